@@ -193,5 +193,13 @@ void loop() {
     return;
   }
   Serial.println(vbus);
-}
 
+  // read the state of both axes in one transaction
+  odrive::Burst burst;
+  success = odrive::read_burst(odrive_num, &burst);
+  if (!success) {
+    Serial.println("error");
+    return;
+  }
+  Serial.println(burst.axes[axis_num].vel_estimate);
+}
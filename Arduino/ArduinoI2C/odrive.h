@@ -9,6 +9,9 @@
 *   - Use endpoint_type_t<PropertyId> to retrieve the underlying type
 *     of a given property.
 *   - Refer to PropertyId for a list of available properties.
+*   - Use read_property_by_path() and write_property_by_path() to access a
+*     property by its path instead. These do not depend on odrive_endpoints.h
+*     matching the firmware.
 *
 * To regenerate the interface definitions, flash an ODrive with
 * the new firmware, connect it to your PC via USB and then run
@@ -164,6 +167,62 @@ namespace odrive {
         return I2C_transaction(i2c_addr + num, i2c_tx_buffer, sizeof(i2c_tx_buffer), nullptr, 0);
     }
 
+    /* @brief Returns the hash by which the ODrive finds an endpoint by its path.
+    * Evaluated at compile time if the path is a string literal.
+    */
+    constexpr uint32_t path_hash_step(uint32_t hash, uint8_t c) {
+        return static_cast<uint32_t>((hash ^ c) * 16777619ul);
+    }
+    constexpr uint32_t path_hash(const char* path, uint32_t hash = path_hash_step(2166136261ul, '.')) {
+        return *path ? path_hash(path + 1, path_hash_step(hash, *path)) : hash;
+    }
+
+    static constexpr const uint16_t hashed_register = 0x7ffb;
+    static constexpr const uint16_t protocol_version = 1;
+
+    /* @brief Read from a property that is addressed by its path.
+    * The type T must match the type of the property on the ODrive.
+    *
+    * Usage example:
+    *   float val;
+    *   success = odrive::read_property_by_path(0, odrive::path_hash("axis0.encoder.pos_estimate"), &val);
+    *
+    * @return true if the I2C transaction succeeded, false otherwise
+    */
+    template<typename T>
+    bool read_property_by_path(uint8_t num, uint32_t hash, T* value) {
+        uint8_t i2c_tx_buffer[8];
+        write_le<uint16_t>(i2c_tx_buffer, hashed_register);
+        write_le<uint32_t>(i2c_tx_buffer + 2, hash);
+        write_le<uint16_t>(i2c_tx_buffer + sizeof(i2c_tx_buffer) - 2, protocol_version);
+        uint8_t i2c_rx_buffer[byte_width<T>::value];
+        if (!I2C_transaction(i2c_addr + num,
+            i2c_tx_buffer, sizeof(i2c_tx_buffer),
+            i2c_rx_buffer, sizeof(i2c_rx_buffer)))
+            return false;
+        if (value)
+            *value = read_le<T>(i2c_rx_buffer);
+        return true;
+    }
+
+    /* @brief Write to a property that is addressed by its path.
+    * The type T must match the type of the property on the ODrive.
+    *
+    * Usage example:
+    *   success = odrive::write_property_by_path<float>(0, odrive::path_hash("axis0.controller.input_pos"), 1.0f);
+    *
+    * @return true if the I2C transaction succeeded, false otherwise
+    */
+    template<typename T>
+    bool write_property_by_path(uint8_t num, uint32_t hash, T value) {
+        uint8_t i2c_tx_buffer[8 + byte_width<T>::value];
+        write_le<uint16_t>(i2c_tx_buffer, hashed_register);
+        write_le<uint32_t>(i2c_tx_buffer + 2, hash);
+        write_le<T>(i2c_tx_buffer + 6, value);
+        write_le<uint16_t>(i2c_tx_buffer + sizeof(i2c_tx_buffer) - 2, protocol_version);
+        return I2C_transaction(i2c_addr + num, i2c_tx_buffer, sizeof(i2c_tx_buffer), nullptr, 0);
+    }
+
     template<int IPropertyId>
     bool read_axis_property(uint8_t num, uint8_t axis, endpoint_type_t<IPropertyId>* value) {
         return read_property<IPropertyId>(num, value, IPropertyId + axis * per_axis_offset);
@@ -175,6 +234,53 @@ namespace odrive {
     }
 
 
+    static constexpr const uint16_t burst_register = 0x7ff0;
+
+    struct AxisBurst {
+        float pos_estimate; // [counts]
+        float vel_estimate; // [counts/s]
+        float Iq_measured; // [A]
+        uint16_t error; // lower 16 bits of axis.error
+        uint8_t current_state;
+        uint8_t sub_errors; // bit 0: motor.error, bit 1: encoder.error, bit 2: sensorless_estimator.error
+    };
+
+    struct Burst {
+        AxisBurst axes[2];
+    };
+
+    /* @brief Reads the state of both axes in a single transaction.
+    * Unlike the other functions this does not depend on odrive_endpoints.h
+    * matching the firmware. The 32 bytes fit into the AVR Wire buffer.
+    *
+    * Usage example:
+    *   odrive::Burst burst;
+    *   success = odrive::read_burst(0, &burst);
+    *
+    * @param num Selects the ODrive. For instance the value 4 selects
+    * the ODrive that has [A2, A1, A0] connected to [VCC, GND, GND].
+    * @return true if the I2C transaction succeeded, false otherwise
+    */
+    bool read_burst(uint8_t num, Burst* burst) {
+        uint8_t i2c_tx_buffer[2];
+        write_le<uint16_t>(i2c_tx_buffer, burst_register);
+        uint8_t i2c_rx_buffer[2 * 16];
+        if (!I2C_transaction(i2c_addr + num,
+            i2c_tx_buffer, sizeof(i2c_tx_buffer),
+            i2c_rx_buffer, sizeof(i2c_rx_buffer)))
+            return false;
+        for (size_t i = 0; i < 2; ++i) {
+            const uint8_t* buf = i2c_rx_buffer + i * 16;
+            burst->axes[i].pos_estimate = read_le<float>(buf);
+            burst->axes[i].vel_estimate = read_le<float>(buf + 4);
+            burst->axes[i].Iq_measured = read_le<float>(buf + 8);
+            burst->axes[i].error = read_le<uint16_t>(buf + 12);
+            burst->axes[i].current_state = buf[14];
+            burst->axes[i].sub_errors = buf[15];
+        }
+        return true;
+    }
+
     /* @brief Checks if the axis is in the requested state and the error register is clear */
     bool check_axis_state(uint8_t num, uint8_t axis, uint8_t state) {
         endpoint_type_t<odrive::AXIS__CURRENT_STATE> observed_state = 0;
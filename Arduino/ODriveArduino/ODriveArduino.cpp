@@ -11,6 +11,41 @@ static const int kMotorStrideBool = 4;
 static const int kMotorOffsetUint16 = 0;
 static const int kMotorStrideUint16 = 2;
 
+// Binary frames, see Firmware/communication/ascii_protocol.cpp
+static const uint8_t kBinaryFrameStart = 0xA5;
+static const uint8_t kBinaryOpPosition = 0x10;
+static const uint8_t kBinaryOpVelocity = 0x20;
+static const uint8_t kBinaryOpCurrent = 0x30;
+static const uint8_t kBinaryOpFeedback = 0x40;
+static const uint8_t kBinaryFlagFeedback = 0x08;
+static const uint16_t kCrc16Polynomial = 0x3d65;
+static const uint16_t kCrc16Init = 0x1337;
+static const size_t kBinaryFeedbackFrameLength = 2 + sizeof(ODriveArduino::Feedback) + 2;
+
+// Asynchronous requests
+enum RequestKind_t {
+    kRequestFloat,
+    kRequestInt,
+    kRequestTextFeedback,
+    kRequestBinaryFeedback,
+    kRequestRunState,
+};
+static const unsigned long kRunStatePollInterval = 100;
+static const unsigned long kRunStateTimeout = 10000;
+
+static bool time_reached(unsigned long now, unsigned long time) {
+    return (long)(now - time) >= 0;
+}
+
+static uint16_t crc16(uint16_t crc, const uint8_t* buffer, size_t length) {
+    while (length--) {
+        crc ^= (uint16_t)*(buffer++) << 8;
+        for (uint8_t bit = 8; bit; --bit)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ kCrc16Polynomial) : (crc << 1);
+    }
+    return crc;
+}
+
 // Print with stream operator
 template<class T> inline Print& operator <<(Print &obj,     T arg) { obj.print(arg);    return obj; }
 template<>        inline Print& operator <<(Print &obj, float arg) { obj.print(arg, 4); return obj; }
@@ -27,6 +62,11 @@ void ODriveArduino::SetPosition(int motor_number, float position, float velocity
 }
 
 void ODriveArduino::SetPosition(int motor_number, float position, float velocity_feedforward, float current_feedforward) {
+    if (binary_) {
+        float args[] = { position, velocity_feedforward, current_feedforward };
+        sendBinary(kBinaryOpPosition | motor_number, args, 3);
+        return;
+    }
     serial_ << "p " << motor_number  << " " << position << " " << velocity_feedforward << " " << current_feedforward << "\n";
 }
 
@@ -35,9 +75,74 @@ void ODriveArduino::SetVelocity(int motor_number, float velocity) {
 }
 
 void ODriveArduino::SetVelocity(int motor_number, float velocity, float current_feedforward) {
+    if (binary_) {
+        float args[] = { velocity, current_feedforward };
+        sendBinary(kBinaryOpVelocity | motor_number, args, 2);
+        return;
+    }
     serial_ << "v " << motor_number  << " " << velocity << " " << current_feedforward << "\n";
 }
 
+void ODriveArduino::SetCurrent(int motor_number, float current) {
+    if (binary_) {
+        sendBinary(kBinaryOpCurrent | motor_number, &current, 1);
+        return;
+    }
+    serial_ << "c " << motor_number << " " << current << "\n";
+}
+
+bool ODriveArduino::ReadFeedback(Feedback& feedback) {
+    sendBinary(kBinaryOpFeedback, nullptr, 0);
+    return readBinaryFeedback(feedback);
+}
+
+bool ODriveArduino::SetPositionWithFeedback(int motor_number, float position, float velocity_feedforward, float current_feedforward, AxisFeedback& feedback) {
+    if (binary_) {
+        Feedback all;
+        float args[] = { position, velocity_feedforward, current_feedforward };
+        sendBinary(kBinaryOpPosition | kBinaryFlagFeedback | motor_number, args, 3);
+        if (!readBinaryFeedback(all))
+            return false;
+        feedback = all.axes[motor_number];
+        return true;
+    }
+    serial_ << "u " << motor_number  << " " << position << " " << velocity_feedforward << " " << current_feedforward << "\n";
+
+    // response: "pos vel Iq"
+    String str = readString();
+    int sep1 = str.indexOf(' ');
+    int sep2 = str.indexOf(' ', sep1 + 1);
+    if (sep1 < 0 || sep2 < 0)
+        return false;
+    feedback.pos_estimate = str.substring(0, sep1).toFloat();
+    feedback.vel_estimate = str.substring(sep1 + 1, sep2).toFloat();
+    feedback.Iq_measured = str.substring(sep2 + 1).toFloat();
+    return true;
+}
+
+bool ODriveArduino::readBinaryFeedback(Feedback& feedback) {
+    // start byte, command byte, payload, CRC16
+    uint8_t frame[2 + sizeof(feedback) + 2];
+    static const unsigned long timeout = 1000;
+    unsigned long timeout_start = millis();
+    size_t idx = 0;
+    while (idx < sizeof(frame)) {
+        if (!serial_.available()) {
+            if (millis() - timeout_start >= timeout)
+                return false;
+            continue;
+        }
+        uint8_t c = serial_.read();
+        if (idx == 0 && c != kBinaryFrameStart)
+            continue; // skip anything before the frame
+        frame[idx++] = c;
+    }
+    if (frame[1] != kBinaryOpFeedback || crc16(kCrc16Init, frame + 1, sizeof(frame) - 1) != 0)
+        return false;
+    memcpy(&feedback, frame + 2, sizeof(feedback));
+    return true;
+}
+
 float ODriveArduino::readFloat() {
     return readString().toFloat();
 }
@@ -59,6 +164,17 @@ bool ODriveArduino::run_state(int axis, int requested_state, bool wait) {
     return timeout_ctr > 0;
 }
 
+void ODriveArduino::sendBinary(uint8_t cmd, const float* args, size_t count) {
+    uint8_t frame[2 + 3 * sizeof(float) + 2] = { kBinaryFrameStart, cmd };
+    size_t len = 2 + count * sizeof(float);
+    if (count)
+        memcpy(frame + 2, args, count * sizeof(float));
+    uint16_t crc = crc16(kCrc16Init, frame + 1, len - 1);
+    frame[len++] = crc >> 8;
+    frame[len++] = crc & 0xff;
+    serial_.write(frame, len);
+}
+
 String ODriveArduino::readString() {
     String str = "";
     static const unsigned long timeout = 1000;
@@ -76,3 +192,234 @@ String ODriveArduino::readString() {
     }
     return str;
 }
+
+bool ODriveArduino::startRequest(Request& request, uint8_t kind, Callback callback, void* context) {
+    if (request.pending() || PendingRequests() >= kMaxPendingRequests)
+        return false;
+    request.status = Request::REQUEST_PENDING;
+    request.kind_ = kind;
+    request.lines_ = 1;
+    request.callback = callback;
+    request.context = context;
+    return true;
+}
+
+void ODriveArduino::pushPending(Request& request) {
+    request.deadline_ = millis() + request_timeout_;
+    pending_[num_pending_++] = &request;
+}
+
+bool ODriveArduino::ReadFloatAsync(const char* property, Request& request, Callback callback, void* context) {
+    if (!startRequest(request, kRequestFloat, callback, context))
+        return false;
+    serial_ << "r " << property << '\n';
+    pushPending(request);
+    return true;
+}
+
+bool ODriveArduino::ReadIntAsync(const char* property, Request& request, Callback callback, void* context) {
+    if (!startRequest(request, kRequestInt, callback, context))
+        return false;
+    serial_ << "r " << property << '\n';
+    pushPending(request);
+    return true;
+}
+
+bool ODriveArduino::ReadFeedbackAsync(Request& request, Callback callback, void* context) {
+    if (!startRequest(request, kRequestBinaryFeedback, callback, context))
+        return false;
+    sendBinary(kBinaryOpFeedback, nullptr, 0);
+    pushPending(request);
+    return true;
+}
+
+bool ODriveArduino::SetPositionWithFeedbackAsync(int motor_number, float position, float velocity_feedforward, float current_feedforward,
+        Request& request, Callback callback, void* context) {
+    if (!startRequest(request, binary_ ? kRequestBinaryFeedback : kRequestTextFeedback, callback, context))
+        return false;
+    if (binary_) {
+        float args[] = { position, velocity_feedforward, current_feedforward };
+        sendBinary(kBinaryOpPosition | kBinaryFlagFeedback | motor_number, args, 3);
+    } else {
+        serial_ << "u " << motor_number  << " " << position << " " << velocity_feedforward << " " << current_feedforward << "\n";
+        request.motor_ = motor_number;
+    }
+    pushPending(request);
+    return true;
+}
+
+bool ODriveArduino::SetPositionsWithFeedbackAsync(const float position[2], const float velocity_feedforward[2], const float current_feedforward[2],
+        Request& request, Callback callback, void* context) {
+    if (!startRequest(request, binary_ ? kRequestBinaryFeedback : kRequestTextFeedback, callback, context))
+        return false;
+    if (binary_) {
+        // only the second frame asks for the feedback of both axes
+        float args0[] = { position[0], velocity_feedforward[0], current_feedforward[0] };
+        float args1[] = { position[1], velocity_feedforward[1], current_feedforward[1] };
+        sendBinary(kBinaryOpPosition | 0, args0, 3);
+        sendBinary(kBinaryOpPosition | kBinaryFlagFeedback | 1, args1, 3);
+    } else {
+        // response: one "pos vel Iq" line per motor
+        serial_ << "u 0 " << position[0] << " " << velocity_feedforward[0] << " " << current_feedforward[0]
+                << " 1 " << position[1] << " " << velocity_feedforward[1] << " " << current_feedforward[1] << "\n";
+        request.motor_ = 0;
+        request.lines_ = 2;
+    }
+    pushPending(request);
+    return true;
+}
+
+bool ODriveArduino::RunStateAsync(int axis, int requested_state, bool wait, Request& request, Callback callback, void* context) {
+    if (!startRequest(request, kRequestRunState, callback, context))
+        return false;
+    serial_ << "w axis" << axis << ".requested_state " << requested_state << '\n';
+    if (!wait) {
+        finishRequest(request, Request::REQUEST_DONE);
+        return true;
+    }
+    request.axis_ = axis;
+    unsigned long now = millis();
+    request.state_deadline_ = now + kRunStateTimeout;
+    request.next_poll_ = now + kRunStatePollInterval;
+    waiting_[num_waiting_++] = &request;
+    return true;
+}
+
+void ODriveArduino::finishRequest(Request& request, Request::Status_t status) {
+    request.status = status;
+    if (request.callback)
+        request.callback(request, request.context);
+}
+
+void ODriveArduino::failPending() {
+    // Remove all requests first, so that callbacks can issue new ones
+    Request* failed[kMaxPendingRequests];
+    size_t num_failed = num_pending_;
+    memcpy(failed, pending_, num_failed * sizeof(Request*));
+    num_pending_ = 0;
+    rx_len_ = 0;
+    for (size_t i = 0; i < num_failed; ++i)
+        finishRequest(*failed[i], Request::REQUEST_TIMEOUT);
+}
+
+bool ODriveArduino::parseFeedbackLine(Request& request, char* line) {
+    // response: "pos vel Iq"
+    AxisFeedback& axis = request.feedback.axes[request.motor_++ & 1];
+    char* end;
+    axis.pos_estimate = strtod(line, &end);
+    if (end == line)
+        return false;
+    axis.vel_estimate = strtod(line = end, &end);
+    if (end == line)
+        return false;
+    axis.Iq_measured = strtod(line = end, &end);
+    return end != line;
+}
+
+void ODriveArduino::onLine(Request& request, char* line) {
+    char* end;
+    switch (request.kind_) {
+        case kRequestFloat:
+            request.value = strtod(line, &end);
+            finishRequest(request, end != line ? Request::REQUEST_DONE : Request::REQUEST_ERROR);
+            break;
+
+        case kRequestInt:
+            request.int_value = strtol(line, &end, 10);
+            finishRequest(request, end != line ? Request::REQUEST_DONE : Request::REQUEST_ERROR);
+            break;
+
+        case kRequestTextFeedback:
+            // the lines before the last one were parsed in Poll()
+            finishRequest(request, request.lines_ == 1 && parseFeedbackLine(request, line)
+                    ? Request::REQUEST_DONE : Request::REQUEST_ERROR);
+            break;
+
+        case kRequestRunState: {
+            request.int_value = strtol(line, &end, 10);
+            unsigned long now = millis();
+            if (end == line) {
+                finishRequest(request, Request::REQUEST_ERROR);
+            } else if (request.int_value == AXIS_STATE_IDLE) {
+                finishRequest(request, Request::REQUEST_DONE);
+            } else if (time_reached(now, request.state_deadline_)) {
+                finishRequest(request, Request::REQUEST_TIMEOUT);
+            } else {
+                request.next_poll_ = now + kRunStatePollInterval;
+                waiting_[num_waiting_++] = &request;
+            }
+        } break;
+
+        default:
+            finishRequest(request, Request::REQUEST_ERROR);
+            break;
+    }
+}
+
+void ODriveArduino::onBinaryFeedback(Request& request) {
+    if (rx_buf_[1] != (char)kBinaryOpFeedback || crc16(kCrc16Init, (const uint8_t*)rx_buf_ + 1, kBinaryFeedbackFrameLength - 1) != 0) {
+        finishRequest(request, Request::REQUEST_ERROR);
+        return;
+    }
+    memcpy(&request.feedback, rx_buf_ + 2, sizeof(request.feedback));
+    finishRequest(request, Request::REQUEST_DONE);
+}
+
+void ODriveArduino::Poll() {
+    unsigned long now = millis();
+
+    // Poll the state of the axes that RunStateAsync waits for
+    for (size_t i = 0; i < num_waiting_; ) {
+        Request& request = *waiting_[i];
+        if (!time_reached(now, request.next_poll_)) {
+            ++i;
+            continue;
+        }
+        waiting_[i] = waiting_[--num_waiting_];
+        serial_ << "r axis" << request.axis_ << ".current_state\n";
+        pushPending(request);
+    }
+
+    while (serial_.available()) {
+        char c = serial_.read();
+        if (!num_pending_)
+            continue; // nothing expected, e.g. an error message
+        Request& request = *pending_[0];
+        bool complete;
+        if (request.kind_ == kRequestBinaryFeedback) {
+            if (rx_len_ == 0 && (uint8_t)c != kBinaryFrameStart)
+                continue; // skip anything before the frame
+            rx_buf_[rx_len_++] = c;
+            complete = rx_len_ == kBinaryFeedbackFrameLength;
+        } else if (c == '\n') {
+            rx_buf_[rx_len_] = 0;
+            complete = true;
+        } else {
+            if (c != '\r' && rx_len_ < sizeof(rx_buf_) - 1)
+                rx_buf_[rx_len_++] = c;
+            complete = false;
+        }
+        if (!complete)
+            continue;
+
+        rx_len_ = 0;
+        if (request.kind_ == kRequestTextFeedback && request.lines_ > 1) {
+            // more lines to come, the request stays at the front
+            if (parseFeedbackLine(request, rx_buf_)) {
+                --request.lines_;
+                continue;
+            }
+            // an error message instead ends the request
+        }
+
+        // Dequeue before completing, so that the callback can issue new requests
+        memmove(pending_, pending_ + 1, --num_pending_ * sizeof(Request*));
+        if (request.kind_ == kRequestBinaryFeedback)
+            onBinaryFeedback(request);
+        else
+            onLine(request, rx_buf_);
+    }
+
+    if (num_pending_ && time_reached(millis(), pending_[0]->deadline_))
+        failPending();
+}
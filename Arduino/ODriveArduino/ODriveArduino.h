@@ -18,14 +18,73 @@ public:
         AXIS_STATE_CLOSED_LOOP_CONTROL = 8  //<! run closed loop control
     };
 
+    struct AxisFeedback {
+        float pos_estimate; // [counts]
+        float vel_estimate; // [counts/s]
+        float Iq_measured;  // [A]
+    };
+    struct Feedback {
+        AxisFeedback axes[2];
+    };
+
+    // Non-blocking request, see the asynchronous API below.
+    // The caller owns the request and must keep it alive until it completed.
+    struct Request;
+    typedef void (*Callback)(Request& request, void* context);
+    struct Request {
+        enum Status_t {
+            REQUEST_IDLE = 0,    //<! never issued
+            REQUEST_PENDING = 1, //<! waiting for the response
+            REQUEST_DONE = 2,    //<! the result is valid
+            REQUEST_TIMEOUT = 3, //<! no response within the request timeout
+            REQUEST_ERROR = 4,   //<! the response could not be parsed
+        };
+
+        Status_t status = REQUEST_IDLE;
+        bool pending() const { return status == REQUEST_PENDING; }
+
+        // Results
+        float value = 0.0f;    // ReadFloatAsync
+        int32_t int_value = 0; // ReadIntAsync, RunStateAsync (last current_state)
+        Feedback feedback;     // ReadFeedbackAsync, Set...WithFeedbackAsync
+
+        // Called from Poll() when the request completed, successfully or not
+        Callback callback = nullptr;
+        void* context = nullptr;
+
+        // Internal
+        uint8_t kind_ = 0;
+        uint8_t motor_ = 0;      // axis of the next feedback line
+        uint8_t lines_ = 0;      // feedback lines still expected
+        uint8_t axis_ = 0;       // RunStateAsync
+        unsigned long deadline_ = 0;       // of the response that is pending
+        unsigned long state_deadline_ = 0; // RunStateAsync gives up waiting for AXIS_STATE_IDLE
+        unsigned long next_poll_ = 0;
+    };
+
+    static const size_t kMaxPendingRequests = 8;
+
     ODriveArduino(Stream& serial);
 
+    // Send the setpoint commands as compact binary frames instead of text.
+    // Requires a firmware with binary ASCII protocol frames.
+    void UseBinaryCommands(bool enable) { binary_ = enable; }
+
     // Commands
     void SetPosition(int motor_number, float position);
     void SetPosition(int motor_number, float position, float velocity_feedforward);
     void SetPosition(int motor_number, float position, float velocity_feedforward, float current_feedforward);
     void SetVelocity(int motor_number, float velocity);
     void SetVelocity(int motor_number, float velocity, float current_feedforward);
+    void SetCurrent(int motor_number, float current);
+
+    // Reads the position, velocity and current of both axes with one binary command.
+    // Returns false on timeout or a corrupted response.
+    bool ReadFeedback(Feedback& feedback);
+
+    // Sets the position and reads back the position, velocity and current of
+    // the same axis in one round trip. Returns false on timeout.
+    bool SetPositionWithFeedback(int motor_number, float position, float velocity_feedforward, float current_feedforward, AxisFeedback& feedback);
 
     // General params
     float readFloat();
@@ -33,10 +92,61 @@ public:
 
     // State helper
     bool run_state(int axis, int requested_state, bool wait);
+
+    // Asynchronous API
+    //
+    // These functions send the command and return immediately. Poll() must
+    // be called from loop() to read the responses without blocking. It
+    // completes the requests in the order they were issued, since the ODrive
+    // responds in order, and calls their callback. Up to kMaxPendingRequests
+    // can be outstanding at a time. The functions return false if the request
+    // is still pending or too many requests are outstanding.
+    // Do not use the blocking read functions while requests are outstanding.
+    bool ReadFloatAsync(const char* property, Request& request, Callback callback = nullptr, void* context = nullptr);
+    bool ReadIntAsync(const char* property, Request& request, Callback callback = nullptr, void* context = nullptr);
+    // Binary feedback command, fills request.feedback for both axes
+    bool ReadFeedbackAsync(Request& request, Callback callback = nullptr, void* context = nullptr);
+    // Fills request.feedback.axes[motor_number], or both axes with binary commands
+    bool SetPositionWithFeedbackAsync(int motor_number, float position, float velocity_feedforward, float current_feedforward,
+            Request& request, Callback callback = nullptr, void* context = nullptr);
+    // Sets the positions of both axes and reads back the feedback of both in one round trip
+    bool SetPositionsWithFeedbackAsync(const float position[2], const float velocity_feedforward[2], const float current_feedforward[2],
+            Request& request, Callback callback = nullptr, void* context = nullptr);
+    // Requests the state. With wait, polls current_state every 100ms and
+    // completes once the axis is back in idle, or times out after 10s.
+    bool RunStateAsync(int axis, int requested_state, bool wait, Request& request, Callback callback = nullptr, void* context = nullptr);
+
+    // Reads the available responses and completes requests. Never blocks.
+    void Poll();
+    size_t PendingRequests() const { return num_pending_ + num_waiting_; }
+    // If the oldest outstanding request gets no response within this time,
+    // all outstanding requests fail, since later responses could not be
+    // matched to their requests anymore.
+    void SetRequestTimeout(unsigned long timeout_ms) { request_timeout_ = timeout_ms; }
+
 private:
     String readString();
+    void sendBinary(uint8_t cmd, const float* args, size_t count);
+    bool readBinaryFeedback(Feedback& feedback);
+
+    bool startRequest(Request& request, uint8_t kind, Callback callback, void* context);
+    void pushPending(Request& request);
+    void finishRequest(Request& request, Request::Status_t status);
+    bool parseFeedbackLine(Request& request, char* line);
+    void onLine(Request& request, char* line);
+    void onBinaryFeedback(Request& request);
+    void failPending();
 
     Stream& serial_;
+    bool binary_ = false;
+
+    Request* pending_[kMaxPendingRequests]; // waiting for a response, oldest first
+    size_t num_pending_ = 0;
+    Request* waiting_[kMaxPendingRequests]; // RunStateAsync between two polls
+    size_t num_waiting_ = 0;
+    unsigned long request_timeout_ = 1000;
+    char rx_buf_[64];
+    size_t rx_len_ = 0;
 };
 
 #endif //ODriveArduino_h
@@ -37,6 +37,15 @@ void setup() {
   Serial.println("Send the character 's' to exectue test move");
   Serial.println("Send the character 'b' to read bus voltage");
   Serial.println("Send the character 'p' to read motor positions in a 10s loop");
+  Serial.println("Send the character 'f' to read the feedback of both motors with a binary command");
+  Serial.println("Send the character 'a' to run a 10s sine move with the non-blocking API");
+}
+
+// Completion callback of the asynchronous position and feedback request
+void onFeedback(ODriveArduino::Request& request, void* context) {
+  unsigned long* num_updates = (unsigned long*)context;
+  if (request.status == ODriveArduino::Request::REQUEST_DONE)
+    ++*num_updates;
 }
 
 void loop() {
@@ -92,5 +101,43 @@ void loop() {
         Serial << '\n';
       }
     }
+
+    // read position, velocity and current of both motors in one binary command
+    if (c == 'f') {
+      ODriveArduino::Feedback feedback;
+      if (odrive.ReadFeedback(feedback)) {
+        for (int motor = 0; motor < 2; ++motor) {
+          Serial << feedback.axes[motor].pos_estimate << '\t'
+                 << feedback.axes[motor].vel_estimate << '\t'
+                 << feedback.axes[motor].Iq_measured << '\t';
+        }
+        Serial << '\n';
+      } else {
+        Serial.println("no feedback");
+      }
+    }
+
+    // Sine move on both motors: the next update is sent as soon as the
+    // feedback of the previous one arrived, without blocking the loop
+    if (c == 'a') {
+      static ODriveArduino::Request request;
+      unsigned long num_updates = 0;
+      float vel_ff[2] = { 0.0f, 0.0f };
+      float current_ff[2] = { 0.0f, 0.0f };
+      static const unsigned long duration = 10000;
+      unsigned long start = millis();
+      while (millis() - start < duration) {
+        odrive.Poll();
+        if (!request.pending()) {
+          float ph = 6.28318530718f * (millis() - start) / 2000.0f;
+          float pos[2] = { 20000.0f * cos(ph), 20000.0f * sin(ph) };
+          odrive.SetPositionsWithFeedbackAsync(pos, vel_ff, current_ff, request, onFeedback, &num_updates);
+        }
+        // ... the rest of the control loop keeps running here
+      }
+      while (request.pending())
+        odrive.Poll();
+      Serial << "Updates per second: " << num_updates / (duration / 1000) << '\n';
+    }
   }
 }
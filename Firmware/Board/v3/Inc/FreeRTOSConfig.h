@@ -91,10 +91,19 @@
     #include <stdint.h>
     #include "main.h" 
     extern uint32_t SystemCoreClock;
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /* Run time stats clock, see cpu_load.cpp */
+    void configure_run_time_counter(void);
+    uint32_t get_run_time_counter(void);
+#ifdef __cplusplus
+}
+#endif
 #endif
 
 #define configUSE_PREEMPTION                     1
-#define configSUPPORT_STATIC_ALLOCATION          0
+#define configSUPPORT_STATIC_ALLOCATION          1
 #define configSUPPORT_DYNAMIC_ALLOCATION         1
 #define configUSE_IDLE_HOOK                      1
 #define configUSE_TICK_HOOK                      0
@@ -102,12 +111,16 @@
 #define configTICK_RATE_HZ                       ((TickType_t)1000)
 #define configMAX_PRIORITIES                     ( 7 )
 #define configMINIMAL_STACK_SIZE                 ((uint16_t)128)
-#define configTOTAL_HEAP_SIZE                    ((size_t)65536)
+#define configTOTAL_HEAP_SIZE                    ((size_t)4096) /* all threads and semaphores are static, see freertos_vars.h */
 #define configMAX_TASK_NAME_LEN                  ( 16 )
 #define configUSE_16_BIT_TICKS                   0
 #define configUSE_MUTEXES                        1
 #define configQUEUE_REGISTRY_SIZE                8
 #define configCHECK_FOR_STACK_OVERFLOW           1
+#define configUSE_TRACE_FACILITY                 1
+#define configGENERATE_RUN_TIME_STATS            1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS() configure_run_time_counter()
+#define portGET_RUN_TIME_COUNTER_VALUE()         get_run_time_counter()
 #define configUSE_PORT_OPTIMISED_TASK_SELECTION  1
 
 /* Co-routine definitions. */
@@ -125,6 +138,7 @@ to exclude the API function. */
 #define INCLUDE_vTaskDelay                  1
 #define INCLUDE_xTaskGetSchedulerState      1
 #define INCLUDE_uxTaskGetStackHighWaterMark 1
+#define INCLUDE_xTaskGetIdleTaskHandle      1
 
 /* Cortex-M specific definitions. */
 #ifdef __NVIC_PRIO_BITS
@@ -2,13 +2,34 @@
 #ifndef __FREERTOS_H
 #define __FREERTOS_H
 
+#include "priorities.h"
+
 // List of semaphores
 extern osSemaphoreId sem_usb_irq;
 extern osSemaphoreId sem_uart_dma;
+extern osSemaphoreId sem_uart_rx;
 extern osSemaphoreId sem_usb_rx;
-extern osSemaphoreId sem_usb_tx;
+extern osSemaphoreId sem_usb_rx_cdc;
+extern osSemaphoreId sem_usb_tx_cdc;
+extern osSemaphoreId sem_usb_tx_native;
 
 extern osThreadId defaultTaskHandle;
 extern osThreadId usb_irq_thread;
 
+// Stack sizes of the threads [32-bit words]. All stacks and control blocks
+// are statically allocated. When changing a size, check the headroom in
+// system_stats.min_stack_space_*.
+#define STACK_SIZE_DEFAULT_TASK     256
+#define STACK_SIZE_USB_IRQ          512
+#define STACK_SIZE_USB_SERVER       512
+#define STACK_SIZE_USB_CDC_SERVER   1024 // the ascii protocol needs considerable stack space
+#define STACK_SIZE_UART_SERVER      1024 // the ascii protocol needs considerable stack space
+#define STACK_SIZE_COMMUNICATION    5000 // TODO: fix stack issues (make_obj_tree uses the copy-constructor)
+#define STACK_SIZE_AXIS             2048 // per axis
+#define STACK_SIZE_LOG              256
+#define STACK_SIZE_IDLE             configMINIMAL_STACK_SIZE
+#define STACK_SIZE_TOTAL (STACK_SIZE_DEFAULT_TASK + STACK_SIZE_USB_IRQ + STACK_SIZE_USB_SERVER \
+        + STACK_SIZE_USB_CDC_SERVER + STACK_SIZE_UART_SERVER + STACK_SIZE_COMMUNICATION + AXIS_COUNT * STACK_SIZE_AXIS + STACK_SIZE_LOG \
+        + STACK_SIZE_IDLE)
+
 #endif /* __FREERTOS_H */
\ No newline at end of file
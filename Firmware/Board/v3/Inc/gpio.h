@@ -74,8 +74,12 @@ void SetGPIO12toUART();
 bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     uint32_t pull_up_down,
     void (*callback)(void*), void* ctx);
+bool GPIO_subscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    void (*callback)(void*), void* ctx);
+void GPIO_set_edge_interrupt_enabled(uint16_t GPIO_pin, bool enabled);
 void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
 void GPIO_set_to_analog(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
+void GPIO_EXTI_dispatch(uint32_t lines);
 
 uint16_t get_gpio_pin_by_pin(uint16_t GPIO_pin);
 GPIO_TypeDef* get_gpio_port_by_pin(uint16_t GPIO_pin);
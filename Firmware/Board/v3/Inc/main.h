@@ -181,6 +181,13 @@
 #error "unknown board voltage"
 #endif
 
+// ADC1 channel of VBUS_S in the general purpose ADC scan
+#if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR <= 2
+#define VBUS_S_ADC_CHANNEL 0
+#else
+#define VBUS_S_ADC_CHANNEL 6
+#endif
+
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -0,0 +1,65 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __PRIORITIES_H
+#define __PRIORITIES_H
+
+#include "cmsis_os.h"
+
+/*
+ * Interrupt priorities of the whole firmware. A lower number is a higher
+ * priority. The firmware uses priority group 4 (no subpriorities).
+ *
+ * Interrupts above configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY (5) are never
+ * masked by FreeRTOS, but they must not call any FreeRTOS API. The current
+ * measurement wakes the axis threads, so it is at 5, the highest level that
+ * may do so. Everything that does more than a few hundred cycles of work
+ * comes after it, so that no communication burst can delay the current loop:
+ *
+ *  0  PWM timers and GPIO edges: latch the GPIO samples, start the SPI
+ *     encoder reads, count steps and timestamp encoder/hall edges. These
+ *     are kept above the current measurement because they only take a few
+ *     hundred cycles and would otherwise lose step pulses or get late
+ *     timestamps while the current loop runs.
+ *  4  SPI encoder DMA: the position must arrive before the current measurement.
+ *  5  Current measurement (ADC): runs the current loop and wakes the axis threads.
+ *  6  PWM input capture.
+ *  7  USB and CAN.
+ *  8  UART and I2C.
+ *
+ * The gate driver fault output has no interrupt. It is polled in every
+ * control cycle (see Motor::do_checks).
+ * The readback of the actual NVIC settings is in odrv.system_stats.priorities.
+ *
+ * Critical sections only mask the interrupts that share their data, with
+ * cpu_enter_masked_critical() at the most urgent of them. This way the
+ * communication code never holds off the current measurement. The safety
+ * critical PWM functions and the edge timestamps, which are shared with
+ * priority 0, disable all interrupts instead.
+ */
+#define IRQ_PRIO_PWM_TIMER      0
+#define IRQ_PRIO_GPIO           0
+#define IRQ_PRIO_ENCODER_SPI    4
+#define IRQ_PRIO_CURRENT_SENSE  5
+#define IRQ_PRIO_PWM_INPUT      6
+#define IRQ_PRIO_USB            7
+#define IRQ_PRIO_CAN            7
+#define IRQ_PRIO_UART           8   // UART4 and its DMA streams
+#define IRQ_PRIO_I2C            8
+
+/*
+ * Thread priorities. The axis threads run the control loop at the current
+ * measurement rate, everything else runs when they are waiting.
+ * The USB IRQ thread handles what OTG_FS_IRQHandler defers, so it comes
+ * before the protocol threads. The ASCII protocol on the USB CDC interface
+ * has its own thread below the native protocol.
+ */
+#define THREAD_PRIO_AXIS0       ((osPriority)(osPriorityHigh + (osPriority)1))
+#define THREAD_PRIO_AXIS1       osPriorityHigh
+#define THREAD_PRIO_USB_IRQ     osPriorityAboveNormal
+#define THREAD_PRIO_COMMS       osPriorityNormal
+#define THREAD_PRIO_USB         osPriorityNormal
+#define THREAD_PRIO_USB_CDC     osPriorityBelowNormal // ASCII console, must not delay the native protocol
+#define THREAD_PRIO_UART        osPriorityNormal
+#define THREAD_PRIO_STARTUP     osPriorityNormal
+#define THREAD_PRIO_LOG         osPriorityLow // drains printf output
+
+#endif /* __PRIORITIES_H */
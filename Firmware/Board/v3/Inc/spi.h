@@ -64,7 +64,8 @@
 extern SPI_HandleTypeDef hspi3;
 
 /* USER CODE BEGIN Private defines */
-
+extern DMA_HandleTypeDef hdma_spi3_rx;
+extern DMA_HandleTypeDef hdma_spi3_tx;
 /* USER CODE END Private defines */
 
 extern void _Error_Handler(char *, int);
@@ -72,7 +73,7 @@ extern void _Error_Handler(char *, int);
 void MX_SPI3_Init(void);
 
 /* USER CODE BEGIN Prototypes */
-
+void MX_SPI3_DMA_Init(void);
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
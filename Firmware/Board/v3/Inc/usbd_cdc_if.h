@@ -82,6 +82,10 @@
 #define USB_TX_DATA_SIZE  64
 #define APP_RX_DATA_SIZE  USB_RX_DATA_SIZE
 #define APP_TX_DATA_SIZE  USB_TX_DATA_SIZE
+/* Largest transfer on the native endpoint. Transfers of more than one USB
+   packet are terminated by a short or zero length packet. Must not be smaller
+   than MAX_PACKET_SIZE in fibre/protocol.hpp. */
+#define USB_NATIVE_TX_DATA_SIZE  512
 /* USER CODE END EXPORTED_DEFINES */
 
 /**
@@ -120,6 +120,8 @@ static uint8_t  USBD_CDC_DataIn (USBD_HandleTypeDef *pdev,
 static uint8_t  USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, 
                                  uint8_t epnum);
 
+static uint8_t  USBD_CDC_SOF (USBD_HandleTypeDef *pdev);
+
 static uint8_t  USBD_CDC_EP0_RxReady (USBD_HandleTypeDef *pdev);
 
 static uint8_t  *USBD_CDC_GetFSCfgDesc (uint16_t *length);
@@ -169,7 +171,7 @@ USBD_ClassTypeDef  USBD_CDC =
   USBD_CDC_EP0_RxReady,
   USBD_CDC_DataIn,
   USBD_CDC_DataOut,
-  NULL,
+  USBD_CDC_SOF,
   NULL,
   NULL,     
   USBD_CDC_GetHSCfgDesc,  
@@ -571,12 +573,21 @@ static uint8_t  USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
   if(pdev->pClassData != NULL)
   {
     // NOTE: We would logically expect xx_IN_EP here, but we actually get the xx_OUT_EP
-    if (epnum == CDC_OUT_EP)
+    if (epnum == CDC_OUT_EP) {
       hcdc->CDC_Tx.State = 0;
-    if (epnum == ODRIVE_OUT_EP)
+      osSemaphoreRelease(sem_usb_tx_cdc);
+    }
+    if (epnum == ODRIVE_OUT_EP) {
+      // A transfer that fills its last packet completely needs a zero length
+      // packet, so that the host sees where it ends
+      if (hcdc->ODRIVE_Tx.Length && (hcdc->ODRIVE_Tx.Length % CDC_DATA_FS_MAX_PACKET_SIZE) == 0) {
+        hcdc->ODRIVE_Tx.Length = 0;
+        USBD_LL_Transmit(pdev, ODRIVE_IN_EP, NULL, 0);
+        return USBD_OK;
+      }
       hcdc->ODRIVE_Tx.State = 0;
-    //Note: We could use independent semaphores for simoultainous USB transmission.
-    osSemaphoreRelease(sem_usb_tx);
+      osSemaphoreRelease(sem_usb_tx_native);
+    }
     return USBD_OK;
   }
   else
@@ -624,6 +635,21 @@ static uint8_t  USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 
 
 
+/**
+  * @brief  USBD_CDC_SOF
+  *         Start of a USB frame (every 1 ms)
+  * @param  pdev: device instance
+  * @retval status
+  */
+static uint8_t  USBD_CDC_SOF (USBD_HandleTypeDef *pdev)
+{
+  if((pdev->pClassData != NULL) && (((USBD_CDC_ItfTypeDef *)pdev->pUserData)->StartOfFrame != NULL))
+  {
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserData)->StartOfFrame();
+  }
+  return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_DataOut
   *         Data received on non-control Out endpoint
@@ -51,6 +51,7 @@
 #include "can.h"
 
 #include "gpio.h"
+#include "priorities.h"
 
 /* USER CODE BEGIN 0 */
 
@@ -105,13 +106,13 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef* canHandle)
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
     /* CAN1 interrupt Init */
-    HAL_NVIC_SetPriority(CAN1_TX_IRQn, 6, 0);
+    HAL_NVIC_SetPriority(CAN1_TX_IRQn, IRQ_PRIO_CAN, 0);
     HAL_NVIC_EnableIRQ(CAN1_TX_IRQn);
-    HAL_NVIC_SetPriority(CAN1_RX0_IRQn, 6, 0);
+    HAL_NVIC_SetPriority(CAN1_RX0_IRQn, IRQ_PRIO_CAN, 0);
     HAL_NVIC_EnableIRQ(CAN1_RX0_IRQn);
-    HAL_NVIC_SetPriority(CAN1_RX1_IRQn, 6, 0);
+    HAL_NVIC_SetPriority(CAN1_RX1_IRQn, IRQ_PRIO_CAN, 0);
     HAL_NVIC_EnableIRQ(CAN1_RX1_IRQn);
-    HAL_NVIC_SetPriority(CAN1_SCE_IRQn, 6, 0);
+    HAL_NVIC_SetPriority(CAN1_SCE_IRQn, IRQ_PRIO_CAN, 0);
     HAL_NVIC_EnableIRQ(CAN1_SCE_IRQn);
   /* USER CODE BEGIN CAN1_MspInit 1 */
 
@@ -65,14 +65,33 @@ osThreadId defaultTaskHandle;
 // List of semaphores
 osSemaphoreId sem_usb_irq;
 osSemaphoreId sem_uart_dma;
+osSemaphoreId sem_uart_rx;
 osSemaphoreId sem_usb_rx;
-osSemaphoreId sem_usb_tx;
+osSemaphoreId sem_usb_rx_cdc;
+osSemaphoreId sem_usb_tx_cdc;
+osSemaphoreId sem_usb_tx_native;
 
 osThreadId usb_irq_thread;
 
-// Place FreeRTOS heap in core coupled memory for better performance
+// Place FreeRTOS heap in core coupled memory for better performance.
+// It is only a fallback, the threads and semaphores below are static.
 __attribute__((section(".ccmram")))
 uint8_t ucHeap[configTOTAL_HEAP_SIZE];
+
+static uint32_t default_task_stack[STACK_SIZE_DEFAULT_TASK];
+static osStaticThreadDef_t default_task_tcb;
+static uint32_t usb_irq_thread_stack[STACK_SIZE_USB_IRQ];
+static osStaticThreadDef_t usb_irq_thread_tcb;
+static StackType_t idle_task_stack[STACK_SIZE_IDLE];
+static StaticTask_t idle_task_tcb;
+
+static osStaticSemaphoreDef_t sem_usb_irq_cb;
+static osStaticSemaphoreDef_t sem_uart_dma_cb;
+static osStaticSemaphoreDef_t sem_uart_rx_cb;
+static osStaticSemaphoreDef_t sem_usb_rx_cb;
+static osStaticSemaphoreDef_t sem_usb_rx_cdc_cb;
+static osStaticSemaphoreDef_t sem_usb_tx_cdc_cb;
+static osStaticSemaphoreDef_t sem_usb_tx_native_cb;
 /* USER CODE END Variables */
 
 /* Function prototypes -------------------------------------------------------*/
@@ -86,10 +105,19 @@ void MX_FREERTOS_Init(void); /* (MISRA C 2004 rule 8.1) */
 /* USER CODE END FunctionPrototypes */
 
 /* Hook prototypes */
+void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer, StackType_t **ppxIdleTaskStackBuffer, uint32_t *pulIdleTaskStackSize);
 void vApplicationIdleHook(void);
 void vApplicationStackOverflowHook(xTaskHandle xTask, signed char *pcTaskName);
 
 /* USER CODE BEGIN 2 */
+// Required by configSUPPORT_STATIC_ALLOCATION
+void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer, StackType_t **ppxIdleTaskStackBuffer, uint32_t *pulIdleTaskStackSize)
+{
+    *ppxIdleTaskTCBBuffer = &idle_task_tcb;
+    *ppxIdleTaskStackBuffer = idle_task_stack;
+    *pulIdleTaskStackSize = STACK_SIZE_IDLE;
+}
+
 __weak void vApplicationIdleHook( void )
 {
    /* vApplicationIdleHook() will only be called if configUSE_IDLE_HOOK is set
@@ -129,7 +157,8 @@ void usb_deferred_interrupt_thread(void * ctx) {
 
 void init_deferred_interrupts(void) {
     // Start USB interrupt handler thread
-    osThreadDef(task_usb_pump, usb_deferred_interrupt_thread, osPriorityAboveNormal, 0, 512);
+    osThreadStaticDef(task_usb_pump, usb_deferred_interrupt_thread, THREAD_PRIO_USB_IRQ, 0, STACK_SIZE_USB_IRQ,
+            usb_irq_thread_stack, &usb_irq_thread_tcb);
     usb_irq_thread = osThreadCreate(osThread(task_usb_pump), NULL);
 }
 
@@ -147,23 +176,36 @@ void MX_FREERTOS_Init(void) {
   /* USER CODE END RTOS_MUTEX */
 
   /* USER CODE BEGIN RTOS_SEMAPHORES */
-  // Init usb irq binary semaphore, and start with no tokens by removing the starting one.
-  osSemaphoreDef(sem_usb_irq);
+  // Unlike the dynamically allocated ones, static binary semaphores start
+  // without a token, so the ones that start available get it explicitly.
+
+  // Init usb irq binary semaphore, and start with no tokens.
+  osSemaphoreStaticDef(sem_usb_irq, &sem_usb_irq_cb);
   sem_usb_irq = osSemaphoreCreate(osSemaphore(sem_usb_irq), 1);
-  osSemaphoreWait(sem_usb_irq, 0);
 
-  // Create a semaphore for UART DMA and remove a token
-  osSemaphoreDef(sem_uart_dma);
+  // Create a semaphore for UART DMA, it starts available
+  osSemaphoreStaticDef(sem_uart_dma, &sem_uart_dma_cb);
   sem_uart_dma = osSemaphoreCreate(osSemaphore(sem_uart_dma), 1);
+  osSemaphoreRelease(sem_uart_dma);
+
+  // Create a semaphore for UART RX
+  osSemaphoreStaticDef(sem_uart_rx, &sem_uart_rx_cb);
+  sem_uart_rx = osSemaphoreCreate(osSemaphore(sem_uart_rx), 1);
 
-  // Create a semaphore for USB RX
-  osSemaphoreDef(sem_usb_rx);
+  // Create a semaphore for USB RX, and one for the ASCII protocol on the CDC
+  // interface, which has its own thread
+  osSemaphoreStaticDef(sem_usb_rx, &sem_usb_rx_cb);
   sem_usb_rx = osSemaphoreCreate(osSemaphore(sem_usb_rx), 1);
-  osSemaphoreWait(sem_usb_rx, 0);  // Remove a token.
+  osSemaphoreStaticDef(sem_usb_rx_cdc, &sem_usb_rx_cdc_cb);
+  sem_usb_rx_cdc = osSemaphoreCreate(osSemaphore(sem_usb_rx_cdc), 1);
 
-  // Create a semaphore for USB TX
-  osSemaphoreDef(sem_usb_tx);
-  sem_usb_tx = osSemaphoreCreate(osSemaphore(sem_usb_tx), 1);
+  // Create one semaphore for USB TX per endpoint pair, so that they can transmit concurrently
+  osSemaphoreStaticDef(sem_usb_tx_cdc, &sem_usb_tx_cdc_cb);
+  sem_usb_tx_cdc = osSemaphoreCreate(osSemaphore(sem_usb_tx_cdc), 1);
+  osSemaphoreRelease(sem_usb_tx_cdc);
+  osSemaphoreStaticDef(sem_usb_tx_native, &sem_usb_tx_native_cb);
+  sem_usb_tx_native = osSemaphoreCreate(osSemaphore(sem_usb_tx_native), 1);
+  osSemaphoreRelease(sem_usb_tx_native);
 
   init_deferred_interrupts();
   /* USER CODE END RTOS_SEMAPHORES */
@@ -174,7 +216,8 @@ void MX_FREERTOS_Init(void) {
 
   /* Create the thread(s) */
   /* definition and creation of defaultTask */
-  osThreadDef(defaultTask, StartDefaultTask, osPriorityNormal, 0, 256);
+  osThreadStaticDef(defaultTask, StartDefaultTask, THREAD_PRIO_STARTUP, 0, STACK_SIZE_DEFAULT_TASK,
+          default_task_stack, &default_task_tcb);
   defaultTaskHandle = osThreadCreate(osThread(defaultTask), NULL);
 
   /* USER CODE BEGIN RTOS_THREADS */
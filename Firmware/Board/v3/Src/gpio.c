@@ -51,6 +51,7 @@
 #include "gpio.h"
 /* USER CODE BEGIN 0 */
 #include <stdbool.h>
+#include "priorities.h"
 
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR == 1 \
 ||  HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR == 2
@@ -191,7 +192,7 @@ void SetGPIO12toUART() {
   HAL_GPIO_Init(GPIO_2_GPIO_Port, &GPIO_InitStruct);
 }
 
-// Expected subscriptions: 2x step signal + 2x encoder index signal
+// Expected subscriptions: 2x step signal + 2x encoder index signal + 2x encoder edge timing
 #define MAX_SUBSCRIPTIONS 10
 struct subscription_t {
   GPIO_TypeDef* GPIO_port;
@@ -201,14 +202,27 @@ struct subscription_t {
 } subscriptions[MAX_SUBSCRIPTIONS] = { 0 };
 size_t n_subscriptions = 0;
 
-// Sets up the specified GPIO to trigger the specified callback
-// on a rising edge of the GPIO.
-// @param pull_up_down: one of GPIO_NOPULL, GPIO_PULLUP or GPIO_PULLDOWN
-bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
-    uint32_t pull_up_down,
+// Subscriber of each EXTI line, indexed by pin number, so that the interrupt
+// runs it without searching the subscriptions. A line can only be routed to
+// one port, so the newest subscription to a pin number gets the line.
+struct exti_handler_t {
+  void (*callback)(void*);
+  void* ctx;
+} exti_handlers[16] = { 0 };
+
+static void set_exti_handler(uint16_t GPIO_pin, void (*callback)(void*), void* ctx) {
+  struct exti_handler_t* handler = &exti_handlers[__builtin_ctz(GPIO_pin)];
+  // The interrupt must not see the callback of one subscription with the ctx of another
+  uint32_t prim = __get_PRIMASK();
+  __disable_irq();
+  handler->callback = callback;
+  handler->ctx = ctx;
+  __set_PRIMASK(prim);
+}
+
+// Registers a handler (or reuses an existing registration)
+static bool register_subscription(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     void (*callback)(void*), void* ctx) {
-  
-  // Register handler (or reuse existing registration)
   // TODO: make thread safe
   struct subscription_t* subscription = NULL;
   for (size_t i = 0; i < n_subscriptions; ++i) {
@@ -228,6 +242,19 @@ bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     .callback = callback,
     .ctx = ctx
   };
+  set_exti_handler(GPIO_pin, callback, ctx);
+  return true;
+}
+
+// Sets up the specified GPIO to trigger the specified callback
+// on a rising edge of the GPIO.
+// @param pull_up_down: one of GPIO_NOPULL, GPIO_PULLUP or GPIO_PULLDOWN
+bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    uint32_t pull_up_down,
+    void (*callback)(void*), void* ctx) {
+  
+  if (!register_subscription(GPIO_port, GPIO_pin, callback, ctx))
+    return false;
 
   // Set up GPIO
   GPIO_InitTypeDef GPIO_InitStruct;
@@ -237,13 +264,56 @@ bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
   HAL_GPIO_Init(GPIO_port, &GPIO_InitStruct);
 
   // Enable interrupt
-  HAL_NVIC_SetPriority(get_irq_number(GPIO_pin), 0, 0);
+  HAL_NVIC_SetPriority(get_irq_number(GPIO_pin), IRQ_PRIO_GPIO, 0);
+  HAL_NVIC_EnableIRQ(get_irq_number(GPIO_pin));
+  return true;
+}
+
+// Sets up the specified GPIO to trigger the specified callback on both
+// edges, without changing the pin configuration. The EXTI input also works
+// in alternate function mode, so this can be used on timer input pins.
+// The edge interrupt starts out masked, see GPIO_set_edge_interrupt_enabled.
+bool GPIO_subscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    void (*callback)(void*), void* ctx) {
+
+  if (!register_subscription(GPIO_port, GPIO_pin, callback, ctx))
+    return false;
+
+  uint32_t position = 0;
+  while (!(GPIO_pin & (1U << position)))
+    position++;
+
+  // Route the EXTI line to this port
+  __HAL_RCC_SYSCFG_CLK_ENABLE();
+  uint32_t exticr = SYSCFG->EXTICR[position >> 2];
+  exticr &= ~(0x0FU << (4U * (position & 0x03U)));
+  exticr |= GPIO_GET_INDEX(GPIO_port) << (4U * (position & 0x03U));
+  SYSCFG->EXTICR[position >> 2] = exticr;
+
+  EXTI->IMR &= ~(uint32_t)GPIO_pin;
+  EXTI->EMR &= ~(uint32_t)GPIO_pin;
+  EXTI->RTSR |= GPIO_pin;
+  EXTI->FTSR |= GPIO_pin;
+
+  // Enable interrupt
+  HAL_NVIC_SetPriority(get_irq_number(GPIO_pin), IRQ_PRIO_GPIO, 0);
   HAL_NVIC_EnableIRQ(get_irq_number(GPIO_pin));
   return true;
 }
 
+// Masks or unmasks the EXTI line of a pin set up by GPIO_subscribe_edges.
+void GPIO_set_edge_interrupt_enabled(uint16_t GPIO_pin, bool enabled) {
+  if (enabled) {
+    EXTI->PR = GPIO_pin; // drop edges that happened while masked
+    EXTI->IMR |= GPIO_pin;
+  } else {
+    EXTI->IMR &= ~(uint32_t)GPIO_pin;
+  }
+}
+
 void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
   bool is_pin_in_use = false;
+  set_exti_handler(GPIO_pin, NULL, NULL);
   for (size_t i = 0; i < n_subscriptions; ++i) {
     if (subscriptions[i].GPIO_port == GPIO_port &&
         subscriptions[i].GPIO_pin == GPIO_pin) {
@@ -251,6 +321,9 @@ void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
       subscriptions[i].ctx = NULL;
     } else if (subscriptions[i].GPIO_pin == GPIO_pin) {
       is_pin_in_use = true;
+      // Hand the line to the remaining subscription of this pin number
+      if (subscriptions[i].callback)
+        set_exti_handler(GPIO_pin, subscriptions[i].callback, subscriptions[i].ctx);
     }
   }
   if (!is_pin_in_use)
@@ -268,12 +341,17 @@ void GPIO_set_to_analog(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
   HAL_GPIO_Init(GPIO_port, &GPIO_InitStruct);
 }
 
-//Dispatch processing of external interrupts based on source
-void HAL_GPIO_EXTI_Callback(uint16_t GPIO_pin) {
-  for (size_t i = 0; i < n_subscriptions; ++i) {
-    if (subscriptions[i].GPIO_pin == GPIO_pin) // TODO: check for port
-      if (subscriptions[i].callback)
-        subscriptions[i].callback(subscriptions[i].ctx);
+// @brief Clears the pending EXTI lines among the given ones and runs their
+// subscribers. Called from the EXTI interrupt handlers.
+// Masked lines are left alone, GPIO_set_edge_interrupt_enabled drops their edges.
+void GPIO_EXTI_dispatch(uint32_t lines) {
+  uint32_t pending = EXTI->PR & EXTI->IMR & lines;
+  EXTI->PR = pending;
+  while (pending) {
+    const struct exti_handler_t* handler = &exti_handlers[__builtin_ctz(pending)];
+    pending &= pending - 1;
+    if (handler->callback)
+      handler->callback(handler->ctx);
   }
 }
 
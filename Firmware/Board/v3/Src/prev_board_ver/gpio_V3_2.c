@@ -77,10 +77,10 @@ void MX_GPIO_Init(void)
   HAL_GPIO_Init(M1_ENC_Z_GPIO_Port, &GPIO_InitStruct);
 
   /* EXTI interrupt init*/
-  HAL_NVIC_SetPriority(EXTI2_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI2_IRQn, IRQ_PRIO_GPIO, 0);
   HAL_NVIC_EnableIRQ(EXTI2_IRQn);
 
-  HAL_NVIC_SetPriority(EXTI4_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI4_IRQn, IRQ_PRIO_GPIO, 0);
   HAL_NVIC_EnableIRQ(EXTI4_IRQn);
 
 }
\ No newline at end of file
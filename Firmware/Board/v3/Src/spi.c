@@ -51,6 +51,7 @@
 #include "spi.h"
 
 #include "gpio.h"
+#include "priorities.h"
 
 /* USER CODE BEGIN 0 */
 
@@ -137,6 +138,59 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* spiHandle)
 
 /* USER CODE BEGIN 1 */
 
+DMA_HandleTypeDef hdma_spi3_rx;
+DMA_HandleTypeDef hdma_spi3_tx;
+
+/* SPI3 DMA init function
+ * This is not done in HAL_SPI_MspInit because the RX stream (DMA1 stream 0)
+ * is shared with I2C1 RX. It must only be called if I2C1 is not in use.
+ */
+void MX_SPI3_DMA_Init(void)
+{
+  /* SPI3_RX Init */
+  hdma_spi3_rx.Instance = DMA1_Stream0;
+  hdma_spi3_rx.Init.Channel = DMA_CHANNEL_0;
+  hdma_spi3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  hdma_spi3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi3_rx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  hdma_spi3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  hdma_spi3_rx.Init.Mode = DMA_NORMAL;
+  hdma_spi3_rx.Init.Priority = DMA_PRIORITY_HIGH;
+  hdma_spi3_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  if (HAL_DMA_Init(&hdma_spi3_rx) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  __HAL_LINKDMA(&hspi3,hdmarx,hdma_spi3_rx);
+
+  /* SPI3_TX Init */
+  hdma_spi3_tx.Instance = DMA1_Stream5;
+  hdma_spi3_tx.Init.Channel = DMA_CHANNEL_0;
+  hdma_spi3_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_spi3_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi3_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi3_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  hdma_spi3_tx.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  hdma_spi3_tx.Init.Mode = DMA_NORMAL;
+  hdma_spi3_tx.Init.Priority = DMA_PRIORITY_HIGH;
+  hdma_spi3_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  if (HAL_DMA_Init(&hdma_spi3_tx) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  __HAL_LINKDMA(&hspi3,hdmatx,hdma_spi3_tx);
+
+  /* DMA1_Stream0_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, IRQ_PRIO_ENCODER_SPI, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
+  /* DMA1_Stream5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, IRQ_PRIO_ENCODER_SPI, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
+}
+
 /* USER CODE END 1 */
 
 /**
@@ -38,6 +38,7 @@
 
 /* USER CODE BEGIN 0 */
 #include "freertos_vars.h"
+#include "gpio.h"
 #include <stdbool.h>
 
 typedef void (*ADC_handler_t)(ADC_HandleTypeDef* hadc, bool injected);
@@ -48,7 +49,6 @@ void decode_tim_capture(TIM_HandleTypeDef *htim, TIM_capture_callback_t callback
 
 // TODO: move somewhere else
 void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
-void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
 void tim_update_cb(TIM_HandleTypeDef* htim);
 void pwm_in_cb(int channel, uint32_t timestamp);
 
@@ -67,6 +67,8 @@ extern TIM_HandleTypeDef htim5;
 extern TIM_HandleTypeDef htim8;
 extern DMA_HandleTypeDef hdma_uart4_rx;
 extern DMA_HandleTypeDef hdma_uart4_tx;
+extern DMA_HandleTypeDef hdma_spi3_rx;
+extern DMA_HandleTypeDef hdma_spi3_tx;
 extern UART_HandleTypeDef huart4;
 
 extern TIM_HandleTypeDef htim14;
@@ -194,6 +196,15 @@ void SysTick_Handler(void)
 /* please refer to the startup file (startup_stm32f4xx.s).                    */
 /******************************************************************************/
 
+/**
+* @brief This function handles DMA1 stream0 global interrupt.
+* Only enabled by MX_SPI3_DMA_Init.
+*/
+void DMA1_Stream0_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi3_rx);
+}
+
 /**
 * @brief This function handles DMA1 stream2 global interrupt.
 */
@@ -222,6 +233,15 @@ void DMA1_Stream4_IRQHandler(void)
   /* USER CODE END DMA1_Stream4_IRQn 1 */
 }
 
+/**
+* @brief This function handles DMA1 stream5 global interrupt.
+* Only enabled by MX_SPI3_DMA_Init.
+*/
+void DMA1_Stream5_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi3_tx);
+}
+
 /**
 * @brief This function handles ADC1, ADC2 and ADC3 global interrupts.
 */
@@ -231,8 +251,7 @@ void ADC_IRQHandler(void)
 
   // The HAL's ADC handling mechanism adds many clock cycles of overhead
   // So we bypass it and handle the logic ourselves.
-  //@TODO add vbus measurement on adc1 here
-  ADC_IRQ_Dispatch(&hadc1, &vbus_sense_adc_cb);
+  // ADC1 (vbus and the auxiliary channels) runs without interrupts, see start_general_purpose_adc()
   ADC_IRQ_Dispatch(&hadc2, &pwm_trig_adc_cb);
   ADC_IRQ_Dispatch(&hadc3, &pwm_trig_adc_cb);
 
@@ -342,7 +361,11 @@ void TIM5_IRQHandler(void)
 void UART4_IRQHandler(void)
 {
   /* USER CODE BEGIN UART4_IRQn 0 */
-
+  // Wake up the UART server thread when the line goes idle after receiving data
+  if (__HAL_UART_GET_FLAG(&huart4, UART_FLAG_IDLE) && __HAL_UART_GET_IT_SOURCE(&huart4, UART_IT_IDLE)) {
+    __HAL_UART_CLEAR_IDLEFLAG(&huart4);
+    osSemaphoreRelease(sem_uart_rx);
+  }
   /* USER CODE END UART4_IRQn 0 */
   HAL_UART_IRQHandler(&huart4);
   /* USER CODE BEGIN UART4_IRQn 1 */
@@ -450,7 +473,7 @@ void I2C1_ER_IRQHandler(void)
 */
 void EXTI0_IRQHandler(void)
 {
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_0);
+  GPIO_EXTI_dispatch(GPIO_PIN_0);
 }
 
 /**
@@ -458,7 +481,7 @@ void EXTI0_IRQHandler(void)
 */
 void EXTI2_IRQHandler(void)
 {
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_2);
+  GPIO_EXTI_dispatch(GPIO_PIN_2);
 }
 
 /**
@@ -466,7 +489,7 @@ void EXTI2_IRQHandler(void)
 */
 void EXTI3_IRQHandler(void)
 {
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_3);
+  GPIO_EXTI_dispatch(GPIO_PIN_3);
 }
 
 /**
@@ -474,7 +497,7 @@ void EXTI3_IRQHandler(void)
 */
 void EXTI4_IRQHandler(void)
 {
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_4);
+  GPIO_EXTI_dispatch(GPIO_PIN_4);
 }
 
 /**
@@ -482,12 +505,8 @@ void EXTI4_IRQHandler(void)
 */
 void EXTI9_5_IRQHandler(void)
 {
-  // The true source of the interrupt is checked inside HAL_GPIO_EXTI_IRQHandler() 
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_5);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_6);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_7);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_8);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_9);
+  // The true source of the interrupt is checked inside GPIO_EXTI_dispatch()
+  GPIO_EXTI_dispatch(GPIO_PIN_5 | GPIO_PIN_6 | GPIO_PIN_7 | GPIO_PIN_8 | GPIO_PIN_9);
 }
 
 /**
@@ -495,13 +514,8 @@ void EXTI9_5_IRQHandler(void)
 */
 void EXTI15_10_IRQHandler(void)
 {
-  // The true source of the interrupt is checked inside HAL_GPIO_EXTI_IRQHandler() 
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_10);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_11);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_12);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_13);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_14);
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_15);
+  // The true source of the interrupt is checked inside GPIO_EXTI_dispatch()
+  GPIO_EXTI_dispatch(GPIO_PIN_10 | GPIO_PIN_11 | GPIO_PIN_12 | GPIO_PIN_13 | GPIO_PIN_14 | GPIO_PIN_15);
 }
 
 /* USER CODE END 1 */
@@ -52,6 +52,7 @@
 
 #include "gpio.h"
 #include "dma.h"
+#include "priorities.h"
 
 /* USER CODE BEGIN 0 */
 
@@ -148,7 +149,7 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     __HAL_LINKDMA(uartHandle,hdmatx,hdma_uart4_tx);
 
     /* UART4 interrupt Init */
-    HAL_NVIC_SetPriority(UART4_IRQn, 5, 0);
+    HAL_NVIC_SetPriority(UART4_IRQn, IRQ_PRIO_UART, 0);
     HAL_NVIC_EnableIRQ(UART4_IRQn);
   /* USER CODE BEGIN UART4_MspInit 1 */
 
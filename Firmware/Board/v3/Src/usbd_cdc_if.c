@@ -122,7 +122,7 @@ uint8_t ODRIVERxBufferFS[APP_RX_DATA_SIZE];
 
 /** Data to send over USB CDC are stored in this buffer   */
 uint8_t CDCTxBufferFS[APP_TX_DATA_SIZE];
-uint8_t ODRIVETxBufferFS[APP_TX_DATA_SIZE];
+uint8_t ODRIVETxBufferFS[USB_NATIVE_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
 /* USER CODE END PRIVATE_VARIABLES */
@@ -154,6 +154,7 @@ static int8_t CDC_Init_FS(void);
 static int8_t CDC_DeInit_FS(void);
 static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len, uint8_t endpoint_pair);
+static int8_t CDC_StartOfFrame_FS(void);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
@@ -167,7 +168,8 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_StartOfFrame_FS
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -183,6 +185,8 @@ static int8_t CDC_Init_FS(void)
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, CDCRxBufferFS, CDC_OUT_EP);
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, ODRIVETxBufferFS, 0, ODRIVE_OUT_EP);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, ODRIVERxBufferFS, ODRIVE_OUT_EP);
+  /* A new host enables the telemetry when it wants it */
+  usb_telemetry_.enabled = false;
   return (USBD_OK);
   /* USER CODE END 3 */
 }
@@ -300,6 +304,18 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len, uint8_t endpoint_pair)
   /* USER CODE END 6 */
 }
 
+/**
+  * @brief  CDC_StartOfFrame_FS
+  *         Called at the start of every USB frame (1 ms) while the device
+  *         is configured.
+  * @retval Result of the operation: USBD_OK
+  */
+static int8_t CDC_StartOfFrame_FS(void)
+{
+  usb_start_of_frame();
+  return (USBD_OK);
+}
+
 /**
   * @brief  CDC_Transmit_FS
   *         Data to send over USB IN endpoint are sent over CDC interface
@@ -316,25 +332,28 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len, uint8_t endpoint_pair)
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 7 */
   
-  //Check length
-  if (Len > USB_TX_DATA_SIZE)
-    return USBD_FAIL;
-
   USBD_CDC_HandleTypeDef* hcdc = (USBD_CDC_HandleTypeDef*) hUsbDeviceFS.pClassData;
 
   // Select EP
   USBD_CDC_EP_HandleTypeDef* hEP_Tx;
   uint8_t* TxBuff;
+  uint16_t MaxLen;
   if (endpoint_pair == CDC_OUT_EP) {
     hEP_Tx = &hcdc->CDC_Tx;
     TxBuff = CDCTxBufferFS;
+    MaxLen = USB_TX_DATA_SIZE;
   } else if (endpoint_pair == ODRIVE_OUT_EP) {
     hEP_Tx = &hcdc->ODRIVE_Tx;
     TxBuff = ODRIVETxBufferFS;
+    MaxLen = USB_NATIVE_TX_DATA_SIZE;
   } else {
     return USBD_FAIL;
   }
 
+  //Check length
+  if (Len > MaxLen)
+    return USBD_FAIL;
+
   // Check for ongoing transmission
   if (hEP_Tx->State != 0)
       return USBD_BUSY;
@@ -1,10 +1,12 @@
 
 #include <stdlib.h>
+#include <algorithm>
 #include <functional>
 #include "gpio.h"
 
 #include "utils.h"
 #include "odrive_main.h"
+#include "freertos_vars.h"
 
 Axis::Axis(const AxisHardwareConfig_t& hw_config,
            Config_t& config,
@@ -12,26 +14,52 @@ Axis::Axis(const AxisHardwareConfig_t& hw_config,
            SensorlessEstimator& sensorless_estimator,
            Controller& controller,
            Motor& motor,
-           TrapezoidalTrajectory& trap)
+           TrapezoidalTrajectory& trap,
+           FusionEstimator& fusion_estimator)
     : hw_config_(hw_config),
       config_(config),
       encoder_(encoder),
       sensorless_estimator_(sensorless_estimator),
       controller_(controller),
       motor_(motor),
-      trap_(trap)
+      trap_(trap),
+      fusion_estimator_(fusion_estimator)
 {
     encoder_.axis_ = this;
     sensorless_estimator_.axis_ = this;
     controller_.axis_ = this;
     motor_.axis_ = this;
     trap_.axis_ = this;
+    fusion_estimator_.axis_ = this;
+
+    encoder_.update_elec_rad_per_enc();
+}
+
+// @brief Recalculates everything that the components derive from their
+// configuration when they are constructed, e.g. after the configuration
+// was replaced behind their back (see migrate_configuration()).
+void Axis::update_derived_values() {
+    motor_.update_current_controller_gains();
+    encoder_.update_pll_gains();
+    encoder_.update_elec_rad_per_enc();
+    sensorless_estimator_.update_pll_gains();
+    sensorless_estimator_.update_observer_gains();
+    controller_.iq_filter_dirty_ = true;
+    controller_.input_shaper_dirty_ = true;
 }
 
 static void step_cb_wrapper(void* ctx) {
     reinterpret_cast<Axis*>(ctx)->step_cb();
 }
 
+static void dir_cb_wrapper(void* ctx) {
+    reinterpret_cast<Axis*>(ctx)->dir_cb();
+}
+
+static void endstop_cb_wrapper(void* ctx) {
+    reinterpret_cast<Axis*>(ctx)->endstop_cb();
+}
+
 // @brief Sets up all components of the axis,
 // such as gate driver and encoder hardware.
 void Axis::setup() {
@@ -44,24 +72,114 @@ static void run_state_machine_loop_wrapper(void* ctx) {
     reinterpret_cast<Axis*>(ctx)->thread_id_valid_ = false;
 }
 
+static uint32_t axis_thread_stacks[AXIS_COUNT][STACK_SIZE_AXIS];
+static osStaticThreadDef_t axis_thread_tcbs[AXIS_COUNT];
+
 // @brief Starts run_state_machine_loop in a new thread
 void Axis::start_thread() {
-    osThreadDef(thread_def, run_state_machine_loop_wrapper, hw_config_.thread_priority, 0, 4*512);
+    size_t axis_num = 0;
+    while (axis_num < AXIS_COUNT - 1 && axes[axis_num] != this)
+        ++axis_num;
+    osThreadStaticDef(thread_def, run_state_machine_loop_wrapper, hw_config_.thread_priority, 0, STACK_SIZE_AXIS,
+            axis_thread_stacks[axis_num], &axis_thread_tcbs[axis_num]);
     thread_id_ = osThreadCreate(osThread(thread_def), this);
     thread_id_valid_ = true;
 }
 
 // @brief Unblocks the control loop thread.
-// This is called from the current sense interrupt handler.
+// This is called from the current sense interrupt handler, at every PWM
+// period for each axis, so it uses a direct to task notification rather than
+// a CMSIS signal, and switches to the thread right on return of the ISR.
 void Axis::signal_current_meas() {
-    if (thread_id_valid_)
-        osSignalSet(thread_id_, M_SIGNAL_PH_CURRENT_MEAS);
+    if (thread_id_valid_) {
+        current_meas_signal_cycles_ = DWT->CYCCNT;
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR((TaskHandle_t)thread_id_, &higher_priority_task_woken);
+        portYIELD_FROM_ISR(higher_priority_task_woken);
+    }
+}
+
+// @brief Runs the interrupt side of the control loop and unblocks the
+// control loop thread when it is due.
+// This is called from the current sense interrupt handler.
+//
+// While isr_current_control_active_ is set, the encoder and the FOC current
+// loop are executed right here, using the current setpoint that the thread
+// last handed over in isr_current_setpoint_. The thread is then only woken
+// up every config_.isr_control_divider measurements.
+// If the hot path fails or overruns the motor's control deadline, the ISR
+// mode is dropped and the resulting error makes the thread exit its loop.
+//
+// While isr_idle_active_ is set, only the encoder is updated here, so that
+// the position is tracked while the thread sleeps for
+// config_.idle_loop_divider measurements. An encoder error is picked up by
+// the next do_checks() of the thread.
+void Axis::handle_current_meas() {
+    ++meas_count_;
+    if (isr_current_control_active_) {
+        bool ok = encoder_.update() && motor_.update(isr_current_setpoint_, encoder_.phase_, encoder_.phase_vel_);
+        if (ok && motor_.get_pwm_timing() > motor_.hw_config_.control_deadline * tim_1_8_period_clocks) {
+            motor_.set_error(Motor::ERROR_CONTROL_DEADLINE_MISSED);
+            ok = false;
+        }
+        if (!ok) {
+            isr_current_control_active_ = false;
+        } else {
+            if ((++loop_counter_ % control_loop_divider()) != 0)
+                return;
+        }
+    } else if (isr_idle_active_) {
+        encoder_.update();
+        if ((++loop_counter_ % control_loop_divider()) != 0)
+            return;
+    }
+    signal_current_meas();
 }
 
-// @brief Blocks until a current measurement is completed
+// @brief Returns by how many current measurements the control loop thread
+// is decimated (1 unless the current loop runs in the ISR or the axis idles
+// at a low rate)
+uint32_t Axis::control_loop_divider() {
+    if (isr_idle_active_) {
+        // wait_for_current_meas extends its timeout by the idle period
+        int32_t max_divider = current_meas_hz / 100;
+        return std::max(std::min(config_.idle_loop_divider, max_divider), (int32_t)1);
+    }
+    if (!isr_current_control_active_)
+        return 1;
+    // the thread must still wake up well before PH_CURRENT_MEAS_TIMEOUT
+    int32_t max_divider = (current_meas_hz * PH_CURRENT_MEAS_TIMEOUT) / 2000;
+    return std::max(std::min(config_.isr_control_divider, max_divider), (int32_t)1);
+}
+
+// @brief Returns the number of current measurements since startup.
+// This is the time base of the trajectory generators. It does not wrap, so
+// time differences are exact for any duration. The ISR may update the
+// counter between the two 32-bit halves of a read, so read until two
+// reads agree.
+uint64_t Axis::get_meas_count() {
+    const volatile uint64_t& count = meas_count_;
+    uint64_t a, b;
+    do {
+        a = count;
+        b = count;
+    } while (a != b);
+    return a;
+}
+
+// @brief Blocks until a current measurement is completed.
+// The time from the notification in the ISR until the thread runs is recorded
+// in the thread_wakeup profiler section, it counts against the control deadline.
 // @returns True on success, false otherwise
 bool Axis::wait_for_current_meas() {
-    return osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status == osEventSignal;
+    uint32_t timeout = PH_CURRENT_MEAS_TIMEOUT; // [ms]
+    if (isr_idle_active_)
+        timeout += (control_loop_divider() * 1000) / (uint32_t)current_meas_hz;
+    // Notifications that came in while the thread was busy collapse into one
+    if (ulTaskNotifyTake(pdTRUE, timeout / portTICK_PERIOD_MS) == 0)
+        return false;
+    profiler.sections_[Profiler::SECTION_THREAD_WAKEUP].record(DWT->CYCCNT - current_meas_signal_cycles_);
+    return true;
 }
 
 // step/direction interface
@@ -69,10 +187,97 @@ void Axis::step_cb() {
     if (enable_step_dir_) {
         GPIO_PinState dir_pin = HAL_GPIO_ReadPin(hw_config_.dir_port, hw_config_.dir_pin);
         float dir = (dir_pin == GPIO_PIN_SET) ? 1.0f : -1.0f;
-        controller_.pos_setpoint_ += dir * config_.counts_per_step;
+        float& step_target = step_filter_active_ ? step_pos_ : controller_.pos_setpoint_;
+        step_target += dir * config_.counts_per_step;
     }
 };
 
+// @brief Counts the step timer in the direction of the dir pin.
+// This only runs on dir edges, which are rare compared to steps.
+void Axis::dir_cb() {
+    TIM_TypeDef* tim = hw_config_.step_timer->Instance;
+    if (HAL_GPIO_ReadPin(hw_config_.dir_port, hw_config_.dir_pin) == GPIO_PIN_SET)
+        tim->CR1 &= ~TIM_CR1_DIR;
+    else
+        tim->CR1 |= TIM_CR1_DIR;
+}
+
+// @brief Switches the step timer to count the rising edges of the step pin.
+// @returns false if this axis has no step timer or the timer is in use
+bool Axis::start_step_timer() {
+    TIM_HandleTypeDef* htim = hw_config_.step_timer;
+    if (!htim)
+        return false;
+    // The PWM input uses the same timer as its time base
+    for (size_t i = 0; i < 4; ++i) {
+        if (is_endpoint_ref_valid(board_config.pwm_mappings[i].endpoint))
+            return false;
+    }
+
+    GPIO_InitTypeDef GPIO_InitStruct;
+    GPIO_InitStruct.Pin = hw_config_.step_pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+    GPIO_InitStruct.Alternate = hw_config_.step_timer_af;
+    HAL_GPIO_Init(hw_config_.step_port, &GPIO_InitStruct);
+
+    // External clock mode 1: every rising edge on TI1 clocks the counter.
+    // The filter needs the input stable for 8 timer clocks (about 100 ns).
+    TIM_SlaveConfigTypeDef sSlaveConfig;
+    sSlaveConfig.SlaveMode = TIM_SLAVEMODE_EXTERNAL1;
+    sSlaveConfig.InputTrigger = TIM_TS_TI1FP1;
+    sSlaveConfig.TriggerPolarity = TIM_TRIGGERPOLARITY_RISING;
+    sSlaveConfig.TriggerPrescaler = TIM_TRIGGERPRESCALER_DIV1;
+    sSlaveConfig.TriggerFilter = 3;
+    if (HAL_TIM_SlaveConfigSynchronization(htim, &sSlaveConfig) != HAL_OK)
+        return false;
+
+    GPIO_subscribe_edges(hw_config_.dir_port, hw_config_.dir_pin, dir_cb_wrapper, this);
+    dir_cb();
+    GPIO_set_edge_interrupt_enabled(hw_config_.dir_pin, true);
+
+    step_timer_count_ = htim->Instance->CNT;
+    __HAL_TIM_ENABLE(htim);
+    return true;
+}
+
+// @brief Applies the steps counted by the step timer since the last call.
+// Called once per control loop iteration.
+void Axis::update_step_timer() {
+    if (!step_timer_active_)
+        return;
+    uint32_t count = hw_config_.step_timer->Instance->CNT;
+    int32_t steps = (int32_t)(count - step_timer_count_);
+    step_timer_count_ = count;
+    if (enable_step_dir_) {
+        float& step_target = step_filter_active_ ? step_pos_ : controller_.pos_setpoint_;
+        step_target += (float)steps * config_.counts_per_step;
+    }
+}
+
+// @brief Tracks the step input position with a second order filter and
+// feeds its position and velocity to the controller.
+// Called once per control loop iteration, after update_step_timer().
+void Axis::update_step_filter() {
+    if (!enable_step_dir_ || !step_filter_active_)
+        return;
+    // The thread period changes with the ISR current loop, and the gains
+    // are cheap to compute
+    float dt = current_meas_period * control_loop_divider();
+    step_filter_.set_bandwidth(config_.step_dir_filter_bandwidth, dt);
+    if (step_filter_.is_stable()) {
+        step_filter_.predict(step_filter_pos_, step_filter_vel_);
+        float err = step_filter_.error(step_pos_, step_filter_pos_);
+        step_filter_.correct(step_filter_pos_, step_filter_vel_, err);
+    } else {
+        step_filter_pos_ = step_pos_;
+        step_filter_vel_ = 0.0f;
+    }
+    controller_.pos_setpoint_ = step_filter_pos_;
+    controller_.vel_setpoint_ = step_filter_vel_;
+}
+
 // @brief Enables or disables step/dir input
 void Axis::set_step_dir_enabled(bool enable) {
     if (enable) {
@@ -83,16 +288,28 @@ void Axis::set_step_dir_enabled(bool enable) {
         GPIO_InitStruct.Pull = GPIO_NOPULL;
         HAL_GPIO_Init(hw_config_.dir_port, &GPIO_InitStruct);
 
-        // Subscribe to rising edges of the step GPIO
-        GPIO_subscribe(hw_config_.step_port, hw_config_.step_pin, GPIO_PULLDOWN,
-                step_cb_wrapper, this);
+        // Start the filter at the current setpoint before any step arrives
+        step_filter_active_ = config_.step_dir_filter_bandwidth > 0.0f;
+        step_pos_ = controller_.pos_setpoint_;
+        step_filter_pos_ = controller_.pos_setpoint_;
+        step_filter_vel_ = 0.0f;
+
+        if (!step_timer_active_ && config_.step_dir_use_timer)
+            step_timer_active_ = start_step_timer();
+
+        // Otherwise subscribe to rising edges of the step GPIO
+        if (!step_timer_active_)
+            GPIO_subscribe(hw_config_.step_port, hw_config_.step_pin, GPIO_PULLDOWN,
+                    step_cb_wrapper, this);
 
         enable_step_dir_ = true;
     } else {
         enable_step_dir_ = false;
 
-        // Unsubscribe from step GPIO
-        GPIO_unsubscribe(hw_config_.step_port, hw_config_.step_pin);
+        // The step timer keeps counting, but update_step_timer drops the
+        // steps while step/dir is disabled. Unsubscribe from step GPIO
+        if (!step_timer_active_)
+            GPIO_unsubscribe(hw_config_.step_port, hw_config_.step_pin);
     }
 }
 
@@ -104,9 +321,9 @@ bool Axis::do_checks() {
     if ((current_state_ != AXIS_STATE_IDLE) && (motor_.armed_state_ == Motor::ARMED_STATE_DISARMED))
         // motor got disarmed in something other than the idle loop
         error_ |= ERROR_MOTOR_DISARMED;
-    if (!(vbus_voltage >= board_config.dc_bus_undervoltage_trip_level))
+    if (!(vbus_voltage_filtered >= board_config.dc_bus_undervoltage_trip_level))
         error_ |= ERROR_DC_BUS_UNDER_VOLTAGE;
-    if (!(vbus_voltage <= board_config.dc_bus_overvoltage_trip_level))
+    if (!(vbus_voltage_filtered <= board_config.dc_bus_overvoltage_trip_level))
         error_ |= ERROR_DC_BUS_OVER_VOLTAGE;
 
     // Sub-components should use set_error which will propegate to this error_
@@ -114,32 +331,214 @@ bool Axis::do_checks() {
     encoder_.do_checks();
     // sensorless_estimator_.do_checks();
     // controller_.do_checks();
+    clear_covered_encoder_error();
+    trace_errors();
 
     return check_for_errors();
 }
 
-// @brief Update all esitmators
+// @brief During closed loop control, an encoder failure is covered by the
+// fusion estimator as long as the sensorless estimate is valid.
+// encoder.error still shows the cause.
+void Axis::clear_covered_encoder_error() {
+    if (fusion_estimator_.using_sensorless_ && current_state_ == AXIS_STATE_CLOSED_LOOP_CONTROL)
+        error_ &= ~ERROR_ENCODER_FAILED;
+}
+
+// @brief Emits a trace event for every change of the axis, motor or encoder error.
+void Axis::trace_errors() {
+    if (error_ != traced_error_) {
+        traced_error_ = error_;
+        trace.emit(Trace::EVENT_AXIS_ERROR, trace_source(this), 0, error_);
+    }
+    if (motor_.error_ != traced_motor_error_) {
+        traced_motor_error_ = motor_.error_;
+        trace.emit(Trace::EVENT_MOTOR_ERROR, trace_source(this), 0, motor_.error_);
+    }
+    if (encoder_.error_ != traced_encoder_error_) {
+        traced_encoder_error_ = encoder_.error_;
+        trace.emit(Trace::EVENT_ENCODER_ERROR, trace_source(this), 0, encoder_.error_);
+    }
+}
+
+// @brief Returns the estimators (see Estimator_t) that the current state uses.
+// The encoder keeps tracking whenever its position is valid, so that it
+// stays valid through sensorless control.
+uint32_t Axis::get_required_estimators() {
+    switch (current_state_) {
+        case AXIS_STATE_SENSORLESS_CONTROL:
+            return ESTIMATOR_SENSORLESS | (encoder_.is_ready_ ? ESTIMATOR_ENCODER : ESTIMATOR_NONE);
+        case AXIS_STATE_SENSORLESS_FLUX_IDENTIFICATION:
+            return encoder_.is_ready_ ? ESTIMATOR_ENCODER : ESTIMATOR_NONE;
+        case AXIS_STATE_CLOSED_LOOP_CONTROL:
+            return fusion_estimator_.config_.enable ? ESTIMATOR_FUSION : ESTIMATOR_ENCODER;
+        default:
+            return ESTIMATOR_ENCODER;
+    }
+}
+
+// @brief Update the esitmators that are in use
 bool Axis::do_updates() {
+    update_step_timer();
+    update_step_filter();
     // Sub-components should use set_error which will propegate to this error_
-    encoder_.update();
-    sensorless_estimator_.update();
+    // The ISR current loop or low rate idle takes care of the encoder (and
+    // makes the decimated measurements useless for the sensorless estimator)
+    if (!isr_current_control_active_ && !isr_idle_active_) {
+        active_estimators_ = get_required_estimators() | config_.shadow_estimators;
+        if (active_estimators_ & ESTIMATOR_FUSION)
+            active_estimators_ |= ESTIMATOR_ENCODER | ESTIMATOR_SENSORLESS;
+        if (active_estimators_ & ESTIMATOR_ENCODER)
+            encoder_.update();
+        ProfilerScope prof(Profiler::SECTION_SENSORLESS_UPDATE);
+        if (active_estimators_ & ESTIMATOR_SENSORLESS)
+            sensorless_estimator_.update();
+        if (active_estimators_ & ESTIMATOR_FUSION)
+            fusion_estimator_.update();
+        else
+            fusion_estimator_.using_sensorless_ = false;
+        clear_covered_encoder_error();
+    } else {
+        active_estimators_ = ESTIMATOR_ENCODER;
+    }
     return check_for_errors();
 }
 
+// @brief Publishes the state of this control loop iteration, see snapshot_buffer_.
+void Axis::publish_snapshot() {
+    AxisSnapshot_t snapshot;
+    snapshot.meas_count = (uint32_t)get_meas_count();
+    snapshot.pos_estimate = encoder_.pos_estimate_;
+    snapshot.pos_estimate_turns = encoder_.pos_estimate_turns_;
+    snapshot.pos_estimate_in_turn = encoder_.pos_estimate_in_turn_;
+    snapshot.vel_estimate = encoder_.vel_estimate_;
+    snapshot.pos_setpoint = controller_.pos_setpoint_;
+    snapshot.vel_setpoint = controller_.vel_setpoint_;
+    snapshot.Iq_setpoint = motor_.current_control_.Iq_setpoint;
+    snapshot.Iq_measured = motor_.current_control_.Iq_measured;
+    snapshot.Id_measured = motor_.current_control_.Id_measured;
+    snapshot.vbus_voltage = vbus_voltage;
+    snapshot.error = error_;
+    snapshot.motor_error = motor_.error_;
+    snapshot.encoder_error = encoder_.error_;
+    snapshot.current_state = current_state_;
+    snapshot_buffer_.publish(snapshot);
+}
+
+// @brief Copies the newest published snapshot to snapshot_.
+// Read the snapshot properties in the same batch as this call.
+bool Axis::take_snapshot() {
+    return snapshot_buffer_.read(&snapshot_);
+}
+
+// @brief Returns the position, velocity, current and error of the last
+// control loop iteration and the current axis error in one packed call, for
+// host control loops.
+std::tuple<float, float, float, uint32_t> Axis::get_feedback() {
+    AxisSnapshot_t snapshot = {};
+    snapshot_buffer_.read(&snapshot);
+    return std::make_tuple(snapshot.pos_estimate, snapshot.vel_estimate, snapshot.Iq_measured, (uint32_t)error_);
+}
+
+// @brief Gets the load position from the snapshot of config_.load_encoder_axis,
+// in counts of this axis' encoder, i.e. scaled by config_.load_encoder_ratio.
+// The other axis publishes its snapshot in every control loop iteration, in
+// idle too, so the position is at most one iteration old.
+bool Axis::get_load_position(int32_t* pos_turns, float* pos_in_turn) {
+    int32_t load_axis = config_.load_encoder_axis;
+    AxisSnapshot_t snapshot;
+    if (load_axis < 0 || load_axis >= (int32_t)AXIS_COUNT || axes[load_axis] == this
+            || !axes[load_axis]->snapshot_buffer_.read(&snapshot)
+            || snapshot.encoder_error != Encoder::ERROR_NONE) {
+        error_ |= ERROR_LOAD_ENCODER_FAILED;
+        return false;
+    }
+    // In double precision, so that the in-turn position keeps its resolution
+    const double cpr = (double)encoder_.config_.cpr;
+    double pos = ((double)snapshot.pos_estimate_turns * (double)axes[load_axis]->encoder_.config_.cpr
+            + (double)snapshot.pos_estimate_in_turn) * (double)config_.load_encoder_ratio;
+    double turns = floor(pos / cpr);
+    *pos_turns = (int32_t)turns;
+    *pos_in_turn = (float)(pos - turns * cpr);
+    return true;
+}
+
+// @brief Returns the axis whose config.torque_share_axis points at this
+// one, i.e. whose controller commands this motor, or nullptr.
+Axis* Axis::get_torque_share_leader() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (axes[i] != this && axes[i]->config_.torque_share_axis >= 0
+                && axes[i]->config_.torque_share_axis < (int32_t)AXIS_COUNT
+                && axes[axes[i]->config_.torque_share_axis] == this)
+            return axes[i];
+    }
+    return nullptr;
+}
+
+// @brief Splits the current command of this axis' controller between
+// this motor and the one of config.torque_share_axis, which picks up its
+// share in its next control loop iteration (see get_shared_current_setpoint).
+// @param current_setpoint: in: the controller output, out: this motor's share [A]
+bool Axis::share_current_setpoint(float* current_setpoint) {
+    int32_t other = config_.torque_share_axis;
+    if (other >= (int32_t)AXIS_COUNT || axes[other] == this) {
+        error_ |= ERROR_TORQUE_SHARE_FAILED;
+        return false;
+    }
+    float ratio = config_.torque_share_ratio;
+    float other_share = ratio * *current_setpoint - config_.torque_share_preload;
+    *current_setpoint = (1.0f - ratio) * *current_setpoint + config_.torque_share_preload;
+    Axis& follower = *axes[other];
+    follower.shared_current_setpoint_ = config_.torque_share_invert ? -other_share : other_share;
+    __DMB(); // publish the setpoint before the sequence number
+    follower.shared_current_seq_ = follower.shared_current_seq_ + 1;
+    return true;
+}
+
+// @brief Returns the current command [A] that the leading axis handed over.
+// Until the first command arrives, e.g. while the leading axis still runs
+// its startup sequence, this is 0. Fails if no new command arrived for a few
+// iterations after that, e.g. because the leading axis left closed loop control.
+bool Axis::get_shared_current_setpoint(float* current_setpoint) {
+    static const uint32_t kMaxMissed = 3;
+    uint32_t seq = shared_current_seq_;
+    __DMB();
+    float setpoint = shared_current_setpoint_;
+    if (seq != shared_current_seen_seq_) {
+        shared_current_seen_seq_ = seq;
+        shared_current_missed_ = 0;
+        shared_current_started_ = true;
+    } else if (shared_current_started_ && ++shared_current_missed_ > kMaxMissed) {
+        error_ |= ERROR_TORQUE_SHARE_FAILED;
+        return false;
+    }
+    *current_setpoint = shared_current_started_ ? setpoint : 0.0f;
+    return true;
+}
+
 float Axis::get_temp() {
-    float adc = adc_measurements_[hw_config_.thermistor_adc_ch];
+    float adc = get_adc_average(hw_config_.thermistor_adc_ch);
     float normalized_voltage = adc / adc_full_scale;
     return horner_fma(normalized_voltage, thermistor_poly_coeffs, thermistor_num_coeffs);
 }
 
-bool Axis::run_sensorless_spin_up() {
+// @brief Spirals up the current, then accelerates open loop towards spin_up_target_vel.
+// @param detect_lock: end the spin-up early once the sensorless estimator has
+//        locked on to the forced phase (see spin_up_lock_* in the config)
+// @param final_phase: if not null, receives the open loop phase at the end
+// @param locked: if not null, receives whether the estimator locked on
+// @param cycles: incremented by the number of control cycles spent
+bool Axis::run_open_loop_spin_up(bool detect_lock, float* final_phase, bool* locked, uint32_t* cycles) {
+    uint32_t n = 0;
+
     // Early Spin-up: spiral up current
     float x = 0.0f;
     run_control_loop([&](){
+        ++n;
         float phase = wrap_pm_pi(config_.ramp_up_distance * x);
         float I_mag = config_.spin_up_current * x;
         x += current_meas_period / config_.ramp_up_time;
-        if (!motor_.update(I_mag, phase))
+        if (!motor_.update(I_mag, phase, 0.0f))
             return error_ |= ERROR_MOTOR_FAILED, false;
         return x < 1.0f;
     });
@@ -147,24 +546,625 @@ bool Axis::run_sensorless_spin_up() {
         return false;
     
     // Late Spin-up: accelerate
+    // The estimator is considered locked when its phase and velocity have
+    // tracked the forced ones for spin_up_lock_time without interruption.
+    const uint32_t lock_cycles = (uint32_t)(config_.spin_up_lock_time * current_meas_hz);
+    uint32_t locked_cycles = 0;
     float vel = config_.ramp_up_distance / config_.ramp_up_time;
     float phase = wrap_pm_pi(config_.ramp_up_distance);
     run_control_loop([&](){
+        ++n;
         vel += config_.spin_up_acceleration * current_meas_period;
         phase = wrap_pm_pi(phase + vel * current_meas_period);
         float I_mag = config_.spin_up_current;
-        if (!motor_.update(I_mag, phase))
+        if (!motor_.update(I_mag, phase, vel))
             return error_ |= ERROR_MOTOR_FAILED, false;
+
+        if (detect_lock) {
+            float phase_err = wrap_pm_pi(sensorless_estimator_.pll_pos_ - phase);
+            float vel_err = sensorless_estimator_.vel_estimate_ - vel;
+            bool tracking = vel >= config_.spin_up_lock_min_vel
+                    && fabsf(phase_err) < config_.spin_up_lock_phase_tol
+                    && fabsf(vel_err) < 0.25f * vel;
+            locked_cycles = tracking ? locked_cycles + 1 : 0;
+            if (locked_cycles > lock_cycles)
+                return false;
+        }
         return vel < config_.spin_up_target_vel;
     });
 
+    if (final_phase)
+        *final_phase = phase;
+    if (locked)
+        *locked = detect_lock && locked_cycles > lock_cycles;
+    if (cycles)
+        *cycles += n;
+    return check_for_errors();
+}
+
+// @brief Spins the motor up open loop for sensorless control.
+//
+// With config.spin_up_lock_detection, the spin-up hands over as soon as the
+// sensorless estimator has locked on. If it does not lock on before
+// spin_up_target_vel, the current is removed for spin_up_retry_delay and the
+// spin-up is retried up to spin_up_max_retries times. A negative value
+// means no retries.
+bool Axis::run_sensorless_spin_up() {
+    const bool detect_lock = config_.spin_up_lock_detection;
+    const uint32_t max_retries = (uint32_t)std::max(config_.spin_up_max_retries, (int32_t)0);
+    uint32_t cycles = 0;
+    spin_up_attempts_ = 0;
+    spin_up_handoff_time_ = 0.0f;
+
+    for (;;) {
+        spin_up_attempts_++;
+        bool locked = false;
+        if (!run_open_loop_spin_up(detect_lock, nullptr, &locked, &cycles))
+            return false;
+        if (requested_state_ != AXIS_STATE_UNDEFINED)
+            return false;
+        if (!detect_lock || locked)
+            break;
+
+        if (spin_up_attempts_ > max_retries) {
+            error_ |= ERROR_SENSORLESS_SPIN_UP_FAILED;
+            return false;
+        }
+
+        // Let the rotor coast down before the next attempt
+        uint32_t i = 0;
+        const uint32_t retry_cycles = (uint32_t)(config_.spin_up_retry_delay * current_meas_hz);
+        run_control_loop([&](){
+            ++cycles;
+            if (!motor_.update(0.0f, 0.0f, 0.0f))
+                return error_ |= ERROR_MOTOR_FAILED, false;
+            return ++i < retry_cycles;
+        });
+        if (error_ != ERROR_NONE || requested_state_ != AXIS_STATE_UNDEFINED)
+            return false;
+    }
+    spin_up_handoff_time_ = (float)cycles * current_meas_period;
+
     // call to controller.reset() that happend when arming means that vel_setpoint
     // is zeroed. So we make the setpoint the spinup target for smooth transition.
     controller_.vel_setpoint_ = config_.spin_up_target_vel;
+    // On an early handoff the velocity integrator takes over the spin-up
+    // current, so that the current does not step down to zero.
+    if (detect_lock)
+        controller_.vel_integrator_current_ = config_.spin_up_current;
 
     return check_for_errors();
 }
 
+// @brief Starts sensorless control from standstill using high frequency injection.
+//
+// With zero current, the HFI tracker first converges to the rotor d axis,
+// or to the opposite direction. To tell them apart, a positive and then a
+// negative d axis current pulse are applied: the current along the magnet
+// flux saturates the stator iron, which lowers Ld and increases the response
+// to the injection. If the negative pulse shows the larger response, the
+// estimate is turned around.
+bool Axis::run_hfi_startup() {
+    if (motor_.config_.motor_type != Motor::MOTOR_TYPE_HIGH_CURRENT) {
+        error_ |= ERROR_INVALID_STATE;
+        return false;
+    }
+
+    const SensorlessEstimator::Config_t& cfg = sensorless_estimator_.config_;
+    const uint32_t converge_cycles = (uint32_t)(cfg.hfi_converge_time * current_meas_hz);
+    const uint32_t pulse_cycles = std::max((uint32_t)(cfg.hfi_polarity_time * current_meas_hz), (uint32_t)2);
+    float response[2] = {0.0f, 0.0f};
+    uint32_t i = 0;
+    motor_.hfi_voltage_ = cfg.hfi_voltage;
+    run_control_loop([&](){
+        float Id = 0.0f;
+        if (i >= converge_cycles) {
+            uint32_t pulse = (i - converge_cycles) / pulse_cycles;
+            Id = pulse == 0 ? cfg.hfi_polarity_current : -cfg.hfi_polarity_current;
+            // Skip the first half of each pulse, while Id is still settling
+            if ((i - converge_cycles) % pulse_cycles >= pulse_cycles / 2)
+                response[pulse] += sensorless_estimator_.hfi_dI_d_;
+        }
+        float phase = sensorless_estimator_.phase_ * motor_.config_.direction;
+        if (!motor_.FOC_current(Id, 0.0f, phase, 0.0f))
+            return error_ |= ERROR_MOTOR_FAILED, false;
+        return ++i < converge_cycles + 2 * pulse_cycles;
+    });
+    motor_.hfi_voltage_ = 0.0f;
+    if (error_ != ERROR_NONE || i < converge_cycles + 2 * pulse_cycles)
+        return false;
+
+    if (response[1] > response[0]) {
+        sensorless_estimator_.hfi_phase_ = wrap_pm_pi(sensorless_estimator_.hfi_phase_ + M_PI);
+        sensorless_estimator_.phase_ = sensorless_estimator_.hfi_phase_;
+        sensorless_estimator_.pll_pos_ = sensorless_estimator_.hfi_phase_;
+    }
+    return check_for_errors();
+}
+
+// @brief Spins the motor up open loop and identifies the permanent magnet
+// flux linkage from the back-EMF at spin_up_target_vel.
+//
+// In the frame of the open loop phase, the steady state motor model is
+//   Vd = R*Id - omega*L*Iq + Ed
+//   Vq = R*Iq + omega*L*Id + Eq
+// where |E| = omega * flux_linkage, independent of the rotor lag.
+// On success the result is written to sensorless_estimator.config.pm_flux_linkage.
+bool Axis::run_sensorless_flux_identification() {
+    if (motor_.config_.motor_type != Motor::MOTOR_TYPE_HIGH_CURRENT) {
+        sensorless_estimator_.error_ |= SensorlessEstimator::ERROR_FLUX_IDENTIFICATION_FAILED;
+        error_ |= ERROR_SENSORLESS_ESTIMATOR_FAILED;
+        return false;
+    }
+
+    float phase;
+    if (!run_open_loop_spin_up(false, &phase, nullptr, nullptr))
+        return false;
+
+    const float vel = config_.spin_up_target_vel;
+    const uint32_t settle_cycles = (uint32_t)(config_.flux_ident_settle_time * current_meas_hz);
+    const uint32_t num_samples = (uint32_t)(config_.flux_ident_duration * current_meas_hz);
+    float sum_Vd = 0.0f, sum_Vq = 0.0f, sum_Id = 0.0f, sum_Iq = 0.0f;
+    uint32_t i = 0;
+    run_control_loop([&](){
+        phase = wrap_pm_pi(phase + vel * current_meas_period);
+        if (!motor_.update(config_.spin_up_current, phase, vel))
+            return error_ |= ERROR_MOTOR_FAILED, false;
+
+        if (i >= settle_cycles) {
+            // Rotate the applied voltage back into the frame it was computed in
+            const Motor::CurrentControl_t& ictrl = motor_.current_control_;
+            float c, s;
+            fast_sincos(phase * motor_.config_.direction, &s, &c);
+            sum_Vd += c * ictrl.final_v_alpha + s * ictrl.final_v_beta;
+            sum_Vq += c * ictrl.final_v_beta - s * ictrl.final_v_alpha;
+            sum_Id += ictrl.Id_measured;
+            sum_Iq += ictrl.Iq_measured;
+        }
+        return ++i < settle_cycles + num_samples;
+    });
+    if (error_ != ERROR_NONE)
+        return false;
+    if (i < settle_cycles + num_samples || num_samples == 0)
+        return false; // interrupted by a state change request
+
+    const float R = motor_.config_.phase_resistance;
+    const float omega_L = vel * motor_.config_.direction * motor_.config_.phase_inductance;
+    float Vd = sum_Vd / (float)num_samples;
+    float Vq = sum_Vq / (float)num_samples;
+    float Id = sum_Id / (float)num_samples;
+    float Iq = sum_Iq / (float)num_samples;
+    float Ed = Vd - R * Id + omega_L * Iq;
+    float Eq = Vq - R * Iq - omega_L * Id;
+    float flux_linkage = sqrtf(Ed * Ed + Eq * Eq) / fabsf(vel);
+
+    if (!(flux_linkage > 0.0f && flux_linkage < INFINITY)) {
+        sensorless_estimator_.error_ |= SensorlessEstimator::ERROR_FLUX_IDENTIFICATION_FAILED;
+        error_ |= ERROR_SENSORLESS_ESTIMATOR_FAILED;
+        return false;
+    }
+
+    sensorless_estimator_.config_.pm_flux_linkage = flux_linkage;
+    sensorless_estimator_.update_observer_gains();
+    return true;
+}
+
+// @brief Identifies the friction model of controller.config. Runs velocity
+// control at friction_ident_points velocities in each direction, spaced by
+// octaves down from config.friction_ident_max_vel, and averages the current
+// command at each of them. Each direction starts at the highest velocity, so
+// that the large velocity error quickly winds the integrator up to the
+// friction current.
+//
+// Half the difference of the currents at +v and -v is
+//   d(v) = coulomb + viscous * v + stribeck * exp(-v / stribeck_vel)
+// where a constant load such as gravity cancels. coulomb and viscous are the
+// least squares line through d(v). With config.friction_ident_stribeck, the
+// excess of d(v) over the line is fitted to the Stribeck term at the
+// configured friction_stribeck_vel, and the line is refitted without it.
+// The friction feedforward is off during the sweep. On success the result is
+// written to controller.config.friction_coulomb, _viscous and _stribeck.
+bool Axis::run_friction_identification() {
+    constexpr size_t friction_ident_points = 6;
+    Controller::Config_t& ctrl_config = controller_.config_;
+    const float max_vel = config_.friction_ident_max_vel;
+    const float loop_hz = current_meas_hz / (float)control_loop_divider();
+    const uint32_t settle_cycles = (uint32_t)(config_.friction_ident_settle_time * loop_hz);
+    const uint32_t num_samples = std::max((uint32_t)(config_.friction_ident_duration * loop_hz), (uint32_t)1);
+    auto point_vel = [&](size_t point) {
+        float vel = max_vel * exp2f(-(float)(point % friction_ident_points));
+        return point < friction_ident_points ? vel : -vel;
+    };
+
+    Controller::ControlMode_t saved_control_mode = ctrl_config.control_mode;
+    bool saved_friction_ff = ctrl_config.enable_friction_ff;
+    bool saved_vel_ramp = ctrl_config.vel_ramp_enable;
+    ctrl_config.control_mode = Controller::CTRL_MODE_VELOCITY_CONTROL;
+    ctrl_config.enable_friction_ff = false;
+    ctrl_config.vel_ramp_enable = false;
+
+    float mean_vel[2 * friction_ident_points];
+    float mean_current[2 * friction_ident_points];
+    float sum_vel = 0.0f, sum_current = 0.0f;
+    size_t point = 0;
+    uint32_t i = 0;
+    controller_.vel_setpoint_ = point_vel(0);
+    run_control_loop([&](){
+        float current_setpoint;
+        if (!controller_.update(encoder_.pos_estimate_turns_, encoder_.pos_estimate_in_turn_,
+                encoder_.vel_estimate_, encoder_.pos_estimate_in_turn_, &current_setpoint))
+            return error_ |= ERROR_CONTROLLER_FAILED, false;
+        if (!motor_.update(current_setpoint, encoder_.phase_, encoder_.phase_vel_))
+            return false; // set_error should update axis.error_
+        if (i >= settle_cycles) {
+            sum_vel += encoder_.vel_estimate_;
+            sum_current += current_setpoint;
+        }
+        if (++i < settle_cycles + num_samples)
+            return true;
+        mean_vel[point] = sum_vel / (float)num_samples;
+        mean_current[point] = sum_current / (float)num_samples;
+        sum_vel = sum_current = 0.0f;
+        i = 0;
+        if (++point == 2 * friction_ident_points)
+            return false;
+        controller_.vel_setpoint_ = point_vel(point);
+        return true;
+    });
+    ctrl_config.control_mode = saved_control_mode;
+    ctrl_config.enable_friction_ff = saved_friction_ff;
+    ctrl_config.vel_ramp_enable = saved_vel_ramp;
+    controller_.vel_setpoint_ = 0.0f;
+    if (error_ != ERROR_NONE)
+        return false;
+    if (point < 2 * friction_ident_points)
+        return false; // interrupted by a state change request
+
+    float vel[friction_ident_points], d[friction_ident_points];
+    for (size_t k = 0; k < friction_ident_points; ++k) {
+        vel[k] = point_vel(k);
+        for (size_t dir = 0; dir < 2; ++dir) {
+            size_t p = k + dir * friction_ident_points;
+            if (!(fabsf(mean_vel[p] - point_vel(p)) <= 0.2f * vel[k])) {
+                error_ |= ERROR_FRICTION_IDENTIFICATION_FAILED;
+                return false;
+            }
+        }
+        d[k] = 0.5f * (mean_current[k] - mean_current[k + friction_ident_points]);
+    }
+
+    // Least squares line through d - stribeck * e
+    float mean_v = 0.0f;
+    for (size_t k = 0; k < friction_ident_points; ++k)
+        mean_v += vel[k] / (float)friction_ident_points;
+    float stribeck = 0.0f, coulomb = 0.0f, viscous = 0.0f;
+    float stribeck_vel = ctrl_config.friction_stribeck_vel;
+    bool fit_stribeck = config_.friction_ident_stribeck && stribeck_vel > 0.0f;
+    for (int pass = 0; pass < (fit_stribeck ? 3 : 1); ++pass) {
+        float mean_d = 0.0f, cov = 0.0f, var = 0.0f;
+        for (size_t k = 0; k < friction_ident_points; ++k)
+            mean_d += (d[k] - stribeck * expf(-vel[k] / stribeck_vel)) / (float)friction_ident_points;
+        for (size_t k = 0; k < friction_ident_points; ++k) {
+            float dk = d[k] - stribeck * expf(-vel[k] / stribeck_vel);
+            cov += (vel[k] - mean_v) * (dk - mean_d);
+            var += SQ(vel[k] - mean_v);
+        }
+        viscous = cov / var;
+        coulomb = mean_d - viscous * mean_v;
+        if (fit_stribeck) {
+            float num = 0.0f, den = 0.0f;
+            for (size_t k = 0; k < friction_ident_points; ++k) {
+                float e = expf(-vel[k] / stribeck_vel);
+                num += e * (d[k] - coulomb - viscous * vel[k]);
+                den += e * e;
+            }
+            stribeck = std::max(num / den, 0.0f);
+        }
+    }
+    if (!(std::isfinite(coulomb) && std::isfinite(viscous) && std::isfinite(stribeck))) {
+        error_ |= ERROR_FRICTION_IDENTIFICATION_FAILED;
+        return false;
+    }
+
+    ctrl_config.friction_coulomb = std::max(coulomb, 0.0f);
+    ctrl_config.friction_viscous = std::max(viscous, 0.0f);
+    if (fit_stribeck)
+        ctrl_config.friction_stribeck = stribeck;
+    return true;
+}
+
+// Runs closed loop control in the configured control mode and injects the
+// excitation of freq_response_ into the current or the velocity command.
+bool Axis::run_frequency_response() {
+    const float loop_hz = current_meas_hz / (float)control_loop_divider();
+    if (!freq_response_.start(loop_hz))
+        return error_ |= ERROR_FREQUENCY_RESPONSE_FAILED, false;
+    bool inject_current = freq_response_.config_.injection == FrequencyResponse::INJECT_CURRENT;
+
+    bool done = false;
+    run_control_loop([&](){
+        float excitation = freq_response_.excitation();
+        if (!inject_current)
+            controller_.vel_injection_ = excitation;
+        float current_setpoint;
+        if (!controller_.update(encoder_.pos_estimate_turns_, encoder_.pos_estimate_in_turn_,
+                encoder_.vel_estimate_, encoder_.pos_estimate_in_turn_, &current_setpoint))
+            return error_ |= ERROR_CONTROLLER_FAILED, false;
+        if (inject_current)
+            current_setpoint += excitation;
+        if (!motor_.update(current_setpoint, encoder_.phase_, encoder_.phase_vel_))
+            return false; // set_error should update axis.error_
+        done = !freq_response_.sample(current_setpoint, encoder_.vel_estimate_);
+        return !done;
+    });
+    controller_.vel_injection_ = 0.0f;
+    if (error_ != ERROR_NONE)
+        return false;
+    return done; // false if interrupted by a state change request
+}
+
+// Measures the inertia with current injection in velocity control at zero
+// velocity, then sets the velocity loop to cross over at
+// auto_tune_vel_bandwidth with auto_tune_phase_margin.
+bool Axis::run_auto_tuning() {
+    Controller::Config_t& ctrl_config = controller_.config_;
+    FrequencyResponse::Config_t saved_fr_config = freq_response_.config_;
+    Controller::ControlMode_t saved_control_mode = ctrl_config.control_mode;
+    bool saved_friction_ff = ctrl_config.enable_friction_ff;
+    bool saved_vel_ramp = ctrl_config.vel_ramp_enable;
+    ctrl_config.control_mode = Controller::CTRL_MODE_VELOCITY_CONTROL;
+    ctrl_config.enable_friction_ff = false;
+    ctrl_config.vel_ramp_enable = false;
+    controller_.vel_setpoint_ = 0.0f;
+
+    FrequencyResponse::Config_t& fr_config = freq_response_.config_;
+    fr_config.injection = FrequencyResponse::INJECT_CURRENT;
+    fr_config.amplitude = config_.auto_tune_excitation_current;
+    fr_config.min_frequency = 0.5f * config_.auto_tune_frequency;
+    fr_config.max_frequency = 2.0f * config_.auto_tune_frequency;
+    fr_config.num_points = 3;
+    fr_config.settle_cycles = 3;
+    fr_config.measure_cycles = 10;
+    bool done = run_frequency_response();
+    freq_response_.config_ = saved_fr_config;
+    ctrl_config.control_mode = saved_control_mode;
+    ctrl_config.enable_friction_ff = saved_friction_ff;
+    ctrl_config.vel_ramp_enable = saved_vel_ramp;
+    if (!done)
+        return false;
+
+    // The plant is vel / Iq = 1 / (inertia * s + viscous), measured behind
+    // the current loop (first order) and the encoder PLL (critically damped)
+    const float current_bandwidth = motor_.config_.current_control_bandwidth;
+    const float pll_bandwidth = encoder_.pll_bandwidth_;
+    float inertia = 0.0f, viscous = 0.0f;
+    for (size_t k = 0; k < freq_response_.num_points_done_; ++k) {
+        const float* row = &freq_response_.results_[k * FrequencyResponse::kValuesPerRow];
+        float omega = 2.0f * M_PI * row[0];
+        // Iq / vel = command / output
+        float out_sq = SQ(row[3]) + SQ(row[4]);
+        float inv_re = (row[1] * row[3] + row[2] * row[4]) / out_sq;
+        float inv_im = (row[2] * row[3] - row[1] * row[4]) / out_sq;
+        float mag = sqrtf(SQ(inv_re) + SQ(inv_im))
+                / (sqrtf(1.0f + SQ(omega / current_bandwidth)) * (1.0f + SQ(omega / pll_bandwidth)));
+        float phase = atan2f(inv_im, inv_re)
+                - atanf(omega / current_bandwidth) - 2.0f * atanf(omega / pll_bandwidth);
+        inertia += mag * sinf(phase) / omega / (float)freq_response_.num_points_done_;
+        viscous += mag * cosf(phase) / (float)freq_response_.num_points_done_;
+    }
+
+    // PI velocity loop: L = vel_gain * (1 + wi / s) / (inertia * s), with the
+    // phase lost to the sampling, the current loop and the encoder PLL
+    const float wc = config_.auto_tune_vel_bandwidth;
+    const float delay = current_meas_period * (float)control_loop_divider()
+            * (float)std::max(ctrl_config.vel_loop_divider, (int32_t)1)
+            + 1.0f / current_bandwidth + 2.0f / pll_bandwidth;
+    float integrator_phase = 0.5f * M_PI - config_.auto_tune_phase_margin * (M_PI / 180.0f) - wc * delay;
+    if (!(inertia > 0.0f && std::isfinite(inertia) && wc > 0.0f && integrator_phase >= 0.0f)) {
+        error_ |= ERROR_AUTO_TUNING_FAILED;
+        return false;
+    }
+    float wi = wc * tanf(integrator_phase);
+    float vel_gain = inertia * wc / sqrtf(1.0f + SQ(wi / wc));
+
+    ctrl_config.inertia = inertia;
+    controller_.inertia_estimate_ = inertia;
+    ctrl_config.friction_viscous = std::max(viscous, 0.0f);
+    ctrl_config.vel_gain = vel_gain;
+    ctrl_config.vel_integrator_gain = vel_gain * wi;
+    ctrl_config.pos_gain = config_.auto_tune_pos_bandwidth_ratio * wc;
+    return true;
+}
+
+bool Axis::endstop_active() {
+    bool level = HAL_GPIO_ReadPin(endstop_port_, endstop_pin_) == GPIO_PIN_SET;
+    return level != config_.homing_endstop_active_low;
+}
+
+// @brief Latches the linear encoder count on the edge that reaches the endstop.
+// None of the GPIOs is an input of an encoder timer, so the count is taken in
+// the edge interrupt, which runs at the highest priority.
+RAM_FUNC void Axis::endstop_cb() {
+    if (!endstop_capture_armed_ || !endstop_active())
+        return;
+    int32_t count = encoder_.shadow_count_;
+    if (encoder_.config_.mode == Encoder::MODE_INCREMENTAL)
+        count += (int16_t)((uint16_t)encoder_.hw_config_.timer->Instance->CNT - (uint16_t)count);
+    endstop_count_ = count;
+    endstop_capture_armed_ = false;
+    endstop_hit_ = true;
+}
+
+// @brief Checks that config.homing_endstop_gpio is not used by anything else.
+// The endstop takes over the EXTI line of its pin number, which the step
+// inputs, the index inputs and the endstops of other axes share across ports.
+bool Axis::endstop_gpio_available() {
+    const int32_t gpio_num = config_.homing_endstop_gpio;
+    if (gpio_num < 1 || gpio_num > GPIO_COUNT)
+        return false;
+    GPIO_TypeDef* port = get_gpio_port_by_pin((uint16_t)gpio_num);
+    uint16_t pin = get_gpio_pin_by_pin((uint16_t)gpio_num);
+#if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
+    if (board_config.enable_uart && (gpio_num == 1 || gpio_num == 2))
+        return false;
+#endif
+    if (is_endpoint_ref_valid(board_config.pwm_mappings[gpio_num - 1].endpoint))
+        return false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        const Encoder::Config_t& enc_config = axis.encoder_.config_;
+        if ((axis.config_.enable_step_dir || axis.enable_step_dir_)
+                && (axis.hw_config_.step_pin == pin || (axis.hw_config_.dir_port == port && axis.hw_config_.dir_pin == pin)))
+            return false;
+        if (enc_config.use_index && axis.encoder_.hw_config_.index_pin == pin)
+            return false;
+        if (enc_config.mode == Encoder::MODE_SPI_ABS_AMS && enc_config.abs_spi_cs_gpio_pin == gpio_num)
+            return false;
+        if (enc_config.mode == Encoder::MODE_SINCOS
+                && (enc_config.sincos_gpio_pin_sin == gpio_num || enc_config.sincos_gpio_pin_cos == gpio_num))
+            return false;
+        if (&axis != this && axis.current_state_ == AXIS_STATE_HOMING && axis.endstop_pin_ == pin)
+            return false;
+    }
+    return true;
+}
+
+// Moves in velocity control at config.homing_vel until the endstop edge (after
+// leaving the endstop first if it starts on it). The reference point is the
+// edge, or with homing_use_index the first index pulse on the way back from
+// it, and gets the position homing_offset. Then moves homing_backoff away
+// from the endstop with a trajectory. The endstop pin gets its previous mode
+// back at the end.
+bool Axis::run_homing() {
+    is_homed_ = false;
+    const float vel = config_.homing_vel;
+    const float dir = vel > 0.0f ? 1.0f : -1.0f;
+    if (!endstop_gpio_available() || !(fabsf(vel) > 0.0f)
+            || (config_.homing_use_index && !encoder_.config_.use_index)) {
+        error_ |= ERROR_HOMING_FAILED;
+        return false;
+    }
+    endstop_port_ = get_gpio_port_by_pin(config_.homing_endstop_gpio);
+    endstop_pin_ = get_gpio_pin_by_pin(config_.homing_endstop_gpio);
+    const uint32_t field_mask = 0x3U << (2U * __builtin_ctz(endstop_pin_));
+    const uint32_t saved_moder = endstop_port_->MODER & field_mask;
+    const uint32_t saved_pupdr = endstop_port_->PUPDR & field_mask;
+    auto restore_endstop_pin = [&]() {
+        uint32_t prim = __get_PRIMASK();
+        __disable_irq();
+        endstop_port_->PUPDR = (endstop_port_->PUPDR & ~field_mask) | saved_pupdr;
+        endstop_port_->MODER = (endstop_port_->MODER & ~field_mask) | saved_moder;
+        __set_PRIMASK(prim);
+    };
+    GPIO_InitTypeDef GPIO_InitStruct;
+    GPIO_InitStruct.Pin = endstop_pin_;
+    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Pull = config_.homing_endstop_active_low ? GPIO_PULLUP : GPIO_PULLDOWN;
+    HAL_GPIO_Init(endstop_port_, &GPIO_InitStruct);
+    endstop_capture_armed_ = false;
+    endstop_hit_ = false;
+    if (!GPIO_subscribe_edges(endstop_port_, endstop_pin_, endstop_cb_wrapper, this)) {
+        restore_endstop_pin();
+        error_ |= ERROR_HOMING_FAILED;
+        return false;
+    }
+    GPIO_set_edge_interrupt_enabled(endstop_pin_, true);
+
+    Controller::Config_t& ctrl_config = controller_.config_;
+    Controller::ControlMode_t saved_control_mode = ctrl_config.control_mode;
+    bool saved_vel_ramp = ctrl_config.vel_ramp_enable;
+    ctrl_config.control_mode = Controller::CTRL_MODE_VELOCITY_CONTROL;
+    ctrl_config.vel_ramp_enable = false;
+
+    enum { LEAVE_ENDSTOP, SEARCH_ENDSTOP, SEARCH_INDEX, BACK_OFF } phase = SEARCH_ENDSTOP;
+    if (endstop_active()) {
+        phase = LEAVE_ENDSTOP;
+        controller_.vel_setpoint_ = -vel;
+    } else {
+        endstop_capture_armed_ = true;
+        controller_.vel_setpoint_ = vel;
+    }
+    const float cpr = (float)encoder_.config_.cpr;
+    const uint32_t timeout_cycles = (uint32_t)(config_.homing_timeout * current_meas_hz / (float)control_loop_divider());
+    uint32_t i = 0;
+    bool index_armed = false;
+    bool done = false;
+
+    // Sets the position of the reference point and plans the back off from
+    // the present setpoints, so that the axis slows down smoothly
+    auto set_reference = [&](int32_t reference_count) {
+        encoder_.shift_linear_count((int32_t)roundf(config_.homing_offset) - reference_count);
+        ctrl_config.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+        controller_.pos_setpoint_ = encoder_.pos_estimate_;
+        controller_.clear_move_queue();
+        controller_.queue_move(roundf(config_.homing_offset) - dir * config_.homing_backoff);
+        controller_.apply_setpoint({ Controller::CTRL_MODE_TRAJECTORY_CONTROL, 0.0f, 0.0f, 0.0f });
+        phase = BACK_OFF;
+    };
+
+    run_control_loop([&](){
+        if (++i > timeout_cycles)
+            return error_ |= ERROR_HOMING_FAILED, false;
+        float away = dir * ((float)endstop_count_ - (float)encoder_.shadow_count_); // [counts] from the edge
+        switch (phase) {
+            case LEAVE_ENDSTOP:
+                if (!endstop_active()) {
+                    endstop_capture_armed_ = true;
+                    controller_.vel_setpoint_ = vel;
+                    phase = SEARCH_ENDSTOP;
+                }
+                break;
+            case SEARCH_ENDSTOP:
+                if (!endstop_hit_)
+                    break;
+                if (!config_.homing_use_index) {
+                    set_reference(endstop_count_);
+                    break;
+                }
+                controller_.vel_setpoint_ = -vel;
+                phase = SEARCH_INDEX;
+                break;
+            case SEARCH_INDEX:
+                // Index pulses count from where the axis passes the edge again
+                if (!index_armed && away > 0.0f) {
+                    encoder_.index_found_ = false;
+                    index_armed = true;
+                } else if (index_armed && encoder_.index_found_) {
+                    // The index callback counts from zero at the index. The
+                    // offset calibration is relative to the same index.
+                    encoder_.is_ready_ = true;
+                    set_reference(0);
+                } else if (away > cpr) {
+                    return error_ |= ERROR_HOMING_FAILED, false;
+                }
+                break;
+            case BACK_OFF:
+                done = ctrl_config.control_mode != Controller::CTRL_MODE_TRAJECTORY_CONTROL;
+                break;
+        }
+
+        float current_setpoint;
+        if (!controller_.update(encoder_.pos_estimate_turns_, encoder_.pos_estimate_in_turn_,
+                encoder_.vel_estimate_, encoder_.pos_estimate_in_turn_, &current_setpoint))
+            return error_ |= ERROR_CONTROLLER_FAILED, false;
+        current_setpoint = std::max(std::min(current_setpoint, config_.homing_current_lim),
+                                    -config_.homing_current_lim);
+        if (!motor_.update(current_setpoint, encoder_.phase_, encoder_.phase_vel_))
+            return false; // set_error should update axis.error_
+        return !done;
+    });
+    GPIO_set_edge_interrupt_enabled(endstop_pin_, false);
+    GPIO_unsubscribe(endstop_port_, endstop_pin_);
+    restore_endstop_pin();
+    endstop_capture_armed_ = false;
+    ctrl_config.control_mode = saved_control_mode;
+    ctrl_config.vel_ramp_enable = saved_vel_ramp;
+    if (error_ != ERROR_NONE)
+        return false;
+    is_homed_ = done;
+    return done; // false if interrupted by a state change request
+}
+
 // Note run_sensorless_control_loop and run_closed_loop_control_loop are very similar and differ only in where we get the estimate from.
 bool Axis::run_sensorless_control_loop() {
     set_step_dir_enabled(config_.enable_step_dir);
@@ -172,29 +1172,84 @@ bool Axis::run_sensorless_control_loop() {
         if (controller_.config_.control_mode >= Controller::CTRL_MODE_POSITION_CONTROL)
             return error_ |= ERROR_POS_CTRL_DURING_SENSORLESS, false;
 
-        // Note that all estimators are updated in the loop prefix in run_control_loop
+        // Note that the estimators of this state are updated in the loop prefix in run_control_loop
         float current_setpoint;
-        if (!controller_.update(sensorless_estimator_.pll_pos_, sensorless_estimator_.vel_estimate_, &current_setpoint))
+        if (!controller_.update(0, sensorless_estimator_.pll_pos_, sensorless_estimator_.vel_estimate_,
+                sensorless_estimator_.pll_pos_, &current_setpoint))
             return error_ |= ERROR_CONTROLLER_FAILED, false;
-        if (!motor_.update(current_setpoint, sensorless_estimator_.phase_))
+        motor_.hfi_voltage_ = sensorless_estimator_.hfi_active_ ? sensorless_estimator_.config_.hfi_voltage : 0.0f;
+        if (!motor_.update(current_setpoint, sensorless_estimator_.phase_, sensorless_estimator_.vel_estimate_))
             return false; // set_error should update axis.error_
         return true;
     });
+    motor_.hfi_voltage_ = 0.0f;
     set_step_dir_enabled(false);
     return check_for_errors();
 }
 
 bool Axis::run_closed_loop_control_loop() {
     set_step_dir_enabled(config_.enable_step_dir);
-    run_control_loop([this](){
-        // Note that all estimators are updated in the loop prefix in run_control_loop
+    shared_current_seen_seq_ = shared_current_seq_;
+    shared_current_started_ = false;
+    start_sequence_moves();
+    auto update_handler = [this](){
+        // Note that the estimators of this state are updated in the loop prefix in run_control_loop
         float current_setpoint;
-        if (!controller_.update(encoder_.pos_estimate_, encoder_.vel_estimate_, &current_setpoint))
+        // An axis that shares the load of another one runs no controller,
+        // the other axis hands over the current command
+        if (get_torque_share_leader()) {
+            if (!get_shared_current_setpoint(&current_setpoint))
+                return false;
+            if (!motor_.update(current_setpoint, encoder_.phase_, encoder_.phase_vel_))
+                return false; // set_error should update axis.error_
+            return true;
+        }
+        bool share_torque = config_.torque_share_axis >= 0;
+        // With a load encoder, only the position loop uses it. The anticogging
+        // calibration maps the motor position, so it runs on this axis' encoder.
+        bool use_load_encoder = config_.load_encoder_axis >= 0 && !controller_.anticogging_.calib_anticogging;
+        int32_t load_pos_turns;
+        float load_pos_in_turn;
+        if (use_load_encoder && !get_load_position(&load_pos_turns, &load_pos_in_turn))
+            return false;
+        if (fusion_estimator_.config_.enable) {
+            if (!controller_.update(use_load_encoder ? load_pos_turns : fusion_estimator_.pos_estimate_turns_,
+                    use_load_encoder ? load_pos_in_turn : fusion_estimator_.pos_estimate_in_turn_,
+                    fusion_estimator_.vel_estimate_, fusion_estimator_.pos_estimate_in_turn_, &current_setpoint))
+                return error_ |= ERROR_CONTROLLER_FAILED, false;
+            if (share_torque && !share_current_setpoint(&current_setpoint))
+                return false;
+            if (!motor_.update(current_setpoint, fusion_estimator_.phase_, fusion_estimator_.phase_vel_))
+                return false; // set_error should update axis.error_
+            return true;
+        }
+        if (!controller_.update(use_load_encoder ? load_pos_turns : encoder_.pos_estimate_turns_,
+                use_load_encoder ? load_pos_in_turn : encoder_.pos_estimate_in_turn_,
+                encoder_.vel_estimate_, encoder_.pos_estimate_in_turn_, &current_setpoint))
             return error_ |= ERROR_CONTROLLER_FAILED, false; //TODO: Make controller.set_error
-        if (!motor_.update(current_setpoint, encoder_.phase_))
+        if (share_torque && !share_current_setpoint(&current_setpoint))
+            return false;
+        if (isr_current_control_active_) {
+            // the current loop picks this up on the next interrupt
+            isr_current_setpoint_ = current_setpoint;
+            return true;
+        }
+        if (!motor_.update(current_setpoint, encoder_.phase_, encoder_.phase_vel_))
             return false; // set_error should update axis.error_
+        // Hand the current loop over to the interrupt once the first timings are queued
+        if (config_.enable_isr_current_control) {
+            isr_current_setpoint_ = current_setpoint;
+            isr_current_control_active_ = true;
+        }
         return true;
+    };
+    // The iteration that finds the moves done still updates the motor, so
+    // that the next state takes over without a missed deadline
+    run_control_loop([&](){
+        bool done = sequence_moves_done();
+        return update_handler() && !done;
     });
+    isr_current_control_active_ = false;
     set_step_dir_enabled(false);
     return check_for_errors();
 }
@@ -203,25 +1258,106 @@ bool Axis::run_idle_loop() {
     // run_control_loop ignores missed modulation timing updates
     // if and only if we're in AXIS_STATE_IDLE
     safety_critical_disarm_motor_pwm(motor_);
+    isr_idle_active_ = config_.enable_low_rate_idle;
     run_control_loop([this](){
         return true;
     });
+    isr_idle_active_ = false;
     return check_for_errors();
 }
 
+// @brief Appends a state to the sequence that AXIS_STATE_SEQUENCE runs.
+// The sequence states cannot be sequences themselves.
+// Returns false if the state is invalid or the sequence is full.
+bool Axis::sequence_add_state(uint32_t state) {
+    if (state == AXIS_STATE_UNDEFINED || state == AXIS_STATE_STARTUP_SEQUENCE
+            || state == AXIS_STATE_FULL_CALIBRATION_SEQUENCE || state == AXIS_STATE_SEQUENCE
+            || state > AXIS_STATE_HOMING
+            || sequence_length_ >= kSequenceLength)
+        return false;
+    sequence_[sequence_length_] = { (State_t)state, 0.0f };
+    ++sequence_length_;
+    return true;
+}
+
+// @brief Appends a move to goal_point to the closed loop control state that
+// was added last. Returns false if the sequence does not end in closed loop
+// control (and its moves) or is full.
+bool Axis::sequence_add_move(float goal_point) {
+    size_t i = sequence_length_;
+    while (i > 0 && sequence_[i - 1].state == AXIS_STATE_UNDEFINED)
+        --i;
+    if (i == 0 || sequence_[i - 1].state != AXIS_STATE_CLOSED_LOOP_CONTROL
+            || sequence_length_ >= kSequenceLength)
+        return false;
+    sequence_[sequence_length_] = { AXIS_STATE_UNDEFINED, goal_point };
+    ++sequence_length_;
+    return true;
+}
+
+void Axis::sequence_clear() {
+    sequence_length_ = 0;
+}
+
+// @brief Loads the sequence into the task chain, followed by idle. The moves
+// go to the closed loop control entry before them, which goes on with the
+// chain once they are done, except if it is the last state: that one holds
+// the goal until another state is requested.
+// @return: the number of task chain entries used
+size_t Axis::load_sequence() {
+    size_t pos = 0;
+    size_t num_goals = 0;
+    for (size_t i = 0; i < sequence_length_ && i < kSequenceLength; ++i) {
+        const SequenceStep_t& step = sequence_[i];
+        if (step.state == AXIS_STATE_UNDEFINED) {
+            if (pos > 0) { // checked by sequence_add_move
+                sequence_goals_[num_goals++] = step.goal_point;
+                ++task_chain_moves_[pos - 1].count;
+            }
+            continue;
+        }
+        task_chain_moves_[pos] = { (uint8_t)num_goals, 0, true };
+        task_chain_[pos++] = step.state;
+    }
+    if (pos > 0)
+        task_chain_moves_[pos - 1].exit_when_done = false;
+    task_chain_[pos++] = AXIS_STATE_IDLE;
+    return pos;
+}
+
+// @brief Queues the moves of the task chain entry that is about to run, if
+// any, starting from the position estimate. The moves of a sequence fit in
+// the move queue.
+// This must be called from the control loop thread, after arming.
+void Axis::start_sequence_moves() {
+    const ChainMoves_t& moves = task_chain_moves_[0];
+    if (!moves.count)
+        return;
+    controller_.clear_move_queue();
+    for (size_t i = 0; i < moves.count; ++i)
+        controller_.queue_move(sequence_goals_[moves.first + i]);
+    controller_.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+    controller_.pos_setpoint_ = encoder_.pos_estimate_;
+    controller_.vel_setpoint_ = 0.0f;
+    controller_.apply_setpoint({ Controller::CTRL_MODE_TRAJECTORY_CONTROL, 0.0f, 0.0f, 0.0f });
+}
+
+// @brief True once the moves of the running task chain entry are done and
+// the chain goes on without a host request.
+bool Axis::sequence_moves_done() {
+    const ChainMoves_t& moves = task_chain_moves_[0];
+    return moves.count && moves.exit_when_done
+            && controller_.config_.control_mode != Controller::CTRL_MODE_TRAJECTORY_CONTROL
+            && controller_.move_queue_count_ == 0;
+}
+
 // Infinite loop that does calibration and enters main control loop as appropriate
 void Axis::run_state_machine_loop() {
 
-    // Allocate the map for anti-cogging algorithm and initialize all values to 0.0f
-    // TODO: Move this somewhere else
     // TODO: respect changes of CPR
-    int encoder_cpr = encoder_.config_.cpr;
-    controller_.anticogging_.cogging_map = (float*)malloc(encoder_cpr * sizeof(float));
-    if (controller_.anticogging_.cogging_map != NULL) {
-        for (int i = 0; i < encoder_cpr; i++) {
-            controller_.anticogging_.cogging_map[i] = 0.0f;
-        }
-    }
+    if (!(controller_.config_.anticogging_map_in_flash && reference_anticogging_map(*this))
+            && controller_.allocate_anticogging_map())
+        load_anticogging_map(*this);
 
     // arm!
     motor_.arm();
@@ -230,7 +1366,10 @@ void Axis::run_state_machine_loop() {
         // Load the task chain if a specific request is pending
         if (requested_state_ != AXIS_STATE_UNDEFINED) {
             size_t pos = 0;
-            if (requested_state_ == AXIS_STATE_STARTUP_SEQUENCE) {
+            memset(task_chain_moves_, 0, sizeof(task_chain_moves_));
+            if (requested_state_ == AXIS_STATE_SEQUENCE) {
+                pos = load_sequence();
+            } else if (requested_state_ == AXIS_STATE_STARTUP_SEQUENCE) {
                 if (config_.startup_motor_calibration)
                     task_chain_[pos++] = AXIS_STATE_MOTOR_CALIBRATION;
                 if (config_.startup_encoder_index_search && encoder_.config_.use_index)
@@ -263,9 +1402,24 @@ void Axis::run_state_machine_loop() {
         // Validate the state before running it
         if (current_state_ > AXIS_STATE_MOTOR_CALIBRATION && !motor_.is_calibrated_)
             current_state_ = AXIS_STATE_UNDEFINED;
-        if (current_state_ > AXIS_STATE_ENCODER_OFFSET_CALIBRATION && !encoder_.is_ready_)
+        if (current_state_ > AXIS_STATE_ENCODER_OFFSET_CALIBRATION
+                && current_state_ != AXIS_STATE_SENSORLESS_FLUX_IDENTIFICATION && !encoder_.is_ready_)
             current_state_ = AXIS_STATE_UNDEFINED;
 
+        // The startup sequence ends in idle or one of the control states
+        if (!startup_done_ && (current_state_ == AXIS_STATE_IDLE
+                || current_state_ == AXIS_STATE_CLOSED_LOOP_CONTROL
+                || current_state_ == AXIS_STATE_SENSORLESS_CONTROL)) {
+            startup_done_ = true;
+            bool all_done = true;
+            for (size_t i = 0; i < AXIS_COUNT; ++i)
+                all_done = all_done && axes[i]->startup_done_;
+            if (all_done)
+                system_stats_.ready_time = HAL_GetTick();
+        }
+
+        trace.emit(Trace::EVENT_AXIS_STATE, trace_source(this), current_state_, error_);
+
         // Run the specified state
         // Handlers should exit if requested_state != AXIS_STATE_UNDEFINED
         bool status;
@@ -280,10 +1434,15 @@ void Axis::run_state_machine_loop() {
 
             case AXIS_STATE_ENCODER_OFFSET_CALIBRATION:
                 status = encoder_.run_offset_calibration();
+                if (status && encoder_.config_.calibrate_correction_table)
+                    status = encoder_.run_correction_table_calibration();
                 break;
 
             case AXIS_STATE_SENSORLESS_CONTROL:
-                status = run_sensorless_spin_up(); // TODO: restart if desired
+                if (sensorless_estimator_.config_.enable_hfi)
+                    status = run_hfi_startup();
+                else
+                    status = run_sensorless_spin_up(); // TODO: restart if desired
                 if (status)
                     status = run_sensorless_control_loop();
                 break;
@@ -292,6 +1451,26 @@ void Axis::run_state_machine_loop() {
                 status = run_closed_loop_control_loop();
                 break;
 
+            case AXIS_STATE_SENSORLESS_FLUX_IDENTIFICATION:
+                status = run_sensorless_flux_identification();
+                break;
+
+            case AXIS_STATE_FRICTION_IDENTIFICATION:
+                status = run_friction_identification();
+                break;
+
+            case AXIS_STATE_FREQUENCY_RESPONSE:
+                status = run_frequency_response();
+                break;
+
+            case AXIS_STATE_AUTO_TUNING:
+                status = run_auto_tuning();
+                break;
+
+            case AXIS_STATE_HOMING:
+                status = run_homing();
+                break;
+
             case AXIS_STATE_IDLE:
                 run_idle_loop();
                 status = motor_.arm(); // done with idling - try to arm the motor
@@ -304,9 +1483,11 @@ void Axis::run_state_machine_loop() {
         }
 
         // If the state failed, go to idle, else advance task chain
-        if (!status)
+        if (!status) {
             current_state_ = AXIS_STATE_IDLE;
-        else
-            memcpy(task_chain_, task_chain_ + 1, sizeof(task_chain_) - sizeof(task_chain_[0]));
+        } else {
+            memmove(task_chain_, task_chain_ + 1, sizeof(task_chain_) - sizeof(task_chain_[0]));
+            memmove(task_chain_moves_, task_chain_moves_ + 1, sizeof(task_chain_moves_) - sizeof(task_chain_moves_[0]));
+        }
     }
 }
@@ -20,6 +20,16 @@ public:
         ERROR_ENCODER_FAILED = 0x100, // Go to encoder.hpp for information, check odrvX.axisX.encoder.error for error value
         ERROR_CONTROLLER_FAILED = 0x200,
         ERROR_POS_CTRL_DURING_SENSORLESS = 0x400,
+        ERROR_SENSORLESS_SPIN_UP_FAILED = 0x800, //<! the sensorless estimator did not lock on during any spin-up attempt
+        ERROR_LOAD_ENCODER_FAILED = 0x1000, //<! config.load_encoder_axis is invalid or its encoder has an error
+        ERROR_TORQUE_SHARE_FAILED = 0x2000, //<! config.torque_share_axis is invalid, or the current command of the
+                                            //   sharing axis stopped arriving
+        ERROR_FRICTION_IDENTIFICATION_FAILED = 0x4000, //<! a velocity of the sweep was not reached, or the fit failed
+        ERROR_FREQUENCY_RESPONSE_FAILED = 0x8000, //<! the frequency_response.config is invalid
+        ERROR_AUTO_TUNING_FAILED = 0x10000, //<! the measured inertia is invalid, or the target bandwidth
+                                            //   leaves no room for the phase margin
+        ERROR_HOMING_FAILED = 0x20000, //<! the homing settings are invalid, the endstop or the index was
+                                       //   not found, or config.homing_timeout passed
     };
 
     // Warning: Do not reorder these enum values.
@@ -33,7 +43,36 @@ public:
         AXIS_STATE_SENSORLESS_CONTROL = 5,  //<! run sensorless control
         AXIS_STATE_ENCODER_INDEX_SEARCH = 6, //<! run encoder index search
         AXIS_STATE_ENCODER_OFFSET_CALIBRATION = 7, //<! run encoder offset calibration
-        AXIS_STATE_CLOSED_LOOP_CONTROL = 8  //<! run closed loop control
+        AXIS_STATE_CLOSED_LOOP_CONTROL = 8,  //<! run closed loop control
+        AXIS_STATE_SENSORLESS_FLUX_IDENTIFICATION = 9, //<! spin up open loop and measure pm_flux_linkage, then idle
+        AXIS_STATE_FRICTION_IDENTIFICATION = 10, //<! sweep the velocity in closed loop and fit controller.config.friction_*, then idle
+        AXIS_STATE_FREQUENCY_RESPONSE = 11, //<! run closed loop control with a sine sweep injected, see FrequencyResponse, then idle
+        AXIS_STATE_AUTO_TUNING = 12, //<! measure the inertia and set the controller gains for config.auto_tune_*, then idle
+        AXIS_STATE_SEQUENCE = 13, //<! run the states and moves added with sequence_add_state/sequence_add_move, then idle
+        AXIS_STATE_HOMING = 14, //<! find the endstop at config.homing_endstop_gpio and set the position, then idle
+    };
+
+    static constexpr size_t kSequenceLength = 8;
+
+    // One step of the sequence run by AXIS_STATE_SEQUENCE
+    struct SequenceStep_t {
+        State_t state;     // AXIS_STATE_UNDEFINED for a move of the closed loop step before it
+        float goal_point;  // [counts] of the move
+    };
+
+    // Moves of one entry of the task chain, see run_closed_loop_control_loop
+    struct ChainMoves_t {
+        uint8_t first;       // index into sequence_goals_
+        uint8_t count;
+        bool exit_when_done; // go on with the chain once the moves are done
+    };
+
+    // Position and velocity estimators that do_updates() can run
+    enum Estimator_t {
+        ESTIMATOR_NONE = 0x00,
+        ESTIMATOR_ENCODER = 0x01,
+        ESTIMATOR_SENSORLESS = 0x02,
+        ESTIMATOR_FUSION = 0x04, // needs the other two
     };
 
     struct Config_t {
@@ -47,6 +86,17 @@ public:
                                     //   For M0 this has no effect if enable_uart is true
 
         float counts_per_step = 2.0f;
+        bool step_dir_use_timer = false; //<! count the step pulses with a hardware timer instead of an interrupt per step.
+                                         //   Only available on M0 and not together with PWM input on GPIO 1-4.
+        float step_dir_filter_bandwidth = 0.0f; //<! [rad/s] smooth the step input and estimate the velocity feed forward from it, 0 to disable
+
+        // Current loop in interrupt context
+        bool enable_isr_current_control = false; //<! run Encoder::update and the FOC current loop directly in the
+                                                 //   current measurement interrupt during closed loop control
+        int32_t isr_control_divider = 1; //<! in this mode the controller thread only runs every N-th current measurement
+        bool enable_low_rate_idle = false; //<! while idle, only track the encoder in the current measurement interrupt
+                                           //   and run the thread every idle_loop_divider measurements
+        int32_t idle_loop_divider = 16;    //<! limited to a thread rate of at least 100Hz
 
         // Spinup settings
         float ramp_up_time = 0.4f;            // [s]
@@ -54,10 +104,59 @@ public:
         float spin_up_current = 10.0f;        // [A]
         float spin_up_acceleration = 400.0f;  // [rad/s^2]
         float spin_up_target_vel = 400.0f;    // [rad/s]
-    };
+        bool spin_up_lock_detection = false;  //<! hand over to sensorless control as soon as the estimator locks on
+        float spin_up_lock_min_vel = 100.0f;  // [rad/s] below this the estimator is not trusted
+        float spin_up_lock_phase_tol = 0.5f;  // [rad] max deviation of the estimated from the forced phase
+        float spin_up_lock_time = 0.05f;      // [s] time the estimator must track before handing over
+        int32_t spin_up_max_retries = 2;      //<! negative values count as 0
+        float spin_up_retry_delay = 0.5f;     // [s] time without current before a retry
+
+        // Flux linkage identification settings
+        float flux_ident_settle_time = 0.2f;  // [s] time at spin_up_target_vel before measuring
+        float flux_ident_duration = 0.5f;     // [s] time over which the back-EMF is averaged
 
-    enum thread_signals {
-        M_SIGNAL_PH_CURRENT_MEAS = 1u << 0
+        // Friction identification settings
+        float friction_ident_max_vel = 10000.0f; // [counts/s] highest velocity of the sweep
+        float friction_ident_settle_time = 1.0f; // [s] time at each velocity before measuring
+        float friction_ident_duration = 0.2f;    // [s] time over which the current is averaged at each velocity
+        bool friction_ident_stribeck = false;    // also fit controller.config.friction_stribeck
+
+        // Auto tuning settings
+        float auto_tune_vel_bandwidth = 100.0f;   // [rad/s] crossover frequency of the velocity loop
+        float auto_tune_phase_margin = 60.0f;     // [deg] of the velocity loop
+        float auto_tune_pos_bandwidth_ratio = 0.25f; // position loop bandwidth relative to auto_tune_vel_bandwidth
+        float auto_tune_excitation_current = 1.0f; // [A] amplitude of the injected sine
+        float auto_tune_frequency = 20.0f;        // [Hz] the inertia is measured at half, one and two times this
+
+        // Homing settings
+        int32_t homing_endstop_gpio = 0;       // GPIO of the endstop switch, 0 if there is none
+        bool homing_endstop_active_low = true; // the switch pulls the input low at the endstop, against the internal pull-up
+        float homing_vel = -2000.0f;           // [counts/s] towards the endstop
+        float homing_current_lim = 5.0f;       // [A]
+        bool homing_use_index = false;         // the reference point is the first index pulse away from the endstop
+                                               // instead of the endstop edge. Needs encoder.config.use_index.
+        float homing_offset = 0.0f;            // [counts] position of the reference point after homing
+        float homing_backoff = 1000.0f;        // [counts] distance from the reference point at which homing ends,
+                                               // away from the endstop
+        float homing_timeout = 30.0f;          // [s]
+
+        // CAN motion protocol settings (see interface_can.cpp)
+        uint32_t can_node_id = 0;         //<! message ID = (can_node_id << 5) | command, must be below 0x38.
+                                          //   Defaults to the axis number. Applied within 1 ms.
+        uint32_t can_feedback_period_ms = 10; //<! period of the encoder and Iq feedback messages, 0 to disable
+        bool can_use_sync = false; //<! apply CAN setpoints and sample the feedback on the SYNC message (ID 0x080).
+                                   //   The feedback is then sent after every SYNC instead of periodically.
+        uint32_t shadow_estimators = ESTIMATOR_NONE; //<! estimators (see Estimator_t) to run in all states, even if the state
+                                                     //   doesn't use them, e.g. to watch sensorless_estimator during closed loop control
+        int32_t load_encoder_axis = -1; //<! axis whose encoder measures the load for the position loop in closed loop control,
+                                        //   -1 to use this axis' encoder. Commutation and the velocity loop use this axis' encoder.
+        float load_encoder_ratio = 1.0f; //<! [counts/count] counts of this axis' encoder per load encoder count
+        int32_t torque_share_axis = -1; //<! axis whose motor drives the same load. In closed loop control, this axis'
+                                        //   controller then commands both motors and the other axis only follows.
+        float torque_share_ratio = 0.5f; //<! fraction of the current command that goes to the motor of torque_share_axis
+        float torque_share_preload = 0.0f; //<! [A] added to this motor and taken off the other one, so that they
+                                           //   pull against each other to take up the backlash
+        bool torque_share_invert = false; //<! the other motor drives the load in the opposite direction
     };
 
     Axis(const AxisHardwareConfig_t& hw_config,
@@ -66,22 +165,41 @@ public:
             SensorlessEstimator& sensorless_estimator,
             Controller& controller,
             Motor& motor,
-            TrapezoidalTrajectory& trap);
+            TrapezoidalTrajectory& trap,
+            FusionEstimator& fusion_estimator);
 
     void setup();
     void start_thread();
+    void update_derived_values();
     void signal_current_meas();
     bool wait_for_current_meas();
+    void handle_current_meas();
+    uint32_t control_loop_divider();
+    uint64_t get_meas_count();
 
     void step_cb();
+    void endstop_cb();
+    bool endstop_active();
+    void dir_cb();
     void set_step_dir_enabled(bool enable);
+    bool start_step_timer();
+    void update_step_timer();
+    void update_step_filter();
 
     bool check_DRV_fault();
     bool check_PSU_brownout();
     bool do_checks();
+    uint32_t get_required_estimators();
     bool do_updates();
+    void clear_covered_encoder_error();
+    void trace_errors();
     float get_temp();
-
+    bool sequence_add_state(uint32_t state);
+    bool sequence_add_move(float goal_point);
+    void sequence_clear();
+    size_t load_sequence();
+    void start_sequence_moves();
+    bool sequence_moves_done();
 
     // True if there are no errors
     bool inline check_for_errors() {
@@ -113,7 +231,7 @@ public:
         while (requested_state_ == AXIS_STATE_UNDEFINED) {
             // look for errors at axis level and also all subcomponents
             bool checks_ok = do_checks();
-            // Update all estimators
+            // Update the estimators that the current state uses
             // Note: updates run even if checks fail
             bool updates_ok = do_updates(); 
             
@@ -127,9 +245,12 @@ public:
             // Run main loop function, defer quitting for after wait
             // TODO: change arming logic to arm after waiting
             bool main_continue = update_handler();
+            publish_snapshot();
 
             // Check we meet deadlines after queueing
-            ++loop_counter_;
+            // While the current loop runs in the ISR, the ISR counts the loops
+            if (!isr_current_control_active_ && !isr_idle_active_)
+                ++loop_counter_;
 
             // Wait until the current measurement interrupt fires
             if (!wait_for_current_meas()) {
@@ -146,13 +267,29 @@ public:
         }
     }
 
+    bool run_open_loop_spin_up(bool detect_lock, float* final_phase, bool* locked, uint32_t* cycles);
     bool run_sensorless_spin_up();
+    bool run_hfi_startup();
+    bool run_sensorless_flux_identification();
+    bool run_friction_identification();
+    bool run_frequency_response();
+    bool run_auto_tuning();
+    bool endstop_gpio_available();
+    bool run_homing();
     bool run_sensorless_control_loop();
     bool run_closed_loop_control_loop();
     bool run_idle_loop();
 
     void run_state_machine_loop();
 
+    void publish_snapshot();
+    bool take_snapshot();
+    std::tuple<float, float, float, uint32_t> get_feedback();
+    bool get_load_position(int32_t* pos_turns, float* pos_in_turn);
+    Axis* get_torque_share_leader();
+    bool share_current_setpoint(float* current_setpoint);
+    bool get_shared_current_setpoint(float* current_setpoint);
+
     const AxisHardwareConfig_t& hw_config_;
     Config_t& config_;
 
@@ -161,26 +298,88 @@ public:
     Controller& controller_;
     Motor& motor_;
     TrapezoidalTrajectory& trap_;
+    FusionEstimator& fusion_estimator_;
 
     osThreadId thread_id_;
     volatile bool thread_id_valid_ = false;
+    volatile uint32_t current_meas_signal_cycles_ = 0; // DWT->CYCCNT when the ISR last woke up the thread
 
     // variables exposed on protocol
     Error_t error_ = ERROR_NONE;
     bool enable_step_dir_ = false; // auto enabled after calibration, based on config.enable_step_dir
+    bool step_timer_active_ = false; // steps are counted by hw_config_.step_timer
+    uint32_t step_timer_count_ = 0;  // step timer count at the last update_step_timer()
+    // Step input filter, latched when step/dir is enabled. While active, the
+    // steps go to step_pos_ and the filter state drives the controller setpoints.
+    bool step_filter_active_ = false;
+    float step_pos_ = 0.0f;        // [counts] unfiltered step input position
+    float step_filter_pos_ = 0.0f; // [counts]
+    float step_filter_vel_ = 0.0f; // [counts/s]
+    Pll<float, PLL_MODE_LINEAR> step_filter_;
     State_t requested_state_ = AXIS_STATE_STARTUP_SEQUENCE;
     State_t task_chain_[10] = { AXIS_STATE_UNDEFINED };
     State_t& current_state_ = task_chain_[0];
+    ChainMoves_t task_chain_moves_[10] = {};
+    // Steps added by the host, and the moves of the sequence that runs
+    SequenceStep_t sequence_[kSequenceLength] = {};
+    uint32_t sequence_length_ = 0;
+    float sequence_goals_[kSequenceLength] = { 0.0f };
+    bool startup_done_ = false;         // the startup sequence reached idle or a control state
+    bool is_homed_ = false;             // the last homing succeeded
     uint32_t loop_counter_ = 0;
+    uint64_t meas_count_ = 0;           // [current measurements] monotonic time base, counted in the ISR
+    uint32_t active_estimators_ = ESTIMATOR_NONE; // estimators that ran in the last do_updates(), see Estimator_t
+    uint32_t spin_up_attempts_ = 0;     // number of spin-up attempts of the last sensorless start
+    float spin_up_handoff_time_ = 0.0f; // [s] time from the start of the last sensorless spin-up to the handoff
+    // Errors at the last trace_errors(), to emit only the changes
+    Error_t traced_error_ = ERROR_NONE;
+    Motor::Error_t traced_motor_error_ = Motor::ERROR_NONE;
+    Encoder::Error_t traced_encoder_error_ = Encoder::ERROR_NONE;
+
+    // Current command handed over by the axis that shares its torque with this one
+    // (see share_current_setpoint). shared_current_seq_ counts the hand-overs.
+    volatile float shared_current_setpoint_ = 0.0f; // [A]
+    volatile uint32_t shared_current_seq_ = 0;
+    uint32_t shared_current_seen_seq_ = 0;
+    uint32_t shared_current_missed_ = 0; // consecutive iterations without a new command
+    bool shared_current_started_ = false; // a command arrived since entering closed loop control
+
+    // Shared with the current measurement interrupt (see handle_current_meas)
+    volatile bool isr_current_control_active_ = false;
+    volatile float isr_current_setpoint_ = 0.0f; // [A]
+    volatile bool isr_idle_active_ = false; // the ISR only updates the encoder, see run_idle_loop
+
+    // Endstop input during homing, the count is latched by endstop_cb
+    GPIO_TypeDef* endstop_port_ = nullptr;
+    uint16_t endstop_pin_ = 0;
+    volatile bool endstop_capture_armed_ = false;
+    volatile bool endstop_hit_ = false;
+    volatile int32_t endstop_count_ = 0; // [counts] linear count at the endstop edge
+
+    // Published at the end of every control loop iteration. snapshot_ is
+    // the copy of the last take_snapshot(), which the host reads in the
+    // same batch, so that all of its values are from one iteration.
+    AxisSnapshotBuffer snapshot_buffer_;
+    AxisSnapshot_t snapshot_ = {};
+
+    FrequencyResponse freq_response_;
 
     // Communication protocol definitions
     auto make_protocol_definitions() {
         return make_protocol_member_list(
             make_protocol_property("error", &error_),
             make_protocol_property("enable_step_dir", &enable_step_dir_),
+            make_protocol_ro_property("step_timer_active", &step_timer_active_),
             make_protocol_ro_property("current_state", &current_state_),
             make_protocol_property("requested_state", &requested_state_),
             make_protocol_ro_property("loop_counter", &loop_counter_),
+            make_protocol_ro_property("meas_count", &meas_count_),
+            make_protocol_ro_property("active_estimators", &active_estimators_),
+            make_protocol_ro_property("spin_up_attempts", &spin_up_attempts_),
+            make_protocol_ro_property("spin_up_handoff_time", &spin_up_handoff_time_),
+            make_protocol_ro_property("isr_current_control_active", const_cast<bool*>(&isr_current_control_active_)),
+            make_protocol_ro_property("isr_idle_active", const_cast<bool*>(&isr_idle_active_)),
+            make_protocol_ro_property("is_homed", &is_homed_),
             make_protocol_object("config",
                 make_protocol_property("startup_motor_calibration", &config_.startup_motor_calibration),
                 make_protocol_property("startup_encoder_index_search", &config_.startup_encoder_index_search),
@@ -189,18 +388,69 @@ public:
                 make_protocol_property("startup_sensorless_control", &config_.startup_sensorless_control),
                 make_protocol_property("enable_step_dir", &config_.enable_step_dir),
                 make_protocol_property("counts_per_step", &config_.counts_per_step),
+                make_protocol_property("step_dir_use_timer", &config_.step_dir_use_timer),
+                make_protocol_property("step_dir_filter_bandwidth", &config_.step_dir_filter_bandwidth),
+                make_protocol_property("enable_isr_current_control", &config_.enable_isr_current_control),
+                make_protocol_property("isr_control_divider", &config_.isr_control_divider),
+                make_protocol_property("enable_low_rate_idle", &config_.enable_low_rate_idle),
+                make_protocol_property("idle_loop_divider", &config_.idle_loop_divider),
                 make_protocol_property("ramp_up_time", &config_.ramp_up_time),
                 make_protocol_property("ramp_up_distance", &config_.ramp_up_distance),
                 make_protocol_property("spin_up_current", &config_.spin_up_current),
                 make_protocol_property("spin_up_acceleration", &config_.spin_up_acceleration),
-                make_protocol_property("spin_up_target_vel", &config_.spin_up_target_vel)
+                make_protocol_property("spin_up_target_vel", &config_.spin_up_target_vel),
+                make_protocol_property("spin_up_lock_detection", &config_.spin_up_lock_detection),
+                make_protocol_property("spin_up_lock_min_vel", &config_.spin_up_lock_min_vel),
+                make_protocol_property("spin_up_lock_phase_tol", &config_.spin_up_lock_phase_tol),
+                make_protocol_property("spin_up_lock_time", &config_.spin_up_lock_time),
+                make_protocol_property("spin_up_max_retries", &config_.spin_up_max_retries),
+                make_protocol_property("spin_up_retry_delay", &config_.spin_up_retry_delay),
+                make_protocol_property("flux_ident_settle_time", &config_.flux_ident_settle_time),
+                make_protocol_property("flux_ident_duration", &config_.flux_ident_duration),
+                make_protocol_property("friction_ident_max_vel", &config_.friction_ident_max_vel),
+                make_protocol_property("friction_ident_settle_time", &config_.friction_ident_settle_time),
+                make_protocol_property("friction_ident_duration", &config_.friction_ident_duration),
+                make_protocol_property("friction_ident_stribeck", &config_.friction_ident_stribeck),
+                make_protocol_property("auto_tune_vel_bandwidth", &config_.auto_tune_vel_bandwidth),
+                make_protocol_property("auto_tune_phase_margin", &config_.auto_tune_phase_margin),
+                make_protocol_property("auto_tune_pos_bandwidth_ratio", &config_.auto_tune_pos_bandwidth_ratio),
+                make_protocol_property("auto_tune_excitation_current", &config_.auto_tune_excitation_current),
+                make_protocol_property("auto_tune_frequency", &config_.auto_tune_frequency),
+                make_protocol_property("homing_endstop_gpio", &config_.homing_endstop_gpio),
+                make_protocol_property("homing_endstop_active_low", &config_.homing_endstop_active_low),
+                make_protocol_property("homing_vel", &config_.homing_vel),
+                make_protocol_property("homing_current_lim", &config_.homing_current_lim),
+                make_protocol_property("homing_use_index", &config_.homing_use_index),
+                make_protocol_property("homing_offset", &config_.homing_offset),
+                make_protocol_property("homing_backoff", &config_.homing_backoff),
+                make_protocol_property("homing_timeout", &config_.homing_timeout),
+                make_protocol_property("can_node_id", &config_.can_node_id),
+                make_protocol_property("can_feedback_period_ms", &config_.can_feedback_period_ms),
+                make_protocol_property("can_use_sync", &config_.can_use_sync),
+                make_protocol_property("shadow_estimators", &config_.shadow_estimators),
+                make_protocol_property("load_encoder_axis", &config_.load_encoder_axis),
+                make_protocol_property("load_encoder_ratio", &config_.load_encoder_ratio),
+                make_protocol_property("torque_share_axis", &config_.torque_share_axis),
+                make_protocol_property("torque_share_ratio", &config_.torque_share_ratio),
+                make_protocol_property("torque_share_preload", &config_.torque_share_preload),
+                make_protocol_property("torque_share_invert", &config_.torque_share_invert)
             ),
             make_protocol_function("get_temp", *this, &Axis::get_temp),
+            make_protocol_object("snapshot", make_axis_snapshot_definitions(snapshot_)),
+            make_protocol_function("take_snapshot", *this, &Axis::take_snapshot),
+            make_protocol_function("get_feedback", *this, &Axis::get_feedback,
+                make_protocol_outputs("pos_estimate", "vel_estimate", "Iq_measured", "error")),
+            make_protocol_ro_property("sequence_length", &sequence_length_),
+            make_protocol_function("sequence_add_state", *this, &Axis::sequence_add_state, "state"),
+            make_protocol_function("sequence_add_move", *this, &Axis::sequence_add_move, "goal_point"),
+            make_protocol_function("sequence_clear", *this, &Axis::sequence_clear),
             make_protocol_object("motor", motor_.make_protocol_definitions()),
             make_protocol_object("controller", controller_.make_protocol_definitions()),
             make_protocol_object("encoder", encoder_.make_protocol_definitions()),
             make_protocol_object("sensorless_estimator", sensorless_estimator_.make_protocol_definitions()),
-            make_protocol_object("trap_traj", trap_.make_protocol_definitions())
+            make_protocol_object("trap_traj", trap_.make_protocol_definitions()),
+            make_protocol_object("fusion_estimator", fusion_estimator_.make_protocol_definitions()),
+            make_protocol_object("frequency_response", freq_response_.make_protocol_definitions())
         );
     }
 };
@@ -0,0 +1,84 @@
+#ifndef __AXIS_SNAPSHOT_HPP
+#define __AXIS_SNAPSHOT_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief State of an axis at the end of one control loop iteration.
+// All values are from the same iteration.
+struct AxisSnapshot_t {
+    uint32_t meas_count;    // [current measurements] low 32 bits of the axis meas_count
+    float pos_estimate;     // [counts]
+    int32_t pos_estimate_turns; // pos_estimate at full resolution, see Encoder
+    float pos_estimate_in_turn; // [counts]
+    float vel_estimate;     // [counts/s]
+    float pos_setpoint;     // [counts]
+    float vel_setpoint;     // [counts/s]
+    float Iq_setpoint;      // [A]
+    float Iq_measured;      // [A]
+    float Id_measured;      // [A]
+    float vbus_voltage;     // [V]
+    uint16_t error;
+    uint16_t motor_error;
+    uint16_t encoder_error;
+    uint8_t current_state;
+};
+
+// @brief Hands the snapshot of each control loop iteration from the axis
+// thread to the communication threads and interrupts.
+//
+// The axis thread writes into the buffer that is not published and then
+// publishes it by incrementing seq_. Readers copy the published buffer and
+// copy it again if seq_ changed in the meantime, so they never block the
+// control loop.
+class AxisSnapshotBuffer {
+public:
+    // @brief Publishes a snapshot. Only the axis thread may call this.
+    void publish(const AxisSnapshot_t& snapshot) {
+        uint32_t seq = seq_;
+        buffers_[(seq + 1) & 1] = snapshot;
+        __DMB(); // finish writing the buffer before publishing it
+        seq_ = seq + 1;
+    }
+
+    // @brief Copies the newest snapshot. May be called from any thread or interrupt.
+    // @return: false if no snapshot was published yet
+    bool read(AxisSnapshot_t* snapshot) const {
+        for (;;) {
+            uint32_t seq = seq_;
+            __DMB();
+            *snapshot = buffers_[seq & 1];
+            __DMB();
+            // After publishing, the next snapshot goes to the buffer that was just copied
+            if (seq == seq_)
+                return seq != 0;
+        }
+    }
+
+private:
+    AxisSnapshot_t buffers_[2] = {};
+    volatile uint32_t seq_ = 0; // number of published snapshots
+};
+
+static inline auto make_axis_snapshot_definitions(AxisSnapshot_t& snapshot) {
+    return make_protocol_member_list(
+        make_protocol_ro_property("meas_count", &snapshot.meas_count),
+        make_protocol_ro_property("pos_estimate", &snapshot.pos_estimate),
+        make_protocol_ro_property("pos_estimate_turns", &snapshot.pos_estimate_turns),
+        make_protocol_ro_property("pos_estimate_in_turn", &snapshot.pos_estimate_in_turn),
+        make_protocol_ro_property("vel_estimate", &snapshot.vel_estimate),
+        make_protocol_ro_property("pos_setpoint", &snapshot.pos_setpoint),
+        make_protocol_ro_property("vel_setpoint", &snapshot.vel_setpoint),
+        make_protocol_ro_property("Iq_setpoint", &snapshot.Iq_setpoint),
+        make_protocol_ro_property("Iq_measured", &snapshot.Iq_measured),
+        make_protocol_ro_property("Id_measured", &snapshot.Id_measured),
+        make_protocol_ro_property("vbus_voltage", &snapshot.vbus_voltage),
+        make_protocol_ro_property("error", &snapshot.error),
+        make_protocol_ro_property("motor_error", &snapshot.motor_error),
+        make_protocol_ro_property("encoder_error", &snapshot.encoder_error),
+        make_protocol_ro_property("current_state", &snapshot.current_state)
+    );
+}
+
+#endif // __AXIS_SNAPSHOT_HPP
@@ -0,0 +1,143 @@
+#include "odrive_main.h"
+
+Benchmark benchmark;
+
+#ifndef BENCHMARK_HOST_CLOCK
+static inline uint32_t benchmark_clock() { return DWT->CYCCNT; }
+static inline uint32_t benchmark_clock_hz() { return HAL_RCC_GetHCLKFreq(); }
+#endif
+
+// Keeps the compiler from optimizing away the kernel results
+static volatile float benchmark_sink;
+
+// The inputs are looked up from tables, so that generating them doesn't count
+static constexpr size_t kNumInputs = 64;
+static float input_angle[kNumInputs]; // [rad] in [-pi, pi)
+static float input_cos[kNumInputs];
+static float input_sin[kNumInputs];
+
+template<typename TFn>
+void Benchmark::measure(BenchmarkResult_t& result, uint32_t iterations, const TFn& fn) {
+    uint32_t min = UINT32_MAX, max = 0;
+    float mean = 0.0f;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        uint32_t prim = __get_PRIMASK();
+        __disable_irq();
+        uint32_t start = benchmark_clock();
+        fn(i % kNumInputs);
+        uint32_t cycles = benchmark_clock() - start;
+        __set_PRIMASK(prim);
+
+        cycles = (cycles > overhead_) ? (cycles - overhead_) : 0;
+        if (cycles < min) min = cycles;
+        if (cycles > max) max = cycles;
+        mean += ((float)cycles - mean) / (float)(i + 1);
+    }
+    result.min = min;
+    result.max = max;
+    result.mean = mean;
+}
+
+// @brief Largest error_fn(angle) over a sweep of [-pi, pi)
+template<typename TFn>
+float Benchmark::max_error(const TFn& error_fn) {
+    constexpr size_t kNumAngles = 4096;
+    float result = 0.0f;
+    for (size_t i = 0; i < kNumAngles; ++i) {
+        float angle = ((float)i * (2.0f / (float)kNumAngles) - 1.0f) * M_PI;
+        result = std::max(result, error_fn(angle));
+    }
+    return result;
+}
+
+bool Benchmark::run(uint32_t iterations) {
+    Axis& axis = *axes[0];
+    if (axis.current_state_ != Axis::AXIS_STATE_IDLE
+            || axis.motor_.armed_state_ != Motor::ARMED_STATE_DISARMED)
+        return false;
+
+    iterations = std::max(std::min(iterations, kMaxIterations), (uint32_t)1);
+    iterations_ = iterations;
+    clock_hz_ = benchmark_clock_hz();
+    for (size_t i = 0; i < kNumInputs; ++i) {
+        input_angle[i] = ((float)i * (2.0f / (float)kNumInputs) - 1.0f) * M_PI;
+        input_cos[i] = our_arm_cos_f32(input_angle[i]);
+        input_sin[i] = our_arm_sin_f32(input_angle[i]);
+    }
+
+    BenchmarkResult_t empty;
+    overhead_ = 0;
+    measure(empty, iterations, [](size_t) {});
+    overhead_ = empty.min;
+
+    measure(results_[KERNEL_SVM], iterations, [](size_t i) {
+        float tA, tB, tC;
+        SVM(0.5f * input_cos[i], 0.5f * input_sin[i], &tA, &tB, &tC);
+        benchmark_sink = tA + tB + tC;
+    });
+    measure(results_[KERNEL_FAST_ATAN2], iterations, [](size_t i) {
+        benchmark_sink = fast_atan2(input_sin[i], input_cos[i]);
+    });
+    measure(results_[KERNEL_FAST_ATAN2_OCTANT], iterations, [](size_t i) {
+        benchmark_sink = fast_atan2_octant(input_sin[i], input_cos[i]);
+    });
+    measure(results_[KERNEL_SIN_COS], iterations, [](size_t i) {
+        benchmark_sink = our_arm_sin_f32(input_angle[i]) + our_arm_cos_f32(input_angle[i]);
+    });
+    measure(results_[KERNEL_FAST_SINCOS], iterations, [](size_t i) {
+        float s, c;
+        fast_sincos(input_angle[i], &s, &c);
+        benchmark_sink = s + c;
+    });
+
+    results_[KERNEL_FAST_ATAN2].max_error = max_error([](float angle) {
+        return fabsf(wrap_pm_pi(fast_atan2(sinf(angle), cosf(angle)) - angle));
+    });
+    results_[KERNEL_FAST_ATAN2_OCTANT].max_error = max_error([](float angle) {
+        return fabsf(wrap_pm_pi(fast_atan2_octant(sinf(angle), cosf(angle)) - angle));
+    });
+    results_[KERNEL_SIN_COS].max_error = max_error([](float angle) {
+        return std::max(fabsf(our_arm_sin_f32(angle) - sinf(angle)), fabsf(our_arm_cos_f32(angle) - cosf(angle)));
+    });
+    results_[KERNEL_FAST_SINCOS].max_error = max_error([](float angle) {
+        float s, c;
+        fast_sincos(angle, &s, &c);
+        return std::max(fabsf(s - sinf(angle)), fabsf(c - cosf(angle)));
+    });
+
+    // The stateful kernels may raise errors that are meaningless while idle
+    // (e.g. a timeout of an absolute encoder that isn't polled this fast)
+    Axis::Error_t axis_error = axis.error_;
+    Motor::Error_t motor_error = axis.motor_.error_;
+    Encoder::Error_t encoder_error = axis.encoder_.error_;
+    SensorlessEstimator::Error_t sensorless_error = axis.sensorless_estimator_.error_;
+
+    measure(results_[KERNEL_ENCODER_UPDATE], iterations, [&](size_t) {
+        axis.encoder_.update();
+    });
+    measure(results_[KERNEL_SENSORLESS_UPDATE], iterations, [&](size_t) {
+        axis.sensorless_estimator_.update();
+    });
+    measure(results_[KERNEL_FOC_CURRENT], iterations, [&](size_t i) {
+        axis.motor_.FOC_current(0.0f, 1.0f, input_angle[i], 0.0f);
+    });
+
+    // The timings queued by FOC_current are dropped when the motor is armed
+    axis.motor_.reset_current_control();
+    axis.error_ = axis_error;
+    axis.motor_.error_ = motor_error;
+    axis.encoder_.error_ = encoder_error;
+    axis.sensorless_estimator_.error_ = sensorless_error;
+
+    TrapezoidalTrajectory::Config_t traj_config;
+    TrapezoidalTrajectory traj(traj_config);
+    traj.planTrapezoidal(100000.0f, 0.0f, 0.0f,
+                         traj_config.vel_limit, traj_config.accel_limit, traj_config.decel_limit);
+    float dt = traj.Tf_ / (float)kNumInputs;
+    measure(results_[KERNEL_TRAP_TRAJ_EVAL], iterations, [&](size_t i) {
+        TrapezoidalTrajectory::Step_t step = traj.eval((float)i * dt);
+        benchmark_sink = step.Y + step.Yd + step.Ydd;
+    });
+
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef __BENCHMARK_HPP
+#define __BENCHMARK_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Execution time of one kernel over a benchmark run [cycles of the
+// benchmark clock]. The overhead of reading the clock is already subtracted.
+// For the approximations of trigonometric functions, max_error is the
+// largest deviation from libm over a sweep of all angles, else 0.
+struct BenchmarkResult_t {
+    uint32_t min = 0;
+    uint32_t max = 0;
+    float mean = 0.0f;
+    float max_error = 0.0f;
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("min", &min),
+            make_protocol_ro_property("max", &max),
+            make_protocol_ro_property("mean", &mean),
+            make_protocol_ro_property("max_error", &max_error)
+        );
+    }
+};
+
+// @brief Micro-benchmark of the control loop kernels.
+//
+// run() calls each kernel the requested number of times with varying inputs
+// and times every call on its own, with interrupts disabled, so the results
+// don't include preemption. The stateful kernels (Encoder::update,
+// SensorlessEstimator::update and Motor::FOC_current) run on the objects of
+// axis0, which must be idle. Their side effects are reverted afterwards as
+// far as they matter while idle: the current controller is reset and errors
+// raised by the kernels are cleared.
+//
+// The clock is the DWT cycle counter. The host simulation build defines
+// BENCHMARK_HOST_CLOCK and provides benchmark_clock() and
+// benchmark_clock_hz() based on the host's monotonic clock.
+class Benchmark {
+public:
+    static constexpr uint32_t kMaxIterations = 100000;
+
+    enum Kernel_t {
+        KERNEL_SVM,
+        KERNEL_FAST_ATAN2,
+        KERNEL_FAST_ATAN2_OCTANT,
+        KERNEL_SIN_COS,
+        KERNEL_FAST_SINCOS,
+        KERNEL_ENCODER_UPDATE,
+        KERNEL_SENSORLESS_UPDATE,
+        KERNEL_FOC_CURRENT,
+        KERNEL_TRAP_TRAJ_EVAL,
+        KERNEL_NUM_KERNELS
+    };
+
+    // @brief Runs all kernels.
+    // @returns: false if axis0 is not idle, in which case nothing is run
+    bool run(uint32_t iterations);
+
+    uint32_t clock_hz_ = 0;     // [Hz] the unit of the results
+    uint32_t iterations_ = 0;   // of the last run
+    uint32_t overhead_ = 0;     // [cycles] of an empty measurement
+    BenchmarkResult_t results_[KERNEL_NUM_KERNELS];
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("clock_hz", &clock_hz_),
+            make_protocol_ro_property("iterations", &iterations_),
+            make_protocol_ro_property("overhead", &overhead_),
+            make_protocol_object("svm", results_[KERNEL_SVM].make_protocol_definitions()),
+            make_protocol_object("fast_atan2", results_[KERNEL_FAST_ATAN2].make_protocol_definitions()),
+            make_protocol_object("fast_atan2_octant", results_[KERNEL_FAST_ATAN2_OCTANT].make_protocol_definitions()),
+            make_protocol_object("sin_cos", results_[KERNEL_SIN_COS].make_protocol_definitions()),
+            make_protocol_object("fast_sincos", results_[KERNEL_FAST_SINCOS].make_protocol_definitions()),
+            make_protocol_object("encoder_update", results_[KERNEL_ENCODER_UPDATE].make_protocol_definitions()),
+            make_protocol_object("sensorless_update", results_[KERNEL_SENSORLESS_UPDATE].make_protocol_definitions()),
+            make_protocol_object("foc_current", results_[KERNEL_FOC_CURRENT].make_protocol_definitions()),
+            make_protocol_object("trap_traj_eval", results_[KERNEL_TRAP_TRAJ_EVAL].make_protocol_definitions()),
+            make_protocol_function("run", *this, &Benchmark::run, "iterations")
+        );
+    }
+
+private:
+    template<typename TFn>
+    void measure(BenchmarkResult_t& result, uint32_t iterations, const TFn& fn);
+    template<typename TFn>
+    float max_error(const TFn& error_fn);
+};
+
+extern Benchmark benchmark;
+
+#ifdef BENCHMARK_HOST_CLOCK
+uint32_t benchmark_clock();
+uint32_t benchmark_clock_hz();
+#endif
+
+#endif // __BENCHMARK_HPP
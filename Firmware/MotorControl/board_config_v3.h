@@ -6,10 +6,12 @@
 #define __BOARD_CONFIG_H
 
 // STM specific includes
+#include <adc.h>
 #include <gpio.h>
 #include <spi.h>
 #include <tim.h>
 #include <main.h>
+#include <priorities.h>
 
 #if HW_VERSION_MAJOR == 3
 #if HW_VERSION_MINOR <= 3
@@ -19,6 +21,12 @@
 #endif
 #endif
 
+// Number of motor axes on the board. hw_configs holds one entry per axis.
+// FOR_EACH_AXIS(X, ...) expands to X(i, ...) for every axis index i. It
+// spells out the per-axis lists that must be known at compile time, such as
+// the "axis0", "axis1", ... objects of the protocol tree.
+#define AXIS_COUNT 2
+#define FOR_EACH_AXIS(X, ...) X(0, __VA_ARGS__) X(1, __VA_ARGS__)
 
 typedef struct {
     GPIO_TypeDef* step_port;
@@ -27,23 +35,37 @@ typedef struct {
     uint16_t dir_pin;
     size_t thermistor_adc_ch;
     osPriority thread_priority;
+    TIM_HandleTypeDef* step_timer; // if not null, can count the steps in hardware (the step pin must be its CH1)
+    uint8_t step_timer_af;
 } AxisHardwareConfig_t;
 
 typedef struct {
     TIM_HandleTypeDef* timer;
     GPIO_TypeDef* index_port;
     uint16_t index_pin;
+    uint32_t index_capture_channel; // channel of timer that latches the count on the index edge
+    uint8_t index_capture_af; // 0 if the index pin is not an input of timer
     GPIO_TypeDef* hallA_port;
     uint16_t hallA_pin;
     GPIO_TypeDef* hallB_port;
     uint16_t hallB_pin;
     GPIO_TypeDef* hallC_port;
     uint16_t hallC_pin;
+    SPI_HandleTypeDef* spi; // for absolute SPI encoders
 } EncoderHardwareConfig_t;
 typedef struct {
     TIM_HandleTypeDef* timer;
-    uint16_t control_deadline;
+    float control_deadline; // [PWM half periods] latest point in the PWM cycle at which new timings must be ready
     float shunt_conductance;
+    // The timer triggers phB_adc and phC_adc, the interrupt of phC_adc comes
+    // second. Axes that share the ADCs use the injected and the regular
+    // conversions respectively.
+    ADC_HandleTypeDef* phB_adc;
+    ADC_HandleTypeDef* phC_adc;
+    bool adc_injected;
+    // Whether the zero current sample (timer counting down) of this axis
+    // loads the PWM timings of the next axis, instead of the current sample.
+    bool load_next_timings_on_dc_cal;
 } MotorHardwareConfig_t;
 typedef struct {
     SPI_HandleTypeDef* spi;
@@ -61,7 +83,7 @@ typedef struct {
     GateDriverHardwareConfig_t gate_driver_config;
 } BoardHardwareConfig_t;
 
-extern const BoardHardwareConfig_t hw_configs[2];
+extern const BoardHardwareConfig_t hw_configs[AXIS_COUNT];
 extern const float thermistor_poly_coeffs[];
 extern const size_t thermistor_num_coeffs;
 
@@ -71,7 +93,7 @@ const float thermistor_poly_coeffs[] =
     {363.0172658f, -459.19773008f, 308.29273921f, -28.12731452f};
 const size_t thermistor_num_coeffs = sizeof(thermistor_poly_coeffs)/sizeof(thermistor_poly_coeffs[1]);
 
-const BoardHardwareConfig_t hw_configs[2] = { {
+const BoardHardwareConfig_t hw_configs[AXIS_COUNT] = { {
     //M0
     .axis_config = {
         .step_port = GPIO_1_GPIO_Port,
@@ -79,23 +101,32 @@ const BoardHardwareConfig_t hw_configs[2] = { {
         .dir_port = GPIO_2_GPIO_Port,
         .dir_pin = GPIO_2_Pin,
         .thermistor_adc_ch = 15,
-        .thread_priority = (osPriority)(osPriorityHigh + (osPriority)1),
+        .thread_priority = THREAD_PRIO_AXIS0,
+        .step_timer = &htim5, // shared with the PWM input
+        .step_timer_af = GPIO_AF2_TIM5,
     },
     .encoder_config = {
         .timer = &htim3,
         .index_port = M0_ENC_Z_GPIO_Port,
         .index_pin = M0_ENC_Z_Pin,
+        .index_capture_channel = TIM_CHANNEL_4,
+        .index_capture_af = GPIO_AF2_TIM3,
         .hallA_port = M0_ENC_A_GPIO_Port,
         .hallA_pin = M0_ENC_A_Pin,
         .hallB_port = M0_ENC_B_GPIO_Port,
         .hallB_pin = M0_ENC_B_Pin,
         .hallC_port = M0_ENC_Z_GPIO_Port,
         .hallC_pin = M0_ENC_Z_Pin,
+        .spi = &hspi3,
     },
     .motor_config = {
         .timer = &htim1,
-        .control_deadline = TIM_1_8_PERIOD_CLOCKS,
+        .control_deadline = 1.0f,
         .shunt_conductance = 1.0f / SHUNT_RESISTANCE,  //[S]
+        .phB_adc = &hadc2,
+        .phC_adc = &hadc3,
+        .adc_injected = true,
+        .load_next_timings_on_dc_cal = false,
     },
     .gate_driver_config = {
         .spi = &hspi3,
@@ -126,23 +157,32 @@ const BoardHardwareConfig_t hw_configs[2] = { {
 #else
         .thermistor_adc_ch = 1,
 #endif
-        .thread_priority = osPriorityHigh,
+        .thread_priority = THREAD_PRIO_AXIS1,
+        .step_timer = nullptr, // no free timer channel on the step pin
+        .step_timer_af = 0,
     },
     .encoder_config = {
         .timer = &htim4,
         .index_port = M1_ENC_Z_GPIO_Port,
         .index_pin = M1_ENC_Z_Pin,
+        .index_capture_channel = 0,
+        .index_capture_af = 0, // no timer channel on the index pin
         .hallA_port = M1_ENC_A_GPIO_Port,
         .hallA_pin = M1_ENC_A_Pin,
         .hallB_port = M1_ENC_B_GPIO_Port,
         .hallB_pin = M1_ENC_B_Pin,
         .hallC_port = M1_ENC_Z_GPIO_Port,
         .hallC_pin = M1_ENC_Z_Pin,
+        .spi = &hspi3,
     },
     .motor_config = {
         .timer = &htim8,
-        .control_deadline = (3 * TIM_1_8_PERIOD_CLOCKS) / 2,
+        .control_deadline = 1.5f,
         .shunt_conductance = 1.0f / SHUNT_RESISTANCE,  //[S]
+        .phB_adc = &hadc2,
+        .phC_adc = &hadc3,
+        .adc_injected = false,
+        .load_next_timings_on_dc_cal = true,
     },
     .gate_driver_config = {
         .spi = &hspi3,
@@ -1,4 +1,6 @@
 
+#include <algorithm>
+
 #include "odrive_main.h"
 
 
@@ -8,58 +10,524 @@ Controller::Controller(Config_t& config) :
 
 void Controller::reset() {
     pos_setpoint_ = 0.0f;
+    pos_setpoint_turns_ = 0;
     vel_setpoint_ = 0.0f;
     vel_integrator_current_ = 0.0f;
     current_setpoint_ = 0.0f;
+    vel_ramp_target_ = 0.0f;
+    current_ramp_target_ = 0.0f;
+    pos_loop_countdown_ = 0;
+    vel_loop_countdown_ = 0;
+    vel_des_ = 0.0f;
+    anticogging_pos_ = 0.0f;
+    Iq_output_ = 0.0f;
+    Iq_filtered_ = 0.0f;
+    iq_filter_dirty_ = true;
+    input_shaper_dirty_ = true;
+    input_shaper_active_ = false;
+    // Keep a learned inertia across arming
+    if (!config_.inertia_estimation || inertia_estimate_ <= 0.0f)
+        inertia_estimate_ = config_.inertia;
+    load_current_estimate_ = 0.0f;
+    dob_vel_ = 0.0f;
+    dob_accel_ = 0.0f;
+    dob_load_baseline_ = 0.0f;
+    // Commands that were posted before the reset are dropped
+    setpoint_applied_seq_ = setpoint_seq_;
 }
 
 //--------------------------------
 // Command Handling
 //--------------------------------
 
+// The setpoint commands take effect at the start of the next control loop
+// update (see post_setpoint()).
 void Controller::set_pos_setpoint(float pos_setpoint, float vel_feed_forward, float current_feed_forward) {
-    pos_setpoint_ = pos_setpoint;
-    vel_setpoint_ = vel_feed_forward;
-    current_setpoint_ = current_feed_forward;
-    config_.control_mode = CTRL_MODE_POSITION_CONTROL;
+    post_setpoint({ CTRL_MODE_POSITION_CONTROL, pos_setpoint, vel_feed_forward, current_feed_forward });
 #ifdef DEBUG_PRINT
-    printf("POSITION_CONTROL %6.0f %3.3f %3.3f\n", pos_setpoint, vel_setpoint_, current_setpoint_);
+    printf("POSITION_CONTROL %6.0f %3.3f %3.3f\n", pos_setpoint, vel_feed_forward, current_feed_forward);
 #endif
 }
 
 void Controller::set_vel_setpoint(float vel_setpoint, float current_feed_forward) {
-    vel_setpoint_ = vel_setpoint;
-    current_setpoint_ = current_feed_forward;
-    config_.control_mode = CTRL_MODE_VELOCITY_CONTROL;
+    post_setpoint({ CTRL_MODE_VELOCITY_CONTROL, 0.0f, vel_setpoint, current_feed_forward });
 #ifdef DEBUG_PRINT
-    printf("VELOCITY_CONTROL %3.3f %3.3f\n", vel_setpoint_, motor->current_setpoint_);
+    printf("VELOCITY_CONTROL %3.3f %3.3f\n", vel_setpoint, current_feed_forward);
 #endif
 }
 
 void Controller::set_current_setpoint(float current_setpoint) {
-    current_setpoint_ = current_setpoint;
-    config_.control_mode = CTRL_MODE_CURRENT_CONTROL;
+    post_setpoint({ CTRL_MODE_CURRENT_CONTROL, 0.0f, 0.0f, current_setpoint });
 #ifdef DEBUG_PRINT
-    printf("CURRENT_CONTROL %3.3f\n", current_setpoint_);
+    printf("CURRENT_CONTROL %3.3f\n", current_setpoint);
 #endif
 }
 
+// @brief Hands a setpoint command to the control loop. A command that was
+// not applied yet is replaced. May be called from any thread and from
+// interrupts up to IRQ_PRIO_CAN.
+// The writers are serialized by a short critical section, the control loop
+// reads without one (see apply_posted_setpoint()).
+void Controller::post_setpoint(const SetpointCommand_t& command) {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CAN);
+    setpoint_seq_ = setpoint_seq_ + 1;
+    __DMB(); // mark the mailbox as being written before writing it
+    setpoint_mailbox_ = command;
+    __DMB(); // finish writing the mailbox before publishing it
+    setpoint_seq_ = setpoint_seq_ + 1;
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Sets the control mode of a command and the setpoints that apply to
+// it right away. This must be called from the control loop.
+void Controller::apply_setpoint(const SetpointCommand_t& command) {
+    // Posted by queue_move() and move_to_pos(). A running trajectory is only
+    // replaced if the queue was cleared since, otherwise the queued move
+    // follows it.
+    if (command.control_mode == CTRL_MODE_TRAJECTORY_CONTROL) {
+        bool replace = move_queue_flush_seq_ != move_queue_flush_applied_seq_;
+        if (config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL && !replace)
+            return;
+        if (!start_queued_move())
+            return; // nothing to start, keep the current control mode
+    }
+    if (command.control_mode == CTRL_MODE_POSITION_CONTROL)
+        pos_setpoint_ = command.pos_setpoint;
+    if (command.control_mode == CTRL_MODE_VELOCITY_CONTROL && config_.vel_ramp_enable)
+        vel_ramp_target_ = command.vel_setpoint;
+    else if (command.control_mode == CTRL_MODE_POSITION_CONTROL || command.control_mode == CTRL_MODE_VELOCITY_CONTROL)
+        vel_setpoint_ = command.vel_setpoint;
+    if (command.control_mode == CTRL_MODE_CURRENT_CONTROL && config_.current_ramp_enable)
+        current_ramp_target_ = command.current_setpoint;
+    else if (command.control_mode >= CTRL_MODE_CURRENT_CONTROL && command.control_mode <= CTRL_MODE_POSITION_CONTROL)
+        current_setpoint_ = command.current_setpoint;
+    config_.control_mode = command.control_mode;
+}
+
+// @brief Applies the newest posted setpoint command, if there is one.
+// A copy that was torn by a concurrent post_setpoint() is read again.
+// @return: true if a command was applied
+bool Controller::apply_posted_setpoint() {
+    SetpointCommand_t command;
+    // A replay applies the recorded commands instead (see InputRecorder)
+    if (input_recorder.replaying()) {
+        setpoint_applied_seq_ = setpoint_seq_;
+        if (!input_recorder.replay_setpoint(axis_, &command))
+            return false;
+        apply_setpoint(command);
+        return true;
+    }
+    uint32_t seq;
+    for (;;) {
+        seq = setpoint_seq_;
+        if (seq == setpoint_applied_seq_)
+            return false;
+        __DMB();
+        command = setpoint_mailbox_;
+        __DMB();
+        if (!(seq & 1) && seq == setpoint_seq_)
+            break;
+    }
+    setpoint_applied_seq_ = seq;
+    input_recorder.record_setpoint(axis_, command);
+    apply_setpoint(command);
+    return true;
+}
+
+// @brief Replaces the queued moves and the move in progress with a move to
+// goal_point. The move is planned by the control loop, from the setpoints of
+// the iteration in which it takes over.
 void Controller::move_to_pos(float goal_point) {
-    axis_->trap_.planTrapezoidal(goal_point, pos_setpoint_, vel_setpoint_,
-                                 axis_->trap_.config_.vel_limit,
-                                 axis_->trap_.config_.accel_limit,
-                                 axis_->trap_.config_.decel_limit);
-    traj_start_loop_count_ = axis_->loop_counter_;
-    config_.control_mode = CTRL_MODE_TRAJECTORY_CONTROL;
+    replace_moves({ goal_point, 0.0f, 0.0f, 0.0f, 0.0f, 0 });
+}
+
+void Controller::replace_moves(const QueuedMove_t& move) {
+    clear_move_queue();
+    push_move(move);
+    post_setpoint({ CTRL_MODE_TRAJECTORY_CONTROL, 0.0f, 0.0f, 0.0f }); // supersede pending setpoint commands
+}
+
+// @brief Appends a move to the queue. The move starts right away if the
+// controller is not executing a trajectory, otherwise after the moves
+// before it. Returns false if the queue is full.
+bool Controller::queue_move(float goal_point) {
+    return push_move({ goal_point, 0.0f, 0.0f, 0.0f, 0.0f, 0 });
+}
+
+bool Controller::push_move(const QueuedMove_t& move) {
+    uint32_t read = move_queue_head();
+    uint32_t write = move_queue_write_;
+    uint32_t next = (write + 1) % kMoveQueueLength;
+    if (next == read)
+        return false;
+    move_queue_[write] = move;
+    __DMB(); // write the move before publishing it
+    move_queue_write_ = next;
+    move_queue_count_ = (next - read + kMoveQueueLength) % kMoveQueueLength;
+    if (config_.control_mode != CTRL_MODE_TRAJECTORY_CONTROL)
+        post_setpoint({ CTRL_MODE_TRAJECTORY_CONTROL, 0.0f, 0.0f, 0.0f }); // start it in the control loop
+    return true;
+}
+
+// @brief Drops the queued moves that have not started yet. The control loop
+// owns the read index, so the flush is handed to it like a setpoint
+// command and takes effect with the next start_queued_move().
+void Controller::clear_move_queue() {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CAN);
+    move_queue_flush_seq_ = move_queue_flush_seq_ + 1;
+    __DMB();
+    move_queue_flush_index_ = move_queue_write_;
+    __DMB();
+    move_queue_flush_seq_ = move_queue_flush_seq_ + 1;
+    cpu_exit_masked_critical(basepri);
+    move_queue_count_ = 0;
+}
+
+// @brief Read index of the move queue, as seen by the communication threads:
+// a pending flush counts as applied.
+uint32_t Controller::move_queue_head() {
+    if (move_queue_flush_seq_ != move_queue_flush_applied_seq_)
+        return move_queue_flush_index_;
+    return move_queue_read_;
+}
+
+// @brief Starts the next queued move from the current setpoints, if any.
+// This must be called from the control loop.
+bool Controller::start_queued_move() {
+    for (;;) {
+        uint32_t seq = move_queue_flush_seq_;
+        if (seq == move_queue_flush_applied_seq_)
+            break;
+        __DMB();
+        uint32_t index = move_queue_flush_index_;
+        __DMB();
+        if (!(seq & 1) && seq == move_queue_flush_seq_) {
+            move_queue_read_ = index;
+            move_queue_flush_applied_seq_ = seq;
+            break;
+        }
+    }
+    uint32_t read = move_queue_read_;
+    if (read == move_queue_write_)
+        return false;
+    __DMB(); // read the move after its write index
+    plan_move(move_queue_[read]);
+    move_queue_read_ = (read + 1) % kMoveQueueLength;
+    move_queue_count_ = (move_queue_write_ - move_queue_read_ + kMoveQueueLength) % kMoveQueueLength;
+    return true;
+}
+
+// @brief Time of the current control loop iteration on the active trajectory [s]
+float Controller::trajectory_time() {
+    // The measurement count in integer arithmetic keeps the elapsed time
+    // exact, only the conversion to seconds rounds.
+    // exact, only the conversion to seconds rounds. Negative before a
+    // delayed start.
+    int64_t elapsed_meas = (int64_t)(axis_->get_meas_count() - traj_start_meas_count_);
+    return (float)elapsed_meas * current_meas_period + traj_t0_;
+}
+
+TrapezoidalTrajectory::Step_t Controller::eval_trajectory(float t) {
+    return traj_scurve_ ? scurve_.eval(t) : axis_->trap_.eval(t);
+}
+
+// @brief Plans a move and starts it in this control loop iteration, or at
+// move.start_meas_count if set. During a trajectory, the move continues from the position,
+// velocity and acceleration of the old plan at this iteration, so replanning
+// mid-motion does not step the setpoints. Otherwise it starts from
+// pos_setpoint_ and vel_setpoint_ at rest acceleration.
+void Controller::plan_move(const QueuedMove_t& move) {
+    TrapezoidalTrajectory::Step_t start = { pos_setpoint_, vel_setpoint_, 0.0f };
+    if (config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL)
+        start = eval_trajectory(trajectory_time());
+
+    // In circular mode, the goal is a position within the turn, reached the shorter way round
+    float goal_point = move.goal_point;
+    if (config_.circular_setpoints) {
+        const float cpr = (float)axis_->encoder_.config_.cpr;
+        goal_point = start.Y + wrap_pm(fmodf_pos(goal_point, cpr) - fmodf_pos(start.Y, cpr), 0.5f * cpr);
+    }
+
+    TrapezoidalTrajectory::Config_t& traj_config = axis_->trap_.config_;
+    float vel_limit = move.vel_limit > 0.0f ? move.vel_limit : traj_config.vel_limit;
+    float accel_limit = move.accel_limit > 0.0f ? move.accel_limit : traj_config.accel_limit;
+    float decel_limit = move.decel_limit > 0.0f ? move.decel_limit : traj_config.decel_limit;
+    float jerk_limit = move.jerk_limit > 0.0f ? move.jerk_limit : traj_config.jerk_limit;
+    traj_scurve_ = traj_config.use_scurve && jerk_limit > 0.0f;
+    if (traj_scurve_) {
+        scurve_.planSCurve(goal_point, start.Y, start.Yd, start.Ydd,
+                           vel_limit, accel_limit, decel_limit, jerk_limit);
+        traj_t0_ = scurve_.t0_;
+    } else {
+        axis_->trap_.planTrapezoidal(goal_point, start.Y, start.Yd,
+                                     vel_limit, accel_limit, decel_limit);
+        traj_t0_ = 0.0f;
+    }
+    traj_start_meas_count_ = move.start_meas_count ? move.start_meas_count : axis_->get_meas_count();
+}
+
+// @brief Moves both axes along a straight line from their position
+// setpoints to the goal points, so that they start and arrive together.
+// All limits of each axis are scaled down to the profile of the axis that
+// is limited most relative to its distance. Both profiles then have the same
+// timing, and the planners, being linear in the distance, output scaled
+// copies of one path profile. Both axes must hold a position at rest and
+// agree on trap_traj.config.use_scurve.
+// The moves start a few measurements in the future, so that both control
+// loops have planned them by then.
+// @return: false if an axis is not at rest or the planners differ
+bool move_to_pos_synced(float goal_axis0, float goal_axis1) {
+    static_assert(AXIS_COUNT == 2, "a synced move is defined for two axes");
+    const float goals[AXIS_COUNT] = { goal_axis0, goal_axis1 };
+    float dist[AXIS_COUNT];
+    float vel_scale = INFINITY, accel_scale = INFINITY, decel_scale = INFINITY, jerk_scale = INFINITY;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Controller& controller = axes[i]->controller_;
+        TrapezoidalTrajectory::Config_t& traj_config = axes[i]->trap_.config_;
+        if (controller.config_.control_mode != Controller::CTRL_MODE_POSITION_CONTROL
+                || controller.vel_setpoint_ != 0.0f
+                || traj_config.use_scurve != axes[0]->trap_.config_.use_scurve)
+            return false;
+        dist[i] = fabsf(goals[i] - controller.pos_setpoint_);
+        if (dist[i] > 0.0f) {
+            vel_scale = std::min(vel_scale, traj_config.vel_limit / dist[i]);
+            accel_scale = std::min(accel_scale, traj_config.accel_limit / dist[i]);
+            decel_scale = std::min(decel_scale, traj_config.decel_limit / dist[i]);
+            jerk_scale = std::min(jerk_scale, traj_config.jerk_limit / dist[i]);
+        }
+    }
+    if (!(vel_scale < INFINITY))
+        return true; // both axes are at their goal
+
+    const uint64_t start_delay = 4; // [measurements]
+    uint64_t start_meas_count[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        start_meas_count[i] = axes[i]->get_meas_count() + start_delay;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        // An axis that does not move gets a move with 0 limits, which plan
+        // from its config and go nowhere
+        axes[i]->controller_.replace_moves({ goals[i], vel_scale * dist[i], accel_scale * dist[i],
+                decel_scale * dist[i], jerk_scale * dist[i], start_meas_count[i] });
+    }
+    return true;
+}
+
+// @brief Clears the setpoint stream and switches to streaming control.
+// Playback starts once two samples are buffered, at the time of the first one.
+// Until then, and after the last sample, the last setpoint is held.
+void Controller::start_stream() {
+    stream_playing_ = false;
+    stream_read_ = stream_write_;
+    stream_count_ = 0;
+    stream_underruns_ = 0;
+    vel_setpoint_ = 0.0f;
+    current_setpoint_ = 0.0f;
+    config_.control_mode = CTRL_MODE_STREAMING_CONTROL;
+    post_setpoint({ CTRL_MODE_STREAMING_CONTROL, 0.0f, 0.0f, 0.0f }); // supersede pending setpoint commands
+}
+
+// @brief Switches to electronic gearing. The follower keeps its current
+// setpoint: gear_offset is set on the first update accordingly.
+void Controller::start_gearing() {
+    gear_align_ = true;
+    config_.control_mode = CTRL_MODE_GEARING_CONTROL;
+    post_setpoint({ CTRL_MODE_GEARING_CONTROL, 0.0f, 0.0f, 0.0f }); // supersede pending setpoint commands
+}
+
+// @brief Appends a sample to the setpoint stream.
+// The time stamps must be increasing. Returns false if the sample was
+// rejected because the buffer is full or the time stamp is not increasing.
+bool Controller::push_stream_sample(float t, float pos, float vel, float current) {
+    uint32_t write = stream_write_;
+    uint32_t next = (write + 1) % kStreamBufferLength;
+    if (next == stream_read_)
+        return false;
+    if (write != stream_read_ && !(t > stream_buffer_[(write + kStreamBufferLength - 1) % kStreamBufferLength].t))
+        return false;
+    stream_buffer_[write] = { t, pos, vel, current };
+    stream_write_ = next;
+    stream_count_ = (next - stream_read_ + kStreamBufferLength) % kStreamBufferLength;
+    return true;
+}
+
+// @brief Sets the setpoints from the stream at the current time.
+// Position is interpolated with a cubic Hermite spline through the sample
+// positions and velocities, the current feed forward linearly.
+void Controller::update_stream() {
+    uint32_t read = stream_read_;
+    uint32_t write = stream_write_;
+    uint32_t available = (write - read + kStreamBufferLength) % kStreamBufferLength;
+
+    if (!stream_playing_) {
+        if (available < 2)
+            return; // hold the previous setpoints until the stream is primed
+        stream_playing_ = true;
+        stream_start_meas_count_ = axis_->get_meas_count();
+        stream_start_t_ = stream_buffer_[read].t;
+    }
+
+    uint64_t elapsed_meas = axis_->get_meas_count() - stream_start_meas_count_;
+    float t = stream_start_t_ + (float)elapsed_meas * current_meas_period;
+
+    // Drop the samples that lie entirely in the past
+    while (available >= 2 && stream_buffer_[(read + 1) % kStreamBufferLength].t <= t) {
+        read = (read + 1) % kStreamBufferLength;
+        --available;
+    }
+    stream_read_ = read;
+    stream_count_ = available;
+
+    const StreamSample_t& s0 = stream_buffer_[read];
+    if (available < 2) {
+        // Ran out of samples: hold the last position
+        ++stream_underruns_;
+        pos_setpoint_ = s0.pos;
+        vel_setpoint_ = 0.0f;
+        current_setpoint_ = 0.0f;
+        return;
+    }
+
+    const StreamSample_t& s1 = stream_buffer_[(read + 1) % kStreamBufferLength];
+    float h = s1.t - s0.t;
+    float u = (t - s0.t) / h;
+    float u2 = u * u;
+    float u3 = u2 * u;
+    float h00 = 2.0f * u3 - 3.0f * u2 + 1.0f;
+    float h10 = u3 - 2.0f * u2 + u;
+    float h01 = -2.0f * u3 + 3.0f * u2;
+    float h11 = u3 - u2;
+    pos_setpoint_ = h00 * s0.pos + h10 * h * s0.vel + h01 * s1.pos + h11 * h * s1.vel;
+    // derivative of the spline
+    float dh00 = 6.0f * u2 - 6.0f * u;
+    float dh10 = 3.0f * u2 - 4.0f * u + 1.0f;
+    float dh01 = -dh00;
+    float dh11 = 3.0f * u2 - 2.0f * u;
+    vel_setpoint_ = (dh00 * s0.pos + dh01 * s1.pos) / h + dh10 * s0.vel + dh11 * s1.vel;
+    current_setpoint_ = s0.current + u * (s1.current - s0.current);
+}
+
+// @brief Returns the number of bins of the anti-cogging map for the current
+// encoder CPR, 0 for one float per count (see config_.anticogging_bins).
+int32_t Controller::get_anticogging_num_bins() {
+    int32_t cpr = axis_->encoder_.config_.cpr;
+    if (config_.anticogging_bins <= 0)
+        return 0;
+    // An even number of bins keeps the map a whole number of flash words
+    int32_t num_bins = std::min(config_.anticogging_bins, cpr) & ~1;
+    return std::max(num_bins, (int32_t)2);
+}
+
+// @brief Allocates the anti-cogging map for the current encoder CPR and
+// clears it. The binned map is used if config_.anticogging_bins is set.
+// @returns false if the allocation failed
+bool Controller::allocate_anticogging_map() {
+    int32_t cpr = axis_->encoder_.config_.cpr;
+    if (cpr <= 0)
+        return false;
+    if (config_.anticogging_bins > 0) {
+        int32_t num_bins = get_anticogging_num_bins();
+        // Prefers CCM RAM, the map is read on every control loop iteration
+        int16_t* map = (int16_t*)table_alloc(num_bins * sizeof(int16_t));
+        if (map == NULL) {
+            anticogging_.map_alloc_failed = true;
+            return false;
+        }
+        for (int32_t i = 0; i < num_bins; ++i)
+            map[i] = 0;
+        anticogging_.binned_map = map;
+        anticogging_.num_bins = num_bins;
+        anticogging_.binned_map_bytes = num_bins * sizeof(int16_t);
+    } else {
+        float* map = (float*)table_alloc(cpr * sizeof(float));
+        if (map == NULL) {
+            anticogging_.map_alloc_failed = true;
+            return false;
+        }
+        for (int32_t i = 0; i < cpr; ++i)
+            map[i] = 0.0f;
+        anticogging_.cogging_map = map;
+        anticogging_.cogging_map_bytes = cpr * sizeof(float);
+    }
+    return true;
+}
+
+// @brief Copies a map that is used in place from flash into RAM, before it
+// is calibrated or before the flash sector is erased.
+// The control loop keeps reading the same values while the pointer changes.
+// @returns false if there is not enough RAM
+bool Controller::move_anticogging_map_to_ram() {
+    if (!anticogging_.map_in_flash)
+        return true;
+    size_t bytes = anticogging_.cogging_map ? anticogging_.cogging_map_bytes : anticogging_.binned_map_bytes;
+    void* map = table_alloc(bytes);
+    if (map == NULL) {
+        anticogging_.map_alloc_failed = true;
+        return false;
+    }
+    if (anticogging_.cogging_map) {
+        memcpy(map, anticogging_.cogging_map, bytes);
+        anticogging_.cogging_map = (float*)map;
+    } else {
+        memcpy(map, anticogging_.binned_map, bytes);
+        anticogging_.binned_map = (int16_t*)map;
+    }
+    anticogging_.map_in_flash = false;
+    return true;
+}
+
+// @brief Returns the anti-cogging current at the given position [counts].
+// The binned map is interpolated linearly between the bin centers.
+float Controller::anticogging_current(float pos) {
+    const int32_t cpr = axis_->encoder_.config_.cpr;
+    if (anticogging_.cogging_map) {
+        // handle negative encoder positions properly (-1 == cpr - 1)
+        return anticogging_.cogging_map[mod(static_cast<int>(pos), cpr)];
+    } else if (anticogging_.binned_map) {
+        const int32_t num_bins = anticogging_.num_bins;
+        float x = pos * ((float)num_bins / (float)cpr) - 0.5f;
+        x -= (float)num_bins * floorf(x / (float)num_bins);
+        int32_t i0 = std::min((int32_t)x, num_bins - 1);
+        int32_t i1 = (i0 + 1 < num_bins) ? i0 + 1 : 0;
+        float frac = x - (float)i0;
+        float y0 = (float)anticogging_.binned_map[i0];
+        float y1 = (float)anticogging_.binned_map[i1];
+        return (y0 + frac * (y1 - y0)) * kAnticoggingBinScale;
+    }
+    return 0.0f;
 }
 
 void Controller::start_anticogging_calibration() {
     // Ensure the cogging map was correctly allocated earlier and that the motor is capable of calibrating
-    if (anticogging_.cogging_map != NULL && axis_->error_ == Axis::ERROR_NONE) {
+    if (anticogging_.cogging_map != NULL && axis_->error_ == Axis::ERROR_NONE
+            && move_anticogging_map_to_ram()) {
+        anticogging_.calib_fast = false;
         anticogging_.calib_anticogging = true;
     }
 }
 
+// @brief Starts the continuous anti-cogging calibration.
+// The axis must be in closed loop control.
+void Controller::start_fast_anticogging_calibration() {
+    if ((anticogging_.cogging_map == NULL && anticogging_.binned_map == NULL)
+            || axis_->error_ != Axis::ERROR_NONE || anticogging_.calib_fast_revolutions < 1
+            || !move_anticogging_map_to_ram())
+        return;
+    if (anticogging_.cogging_map) {
+        for (int32_t i = 0; i < axis_->encoder_.config_.cpr; ++i)
+            anticogging_.cogging_map[i] = 0.0f;
+    } else {
+        for (int32_t i = 0; i < anticogging_.num_bins; ++i)
+            anticogging_.binned_map[i] = 0;
+    }
+    anticogging_.use_anticogging = false; // the map must not feed back into the measurement
+    calib_sweep_pos_ = pos_setpoint_;
+    calib_sweep_dist_ = 0.0f;
+    calib_sweep_dir_ = 1.0f;
+    calib_bin_ = -1;
+    anticogging_.calib_fast = true;
+    anticogging_.calib_anticogging = true;
+}
+
 /*
  * This anti-cogging implementation iterates through each encoder position,
  * waits for zero velocity & position error,
@@ -68,58 +536,502 @@ void Controller::start_anticogging_calibration() {
  * This holding current is added as a feedforward term in the control loop.
  */
 bool Controller::anticogging_calibration(float pos_estimate, float vel_estimate) {
-    if (anticogging_.calib_anticogging && anticogging_.cogging_map != NULL) {
+    if (anticogging_.calib_anticogging && !anticogging_.calib_fast && anticogging_.cogging_map != NULL) {
         float pos_err = anticogging_.index - pos_estimate;
         if (fabsf(pos_err) <= anticogging_.calib_pos_threshold &&
             fabsf(vel_estimate) < anticogging_.calib_vel_threshold) {
             anticogging_.cogging_map[anticogging_.index++] = vel_integrator_current_;
         }
         if (anticogging_.index < axis_->encoder_.config_.cpr) { // TODO: remove the dependency on encoder CPR
-            set_pos_setpoint(anticogging_.index, 0.0f, 0.0f);
+            apply_setpoint({ CTRL_MODE_POSITION_CONTROL, (float)anticogging_.index, 0.0f, 0.0f });
             return false;
         } else {
             anticogging_.index = 0;
-            set_pos_setpoint(0.0f, 0.0f, 0.0f);  // Send the motor home
+            apply_setpoint({ CTRL_MODE_POSITION_CONTROL, 0.0f, 0.0f, 0.0f });  // Send the motor home
             anticogging_.use_anticogging = true;  // We're good to go, enable anti-cogging
             anticogging_.calib_anticogging = false;
+            anticogging_.map_dirty = true;
             return true;
         }
     }
     return false;
 }
 
-bool Controller::update(float pos_estimate, float vel_estimate, float* current_setpoint_output) {
+// @brief Adds the mean of the samples of the current bin to the map.
+// Within one direction, each bin is seen once per revolution, so the
+// revolution number is the number of earlier averages in the bin.
+void Controller::commit_anticogging_bin() {
+    if (calib_bin_ >= 0 && calib_bin_n_ > 0) {
+        float mean = calib_bin_sum_ / (float)calib_bin_n_;
+        float weight = 1.0f / (float)(calib_bin_pass_ + 1);
+        if (anticogging_.cogging_map) {
+            float& value = anticogging_.cogging_map[calib_bin_];
+            value += (mean - value) * weight;
+        } else {
+            int16_t& bin = anticogging_.binned_map[calib_bin_];
+            float value = (float)bin * kAnticoggingBinScale;
+            value += (mean - value) * weight;
+            bin = (int16_t)std::max(std::min(roundf(value / kAnticoggingBinScale), 32767.0f), -32768.0f);
+        }
+    }
+    calib_bin_ = -1;
+    calib_bin_sum_ = 0.0f;
+    calib_bin_n_ = 0;
+}
+
+/*
+ * The continuous anti-cogging calibration sweeps the position setpoint at a
+ * constant, slow velocity over calib_fast_revolutions revolutions forward
+ * and then the same back. The current that holds the axis on the sweep is
+ * averaged per encoder count. Averaging both directions cancels out the
+ * friction, which otherwise shows up with the sign of the velocity.
+ */
+bool Controller::fast_anticogging_calibration(float pos_estimate_in_turn) {
+    if (!(anticogging_.calib_anticogging && anticogging_.calib_fast
+            && (anticogging_.cogging_map != NULL || anticogging_.binned_map != NULL)))
+        return false;
+
+    const int32_t cpr = axis_->encoder_.config_.cpr;
+    // Let the velocity loop settle after each reversal before recording
+    const float lead_in = 0.125f * (float)cpr;
+    const float sweep_length = lead_in + (float)(anticogging_.calib_fast_revolutions * cpr);
+    float dt = current_meas_period * axis_->control_loop_divider() * std::max(config_.pos_loop_divider, (int32_t)1);
+    // Every count must be sampled on every revolution
+    float step = std::min(anticogging_.calib_fast_vel * dt, 0.5f);
+
+    if (calib_sweep_dist_ >= sweep_length) {
+        commit_anticogging_bin();
+        if (calib_sweep_dir_ > 0.0f) {
+            calib_sweep_dir_ = -1.0f;
+            calib_sweep_dist_ = 0.0f;
+        } else {
+            apply_setpoint({ CTRL_MODE_POSITION_CONTROL, calib_sweep_pos_, 0.0f, 0.0f });
+            anticogging_.use_anticogging = true;
+            anticogging_.calib_anticogging = false;
+            anticogging_.calib_fast = false;
+            anticogging_.map_dirty = true;
+            return true;
+        }
+    }
+
+    if (calib_sweep_dist_ >= lead_in) {
+        // Each bin of the binned map is a contiguous range of counts, so it
+        // is also seen once per revolution
+        int32_t bin = anticogging_.cogging_map
+                ? mod(static_cast<int>(pos_estimate_in_turn), cpr)
+                : std::min((int32_t)(pos_estimate_in_turn * ((float)anticogging_.num_bins / (float)cpr)), anticogging_.num_bins - 1);
+        if (bin != calib_bin_) {
+            commit_anticogging_bin();
+            calib_bin_ = bin;
+            // the passes of the reverse direction follow those of the forward direction
+            calib_bin_pass_ = (int32_t)((calib_sweep_dist_ - lead_in) / (float)cpr)
+                    + (calib_sweep_dir_ > 0.0f ? 0 : anticogging_.calib_fast_revolutions);
+        }
+        calib_bin_sum_ += Iq_output_;
+        ++calib_bin_n_;
+    }
+
+    calib_sweep_pos_ += calib_sweep_dir_ * step;
+    calib_sweep_dist_ += step;
+    apply_setpoint({ CTRL_MODE_POSITION_CONTROL, calib_sweep_pos_, calib_sweep_dir_ * step / dt, 0.0f });
+    return false;
+}
+
+// @brief Runs the cascaded position/velocity controller.
+//
+// This is called once per control loop iteration (i.e. at the current loop rate).
+// The position loop (including trajectory evaluation) and the velocity loop
+// only run every config_.pos_loop_divider and config_.vel_loop_divider
+// iterations respectively. In between, the last velocity loop output is held.
+// The position estimate is pos_estimate_turns * encoder cpr + pos_estimate_in_turn.
+// cogging_pos_in_turn is the motor position within the turn, which differs
+// from pos_estimate_in_turn when the position comes from a load encoder.
+bool Controller::update(int32_t pos_estimate_turns, float pos_estimate_in_turn, float vel_estimate,
+        float cogging_pos_in_turn, float* current_setpoint_output) {
+    ProfilerScope prof(Profiler::SECTION_CONTROLLER_UPDATE);
+
+    apply_posted_setpoint();
+
+    uint32_t pos_loop_divider = std::max(config_.pos_loop_divider, (int32_t)1);
+    uint32_t vel_loop_divider = std::max(config_.vel_loop_divider, (int32_t)1);
+    // Countdowns rather than a modulo of a running count, which would slip
+    // when the count wraps around
+    bool run_pos_loop = pos_loop_countdown_ == 0;
+    bool run_vel_loop = vel_loop_countdown_ == 0;
+    pos_loop_countdown_ = run_pos_loop ? pos_loop_divider - 1 : std::min(pos_loop_countdown_ - 1, pos_loop_divider - 1);
+    vel_loop_countdown_ = run_vel_loop ? vel_loop_divider - 1 : std::min(vel_loop_countdown_ - 1, vel_loop_divider - 1);
+
+    update_gain_schedule(vel_estimate);
+    update_ramps();
+
+    if (run_pos_loop) {
+        uint16_t start_timing = axis_->motor_.get_pwm_timing();
+        if (config_.control_mode == CTRL_MODE_GEARING_CONTROL && !update_gearing())
+            return false;
+        update_position_loop(pos_estimate_turns, pos_estimate_in_turn, vel_estimate, cogging_pos_in_turn);
+        axis_->motor_.log_loop_timing(axis_->motor_.pos_loop_timing_, start_timing);
+    }
+
+    if (run_vel_loop) {
+        uint16_t start_timing = axis_->motor_.get_pwm_timing();
+        float dt = current_meas_period * axis_->control_loop_divider() * vel_loop_divider;
+        update_velocity_loop(vel_estimate, dt);
+        axis_->motor_.log_loop_timing(axis_->motor_.vel_loop_timing_, start_timing);
+    }
+
+    Iq_filtered_ = filter_iq(Iq_output_);
+
+    if (current_setpoint_output) *current_setpoint_output = Iq_filtered_;
+    return true;
+}
+
+// @brief Returns the cam_table offset [counts] at a gear_axis position [counts]
+// and its slope [counts/count] in *slope. Zero without a cam table.
+float Controller::cam_lookup(double gear_pos, float* slope) {
+    int32_t n = std::min(config_.cam_points, (int32_t)kCamTableSize);
+    if (n <= 0 || !(config_.cam_period > 0.0f)) {
+        *slope = 0.0f;
+        return 0.0f;
+    }
+    double period = (double)config_.cam_period;
+    float x = (float)((gear_pos - floor(gear_pos / period) * period) / period) * (float)n; // [0, n)
+    int32_t i = std::min((int32_t)x, n - 1);
+    float frac = x - (float)i;
+    float a = config_.cam_table[i];
+    float b = config_.cam_table[(i + 1) % n];
+    *slope = (b - a) * (float)n / config_.cam_period;
+    return a + (b - a) * frac;
+}
+
+// @brief Slews vel_setpoint_ and current_setpoint_ towards their ramp
+// targets in the control modes whose ramp is enabled. Runs every control
+// loop iteration, so that the ramp doesn't step with the loop dividers.
+void Controller::update_ramps() {
+    float dt = current_meas_period * axis_->control_loop_divider();
+    if (config_.control_mode == CTRL_MODE_VELOCITY_CONTROL && config_.vel_ramp_enable) {
+        float max_step = std::max(config_.vel_ramp_rate, 0.0f) * dt;
+        vel_setpoint_ += std::min(std::max(vel_ramp_target_ - vel_setpoint_, -max_step), max_step);
+    }
+    if (config_.control_mode == CTRL_MODE_CURRENT_CONTROL && config_.current_ramp_enable) {
+        float max_step = std::max(config_.current_ramp_rate, 0.0f) * dt;
+        current_setpoint_ += std::min(std::max(current_ramp_target_ - current_setpoint_, -max_step), max_step);
+    }
+}
+
+// @brief Sets the setpoints from the encoder of config_.gear_axis:
+// pos_setpoint = gear_offset + gear_ratio * gear_pos + cam_table(gear_pos),
+// with the velocity of the gear axis fed forward through the same relation.
+// The gear axis position comes from its snapshot of the last control loop
+// iteration, so it lags by at most one iteration.
+// @return: false if gear_axis is invalid or its encoder has an error
+bool Controller::update_gearing() {
+    int32_t gear_axis = config_.gear_axis;
+    AxisSnapshot_t snapshot;
+    if (gear_axis < 0 || gear_axis >= (int32_t)AXIS_COUNT || axes[gear_axis] == axis_
+            || !axes[gear_axis]->snapshot_buffer_.read(&snapshot)
+            || snapshot.encoder_error != Encoder::ERROR_NONE)
+        return false;
+    // In double precision, so that large positions keep the in-turn resolution
+    double gear_pos = (double)snapshot.pos_estimate_turns * (double)axes[gear_axis]->encoder_.config_.cpr
+            + (double)snapshot.pos_estimate_in_turn;
+    float cam_slope;
+    float cam = cam_lookup(gear_pos, &cam_slope);
+    double geared = (double)config_.gear_ratio * gear_pos + (double)cam;
+    if (gear_align_) {
+        config_.gear_offset = (float)((double)pos_setpoint_ - geared);
+        gear_align_ = false;
+    }
+    pos_setpoint_ = (float)((double)config_.gear_offset + geared);
+    vel_setpoint_ = (config_.gear_ratio + cam_slope) * snapshot.vel_estimate;
+    return true;
+}
+
+// @brief Computes the biquad coefficients of the enabled config_.iq_filter
+// stages for the control loop rate and clears the filter state.
+// Stages at or above 0.45 times the control loop rate are skipped.
+// This only runs on configuration changes, so it uses the accurate libm
+// sin/cos: low frequency stages are sensitive to errors in cos(w0).
+// The coefficients follow the Audio EQ Cookbook (R. Bristow-Johnson).
+void Controller::update_iq_filter_coeffs() {
+    iq_filter_dirty_ = false;
+    float fs = 1.0f / (current_meas_period * axis_->control_loop_divider()); // [Hz]
+
+    uint32_t n = 0;
+    for (size_t i = 0; i < kIqFilterStages; ++i) {
+        const IqFilterStage_t& stage = config_.iq_filter[i];
+        if (stage.type == IQ_FILTER_NONE || stage.frequency <= 0.0f
+                || stage.frequency >= 0.45f * fs || stage.q <= 0.0f)
+            continue;
+        float w0 = 2.0f * M_PI * stage.frequency / fs;
+        float cos_w0 = cosf(w0);
+        float alpha = sinf(w0) / (2.0f * stage.q);
+        float a0 = 1.0f + alpha;
+        float b0, b1, b2;
+        if (stage.type == IQ_FILTER_NOTCH) {
+            b0 = 1.0f;
+            b1 = -2.0f * cos_w0;
+            b2 = 1.0f;
+        } else if (stage.type == IQ_FILTER_LOWPASS) {
+            b0 = 0.5f * (1.0f - cos_w0);
+            b1 = 1.0f - cos_w0;
+            b2 = 0.5f * (1.0f - cos_w0);
+        } else {
+            continue;
+        }
+        // CMSIS expects {b0, b1, b2, a1, a2} normalized to a0, with the
+        // feedback coefficients negated.
+        float* c = &iq_filter_coeffs_[5 * n++];
+        c[0] = b0 / a0;
+        c[1] = b1 / a0;
+        c[2] = b2 / a0;
+        c[3] = 2.0f * cos_w0 / a0;
+        c[4] = -(1.0f - alpha) / a0;
+    }
+
+    iq_filter_active_stages_ = n;
+    if (n > 0)
+        arm_biquad_cascade_df2T_init_f32(&iq_filter_, n, iq_filter_coeffs_, iq_filter_state_);
+}
+
+// @brief Runs the current command through the filter and limits the result.
+// A notch can overshoot a step command, so the current limit is applied again.
+float Controller::filter_iq(float Iq) {
+    if (iq_filter_dirty_)
+        update_iq_filter_coeffs();
+    if (iq_filter_active_stages_ == 0)
+        return Iq;
+
+    float out;
+    arm_biquad_cascade_df2T_f32(&iq_filter_, &Iq, &out, 1);
+    float Ilim = axis_->motor_.effective_current_lim();
+    return std::max(std::min(out, Ilim), -Ilim);
+}
+
+// @brief Interpolates the gain multipliers from config_.gain_schedule.
+// Outside of the range of keys, the first or last point applies.
+void Controller::update_gain_schedule(float vel_estimate) {
+    int32_t n = std::min(config_.gain_schedule_points, (int32_t)kGainScheduleSize);
+    if (config_.gain_schedule_mode == GAIN_SCHEDULE_NONE || n <= 0) {
+        pos_gain_scale_ = 1.0f;
+        vel_gain_scale_ = 1.0f;
+        vel_integrator_gain_scale_ = 1.0f;
+        return;
+    }
+
+    float key = (config_.gain_schedule_mode == GAIN_SCHEDULE_VELOCITY) ? fabsf(vel_estimate) : load_index_;
+    const GainSchedulePoint_t* points = config_.gain_schedule;
+    int32_t i = 0;
+    while (i < n - 2 && key >= points[i + 1].key)
+        ++i;
+    const GainSchedulePoint_t& p0 = points[i];
+    const GainSchedulePoint_t& p1 = points[std::min(i + 1, n - 1)];
+    float frac = 0.0f;
+    if (p1.key > p0.key)
+        frac = std::max(std::min((key - p0.key) / (p1.key - p0.key), 1.0f), 0.0f);
+    pos_gain_scale_ = p0.pos_gain_scale + frac * (p1.pos_gain_scale - p0.pos_gain_scale);
+    vel_gain_scale_ = p0.vel_gain_scale + frac * (p1.vel_gain_scale - p0.vel_gain_scale);
+    vel_integrator_gain_scale_ = p0.vel_integrator_gain_scale + frac * (p1.vel_integrator_gain_scale - p0.vel_integrator_gain_scale);
+}
+
+// @brief Updates the disturbance observer with the last current command
+// (after the current command filter).
+//
+// The observer tracks the velocity estimate with a model of the inertia and
+// estimates the load current, i.e. the current that goes into anything but
+// accelerating the inertia (friction, gravity, process forces). The gains
+// place both observer poles at config_.disturbance_observer_bandwidth.
+//
+// A wrong inertia shows up in the load current estimate as a term
+// proportional to the acceleration. While accelerating faster than
+// config_.inertia_estimation_min_accel, the inertia is adapted to remove
+// that term (normalized LMS). The load is assumed to stay at the level it
+// had before the acceleration started.
+void Controller::update_disturbance_observer(float vel_estimate, float dt) {
+    float J = inertia_estimate_;
+    if (!config_.use_disturbance_observer || J <= 0.0f) {
+        load_current_estimate_ = 0.0f;
+        dob_vel_ = vel_estimate;
+        dob_accel_ = 0.0f;
+        dob_load_baseline_ = 0.0f;
+        return;
+    }
+
+    // The discrete time approximation is only good up to about a quarter of the update rate
+    float bandwidth = std::min(config_.disturbance_observer_bandwidth, 0.25f / dt);
+    float l1 = 2.0f * bandwidth;
+    float l2 = J * bandwidth * bandwidth;
+
+    float err = vel_estimate - dob_vel_;
+    dob_accel_ = (Iq_filtered_ - load_current_estimate_) / J + l1 * err;
+    dob_vel_ += dt * dob_accel_;
+    load_current_estimate_ -= dt * l2 * err;
+
+    float accel = dob_accel_;
+    if (fabsf(accel) < config_.inertia_estimation_min_accel) {
+        // Baseline follows the load with the adaptation time constant
+        if (config_.inertia_estimation_time > 0.0f)
+            dob_load_baseline_ += std::min(dt / config_.inertia_estimation_time, 1.0f) * (load_current_estimate_ - dob_load_baseline_);
+    } else if (config_.inertia_estimation && config_.inertia_estimation_time > 0.0f) {
+        // load_current_estimate_ - baseline = (J_true - J) * accel
+        float mu = std::min(dt / config_.inertia_estimation_time, 1.0f);
+        float J_new = J + mu * (load_current_estimate_ - dob_load_baseline_) / accel;
+        // Do not let the estimate collapse or run away on a bad excitation
+        inertia_estimate_ = std::max(std::min(J_new, 10.0f * J), 0.1f * J);
+    }
+}
+
+// @brief Feeds the setpoints of this position loop update through the input
+// shaper, see config_.input_shaper_type.
+// @returns true if the shaper is active, its output_ then holds the setpoints
+bool Controller::update_input_shaper() {
+    float dt = current_meas_period * axis_->control_loop_divider() * std::max(config_.pos_loop_divider, (int32_t)1);
+    if (input_shaper_dirty_ || dt != input_shaper_.dt_) {
+        input_shaper_dirty_ = false;
+        input_shaper_.configure(config_.input_shaper_type, config_.input_shaper_frequency,
+                                config_.input_shaper_damping, config_.input_shaper_tolerance, dt);
+        input_shaper_active_ = false;
+    }
+
+    // Gearing follows another axis, which the shaper would only delay
+    bool shaped_mode = config_.control_mode == CTRL_MODE_POSITION_CONTROL
+            || config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL
+            || config_.control_mode == CTRL_MODE_STREAMING_CONTROL;
+    InputShaper::Sample_t input = { pos_setpoint_, vel_setpoint_, current_setpoint_ };
+    if (!shaped_mode || input_shaper_.num_impulses_ == 0) {
+        input_shaper_.output_ = input;
+        input_shaper_active_ = false;
+        return false;
+    }
+    // Start from the setpoints at hand, as if they had been held forever
+    if (!input_shaper_active_)
+        input_shaper_.reset(input);
+    input_shaper_.update(input);
+    input_shaper_active_ = true;
+    return true;
+}
+
+// @brief Trajectory evaluation and position control.
+// Updates vel_des_ and anticogging_pos_ for the velocity loop.
+void Controller::update_position_loop(int32_t pos_estimate_turns, float pos_estimate_in_turn, float vel_estimate,
+        float cogging_pos_in_turn) {
+    const float cpr = (float)axis_->encoder_.config_.cpr;
+    float pos_estimate = (float)pos_estimate_turns * cpr + pos_estimate_in_turn;
+
     // Only runs if anticogging_.calib_anticogging is true; non-blocking
     anticogging_calibration(pos_estimate, vel_estimate);
-    float anticogging_pos = pos_estimate;
+    fast_anticogging_calibration(pos_estimate_in_turn);
+    anticogging_pos_ = cogging_pos_in_turn; // the cogging map is indexed modulo cpr
 
     // Trajectory control
     if (config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL) {
-        // Note: uint32_t loop count delta is OK across overflow
-        // Beware of negative deltas, as they will not be well behaved due to uint!
-        float t = (axis_->loop_counter_ - traj_start_loop_count_) * current_meas_period;
-        if (t > axis_->trap_.Tf_) {
-            // Drop into position control mode when done to avoid problems on loop counter delta overflow
+        float t = trajectory_time();
+        float Tf = traj_scurve_ ? scurve_.Tf_ : axis_->trap_.Tf_;
+        float T_decel = traj_scurve_ ? (scurve_.Ta_ + scurve_.Tv_) : (axis_->trap_.Ta_ + axis_->trap_.Tv_);
+        // Blend into the next queued move: replanning from the current
+        // setpoint keeps the velocity, so the axis does not stop in between.
+        if ((t > Tf || (config_.blend_queued_moves && t >= T_decel)) && start_queued_move()) {
+            t = traj_t0_;
+            Tf = traj_scurve_ ? scurve_.Tf_ : axis_->trap_.Tf_;
+        }
+        if (t > Tf) {
+            // Drop into position control mode when done
             config_.control_mode = CTRL_MODE_POSITION_CONTROL;
             // pos_setpoint already set by trajectory
             vel_setpoint_ = 0.0f;
             current_setpoint_ = 0.0f;
         } else {
-            TrapezoidalTrajectory::Step_t traj_step = axis_->trap_.eval(t);
+            TrapezoidalTrajectory::Step_t traj_step = eval_trajectory(t);
             pos_setpoint_ = traj_step.Y;
             vel_setpoint_ = traj_step.Yd;
             current_setpoint_ = traj_step.Ydd * axis_->trap_.config_.A_per_css;
         }
-        anticogging_pos = pos_setpoint_; // FF the position setpoint instead of the pos_estimate
+        anticogging_pos_ = pos_setpoint_; // FF the position setpoint instead of the pos_estimate
+    }
+
+    // Streaming control
+    if (config_.control_mode == CTRL_MODE_STREAMING_CONTROL) {
+        update_stream();
+        anticogging_pos_ = pos_setpoint_;
+    }
+
+    // G-code path, shared by the axes
+    if (config_.control_mode == CTRL_MODE_PATH_CONTROL) {
+        float accel;
+        if (gcode.eval(axis_, &pos_setpoint_, &vel_setpoint_, &accel)) {
+            current_setpoint_ = accel * axis_->trap_.config_.A_per_css;
+        } else {
+            // Hold the end of the path
+            config_.control_mode = CTRL_MODE_POSITION_CONTROL;
+            vel_setpoint_ = 0.0f;
+            current_setpoint_ = 0.0f;
+        }
+        anticogging_pos_ = pos_setpoint_;
     }
 
+    // Electronic gearing, the setpoints were set by update_gearing()
+    if (config_.control_mode == CTRL_MODE_GEARING_CONTROL)
+        anticogging_pos_ = pos_setpoint_;
+
     // Position control
     // TODO Decide if we want to use encoder or pll position here
+    // A held setpoint is brought back into [0, cpr) in circular mode, so that
+    // it doesn't lose resolution however many turns the axis makes.
+    // The generated setpoints of the other modes stay continuous.
+    if (config_.circular_setpoints && config_.control_mode == CTRL_MODE_POSITION_CONTROL
+            && !(pos_setpoint_ >= 0.0f && pos_setpoint_ < cpr)) {
+        float turns = floorf(pos_setpoint_ / cpr);
+        pos_setpoint_ = std::min(pos_setpoint_ - turns * cpr, nextafterf(cpr, 0.0f));
+        pos_setpoint_turns_ += (int32_t)turns;
+        if (input_shaper_active_)
+            input_shaper_.shift_pos(-turns * cpr);
+    }
+
+    float pos_setpoint = pos_setpoint_;
     float vel_des = vel_setpoint_;
+    if (update_input_shaper()) {
+        pos_setpoint = input_shaper_.output_.pos;
+        vel_des = input_shaper_.output_.vel;
+        if (config_.control_mode != CTRL_MODE_POSITION_CONTROL)
+            anticogging_pos_ = pos_setpoint;
+    }
     if (config_.control_mode >= CTRL_MODE_POSITION_CONTROL) {
-        float pos_err = pos_setpoint_ - pos_estimate;
-        vel_des += config_.pos_gain * pos_err;
+        float pos_err;
+        if (config_.circular_setpoints) {
+            pos_err = wrap_pm(fmodf_pos(pos_setpoint, cpr) - pos_estimate_in_turn, 0.5f * cpr);
+        } else {
+            // Subtract the whole turns in double precision first, so that the error
+            // keeps the resolution of the in-turn estimate at large positions
+            pos_err = (float)((double)pos_setpoint - (double)pos_estimate_turns * (double)cpr) - pos_estimate_in_turn;
+        }
+        vel_des += (pos_gain_scale_ * config_.pos_gain) * pos_err;
     }
+    vel_des_ = vel_des;
+}
+
+// @brief Friction model at the velocity vel [counts/s]:
+// sign(vel) * (coulomb + stribeck * exp(-|vel| / stribeck_vel)) + viscous * vel,
+// with the sign smoothed over +/- config_.friction_sign_band.
+// See Axis::run_friction_identification().
+float Controller::friction_current(float vel) {
+    float band = config_.friction_sign_band;
+    float sign = (band > 0.0f) ? std::max(std::min(vel / band, 1.0f), -1.0f)
+                               : (float)((vel > 0.0f) - (vel < 0.0f));
+    float breakaway = config_.friction_coulomb;
+    if (config_.friction_stribeck != 0.0f && config_.friction_stribeck_vel > 0.0f)
+        breakaway += config_.friction_stribeck * expf(-fabsf(vel) / config_.friction_stribeck_vel);
+    return sign * breakaway + config_.friction_viscous * vel;
+}
+
+// @brief Velocity control, anti-cogging feed-forward and current limiting.
+// Updates Iq_output_.
+// @param dt: time since the last velocity loop update [s]
+void Controller::update_velocity_loop(float vel_estimate, float dt) {
+    update_disturbance_observer(vel_estimate, dt);
+
+    // In velocity control mode (and below) the position loop does not
+    // contribute, so follow setpoint changes at the velocity loop rate
+    float vel_des = (config_.control_mode >= CTRL_MODE_POSITION_CONTROL) ? vel_des_ : vel_setpoint_;
+    vel_des += vel_injection_;
 
     // Velocity limiting
     float vel_lim = config_.vel_limit;
@@ -127,25 +1039,29 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
     if (vel_des < -vel_lim) vel_des = -vel_lim;
 
     // Velocity control
-    float Iq = current_setpoint_;
+    float Iq = input_shaper_active_ ? input_shaper_.output_.current : current_setpoint_;
 
     // Anti-cogging is enabled after calibration
     // We get the current position and apply a current feed-forward
-    // ensuring that we handle negative encoder positions properly (-1 == motor->encoder.encoder_cpr - 1)
     if (anticogging_.use_anticogging) {
-        Iq += anticogging_.cogging_map[mod(static_cast<int>(anticogging_pos), axis_->encoder_.config_.cpr)];
+        Iq += anticogging_current(anticogging_pos_);
     }
 
     float v_err = vel_des - vel_estimate;
     if (config_.control_mode >= CTRL_MODE_VELOCITY_CONTROL) {
-        Iq += config_.vel_gain * v_err;
+        Iq += (vel_gain_scale_ * config_.vel_gain) * v_err;
+        // Compensate the load before the integrator has to
+        Iq += config_.disturbance_ff_gain * load_current_estimate_;
+        if (config_.enable_friction_ff)
+            Iq += friction_current(vel_des);
     }
 
     // Velocity integral action before limiting
     Iq += vel_integrator_current_;
 
     // Current limiting
-    float Ilim = std::min(axis_->motor_.config_.current_lim, axis_->motor_.current_control_.max_allowed_current);
+    float Ilim = axis_->motor_.effective_current_lim();
+    float Iq_unlimited = Iq;
     bool limited = false;
     if (Iq > Ilim) {
         limited = true;
@@ -161,14 +1077,21 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
         // reset integral if not in use
         vel_integrator_current_ = 0.0f;
     } else {
-        if (limited) {
-            // TODO make decayfactor configurable
-            vel_integrator_current_ *= 0.99f;
-        } else {
-            vel_integrator_current_ += (config_.vel_integrator_gain * current_meas_period) * v_err;
+        float integrator_step = (vel_integrator_gain_scale_ * config_.vel_integrator_gain * dt) * v_err;
+        if (config_.vel_integrator_anti_windup == ANTI_WINDUP_BACK_CALCULATION) {
+            // Keep integrating, minus the current that the limit cut off
+            float back_calc = std::min(config_.vel_integrator_back_calc_gain * dt, 1.0f);
+            vel_integrator_current_ += integrator_step + back_calc * (Iq - Iq_unlimited);
+        } else if (!limited) {
+            vel_integrator_current_ += integrator_step;
+        } else if (config_.vel_integrator_anti_windup == ANTI_WINDUP_DECAY) {
+            // The decay is specified in time, so that it does not depend on the loop rate.
+            // First order approximation of exp(-dt/tau), dt << tau
+            float decay_time = config_.vel_integrator_decay_time;
+            if (decay_time > 0.0f)
+                vel_integrator_current_ *= std::max(1.0f - dt / decay_time, 0.0f);
         }
     }
 
-    if (current_setpoint_output) *current_setpoint_output = Iq;
-    return true;
+    Iq_output_ = Iq;
 }
@@ -14,7 +14,74 @@ public:
         CTRL_MODE_CURRENT_CONTROL = 1,
         CTRL_MODE_VELOCITY_CONTROL = 2,
         CTRL_MODE_POSITION_CONTROL = 3,
-        CTRL_MODE_TRAJECTORY_CONTROL = 4
+        CTRL_MODE_TRAJECTORY_CONTROL = 4,
+        CTRL_MODE_STREAMING_CONTROL = 5,
+        CTRL_MODE_GEARING_CONTROL = 6, //<! follow the encoder of config_.gear_axis, see update_gearing()
+        CTRL_MODE_PATH_CONTROL = 7     //<! follow the G-code path, see Gcode
+    };
+
+    enum GainScheduleMode_t {
+        GAIN_SCHEDULE_NONE = 0,
+        GAIN_SCHEDULE_VELOCITY = 1,   //<! keyed by the absolute velocity estimate [counts/s]
+        GAIN_SCHEDULE_LOAD_INDEX = 2, //<! keyed by load_index_, set by the user
+    };
+
+    enum AntiWindupMode_t {
+        ANTI_WINDUP_DECAY = 0,            //<! decay the integrator with vel_integrator_decay_time while limited
+        ANTI_WINDUP_CLAMP = 1,            //<! hold the integrator while limited
+        ANTI_WINDUP_BACK_CALCULATION = 2, //<! feed the excess current back into the integrator
+    };
+
+    enum IqFilterType_t {
+        IQ_FILTER_NONE = 0,
+        IQ_FILTER_NOTCH = 1,   //<! rejects a band around frequency, q = frequency / bandwidth
+        IQ_FILTER_LOWPASS = 2, //<! second order low-pass, q = 0.707 for a Butterworth response
+    };
+
+    // One biquad stage of the filter on the current command
+    struct IqFilterStage_t {
+        IqFilterType_t type = IQ_FILTER_NONE;
+        float frequency = 1000.0f; // [Hz] notch or cutoff frequency
+        float q = 0.707f;
+    };
+    static constexpr size_t kIqFilterStages = 3;
+
+    // Gain multipliers at one key value of the gain schedule
+    struct GainSchedulePoint_t {
+        float key = 0.0f;
+        float pos_gain_scale = 1.0f;
+        float vel_gain_scale = 1.0f;
+        float vel_integrator_gain_scale = 1.0f;
+    };
+    static constexpr size_t kGainScheduleSize = 4;
+    static constexpr size_t kCamTableSize = 8;
+
+    // One time-stamped sample of a setpoint stream
+    struct StreamSample_t {
+        float t;       // [s] since the start of the stream
+        float pos;     // [counts]
+        float vel;     // [counts/s]
+        float current; // [A]
+    };
+
+    // Setpoints of one set_pos_setpoint(), set_vel_setpoint() or
+    // set_current_setpoint() call. The control mode selects which of them apply.
+    struct SetpointCommand_t {
+        ControlMode_t control_mode;
+        float pos_setpoint;     // [counts]
+        float vel_setpoint;     // [counts/s]
+        float current_setpoint; // [A]
+    };
+
+    // One move of the move queue. The limits override those of
+    // trap_traj.config when they are positive.
+    struct QueuedMove_t {
+        float goal_point;           // [counts]
+        float vel_limit;            // [counts/s]
+        float accel_limit;          // [counts/s^2]
+        float decel_limit;          // [counts/s^2]
+        float jerk_limit;           // [counts/s^3]
+        uint64_t start_meas_count;  // see Axis::get_meas_count(), 0 to start when planned
     };
 
     struct Config_t {
@@ -24,23 +91,113 @@ public:
         // float vel_gain = 5.0f / 200.0f, // [A/(rad/s)] <sensorless example>
         float vel_integrator_gain = 10.0f / 10000.0f;  // [A/(counts/s * s)]
         float vel_limit = 20000.0f;           // [counts/s]
+        int32_t vel_loop_divider = 1; //<! run the velocity loop every N-th control loop iteration
+        int32_t pos_loop_divider = 1; //<! run the position loop and trajectory every N-th control loop iteration
+        bool blend_queued_moves = true; //<! start the next queued move when the current one starts to decelerate
+        bool circular_setpoints = false; //<! control the position modulo one revolution: the position error takes the
+                                         //   shorter way round and pos_setpoint is held within [0, cpr), see pos_setpoint_turns_
+        InputShaperType_t input_shaper_type = INPUT_SHAPER_NONE; //<! shape the setpoints of the position, trajectory
+                                                                 //   and streaming modes against a vibration of the load
+        float input_shaper_frequency = 10.0f; //<! [Hz] natural frequency of the vibration
+        float input_shaper_damping = 0.0f;    //<! damping ratio of the vibration
+        float input_shaper_tolerance = 0.05f; //<! residual vibration that INPUT_SHAPER_EI leaves at input_shaper_frequency
+        int32_t anticogging_bins = 0; //<! store the anti-cogging map as this many interpolated int16 bins instead of
+                                      //   one float per encoder count, 0 to disable. Applied at startup.
+        bool anticogging_map_in_flash = false; //<! use a saved anti-cogging map in place in flash instead of
+                                               //   copying it into RAM. Applied at startup.
+        AntiWindupMode_t vel_integrator_anti_windup = ANTI_WINDUP_DECAY;
+        float vel_integrator_decay_time = 0.0125f; //<! [s] time constant for ANTI_WINDUP_DECAY
+        float vel_integrator_back_calc_gain = 100.0f; //<! [1/s] rate at which ANTI_WINDUP_BACK_CALCULATION removes the excess current
+        GainScheduleMode_t gain_schedule_mode = GAIN_SCHEDULE_NONE;
+        int32_t gain_schedule_points = 0; //<! number of valid entries in gain_schedule, sorted by increasing key
+        GainSchedulePoint_t gain_schedule[kGainScheduleSize];
+        IqFilterStage_t iq_filter[kIqFilterStages]; //<! applied to the current command in this order
+        bool use_disturbance_observer = false;
+        float inertia = 0.0f;                           //<! [A/(counts/s^2)] initial value of inertia_estimate_
+        float disturbance_observer_bandwidth = 200.0f;  //<! [rad/s]
+        float disturbance_ff_gain = 1.0f;               //<! fraction of the load current estimate that is fed forward
+        bool inertia_estimation = false;                //<! adapt inertia_estimate_ while accelerating
+        float inertia_estimation_time = 1.0f;           //<! [s] time constant of the adaptation
+        float inertia_estimation_min_accel = 10000.0f;  //<! [counts/s^2] only adapt above this acceleration
+        int32_t gear_axis = -1;     //<! axis whose encoder drives the setpoint in CTRL_MODE_GEARING_CONTROL
+        float gear_ratio = 1.0f;    //<! [counts/count] follower counts per count of the gear_axis encoder
+        float gear_offset = 0.0f;   //<! [counts] follower position at gear_axis position 0, set by start_gearing()
+        int32_t cam_points = 0;     //<! number of valid entries in cam_table, 0 for plain gearing
+        float cam_period = 8192.0f; //<! [counts of gear_axis] the cam_table repeats with this period
+        float cam_table[kCamTableSize] = { 0.0f }; //<! [counts] added to the geared position at cam_points evenly
+                                                   //<! spaced gear_axis positions of cam_period, interpolated linearly
+        bool vel_ramp_enable = false;     //<! in CTRL_MODE_VELOCITY_CONTROL, slew vel_setpoint towards vel_ramp_target
+        float vel_ramp_rate = 10000.0f;   //<! [counts/s^2]
+        bool current_ramp_enable = false; //<! in CTRL_MODE_CURRENT_CONTROL, slew current_setpoint towards current_ramp_target
+        float current_ramp_rate = 1.0f;   //<! [A/s]
+        bool enable_friction_ff = false;     //<! add friction_current() of the velocity command in velocity control and above
+        float friction_coulomb = 0.0f;       //<! [A]
+        float friction_viscous = 0.0f;       //<! [A/(counts/s)]
+        float friction_stribeck = 0.0f;      //<! [A] breakaway current on top of friction_coulomb at standstill
+        float friction_stribeck_vel = 500.0f; //<! [counts/s] the Stribeck term decays to 1/e at this velocity
+        float friction_sign_band = 100.0f;   //<! [counts/s] the Coulomb and Stribeck terms change sign linearly
+                                             //<! within +/- this velocity, so that they don't chatter at standstill
     };
 
+    static constexpr uint32_t kMoveQueueLength = 16;
+    static constexpr uint32_t kStreamBufferLength = 64;
+    static constexpr float kAnticoggingBinScale = 0.001f; // [A/LSB] of the binned anti-cogging map
+
     Controller(Config_t& config);
     void reset();
 
     void set_pos_setpoint(float pos_setpoint, float vel_feed_forward, float current_feed_forward);
     void set_vel_setpoint(float vel_setpoint, float current_feed_forward);
     void set_current_setpoint(float current_setpoint);
+    void post_setpoint(const SetpointCommand_t& command);
+    void apply_setpoint(const SetpointCommand_t& command);
+    bool apply_posted_setpoint();
 
     // Trajectory-Planned control
     void move_to_pos(float goal_point);
+    void replace_moves(const QueuedMove_t& move);
+    bool queue_move(float goal_point);
+    bool push_move(const QueuedMove_t& move);
+    void clear_move_queue();
+
+    // Streaming setpoint control
+    void start_stream();
+    bool push_stream_sample(float t, float pos, float vel, float current);
+
+    // Electronic gearing and camming
+    void start_gearing();
+    bool update_gearing();
+    float cam_lookup(double gear_pos, float* slope);
     
     // TODO: make this more similar to other calibration loops
+    int32_t get_anticogging_num_bins();
+    bool allocate_anticogging_map();
+    bool move_anticogging_map_to_ram();
+    float anticogging_current(float pos);
     void start_anticogging_calibration();
     bool anticogging_calibration(float pos_estimate, float vel_estimate);
+    void start_fast_anticogging_calibration();
+    bool fast_anticogging_calibration(float pos_estimate_in_turn);
 
-    bool update(float pos_estimate, float vel_estimate, float* current_setpoint);
+    bool update(int32_t pos_estimate_turns, float pos_estimate_in_turn, float vel_estimate,
+            float cogging_pos_in_turn, float* current_setpoint);
+    void update_position_loop(int32_t pos_estimate_turns, float pos_estimate_in_turn, float vel_estimate,
+            float cogging_pos_in_turn);
+    void update_velocity_loop(float vel_estimate, float dt);
+    void update_gain_schedule(float vel_estimate);
+    void update_disturbance_observer(float vel_estimate, float dt);
+    float friction_current(float vel);
+    void update_iq_filter_coeffs();
+    bool update_input_shaper();
+    float filter_iq(float Iq);
+    void plan_move(const QueuedMove_t& move);
+    float trajectory_time();
+    TrapezoidalTrajectory::Step_t eval_trajectory(float t);
+    uint32_t move_queue_head();
+    void commit_anticogging_bin();
+    bool start_queued_move();
+    void update_stream();
+    void update_ramps();
 
     Config_t& config_;
     Axis* axis_ = nullptr; // set by Axis constructor
@@ -49,48 +206,254 @@ public:
     // - expose selected (all?) variables on protocol
     // - make calibration user experience similar to motor & encoder calibration
     // - use python tools to Fourier transform and write back the smoothed map or Fourier coefficients
-    // - make the calibration persistent
 
+    // Exactly one of cogging_map (one float per encoder count) and
+    // binned_map (num_bins int16 values, see kAnticoggingBinScale) is allocated.
     typedef struct {
         int index;
         float *cogging_map;
+        int16_t *binned_map;
+        int32_t num_bins;
         bool use_anticogging;
         bool calib_anticogging;
         float calib_pos_threshold;
         float calib_vel_threshold;
+        bool map_saved;   // flash holds this map (loaded at startup or saved since)
+        bool map_dirty;   // the map was calibrated and is saved with the next save_configuration()
+        bool calib_fast;  // the running calibration is the continuous one
+        float calib_fast_vel;           // [counts/s] sweep velocity of the continuous calibration
+        int32_t calib_fast_revolutions; // number of revolutions per direction
+        size_t cogging_map_bytes; // size of the allocated map, for the protocol
+        size_t binned_map_bytes;
+        bool map_in_flash; // the map is read in place from flash, see move_anticogging_map_to_ram()
+        bool map_alloc_failed; // neither the table pools nor the heap had room for the map, see table_alloc()
     } Anticogging_t;
     Anticogging_t anticogging_ = {
         .index = 0,
         .cogging_map = nullptr,
+        .binned_map = nullptr,
+        .num_bins = 0,
         .use_anticogging = false,
         .calib_anticogging = false,
         .calib_pos_threshold = 1.0f,
         .calib_vel_threshold = 1.0f,
+        .map_saved = false,
+        .map_dirty = false,
+        .calib_fast = false,
+        .calib_fast_vel = 1000.0f,
+        .calib_fast_revolutions = 4,
+        .cogging_map_bytes = 0,
+        .binned_map_bytes = 0,
+        .map_in_flash = false,
+        .map_alloc_failed = false,
     };
+    // State of the continuous calibration
+    float calib_sweep_pos_ = 0.0f;  // [counts] position setpoint of the sweep
+    float calib_sweep_dist_ = 0.0f; // [counts] distance covered in the current direction
+    float calib_sweep_dir_ = 1.0f;
+    int32_t calib_bin_ = -1;        // map or bin index of the samples in calib_bin_sum_, -1 if none
+    int32_t calib_bin_pass_ = 0;    // revolution during which calib_bin_ was sampled
+    float calib_bin_sum_ = 0.0f;    // [A]
+    uint32_t calib_bin_n_ = 0;
 
     // variables exposed on protocol
     float pos_setpoint_ = 0.0f;
+    int32_t pos_setpoint_turns_ = 0; // whole turns taken off pos_setpoint_ in config_.circular_setpoints mode
     float vel_setpoint_ = 0.0f;
     // float vel_setpoint = 800.0f; <sensorless example>
     float vel_integrator_current_ = 0.0f;  // [A]
     float current_setpoint_ = 0.0f;        // [A]
+    float vel_ramp_target_ = 0.0f;         // [counts/s] see config_.vel_ramp_enable
+    float current_ramp_target_ = 0.0f;     // [A] see config_.current_ramp_enable
+    float vel_injection_ = 0.0f;           // [counts/s] added to the velocity command, see FrequencyResponse
 
-    uint32_t traj_start_loop_count_ = 0;
+    // Setpoint mailbox. The communication threads and interrupts post
+    // commands, the control loop applies the newest one at the start of its
+    // next update, so that all setpoints of a command change together.
+    // setpoint_seq_ is odd while setpoint_mailbox_ is written.
+    SetpointCommand_t setpoint_mailbox_ = { CTRL_MODE_POSITION_CONTROL, 0.0f, 0.0f, 0.0f };
+    volatile uint32_t setpoint_seq_ = 0;
+    uint32_t setpoint_applied_seq_ = 0; // setpoint_seq_ of the last applied command
+
+    uint64_t traj_start_meas_count_ = 0; // see Axis::get_meas_count()
+    float traj_t0_ = 0.0f; // [s] trajectory time at traj_start_meas_count_, see SCurveTrajectory::t0_
+    bool traj_scurve_ = false; // the current move was planned by scurve_
+    SCurveTrajectory scurve_;
+
+    // Goal points of the queued moves. The ring buffer is filled by the
+    // communication threads (write index) and drained by the control loop
+    // (read index). clear_move_queue() posts the write index to flush to,
+    // move_queue_flush_seq_ is odd while it is written.
+    QueuedMove_t move_queue_[kMoveQueueLength];
+    volatile uint32_t move_queue_read_ = 0;
+    volatile uint32_t move_queue_write_ = 0;
+    volatile uint32_t move_queue_flush_index_ = 0;
+    volatile uint32_t move_queue_flush_seq_ = 0;
+    volatile uint32_t move_queue_flush_applied_seq_ = 0;
+    uint32_t move_queue_count_ = 0; // number of queued moves that have not started yet
+
+    // Setpoint stream, filled and drained like the move queue. While playing,
+    // the sample at the read index and the one after it are interpolated.
+    StreamSample_t stream_buffer_[kStreamBufferLength];
+    volatile uint32_t stream_read_ = 0;
+    volatile uint32_t stream_write_ = 0;
+    bool stream_playing_ = false;
+    uint64_t stream_start_meas_count_ = 0; // see Axis::get_meas_count()
+    float stream_start_t_ = 0.0f;          // [s] stream time of the first sample
+    uint32_t stream_count_ = 0;            // number of buffered samples
+    uint32_t stream_underruns_ = 0;        // number of control loop iterations without a sample after the current time
+
+    // Electronic gearing, see update_gearing()
+    volatile bool gear_align_ = false; // set gear_offset so that the setpoint doesn't jump
+
+    // Multi-rate state, held between the position/velocity loop updates
+    uint32_t pos_loop_countdown_ = 0; // control loop iterations until the next position loop update
+    uint32_t vel_loop_countdown_ = 0; // control loop iterations until the next velocity loop update
+    float vel_des_ = 0.0f;         // [counts/s] output of the position loop
+    float anticogging_pos_ = 0.0f; // [counts]
+    float Iq_output_ = 0.0f;       // [A] output of the velocity loop
+
+    // Gain scheduling, see config_.gain_schedule
+    float load_index_ = 0.0f;
+    float pos_gain_scale_ = 1.0f;
+    float vel_gain_scale_ = 1.0f;
+    float vel_integrator_gain_scale_ = 1.0f;
+
+    // Disturbance observer. The model is Iq - load_current = inertia * acceleration.
+    float inertia_estimate_ = 0.0f;           // [A/(counts/s^2)]
+    float load_current_estimate_ = 0.0f;      // [A]
+    float dob_vel_ = 0.0f;                    // [counts/s] velocity state of the observer
+    float dob_accel_ = 0.0f;                  // [counts/s^2] acceleration of the observer
+    float dob_load_baseline_ = 0.0f;          // [A] load current estimate before the current acceleration
+
+    // Biquad cascade on the current command, see config_.iq_filter.
+    // The coefficients are recomputed by the control loop when
+    // iq_filter_dirty_ is set, so that they never change mid-update.
+    volatile bool iq_filter_dirty_ = true;
+    uint32_t iq_filter_active_stages_ = 0;
+    arm_biquad_cascade_df2T_instance_f32 iq_filter_;
+    float iq_filter_coeffs_[5 * kIqFilterStages];
+    float iq_filter_state_[2 * kIqFilterStages];
+    float Iq_filtered_ = 0.0f; // [A] output of the filter
+
+    // Input shaper on the setpoints, see config_.input_shaper_type. Like the
+    // current filter, it is reconfigured by the control loop when
+    // input_shaper_dirty_ is set.
+    volatile bool input_shaper_dirty_ = true;
+    bool input_shaper_active_ = false; // the setpoints were shaped in the last position loop update
+    InputShaper input_shaper_;
 
     // Communication protocol definitions
+    auto make_iq_filter_stage_definitions(IqFilterStage_t& stage) {
+        return make_protocol_member_list(
+            make_protocol_property("type", &stage.type,
+                [](void* ctx) { static_cast<Controller*>(ctx)->iq_filter_dirty_ = true; }, this),
+            make_protocol_property("frequency", &stage.frequency,
+                [](void* ctx) { static_cast<Controller*>(ctx)->iq_filter_dirty_ = true; }, this),
+            make_protocol_property("q", &stage.q,
+                [](void* ctx) { static_cast<Controller*>(ctx)->iq_filter_dirty_ = true; }, this)
+        );
+    }
+
+    static auto make_gain_schedule_point_definitions(GainSchedulePoint_t& point) {
+        return make_protocol_member_list(
+            make_protocol_property("key", &point.key),
+            make_protocol_property("pos_gain_scale", &point.pos_gain_scale),
+            make_protocol_property("vel_gain_scale", &point.vel_gain_scale),
+            make_protocol_property("vel_integrator_gain_scale", &point.vel_integrator_gain_scale)
+        );
+    }
+
     auto make_protocol_definitions() {
         return make_protocol_member_list(
             make_protocol_property("pos_setpoint", &pos_setpoint_),
+            make_protocol_ro_property("pos_setpoint_turns", &pos_setpoint_turns_),
             make_protocol_property("vel_setpoint", &vel_setpoint_),
             make_protocol_property("vel_integrator_current", &vel_integrator_current_),
             make_protocol_property("current_setpoint", &current_setpoint_),
+            make_protocol_property("vel_ramp_target", &vel_ramp_target_),
+            make_protocol_property("current_ramp_target", &current_ramp_target_),
             make_protocol_object("config",
                 make_protocol_property("control_mode", &config_.control_mode),
                 make_protocol_property("pos_gain", &config_.pos_gain),
                 make_protocol_property("vel_gain", &config_.vel_gain),
                 make_protocol_property("vel_integrator_gain", &config_.vel_integrator_gain),
-                make_protocol_property("vel_limit", &config_.vel_limit)
+                make_protocol_property("vel_limit", &config_.vel_limit),
+                make_protocol_property("vel_loop_divider", &config_.vel_loop_divider),
+                make_protocol_property("anticogging_bins", &config_.anticogging_bins),
+                make_protocol_property("anticogging_map_in_flash", &config_.anticogging_map_in_flash),
+                make_protocol_property("vel_integrator_anti_windup", &config_.vel_integrator_anti_windup),
+                make_protocol_property("vel_integrator_decay_time", &config_.vel_integrator_decay_time),
+                make_protocol_property("vel_integrator_back_calc_gain", &config_.vel_integrator_back_calc_gain),
+                make_protocol_property("gain_schedule_mode", &config_.gain_schedule_mode),
+                make_protocol_property("gain_schedule_points", &config_.gain_schedule_points),
+                make_protocol_object("gain_schedule",
+                    make_protocol_object("point0", make_gain_schedule_point_definitions(config_.gain_schedule[0])),
+                    make_protocol_object("point1", make_gain_schedule_point_definitions(config_.gain_schedule[1])),
+                    make_protocol_object("point2", make_gain_schedule_point_definitions(config_.gain_schedule[2])),
+                    make_protocol_object("point3", make_gain_schedule_point_definitions(config_.gain_schedule[3]))
+                ),
+                make_protocol_property("use_disturbance_observer", &config_.use_disturbance_observer),
+                make_protocol_property("inertia", &config_.inertia),
+                make_protocol_property("disturbance_observer_bandwidth", &config_.disturbance_observer_bandwidth),
+                make_protocol_property("disturbance_ff_gain", &config_.disturbance_ff_gain),
+                make_protocol_property("inertia_estimation", &config_.inertia_estimation),
+                make_protocol_property("inertia_estimation_time", &config_.inertia_estimation_time),
+                make_protocol_property("inertia_estimation_min_accel", &config_.inertia_estimation_min_accel),
+                make_protocol_object("iq_filter",
+                    make_protocol_object("stage0", make_iq_filter_stage_definitions(config_.iq_filter[0])),
+                    make_protocol_object("stage1", make_iq_filter_stage_definitions(config_.iq_filter[1])),
+                    make_protocol_object("stage2", make_iq_filter_stage_definitions(config_.iq_filter[2]))
+                ),
+                make_protocol_property("pos_loop_divider", &config_.pos_loop_divider),
+                make_protocol_property("blend_queued_moves", &config_.blend_queued_moves),
+                make_protocol_property("circular_setpoints", &config_.circular_setpoints),
+                make_protocol_property("input_shaper_type", &config_.input_shaper_type,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->input_shaper_dirty_ = true; }, this),
+                make_protocol_property("input_shaper_frequency", &config_.input_shaper_frequency,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->input_shaper_dirty_ = true; }, this),
+                make_protocol_property("input_shaper_damping", &config_.input_shaper_damping,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->input_shaper_dirty_ = true; }, this),
+                make_protocol_property("input_shaper_tolerance", &config_.input_shaper_tolerance,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->input_shaper_dirty_ = true; }, this),
+                make_protocol_property("gear_axis", &config_.gear_axis),
+                make_protocol_property("gear_ratio", &config_.gear_ratio),
+                make_protocol_property("gear_offset", &config_.gear_offset),
+                make_protocol_property("cam_points", &config_.cam_points),
+                make_protocol_property("cam_period", &config_.cam_period),
+                make_protocol_object("cam_table",
+                    make_protocol_property("point0", &config_.cam_table[0]),
+                    make_protocol_property("point1", &config_.cam_table[1]),
+                    make_protocol_property("point2", &config_.cam_table[2]),
+                    make_protocol_property("point3", &config_.cam_table[3]),
+                    make_protocol_property("point4", &config_.cam_table[4]),
+                    make_protocol_property("point5", &config_.cam_table[5]),
+                    make_protocol_property("point6", &config_.cam_table[6]),
+                    make_protocol_property("point7", &config_.cam_table[7])
+                ),
+                make_protocol_property("vel_ramp_enable", &config_.vel_ramp_enable),
+                make_protocol_property("vel_ramp_rate", &config_.vel_ramp_rate),
+                make_protocol_property("current_ramp_enable", &config_.current_ramp_enable),
+                make_protocol_property("current_ramp_rate", &config_.current_ramp_rate),
+                make_protocol_property("enable_friction_ff", &config_.enable_friction_ff),
+                make_protocol_property("friction_coulomb", &config_.friction_coulomb),
+                make_protocol_property("friction_viscous", &config_.friction_viscous),
+                make_protocol_property("friction_stribeck", &config_.friction_stribeck),
+                make_protocol_property("friction_stribeck_vel", &config_.friction_stribeck_vel),
+                make_protocol_property("friction_sign_band", &config_.friction_sign_band)
             ),
+            make_protocol_ro_property("move_queue_count", &move_queue_count_),
+            make_protocol_property("load_index", &load_index_),
+            make_protocol_ro_property("pos_gain_scale", &pos_gain_scale_),
+            make_protocol_ro_property("vel_gain_scale", &vel_gain_scale_),
+            make_protocol_ro_property("vel_integrator_gain_scale", &vel_integrator_gain_scale_),
+            make_protocol_ro_property("current_setpoint_filtered", &Iq_filtered_),
+            make_protocol_ro_property("shaped_pos_setpoint", &input_shaper_.output_.pos),
+            make_protocol_ro_property("input_shaper_duration", &input_shaper_.duration_),
+            make_protocol_property("inertia_estimate", &inertia_estimate_),
+            make_protocol_ro_property("load_current_estimate", &load_current_estimate_),
+            make_protocol_ro_property("stream_count", &stream_count_),
+            make_protocol_ro_property("stream_underruns", &stream_underruns_),
             make_protocol_function("set_pos_setpoint", *this, &Controller::set_pos_setpoint,
                 "pos_setpoint", "vel_feed_forward", "current_feed_forward"),
             make_protocol_function("set_vel_setpoint", *this, &Controller::set_vel_setpoint,
@@ -98,9 +461,31 @@ public:
             make_protocol_function("set_current_setpoint", *this, &Controller::set_current_setpoint,
                 "current_setpoint"),
             make_protocol_function("move_to_pos", *this, &Controller::move_to_pos, "goal_point"),
-            make_protocol_function("start_anticogging_calibration", *this, &Controller::start_anticogging_calibration)
+            make_protocol_function("queue_move", *this, &Controller::queue_move, "goal_point"),
+            make_protocol_function("clear_move_queue", *this, &Controller::clear_move_queue),
+            make_protocol_function("start_stream", *this, &Controller::start_stream),
+            make_protocol_function("push_stream_sample", *this, &Controller::push_stream_sample,
+                "t", "pos", "vel", "current"),
+            make_protocol_function("start_gearing", *this, &Controller::start_gearing),
+            make_protocol_object("anticogging",
+                make_protocol_property("use_anticogging", &anticogging_.use_anticogging),
+                make_protocol_ro_property("calib_anticogging", &anticogging_.calib_anticogging),
+                make_protocol_property("calib_fast_vel", &anticogging_.calib_fast_vel),
+                make_protocol_property("calib_fast_revolutions", &anticogging_.calib_fast_revolutions),
+                make_protocol_ro_property("num_bins", &anticogging_.num_bins),
+                make_protocol_ro_property("map_saved", &anticogging_.map_saved),
+                make_protocol_ro_property("map_dirty", &anticogging_.map_dirty),
+                make_protocol_ro_property("map_in_flash", &anticogging_.map_in_flash),
+                make_protocol_ro_property("map_alloc_failed", &anticogging_.map_alloc_failed),
+                make_protocol_buffer("cogging_map", &anticogging_.cogging_map, &anticogging_.cogging_map_bytes),
+                make_protocol_buffer("binned_map", &anticogging_.binned_map, &anticogging_.binned_map_bytes)
+            ),
+            make_protocol_function("start_anticogging_calibration", *this, &Controller::start_anticogging_calibration),
+            make_protocol_function("start_fast_anticogging_calibration", *this, &Controller::start_fast_anticogging_calibration)
         );
     }
 };
 
+bool move_to_pos_synced(float goal_axis0, float goal_axis1);
+
 #endif // __CONTROLLER_HPP
@@ -0,0 +1,65 @@
+
+#include "odrive_main.h"
+#include "freertos_vars.h"
+#include <communication/interface_usb.h>
+#include <communication/interface_uart.h>
+
+CpuLoad cpu_load;
+
+// @brief Enables the DWT cycle counter, which is the run time stats clock.
+// This is called by the scheduler at startup and again by Profiler::init(),
+// so it must not reset the counter.
+extern "C" void configure_run_time_counter(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// The counter wraps around after 2^32 cycles (about 25s at 168MHz). Only
+// differences over less than that are used, so this doesn't matter, neither
+// for the scheduler nor for CpuLoad.
+extern "C" uint32_t get_run_time_counter(void) {
+    return DWT->CYCCNT;
+}
+
+static float fraction(uint32_t part, uint32_t total) {
+    float value = (float)part / (float)total;
+    return value > 1.0f ? 1.0f : value; // e.g. after a profiler reset
+}
+
+// @brief Updates the loads once per kWindowMs.
+// This is called from the idle hook.
+void CpuLoad::update() {
+    uint32_t now = HAL_GetTick();
+    if (now - window_start_ < kWindowMs)
+        return;
+    window_start_ = now;
+
+    TaskHandle_t handles[THREAD_NUM_THREADS] = {
+        defaultTaskHandle, usb_irq_thread, usb_thread, usb_cdc_thread, uart_thread, comm_thread, log_thread
+    };
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        handles[THREAD_AXES + i] = axes[i]->thread_id_;
+    handles[THREAD_IDLE] = xTaskGetIdleTaskHandle();
+
+    uint32_t time = get_run_time_counter();
+    uint32_t isr_cycles = profiler.sections_[Profiler::SECTION_ADC_CB].total_;
+    uint32_t elapsed = time - last_time_;
+    bool first_window = !started_;
+    started_ = true;
+    for (size_t i = 0; i < THREAD_NUM_THREADS; ++i) {
+        if (!handles[i])
+            continue; // not started, e.g. UART or USB CDC thread disabled
+        TaskStatus_t status;
+        vTaskGetInfo(handles[i], &status, pdFALSE, eInvalid);
+        if (!first_window)
+            threads_[i] = fraction(status.ulRunTimeCounter - last_run_times_[i], elapsed);
+        last_run_times_[i] = status.ulRunTimeCounter;
+    }
+    if (!first_window) {
+        total_ = 1.0f - threads_[THREAD_IDLE];
+        isr_ = fraction(isr_cycles - last_isr_cycles_, elapsed);
+        idle_per_period_ = threads_[THREAD_IDLE] * current_meas_period;
+    }
+    last_time_ = time;
+    last_isr_cycles_ = isr_cycles;
+}
@@ -0,0 +1,69 @@
+#ifndef __CPU_LOAD_HPP
+#define __CPU_LOAD_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief CPU utilization of every thread and of the current measurement
+// interrupt.
+//
+// FreeRTOS accumulates the run time of each thread on the DWT cycle counter
+// (configGENERATE_RUN_TIME_STATS). update() is called from the idle task
+// and turns the run times of the last kWindowMs into fractions of the CPU.
+// Interrupts count towards the thread they interrupted, so the thread loads
+// include the interrupt time. pwm_trig_adc_cb, which runs the current loop,
+// is also reported on its own, from its profiler section.
+//
+// While the CPU is saturated, the idle task (and thus update()) doesn't run
+// and the last values stay.
+class CpuLoad {
+public:
+    static constexpr uint32_t kWindowMs = 1000;
+
+    enum Thread_t {
+        THREAD_STARTUP,
+        THREAD_USB_IRQ,
+        THREAD_USB,
+        THREAD_USB_CDC,
+        THREAD_UART,
+        THREAD_COMMS,
+        THREAD_LOG,
+        THREAD_AXES, // one per axis
+        THREAD_IDLE = THREAD_AXES + AXIS_COUNT,
+        THREAD_NUM_THREADS
+    };
+
+    void update();
+
+    float total_ = 0.0f;   // fraction of the CPU time outside of the idle task
+    float isr_ = 0.0f;     // fraction of the CPU time in pwm_trig_adc_cb
+    float idle_per_period_ = 0.0f; // [s] idle time per current measurement period
+    float threads_[THREAD_NUM_THREADS] = { 0.0f }; // fraction of the CPU time per thread
+
+#define CPU_LOAD_AXIS_THREAD(i, threads) make_protocol_ro_property("axis" #i, &threads[THREAD_AXES + i]),
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("startup", &threads_[THREAD_STARTUP]),
+            make_protocol_ro_property("usb_irq", &threads_[THREAD_USB_IRQ]),
+            make_protocol_ro_property("usb", &threads_[THREAD_USB]),
+            make_protocol_ro_property("usb_cdc", &threads_[THREAD_USB_CDC]),
+            make_protocol_ro_property("uart", &threads_[THREAD_UART]),
+            make_protocol_ro_property("comms", &threads_[THREAD_COMMS]),
+            make_protocol_ro_property("log", &threads_[THREAD_LOG]),
+            FOR_EACH_AXIS(CPU_LOAD_AXIS_THREAD, threads_)
+            make_protocol_ro_property("idle", &threads_[THREAD_IDLE])
+        );
+    }
+
+private:
+    bool started_ = false;           // the first update() only takes the reference values
+    uint32_t window_start_ = 0;      // [ms]
+    uint32_t last_time_ = 0;         // [cycles]
+    uint32_t last_isr_cycles_ = 0;
+    uint32_t last_run_times_[THREAD_NUM_THREADS] = { 0 }; // [cycles]
+};
+
+extern CpuLoad cpu_load;
+
+#endif // __CPU_LOAD_HPP
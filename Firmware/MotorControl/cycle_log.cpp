@@ -0,0 +1,62 @@
+
+#include "odrive_main.h"
+
+CycleLog cycle_log;
+
+static_assert(sizeof(CycleLog::Record_t) == 24, "the record layout is part of the protocol");
+
+static inline uint16_t saturate_u16(uint32_t value) {
+    return value > UINT16_MAX ? UINT16_MAX : (uint16_t)value;
+}
+
+// @brief Appends a record for the given axis, unless the log is frozen.
+// This is called from the current measurement interrupt.
+void CycleLog::record(Axis& axis, uint8_t axis_num, uint32_t adc_cb_cycles) {
+    if (frozen_)
+        return;
+
+    bool error = axis.error_ != Axis::ERROR_NONE || axis.motor_.error_ != Motor::ERROR_NONE;
+
+    Record_t& rec = records_[pos_];
+    rec.timestamp = DWT->CYCCNT;
+    rec.adc_cb_cycles = saturate_u16(adc_cb_cycles);
+    rec.foc_cycles = saturate_u16(profiler.sections_[Profiler::SECTION_FOC_CURRENT].last_);
+    rec.encoder_cycles = saturate_u16(profiler.sections_[Profiler::SECTION_ENCODER_UPDATE].last_);
+    rec.axis = axis_num;
+    rec.flags = error ? kFlagError : 0;
+    for (size_t i = 0; i < ACTIVITY_NUM_ACTIVITIES; ++i) {
+        if (activity_[i])
+            rec.flags |= (1 << i);
+    }
+    rec.Iq_setpoint = axis.motor_.current_control_.Iq_setpoint;
+    rec.Iq_measured = axis.motor_.current_control_.Iq_measured;
+    rec.vbus_voltage = vbus_voltage;
+    pos_ = (pos_ + 1) % kNumRecords;
+
+    // Freeze on a new error (deadline misses are reported as motor errors)
+    if (axis_num < AXIS_COUNT) {
+        if (error && !axis_had_error_[axis_num]) {
+            frozen_ = true;
+            trigger_timestamp_ = rec.timestamp;
+        }
+        axis_had_error_[axis_num] = error;
+    }
+}
+
+// @brief Resumes logging after the log was frozen.
+// Errors that are still present at that point do not freeze the log again.
+void CycleLog::rearm() {
+    frozen_ = false;
+}
+
+// @brief Returns one 32-bit word of the record buffer, oldest record first.
+// This allows the buffer to be downloaded without knowing pos_.
+uint32_t CycleLog::get_word(uint32_t index) {
+    constexpr size_t words_per_record = sizeof(Record_t) / sizeof(uint32_t);
+    if (index >= kNumRecords * words_per_record)
+        return 0;
+    size_t record_idx = (pos_ + index / words_per_record) % kNumRecords;
+    uint32_t word;
+    memcpy(&word, reinterpret_cast<const uint8_t*>(&records_[record_idx]) + (index % words_per_record) * sizeof(uint32_t), sizeof(word));
+    return word;
+}
@@ -0,0 +1,86 @@
+#ifndef __CYCLE_LOG_HPP
+#define __CYCLE_LOG_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Always-on ring buffer of the most recent control cycles.
+//
+// One record is written per current measurement at the end of the ADC
+// callback. When an axis or motor error shows up, the log freezes so that
+// the cycles leading up to the error can be downloaded and inspected later.
+// Call rearm() to resume logging.
+//
+// The stage cycle counts are the most recent values from the profiler, so
+// with the current loop running in the thread, foc_cycles belongs to the
+// previous cycle.
+class CycleLog {
+public:
+    static constexpr size_t kNumRecords = 128;
+
+    enum Activity_t {
+        ACTIVITY_USB,
+        ACTIVITY_UART,
+        ACTIVITY_NVM_WRITE,
+        ACTIVITY_USB_CDC,
+        ACTIVITY_NUM_ACTIVITIES
+    };
+
+    // 24 bytes, no padding. The layout is part of the protocol, see
+    // dump_cycle_log in tools/odrive/utils.py.
+    struct Record_t {
+        uint32_t timestamp;       // [CPU cycles] DWT cycle counter at the end of the ADC callback
+        uint16_t adc_cb_cycles;   // [CPU cycles]
+        uint16_t foc_cycles;      // [CPU cycles]
+        uint16_t encoder_cycles;  // [CPU cycles]
+        uint8_t axis;
+        uint8_t flags;            // bit n: Activity_t n was ongoing, bit 7: error
+        float Iq_setpoint;        // [A]
+        float Iq_measured;        // [A]
+        float vbus_voltage;       // [V]
+    };
+    static constexpr uint8_t kFlagError = 0x80;
+
+    void record(Axis& axis, uint8_t axis_num, uint32_t adc_cb_cycles);
+    void rearm();
+    uint32_t get_word(uint32_t index);
+
+    void set_activity(Activity_t activity, bool active) { activity_[activity] = active; }
+
+    Record_t records_[kNumRecords];
+    const size_t records_bytes_ = sizeof(records_);
+    uint32_t pos_ = 0;                  // index of the next record to be written
+    bool frozen_ = false;
+    uint32_t trigger_timestamp_ = 0;     // [CPU cycles] timestamp of the record that froze the log
+    bool axis_had_error_[AXIS_COUNT] = { false };
+    volatile bool activity_[ACTIVITY_NUM_ACTIVITIES] = { false };
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("frozen", &frozen_),
+            make_protocol_ro_property("pos", &pos_),
+            make_protocol_ro_property("trigger_timestamp", &trigger_timestamp_),
+            make_protocol_function("rearm", *this, &CycleLog::rearm),
+            make_protocol_buffer("records", records_, &records_bytes_),
+            make_protocol_function("get_word", *this, &CycleLog::get_word, "index")
+        );
+    }
+};
+
+extern CycleLog cycle_log;
+
+// @brief Marks an activity of a communication or background thread as
+// ongoing for as long as this object lives.
+class CycleLogActivity {
+public:
+    explicit CycleLogActivity(CycleLog::Activity_t activity) : activity_(activity) {
+        cycle_log.set_activity(activity_, true);
+    }
+    ~CycleLogActivity() { cycle_log.set_activity(activity_, false); }
+
+private:
+    CycleLog::Activity_t activity_;
+};
+
+#endif // __CYCLE_LOG_HPP
@@ -8,20 +8,120 @@ Encoder::Encoder(const EncoderHardwareConfig_t& hw_config,
         config_(config)
 {
     update_pll_gains();
+}
 
-    if (config.pre_calibrated && (config.mode == Encoder::MODE_HALL)) {
-        is_ready_ = true;
-    }
+static inline uint32_t tim_channel_to_cc_flag(uint32_t channel) {
+    return TIM_FLAG_CC1 << (channel >> 2);
 }
 
 static void enc_index_cb_wrapper(void* ctx) {
     reinterpret_cast<Encoder*>(ctx)->enc_index_cb();
 }
 
+static void enc_edge_cb_wrapper(void* ctx) {
+    reinterpret_cast<Encoder*>(ctx)->enc_edge_cb();
+}
+
+static void enc_hall_edge_cb_wrapper(void* ctx) {
+    reinterpret_cast<Encoder*>(ctx)->enc_hall_edge_cb();
+}
+
 void Encoder::setup() {
+    switch (config_.mode) {
+        case MODE_INCREMENTAL: update_fn_ = &Encoder::update_mode<MODE_INCREMENTAL>; break;
+        case MODE_HALL: update_fn_ = &Encoder::update_mode<MODE_HALL>; break;
+        case MODE_SPI_ABS_AMS: update_fn_ = &Encoder::update_mode<MODE_SPI_ABS_AMS>; break;
+        case MODE_SINCOS: update_fn_ = &Encoder::update_mode<MODE_SINCOS>; break;
+        default: update_fn_ = &Encoder::update_unsupported_mode; break;
+    }
+
+    // Absolute encoders don't need an index, so a stored offset is enough
+    if (check_calibration() && (config_.mode == MODE_HALL || config_.mode == MODE_SPI_ABS_AMS
+            || (config_.mode == MODE_SINCOS && config_.sincos_periods == 1)))
+        is_ready_ = true;
+
     HAL_TIM_Encoder_Start(hw_config_.timer, TIM_CHANNEL_ALL);
     GPIO_subscribe(hw_config_.index_port, hw_config_.index_pin, GPIO_NOPULL,
             enc_index_cb_wrapper, this);
+
+    // Where the index pin is an input of the encoder timer, the timer latches
+    // the count on the index edge and the EXTI line only notifies us.
+    if (config_.mode == MODE_INCREMENTAL && hw_config_.index_capture_af) {
+        GPIO_InitTypeDef GPIO_InitStruct;
+        GPIO_InitStruct.Pin = hw_config_.index_pin;
+        GPIO_InitStruct.Mode = GPIO_MODE_AF_PP; // leaves the EXTI line connected
+        GPIO_InitStruct.Pull = GPIO_NOPULL;
+        GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+        GPIO_InitStruct.Alternate = hw_config_.index_capture_af;
+        HAL_GPIO_Init(hw_config_.index_port, &GPIO_InitStruct);
+
+        // Same filter as the A and B channels
+        TIM_IC_InitTypeDef sConfigIC;
+        sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_RISING;
+        sConfigIC.ICSelection = TIM_ICSELECTION_DIRECTTI;
+        sConfigIC.ICPrescaler = TIM_ICPSC_DIV1;
+        sConfigIC.ICFilter = 4;
+        HAL_TIM_IC_ConfigChannel(hw_config_.timer, &sConfigIC, hw_config_.index_capture_channel);
+        HAL_TIM_IC_Start(hw_config_.timer, hw_config_.index_capture_channel);
+        __HAL_TIM_CLEAR_FLAG(hw_config_.timer, tim_channel_to_cc_flag(hw_config_.index_capture_channel));
+    }
+
+    // The A channel stays connected to the timer, the EXTI line only adds timestamps
+    if (config_.mode == MODE_INCREMENTAL && config_.enable_edge_timing)
+        GPIO_subscribe_edges(hw_config_.hallA_port, hw_config_.hallA_pin,
+                enc_edge_cb_wrapper, this);
+
+    // In hall mode this replaces the index subscription of hall C, which shares the pin
+    if (config_.mode == MODE_HALL && config_.enable_hall_interpolation) {
+        GPIO_subscribe_edges(hw_config_.hallA_port, hw_config_.hallA_pin, enc_hall_edge_cb_wrapper, this);
+        GPIO_subscribe_edges(hw_config_.hallB_port, hw_config_.hallB_pin, enc_hall_edge_cb_wrapper, this);
+        GPIO_subscribe_edges(hw_config_.hallC_port, hw_config_.hallC_pin, enc_hall_edge_cb_wrapper, this);
+        GPIO_set_edge_interrupt_enabled(hw_config_.hallA_pin, true);
+        GPIO_set_edge_interrupt_enabled(hw_config_.hallB_pin, true);
+        GPIO_set_edge_interrupt_enabled(hw_config_.hallC_pin, true);
+    }
+
+    if (config_.mode == MODE_SPI_ABS_AMS) {
+        // The only free SPI3 RX DMA stream is shared with I2C1
+        if (config_.abs_spi_cs_gpio_pin < 1 || config_.abs_spi_cs_gpio_pin > 8
+                || board_config.enable_i2c_instead_of_can) {
+            set_error(ERROR_ABS_SPI_NOT_AVAILABLE);
+            return;
+        }
+        abs_spi_cs_port_ = get_gpio_port_by_pin(config_.abs_spi_cs_gpio_pin);
+        abs_spi_cs_pin_ = get_gpio_pin_by_pin(config_.abs_spi_cs_gpio_pin);
+
+        GPIO_InitTypeDef GPIO_InitStruct;
+        GPIO_InitStruct.Pin = abs_spi_cs_pin_;
+        GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+        GPIO_InitStruct.Pull = GPIO_NOPULL;
+        GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+        HAL_GPIO_WritePin(abs_spi_cs_port_, abs_spi_cs_pin_, GPIO_PIN_SET);
+        HAL_GPIO_Init(abs_spi_cs_port_, &GPIO_InitStruct);
+
+        if (!hw_config_.spi->hdmarx)
+            MX_SPI3_DMA_Init();
+    }
+
+    if (config_.mode == MODE_SINCOS) {
+        GPIO_TypeDef* sin_port = get_gpio_port_by_pin(config_.sincos_gpio_pin_sin);
+        uint16_t sin_pin = get_gpio_pin_by_pin(config_.sincos_gpio_pin_sin);
+        GPIO_TypeDef* cos_port = get_gpio_port_by_pin(config_.sincos_gpio_pin_cos);
+        uint16_t cos_pin = get_gpio_pin_by_pin(config_.sincos_gpio_pin_cos);
+        if (config_.sincos_periods < 1 || config_.cpr % config_.sincos_periods) {
+            set_error(ERROR_SINCOS_NOT_AVAILABLE);
+            return;
+        }
+        // Fails if a pin has no ADC channel or the injected sequence is full
+        sincos_rank_sin_ = add_synchronous_adc_channel(sin_port, sin_pin);
+        sincos_rank_cos_ = sincos_rank_sin_ < 0 ? -1 : add_synchronous_adc_channel(cos_port, cos_pin);
+        if (sincos_rank_cos_ < 0) {
+            set_error(ERROR_SINCOS_NOT_AVAILABLE);
+            return;
+        }
+        GPIO_set_to_analog(sin_port, sin_pin);
+        GPIO_set_to_analog(cos_port, cos_pin);
+    }
 }
 
 void Encoder::set_error(Encoder::Error_t error) {
@@ -43,9 +143,17 @@ bool Encoder::do_checks(){
 // TODO: disable interrupt once we found the index
 void Encoder::enc_index_cb() {
     if (config_.use_index && !index_found_) {
-        set_circular_count(0, false);
-        set_linear_count(0); // Avoid position control transient after search
-        if (config_.pre_calibrated) {
+        // Counts travelled since the index edge. Without a hardware capture
+        // these are lost, which depends on the interrupt latency and speed.
+        int32_t count = 0;
+        uint32_t cc_flag = tim_channel_to_cc_flag(hw_config_.index_capture_channel);
+        if (hw_config_.index_capture_af && __HAL_TIM_GET_FLAG(hw_config_.timer, cc_flag)) {
+            uint16_t captured = (uint16_t)__HAL_TIM_GET_COMPARE(hw_config_.timer, hw_config_.index_capture_channel);
+            count = (int16_t)((uint16_t)hw_config_.timer->Instance->CNT - captured);
+        }
+        set_circular_count(count, false);
+        set_linear_count(count); // Avoid position control transient after search
+        if (check_calibration()) {
             is_ready_ = true;
         } else {
             // We can't use the update_offset facility in set_circular_count because
@@ -57,27 +165,50 @@ void Encoder::enc_index_cb() {
     }
 }
 
+// Triggered on both edges of the A channel while edge timing is active.
+// The interrupt entry and dispatch take longer than the timer input filter,
+// so the timer count already includes this edge.
+RAM_FUNC void Encoder::enc_edge_cb() {
+    edge_timestamp_ = DWT->CYCCNT;
+    edge_count_ = (uint16_t)hw_config_.timer->Instance->CNT;
+    edge_seq_ = edge_seq_ + 1;
+}
+
 // Function that sets the current encoder count to a desired 32-bit value.
 void Encoder::set_linear_count(int32_t count) {
-    // Disable interrupts to make a critical section to avoid race condition
-    uint32_t prim = __get_PRIMASK();
-    __disable_irq();
+    // Mask the encoder update in the current measurement interrupt to avoid a race condition
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
 
     // Update states
     shadow_count_ = count;
+    shadow_count_in_turn_ = mod(count, config_.cpr);
+    shadow_turns_ = (count - shadow_count_in_turn_) / config_.cpr;
+    pos_estimate_turns_ = shadow_turns_;
+    pos_estimate_in_turn_ = (float)shadow_count_in_turn_;
     pos_estimate_ = (float)count;
     //Write hardware last
     hw_config_.timer->Instance->CNT = count;
 
-    __set_PRIMASK(prim);
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Adds delta to the linear count. Unlike set_linear_count() with
+// the shadow count, this keeps the counts that the timer has seen since the
+// last update.
+void Encoder::shift_linear_count(int32_t delta) {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    int32_t count = shadow_count_;
+    if (config_.mode == MODE_INCREMENTAL)
+        count += (int16_t)((uint16_t)hw_config_.timer->Instance->CNT - (uint16_t)count);
+    set_linear_count(count + delta);
+    cpu_exit_masked_critical(basepri);
 }
 
 // Function that sets the CPR circular tracking encoder count to a desired 32-bit value.
 // Note that this will get mod'ed down to [0, cpr)
 void Encoder::set_circular_count(int32_t count, bool update_offset) {
-    // Disable interrupts to make a critical section to avoid race condition
-    uint32_t prim = __get_PRIMASK();
-    __disable_irq();
+    // Mask the encoder update in the current measurement interrupt to avoid a race condition
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
 
     if (update_offset) {
         config_.offset += count - count_in_cpr_;
@@ -88,34 +219,57 @@ void Encoder::set_circular_count(int32_t count, bool update_offset) {
     count_in_cpr_ = mod(count, config_.cpr);
     pos_cpr_ = (float)count_in_cpr_;
 
-    __set_PRIMASK(prim);
+    cpu_exit_masked_critical(basepri);
 }
 
 
-// @brief Slowly turns the motor in one direction until the
-// encoder index is found.
-// TODO: Do the scan with current, not voltage!
+// @brief Turns the motor in one direction until the encoder index is found.
+// The rotating field is driven with voltage, or with the current controller
+// if config.idx_search_use_current is set. The latter keeps the current at
+// calibration_current regardless of the back-EMF, so the search can run fast
+// without stalling on higher-friction loads.
 bool Encoder::run_index_search() {
+    Motor& motor = axis_->motor_;
     float voltage_magnitude;
-    if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
-        voltage_magnitude = axis_->motor_.config_.calibration_current * axis_->motor_.config_.phase_resistance;
-    else if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_GIMBAL)
-        voltage_magnitude = axis_->motor_.config_.calibration_current;
+    if (motor.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
+        voltage_magnitude = motor.config_.calibration_current * motor.config_.phase_resistance;
+    else if (motor.config_.motor_type == Motor::MOTOR_TYPE_GIMBAL)
+        voltage_magnitude = motor.config_.calibration_current;
     else
         return false;
-    
-    float omega = (float)(axis_->motor_.config_.direction) * config_.idx_search_speed;
+    const bool use_current = config_.idx_search_use_current
+            && motor.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT;
+
+    const float omega_target = (float)(motor.config_.direction) * config_.idx_search_speed;
+    const float omega_step = config_.idx_search_accel * current_meas_period;
+    float omega = omega_step > 0.0f ? 0.0f : omega_target;
 
+    // Drop captures of index edges from before the search
+    if (hw_config_.index_capture_af)
+        __HAL_TIM_CLEAR_FLAG(hw_config_.timer, tim_channel_to_cc_flag(hw_config_.index_capture_channel));
     index_found_ = false;
+    if (use_current)
+        motor.reset_current_control();
     float phase = 0.0f;
     axis_->run_control_loop([&](){
+        if (omega != omega_target)
+            omega = omega_target > omega ? std::min(omega + omega_step, omega_target)
+                                         : std::max(omega - omega_step, omega_target);
         phase = wrap_pm_pi(phase + omega * current_meas_period);
 
-        float v_alpha = voltage_magnitude * our_arm_cos_f32(phase);
-        float v_beta = voltage_magnitude * our_arm_sin_f32(phase);
-        if (!axis_->motor_.enqueue_voltage_timings(v_alpha, v_beta))
-            return false; // error set inside enqueue_voltage_timings
-        axis_->motor_.log_timing(Motor::TIMING_LOG_IDX_SEARCH);
+        if (use_current) {
+            // The field is forced, so there is no rotor velocity for the feed forward terms
+            if (!motor.FOC_current(motor.config_.calibration_current, 0.0f, phase, 0.0f))
+                return false; // error set inside FOC_current
+        } else {
+            float c, s;
+            fast_sincos(phase, &s, &c);
+            float v_alpha = voltage_magnitude * c;
+            float v_beta = voltage_magnitude * s;
+            if (!motor.enqueue_voltage_timings(v_alpha, v_beta))
+                return false; // error set inside enqueue_voltage_timings
+        }
+        motor.log_timing(Motor::TIMING_LOG_IDX_SEARCH);
 
         // continue until the index is found
         return !index_found_;
@@ -128,10 +282,17 @@ bool Encoder::run_index_search() {
 // and the encoder state 0.
 // TODO: Do the scan with current, not voltage!
 bool Encoder::run_offset_calibration() {
-    static const float start_lock_duration = 1.0f;
-    static const float scan_omega = 4.0f * M_PI;
-    static const float scan_distance = 16.0f * M_PI;
-    static const int num_steps = (int)(scan_distance / scan_omega * (float)current_meas_hz);
+    // The offset is measured with the corrected signals
+    if (config_.mode == MODE_SINCOS && !run_sincos_calibration())
+        return false;
+
+    if (config_.use_fast_offset_calibration)
+        return run_offset_calibration_fast();
+
+    const float start_lock_duration = config_.calib_lock_duration;
+    const float scan_omega = config_.calib_scan_omega;
+    const float scan_distance = config_.calib_scan_distance;
+    const int num_steps = (int)(scan_distance / scan_omega * (float)current_meas_hz);
 
     // Require index found if enabled
     if (config_.use_index && !index_found_) {
@@ -169,8 +330,10 @@ bool Encoder::run_offset_calibration() {
     i = 0;
     axis_->run_control_loop([&](){
         float phase = wrap_pm_pi(scan_distance * (float)i / (float)num_steps - scan_distance / 2.0f);
-        float v_alpha = voltage_magnitude * our_arm_cos_f32(phase);
-        float v_beta = voltage_magnitude * our_arm_sin_f32(phase);
+        float c, s;
+        fast_sincos(phase, &s, &c);
+        float v_alpha = voltage_magnitude * c;
+        float v_beta = voltage_magnitude * s;
         if (!axis_->motor_.enqueue_voltage_timings(v_alpha, v_beta))
             return false; // error set inside enqueue_voltage_timings
         axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
@@ -210,8 +373,10 @@ bool Encoder::run_offset_calibration() {
     i = 0;
     axis_->run_control_loop([&](){
         float phase = wrap_pm_pi(-scan_distance * (float)i / (float)num_steps + scan_distance / 2.0f);
-        float v_alpha = voltage_magnitude * our_arm_cos_f32(phase);
-        float v_beta = voltage_magnitude * our_arm_sin_f32(phase);
+        float c, s;
+        fast_sincos(phase, &s, &c);
+        float v_alpha = voltage_magnitude * c;
+        float v_beta = voltage_magnitude * s;
         if (!axis_->motor_.enqueue_voltage_timings(v_alpha, v_beta))
             return false; // error set inside enqueue_voltage_timings
         axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
@@ -226,11 +391,543 @@ bool Encoder::run_offset_calibration() {
     config_.offset = encvaluesum / (num_steps * 2);
     int32_t residual = encvaluesum - ((int64_t)config_.offset * (int64_t)(num_steps * 2));
     config_.offset_float = (float)residual / (float)(num_steps * 2) + 0.5f; // add 0.5 to center-align state to phase
+    config_.calib_signature = calibration_signature();
+
+    is_ready_ = true;
+    return true;
+}
+
+// @brief M/T style velocity estimation from the timestamps of encoder edges.
+//
+// Every control cycle in which new edges arrived, the velocity is the count
+// difference divided by the time between the last edge of this cycle and
+// the last edge of the previous cycle with edges. Without new edges the
+// speed can be at most 2 counts (the distance between A channel edges) per
+// time since the last edge, which lets the estimate decay when stopping.
+// Below half of edge_timing_vel_limit this replaces the PLL velocity, up to
+// the limit it is blended in linearly. Above the limit, the edge interrupt
+// is masked so that it costs nothing at high speed.
+// @returns the velocity to continue the PLL with [counts/s]
+float Encoder::update_edge_timing(float vel_pll) {
+    const float limit = config_.edge_timing_vel_limit;
+    bool active = fabsf(vel_pll) < (edge_timing_active_ ? 1.2f * limit : limit);
+    if (active != edge_timing_active_) {
+        edge_timing_active_ = active;
+        edge_ref_valid_ = false;
+        GPIO_set_edge_interrupt_enabled(hw_config_.hallA_pin, active);
+    }
+    if (!active)
+        return vel_pll;
+
+    uint32_t prim = __get_PRIMASK();
+    __disable_irq();
+    uint32_t seq = edge_seq_;
+    uint32_t timestamp = edge_timestamp_;
+    uint16_t count = edge_count_;
+    __set_PRIMASK(prim);
+
+    const float cpu_hz = (float)SystemCoreClock;
+    if (seq != edge_last_seq_) {
+        edge_last_seq_ = seq;
+        bool had_ref = edge_ref_valid_;
+        uint32_t dt = timestamp - edge_ref_timestamp_;
+        int16_t dcount = (int16_t)(count - edge_ref_count_);
+        edge_ref_timestamp_ = timestamp;
+        edge_ref_count_ = count;
+        edge_ref_valid_ = true;
+        if (!had_ref)
+            return vel_pll;
+        edge_vel_estimate_ = dt ? (float)dcount * cpu_hz / (float)dt : 0.0f;
+    } else if (edge_ref_valid_) {
+        uint32_t dt = DWT->CYCCNT - edge_ref_timestamp_;
+        float max_vel = dt ? 2.0f * cpu_hz / (float)dt : INFINITY;
+        if (fabsf(edge_vel_estimate_) > max_vel)
+            edge_vel_estimate_ = copysignf(max_vel, edge_vel_estimate_);
+    } else {
+        return vel_pll;
+    }
+
+    float pll_weight = (fabsf(vel_pll) - 0.5f * limit) / (0.5f * limit);
+    if (pll_weight < 0.0f) pll_weight = 0.0f;
+    if (pll_weight > 1.0f) pll_weight = 1.0f;
+    return pll_weight * vel_pll + (1.0f - pll_weight) * edge_vel_estimate_;
+}
+
+// The DMA cannot access CCM RAM, where the Encoder objects live, so the
+// transfer buffers are shared. There is only one SPI bus and therefore at
+// most one transaction at a time.
+static uint16_t abs_spi_dma_tx = 0xFFFF; // read ANGLECOM (0x3FFF) with parity and read bit
+static uint16_t abs_spi_dma_rx = 0;
+static Encoder* abs_spi_active_encoder = nullptr;
+
+// @brief Starts reading the absolute position in the background.
+// This is called from the PWM timer update interrupt half a PWM period before
+// the current measurement, so the result is ready by then. The sensor returns
+// the result of the previous frame, i.e. the angle is one PWM period old.
+void Encoder::abs_spi_start_transaction() {
+    if (config_.mode != MODE_SPI_ABS_AMS || !abs_spi_cs_port_)
+        return;
+    // The bus may be in use by the other axis or by a gate driver access.
+    // Blocking gate driver accesses only happen during setup, before the PWM
+    // timers run. The background gate driver reads are started a quarter
+    // period away from this (see gate_driver_poll_start_frame).
+    if (hw_config_.spi->State != HAL_SPI_STATE_READY) {
+        abs_spi_error_count_++;
+        return;
+    }
+    abs_spi_active_encoder = this;
+    HAL_GPIO_WritePin(abs_spi_cs_port_, abs_spi_cs_pin_, GPIO_PIN_RESET);
+    if (HAL_SPI_TransmitReceive_DMA(hw_config_.spi, (uint8_t*)&abs_spi_dma_tx, (uint8_t*)&abs_spi_dma_rx, 1) != HAL_OK) {
+        HAL_GPIO_WritePin(abs_spi_cs_port_, abs_spi_cs_pin_, GPIO_PIN_SET);
+        abs_spi_active_encoder = nullptr;
+        abs_spi_error_count_++;
+    }
+}
+
+// @brief Finishes the transaction started by abs_spi_start_transaction.
+// Called from the SPI DMA complete or error interrupt.
+void Encoder::abs_spi_cb() {
+    HAL_GPIO_WritePin(abs_spi_cs_port_, abs_spi_cs_pin_, GPIO_PIN_SET);
+    if (hw_config_.spi->ErrorCode != HAL_SPI_ERROR_NONE) {
+        abs_spi_error_count_++;
+        return;
+    }
+    uint16_t rx = abs_spi_dma_rx;
+
+    // bit 15: even parity, bit 14: error flag, bits 13..0: angle
+    uint16_t parity = rx;
+    parity ^= parity >> 8;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    if ((parity & 1) || (rx & 0x4000)) {
+        abs_spi_error_count_++;
+        return;
+    }
+    abs_spi_pos_ = rx & 0x3FFF;
+    abs_spi_pos_updated_ = true;
+}
+
+// @brief Dispatches the SPI DMA complete callback to the encoder that started the transaction.
+void abs_spi_dispatch_cb(SPI_HandleTypeDef* hspi) {
+    Encoder* encoder = abs_spi_active_encoder;
+    abs_spi_active_encoder = nullptr;
+    if (encoder && encoder->hw_config_.spi == hspi)
+        encoder->abs_spi_cb();
+}
+
+// @brief Returns the angle within the signal period [rad] of a sin/cos
+// sample, corrected with the calibrated offsets, gains and phase.
+// Also updates sincos_amplitude_.
+float Encoder::get_sincos_angle(uint16_t adc_sin, uint16_t adc_cos) {
+    float s = ((float)adc_sin - config_.sincos_offset_sin) * config_.sincos_gain_sin;
+    float c = ((float)adc_cos - config_.sincos_offset_cos) * config_.sincos_gain_cos;
+    // c = cos(angle + phase) = cos(angle) * cos(phase) - sin(angle) * sin(phase)
+    float phase_s, phase_c;
+    fast_sincos(config_.sincos_phase, &phase_s, &phase_c);
+    c = (c + s * phase_s) / phase_c;
+    sincos_amplitude_ = sqrtf(s * s + c * c);
+    return fast_atan2(s, c);
+}
+
+// @brief Turns the motor forward and back over one period of the sin/cos
+// signals to calibrate them. The forward scan finds the offsets and gains
+// from the extreme values, the backward scan the phase from the correlation
+// of the normalized signals, which is -sin(phase)/2.
+bool Encoder::run_sincos_calibration() {
+    if (sincos_rank_cos_ < 0) {
+        set_error(ERROR_SINCOS_NOT_AVAILABLE);
+        return false;
+    }
+
+    float voltage_magnitude;
+    if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
+        voltage_magnitude = axis_->motor_.config_.calibration_current * axis_->motor_.config_.phase_resistance;
+    else if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_GIMBAL)
+        voltage_magnitude = axis_->motor_.config_.calibration_current;
+    else
+        return false;
+
+    // One signal period, in electrical radians
+    const float scan_distance = 2.0f * M_PI * (float)axis_->motor_.config_.pole_pairs / (float)config_.sincos_periods;
+    const int num_steps = (int)(scan_distance / config_.calib_scan_omega * (float)current_meas_hz);
+
+    // go to motor zero phase for calib_lock_duration to get ready to scan
+    int i = 0;
+    axis_->run_control_loop([&](){
+        if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude, 0.0f))
+            return false; // error set inside enqueue_voltage_timings
+        axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+        return ++i < config_.calib_lock_duration * current_meas_hz;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    // scan forward
+    uint16_t min_sin = UINT16_MAX, max_sin = 0, min_cos = UINT16_MAX, max_cos = 0;
+    i = 0;
+    axis_->run_control_loop([&](){
+        float phase = wrap_pm_pi(scan_distance * (float)i / (float)num_steps);
+        float c, s;
+        fast_sincos(phase, &s, &c);
+        if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude * c, voltage_magnitude * s))
+            return false; // error set inside enqueue_voltage_timings
+        axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+        uint16_t adc_sin = get_synchronous_adc_value(sincos_rank_sin_);
+        uint16_t adc_cos = get_synchronous_adc_value(sincos_rank_cos_);
+        min_sin = std::min(min_sin, adc_sin);
+        max_sin = std::max(max_sin, adc_sin);
+        min_cos = std::min(min_cos, adc_cos);
+        max_cos = std::max(max_cos, adc_cos);
+        return ++i < num_steps;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    float amplitude_sin = 0.5f * (float)(max_sin - min_sin);
+    float amplitude_cos = 0.5f * (float)(max_cos - min_cos);
+    if (max_sin < min_sin || max_cos < min_cos
+            || amplitude_sin < kSincosMinAmplitude || amplitude_cos < kSincosMinAmplitude) {
+        set_error(ERROR_NO_RESPONSE);
+        return false;
+    }
+    const float offset_sin = 0.5f * (float)(max_sin + min_sin);
+    const float offset_cos = 0.5f * (float)(max_cos + min_cos);
+    const float gain_sin = 1.0f / amplitude_sin;
+    const float gain_cos = 1.0f / amplitude_cos;
+
+    // scan backwards
+    float correlation = 0.0f;
+    i = 0;
+    axis_->run_control_loop([&](){
+        float phase = wrap_pm_pi(scan_distance * (float)(num_steps - i) / (float)num_steps);
+        float c, s;
+        fast_sincos(phase, &s, &c);
+        if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude * c, voltage_magnitude * s))
+            return false; // error set inside enqueue_voltage_timings
+        axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+        float sin_norm = ((float)get_synchronous_adc_value(sincos_rank_sin_) - offset_sin) * gain_sin;
+        float cos_norm = ((float)get_synchronous_adc_value(sincos_rank_cos_) - offset_cos) * gain_cos;
+        correlation += sin_norm * cos_norm;
+        return ++i < num_steps;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    float sin_phase = -2.0f * correlation / (float)num_steps;
+    sin_phase = std::max(std::min(sin_phase, 0.5f), -0.5f); // beyond 30 degrees the signals are unusable anyway
+    config_.sincos_offset_sin = offset_sin;
+    config_.sincos_offset_cos = offset_cos;
+    config_.sincos_gain_sin = gain_sin;
+    config_.sincos_gain_cos = gain_cos;
+    config_.sincos_phase = asinf(sin_phase);
+    sincos_init_ = false; // restart the tracking with the corrected signals
+    return true;
+}
+
+// @brief Solves A x = b for x by Gaussian elimination with partial pivoting.
+// A and b are overwritten. Returns false if A is (numerically) singular.
+static bool solve_linear_system(double A[][Encoder::kMaxOffsetFitTerms], double b[], size_t n) {
+    for (size_t col = 0; col < n; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < n; ++row) {
+            if (fabs(A[row][col]) > fabs(A[pivot][col]))
+                pivot = row;
+        }
+        if (fabs(A[pivot][col]) < 1e-9)
+            return false;
+        if (pivot != col) {
+            for (size_t k = 0; k < n; ++k) {
+                double tmp = A[col][k]; A[col][k] = A[pivot][k]; A[pivot][k] = tmp;
+            }
+            double tmp = b[col]; b[col] = b[pivot]; b[pivot] = tmp;
+        }
+        for (size_t row = col + 1; row < n; ++row) {
+            double factor = A[row][col] / A[col][col];
+            for (size_t k = col; k < n; ++k)
+                A[row][k] -= factor * A[col][k];
+            b[row] -= factor * b[col];
+        }
+    }
+    for (size_t col = n; col-- > 0;) {
+        for (size_t k = col + 1; k < n; ++k)
+            b[col] -= A[col][k] * b[k];
+        b[col] /= A[col][col];
+    }
+    return true;
+}
+
+// @brief Faster alternative to the forward/backward averaging in
+// run_offset_calibration.
+//
+// The lock phase ends as soon as the rotor has settled, and the scan window
+// is only swept once in each direction (calib_scan_distance in total instead
+// of twice that). The encoder count is then least-squares fitted as
+//   count = offset + k * phase + lag * dir
+//           + sum_n (a_n cos(n * phase_mech) + b_n sin(n * phase_mech))
+// where dir is +1 on the forward and -1 on the backward sweep. The lag term
+// absorbs the speed dependent rotor lag, so calib_scan_omega can be raised,
+// and the harmonic terms absorb encoder eccentricity, so the offset is not
+// biased by it even if the scan does not cover a whole number of turns.
+// Harmonics are only fitted if the scan covers at least one of their periods.
+bool Encoder::run_offset_calibration_fast() {
+    const float scan_distance = config_.calib_scan_distance / 2.0f;
+    const int num_steps = (int)(scan_distance / config_.calib_scan_omega * (float)current_meas_hz);
+    const int max_lock_steps = (int)(config_.calib_lock_duration * (float)current_meas_hz);
+    const int settle_steps = (int)(0.1f * (float)current_meas_hz);
+    const float pole_pairs = (float)axis_->motor_.config_.pole_pairs;
+
+    // Require index found if enabled
+    if (config_.use_index && !index_found_) {
+        set_error(ERROR_INDEX_NOT_FOUND_YET);
+        return false;
+    }
+    if (num_steps < 2 || pole_pairs < 1.0f)
+        return false;
+
+    // We use shadow_count_ to do the calibration, but the offset is used by count_in_cpr_
+    // Therefore we have to sync them for calibration
+    shadow_count_ = count_in_cpr_;
+
+    float voltage_magnitude;
+    if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
+        voltage_magnitude = axis_->motor_.config_.calibration_current * axis_->motor_.config_.phase_resistance;
+    else if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_GIMBAL)
+        voltage_magnitude = axis_->motor_.config_.calibration_current;
+    else
+        return false;
+
+    // go to the start of the scan until the rotor stops moving
+    const float start_phase = wrap_pm_pi(-scan_distance / 2.0f);
+    float start_c, start_s;
+    fast_sincos(start_phase, &start_s, &start_c);
+    int i = 0;
+    int still_steps = 0;
+    int32_t last_count = shadow_count_;
+    axis_->run_control_loop([&](){
+        if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude * start_c, voltage_magnitude * start_s))
+            return false; // error set inside enqueue_voltage_timings
+        axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+        still_steps = (shadow_count_ == last_count) ? still_steps + 1 : 0;
+        last_count = shadow_count_;
+        return ++i < max_lock_steps && (i < settle_steps || still_steps < settle_steps);
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    // Regressors: 1, phase, dir, then cos/sin pairs of the mechanical harmonics
+    size_t num_harmonics = 0;
+    while (num_harmonics < kMaxOffsetFitHarmonics
+            && (float)(num_harmonics + 1) * scan_distance / pole_pairs >= 2.0f * M_PI)
+        ++num_harmonics;
+    const size_t num_terms = 3 + 2 * num_harmonics;
+
+    // Normal equations, accumulated in double since the sums span many orders of magnitude
+    double ata[kMaxOffsetFitTerms][kMaxOffsetFitTerms] = { { 0.0 } };
+    double aty[kMaxOffsetFitTerms] = { 0.0 };
+    const int32_t init_enc_val = shadow_count_;
+
+    auto add_sample = [&](float phase, float dir) {
+        float x[kMaxOffsetFitTerms] = { 1.0f, phase, dir };
+        for (size_t n = 0; n < num_harmonics; ++n)
+            fast_sincos((float)(n + 1) * phase / pole_pairs, &x[4 + 2 * n], &x[3 + 2 * n]);
+        double y = (double)(shadow_count_ - init_enc_val);
+        for (size_t r = 0; r < num_terms; ++r) {
+            for (size_t c = r; c < num_terms; ++c)
+                ata[r][c] += (double)x[r] * (double)x[c];
+            aty[r] += (double)x[r] * y;
+        }
+    };
+
+    // sweep forward, then back
+    for (float dir : { 1.0f, -1.0f }) {
+        i = 0;
+        axis_->run_control_loop([&](){
+            float phase = dir * (scan_distance * (float)i / (float)num_steps - scan_distance / 2.0f);
+            float c, s;
+            fast_sincos(phase, &s, &c);
+            if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude * c, voltage_magnitude * s))
+                return false; // error set inside enqueue_voltage_timings
+            axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+            // shadow_count_ was sampled in response to the previous command
+            if (i > 0)
+                add_sample(dir * (scan_distance * (float)(i - 1) / (float)num_steps - scan_distance / 2.0f), dir);
+
+            return ++i < num_steps;
+        });
+        if (axis_->error_ != Axis::ERROR_NONE)
+            return false;
+    }
+
+    for (size_t r = 0; r < num_terms; ++r) {
+        for (size_t c = 0; c < r; ++c)
+            ata[r][c] = ata[c][r];
+    }
+    if (!solve_linear_system(ata, aty, num_terms)) {
+        set_error(ERROR_NO_RESPONSE);
+        return false;
+    }
+
+    // Check response and direction
+    float counts_per_rad = (float)aty[1];
+    if (fabsf(counts_per_rad) * scan_distance <= 8.0f) {
+        set_error(ERROR_NO_RESPONSE);
+        return false;
+    }
+    axis_->motor_.config_.direction = counts_per_rad > 0.0f ? 1 : -1;
+
+    // Check CPR
+    float expected_counts_per_rad = (float)(config_.cpr) / (pole_pairs * 2.0f * M_PI);
+    if (fabsf(fabsf(counts_per_rad) - expected_counts_per_rad) / expected_counts_per_rad > config_.calib_range) {
+        set_error(ERROR_CPR_OUT_OF_RANGE);
+        return false;
+    }
+
+    offset_fit_.lag = (float)aty[2];
+    for (size_t n = 0; n < kMaxOffsetFitHarmonics; ++n) {
+        offset_fit_.harmonics[n] = n < num_harmonics
+                ? sqrtf((float)(aty[3 + 2 * n] * aty[3 + 2 * n] + aty[4 + 2 * n] * aty[4 + 2 * n]))
+                : 0.0f;
+    }
+
+    double offset = (double)init_enc_val + aty[0];
+    double offset_floor = floor(offset);
+    config_.offset = (int32_t)offset_floor;
+    config_.offset_float = (float)(offset - offset_floor) + 0.5f; // add 0.5 to center-align state to phase
+    config_.calib_signature = calibration_signature();
 
     is_ready_ = true;
     return true;
 }
 
+// @brief Identifies the settings that the offset depends on, so that a
+// stored offset is not trusted after they were changed.
+// @returns a non-zero hash of the encoder mode, cpr and pole pairs
+uint32_t Encoder::calibration_signature() {
+    uint32_t values[] = { (uint32_t)config_.mode, (uint32_t)config_.cpr, (uint32_t)axis_->motor_.config_.pole_pairs,
+            (uint32_t)config_.sincos_periods };
+    // The signal periods only matter in MODE_SINCOS, leaving them out keeps
+    // the signatures of the other modes as they were
+    size_t n_values = config_.mode == MODE_SINCOS ? 4 : 3;
+    uint32_t signature = 2166136261u; // FNV-1a
+    for (size_t j = 0; j < n_values; ++j) {
+        uint32_t value = values[j];
+        for (size_t i = 0; i < 4; ++i)
+            signature = (signature ^ ((value >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    return signature ? signature : 1;
+}
+
+// @brief Returns true if the stored offset can be used without running the
+// offset calibration again.
+// Configurations from before calib_signature existed are trusted as before.
+bool Encoder::check_calibration() {
+    if (!config_.pre_calibrated)
+        return false;
+    int32_t direction = axis_->motor_.config_.direction;
+    if (direction != 1 && direction != -1)
+        return false;
+    // Both calibrations leave the sub-count offset in (-0.5, 1.5), this also rejects NaN
+    if (!(config_.offset_float > -0.5f && config_.offset_float < 1.5f))
+        return false;
+    return config_.calib_signature == 0 || config_.calib_signature == calibration_signature();
+}
+
+// @brief Builds config_.correction_table by turning the motor one full
+// mechanical turn forward and back with a voltage vector.
+//
+// In every cycle the difference between the commanded phase and the phase
+// that the encoder reports is recorded in the bin of the current count.
+// Forward and backward means are averaged so that the rotor lag cancels.
+// This requires a valid offset, so it is run after run_offset_calibration.
+bool Encoder::run_correction_table_calibration() {
+    const int pole_pairs = axis_->motor_.config_.pole_pairs;
+    const float scan_distance = 2.0f * M_PI * (float)pole_pairs;
+    const int num_steps = (int)(scan_distance / config_.calib_scan_omega * (float)current_meas_hz);
+    const int lock_steps = (int)(config_.calib_lock_duration * (float)current_meas_hz);
+    const float elec_rad_per_enc = (float)pole_pairs * 2.0f * M_PI * (1.0f / (float)(config_.cpr));
+    const float direction = (float)axis_->motor_.config_.direction;
+
+    if (!is_ready_ || num_steps < 1)
+        return false;
+
+    float voltage_magnitude;
+    if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
+        voltage_magnitude = axis_->motor_.config_.calibration_current * axis_->motor_.config_.phase_resistance;
+    else if (axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_GIMBAL)
+        voltage_magnitude = axis_->motor_.config_.calibration_current;
+    else
+        return false;
+
+    // The table must not affect the measurement
+    bool use_correction_table = config_.use_correction_table;
+    config_.use_correction_table = false;
+
+    float sum[2][kCorrectionTableSize] = { { 0.0f } };
+    uint16_t num_samples[2][kCorrectionTableSize] = { { 0 } };
+
+    // lock to phase zero, scan one turn forward, then back
+    bool ok = true;
+    for (int pass = -1; pass < 2 && ok; ++pass) {
+        int i = 0;
+        axis_->run_control_loop([&](){
+            float phase;
+            if (pass < 0)
+                phase = 0.0f;
+            else if (pass == 0)
+                phase = wrap_pm_pi(scan_distance * (float)i / (float)num_steps);
+            else
+                phase = wrap_pm_pi(scan_distance * (float)(num_steps - i) / (float)num_steps);
+            float c, s;
+            fast_sincos(phase, &s, &c);
+            if (!axis_->motor_.enqueue_voltage_timings(voltage_magnitude * c, voltage_magnitude * s))
+                return false; // error set inside enqueue_voltage_timings
+            axis_->motor_.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+            if (pass >= 0) {
+                // Phase that update() reports at the center of the current count
+                float measured_phase = elec_rad_per_enc * ((float)(count_in_cpr_ - config_.offset) + 0.5f - config_.offset_float);
+                float error = wrap_pm_pi(direction * phase - measured_phase) / elec_rad_per_enc;
+                size_t bin = (size_t)(((float)count_in_cpr_ + 0.5f) * ((float)kCorrectionTableSize / (float)config_.cpr)) % kCorrectionTableSize;
+                if (num_samples[pass][bin] < UINT16_MAX) {
+                    sum[pass][bin] += error;
+                    num_samples[pass][bin]++;
+                }
+            }
+            return ++i < (pass < 0 ? lock_steps : num_steps);
+        });
+        ok = axis_->error_ == Axis::ERROR_NONE;
+    }
+    config_.use_correction_table = use_correction_table;
+    if (!ok)
+        return false;
+
+    for (size_t bin = 0; bin < kCorrectionTableSize; ++bin) {
+        if (!num_samples[0][bin] || !num_samples[1][bin]) {
+            set_error(ERROR_CORRECTION_TABLE_INCOMPLETE);
+            return false;
+        }
+    }
+    for (size_t bin = 0; bin < kCorrectionTableSize; ++bin) {
+        config_.correction_table[bin] = 0.5f * (sum[0][bin] / (float)num_samples[0][bin]
+                                              + sum[1][bin] / (float)num_samples[1][bin]);
+    }
+    config_.use_correction_table = true;
+    return true;
+}
+
+float Encoder::get_correction(uint32_t index) {
+    return index < kCorrectionTableSize ? config_.correction_table[index] : 0.0f;
+}
+
+void Encoder::set_correction(uint32_t index, float value) {
+    if (index < kCorrectionTableSize)
+        config_.correction_table[index] = value;
+}
+
 static bool decode_hall(uint8_t hall_state, int32_t* hall_cnt) {
     switch (hall_state) {
         case 0b001: *hall_cnt = 0; return true;
@@ -243,24 +940,98 @@ static bool decode_hall(uint8_t hall_state, int32_t* hall_cnt) {
     }
 }
 
+// Triggered on every edge of any hall sensor if hall interpolation is enabled.
+// Records the time of the edge and, if it continues a run of edges in the
+// same direction, the time since the previous edge.
+RAM_FUNC void Encoder::enc_hall_edge_cb() {
+    uint32_t timestamp = DWT->CYCCNT;
+    uint8_t hall_state =
+        (HAL_GPIO_ReadPin(hw_config_.hallA_port, hw_config_.hallA_pin) != GPIO_PIN_RESET ? 0b001 : 0) |
+        (HAL_GPIO_ReadPin(hw_config_.hallB_port, hw_config_.hallB_pin) != GPIO_PIN_RESET ? 0b010 : 0) |
+        (HAL_GPIO_ReadPin(hw_config_.hallC_port, hw_config_.hallC_pin) != GPIO_PIN_RESET ? 0b100 : 0);
+    int32_t hall_cnt;
+    if (!decode_hall(hall_state, &hall_cnt)) {
+        hall_edge_period_ = 0;
+        return;
+    }
+    int32_t step = mod(hall_cnt - hall_edge_cnt_, 6);
+    if (step > 3)
+        step -= 6;
+    if (step == 1 || step == -1) {
+        hall_edge_period_ = (step == hall_edge_dir_) ? timestamp - hall_edge_timestamp_ : 0;
+        hall_edge_dir_ = step;
+    } else {
+        hall_edge_period_ = 0; // the edge was missed or it bounced
+    }
+    hall_edge_timestamp_ = timestamp;
+    hall_edge_cnt_ = hall_cnt;
+    hall_edge_seq_ = hall_edge_seq_ + 1;
+}
+
+// @brief Updates the electrical angle per encoder count.
+// This must be called whenever the cpr or the motor pole pair count changes.
+void Encoder::update_elec_rad_per_enc() {
+    elec_rad_per_enc_ = axis_->motor_.config_.pole_pairs * 2 * M_PI * (1.0f / (float)(config_.cpr));
+}
+
 void Encoder::update_pll_gains() {
-    pll_kp_ = 2.0f * config_.bandwidth;  // basic conversion to discrete time
-    pll_ki_ = 0.25f * (pll_kp_ * pll_kp_); // Critically damped
+    pll_.set_bandwidth(config_.bandwidth, current_meas_period);
+    pll_.set_period((float)config_.cpr, 0.0f);
+    pll_linear_.set_bandwidth(config_.bandwidth, current_meas_period);
+    pll_bandwidth_ = config_.bandwidth;
+    tracking_error_filt_ = 0.0f;
 
-    // Check that we don't get problems with discrete time approximation
-    if (!(current_meas_period * pll_kp_ < 1.0f)) {
+    // Check that we don't get problems with discrete time approximation.
+    // The adaptive bandwidth stays between bandwidth and bandwidth_max,
+    // so checking both keeps it stable.
+    bool stable = pll_.is_stable();
+    if (config_.enable_adaptive_bandwidth) {
+        Pll<float, PLL_MODE_LINEAR> max_pll;
+        max_pll.set_bandwidth(config_.bandwidth_max, current_meas_period);
+        stable = stable && max_pll.is_stable();
+    }
+    if (!stable) {
         set_error(ERROR_UNSTABLE_GAIN);
     }
 }
 
-bool Encoder::update() {
+// @brief Schedules the PLL bandwidth linearly from config_.bandwidth at
+// standstill to config_.bandwidth_max at adaptive_bandwidth_vel, or at a
+// filtered tracking error of adaptive_bandwidth_err, whichever is closer.
+// A low bandwidth keeps the velocity estimate quiet at standstill, a high
+// one follows fast changes at speed.
+void Encoder::update_adaptive_bandwidth() {
+    float x = 0.0f;
+    if (config_.adaptive_bandwidth_vel > 0.0f)
+        x = fabsf(vel_estimate_) / config_.adaptive_bandwidth_vel;
+    if (config_.adaptive_bandwidth_err > 0.0f)
+        x = std::max(x, tracking_error_filt_ / config_.adaptive_bandwidth_err);
+    x = std::min(x, 1.0f);
+    float bandwidth = config_.bandwidth + x * (config_.bandwidth_max - config_.bandwidth);
+    if (bandwidth != pll_bandwidth_) {
+        pll_.set_bandwidth(bandwidth, current_meas_period);
+        pll_linear_.set_bandwidth(bandwidth, current_meas_period);
+        pll_bandwidth_ = bandwidth;
+    }
+}
+
+bool Encoder::update_unsupported_mode() {
+    set_error(ERROR_UNSUPPORTED_ENCODER_MODE);
+    return false;
+}
+
+// One instance per encoder mode, see update_fn_. The mode checks in here
+// are resolved at compile time.
+template<Encoder::Mode_t mode>
+RAM_FUNC bool Encoder::update_mode() {
+    ProfilerScope prof(Profiler::SECTION_ENCODER_UPDATE);
+
     // update internal encoder state.
     int32_t delta_enc = 0;
-    switch (config_.mode) {
+    switch (mode) {
         case MODE_INCREMENTAL: {
-            //TODO: use count_in_cpr_ instead as shadow_count_ can overflow
-            //or use 64 bit
-            int16_t delta_enc_16 = (int16_t)hw_config_.timer->Instance->CNT - (int16_t)shadow_count_;
+            uint16_t count = input_recorder.encoder_count(axis_, (uint16_t)hw_config_.timer->Instance->CNT);
+            int16_t delta_enc_16 = (int16_t)count - (int16_t)shadow_count_;
             delta_enc = (int32_t)delta_enc_16; //sign extend
         } break;
 
@@ -277,31 +1048,129 @@ bool Encoder::update() {
             }
         } break;
         
-        default: {
-           set_error(ERROR_UNSUPPORTED_ENCODER_MODE);
-           return false;
+        case MODE_SPI_ABS_AMS: {
+            if (!abs_spi_pos_updated_) {
+                // Keep predicting for a few cycles, e.g. if the bus was busy
+                if (++abs_spi_missed_reads_ > kAbsSpiMaxMissedReads) {
+                    set_error(ERROR_ABS_SPI_TIMEOUT);
+                    return false;
+                }
+                break;
+            }
+            abs_spi_pos_updated_ = false;
+            abs_spi_missed_reads_ = 0;
+            int32_t pos = (int32_t)(((int64_t)abs_spi_pos_ * config_.cpr) >> 14);
+            if (!abs_spi_pos_init_) {
+                // The first reading defines the position, there is nothing to track yet
+                shadow_count_ = pos;
+                shadow_turns_ = 0;
+                shadow_count_in_turn_ = pos;
+                count_in_cpr_ = pos;
+                pos_estimate_turns_ = 0;
+                pos_estimate_in_turn_ = (float)pos;
+                pos_estimate_ = (float)pos;
+                pos_cpr_ = (float)pos;
+                abs_spi_pos_init_ = true;
+                break;
+            }
+            delta_enc = mod(pos - count_in_cpr_, config_.cpr);
+            if (delta_enc > config_.cpr / 2)
+                delta_enc -= config_.cpr;
+        } break;
+
+        case MODE_SINCOS: {
+            if (sincos_rank_cos_ < 0)
+                return false; // error set in setup()
+            float angle = get_sincos_angle(get_synchronous_adc_value(sincos_rank_sin_),
+                                           get_synchronous_adc_value(sincos_rank_cos_));
+            if (is_ready_ && (sincos_amplitude_ < 0.5f || sincos_amplitude_ > 1.5f)) {
+                set_error(ERROR_SINCOS_SIGNAL_LOST);
+                return false;
+            }
+            // The angle gives the position within the signal period. The period
+            // is tracked by count_in_cpr_, so the position must not move by
+            // half a period or more between two updates.
+            const int32_t counts_per_period = config_.cpr / config_.sincos_periods;
+            float pos_in_period = fmodf_pos(angle * (1.0f / (2.0f * M_PI)) * (float)counts_per_period, (float)counts_per_period);
+            int32_t pos = std::min((int32_t)pos_in_period, counts_per_period - 1);
+            sincos_fract_ = pos_in_period - (float)pos;
+            if (!sincos_init_) {
+                // The first reading defines the position within the period
+                shadow_count_ = pos;
+                shadow_turns_ = 0;
+                shadow_count_in_turn_ = pos;
+                count_in_cpr_ = pos;
+                pos_estimate_turns_ = 0;
+                pos_estimate_in_turn_ = (float)pos;
+                pos_estimate_ = (float)pos;
+                pos_cpr_ = (float)pos;
+                sincos_init_ = true;
+                break;
+            }
+            delta_enc = mod(pos - count_in_cpr_, counts_per_period);
+            if (delta_enc > counts_per_period / 2)
+                delta_enc -= counts_per_period;
         } break;
     }
 
-    shadow_count_ += delta_enc;
+    // shadow_count_ is a plain 32 bit counter that wraps around. The linear
+    // position is tracked as whole turns plus counts within the turn instead.
+    shadow_count_ = (int32_t)((uint32_t)shadow_count_ + (uint32_t)delta_enc);
+    shadow_count_in_turn_ += delta_enc;
+    if (shadow_count_in_turn_ < 0 || shadow_count_in_turn_ >= config_.cpr) {
+        int32_t in_turn = mod(shadow_count_in_turn_, config_.cpr);
+        shadow_turns_ += (shadow_count_in_turn_ - in_turn) / config_.cpr;
+        shadow_count_in_turn_ = in_turn;
+    }
     count_in_cpr_ += delta_enc;
     count_in_cpr_ = mod(count_in_cpr_, config_.cpr);
 
+    //// look up the nonlinearity correction at the center of the current count
+    float correction = 0.0f;
+    if (config_.use_correction_table) {
+        float bin = ((float)count_in_cpr_ + 0.5f) * ((float)kCorrectionTableSize / (float)config_.cpr);
+        size_t idx = (size_t)bin;
+        float fract = bin - (float)idx;
+        idx %= kCorrectionTableSize;
+        float c0 = config_.correction_table[idx];
+        float c1 = config_.correction_table[(idx + 1) % kCorrectionTableSize];
+        correction = c0 + fract * (c1 - c0);
+    }
+
     //// run pll (for now pll is in units of encoder counts)
+    if (config_.enable_adaptive_bandwidth)
+        update_adaptive_bandwidth();
     // Predict current pos
-    pos_estimate_ += current_meas_period * vel_estimate_;
-    pos_cpr_      += current_meas_period * vel_estimate_;
+    pll_linear_.predict(pos_estimate_in_turn_, vel_estimate_);
+    pll_.predict(pos_cpr_, vel_estimate_);
     // discrete phase detector
-    float delta_pos     = (float)(shadow_count_ - (int32_t)floorf(pos_estimate_));
-    float delta_pos_cpr = (float)(count_in_cpr_ - (int32_t)floorf(pos_cpr_));
-    delta_pos_cpr = wrap_pm(delta_pos_cpr, 0.5f * (float)(config_.cpr));
+    int32_t delta_turns = shadow_turns_ - pos_estimate_turns_;
+    float delta_pos     = (float)(delta_turns * config_.cpr + shadow_count_in_turn_ - (int32_t)floorf(pos_estimate_in_turn_)) + correction;
+    float delta_pos_cpr = (float)(count_in_cpr_ - (int32_t)floorf(pos_cpr_)) + correction;
+    // The sin/cos signals resolve the position within the count, so the
+    // phase detector compares the exact positions instead of whole counts
+    if (mode == MODE_SINCOS) {
+        delta_pos += sincos_fract_ - (pos_estimate_in_turn_ - floorf(pos_estimate_in_turn_));
+        delta_pos_cpr += sincos_fract_ - (pos_cpr_ - floorf(pos_cpr_));
+    }
+    delta_pos_cpr = pll_.wrap_error(delta_pos_cpr);
+    if (config_.enable_adaptive_bandwidth && config_.adaptive_bandwidth_err > 0.0f) {
+        // first order filter at the present bandwidth, bandwidth * dt < 0.5 for a stable PLL
+        tracking_error_filt_ += (pll_bandwidth_ * current_meas_period) * (fabsf(delta_pos_cpr) - tracking_error_filt_);
+    }
     // pll feedback
-    pos_estimate_ += current_meas_period * pll_kp_ * delta_pos;
-    pos_cpr_      += current_meas_period * pll_kp_ * delta_pos_cpr;
-    pos_cpr_ = fmodf_pos(pos_cpr_, (float)(config_.cpr));
-    vel_estimate_      += current_meas_period * pll_ki_ * delta_pos_cpr;
+    pll_linear_.correct_pos(pos_estimate_in_turn_, delta_pos);
+    if (pos_estimate_in_turn_ < 0.0f || pos_estimate_in_turn_ >= (float)config_.cpr) {
+        float in_turn = fmodf_pos(pos_estimate_in_turn_, (float)config_.cpr);
+        pos_estimate_turns_ += (int32_t)roundf((pos_estimate_in_turn_ - in_turn) / (float)config_.cpr);
+        pos_estimate_in_turn_ = in_turn;
+    }
+    pos_estimate_ = (float)pos_estimate_turns_ * (float)config_.cpr + pos_estimate_in_turn_;
+    pll_.correct(pos_cpr_, vel_estimate_, delta_pos_cpr);
+    if (config_.enable_edge_timing && mode == MODE_INCREMENTAL)
+        vel_estimate_ = update_edge_timing(vel_estimate_);
     bool snap_to_zero_vel = false;
-    if (fabsf(vel_estimate_) < 0.5f * current_meas_period * pll_ki_) {
+    if (fabsf(vel_estimate_) < 0.5f * current_meas_period * pll_.ki_) {
         vel_estimate_ = 0.0f; //align delta-sigma on zero to prevent jitter
         snap_to_zero_vel = true;
     }
@@ -323,14 +1192,38 @@ bool Encoder::update() {
         if (interpolation_ > 1.0f) interpolation_ = 1.0f;
         if (interpolation_ < 0.0f) interpolation_ = 0.0f;
     }
-    float interpolated_enc = corrected_enc + interpolation_;
+    // With hall interpolation, the position within the hall sector follows
+    // from the time since the last edge and the duration of the previous sector.
+    // It is only used while the motor keeps turning in the same direction at a
+    // speed that does not drop by more than half from one sector to the next.
+    hall_interpolation_active_ = false;
+    if (mode == MODE_HALL && config_.enable_hall_interpolation) {
+        uint32_t prim = __get_PRIMASK();
+        __disable_irq();
+        uint32_t timestamp = hall_edge_timestamp_;
+        uint32_t period = hall_edge_period_;
+        int32_t hall_cnt = hall_edge_cnt_;
+        int32_t dir = hall_edge_dir_;
+        __set_PRIMASK(prim);
+
+        uint32_t elapsed = DWT->CYCCNT - timestamp;
+        if (period && elapsed < 2 * period) {
+            float fract = (float)elapsed / (float)period;
+            if (fract > 0.999f) fract = 0.999f;
+            corrected_enc = hall_cnt - config_.offset;
+            interpolation_ = dir > 0 ? fract : 1.0f - fract;
+            hall_interpolation_active_ = true;
+        }
+    }
+    if (mode == MODE_SINCOS)
+        interpolation_ = sincos_fract_; // measured rather than predicted
+    float interpolated_enc = corrected_enc + interpolation_ + correction;
 
     //// compute electrical phase
-    //TODO avoid recomputing elec_rad_per_enc every time
-    float elec_rad_per_enc = axis_->motor_.config_.pole_pairs * 2 * M_PI * (1.0f / (float)(config_.cpr));
-    float ph = elec_rad_per_enc * (interpolated_enc - config_.offset_float);
+    float ph = elec_rad_per_enc_ * (interpolated_enc - config_.offset_float);
     // ph = fmodf(ph, 2*M_PI);
     phase_ = wrap_pm_pi(ph);
+    phase_vel_ = elec_rad_per_enc_ * vel_estimate_;
 
     return true;
 }
@@ -15,13 +15,23 @@ public:
         ERROR_UNSUPPORTED_ENCODER_MODE = 0x08,
         ERROR_ILLEGAL_HALL_STATE = 0x10,
         ERROR_INDEX_NOT_FOUND_YET = 0x20,
+        ERROR_CORRECTION_TABLE_INCOMPLETE = 0x40,
+        ERROR_ABS_SPI_TIMEOUT = 0x80,
+        ERROR_ABS_SPI_NOT_AVAILABLE = 0x100,
+        ERROR_SINCOS_NOT_AVAILABLE = 0x200,
+        ERROR_SINCOS_SIGNAL_LOST = 0x400,
     };
 
     enum Mode_t {
         MODE_INCREMENTAL,
-        MODE_HALL
+        MODE_HALL,
+        MODE_SPI_ABS_AMS,   // AS5047P/AS5048A (16 bit frames, SPI mode 1) on the gate driver SPI bus
+        MODE_SINCOS         // Analog sine and cosine signals on two GPIOs, sampled with the phase currents
     };
 
+    // Number of bins of the nonlinearity correction table, spread evenly over one turn
+    static constexpr size_t kCorrectionTableSize = 128;
+
     struct Config_t {
         Encoder::Mode_t mode = Encoder::MODE_INCREMENTAL;
         bool use_index = false;
@@ -30,12 +40,55 @@ public:
                                     // be determined by run_offset_calibration.
                                     // In this case the encoder will enter ready
                                     // state as soon as the index is found.
-        float idx_search_speed = 10.0f; // [rad/s electrical]
+        float idx_search_speed = 10.0f; // [rad/s electrical], the sign sets the search direction
+        float idx_search_accel = 0.0f;  // [rad/s^2 electrical] ramp up to idx_search_speed, 0 to start at full speed
+        bool idx_search_use_current = false; // Drive the index search with the current controller (high current motors only)
         int32_t cpr = (2048 * 4);   // Default resolution of CUI-AMT102 encoder,
         int32_t offset = 0;        // Offset between encoder count and rotor electrical phase
         float offset_float = 0.0f; // Sub-count phase alignment offset
+        uint32_t calib_signature = 0; // calibration_signature() when the offset was calibrated, 0 if unknown
         float calib_range = 0.02f;
+        uint16_t abs_spi_cs_gpio_pin = 0; // GPIO number of the chip select in MODE_SPI_ABS_AMS
+        uint16_t sincos_gpio_pin_sin = 3; // GPIO number of the sine input in MODE_SINCOS (requires a reboot)
+        uint16_t sincos_gpio_pin_cos = 4; // GPIO number of the cosine input in MODE_SINCOS (requires a reboot)
+        int32_t sincos_periods = 1;       // Signal periods per turn in MODE_SINCOS, cpr must be a multiple of it
+        float sincos_offset_sin = 2048.0f; // [ADC counts] signal centers, set by the sin/cos calibration
+        float sincos_offset_cos = 2048.0f;
+        float sincos_gain_sin = 1.0f / 2048.0f; // [1/ADC counts] inverse signal amplitudes
+        float sincos_gain_cos = 1.0f / 2048.0f;
+        float sincos_phase = 0.0f; // [rad] deviation of the cosine from quadrature
+        bool enable_hall_interpolation = false; // Interpolate between hall edges using their timestamps (MODE_HALL only, requires a reboot)
+        bool enable_edge_timing = false;  // Blend in the edge timing velocity at low speed (MODE_INCREMENTAL only, requires a reboot)
+        float edge_timing_vel_limit = 4000.0f; // [counts/s] speed below which edge timing is used, fully
+                                               // below half of it and blended with the PLL above that
         float bandwidth = 1000.0f;
+        bool enable_adaptive_bandwidth = false; // Schedule the PLL bandwidth from bandwidth at standstill up to bandwidth_max
+        float bandwidth_max = 4000.0f;          // [rad/s] PLL bandwidth at adaptive_bandwidth_vel or adaptive_bandwidth_err
+        float adaptive_bandwidth_vel = 20000.0f; // [counts/s] speed at which bandwidth_max is reached, 0 to disable
+        float adaptive_bandwidth_err = 0.0f;    // [counts] filtered tracking error at which bandwidth_max is reached, 0 to disable
+        float calib_lock_duration = 1.0f;       // [s] time to lock onto phase zero before the offset scan
+        float calib_scan_omega = 4.0f * M_PI;   // [rad/s electrical] offset scan speed
+        float calib_scan_distance = 16.0f * M_PI; // [rad electrical] offset scan distance in each direction
+        bool use_fast_offset_calibration = false; // Use run_offset_calibration_fast instead of
+                                                  // the forward/backward averaging scan
+        bool use_correction_table = false;      // Apply correction_table to the measured position
+        bool calibrate_correction_table = false; // Build correction_table after the offset calibration
+        float correction_table[kCorrectionTableSize] = { 0.0f }; // [counts] added to the measured position,
+                                                  // linearly interpolated between bins
+    };
+
+    // Number of control cycles without an absolute SPI reading after which ERROR_ABS_SPI_TIMEOUT is set
+    static constexpr uint32_t kAbsSpiMaxMissedReads = 4;
+    // Smallest signal amplitude [ADC counts] that the sin/cos calibration accepts
+    static constexpr float kSincosMinAmplitude = 100.0f;
+
+    static constexpr size_t kMaxOffsetFitHarmonics = 2;
+    static constexpr size_t kMaxOffsetFitTerms = 3 + 2 * kMaxOffsetFitHarmonics;
+
+    // Result of the last run_offset_calibration_fast, for diagnostics
+    struct OffsetFit_t {
+        float lag = 0.0f;  // [counts] rotor lag behind the scan, per direction
+        float harmonics[kMaxOffsetFitHarmonics] = { 0.0f }; // [counts] amplitude of the n-th mechanical harmonic
     };
 
     Encoder(const EncoderHardwareConfig_t& hw_config,
@@ -46,38 +99,106 @@ public:
     bool do_checks();
 
     void enc_index_cb();
+    void enc_edge_cb();
+    void enc_hall_edge_cb();
 
     void set_linear_count(int32_t count);
+    void shift_linear_count(int32_t delta);
     void set_circular_count(int32_t count, bool update_offset);
     bool calib_enc_offset(float voltage_magnitude);
     bool scan_for_enc_idx(float omega, float voltage_magnitude);
 
     bool run_index_search();
     bool run_offset_calibration();
-    bool update();
+    bool run_offset_calibration_fast();
+    bool run_correction_table_calibration();
+    uint32_t calibration_signature();
+    bool check_calibration();
+    float get_correction(uint32_t index);
+    void set_correction(uint32_t index, float value);
+    // @brief Runs the update of the encoder mode that setup() selected
+    bool update() { return (this->*update_fn_)(); }
+    template<Mode_t mode> bool update_mode();
+    bool update_unsupported_mode();
+    float update_edge_timing(float vel_pll);
+    float get_sincos_angle(uint16_t adc_sin, uint16_t adc_cos);
+    bool run_sincos_calibration();
+
+    void abs_spi_start_transaction();
+    void abs_spi_cb();
 
     void update_pll_gains();
+    void update_adaptive_bandwidth();
+    void update_elec_rad_per_enc();
 
     const EncoderHardwareConfig_t& hw_config_;
     Config_t& config_;
     Axis* axis_ = nullptr; // set by Axis constructor
+    // update_mode<config_.mode>, so that the hot path has no mode branches.
+    // The mode only takes effect at setup(), like the rest of the encoder hardware.
+    bool (Encoder::*update_fn_)() = &Encoder::update_unsupported_mode;
 
     Error_t error_ = ERROR_NONE;
     bool index_found_ = false;
     bool is_ready_ = false;
-    int32_t shadow_count_ = 0;
+    int32_t shadow_count_ = 0;          // wraps around at 32 bit
+    int32_t shadow_turns_ = 0;          // linear count = shadow_turns_ * cpr + shadow_count_in_turn_
+    int32_t shadow_count_in_turn_ = 0;  // [0, cpr)
     int32_t count_in_cpr_ = 0;
     float interpolation_ = 0.0f;
     float phase_ = 0.0f;    // [rad]
-    float pos_estimate_ = 0.0f;  // [rad]
+    float phase_vel_ = 0.0f; // [rad/s] electrical
+    float pos_estimate_ = 0.0f;  // [counts] pos_estimate_turns_ * cpr + pos_estimate_in_turn_, loses resolution at large positions
+    int32_t pos_estimate_turns_ = 0;
+    float pos_estimate_in_turn_ = 0.0f; // [counts] [0, cpr)
     float pos_cpr_ = 0.0f;  // [rad]
     float vel_estimate_ = 0.0f;  // [rad/s]
-    float pll_kp_ = 0.0f;   // [rad/s / rad]
-    float pll_ki_ = 0.0f;   // [(rad/s^2) / rad]
+    Pll<float, PLL_MODE_WRAP> pll_;              // pos_cpr_ and vel_estimate_
+    Pll<float, PLL_MODE_LINEAR> pll_linear_;     // pos_estimate_in_turn_, normalized by update()
+    float pll_bandwidth_ = 0.0f;        // [rad/s] bandwidth of pll_ and pll_linear_, see config_.enable_adaptive_bandwidth
+    float tracking_error_filt_ = 0.0f;  // [counts] low pass filtered magnitude of the PLL phase error
+    float elec_rad_per_enc_ = 0.0f; // [rad/count] set by update_elec_rad_per_enc()
+    OffsetFit_t offset_fit_;
 
     // Updated by low_level pwm_adc_cb
     uint8_t hall_state_ = 0x0; // bit[0] = HallA, .., bit[2] = HallC
 
+    // Hall edge state, written by enc_hall_edge_cb
+    volatile uint32_t hall_edge_seq_ = 0;
+    volatile uint32_t hall_edge_timestamp_ = 0; // [CPU cycles]
+    volatile uint32_t hall_edge_period_ = 0;    // [CPU cycles] between the last two edges, 0 if unknown
+    volatile int32_t hall_edge_cnt_ = 0;        // hall count after the last edge
+    volatile int32_t hall_edge_dir_ = 0;        // direction of the last edge (+1 or -1)
+    bool hall_interpolation_active_ = false;
+
+    // Edge timing state. The timestamp and count of the most recent A channel
+    // edge are written by enc_edge_cb.
+    volatile uint32_t edge_seq_ = 0;
+    volatile uint32_t edge_timestamp_ = 0;   // [CPU cycles]
+    volatile uint16_t edge_count_ = 0;       // encoder timer count
+    bool edge_timing_active_ = false;
+    bool edge_ref_valid_ = false;
+    uint32_t edge_last_seq_ = 0;
+    uint32_t edge_ref_timestamp_ = 0;        // [CPU cycles]
+    uint16_t edge_ref_count_ = 0;
+    float edge_vel_estimate_ = 0.0f;         // [counts/s]
+
+    // Absolute SPI encoder state, updated by abs_spi_cb
+    GPIO_TypeDef* abs_spi_cs_port_ = nullptr;
+    uint16_t abs_spi_cs_pin_ = 0;
+    volatile bool abs_spi_pos_updated_ = false;
+    volatile uint16_t abs_spi_pos_ = 0;      // [counts of 2^14 per turn]
+    bool abs_spi_pos_init_ = false;
+    uint32_t abs_spi_missed_reads_ = 0;     // consecutive control cycles without a valid reading
+    uint32_t abs_spi_error_count_ = 0;      // total bus, parity and sensor errors
+
+    // Sin/cos encoder state
+    int sincos_rank_sin_ = -1;              // see add_synchronous_adc_channel()
+    int sincos_rank_cos_ = -1;
+    bool sincos_init_ = false;
+    float sincos_fract_ = 0.0f;             // [counts] sub-count part of the measured position
+    float sincos_amplitude_ = 0.0f;         // of the corrected signals, 1 when calibrated
+
     // Communication protocol definitions
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -88,28 +209,80 @@ public:
             make_protocol_property("count_in_cpr", &count_in_cpr_),
             make_protocol_property("interpolation", &interpolation_),
             make_protocol_property("phase", &phase_),
-            make_protocol_property("pos_estimate", &pos_estimate_),
+            make_protocol_ro_property("phase_vel", &phase_vel_),
+            make_protocol_ro_property("shadow_turns", &shadow_turns_),
+            make_protocol_ro_property("shadow_count_in_turn", &shadow_count_in_turn_),
+            make_protocol_ro_property("pos_estimate", &pos_estimate_),
+            make_protocol_ro_property("pos_estimate_turns", &pos_estimate_turns_),
+            make_protocol_ro_property("pos_estimate_in_turn", &pos_estimate_in_turn_),
             make_protocol_property("pos_cpr", &pos_cpr_),
             make_protocol_property("hall_state", &hall_state_),
             make_protocol_property("vel_estimate", &vel_estimate_),
-            // make_protocol_property("pll_kp", &pll_kp_),
-            // make_protocol_property("pll_ki", &pll_ki_),
+            make_protocol_ro_property("hall_interpolation_active", &hall_interpolation_active_),
+            make_protocol_ro_property("edge_vel_estimate", &edge_vel_estimate_),
+            make_protocol_ro_property("edge_timing_active", &edge_timing_active_),
+            make_protocol_ro_property("abs_spi_error_count", &abs_spi_error_count_),
+            make_protocol_ro_property("sincos_amplitude", &sincos_amplitude_),
+            make_protocol_object("offset_fit",
+                make_protocol_ro_property("lag", &offset_fit_.lag),
+                make_protocol_ro_property("harmonic_1", &offset_fit_.harmonics[0]),
+                make_protocol_ro_property("harmonic_2", &offset_fit_.harmonics[1])
+            ),
+            make_protocol_ro_property("pll_bandwidth", &pll_bandwidth_),
+            make_protocol_ro_property("tracking_error_filt", &tracking_error_filt_),
+            // make_protocol_property("pll_kp", &pll_.kp_),
+            // make_protocol_property("pll_ki", &pll_.ki_),
             make_protocol_object("config",
                 make_protocol_property("mode", &config_.mode),
                 make_protocol_property("use_index", &config_.use_index),
                 make_protocol_property("pre_calibrated", &config_.pre_calibrated),
+                make_protocol_property("calib_signature", &config_.calib_signature),
                 make_protocol_property("idx_search_speed", &config_.idx_search_speed),
-                make_protocol_property("cpr", &config_.cpr),
+                make_protocol_property("idx_search_accel", &config_.idx_search_accel),
+                make_protocol_property("idx_search_use_current", &config_.idx_search_use_current),
+                make_protocol_property("cpr", &config_.cpr,
+                    [](void* ctx) {
+                        static_cast<Encoder*>(ctx)->update_pll_gains();
+                        static_cast<Encoder*>(ctx)->update_elec_rad_per_enc();
+                    }, this),
                 make_protocol_property("offset", &config_.offset),
                 make_protocol_property("offset_float", &config_.offset_float),
                 make_protocol_property("bandwidth", &config_.bandwidth,
                     [](void* ctx) { static_cast<Encoder*>(ctx)->update_pll_gains(); }, this),
-                make_protocol_property("calib_range", &config_.calib_range)
-            )
+                make_protocol_property("enable_adaptive_bandwidth", &config_.enable_adaptive_bandwidth,
+                    [](void* ctx) { static_cast<Encoder*>(ctx)->update_pll_gains(); }, this),
+                make_protocol_property("bandwidth_max", &config_.bandwidth_max,
+                    [](void* ctx) { static_cast<Encoder*>(ctx)->update_pll_gains(); }, this),
+                make_protocol_property("adaptive_bandwidth_vel", &config_.adaptive_bandwidth_vel),
+                make_protocol_property("adaptive_bandwidth_err", &config_.adaptive_bandwidth_err),
+                make_protocol_property("calib_range", &config_.calib_range),
+                make_protocol_property("abs_spi_cs_gpio_pin", &config_.abs_spi_cs_gpio_pin), // requires a reboot
+                make_protocol_property("sincos_gpio_pin_sin", &config_.sincos_gpio_pin_sin), // requires a reboot
+                make_protocol_property("sincos_gpio_pin_cos", &config_.sincos_gpio_pin_cos), // requires a reboot
+                make_protocol_property("sincos_periods", &config_.sincos_periods),
+                make_protocol_property("sincos_offset_sin", &config_.sincos_offset_sin),
+                make_protocol_property("sincos_offset_cos", &config_.sincos_offset_cos),
+                make_protocol_property("sincos_gain_sin", &config_.sincos_gain_sin),
+                make_protocol_property("sincos_gain_cos", &config_.sincos_gain_cos),
+                make_protocol_property("sincos_phase", &config_.sincos_phase),
+                make_protocol_property("enable_hall_interpolation", &config_.enable_hall_interpolation), // requires a reboot
+                make_protocol_property("enable_edge_timing", &config_.enable_edge_timing), // requires a reboot
+                make_protocol_property("edge_timing_vel_limit", &config_.edge_timing_vel_limit),
+                make_protocol_property("calib_lock_duration", &config_.calib_lock_duration),
+                make_protocol_property("calib_scan_omega", &config_.calib_scan_omega),
+                make_protocol_property("calib_scan_distance", &config_.calib_scan_distance),
+                make_protocol_property("use_fast_offset_calibration", &config_.use_fast_offset_calibration),
+                make_protocol_property("use_correction_table", &config_.use_correction_table),
+                make_protocol_property("calibrate_correction_table", &config_.calibrate_correction_table)
+            ),
+            make_protocol_function("get_correction", *this, &Encoder::get_correction, "index"),
+            make_protocol_function("set_correction", *this, &Encoder::set_correction, "index", "value")
         );
     }
 };
 
 DEFINE_ENUM_FLAG_OPERATORS(Encoder::Error_t)
 
+void abs_spi_dispatch_cb(SPI_HandleTypeDef* hspi);
+
 #endif // __ENCODER_HPP
@@ -0,0 +1,77 @@
+
+#include "odrive_main.h"
+
+// @brief Validates the config and prepares the first point.
+// loop_hz is the rate at which sample() will be called.
+// Returns false if the configuration is invalid.
+bool FrequencyResponse::start(float loop_hz) {
+    num_points_done_ = 0;
+    results_length_ = 0;
+    excitation_ = 0.0f;
+    if (!(config_.amplitude > 0.0f && config_.min_frequency > 0.0f
+            && config_.max_frequency >= config_.min_frequency
+            && config_.num_points >= 1 && config_.num_points <= kMaxPoints
+            && config_.measure_cycles >= 1 && loop_hz > 0.0f))
+        return false;
+    loop_hz_ = loop_hz;
+    phase_ = 0.0f;
+    start_point();
+    return true;
+}
+
+void FrequencyResponse::start_point() {
+    float ratio = config_.num_points > 1
+            ? (float)num_points_done_ / (float)(config_.num_points - 1) : 0.0f;
+    float frequency = config_.min_frequency * powf(config_.max_frequency / config_.min_frequency, ratio);
+    frequency = std::min(frequency, 0.4f * loop_hz_);
+
+    // Round to an integer number of iterations per measurement
+    float samples = roundf((float)config_.measure_cycles * loop_hz_ / frequency);
+    measure_samples_ = std::max((uint32_t)samples, (uint32_t)1);
+    frequency_ = (float)config_.measure_cycles * loop_hz_ / (float)measure_samples_;
+    settle_samples_ = (uint32_t)((float)config_.settle_cycles * loop_hz_ / frequency_);
+    phase_step_ = 2.0f * M_PI * frequency_ / loop_hz_;
+    sample_cnt_ = 0;
+    command_re_ = command_im_ = 0.0f;
+    output_re_ = output_im_ = 0.0f;
+    excitation_ = config_.amplitude * our_arm_sin_f32(phase_);
+}
+
+// @brief Feeds the command and the output of the control loop iteration
+// that injected excitation(), then advances the excitation.
+// Returns false once all points are measured.
+bool FrequencyResponse::sample(float command, float output) {
+    if (num_points_done_ >= config_.num_points)
+        return false;
+
+    if (sample_cnt_ >= settle_samples_) {
+        // Correlation with the excitation A * sin(phase)
+        float s = our_arm_sin_f32(phase_);
+        float c = our_arm_cos_f32(phase_);
+        command_re_ += command * s;
+        command_im_ += command * c;
+        output_re_ += output * s;
+        output_im_ += output * c;
+    }
+    phase_ = wrap_pm_pi(phase_ + phase_step_);
+    excitation_ = config_.amplitude * our_arm_sin_f32(phase_);
+
+    if (++sample_cnt_ < settle_samples_ + measure_samples_)
+        return true;
+
+    float scale = 2.0f / ((float)measure_samples_ * config_.amplitude);
+    float* row = &results_[num_points_done_ * kValuesPerRow];
+    row[0] = frequency_;
+    row[1] = scale * command_re_;
+    row[2] = scale * command_im_;
+    row[3] = scale * output_re_;
+    row[4] = scale * output_im_;
+    ++num_points_done_;
+    results_length_ = num_points_done_ * kValuesPerRow * sizeof(float);
+    if (num_points_done_ >= config_.num_points) {
+        excitation_ = 0.0f;
+        return false;
+    }
+    start_point();
+    return true;
+}
@@ -0,0 +1,92 @@
+#ifndef __FREQ_RESPONSE_HPP
+#define __FREQ_RESPONSE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Stepped sine measurement of the frequency response of an axis,
+// run by AXIS_STATE_FREQUENCY_RESPONSE.
+//
+// At each of config.num_points log spaced frequencies between min_frequency
+// and max_frequency, a sine of config.amplitude is added to the current
+// command (INJECT_CURRENT) or to the velocity command (INJECT_VELOCITY) of
+// the running controller. After config.settle_cycles periods, the total
+// current command and the velocity estimate are correlated with the
+// excitation over config.measure_cycles periods. The frequency is rounded so
+// that these span an integer number of control loop iterations, which
+// rejects DC offsets and the harmonics of the excitation.
+//
+// results_ holds num_points_done_ rows of kValuesPerRow floats:
+//   frequency [Hz], command re, command im, output re, output im
+// where command and output are the phasors of the current command [A] and
+// of the velocity estimate [counts/s], divided by the phasor of the
+// excitation. Read it out through the "results" endpoint, see
+// measure_frequency_response in tools/odrive/utils.py. output / command is
+// the plant (current to velocity). With INJECT_CURRENT, 1 / command - 1 is
+// the loop gain of the velocity loop, with INJECT_VELOCITY, output is its
+// closed loop response.
+class FrequencyResponse {
+public:
+    static constexpr size_t kMaxPoints = 32;
+    static constexpr size_t kValuesPerRow = 5;
+
+    enum Injection_t {
+        INJECT_CURRENT = 0,  //<! add the excitation to the current command [A]
+        INJECT_VELOCITY = 1, //<! add the excitation to the velocity command [counts/s]
+    };
+
+    struct Config_t {
+        Injection_t injection = INJECT_CURRENT;
+        float amplitude = 1.0f;        //<! [A] or [counts/s], see injection
+        float min_frequency = 5.0f;    //<! [Hz]
+        float max_frequency = 500.0f;  //<! [Hz] limited to 0.4 times the control loop rate
+        uint32_t num_points = 16;      //<! at most kMaxPoints
+        uint32_t settle_cycles = 3;    //<! periods before the measurement at each frequency
+        uint32_t measure_cycles = 10;  //<! periods over which the response is averaged
+    };
+
+    bool start(float loop_hz);
+    bool sample(float command, float output);
+    // @brief Excitation to inject in the current control loop iteration
+    float excitation() const { return excitation_; }
+
+    Config_t config_;
+
+    float results_[kMaxPoints * kValuesPerRow] = { 0.0f };
+    size_t results_length_ = 0;    // [bytes] valid part of results_
+    uint32_t num_points_done_ = 0;
+    float frequency_ = 0.0f;       // [Hz] frequency of the point being measured
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_object("config",
+                make_protocol_property("injection", &config_.injection),
+                make_protocol_property("amplitude", &config_.amplitude),
+                make_protocol_property("min_frequency", &config_.min_frequency),
+                make_protocol_property("max_frequency", &config_.max_frequency),
+                make_protocol_property("num_points", &config_.num_points),
+                make_protocol_property("settle_cycles", &config_.settle_cycles),
+                make_protocol_property("measure_cycles", &config_.measure_cycles)
+            ),
+            make_protocol_ro_property("num_points_done", &num_points_done_),
+            make_protocol_ro_property("frequency", &frequency_),
+            make_protocol_buffer("results", results_, &results_length_)
+        );
+    }
+
+private:
+    void start_point();
+
+    float loop_hz_ = 0.0f;
+    float phase_ = 0.0f;           // [rad] of the excitation, continuous across the points
+    float phase_step_ = 0.0f;      // [rad] per control loop iteration
+    float excitation_ = 0.0f;
+    uint32_t settle_samples_ = 0;
+    uint32_t measure_samples_ = 0;
+    uint32_t sample_cnt_ = 0;
+    float command_re_ = 0.0f, command_im_ = 0.0f;
+    float output_re_ = 0.0f, output_im_ = 0.0f;
+};
+
+#endif // __FREQ_RESPONSE_HPP
@@ -0,0 +1,56 @@
+
+#include "odrive_main.h"
+
+FusionEstimator::FusionEstimator(Config_t& config) :
+        config_(config)
+{
+}
+
+// @brief Updates the fused estimate. Must run after the encoder and the
+// sensorless estimator.
+bool FusionEstimator::update() {
+    Encoder& encoder = axis_->encoder_;
+    SensorlessEstimator& sensorless = axis_->sensorless_estimator_;
+
+    encoder_valid_ = encoder.error_ == Encoder::ERROR_NONE && encoder.is_ready_;
+    sensorless_valid_ = sensorless.error_ == SensorlessEstimator::ERROR_NONE
+            && (fabsf(sensorless.vel_estimate_) >= config_.min_sensorless_vel || sensorless.hfi_active_);
+
+    if (encoder_valid_) {
+        if (sensorless_valid_) {
+            float diff = wrap_pm_pi(sensorless.phase_ - encoder.phase_);
+            phase_diff_filt_ = wrap_pm_pi(phase_diff_filt_
+                    + current_meas_period * config_.bandwidth * wrap_pm_pi(diff - phase_diff_filt_));
+        }
+        using_sensorless_ = false;
+        phase_ = wrap_pm_pi(encoder.phase_ + config_.sensorless_weight * phase_diff_filt_);
+        phase_vel_ = encoder.phase_vel_;
+        pos_estimate_turns_ = encoder.pos_estimate_turns_;
+        pos_estimate_in_turn_ = encoder.pos_estimate_in_turn_;
+        vel_estimate_ = encoder.vel_estimate_;
+        return true;
+    }
+
+    if (!config_.enable || !sensorless_valid_) {
+        using_sensorless_ = false;
+        return false;
+    }
+
+    if (!using_sensorless_) {
+        using_sensorless_ = true;
+        failover_count_++;
+    }
+    phase_ = wrap_pm_pi(sensorless.phase_ - (1.0f - config_.sensorless_weight) * phase_diff_filt_);
+    phase_vel_ = sensorless.vel_estimate_;
+
+    // Dead reckoning in encoder counts, so that the controller gains still apply
+    const float cpr = (float)encoder.config_.cpr;
+    vel_estimate_ = phase_vel_ / encoder.elec_rad_per_enc_;
+    pos_estimate_in_turn_ += current_meas_period * vel_estimate_;
+    if (pos_estimate_in_turn_ < 0.0f || pos_estimate_in_turn_ >= cpr) {
+        float in_turn = fmodf_pos(pos_estimate_in_turn_, cpr);
+        pos_estimate_turns_ += (int32_t)roundf((pos_estimate_in_turn_ - in_turn) / cpr);
+        pos_estimate_in_turn_ = in_turn;
+    }
+    return true;
+}
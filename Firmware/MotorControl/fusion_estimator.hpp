@@ -0,0 +1,67 @@
+#ifndef __FUSION_ESTIMATOR_HPP
+#define __FUSION_ESTIMATOR_HPP
+
+// @brief Combines the encoder with the sensorless estimator, so that closed
+// loop control keeps running when the encoder fails.
+//
+// While both are valid, the phase difference between the sensorless estimator
+// and the encoder is low pass filtered at config.bandwidth. The fused phase is
+//   phase = encoder phase + sensorless_weight * filtered difference
+// which is a complementary filter: the encoder provides the high frequency
+// content and the weighted blend the low frequency content.
+//
+// When the encoder reports an error, the filtered difference is frozen and
+//   phase = sensorless phase - (1 - sensorless_weight) * filtered difference
+// takes over, which is continuous with the phase before the fault. The position
+// is then dead-reckoned from the sensorless velocity in encoder counts.
+class FusionEstimator {
+public:
+    struct Config_t {
+        bool enable = false;
+        float bandwidth = 10.0f;            // [rad/s] crossover of the complementary filter
+        float sensorless_weight = 0.0f;     // 0: encoder phase only while the encoder is healthy
+        float min_sensorless_vel = 200.0f;  // [rad/s] electrical, below this the sensorless estimate is not used
+    };
+
+    FusionEstimator(Config_t& config);
+
+    bool update();
+
+    Axis* axis_ = nullptr; // set by Axis constructor
+    Config_t& config_;
+
+    bool encoder_valid_ = false;
+    bool sensorless_valid_ = false;
+    bool using_sensorless_ = false;             // the encoder failed and the sensorless estimate is used
+    uint32_t failover_count_ = 0;
+    float phase_diff_filt_ = 0.0f;              // [rad] filtered sensorless phase - encoder phase
+    float phase_ = 0.0f;                        // [rad] electrical
+    float phase_vel_ = 0.0f;                    // [rad/s] electrical
+    int32_t pos_estimate_turns_ = 0;
+    float pos_estimate_in_turn_ = 0.0f;         // [counts] [0, cpr)
+    float vel_estimate_ = 0.0f;                 // [counts/s]
+
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("encoder_valid", &encoder_valid_),
+            make_protocol_ro_property("sensorless_valid", &sensorless_valid_),
+            make_protocol_ro_property("using_sensorless", &using_sensorless_),
+            make_protocol_property("failover_count", &failover_count_),
+            make_protocol_ro_property("phase_diff_filt", &phase_diff_filt_),
+            make_protocol_ro_property("phase", &phase_),
+            make_protocol_ro_property("phase_vel", &phase_vel_),
+            make_protocol_ro_property("pos_estimate_turns", &pos_estimate_turns_),
+            make_protocol_ro_property("pos_estimate_in_turn", &pos_estimate_in_turn_),
+            make_protocol_ro_property("vel_estimate", &vel_estimate_),
+            make_protocol_object("config",
+                make_protocol_property("enable", &config_.enable),
+                make_protocol_property("bandwidth", &config_.bandwidth),
+                make_protocol_property("sensorless_weight", &config_.sensorless_weight),
+                make_protocol_property("min_sensorless_vel", &config_.min_sensorless_vel)
+            )
+        );
+    }
+};
+
+#endif /* __FUSION_ESTIMATOR_HPP */
@@ -0,0 +1,131 @@
+#include "odrive_main.h"
+
+Gcode gcode;
+
+// @brief Checks that config_.counts_per_unit can convert the path to counts
+bool Gcode::valid_units() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (!(std::fabs(config_.counts_per_unit[i]) > 0.0f) || !std::isfinite(config_.counts_per_unit[i]))
+            return false;
+    }
+    return true;
+}
+
+// @brief Enters the critical section of a push. An idle path is placed at
+// the position setpoints of the axes first.
+// @returns true if the path was idle
+bool Gcode::begin_push() {
+    bool was_idle = planner_.count() == 0;
+    if (was_idle) {
+        float pos[AXIS_COUNT];
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            pos[i] = axes[i]->controller_.pos_setpoint_ / config_.counts_per_unit[i];
+        planner_.reset(pos);
+    }
+    return was_idle;
+}
+
+// @brief Leaves the critical section of a push. A path that got its first
+// segment starts after config_.start_delay.
+// @returns true if the path starts, see start_axes()
+bool Gcode::end_push(bool was_idle) {
+    bool start = was_idle && planner_.count() > 0;
+    if (start)
+        planner_.start_at(axes[0]->get_meas_count() + (uint64_t)(std::max(config_.start_delay, 0.0f) / current_meas_period));
+    eval_tick_ = UINT64_MAX;
+    queue_count_ = planner_.count();
+    free_slots_ = planner_.free_slots();
+    return start;
+}
+
+// @brief Switches the axes to follow the path. This is called outside of the
+// critical section.
+void Gcode::start_axes() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.post_setpoint({ Controller::CTRL_MODE_PATH_CONTROL, 0.0f, 0.0f, 0.0f });
+}
+
+// @brief Appends a straight move (G0 if rapid, otherwise G1 at feed_rate_).
+// @param values: [units] coordinates of X and Y, absolute or relative as
+// selected by absolute_. Axes that are not given keep their position.
+// @returns false if the buffer is full or the move is invalid
+bool Gcode::line(const float values[AXIS_COUNT], const bool given[AXIS_COUNT], bool rapid) {
+    if (!valid_units())
+        return false;
+    float vel_limits[AXIS_COUNT];
+    float accel_limits[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        const TrapezoidalTrajectory::Config_t& limits = axes[i]->trap_.config_;
+        float scale = std::fabs(config_.counts_per_unit[i]);
+        vel_limits[i] = limits.vel_limit / scale;
+        accel_limits[i] = std::min(limits.accel_limit, limits.decel_limit) / scale;
+    }
+    float feed = rapid ? 0.0f : feed_rate_ / 60.0f;
+
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+    bool was_idle = begin_push();
+    float target[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        float end = planner_.end_pos()[i];
+        target[i] = !given[i] ? end : absolute_ ? values[i] : end + values[i];
+    }
+    bool ok = planner_.push_line(target, feed, vel_limits, accel_limits, config_.junction_deviation);
+    bool start = end_push(was_idle);
+    cpu_exit_masked_critical(basepri);
+    if (start)
+        start_axes();
+    return ok;
+}
+
+// @brief Appends a stop of duration [s] (G4)
+// @returns false if the buffer is full or the duration is negative
+bool Gcode::dwell(float duration) {
+    if (!valid_units())
+        return false;
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+    bool was_idle = begin_push();
+    bool ok = planner_.push_dwell(duration);
+    bool start = end_push(was_idle);
+    cpu_exit_masked_critical(basepri);
+    if (start)
+        start_axes();
+    return ok;
+}
+
+// @brief Drops the buffered moves. The axes stop abruptly where the path was
+// last evaluated and hold that position.
+void Gcode::clear() {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+    planner_.clear();
+    end_push(false);
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Evaluates the path for one axis at the current measurement count
+// of axis0, so that both axes follow the same point in time. The path is
+// evaluated once per count, for the first axis that asks.
+// This must be called from the control loop.
+// @param pos, vel, accel: [counts], [counts/s], [counts/s^2]
+// @returns false once the path has ended, pos is then its end
+bool Gcode::eval(const Axis* axis, float* pos, float* vel, float* accel) {
+    size_t i = 0;
+    while (i < AXIS_COUNT && axes[i] != axis)
+        ++i;
+    if (i == AXIS_COUNT)
+        return false;
+    uint64_t tick = axes[0]->get_meas_count();
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+    if (tick != eval_tick_) {
+        eval_running_ = planner_.eval(tick, current_meas_period, eval_pos_, eval_vel_, eval_accel_);
+        eval_tick_ = tick;
+        queue_count_ = planner_.count();
+        free_slots_ = planner_.free_slots();
+    }
+    float scale = config_.counts_per_unit[i];
+    *pos = eval_pos_[i] * scale;
+    *vel = eval_vel_[i] * scale;
+    *accel = eval_accel_[i] * scale;
+    bool running = eval_running_;
+    cpu_exit_masked_critical(basepri);
+    return running;
+}
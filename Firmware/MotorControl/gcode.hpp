@@ -0,0 +1,80 @@
+#ifndef __GCODE_HPP
+#define __GCODE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Path of the G-code moves of the ASCII protocol (G0, G1, G4).
+//
+// X moves axis0 and Y moves axis1, in units of config_.counts_per_unit
+// (e.g. mm). The moves are buffered in a PathPlanner, which blends the
+// corners within config_.junction_deviation. Each axis limits the path with
+// the velocity and acceleration limits of its trap_traj.config.
+//
+// The first move into an idle buffer starts the path from the position
+// setpoints of the axes, config_.start_delay later, and switches both axes
+// to CTRL_MODE_PATH_CONTROL. Keep the buffer filled (see free_slots()) for
+// the axes not to stop between the moves: the path always plans to stop at
+// the end of the last buffered move. When the path ends, the axes drop to
+// CTRL_MODE_POSITION_CONTROL.
+//
+// The buffer is filled by the communication threads and drained by the axis
+// threads, under a critical section.
+class Gcode {
+public:
+    static_assert(AXIS_COUNT == 2, "G-code maps X and Y to two axes");
+
+    struct Config_t {
+        float counts_per_unit[AXIS_COUNT] = { 1.0f, 1.0f }; //<! [counts/unit] of X and Y
+        float junction_deviation = 0.05f; //<! [units] how far the path may round off a corner, 0 to stop at every corner
+        float start_delay = 0.05f;        //<! [s] from the first buffered move to its start, to let the buffer fill
+    };
+
+    bool line(const float values[AXIS_COUNT], const bool given[AXIS_COUNT], bool rapid);
+    bool dwell(float duration);
+    void set_feed_rate(float units_per_min) { feed_rate_ = units_per_min; }
+    void set_absolute(bool absolute) { absolute_ = absolute; }
+    void clear();
+    bool eval(const Axis* axis, float* pos, float* vel, float* accel);
+
+    Config_t config_;
+
+    bool absolute_ = true;    // G90, G91 makes the coordinates relative to the end of the path
+    float feed_rate_ = 0.0f;  // [units/min] of G1, 0 for the axis limits only
+    uint32_t queue_count_ = 0; // buffered moves, including the one in progress
+    uint32_t free_slots_ = PathPlanner<AXIS_COUNT>::kLength;
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_object("config",
+                make_protocol_property("counts_per_unit_x", &config_.counts_per_unit[0]),
+                make_protocol_property("counts_per_unit_y", &config_.counts_per_unit[1]),
+                make_protocol_property("junction_deviation", &config_.junction_deviation),
+                make_protocol_property("start_delay", &config_.start_delay)
+            ),
+            make_protocol_ro_property("absolute", &absolute_),
+            make_protocol_ro_property("feed_rate", &feed_rate_),
+            make_protocol_ro_property("queue_count", &queue_count_),
+            make_protocol_ro_property("free_slots", &free_slots_),
+            make_protocol_function("clear", *this, &Gcode::clear)
+        );
+    }
+
+private:
+    bool valid_units();
+    bool begin_push();
+    bool end_push(bool was_idle);
+    void start_axes();
+
+    PathPlanner<AXIS_COUNT> planner_;
+    uint64_t eval_tick_ = UINT64_MAX; // meas count of the newest evaluation, UINT64_MAX if outdated
+    float eval_pos_[AXIS_COUNT] = { 0.0f };   // [units]
+    float eval_vel_[AXIS_COUNT] = { 0.0f };   // [units/s]
+    float eval_accel_[AXIS_COUNT] = { 0.0f }; // [units/s^2]
+    bool eval_running_ = false; // result of the newest evaluation
+};
+
+extern Gcode gcode;
+
+#endif // __GCODE_HPP
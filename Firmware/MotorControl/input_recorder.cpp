@@ -0,0 +1,214 @@
+#include "odrive_main.h"
+
+InputRecorder input_recorder;
+
+// @brief Starts a new recording in the oscilloscope buffer, which replaces
+// the capture in it.
+// @returns false if the oscilloscope is capturing
+bool InputRecorder::start() {
+    Oscilloscope::State_t scope_state = oscilloscope.state_;
+    if (scope_state != Oscilloscope::STATE_IDLE && scope_state != Oscilloscope::STATE_DONE)
+        return false;
+    stop();
+    oscilloscope.stop();
+    oscilloscope.buffer_length_ = 0;
+
+    Header_t* h = header();
+    h->num_records = 0;
+    h->num_setpoints = 0;
+    h->current_meas_hz = current_meas_hz;
+    h->axes = (uint8_t)(config_.axes & ((1u << AXIS_COUNT) - 1));
+    h->current_oversampling = (uint8_t)board_config.current_oversampling;
+    h->reserved = 0;
+    num_records_ = 0;
+    num_setpoints_ = 0;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        open_[i] = kNoRecord;
+    buffer_length_ = kBufferBytes;
+    __DMB(); // prepare the recording before the interrupt sees it
+    state_ = STATE_RECORDING;
+    return true;
+}
+
+// @brief Ends the recording or the replay. The buffer keeps the recording.
+void InputRecorder::stop() {
+    if (active())
+        finish();
+}
+
+// @brief Marks the recording in the buffer as overwritten, e.g. by an
+// oscilloscope capture
+void InputRecorder::discard() {
+    stop();
+    state_ = STATE_IDLE;
+    buffer_length_ = 0;
+}
+
+// @brief Replays the recording in the oscilloscope buffer, from the next
+// current measurement of each axis on. The firmware must have the
+// configuration it was recorded with.
+// The axes share the vbus voltage and the DC bus current budget, so an axis
+// that isn't in the recording would feed live values into the replayed
+// ones. Only recordings of all axes can be replayed.
+// @returns false if the buffer holds no valid recording for this firmware
+bool InputRecorder::start_replay() {
+    if (active())
+        return false;
+    const Header_t* h = header();
+    if (!has_space(h->num_records, h->num_setpoints) || h->current_meas_hz != current_meas_hz
+            || h->current_oversampling != board_config.current_oversampling
+            || h->axes != (1u << AXIS_COUNT) - 1)
+        return false;
+    num_records_ = h->num_records;
+    num_setpoints_ = h->num_setpoints;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        open_[i] = kNoRecord;
+        setpoint_cursor_[i] = 0;
+    }
+    replay_mismatches_ = 0;
+    buffer_length_ = kBufferBytes;
+    __DMB(); // prepare the replay before the interrupt sees it
+    state_ = STATE_REPLAYING;
+    return true;
+}
+
+// @brief Returns the index of axis in axes, AXIS_COUNT if it isn't one
+size_t InputRecorder::get_axis_num(const Axis* axis) {
+    size_t axis_num = 0;
+    while (axis_num < AXIS_COUNT && axes[axis_num] != axis)
+        ++axis_num;
+    return axis_num;
+}
+
+bool InputRecorder::has_space(uint32_t records, uint32_t setpoints) const {
+    return sizeof(Header_t) + (size_t)records * sizeof(Record_t)
+            + (size_t)setpoints * sizeof(SetpointEvent_t) <= kBufferBytes;
+}
+
+void InputRecorder::finish() {
+    state_ = STATE_DONE;
+}
+
+// @brief Appends the record of this cycle, or looks up the next recorded one
+void InputRecorder::next_record(size_t axis_num) {
+    if (!(header()->axes & (1u << axis_num)))
+        return;
+    if (state_ == STATE_RECORDING) {
+        if (!has_space(num_records_ + 1, num_setpoints_)) {
+            finish();
+            return;
+        }
+        records()[num_records_] = { 0, 0, 0, 0, 0.0f, 0, 0, (uint8_t)axis_num };
+        open_[axis_num] = num_records_;
+        header()->num_records = ++num_records_;
+    } else {
+        // The records of the axes are interleaved
+        size_t i = (open_[axis_num] == kNoRecord) ? 0 : open_[axis_num] + 1;
+        while (i < num_records_ && (records()[i].axis_fields & kAxisMask) != axis_num)
+            ++i;
+        if (i >= num_records_) {
+            finish(); // the end of the recording
+            return;
+        }
+        open_[axis_num] = i;
+    }
+}
+
+// @brief Returns the record of this cycle of axis_num. While recording, the
+// field is marked as read. While replaying, nullptr is returned if the
+// recording doesn't have the field.
+InputRecorder::Record_t* InputRecorder::open_record(size_t axis_num, uint8_t field) {
+    if (axis_num >= AXIS_COUNT || open_[axis_num] == kNoRecord)
+        return nullptr;
+    Record_t* record = &records()[open_[axis_num]];
+    if (state_ == STATE_RECORDING) {
+        record->axis_fields |= field;
+    } else if (!(record->axis_fields & field)) {
+        ++replay_mismatches_;
+        return nullptr;
+    }
+    return record;
+}
+
+uint32_t InputRecorder::substitute_current(size_t axis_num, bool dc_cal, bool is_phB, uint32_t adc_sum) {
+    Record_t* record = open_record(axis_num, dc_cal ? FIELD_DC_CAL : FIELD_CURRENT);
+    if (!record)
+        return adc_sum;
+    uint16_t& value = dc_cal ? (is_phB ? record->adc_dc_phB : record->adc_dc_phC)
+                             : (is_phB ? record->adc_phB : record->adc_phC);
+    if (state_ == STATE_RECORDING)
+        value = (uint16_t)adc_sum;
+    return value;
+}
+
+float InputRecorder::substitute_vbus(size_t axis_num, float sample) {
+    Record_t* record = open_record(axis_num, FIELD_VBUS);
+    if (!record)
+        return sample;
+    if (state_ == STATE_RECORDING)
+        record->vbus_sample = sample;
+    return record->vbus_sample;
+}
+
+uint8_t InputRecorder::substitute_hall(size_t axis_num, uint8_t hall_state) {
+    Record_t* record = open_record(axis_num, FIELD_HALL);
+    if (!record)
+        return hall_state;
+    if (state_ == STATE_RECORDING)
+        record->hall_state = hall_state;
+    return record->hall_state;
+}
+
+uint16_t InputRecorder::substitute_encoder(size_t axis_num, uint16_t count) {
+    Record_t* record = open_record(axis_num, FIELD_ENCODER);
+    if (!record)
+        return count;
+    if (state_ == STATE_RECORDING)
+        record->encoder_count = count;
+    return record->encoder_count;
+}
+
+// @brief Stores a command that the controller of axis_num applied in this cycle.
+// The current measurement interrupt is masked, so that the records and the
+// setpoint events don't run into each other.
+void InputRecorder::add_setpoint(size_t axis_num, const Controller::SetpointCommand_t& command) {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    if (state_ == STATE_RECORDING && axis_num < AXIS_COUNT && open_[axis_num] != kNoRecord) {
+        if (!has_space(num_records_, num_setpoints_ + 1)) {
+            finish();
+        } else {
+            *setpoint_event(num_setpoints_) = { (uint32_t)open_[axis_num], (uint8_t)command.control_mode, { 0, 0, 0 },
+                                                command.pos_setpoint, command.vel_setpoint, command.current_setpoint };
+            header()->num_setpoints = ++num_setpoints_;
+        }
+    }
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Returns the command that the controller of axis applied in this
+// cycle of the recording, if there was one.
+// @returns false if there was none
+bool InputRecorder::replay_setpoint(const Axis* axis, Controller::SetpointCommand_t* command) {
+    size_t axis_num = get_axis_num(axis);
+    if (state_ != STATE_REPLAYING || axis_num >= AXIS_COUNT || open_[axis_num] == kNoRecord)
+        return false;
+    uint32_t open = (uint32_t)open_[axis_num];
+    uint32_t i = setpoint_cursor_[axis_num];
+    for (; i < num_setpoints_; ++i) {
+        const SetpointEvent_t& event = *setpoint_event(i);
+        if (event.record >= num_records_ || (records()[event.record].axis_fields & kAxisMask) != axis_num)
+            continue;
+        if (event.record > open)
+            break;
+        if (event.record < open) {
+            ++replay_mismatches_; // the replayed controller didn't take it in time
+            continue;
+        }
+        *command = { (Controller::ControlMode_t)event.control_mode, event.pos_setpoint,
+                     event.vel_setpoint, event.current_setpoint };
+        setpoint_cursor_[axis_num] = i + 1;
+        return true;
+    }
+    setpoint_cursor_[axis_num] = i;
+    return false;
+}
@@ -0,0 +1,174 @@
+#ifndef __INPUT_RECORDER_HPP
+#define __INPUT_RECORDER_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Records the raw inputs of the control loop of each current
+// measurement into the oscilloscope buffer, so that a run can be replayed
+// offline in the host simulation (see test/sim/run_sim.cpp).
+//
+// The inputs are taken where the firmware reads them: the ADC samples of the
+// phase currents and of their zero current offset, the vbus sample, the
+// hall state and the encoder timer count, and the commands that the
+// controller takes from its setpoint mailbox. Everything else the control
+// loop computes from these and from its state, so a replay that starts from
+// the same state and configuration runs the same code to the same result,
+// bit for bit.
+//
+// The buffer starts with a Header_t, followed by one Record_t per recorded
+// axis and current measurement. The setpoint commands are kept as
+// SetpointEvent_t from the end of the buffer downwards. The recording stops
+// when the two meet. Read it out through the "buffer" endpoint, see
+// record_inputs in tools/odrive/utils.py. The oscilloscope can't capture
+// while a recording is in the buffer, and vice versa.
+//
+// During a replay, the recorded inputs replace the ones the firmware reads,
+// and the setpoint mailbox is ignored. Inputs that the recording doesn't
+// have (e.g. hall edge timestamps, SPI and sin/cos encoders) come from the
+// hardware, and reads that the recording has no input for are counted in
+// replay_mismatches_. Only recordings of all axes can be replayed, see
+// start_replay(). A replay is started by the simulation ("run_sim replay"),
+// it is not exposed on the protocol.
+class InputRecorder {
+public:
+    enum State_t {
+        STATE_IDLE,
+        STATE_RECORDING,
+        STATE_DONE,      //<! the buffer holds a recording
+        STATE_REPLAYING,
+    };
+
+    // Record_t::axis_fields bits 2 and up
+    enum Field_t {
+        FIELD_CURRENT = 0x04, //<! adc_phB and adc_phC
+        FIELD_DC_CAL = 0x08,  //<! adc_dc_phB and adc_dc_phC
+        FIELD_VBUS = 0x10,
+        FIELD_HALL = 0x20,
+        FIELD_ENCODER = 0x40,
+    };
+    static constexpr uint8_t kAxisMask = 0x03;
+    static_assert(AXIS_COUNT <= kAxisMask + 1, "the axis number must fit into Record_t::axis_fields");
+
+    // The layouts are part of the protocol, see record_inputs in tools/odrive/utils.py.
+    struct Header_t {
+        uint32_t num_records;
+        uint32_t num_setpoints;
+        float current_meas_hz;    // [Hz]
+        uint8_t axes;             // bit i: axis i was recorded
+        uint8_t current_oversampling;
+        uint16_t reserved;
+    };
+
+    struct Record_t {
+        uint16_t adc_phB;         // [ADC counts] current sample, sum of the oversampled conversions
+        uint16_t adc_phC;         // [ADC counts]
+        uint16_t adc_dc_phB;      // [ADC counts] zero current sample
+        uint16_t adc_dc_phC;      // [ADC counts]
+        float vbus_sample;        // [V] before the filters of update_vbus_voltage()
+        uint16_t encoder_count;   // timer count read by Encoder::update()
+        uint8_t hall_state;
+        uint8_t axis_fields;      // bits 0-1: axis, bits 2-6: Field_t of the inputs that were read
+    };
+
+    struct SetpointEvent_t {
+        uint32_t record;          // index of the record of the cycle that applied the command
+        uint8_t control_mode;
+        uint8_t reserved[3];
+        float pos_setpoint;       // [counts]
+        float vel_setpoint;       // [counts/s]
+        float current_setpoint;   // [A]
+    };
+
+    static constexpr size_t kBufferBytes = sizeof(oscilloscope.buffer_);
+
+    struct Config_t {
+        uint32_t axes = (1u << AXIS_COUNT) - 1; //<! bit i records axis i, fewer axes make a longer window but can't be replayed
+    };
+
+    bool start();
+    void stop();
+    void discard();
+    bool start_replay();
+
+    bool active() const { return state_ == STATE_RECORDING || state_ == STATE_REPLAYING; }
+    bool replaying() const { return state_ == STATE_REPLAYING; }
+
+    // The hooks below are called where the firmware reads the inputs. They
+    // return the input to use, which is the one passed in unless replaying.
+
+    // @brief Starts the record of axis_num for this current measurement,
+    // before its current sample is read
+    void begin_cycle(size_t axis_num) {
+        if (active())
+            next_record(axis_num);
+    }
+    uint32_t current_sample(size_t axis_num, bool dc_cal, bool is_phB, uint32_t adc_sum) {
+        return active() ? substitute_current(axis_num, dc_cal, is_phB, adc_sum) : adc_sum;
+    }
+    float vbus_sample(size_t axis_num, float sample) {
+        return active() ? substitute_vbus(axis_num, sample) : sample;
+    }
+    uint8_t hall_state(size_t axis_num, uint8_t hall_state) {
+        return active() ? substitute_hall(axis_num, hall_state) : hall_state;
+    }
+    uint16_t encoder_count(const Axis* axis, uint16_t count) {
+        return active() ? substitute_encoder(get_axis_num(axis), count) : count;
+    }
+    void record_setpoint(const Axis* axis, const Controller::SetpointCommand_t& command) {
+        if (state_ == STATE_RECORDING)
+            add_setpoint(get_axis_num(axis), command);
+    }
+    bool replay_setpoint(const Axis* axis, Controller::SetpointCommand_t* command);
+
+    Header_t* header() { return reinterpret_cast<Header_t*>(oscilloscope.buffer_); }
+    Record_t* records() { return reinterpret_cast<Record_t*>(header() + 1); }
+    SetpointEvent_t* setpoint_event(uint32_t index) {
+        return reinterpret_cast<SetpointEvent_t*>(reinterpret_cast<uint8_t*>(oscilloscope.buffer_)
+                + kBufferBytes - (index + 1) * sizeof(SetpointEvent_t));
+    }
+
+    Config_t config_;
+
+    volatile State_t state_ = STATE_IDLE;
+    uint32_t num_records_ = 0;
+    uint32_t num_setpoints_ = 0;
+    uint32_t replay_mismatches_ = 0; // inputs that the replayed code read but the recording didn't have
+    size_t buffer_length_ = 0;       // [bytes] valid part of the buffer
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_object("config",
+                make_protocol_property("axes", &config_.axes)
+            ),
+            make_protocol_ro_property("state", const_cast<State_t*>(&state_)),
+            make_protocol_ro_property("num_records", &num_records_),
+            make_protocol_ro_property("num_setpoints", &num_setpoints_),
+            make_protocol_buffer("buffer", oscilloscope.buffer_, &buffer_length_),
+            make_protocol_function("start", *this, &InputRecorder::start),
+            make_protocol_function("stop", *this, &InputRecorder::stop)
+        );
+    }
+
+private:
+    static constexpr size_t kNoRecord = SIZE_MAX;
+
+    static size_t get_axis_num(const Axis* axis);
+    bool has_space(uint32_t records, uint32_t setpoints) const;
+    void next_record(size_t axis_num);
+    Record_t* open_record(size_t axis_num, uint8_t field);
+    uint32_t substitute_current(size_t axis_num, bool dc_cal, bool is_phB, uint32_t adc_sum);
+    float substitute_vbus(size_t axis_num, float sample);
+    uint8_t substitute_hall(size_t axis_num, uint8_t hall_state);
+    uint16_t substitute_encoder(size_t axis_num, uint16_t count);
+    void add_setpoint(size_t axis_num, const Controller::SetpointCommand_t& command);
+    void finish();
+
+    size_t open_[AXIS_COUNT];         // index of the current record of each axis, kNoRecord before the first
+    uint32_t setpoint_cursor_[AXIS_COUNT] = { 0 }; // replay: next setpoint event to look at
+};
+
+extern InputRecorder input_recorder;
+
+#endif // __INPUT_RECORDER_HPP
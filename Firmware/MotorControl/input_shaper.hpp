@@ -0,0 +1,168 @@
+#ifndef __INPUT_SHAPER_HPP
+#define __INPUT_SHAPER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+// This header does not depend on the rest of the firmware so that it can
+// be tested on the host (see test/run_tests.cpp).
+
+enum InputShaperType_t {
+    INPUT_SHAPER_NONE = 0,
+    INPUT_SHAPER_ZV = 1,  //<! zero vibration: 2 impulses over half a period of the vibration
+    INPUT_SHAPER_ZVD = 2, //<! zero vibration and derivative: 3 impulses over one period, less sensitive to the frequency
+    INPUT_SHAPER_EI = 3,  //<! extra insensitive: 3 impulses over one period, which leave `tolerance` of the vibration
+                          //   at the design frequency and in exchange suppress a wider band around it
+};
+
+// @brief Removes the excitation of a lightly damped vibration from a setpoint
+// stream, by convolving it with a sequence of delayed impulses that add up to 1.
+//
+// The vibrations that the impulses excite cancel out at the design frequency,
+// so the load doesn't ring after a move. The price is a delay: the shaped
+// setpoints reach a target duration_ later than the input.
+//
+// The position, velocity and feed forward current are shaped alike. The past
+// inputs are kept at a reduced rate (decimation_) in a history of
+// kHistoryLength entries and interpolated linearly, so that the delays of low
+// frequency shapers fit in a small buffer.
+//
+// The impulses follow W. Singhose, "Command Shaping for Flexible Systems: A
+// Review of the First 50 Years". For EI, the undamped amplitudes are weighted
+// with the decay of the vibration between the impulses like for ZV and ZVD,
+// which is exact at the design frequency.
+class InputShaper {
+public:
+    static constexpr size_t kMaxImpulses = 3;
+    static constexpr size_t kHistoryLength = 128;
+
+    struct Sample_t {
+        float pos;     // [counts]
+        float vel;     // [counts/s]
+        float current; // [A] feed forward
+    };
+
+    // @brief Computes the impulses for a vibration at the natural frequency
+    // [Hz] with the damping ratio damping, for updates every dt [s].
+    // tolerance is the residual vibration that INPUT_SHAPER_EI leaves at the
+    // design frequency, relative to an unshaped move.
+    // @returns false if the parameters are out of range. The shaper then
+    // passes its input through, like with INPUT_SHAPER_NONE.
+    bool configure(InputShaperType_t type, float frequency, float damping, float tolerance, float dt) {
+        num_impulses_ = 0;
+        duration_ = 0.0f;
+        dt_ = dt;
+        if (type == INPUT_SHAPER_NONE)
+            return true;
+        if (!(frequency > 0.0f) || !(damping >= 0.0f && damping < 1.0f) || !(dt > 0.0f))
+            return false;
+
+        float damping_root = std::sqrt(1.0f - damping * damping);
+        float K = std::exp(-damping * (float)M_PI / damping_root); // decay over half a period
+        float half_period = 0.5f / (frequency * damping_root); // [s] of the damped vibration
+        float amplitudes[kMaxImpulses];
+        size_t n;
+        if (type == INPUT_SHAPER_ZV) {
+            amplitudes[0] = 1.0f;
+            amplitudes[1] = K;
+            n = 2;
+        } else if (type == INPUT_SHAPER_ZVD) {
+            amplitudes[0] = 1.0f;
+            amplitudes[1] = 2.0f * K;
+            amplitudes[2] = K * K;
+            n = 3;
+        } else if (type == INPUT_SHAPER_EI) {
+            if (!(tolerance >= 0.0f && tolerance < 1.0f))
+                return false;
+            amplitudes[0] = 0.25f * (1.0f + tolerance);
+            amplitudes[1] = 0.5f * (1.0f - tolerance) * K;
+            amplitudes[2] = 0.25f * (1.0f + tolerance) * K * K;
+            n = 3;
+        } else {
+            return false;
+        }
+
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; ++i)
+            sum += amplitudes[i];
+        for (size_t i = 0; i < n; ++i) {
+            amplitudes_[i] = amplitudes[i] / sum;
+            delays_[i] = (float)i * half_period / dt;
+        }
+        duration_ = (float)(n - 1) * half_period;
+        // The oldest interpolated entry must still be in the history
+        decimation_ = std::max((uint32_t)std::ceil(delays_[n - 1] / (float)(kHistoryLength - 2)), (uint32_t)1);
+        num_impulses_ = n;
+        return true;
+    }
+
+    // @brief Fills the history with x, as if the input had been x forever
+    void reset(const Sample_t& x) {
+        for (size_t i = 0; i < kHistoryLength; ++i)
+            history_[i] = x;
+        newest_ = 0;
+        phase_ = 0;
+        output_ = x;
+    }
+
+    // @brief Moves the positions of the history by delta [counts], for an
+    // input that wraps around
+    void shift_pos(float delta) {
+        for (size_t i = 0; i < kHistoryLength; ++i)
+            history_[i].pos += delta;
+        output_.pos += delta;
+    }
+
+    // @brief Takes the input of this update and returns the shaped setpoints
+    const Sample_t& update(const Sample_t& x) {
+        if (num_impulses_ == 0)
+            return output_ = x;
+        if (++phase_ >= decimation_) {
+            phase_ = 0;
+            newest_ = (newest_ + 1) % kHistoryLength;
+            history_[newest_] = x;
+        }
+        Sample_t y = { 0.0f, 0.0f, 0.0f };
+        for (size_t i = 0; i < num_impulses_; ++i) {
+            Sample_t delayed = delayed_input(x, delays_[i]);
+            y.pos += amplitudes_[i] * delayed.pos;
+            y.vel += amplitudes_[i] * delayed.vel;
+            y.current += amplitudes_[i] * delayed.current;
+        }
+        return output_ = y;
+    }
+
+    size_t num_impulses_ = 0;                 // 0 passes the input through
+    float amplitudes_[kMaxImpulses] = { 0.0f };
+    float delays_[kMaxImpulses] = { 0.0f };   // [updates]
+    float duration_ = 0.0f;                   // [s] delay of the last impulse
+    float dt_ = 0.0f;                         // [s] update period the impulses were computed for
+    uint32_t decimation_ = 1;                 // updates per history entry
+    Sample_t output_ = { 0.0f, 0.0f, 0.0f };
+
+private:
+    static Sample_t lerp(const Sample_t& a, const Sample_t& b, float frac) {
+        return { a.pos + frac * (b.pos - a.pos), a.vel + frac * (b.vel - a.vel),
+                 a.current + frac * (b.current - a.current) };
+    }
+
+    // @brief Interpolates the input delay [updates] ago. x is the input of
+    // this update, the newest history entry is phase_ updates old.
+    Sample_t delayed_input(const Sample_t& x, float delay) const {
+        if (delay <= (float)phase_)
+            return phase_ ? lerp(x, history_[newest_], delay / (float)phase_) : x;
+        float entries = (delay - (float)phase_) / (float)decimation_;
+        size_t k = (size_t)entries;
+        size_t a = (newest_ + kHistoryLength - k) % kHistoryLength;
+        size_t b = (a + kHistoryLength - 1) % kHistoryLength;
+        return lerp(history_[a], history_[b], entries - (float)k);
+    }
+
+    Sample_t history_[kHistoryLength];
+    size_t newest_ = 0;   // index of the newest history entry
+    uint32_t phase_ = 0;  // updates since the newest history entry
+};
+
+#endif // __INPUT_SHAPER_HPP
@@ -0,0 +1,75 @@
+
+#include "odrive_main.h"
+
+#include <stdarg.h>
+
+Logger logger;
+
+static_assert((Logger::kBufferSize & (Logger::kBufferSize - 1)) == 0, "kBufferSize must be a power of 2");
+
+constexpr char Logger::kTruncationMarker[];
+
+// @brief Appends a message if its level is enabled and it fits entirely.
+// A message longer than kMaxMessageLength keeps its first bytes and ends in
+// kTruncationMarker. Returns false if the message was dropped.
+// Copying takes a short masked critical section, so this may be called from
+// any thread and from interrupts up to IRQ_PRIO_USB, but not from the current
+// measurement interrupt (use the trace there).
+bool Logger::write(Level_t level, const char* data, size_t len) {
+    if (level < level_)
+        return false;
+    const size_t marker_len = sizeof(kTruncationMarker) - 1;
+    bool truncated = len > kMaxMessageLength;
+    size_t text_len = truncated ? kMaxMessageLength - marker_len : len;
+    size_t total_len = truncated ? kMaxMessageLength : len;
+    auto append = [this](uint32_t write_count, const char* src, size_t n) {
+        size_t pos = write_count & (kBufferSize - 1);
+        size_t first = std::min(n, kBufferSize - pos);
+        memcpy(&buffer_[pos], src, first);
+        memcpy(&buffer_[0], src + first, n - first);
+    };
+    bool fits = false;
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_USB);
+    uint32_t write_count = write_count_;
+    if (total_len <= kBufferSize - (write_count - read_count_)) {
+        append(write_count, data, text_len);
+        if (truncated) {
+            append(write_count + text_len, kTruncationMarker, marker_len);
+            truncated_messages_++;
+        }
+        write_count_ = write_count + total_len;
+        fits = true;
+    } else {
+        dropped_messages_++;
+        dropped_bytes_ += total_len;
+    }
+    cpu_exit_masked_critical(basepri);
+    return fits;
+}
+
+// @brief Returns the length of the oldest contiguous piece of text that was
+// not drained yet, and points data to it. Only for the log thread.
+size_t Logger::peek(const uint8_t** data) {
+    uint32_t read_count = read_count_;
+    size_t pos = read_count & (kBufferSize - 1);
+    *data = &buffer_[pos];
+    return std::min((size_t)(write_count_ - read_count), kBufferSize - pos);
+}
+
+// @brief Releases len bytes of the text returned by peek().
+void Logger::consume(size_t len) {
+    read_count_ = read_count_ + len;
+}
+
+void log_printf(Logger::Level_t level, const char* fmt, ...) {
+    if (level < logger.level_)
+        return;
+    // One byte more than a message, so that write() sees when the text was cut
+    char message[Logger::kMaxMessageLength + 1];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    if (len > 0)
+        logger.write(level, message, std::min((size_t)len, sizeof(message)));
+}
@@ -0,0 +1,65 @@
+#ifndef __LOGGER_HPP
+#define __LOGGER_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Non-blocking text log, fed by printf.
+//
+// write() appends a message to a RAM ring buffer and never waits, so printf
+// can be used from the axis threads without missing a control deadline.
+// A message longer than kMaxMessageLength is cut to that length and ends in
+// kTruncationMarker. A message that doesn't fit entirely is dropped and
+// counted, the text that is already in the buffer is never overwritten.
+//
+// The log thread (see communication.cpp) drains the buffer to the stdout
+// interfaces selected at build time (USB_PROTOCOL=stdout, UART_PROTOCOL=stdout)
+// every kDrainPeriodMs, and discards the text if there are none. The host
+// can also read the most recent text through the "buffer" endpoint and
+// write_count_, like the trace.
+class Logger {
+public:
+    static constexpr size_t kBufferSize = 2048; // must be a power of 2
+    static constexpr size_t kMaxMessageLength = 256; // longer messages are truncated
+    static constexpr char kTruncationMarker[] = "...\r\n";
+    static constexpr uint32_t kDrainPeriodMs = 10;
+
+    enum Level_t {
+        LEVEL_DEBUG = 0,
+        LEVEL_INFO = 1,    //<! printf
+        LEVEL_WARNING = 2,
+        LEVEL_ERROR = 3,
+    };
+
+    bool write(Level_t level, const char* data, size_t len);
+    size_t peek(const uint8_t** data);
+    void consume(size_t len);
+
+    uint8_t buffer_[kBufferSize] = { 0 };
+    const size_t buffer_bytes_ = sizeof(buffer_);
+    volatile uint32_t write_count_ = 0;  // total number of bytes written
+    volatile uint32_t read_count_ = 0;   // total number of bytes drained
+    Level_t level_ = LEVEL_INFO;         // messages below this level are ignored
+    uint32_t dropped_messages_ = 0;      // messages that didn't fit into the buffer
+    uint32_t dropped_bytes_ = 0;
+    uint32_t truncated_messages_ = 0;    // messages that were cut to kMaxMessageLength
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_property("level", &level_),
+            make_protocol_ro_property("write_count", const_cast<uint32_t*>(&write_count_)),
+            make_protocol_ro_property("dropped_messages", &dropped_messages_),
+            make_protocol_ro_property("dropped_bytes", &dropped_bytes_),
+            make_protocol_ro_property("truncated_messages", &truncated_messages_),
+            make_protocol_buffer("buffer", buffer_, &buffer_bytes_)
+        );
+    }
+};
+
+extern Logger logger;
+
+// @brief Formats a message like printf and writes it to the log.
+void log_printf(Logger::Level_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif // __LOGGER_HPP
@@ -35,33 +35,90 @@ const float adc_ref_voltage = 3.3f;
 // This value is updated by the DC-bus reading ADC.
 // Arbitrary non-zero inital value to avoid division by zero if ADC reading is late
 float vbus_voltage = 12.0f;
+float vbus_voltage_filtered = 12.0f;
+float vbus_V_to_mod = 1.0f / ((2.0f / 3.0f) * 12.0f);
 bool brake_resistor_armed = false;
+float regen_current_lim = INFINITY;
+float brake_power = 0.0f;
+float brake_energy = 0.0f;
+
+// Control loop timing, see init_pwm_timing()
+uint16_t tim_1_8_period_clocks = TIM_1_8_PERIOD_CLOCKS;
+float current_meas_period = CURRENT_MEAS_PERIOD;
+int32_t current_meas_hz = CURRENT_MEAS_HZ;
+float pwm_phase_offset = 0.25f;
+// Number of injected conversions averaged per M0 phase current sample, see set_current_oversampling()
+static uint32_t current_oversampling = 1;
 /* Private constant data -----------------------------------------------------*/
+// Range of accepted board_config.pwm_period_clocks values.
+// The lower bound leaves time for the ADC sequencing and the interrupt handlers,
+// the upper bound keeps a full PWM cycle (2 * period) within 16 bit.
+static const uint32_t pwm_period_clocks_min = 2048;
+static const uint32_t pwm_period_clocks_max = 32767;
+// Range of accepted board_config.pwm_phase_offset values [PWM periods].
+// pwm_trig_adc_cb relies on the update events coming in the order M0 up,
+// M1 up, M0 down, M1 down, and each axis computes its timings until the
+// next update event of the other axis.
+static const float pwm_phase_offset_min = 0.1f;
+static const float pwm_phase_offset_max = 0.4f;
 static const GPIO_TypeDef* GPIOs_to_samp[] = { GPIOA, GPIOB, GPIOC };
 static const int num_GPIO = sizeof(GPIOs_to_samp) / sizeof(GPIOs_to_samp[0]); 
 /* Private variables ---------------------------------------------------------*/
 
-// Two motors, sampling port A,B,C (coherent with current meas timing)
-static uint16_t GPIO_port_samples [2][num_GPIO];
+// One sample of port A,B,C per motor (coherent with current meas timing)
+static uint16_t GPIO_port_samples [AXIS_COUNT][num_GPIO];
+
+// Where to find each hall signal of an axis in GPIO_port_samples.
+// Index 0 is hall A (bit 0 of hall_state_), up to hall C (bit 2).
+struct HallDecoder_t {
+    uint8_t port_idx[3];
+    uint8_t bit[3];
+};
+static HallDecoder_t hall_decoders[AXIS_COUNT];
+
+// @brief Looks up the port index and bit of each hall signal once, so that
+// the decoding in the current measurement interrupt is three masked loads.
+static void init_hall_decoder(const Encoder& enc, HallDecoder_t* decoder) {
+    GPIO_TypeDef* hall_ports[] = {
+        enc.hw_config_.hallA_port,
+        enc.hw_config_.hallB_port,
+        enc.hw_config_.hallC_port,
+    };
+    uint16_t hall_pins[] = {
+        enc.hw_config_.hallA_pin,
+        enc.hw_config_.hallB_pin,
+        enc.hw_config_.hallC_pin,
+    };
+
+    for (int i = 0; i < 3; ++i) {
+        decoder->port_idx[i] = 0;
+        for (int port_idx = 0; port_idx < num_GPIO; ++port_idx) {
+            if (GPIOs_to_samp[port_idx] == hall_ports[i])
+                decoder->port_idx[i] = port_idx;
+        }
+        decoder->bit[i] = 0;
+        while (decoder->bit[i] < 15 && !(hall_pins[i] & (1 << decoder->bit[i])))
+            decoder->bit[i]++;
+    }
+}
+
+static inline void decode_hall_samples(Encoder& enc, const HallDecoder_t& decoder, const uint16_t GPIO_samples[num_GPIO]) {
+    enc.hall_state_ =
+        (((GPIO_samples[decoder.port_idx[0]] >> decoder.bit[0]) & 1) << 0) |
+        (((GPIO_samples[decoder.port_idx[1]] >> decoder.bit[1]) & 1) << 1) |
+        (((GPIO_samples[decoder.port_idx[2]] >> decoder.bit[2]) & 1) << 2);
+}
+
 /* CPU critical section helpers ----------------------------------------------*/
 
-static inline uint8_t cpu_enter_critical() {
-    uint8_t status_register;
-    asm (
-        "MRS   R0, PRIMASK\n\t"
-        "CPSID I\n\t"
-        "STRB R0, %[output]"
-        : [output] "=m" (status_register) :: "r0"
-    );
-    return status_register;
-}
- 
-static inline void cpu_exit_critical(uint8_t status_register) {
-    asm (
-        "ldrb r0, %[input]\n\t"
-        "msr PRIMASK,r0;\n\t"
-        ::[input] "m" (status_register) : "r0"
-    );
+static inline uint32_t cpu_enter_critical() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static inline void cpu_exit_critical(uint32_t primask) {
+    __set_PRIMASK(primask);
 }
 
 /* Safety critical functions -------------------------------------------------*/
@@ -115,7 +172,7 @@ void low_level_fault(Motor::Error_t error) {
 // All calls to this function must clearly originate
 // from user input.
 void safety_critical_arm_motor_pwm(Motor& motor) {
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     if (brake_resistor_armed) {
         motor.armed_state_ = Motor::ARMED_STATE_WAITING_FOR_TIMINGS;
     }
@@ -128,7 +185,7 @@ void safety_critical_arm_motor_pwm(Motor& motor) {
 // safety_critical_arm_motor_phases is called.
 // @returns true if the motor was in a state other than disarmed before
 bool safety_critical_disarm_motor_pwm(Motor& motor) {
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     bool was_armed = motor.armed_state_ != Motor::ARMED_STATE_DISARMED;
     motor.armed_state_ = Motor::ARMED_STATE_DISARMED;
     __HAL_TIM_MOE_DISABLE_UNCONDITIONALLY(motor.hw_config_.timer);
@@ -142,7 +199,7 @@ bool safety_critical_disarm_motor_pwm(Motor& motor) {
 // the actual PMW timings on the pins can be undefined for up to one
 // timer period.
 void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3]) {
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     if (!brake_resistor_armed) {
         motor.armed_state_ = Motor::ARMED_STATE_ARMED;
     }
@@ -173,7 +230,7 @@ void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3])
 
 // @brief Arms the brake resistor
 void safety_critical_arm_brake_resistor() {
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     brake_resistor_armed = true;
     htim2.Instance->CCR3 = 0;
     htim2.Instance->CCR4 = TIM_APB1_PERIOD_CLOCKS + 1;
@@ -185,7 +242,7 @@ void safety_critical_arm_brake_resistor() {
 // After calling this, the brake resistor can only be armed again
 // by calling safety_critical_arm_brake_resistor().
 void safety_critical_disarm_brake_resistor() {
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     brake_resistor_armed = false;
     htim2.Instance->CCR3 = 0;
     htim2.Instance->CCR4 = TIM_APB1_PERIOD_CLOCKS + 1;
@@ -200,7 +257,7 @@ void safety_critical_disarm_brake_resistor() {
 void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t high_on) {
     if (high_on - low_off < TIM_APB1_DEADTIME_CLOCKS)
         low_level_fault(Motor::ERROR_BRAKE_DEADTIME_VIOLATION);
-    uint8_t sr = cpu_enter_critical();
+    uint32_t sr = cpu_enter_critical();
     if (brake_resistor_armed) {
         // Safe update of low and high side timings
         // To avoid race condition, first reset timings to safe state
@@ -215,14 +272,88 @@ void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t hig
 
 /* Function implementations --------------------------------------------------*/
 
+// @brief Derives the control loop timing from board_config.pwm_period_clocks.
+// Must be called after the configuration is loaded and before any
+// component that uses current_meas_period is constructed.
+// Out of range values fall back to the compile time default.
+// The same goes for board_config.pwm_phase_offset.
+void init_pwm_timing() {
+    uint32_t period = board_config.pwm_period_clocks;
+    if (period < pwm_period_clocks_min || period > pwm_period_clocks_max)
+        period = TIM_1_8_PERIOD_CLOCKS;
+    tim_1_8_period_clocks = (uint16_t)period;
+    current_meas_period = (float)(2 * period) / (float)TIM_1_8_CLOCK_HZ;
+    current_meas_hz = TIM_1_8_CLOCK_HZ / (2 * period);
+    float offset = board_config.pwm_phase_offset;
+    if (!(offset >= pwm_phase_offset_min && offset <= pwm_phase_offset_max))
+        offset = 0.25f;
+    pwm_phase_offset = offset;
+}
+
+// @brief Sets how many back to back conversions of each phase current are
+// averaged for M0. The injected sequences of ADC2 and ADC3 are made of n ranks
+// of the same channel, so the hardware takes all samples on a single trigger.
+// Each additional conversion extends the sampling window by 15 ADC clocks
+// (0.7us) after the center of SVM vector 0.
+// M1 is sampled by the regular group, which only has one data register,
+// so it always takes a single sample.
+// Out of range values are clamped to [1, CURRENT_OVERSAMPLING_MAX].
+void set_current_oversampling(uint32_t n) {
+    n = std::min(std::max(n, (uint32_t)1), (uint32_t)CURRENT_OVERSAMPLING_MAX);
+    ADC_HandleTypeDef* hadcs[] = { &hadc2, &hadc3 };
+    const uint32_t channels[] = { ADC_CHANNEL_10, ADC_CHANNEL_11 };
+    for (size_t i = 0; i < 2; ++i) {
+        // The position of each rank in JSQR depends on the sequence length,
+        // so the whole sequence is configured again
+        hadcs[i]->Instance->JSQR = 0;
+        ADC_InjectionConfTypeDef sConfigInjected;
+        sConfigInjected.InjectedChannel = channels[i];
+        sConfigInjected.InjectedNbrOfConversion = n;
+        sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_3CYCLES;
+        sConfigInjected.ExternalTrigInjecConvEdge = ADC_EXTERNALTRIGINJECCONVEDGE_RISING;
+        sConfigInjected.ExternalTrigInjecConv = ADC_EXTERNALTRIGINJECCONV_T1_TRGO;
+        sConfigInjected.AutoInjectedConv = DISABLE;
+        sConfigInjected.InjectedDiscontinuousConvMode = DISABLE;
+        sConfigInjected.InjectedOffset = 0;
+        for (size_t rank = 1; rank <= n; ++rank) {
+            sConfigInjected.InjectedRank = rank;
+            HAL_ADCEx_InjectedConfigChannel(hadcs[i], &sConfigInjected);
+        }
+    }
+    current_oversampling = n;
+}
+
+// @brief Returns the time [s] from the current sample of an axis to the
+// middle of the PWM period in which the timings computed from it are applied.
+// The timings of an axis are written by pwm_trig_adc_cb of the previous axis
+// (see load_next_timings_on_dc_cal) and the preloaded compare registers take
+// them over on the next update event, which comes every half PWM period.
+// They then stay for a full period. With the default pwm_phase_offset this
+// is 1.5 periods for both axes.
+static float get_pwm_delay(size_t axis_num) {
+    size_t loading_axis = (axis_num + AXIS_COUNT - 1) % AXIS_COUNT;
+    // M1 lags M0 by pwm_phase_offset [PWM periods]
+    float write = (loading_axis ? pwm_phase_offset : 0.0f) - (axis_num ? pwm_phase_offset : 0.0f)
+            + (hw_configs[loading_axis].motor_config.load_next_timings_on_dc_cal ? 0.5f : 0.0f);
+    write -= floorf(write);
+    // The write comes after the update event if both fall together
+    float applied = floorf(2.0f * write) * 0.5f + 0.5f;
+    return (applied + 0.5f) * current_meas_period;
+}
+
 void start_adc_pwm() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        init_hall_decoder(axes[i]->encoder_, &hall_decoders[i]);
+        axes[i]->motor_.pwm_delay_ = get_pwm_delay(i);
+    }
+
     // Enable ADC and interrupts
     __HAL_ADC_ENABLE(&hadc1);
     __HAL_ADC_ENABLE(&hadc2);
     __HAL_ADC_ENABLE(&hadc3);
     // Warp field stabilize.
     osDelay(2);
-    __HAL_ADC_ENABLE_IT(&hadc1, ADC_IT_JEOC);
+    set_current_oversampling(board_config.current_oversampling);
     __HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_JEOC);
     __HAL_ADC_ENABLE_IT(&hadc3, ADC_IT_JEOC);
     __HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_EOC);
@@ -234,8 +365,10 @@ void start_adc_pwm() {
 
     start_pwm(&htim1);
     start_pwm(&htim8);
-    // TODO: explain why this offset
-    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, TIM_1_8_PERIOD_CLOCKS / 2 - 1 * 128);
+    // TIM1 starts pwm_phase_offset ahead of TIM8
+    // TODO: explain why the 128 clocks
+    uint16_t count_offset = (uint16_t)(pwm_phase_offset * (float)(2 * tim_1_8_period_clocks)) - 1 * 128;
+    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, count_offset);
 
     // Motor output starts in the disabled state
     __HAL_TIM_MOE_DISABLE_UNCONDITIONALLY(&htim1);
@@ -259,8 +392,12 @@ void start_adc_pwm() {
 }
 
 void start_pwm(TIM_HandleTypeDef* htim) {
+    // Apply the configured period (the timer was initialized with the default)
+    // There is no auto-reload preload, so this takes effect immediately.
+    __HAL_TIM_SET_AUTORELOAD(htim, tim_1_8_period_clocks);
+
     // Init PWM
-    int half_load = TIM_1_8_PERIOD_CLOCKS / 2;
+    int half_load = tim_1_8_period_clocks / 2;
     htim->Instance->CCR1 = half_load;
     htim->Instance->CCR2 = half_load;
     htim->Instance->CCR3 = half_load;
@@ -323,18 +460,17 @@ void sync_timers(TIM_HandleTypeDef* htim_a, TIM_HandleTypeDef* htim_b,
     htim_b->Instance->BDTR |= MOE_store_b;
 }
 
-// @brief ADC1 measurements are written to this buffer by DMA
-uint16_t adc_measurements_[ADC_CHANNEL_COUNT] = { 0 };
+// @brief ADC1 measurements are written to this buffer by DMA,
+// the last ADC_OVERSAMPLING scans of all channels.
+uint16_t adc_measurements_[ADC_OVERSAMPLING][ADC_CHANNEL_COUNT] = { 0 };
 
 // @brief Starts the general purpose ADC on the ADC1 peripheral.
 // The measured ADC voltages can be read with get_adc_voltage().
 //
 // ADC1 is set up to continuously sample all channels 0 to 15 in a
-// round-robin fashion.
-// DMA is used to copy the measured 12-bit values to adc_measurements_.
-//
-// The injected (high priority) channel of ADC1 is used to sample vbus_voltage.
-// This conversion is triggered by TIM1 at the frequency of the motor control loop.
+// round-robin fashion. This includes the thermistors and vbus.
+// Circular DMA copies the measured 12-bit values to adc_measurements_,
+// without any interrupt. The readers average the last ADC_OVERSAMPLING scans.
 void start_general_purpose_adc() {
     ADC_ChannelConfTypeDef sConfig;
 
@@ -365,27 +501,27 @@ void start_general_purpose_adc() {
             _Error_Handler((char*)__FILE__, __LINE__);
     }
 
-    HAL_ADC_Start_DMA(&hadc1, reinterpret_cast<uint32_t*>(adc_measurements_), ADC_CHANNEL_COUNT);
+    // vbus is part of the scan, so the injected vbus conversion that
+    // MX_ADC1_Init configures is not needed
+    CLEAR_BIT(hadc1.Instance->CR2, ADC_CR2_JEXTEN);
+
+    HAL_ADC_Start_DMA(&hadc1, reinterpret_cast<uint32_t*>(adc_measurements_), ADC_OVERSAMPLING * ADC_CHANNEL_COUNT);
 }
 
-// @brief Returns the ADC voltage associated with the specified pin.
-// GPIO_set_to_analog() must be called first to put the Pin into
-// analog mode.
-// Returns NaN if the pin has no associated ADC1 channel.
-//
-// On ODrive 3.3 and 3.4 the following pins can be used with this function:
-//  GPIO_1, GPIO_2, GPIO_3, GPIO_4 and some pins that are connected to
-//  on-board sensors (M0_TEMP, M1_TEMP, AUX_TEMP)
-//
-// The ADC values are sampled in background at ~30kHz without
-// any CPU involvement.
-//
-// Details: each of the 16 conversion takes (15+26) ADC clock
-// cycles and the ADC, so the update rate of the entire sequence is:
-//  21000kHz / (15+26) / 16 = 32kHz
-// The true frequency is slightly lower because of the injected vbus
-// measurements
-float get_adc_voltage(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+// @brief Returns the average of the last ADC_OVERSAMPLING conversions of
+// the specified ADC1 channel [ADC counts].
+// The DMA may overwrite one of the samples during the read, which only
+// shifts the averaging window by one scan.
+float get_adc_average(uint32_t channel) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < ADC_OVERSAMPLING; ++i)
+        sum += adc_measurements_[i][channel];
+    return (float)sum * (1.0f / ADC_OVERSAMPLING);
+}
+
+// @brief Returns the ADC1 channel of the specified pin, or UINT32_MAX if
+// the pin has no ADC1 channel.
+static uint32_t get_adc_channel(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
     uint32_t channel = UINT32_MAX;
     if (GPIO_port == GPIOA) {
         if (GPIO_pin == GPIO_PIN_0)
@@ -423,102 +559,158 @@ float get_adc_voltage(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
         else if (GPIO_pin == GPIO_PIN_5)
             channel = 15;
     }
+    return channel;
+}
+
+// @brief Returns the ADC voltage associated with the specified pin.
+// GPIO_set_to_analog() must be called first to put the Pin into
+// analog mode.
+// Returns NaN if the pin has no associated ADC1 channel.
+//
+// On ODrive 3.3 and 3.4 the following pins can be used with this function:
+//  GPIO_1, GPIO_2, GPIO_3, GPIO_4 and some pins that are connected to
+//  on-board sensors (M0_TEMP, M1_TEMP, AUX_TEMP)
+//
+// The ADC values are sampled in background at ~30kHz without
+// any CPU involvement and averaged over ADC_OVERSAMPLING scans.
+//
+// Details: each of the 16 conversion takes (15+26) ADC clock
+// cycles and the ADC, so the update rate of the entire sequence is:
+//  21000kHz / (15+26) / 16 = 32kHz
+// With 4 scans, the average covers about one current measurement period at 8kHz.
+float get_adc_voltage(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+    uint32_t channel = get_adc_channel(GPIO_port, GPIO_pin);
     if (channel < ADC_CHANNEL_COUNT)
-        return ((float)adc_measurements_[channel]) * (adc_ref_voltage / adc_full_scale);
+        return get_adc_average(channel) * (adc_ref_voltage / adc_full_scale);
     else
         return 0.0f / 0.0f; // NaN
 }
 
+// @brief ADC1 channels of the injected sequence, in the order of their ranks
+static uint32_t sync_adc_channels[ADC_SYNC_CHANNEL_COUNT];
+static size_t n_sync_adc_channels = 0;
+
+// @brief Adds the ADC1 channel of the specified pin to the injected sequence
+// of ADC1, which converts on the same trigger as the M0 phase currents
+// (TIM1 TRGO). The injected conversions interrupt the background scan.
+// Each takes 15 ADC clocks (0.7us), so the sequence is done by the time the
+// M0 current measurement interrupt has finished.
+// The pin must be put into analog mode with GPIO_set_to_analog().
+// Returns the rank to pass to get_synchronous_adc_value(), or -1 if the pin
+// has no ADC1 channel or the sequence is full.
+int add_synchronous_adc_channel(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+    uint32_t channel = get_adc_channel(GPIO_port, GPIO_pin);
+    if (channel >= ADC_CHANNEL_COUNT || n_sync_adc_channels >= ADC_SYNC_CHANNEL_COUNT)
+        return -1;
+    sync_adc_channels[n_sync_adc_channels++] = channel;
+
+    // The position of each rank in JSQR depends on the sequence length,
+    // so the whole sequence is configured again
+    hadc1.Instance->JSQR = 0;
+    ADC_InjectionConfTypeDef sConfigInjected;
+    sConfigInjected.InjectedNbrOfConversion = n_sync_adc_channels;
+    sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_3CYCLES;
+    sConfigInjected.ExternalTrigInjecConvEdge = ADC_EXTERNALTRIGINJECCONVEDGE_RISING;
+    sConfigInjected.ExternalTrigInjecConv = ADC_EXTERNALTRIGINJECCONV_T1_TRGO;
+    sConfigInjected.AutoInjectedConv = DISABLE;
+    sConfigInjected.InjectedDiscontinuousConvMode = DISABLE;
+    sConfigInjected.InjectedOffset = 0;
+    for (size_t i = 0; i < n_sync_adc_channels; ++i) {
+        sConfigInjected.InjectedChannel = sync_adc_channels[i] << ADC_CR1_AWDCH_Pos;
+        sConfigInjected.InjectedRank = i + 1;
+        if (HAL_ADCEx_InjectedConfigChannel(&hadc1, &sConfigInjected) != HAL_OK)
+            return -1;
+    }
+    return (int)(n_sync_adc_channels - 1);
+}
+
 //--------------------------------
 // IRQ Callbacks
 //--------------------------------
 
-void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
+// @brief Updates the two vbus estimates from the general purpose ADC scan.
+// This is called twice per current measurement period, before the brake
+// resistor and the next PWM timings are computed.
+// vbus_voltage follows the bus closely (board_config.vbus_fast_filter_tau),
+// so that the modulation compensates the ripple of the bus voltage under load.
+// vbus_voltage_filtered (board_config.vbus_filter_tau) rejects the spikes and
+// the ripple for the over and undervoltage checks and the brake resistor
+// regulation.
+static void update_vbus_voltage(size_t axis_num) {
     static const float voltage_scale = adc_ref_voltage * VBUS_S_DIVIDER_RATIO / adc_full_scale;
-    // Only one conversion in sequence, so only rank1
-    uint32_t ADCValue = HAL_ADCEx_InjectedGetValue(hadc, ADC_INJECTED_RANK_1);
-    vbus_voltage = ADCValue * voltage_scale;
-    if (axes[0] && !axes[0]->error_ && axes[1] && !axes[1]->error_) {
-        if (oscilloscope_pos >= OSCILLOSCOPE_SIZE)
-            oscilloscope_pos = 0;
-        oscilloscope[oscilloscope_pos++] = vbus_voltage;
-    }
+    const float dt = 0.5f * current_meas_period;
+    // Filter factor per update, a time constant of (about) 0 takes each sample
+    auto filter_k = [dt](float tau) { return tau > dt ? dt / tau : 1.0f; };
+    float sample = input_recorder.vbus_sample(axis_num, get_adc_average(VBUS_S_ADC_CHANNEL) * voltage_scale);
+    vbus_voltage += filter_k(board_config.vbus_fast_filter_tau) * (sample - vbus_voltage);
+    vbus_voltage_filtered += filter_k(board_config.vbus_filter_tau) * (sample - vbus_voltage_filtered);
+    vbus_V_to_mod = 1.0f / ((2.0f / 3.0f) * vbus_voltage);
 }
 
-static void decode_hall_samples(Encoder& enc, uint16_t GPIO_samples[num_GPIO]) {
-    GPIO_TypeDef* hall_ports[] = {
-        enc.hw_config_.hallC_port,
-        enc.hw_config_.hallB_port,
-        enc.hw_config_.hallA_port,
-    };
-    uint16_t hall_pins[] = {
-        enc.hw_config_.hallC_pin,
-        enc.hw_config_.hallB_pin,
-        enc.hw_config_.hallA_pin,
-    };
-
-    uint8_t hall_state = 0x0;
-    for (int i = 0; i < 3; ++i) {
-        int port_idx = 0;
-        for (;;) {
-            auto port = GPIOs_to_samp[port_idx];
-            if (port == hall_ports[i])
-                break;
-            ++port_idx;
-        }
-
-        hall_state <<= 1;
-        hall_state |= (GPIO_samples[port_idx] & hall_pins[i]) ? 1 : 0;
+// Bit i is set by the current measurement of axis i when it was handed over
+// to the interrupt of the last axis
+static uint32_t deferred_current_meas = 0;
+static_assert(AXIS_COUNT <= 32, "deferred_current_meas has one bit per axis");
+
+// @brief Returns true if all axes should be serviced by the current measurement
+// interrupt of the last axis.
+// This is only done while all axes run their current loop in the ISR.
+static bool dual_axis_isr_active() {
+    if (!board_config.enable_dual_axis_isr)
+        return false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (!axes[i]->isr_current_control_active_)
+            return false;
     }
-
-    enc.hall_state_ = hall_state;
+    return true;
 }
 
 // This is the callback from the ADC that we expect after the PWM has triggered an ADC conversion.
 // TODO: Document how the phasing is done, link to timing diagram
-void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
-#define calib_tau 0.2f  //@TOTO make more easily configurable
-    static const float calib_filter_k = CURRENT_MEAS_PERIOD / calib_tau;
-
-    // Ensure ADCs are expected ones to simplify the logic below
-    if (!(hadc == &hadc2 || hadc == &hadc3)) {
-        low_level_fault(Motor::ERROR_ADC_FAILED);
-        return;
-    };
+RAM_FUNC void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
+    ProfilerScope prof(Profiler::SECTION_ADC_CB);
 
-    // Motor 0 is on Timer 1, which triggers ADC 2 and 3 on an injected conversion
-    // Motor 1 is on Timer 8, which triggers ADC 2 and 3 on a regular conversion
+    // Find the axis whose timer triggered this conversion (see MotorHardwareConfig_t).
+    // On ODrive v3, motor 0 is on Timer 1, which triggers ADC 2 and 3 on an
+    // injected conversion, and motor 1 is on Timer 8, which triggers ADC 2
+    // and 3 on a regular conversion.
     // If the corresponding timer is counting up, we just sampled in SVM vector 0, i.e. real current
     // If we are counting down, we just sampled in SVM vector 7, with zero current
-    Axis& axis = injected ? *axes[0] : *axes[1];
-    int axis_num = injected ? 0 : 1;
-    Axis& other_axis = injected ? *axes[1] : *axes[0];
-    bool counting_down = axis.motor_.hw_config_.timer->Instance->CR1 & TIM_CR1_DIR;
+    size_t axis_num = 0;
+    while (axis_num < AXIS_COUNT && !(hw_configs[axis_num].motor_config.adc_injected == injected
+            && (hadc == hw_configs[axis_num].motor_config.phB_adc || hadc == hw_configs[axis_num].motor_config.phC_adc)))
+        ++axis_num;
+    if (axis_num >= AXIS_COUNT) {
+        low_level_fault(Motor::ERROR_ADC_FAILED);
+        return;
+    }
+    Axis& axis = *axes[axis_num];
+    const MotorHardwareConfig_t& hw_config = axis.motor_.hw_config_;
+    Axis& next_axis = *axes[(axis_num + 1) % AXIS_COUNT];
+    bool counting_down = hw_config.timer->Instance->CR1 & TIM_CR1_DIR;
+    bool is_phB = hadc == hw_config.phB_adc;
 
     bool current_meas_not_DC_CAL = !counting_down;
-    bool update_timings = false;
-    if (hadc == &hadc2) {
-        if (&axis == axes[1] && counting_down)
-            update_timings = true; // update timings of M0
-        else if (&axis == axes[0] && !counting_down)
-            update_timings = true; // update timings of M1
-    }
+    bool update_timings = is_phB && counting_down == hw_config.load_next_timings_on_dc_cal;
+    if (current_meas_not_DC_CAL && is_phB)
+        input_recorder.begin_cycle(axis_num);
 
-    // Load next timings for the motor that we're not currently sampling
+    // Load next timings for the next motor, which we're not currently sampling
     if (update_timings) {
-        if (!other_axis.motor_.next_timings_valid_) {
+        if (!next_axis.motor_.next_timings_valid_) {
             // the motor control loop failed to update the timings in time
             // we must assume that it died and therefore float all phases
-            bool was_armed = safety_critical_disarm_motor_pwm(other_axis.motor_);
+            bool was_armed = safety_critical_disarm_motor_pwm(next_axis.motor_);
             if (was_armed) {
-                other_axis.motor_.error_ |= Motor::ERROR_CONTROL_DEADLINE_MISSED;
+                next_axis.motor_.error_ |= Motor::ERROR_CONTROL_DEADLINE_MISSED;
             }
         } else {
-            other_axis.motor_.next_timings_valid_ = false;
+            next_axis.motor_.next_timings_valid_ = false;
             safety_critical_apply_motor_pwm_timings(
-                other_axis.motor_, other_axis.motor_.next_timings_
+                next_axis.motor_, next_axis.motor_.next_timings_
             );
         }
+        update_vbus_voltage(axis_num);
         update_brake_current();
     }
 
@@ -528,49 +720,101 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     else
         axis.motor_.log_timing(Motor::TIMING_LOG_ADC_CB_DC);
 
-    uint32_t ADCValue;
+    uint32_t sum;
+    uint32_t num_conversions;
     if (injected) {
-        ADCValue = HAL_ADCEx_InjectedGetValue(hadc, ADC_INJECTED_RANK_1);
+        // JDR1..JDR4 hold the ranks of the injected sequence
+        sum = 0;
+        for (size_t i = 0; i < current_oversampling; ++i)
+            sum += (&hadc->Instance->JDR1)[i];
+        num_conversions = current_oversampling;
     } else {
-        ADCValue = HAL_ADC_GetValue(hadc);
+        sum = HAL_ADC_GetValue(hadc);
+        num_conversions = 1;
     }
+    sum = input_recorder.current_sample(axis_num, !current_meas_not_DC_CAL, is_phB, sum);
+    float ADCValue = (float)sum / (float)num_conversions;
     float current = axis.motor_.phase_current_from_adcval(ADCValue);
 
     if (current_meas_not_DC_CAL) {
-        // ADC2 and ADC3 record the phB and phC currents concurrently,
+        // The two ADCs record the phB and phC currents concurrently,
         // and their interrupts should arrive on the same clock cycle.
-        // We dispatch the callbacks in order, so ADC2 will always be processed before ADC3.
-        // Therefore we store the value from ADC2 and signal the thread that the
-        // measurement is ready when we receive the ADC3 measurement
+        // We dispatch the callbacks in order, so phB_adc will always be processed before phC_adc.
+        // Therefore we store the value from phB_adc and signal the thread that the
+        // measurement is ready when we receive the phC_adc measurement
 
         // return or continue
-        if (hadc == &hadc2) {
+        if (is_phB) {
             axis.motor_.current_meas_.phB = current - axis.motor_.DC_calib_.phB;
             return;
         } else {
             axis.motor_.current_meas_.phC = current - axis.motor_.DC_calib_.phC;
         }
         // Prepare hall readings
-        decode_hall_samples(axis.encoder_, GPIO_port_samples[axis_num]);
-        // Trigger axis thread
-        axis.signal_current_meas();
+        decode_hall_samples(axis.encoder_, hall_decoders[axis_num], GPIO_port_samples[axis_num]);
+        axis.encoder_.hall_state_ = input_recorder.hall_state(axis_num, axis.encoder_.hall_state_);
+
+        // In dual axis mode, the measurements of all but the last axis are
+        // held back and all axes are serviced back to back in the interrupt
+        // of the last axis. They are computed in axis order, because their
+        // deadlines come up in that order.
+        if (axis_num != AXIS_COUNT - 1 && dual_axis_isr_active()) {
+            deferred_current_meas |= 1u << axis_num;
+            return;
+        }
+        if (axis_num == AXIS_COUNT - 1 && deferred_current_meas) {
+            for (size_t i = 0; i < AXIS_COUNT - 1; ++i) {
+                if (deferred_current_meas & (1u << i)) {
+                    axes[i]->handle_current_meas();
+                    cycle_log.record(*axes[i], i, prof.elapsed());
+                }
+            }
+            deferred_current_meas = 0;
+        }
+
+        // Run the ISR side of the control loop and trigger axis thread
+        axis.handle_current_meas();
+        cycle_log.record(axis, axis_num, prof.elapsed());
+        if (axis_num == AXIS_COUNT - 1) {
+            // once per period, after all axes
+            oscilloscope.sample();
+            pwm_in_update();
+        }
     } else {
         // DC_CAL measurement
-        if (hadc == &hadc2) {
-            axis.motor_.DC_calib_.phB += (current - axis.motor_.DC_calib_.phB) * calib_filter_k;
+        Motor& motor = axis.motor_;
+        if (motor.config_.freeze_dc_calib_while_armed && motor.DC_calib_converged_
+                && motor.armed_state_ != Motor::ARMED_STATE_DISARMED)
+            return;
+        // With DPWM, the clamped phase conducts through its low side shunt here
+        if (motor.dpwm_active_)
+            return;
+        // Until a full time constant of samples is in, the filter is a running
+        // mean of all samples (the first sample initializes it). This converges
+        // as fast as possible and then hands over to the low pass filter.
+        float filter_tau = std::max(motor.config_.dc_calib_tau, current_meas_period);
+        uint32_t filter_len = (uint32_t)(filter_tau / current_meas_period);
+        float calib_filter_k = current_meas_period / filter_tau;
+        if (motor.DC_calib_samples_ < filter_len)
+            calib_filter_k = 1.0f / (float)(motor.DC_calib_samples_ + 1);
+        if (is_phB) {
+            motor.DC_calib_.phB += (current - motor.DC_calib_.phB) * calib_filter_k;
         } else {
-            axis.motor_.DC_calib_.phC += (current - axis.motor_.DC_calib_.phC) * calib_filter_k;
+            motor.DC_calib_.phC += (current - motor.DC_calib_.phC) * calib_filter_k;
+            // phC_adc comes second, so the sample is complete for both phases
+            if (motor.DC_calib_samples_ < filter_len)
+                ++motor.DC_calib_samples_;
+            else
+                motor.DC_calib_converged_ = true;
         }
     }
 }
 
 void tim_update_cb(TIM_HandleTypeDef* htim) {
-    int portsamples_arr;
-    if (htim == &htim1) {
-        portsamples_arr = 0;
-    } else if (htim == &htim8) {
-        portsamples_arr = 1;
-    } else {
+    size_t portsamples_arr = 0;
+    while (portsamples_arr < AXIS_COUNT && hw_configs[portsamples_arr].motor_config.timer != htim)
+        ++portsamples_arr;
+    if (portsamples_arr >= AXIS_COUNT) {
         low_level_fault(Motor::ERROR_UNEXPECTED_TIMER_CALLBACK);
         return;
     }
@@ -578,29 +822,97 @@ void tim_update_cb(TIM_HandleTypeDef* htim) {
     for (int i = 0; i < num_GPIO; ++i) {
         GPIO_port_samples[portsamples_arr][i] = GPIOs_to_samp[i]->IDR;
     }
+
+    // Kick off absolute SPI encoder reads half a period before the current measurement
+    bool counting_down = htim->Instance->CR1 & TIM_CR1_DIR;
+    if (counting_down)
+        axes[portsamples_arr]->encoder_.abs_spi_start_transaction();
+    else if (portsamples_arr == 0)
+        gate_driver_poll_start_frame();
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* hspi) {
+    abs_spi_dispatch_cb(hspi);
+    gate_driver_poll_dispatch_cb(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef* hspi) {
+    abs_spi_dispatch_cb(hspi);
+    gate_driver_poll_dispatch_cb(hspi);
+}
+
+// @brief Shares the supply budget of board_config.dc_bus_current_limit and
+// dc_bus_power_limit between the armed motors, as their bus_current_lim_.
+//
+// Each motor may draw what the others leave of the budget, but at least an
+// equal share of it: one axis can use the whole supply while the other one
+// is idle, and neither can starve the other. The current that a motor
+// regenerates adds to the budget of the others. When both ask for more than
+// their share, the budget is exceeded by up to one share for one update
+// while the limits settle, which the bus capacitors take.
+//
+// @param Ibus: [A] bus current of each motor, 0 if it is not armed
+static void update_dc_bus_limits(const float Ibus[AXIS_COUNT], float Ibus_sum) {
+    if (!board_config.enable_dc_bus_limit) {
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            axes[i]->motor_.bus_current_lim_ = INFINITY;
+        return;
+    }
+    float budget = board_config.dc_bus_current_limit;
+    if (vbus_voltage_filtered > 0.0f)
+        budget = std::min(budget, board_config.dc_bus_power_limit / vbus_voltage_filtered);
+    budget = std::max(budget, 0.0f);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->motor_.bus_current_lim_ = std::max(budget - (Ibus_sum - Ibus[i]), budget * (1.0f / AXIS_COUNT));
 }
 
 // @brief Sums up the Ibus contribution of each motor and updates the
-// brake resistor PWM accordingly.
+// brake resistor PWM and the supply limits of the motors accordingly.
+//
+// With board_config.enable_vbus_regulation, a proportional term on the vbus
+// excess over vbus_regulation_setpoint is added to the brake current. Once the
+// brake resistor saturates, regen_current_lim takes the same excess off the
+// regenerative current that the motors may feed back (see Motor::FOC_current)
+// instead of faulting.
+//
+// This is called twice per current measurement period.
 void update_brake_current() {
+    float Ibus[AXIS_COUNT];
     float Ibus_sum = 0.0f;
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
-        if (axes[i]->motor_.armed_state_ == Motor::ARMED_STATE_ARMED) {
-            Ibus_sum += axes[i]->motor_.current_control_.Ibus;
-        }
+        Ibus[i] = (axes[i]->motor_.armed_state_ == Motor::ARMED_STATE_ARMED) ? axes[i]->motor_.current_control_.Ibus : 0.0f;
+        Ibus_sum += Ibus[i];
     }
+    update_dc_bus_limits(Ibus, Ibus_sum);
     float brake_current = -Ibus_sum;
     // Clip negative values to 0.0f
     if (brake_current < 0.0f) brake_current = 0.0f;
-    float brake_duty = brake_current * board_config.brake_resistance / vbus_voltage;
 
     // Duty limit at 90% to allow bootstrap caps to charge
+    static const float max_brake_duty = 0.9f;
+    if (board_config.enable_vbus_regulation) {
+        float excess_current = (vbus_voltage_filtered - board_config.vbus_regulation_setpoint) * board_config.vbus_regulation_gain;
+        if (excess_current > 0.0f)
+            brake_current += excess_current;
+        else
+            excess_current = 0.0f;
+        float max_brake_current = max_brake_duty * vbus_voltage / board_config.brake_resistance;
+        if (brake_current > max_brake_current)
+            brake_current = max_brake_current;
+        regen_current_lim = std::max(max_brake_current - excess_current, 0.0f) * (1.0f / AXIS_COUNT);
+    } else {
+        regen_current_lim = INFINITY;
+    }
+    float brake_duty = brake_current * board_config.brake_resistance / vbus_voltage;
+
     // If brake_duty is NaN, this expression will also evaluate to false
-    if ((brake_duty >= 0.0f) && (brake_duty <= 0.9f)) {
+    if ((brake_duty >= 0.0f) && (brake_duty <= max_brake_duty)) {
         int high_on = static_cast<int>(TIM_APB1_PERIOD_CLOCKS * (1.0f - brake_duty));
         int low_off = high_on - TIM_APB1_DEADTIME_CLOCKS;
         if (low_off < 0) low_off = 0;
         safety_critical_apply_brake_resistor_timings(low_off, high_on);
+        brake_power = brake_current * brake_current * board_config.brake_resistance;
+        brake_energy += brake_power * (0.5f * current_meas_period);
     } else {
         //shuts off all motors AND brake resistor, sets error code on all motors.
         low_level_fault(Motor::ERROR_BRAKE_CURRENT_OUT_OF_RANGE);
@@ -651,6 +963,100 @@ uint32_t gpio_num_to_tim_2_5_channel(int gpio_num) {
 #endif
 }
 
+#define TIM_2_5_CLOCK_HZ        TIM_APB1_CLOCK_HZ
+#define PWM_MIN_HIGH_TIME          ((TIM_2_5_CLOCK_HZ / 1000000UL) * 1000UL) // 1ms high is considered full reverse
+#define PWM_MAX_HIGH_TIME          ((TIM_2_5_CLOCK_HZ / 1000000UL) * 2000UL) // 2ms high is considered full forward
+#define PWM_MIN_LEGAL_HIGH_TIME    ((TIM_2_5_CLOCK_HZ / 1000000UL) * 500UL) // ignore high periods shorter than 0.5ms
+#define PWM_MAX_LEGAL_HIGH_TIME    ((TIM_2_5_CLOCK_HZ / 1000000UL) * 2500UL) // ignore high periods longer than 2.5ms
+#define PWM_INVERT_INPUT        false
+
+// Capture timestamps of both edges of a PWM input. Where a DMA stream is
+// free, the timer writes them into edges without an interrupt. Otherwise
+// pwm_in_cb measures the pulses in the TIM5 interrupt. Either way, the
+// mapped endpoint is only written by pwm_in_update().
+static constexpr size_t kPwmInEdges = 8; // ring buffer of the DMA, a power of 2
+struct PwmInput_t {
+    bool enabled;
+    bool use_dma;
+    DMA_HandleTypeDef hdma;
+    volatile uint32_t edges[kPwmInEdges];
+    uint32_t read_pos;        // next edge in edges to be decoded
+    bool level;               // input level after the last decoded edge
+    bool last_pin_level;      // pin level at the last pwm_in_update()
+    bool last_edge_valid;
+    uint32_t last_edge;       // timestamp of the last decoded edge
+    volatile uint32_t pulse_seq;  // incremented for every new pulse in high_time
+    volatile uint32_t high_time;  // [TIM5 clocks] last complete pulse
+    uint32_t applied_seq;         // pulse_seq of the last applied pulse
+    // Destination of the pulses, resolved from the mapping by pwm_in_init()
+    float* target;                // the mapped property if it is a float, otherwise nullptr
+    Endpoint* endpoint;           // the mapped endpoint, used if target is nullptr
+    float min;                    // value at PWM_MIN_HIGH_TIME
+    float scale;                  // [1/TIM5 clocks] change in value per clock of high time
+};
+static PwmInput_t pwm_inputs[GPIO_COUNT];
+
+// @brief Returns the DMA stream that TIM5 requests for the capture of
+// this GPIO (all on channel 6 of DMA1), or nullptr if it is in use.
+// CH3 shares its stream with the SPI3 (and I2C1) receiver. The streams of
+// CH1 and CH2 belong to the UART, which runs on the same pins.
+static DMA_Stream_TypeDef* pwm_in_dma_stream(int gpio_num) {
+    switch (gpio_num) {
+        case 1: return board_config.enable_uart ? nullptr : DMA1_Stream2;
+        case 2: return board_config.enable_uart ? nullptr : DMA1_Stream4;
+        case 4: return DMA1_Stream1;
+        default: return nullptr;
+    }
+}
+
+static uint16_t tim_channel_to_dma_source(uint32_t channel) {
+    switch (channel) {
+        case TIM_CHANNEL_1: return TIM_DMA_CC1;
+        case TIM_CHANNEL_2: return TIM_DMA_CC2;
+        case TIM_CHANNEL_3: return TIM_DMA_CC3;
+        default: return TIM_DMA_CC4;
+    }
+}
+
+// @brief Starts a circular DMA transfer of the capture register to the edge buffer.
+// The DMA interrupts stay disabled.
+static bool pwm_in_start_dma(int gpio_num, PwmInput_t& input) {
+    DMA_Stream_TypeDef* stream = pwm_in_dma_stream(gpio_num);
+    if (!stream)
+        return false;
+    uint32_t channel = gpio_num_to_tim_2_5_channel(gpio_num);
+    input.hdma.Instance = stream;
+    input.hdma.Init.Channel = DMA_CHANNEL_6;
+    input.hdma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    input.hdma.Init.PeriphInc = DMA_PINC_DISABLE;
+    input.hdma.Init.MemInc = DMA_MINC_ENABLE;
+    input.hdma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    input.hdma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    input.hdma.Init.Mode = DMA_CIRCULAR;
+    input.hdma.Init.Priority = DMA_PRIORITY_LOW;
+    input.hdma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&input.hdma) != HAL_OK)
+        return false;
+    // CCR1 to CCR4 are consecutive, like the TIM_CHANNEL_x values (in steps of 4)
+    if (HAL_DMA_Start(&input.hdma, (uint32_t)(&TIM5->CCR1 + channel / 4), (uint32_t)input.edges, kPwmInEdges) != HAL_OK)
+        return false;
+    __HAL_TIM_ENABLE_DMA(&htim5, tim_channel_to_dma_source(channel));
+    return HAL_TIM_IC_Start(&htim5, channel) == HAL_OK;
+}
+
+// @brief Looks up the mapped endpoint once so that pwm_in_update() doesn't
+// go through the endpoint table and the generic conversion for every pulse.
+// @returns false if the mapping doesn't point to an endpoint
+static bool pwm_in_resolve_mapping(const PWMMapping_t& mapping, PwmInput_t& input) {
+    input.endpoint = get_endpoint(mapping.endpoint);
+    if (!input.endpoint)
+        return false;
+    input.target = input.endpoint->get_float_property();
+    input.min = mapping.min;
+    input.scale = (mapping.max - mapping.min) / (float)(PWM_MAX_HIGH_TIME - PWM_MIN_HIGH_TIME);
+    return true;
+}
+
 void pwm_in_init() {
     GPIO_InitTypeDef GPIO_InitStruct;
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
@@ -670,55 +1076,104 @@ void pwm_in_init() {
     int gpio_num = 4; {
 #endif
         if (is_endpoint_ref_valid(board_config.pwm_mappings[gpio_num - 1].endpoint)) {
+            PwmInput_t& input = pwm_inputs[gpio_num - 1];
             GPIO_InitStruct.Pin = get_gpio_pin_by_pin(gpio_num);
             HAL_GPIO_DeInit(get_gpio_port_by_pin(gpio_num), get_gpio_pin_by_pin(gpio_num));
             HAL_GPIO_Init(get_gpio_port_by_pin(gpio_num), &GPIO_InitStruct);
             HAL_TIM_IC_ConfigChannel(&htim5, &sConfigIC, gpio_num_to_tim_2_5_channel(gpio_num));
-            HAL_TIM_IC_Start_IT(&htim5, gpio_num_to_tim_2_5_channel(gpio_num));
+            // The DMA ring buffer is decoded from here on
+            input.level = HAL_GPIO_ReadPin(get_gpio_port_by_pin(gpio_num), get_gpio_pin_by_pin(gpio_num)) != GPIO_PIN_RESET;
+            input.last_pin_level = input.level;
+            input.use_dma = pwm_in_start_dma(gpio_num, input);
+            if (!input.use_dma)
+                HAL_TIM_IC_Start_IT(&htim5, gpio_num_to_tim_2_5_channel(gpio_num));
+            input.enabled = pwm_in_resolve_mapping(board_config.pwm_mappings[gpio_num - 1], input);
         }
     }
 }
 
-#define TIM_2_5_CLOCK_HZ        TIM_APB1_CLOCK_HZ
-#define PWM_MIN_HIGH_TIME          ((TIM_2_5_CLOCK_HZ / 1000000UL) * 1000UL) // 1ms high is considered full reverse
-#define PWM_MAX_HIGH_TIME          ((TIM_2_5_CLOCK_HZ / 1000000UL) * 2000UL) // 2ms high is considered full forward
-#define PWM_MIN_LEGAL_HIGH_TIME    ((TIM_2_5_CLOCK_HZ / 1000000UL) * 500UL) // ignore high periods shorter than 0.5ms
-#define PWM_MAX_LEGAL_HIGH_TIME    ((TIM_2_5_CLOCK_HZ / 1000000UL) * 2500UL) // ignore high periods longer than 2.5ms
-#define PWM_INVERT_INPUT        false
-
-void handle_pulse(int gpio_num, uint32_t high_time) {
+// @brief Hands a measured pulse to pwm_in_update()
+static void handle_pulse(PwmInput_t& input, uint32_t high_time) {
     if (high_time < PWM_MIN_LEGAL_HIGH_TIME || high_time > PWM_MAX_LEGAL_HIGH_TIME)
         return;
+    input.high_time = high_time;
+    input.pulse_seq = input.pulse_seq + 1;
+}
 
-    if (high_time < PWM_MIN_HIGH_TIME)
-        high_time = PWM_MIN_HIGH_TIME;
-    if (high_time > PWM_MAX_HIGH_TIME)
-        high_time = PWM_MAX_HIGH_TIME;
-    float fraction = (float)(high_time - PWM_MIN_HIGH_TIME) / (float)(PWM_MAX_HIGH_TIME - PWM_MIN_HIGH_TIME);
-    float value = board_config.pwm_mappings[gpio_num - 1].min +
-                  (fraction * (board_config.pwm_mappings[gpio_num - 1].max - board_config.pwm_mappings[gpio_num - 1].min));
-
-    Endpoint* endpoint = get_endpoint(board_config.pwm_mappings[gpio_num - 1].endpoint);
-    if (!endpoint)
+// @brief Decodes the new edges in the DMA ring buffer.
+// The edges alternate, so the level after each edge follows from the level
+// before it. The level is checked against the pin while the input is
+// quiet, in case the first edges were missed.
+static void decode_pwm_in_edges(int gpio_num, PwmInput_t& input) {
+    bool pin_level = HAL_GPIO_ReadPin(get_gpio_port_by_pin(gpio_num), get_gpio_pin_by_pin(gpio_num)) != GPIO_PIN_RESET;
+    uint32_t write_pos = (kPwmInEdges - __HAL_DMA_GET_COUNTER(&input.hdma)) & (kPwmInEdges - 1);
+    if (write_pos == input.read_pos) {
+        // The capture lags the pin by the input filter, so wait for the
+        // pin to be stable for one update
+        if (pin_level == input.last_pin_level && pin_level != input.level) {
+            input.level = pin_level;
+            input.last_edge_valid = false;
+        }
+        input.last_pin_level = pin_level;
         return;
+    }
+    input.last_pin_level = pin_level;
+
+    for (; input.read_pos != write_pos; input.read_pos = (input.read_pos + 1) & (kPwmInEdges - 1)) {
+        uint32_t timestamp = input.edges[input.read_pos];
+        bool ends_pulse = input.level != PWM_INVERT_INPUT;
+        if (ends_pulse && input.last_edge_valid)
+            handle_pulse(input, timestamp - input.last_edge);
+        input.level = !input.level;
+        input.last_edge = timestamp;
+        input.last_edge_valid = true;
+    }
+}
 
-    endpoint->set_from_float(value);
+// @brief Writes the newest pulse of each PWM input to its mapped endpoint.
+// This runs once per current measurement period, so an endpoint is
+// written at most once per control cycle however fast the pulses come in.
+void pwm_in_update() {
+    for (int gpio_num = 1; gpio_num <= GPIO_COUNT; ++gpio_num) {
+        PwmInput_t& input = pwm_inputs[gpio_num - 1];
+        if (!input.enabled)
+            continue;
+        if (input.use_dma)
+            decode_pwm_in_edges(gpio_num, input);
+        uint32_t seq = input.pulse_seq;
+        if (seq == input.applied_seq)
+            continue;
+        input.applied_seq = seq;
+
+        uint32_t high_time = input.high_time;
+        if (high_time < PWM_MIN_HIGH_TIME)
+            high_time = PWM_MIN_HIGH_TIME;
+        if (high_time > PWM_MAX_HIGH_TIME)
+            high_time = PWM_MAX_HIGH_TIME;
+        float value = input.min + input.scale * (float)(high_time - PWM_MIN_HIGH_TIME);
+        if (input.target)
+            *input.target = value;
+        else
+            input.endpoint->set_from_float(value);
+    }
 }
 
+// @brief Measures the pulses of the inputs that have no DMA stream.
+// This is called from the TIM5 interrupt.
 void pwm_in_cb(int channel, uint32_t timestamp) {
     static uint32_t last_timestamp[GPIO_COUNT] = { 0 };
     static bool last_pin_state[GPIO_COUNT] = { false };
     static bool last_sample_valid[GPIO_COUNT] = { false };
 
     int gpio_num = tim_2_5_channel_num_to_gpio_num(channel);
-    if (gpio_num < 1 || gpio_num > GPIO_COUNT)
+    if (gpio_num < 1 || gpio_num > GPIO_COUNT || pwm_inputs[gpio_num - 1].use_dma)
         return;
     bool current_pin_state = HAL_GPIO_ReadPin(get_gpio_port_by_pin(gpio_num), get_gpio_pin_by_pin(gpio_num)) != GPIO_PIN_RESET;
 
     if (last_sample_valid[gpio_num - 1]
         && (last_pin_state[gpio_num - 1] != PWM_INVERT_INPUT)
         && (current_pin_state == PWM_INVERT_INPUT)) {
-        handle_pulse(gpio_num, timestamp - last_timestamp[gpio_num - 1]);
+        handle_pulse(pwm_inputs[gpio_num - 1], timestamp - last_timestamp[gpio_num - 1]);
     }
 
     last_timestamp[gpio_num - 1] = timestamp;
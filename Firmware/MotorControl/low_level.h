@@ -18,15 +18,39 @@ extern "C" {
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 #define ADC_CHANNEL_COUNT 16
+#define ADC_OVERSAMPLING 4 // number of scans averaged by get_adc_average()
+#define CURRENT_OVERSAMPLING_MAX 4 // length of the ADC2/ADC3 injected sequences, see set_current_oversampling()
+#define ADC_SYNC_CHANNEL_COUNT 4 // length of the ADC1 injected sequence, see add_synchronous_adc_channel()
 extern const float adc_full_scale;
 extern const float adc_ref_voltage;
 /* Exported variables --------------------------------------------------------*/
 extern float vbus_voltage;
+extern float vbus_V_to_mod; // [1/V] modulation per volt, updated with vbus_voltage
+extern float vbus_voltage_filtered; // [V] slow estimate for the protection and the brake resistor regulation
 extern bool brake_resistor_armed;
-extern uint16_t adc_measurements_[ADC_CHANNEL_COUNT];
+extern float regen_current_lim; // [A] regenerative bus current allowed per motor, see update_brake_current()
+extern float brake_power;       // [W] dissipated in the brake resistor
+extern float brake_energy;      // [J] dissipated in the brake resistor since startup
+extern uint16_t adc_measurements_[ADC_OVERSAMPLING][ADC_CHANNEL_COUNT];
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions --------------------------------------------------------*/
 
+// @brief Starts a critical section that masks the interrupts at irq_prio and
+// all less urgent ones (see priorities.h). Pass the most urgent priority of
+// the interrupts that share the data. Interrupts above it, like the current
+// measurement for communication data, keep running. irq_prio must not be 0.
+// Sections nest, and one must not call the FreeRTOS API.
+// @returns: the previous mask, for cpu_exit_masked_critical()
+static inline uint32_t cpu_enter_masked_critical(uint32_t irq_prio) {
+    uint32_t basepri = __get_BASEPRI();
+    __set_BASEPRI_MAX(irq_prio << (8U - __NVIC_PRIO_BITS));
+    return basepri;
+}
+
+static inline void cpu_exit_masked_critical(uint32_t basepri) {
+    __set_BASEPRI(basepri);
+}
+
 void safety_critical_arm_motor_pwm(Motor& motor);
 bool safety_critical_disarm_motor_pwm(Motor& motor);
 void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3]);
@@ -37,19 +61,29 @@ void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t hig
 // called from STM platform code
 extern "C" {
 void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
-void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
 void tim_update_cb(TIM_HandleTypeDef* htim);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef* hspi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef* hspi);
 void pwm_in_cb(int channel, uint32_t timestamp);
 }
 
 // Initalisation
+void init_pwm_timing();
+void set_current_oversampling(uint32_t n);
 void start_adc_pwm();
 void start_pwm(TIM_HandleTypeDef* htim);
 void sync_timers(TIM_HandleTypeDef* htim_a, TIM_HandleTypeDef* htim_b,
         uint16_t TIM_CLOCKSOURCE_ITRx, uint16_t count_offset);
 void start_general_purpose_adc();
+float get_adc_average(uint32_t channel);
 float get_adc_voltage(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
+int add_synchronous_adc_channel(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
+// @brief Returns the last conversion of a channel added by add_synchronous_adc_channel() [ADC counts]
+static inline uint16_t get_synchronous_adc_value(int rank) {
+    return (uint16_t)(&ADC1->JDR1)[rank];
+}
 void pwm_in_init();
+void pwm_in_update();
 
 void update_brake_current();
 
@@ -8,9 +8,13 @@
 #include <communication/interface_uart.h>
 #include <communication/interface_i2c.h>
 
+#include <new>
+#include <utility>
+
 BoardConfig_t board_config;
 Encoder::Config_t encoder_configs[AXIS_COUNT];
 SensorlessEstimator::Config_t sensorless_configs[AXIS_COUNT];
+FusionEstimator::Config_t fusion_configs[AXIS_COUNT];
 Controller::Config_t controller_configs[AXIS_COUNT];
 Motor::Config_t motor_configs[AXIS_COUNT];
 Axis::Config_t axis_configs[AXIS_COUNT];
@@ -28,26 +32,394 @@ typedef Config<
     Controller::Config_t[AXIS_COUNT],
     Motor::Config_t[AXIS_COUNT],
     TrapezoidalTrajectory::Config_t[AXIS_COUNT],
-    Axis::Config_t[AXIS_COUNT]> ConfigFormat;
+    Axis::Config_t[AXIS_COUNT],
+    FusionEstimator::Config_t[AXIS_COUNT]> ConfigFormat;
+
+// The anti-cogging maps are too large for the configuration store and live
+// in their own flash sector (see NVM_large_data), one slot per axis.
+// A map only applies to the encoder setup it was calibrated with, so that
+// is stored with it.
+struct CoggingMapHeader_t {
+    uint32_t magic;
+    uint32_t cpr;
+    int32_t encoder_offset;
+    uint32_t encoder_mode;
+    uint32_t num_bins; // 0: one float per count, otherwise int16 bins (see Controller::kAnticoggingBinScale)
+    uint32_t crc16; // over the fields above and the map
+};
+static constexpr uint32_t kCoggingMapMagic = 0xC0661002;
+static constexpr size_t kCoggingMapSlotSize = 0x10000; // [bytes] per axis, up to 16379 counts per revolution unbinned
+
+static size_t cogging_map_data_size(const CoggingMapHeader_t& header) {
+    return header.num_bins ? header.num_bins * sizeof(int16_t) : header.cpr * sizeof(float);
+}
+
+static uint16_t cogging_map_crc16(const CoggingMapHeader_t& header, const uint8_t* data) {
+    uint16_t crc16 = CONFIG_CRC16_INIT;
+    crc16 = calc_crc16<CONFIG_CRC16_POLYNOMIAL>(crc16, (const uint8_t*)&header, offsetof(CoggingMapHeader_t, crc16));
+    return calc_crc16<CONFIG_CRC16_POLYNOMIAL>(crc16, data, cogging_map_data_size(header));
+}
+
+// @brief Rewrites the anti-cogging sector if a map was calibrated since the
+// last save. Maps that are already in flash are written again.
+// @returns false if writing the flash failed
+static bool save_anticogging_maps() {
+    bool dirty = false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        dirty = dirty || axes[i]->controller_.anticogging_.map_dirty;
+    if (!dirty)
+        return true;
+
+    // Maps that are used in place would be erased with the sector
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (!axes[i]->controller_.move_anticogging_map_to_ram())
+            return false;
+    }
+    if (NVM_large_data_erase())
+        return false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Controller::Anticogging_t& anticogging = axes[i]->controller_.anticogging_;
+        Encoder::Config_t& encoder_config = axes[i]->encoder_.config_;
+        const uint8_t* data = anticogging.cogging_map ? (const uint8_t*)anticogging.cogging_map
+                                                      : (const uint8_t*)anticogging.binned_map;
+        if (!data || !(anticogging.map_dirty || anticogging.map_saved))
+            continue;
+        anticogging.map_saved = false;
+        anticogging.map_dirty = false;
+
+        CoggingMapHeader_t header = {
+            .magic = kCoggingMapMagic,
+            .cpr = (uint32_t)encoder_config.cpr,
+            .encoder_offset = encoder_config.offset,
+            .encoder_mode = (uint32_t)encoder_config.mode,
+            .num_bins = anticogging.cogging_map ? 0 : (uint32_t)anticogging.num_bins,
+            .crc16 = 0,
+        };
+        size_t data_size = cogging_map_data_size(header);
+        if (encoder_config.cpr <= 0 || sizeof(header) + data_size > kCoggingMapSlotSize)
+            continue;
+        header.crc16 = cogging_map_crc16(header, data);
+        // The header goes last so that an interrupted write leaves no valid slot
+        size_t slot = i * kCoggingMapSlotSize;
+        if (NVM_large_data_write(slot + sizeof(header), data, data_size)
+            || NVM_large_data_write(slot, (const uint8_t*)&header, sizeof(header)))
+            return false;
+        anticogging.map_saved = true;
+    }
+    return true;
+}
+
+// @brief Returns the map of the axis in flash if there is a valid one for
+// its current encoder setup. The CRC is checked in place.
+static const uint8_t* find_anticogging_map(Axis& axis, CoggingMapHeader_t* header) {
+    size_t axis_num = 0;
+    while (axis_num < AXIS_COUNT && axes[axis_num] != &axis)
+        ++axis_num;
+    Encoder::Config_t& encoder_config = axis.encoder_.config_;
+    if (axis_num >= AXIS_COUNT)
+        return nullptr;
+    // Without an index, an incremental encoder counts from an arbitrary
+    // position after every boot
+    if (encoder_config.mode == Encoder::MODE_INCREMENTAL
+            && !(encoder_config.use_index && encoder_config.pre_calibrated))
+        return nullptr;
+
+    const uint8_t* slot = (const uint8_t*)NVM_large_data() + axis_num * kCoggingMapSlotSize;
+    memcpy(header, slot, sizeof(*header));
+    if (header->magic != kCoggingMapMagic
+            || header->cpr != (uint32_t)encoder_config.cpr
+            || header->encoder_offset != encoder_config.offset
+            || header->encoder_mode != (uint32_t)encoder_config.mode
+            || sizeof(*header) + cogging_map_data_size(*header) > kCoggingMapSlotSize)
+        return nullptr;
+    const uint8_t* data = slot + sizeof(*header);
+    if (cogging_map_crc16(*header, data) != header->crc16)
+        return nullptr;
+    return data;
+}
+
+// @brief Makes the axis use its anti-cogging map in place in flash, without
+// a copy in RAM. The map must have the format that allocate_anticogging_map()
+// would allocate. It is copied into RAM before it is calibrated again, see
+// Controller::move_anticogging_map_to_ram().
+// @returns false if there is no such map, allocate and load one then
+bool reference_anticogging_map(Axis& axis) {
+    Controller::Anticogging_t& anticogging = axis.controller_.anticogging_;
+    CoggingMapHeader_t header;
+    const uint8_t* data = find_anticogging_map(axis, &header);
+    if (!data || header.num_bins != (uint32_t)axis.controller_.get_anticogging_num_bins()
+            || ((uintptr_t)data & 3))
+        return false;
+    if (header.num_bins == 0) {
+        anticogging.cogging_map = (float*)data;
+        anticogging.cogging_map_bytes = header.cpr * sizeof(float);
+    } else {
+        anticogging.binned_map = (int16_t*)data;
+        anticogging.num_bins = (int32_t)header.num_bins;
+        anticogging.binned_map_bytes = header.num_bins * sizeof(int16_t);
+    }
+    anticogging.map_in_flash = true;
+    anticogging.map_saved = true;
+    return true;
+}
 
+// @brief Loads the axis' anti-cogging map from flash if there is one for
+// its current encoder setup. The map must already be allocated.
+// A per-count map in flash can be loaded into a binned map, the average of
+// the counts of each bin is used then.
+bool load_anticogging_map(Axis& axis) {
+    Controller::Anticogging_t& anticogging = axis.controller_.anticogging_;
+    if (!(anticogging.cogging_map || anticogging.binned_map))
+        return false;
+    CoggingMapHeader_t header;
+    const uint8_t* data = find_anticogging_map(axis, &header);
+    if (!data)
+        return false;
+
+    if (anticogging.cogging_map && header.num_bins == 0) {
+        memcpy(anticogging.cogging_map, data, header.cpr * sizeof(float));
+        anticogging.map_saved = true;
+    } else if (anticogging.binned_map && header.num_bins == (uint32_t)anticogging.num_bins) {
+        memcpy(anticogging.binned_map, data, header.num_bins * sizeof(int16_t));
+        anticogging.map_saved = true;
+    } else if (anticogging.binned_map && header.num_bins == 0) {
+        // Fit the bins from the per-count map. The sector then no longer
+        // matches and is rewritten with the next save.
+        const float* map = (const float*)data;
+        const uint32_t num_bins = (uint32_t)anticogging.num_bins;
+        for (uint32_t bin = 0; bin < num_bins; ++bin) {
+            uint32_t begin = (bin * header.cpr) / num_bins;
+            uint32_t end = ((bin + 1) * header.cpr) / num_bins;
+            float sum = 0.0f;
+            for (uint32_t i = begin; i < end; ++i)
+                sum += map[i];
+            float mean = (end > begin) ? sum / (float)(end - begin) : 0.0f;
+            anticogging.binned_map[bin] = (int16_t)std::max(std::min(roundf(mean / Controller::kAnticoggingBinScale), 32767.0f), -32768.0f);
+        }
+        anticogging.map_dirty = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Every configuration object is a record of the NVM log, so that a save only
+// appends the objects that changed. The ID is (type << 8) | axis and must
+// stay the same across firmware versions.
+#define AXIS_CONFIG_RECORD(i, type, configs) { (type << 8) | i, &configs[i], sizeof(configs[i]) },
+#define AXIS_CONFIG_RECORDS(type, configs) FOR_EACH_AXIS(AXIS_CONFIG_RECORD, type, configs)
+static const ConfigRecord_t config_records[] = {
+    { 0x0000, &board_config, sizeof(board_config) },
+    AXIS_CONFIG_RECORDS(1, encoder_configs)
+    AXIS_CONFIG_RECORDS(2, sensorless_configs)
+    AXIS_CONFIG_RECORDS(3, controller_configs)
+    AXIS_CONFIG_RECORDS(4, motor_configs)
+    AXIS_CONFIG_RECORDS(5, trap_configs)
+    AXIS_CONFIG_RECORDS(6, axis_configs)
+    AXIS_CONFIG_RECORDS(7, fusion_configs)
+    { 0x0800, &gcode.config_, sizeof(gcode.config_) },
+};
+
+// Staging area of save_configuration_async(). The changed objects are copied
+// here in one go, so that the saved configuration is consistent, and then
+// written to flash in small pieces from the idle task.
+// Each entry is the record ID (uint16_t), the length (uint16_t) and the data.
+// The tags make the record data larger than the objects, by how much
+// depends on the field types, so the size is a generous estimate that is
+// checked when the save starts.
+static constexpr size_t kConfigObjectsSize = sizeof(board_config) + sizeof(encoder_configs)
+        + sizeof(sensorless_configs) + sizeof(controller_configs) + sizeof(motor_configs)
+        + sizeof(trap_configs) + sizeof(axis_configs) + sizeof(fusion_configs) + sizeof(gcode.config_);
+static constexpr size_t kConfigStagingSize = 3 * kConfigObjectsSize
+        + (sizeof(config_records) / sizeof(config_records[0])) * 10;
+static constexpr size_t kConfigWriteChunk = 32; // [bytes] written per tick, multiple of 4
+static uint8_t config_staging_[kConfigStagingSize] CCM_DATA;
+static size_t config_staging_length_ = 0;
+static size_t config_staging_offset_ = 0; // entry that is being written
+static size_t config_record_offset_ = 0;  // [bytes] of its data written so far
+static uint32_t config_save_tick_ = 0;
+volatile ConfigSaveState_t config_save_state_ = CONFIG_SAVE_STATE_IDLE;
+static uint32_t config_records_to_migrate_ = 0; // bit mask of config_records
+bool config_migrated_ = false;
+
+// Writes the serialized record data to the staging area
+class ConfigStagingSink : public ConfigRecordSink {
+public:
+    ConfigStagingSink(uint8_t* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {}
+    bool write(size_t offset, const uint8_t* data, size_t length) override {
+        if (offset + length > capacity_)
+            return false;
+        memcpy(buffer_ + offset, data, length);
+        return true;
+    }
+private:
+    uint8_t* buffer_;
+    size_t capacity_;
+};
+
+// @brief The synchronous NVM functions must not interleave with an
+// asynchronous save, so they wait for it to finish.
+static void wait_for_async_save() {
+    while (config_save_state_ == CONFIG_SAVE_STATE_WRITING)
+        osDelay(1);
+}
+
+// @brief Starts saving the changed configuration objects without stopping
+// the motors.
+//
+// Unlike save_configuration(), this never erases flash. Programming stalls
+// flash reads for a few microseconds per word, which the control loop
+// tolerates, but an erase would stall the interrupt vector table and the
+// control code for seconds. So this fails if the NVM log has no room for
+// the changed objects and must be compacted, or if an anti-cogging map has
+// to be saved. Use save_configuration() with the motors idle in that case.
+//
+// The progress is in config_save_state_.
+// @returns false if the save could not be started
+bool save_configuration_async(void) {
+    if (config_save_state_ == CONFIG_SAVE_STATE_WRITING)
+        return false;
+    bool maps_dirty = false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        maps_dirty = maps_dirty || axes[i]->controller_.anticogging_.map_dirty;
+
+    size_t length = 0;
+    size_t needed = 0; // [bytes] in the log
+    bool fits = true;
+    for (const ConfigRecord_t& record : config_records) {
+        if (record.is_stored())
+            continue;
+        uint16_t header[2];
+        if (length + sizeof(header) > kConfigStagingSize) {
+            fits = false;
+            break;
+        }
+        ConfigStagingSink sink(&config_staging_[length + sizeof(header)], kConfigStagingSize - length - sizeof(header));
+        size_t record_length = record.serialize((const uint8_t *)record.object, &sink);
+        if (!record_length) {
+            fits = false;
+            break;
+        }
+        header[0] = record.id;
+        header[1] = (uint16_t)record_length;
+        memcpy(&config_staging_[length], header, sizeof(header));
+        length += sizeof(header) + record_length;
+        needed += NVM_log_record_size(record_length);
+    }
+    if (maps_dirty || !fits || needed > NVM_log_free_space()) {
+        config_save_state_ = CONFIG_SAVE_STATE_FAILED;
+        return false;
+    }
+    config_staging_length_ = length;
+    config_staging_offset_ = 0;
+    config_record_offset_ = 0;
+    if (length) {
+        config_save_state_ = CONFIG_SAVE_STATE_WRITING;
+    } else {
+        config_save_state_ = CONFIG_SAVE_STATE_DONE; // nothing changed
+    }
+    return true;
+}
+
+// @brief Writes the next piece of an asynchronous save.
+// This is called from the idle hook and writes at most one piece per tick.
+static void config_save_step(void) {
+    if (config_save_state_ != CONFIG_SAVE_STATE_WRITING)
+        return;
+    uint32_t tick = osKernelSysTick();
+    if (tick == config_save_tick_)
+        return;
+    config_save_tick_ = tick;
+
+    uint16_t header[2];
+    memcpy(header, &config_staging_[config_staging_offset_], sizeof(header));
+    const uint8_t* data = &config_staging_[config_staging_offset_ + sizeof(header)];
+    size_t length = std::min(kConfigWriteChunk, header[1] - config_record_offset_);
+    if ((config_record_offset_ == 0 && NVM_log_start_append(header[0], header[1]))
+            || NVM_log_write(config_record_offset_, data + config_record_offset_, length)) {
+        NVM_log_init(); // forget the open record, its fields stay invalid
+        config_save_state_ = CONFIG_SAVE_STATE_FAILED;
+        return;
+    }
+    config_record_offset_ += length;
+    if (config_record_offset_ < header[1])
+        return;
+
+    if (NVM_log_commit()) {
+        NVM_log_init();
+        config_save_state_ = CONFIG_SAVE_STATE_FAILED;
+        return;
+    }
+    config_staging_offset_ += sizeof(header) + header[1];
+    config_record_offset_ = 0;
+    if (config_staging_offset_ >= config_staging_length_) {
+        user_config_loaded_ = true;
+        config_save_state_ = CONFIG_SAVE_STATE_DONE;
+    }
+}
+
+// @brief Saves the configuration objects that changed since the last save.
+// If the NVM log is full (or there is none yet), all objects are written to
+// the other sector instead, which erases flash.
 void save_configuration(void) {
-    if (ConfigFormat::safe_store_config(
-            &board_config,
-            &encoder_configs,
-            &sensorless_configs,
-            &controller_configs,
-            &motor_configs,
-            &trap_configs,
-            &axis_configs)) {
-        //printf("saving configuration failed\r\n"); osDelay(5);
+    wait_for_async_save();
+    CycleLogActivity activity(CycleLog::ACTIVITY_NVM_WRITE);
+    save_anticogging_maps();
+
+    size_t needed = 0; // [bytes] in the log
+    for (const ConfigRecord_t& record : config_records) {
+        if (!record.is_stored())
+            needed += NVM_log_record_size(record.length());
+    }
+
+    bool ok = true;
+    if (needed <= NVM_log_free_space()) {
+        for (const ConfigRecord_t& record : config_records) {
+            if (!record.is_stored())
+                ok = ok && !record.store((const uint8_t *)record.object);
+        }
     } else {
+        ok = !NVM_log_start_compaction();
+        for (const ConfigRecord_t& record : config_records)
+            ok = ok && !record.store((const uint8_t *)record.object);
+        ok = ok && !NVM_log_finish_compaction();
+    }
+
+    if (ok) {
         user_config_loaded_ = true;
+    } else {
+        NVM_log_init(); // back to the last complete state
+        //printf("saving configuration failed\r\n"); osDelay(5);
+    }
+}
+
+static void load_default_configuration(void) {
+    board_config = BoardConfig_t();
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        encoder_configs[i] = Encoder::Config_t();
+        sensorless_configs[i] = SensorlessEstimator::Config_t();
+        controller_configs[i] = Controller::Config_t();
+        motor_configs[i] = Motor::Config_t();
+        trap_configs[i] = TrapezoidalTrajectory::Config_t();
+        axis_configs[i] = Axis::Config_t();
+        axis_configs[i].can_node_id = i; // the axes must not share a CAN node ID
+        fusion_configs[i] = FusionEstimator::Config_t();
     }
+    gcode.config_ = Gcode::Config_t();
 }
 
 void load_configuration(void) {
-    // Try to load configs
-    if (NVM_init() ||
+    if (!NVM_log_init()) {
+        // Objects without a valid record keep their defaults. Records of a
+        // different config_version are migrated once the tree is published.
+        load_default_configuration();
+        config_records_to_migrate_ = 0;
+        for (size_t i = 0; i < sizeof(config_records) / sizeof(config_records[0]); ++i) {
+            if (!config_records[i].load())
+                config_records_to_migrate_ |= 1UL << i;
+        }
+        user_config_loaded_ = true;
+    } else if (NVM_init() ||
         ConfigFormat::safe_load_config(
                 &board_config,
                 &encoder_configs,
@@ -55,23 +427,50 @@ void load_configuration(void) {
                 &controller_configs,
                 &motor_configs,
                 &trap_configs,
-                &axis_configs)) {
-        //If loading failed, restore defaults
-        board_config = BoardConfig_t();
-        for (size_t i = 0; i < AXIS_COUNT; ++i) {
-            encoder_configs[i] = Encoder::Config_t();
-            sensorless_configs[i] = SensorlessEstimator::Config_t();
-            controller_configs[i] = Controller::Config_t();
-            motor_configs[i] = Motor::Config_t();
-            trap_configs[i] = TrapezoidalTrajectory::Config_t();
-            axis_configs[i] = Axis::Config_t();
-        }
+                &axis_configs,
+                &fusion_configs)) {
+        // Neither a log nor a block of an older firmware, restore defaults
+        load_default_configuration();
     } else {
+        // A block of an older firmware, the next save converts it to a log
         user_config_loaded_ = true;
     }
 }
 
+// @brief Migrates board_config right after load_configuration().
+// The boot reads board_config long before the object tree is published, so
+// it can't wait for migrate_configuration(). It is the first record.
+static void migrate_board_configuration(void) {
+    if ((config_records_to_migrate_ & 1) && config_records[0].migrate(for_each_board_config_field))
+        config_migrated_ = true;
+    config_records_to_migrate_ &= ~1UL;
+}
+
+// @brief Loads the objects that load_configuration() could not load as a
+// whole from the tagged fields of their records.
+//
+// This runs in the communication thread right after the object tree is
+// published, before the axes are set up. The components are constructed by
+// then, so everything they derive from their configuration is recalculated.
+// The migrated objects are written in the current format with the next
+// save_configuration().
+void migrate_configuration(void) {
+    static_assert(sizeof(config_records) / sizeof(config_records[0]) <= 32, "too many config records");
+    bool migrated = false;
+    for (size_t i = 0; i < sizeof(config_records) / sizeof(config_records[0]); ++i) {
+        if ((config_records_to_migrate_ & (1UL << i)) && config_records[i].migrate())
+            migrated = true;
+    }
+    config_records_to_migrate_ = 0;
+    if (migrated) {
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            axes[i]->update_derived_values();
+        config_migrated_ = true;
+    }
+}
+
 void erase_configuration(void) {
+    wait_for_async_save();
     NVM_erase();
 }
 
@@ -93,6 +492,16 @@ void enter_dfu_mode() {
     }
 }
 
+// Constructs an object in CCM RAM, or on the heap if CCM is exhausted.
+// Only for objects that are never deleted.
+template<typename T, typename ... TArgs>
+static T* new_in_ccm(TArgs&& ... args) {
+    void* mem = ccm_alloc(sizeof(T));
+    if (mem)
+        return new (mem) T(std::forward<TArgs>(args)...);
+    return new T(std::forward<TArgs>(args)...);
+}
+
 extern "C" {
 int odrive_main(void);
 void vApplicationStackOverflowHook(void) {
@@ -101,21 +510,64 @@ void vApplicationStackOverflowHook(void) {
 void vApplicationIdleHook(void) {
     if (system_stats_.fully_booted) {
         system_stats_.uptime = xTaskGetTickCount();
+        micros64(); // keeps counting the millisecond tick wraps
         system_stats_.min_heap_space = xPortGetMinimumEverFreeHeapSize();
         system_stats_.min_stack_space_comms = uxTaskGetStackHighWaterMark(comm_thread) * sizeof(StackType_t);
-        system_stats_.min_stack_space_axis0 = uxTaskGetStackHighWaterMark(axes[0]->thread_id_) * sizeof(StackType_t);
-        system_stats_.min_stack_space_axis1 = uxTaskGetStackHighWaterMark(axes[1]->thread_id_) * sizeof(StackType_t);
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            system_stats_.min_stack_space_axes[i] = uxTaskGetStackHighWaterMark(axes[i]->thread_id_) * sizeof(StackType_t);
         system_stats_.min_stack_space_usb = uxTaskGetStackHighWaterMark(usb_thread) * sizeof(StackType_t);
+        if (usb_cdc_thread)
+            system_stats_.min_stack_space_usb_cdc = uxTaskGetStackHighWaterMark(usb_cdc_thread) * sizeof(StackType_t);
         system_stats_.min_stack_space_uart = uxTaskGetStackHighWaterMark(uart_thread) * sizeof(StackType_t);
         system_stats_.min_stack_space_usb_irq = uxTaskGetStackHighWaterMark(usb_irq_thread) * sizeof(StackType_t);
         system_stats_.min_stack_space_startup = uxTaskGetStackHighWaterMark(defaultTaskHandle) * sizeof(StackType_t);
+        if (log_thread)
+            system_stats_.min_stack_space_log = uxTaskGetStackHighWaterMark(log_thread) * sizeof(StackType_t);
+        system_stats_.ccm_pool_free = ccm_bytes_free();
+        system_stats_.table_pool_free = table_pool_bytes_free();
+        system_stats_.table_heap_used = table_heap_bytes_used();
+        system_stats_.table_alloc_failures = table_alloc_failure_count();
+        cpu_load.update();
     }
+    trace.drain_itm();
+    config_save_step();
+}
 }
+
+static int32_t get_thread_priority(osThreadId thread) {
+    return thread ? osThreadGetPriority(thread) : osPriorityError;
+}
+
+// @brief Reads back the priorities that are actually in effect, so that
+// deviations from priorities.h (e.g. by regenerated CubeMX code) show up.
+static void read_priorities() {
+    system_stats_.priorities.pwm_timer = NVIC_GetPriority(TIM8_UP_TIM13_IRQn);
+    system_stats_.priorities.encoder_spi = NVIC_GetPriority(DMA1_Stream0_IRQn);
+    system_stats_.priorities.current_sense = NVIC_GetPriority(ADC_IRQn);
+    system_stats_.priorities.pwm_input = NVIC_GetPriority(TIM5_IRQn);
+    system_stats_.priorities.usb = NVIC_GetPriority(OTG_FS_IRQn);
+    system_stats_.priorities.can = NVIC_GetPriority(CAN1_RX0_IRQn);
+    system_stats_.priorities.uart = NVIC_GetPriority(UART4_IRQn);
+    system_stats_.priorities.i2c = NVIC_GetPriority(I2C1_EV_IRQn);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        system_stats_.priorities.thread_axes[i] = get_thread_priority(axes[i]->thread_id_);
+    system_stats_.priorities.thread_usb_irq = get_thread_priority(usb_irq_thread);
+    system_stats_.priorities.thread_comms = get_thread_priority(comm_thread);
+    system_stats_.priorities.thread_usb = get_thread_priority(usb_thread);
+    system_stats_.priorities.thread_usb_cdc = get_thread_priority(usb_cdc_thread);
+    system_stats_.priorities.thread_uart = get_thread_priority(uart_thread);
+    system_stats_.priorities.thread_log = get_thread_priority(log_thread);
 }
 
 int odrive_main(void) {
+    profiler.init();
+    fast_sincos_init();
+
     // Load persistent configuration (or defaults)
     load_configuration();
+    migrate_board_configuration();
+    // Everything that depends on the control loop rate must come after this
+    init_pwm_timing();
 
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
     if (board_config.enable_i2c_instead_of_can) {
@@ -159,17 +611,19 @@ int odrive_main(void) {
 #endif
 
     // Construct all objects.
+    // They are accessed from the current measurement interrupt, so they go into CCM RAM.
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
-        Encoder *encoder = new Encoder(hw_configs[i].encoder_config,
+        Encoder *encoder = new_in_ccm<Encoder>(hw_configs[i].encoder_config,
                                        encoder_configs[i]);
-        SensorlessEstimator *sensorless_estimator = new SensorlessEstimator(sensorless_configs[i]);
-        Controller *controller = new Controller(controller_configs[i]);
-        Motor *motor = new Motor(hw_configs[i].motor_config,
+        SensorlessEstimator *sensorless_estimator = new_in_ccm<SensorlessEstimator>(sensorless_configs[i]);
+        Controller *controller = new_in_ccm<Controller>(controller_configs[i]);
+        Motor *motor = new_in_ccm<Motor>(hw_configs[i].motor_config,
                                  hw_configs[i].gate_driver_config,
                                  motor_configs[i]);
-        TrapezoidalTrajectory *trap = new TrapezoidalTrajectory(trap_configs[i]);
-        axes[i] = new Axis(hw_configs[i].axis_config, axis_configs[i],
-                *encoder, *sensorless_estimator, *controller, *motor, *trap);
+        TrapezoidalTrajectory *trap = new_in_ccm<TrapezoidalTrajectory>(trap_configs[i]);
+        FusionEstimator *fusion_estimator = new_in_ccm<FusionEstimator>(fusion_configs[i]);
+        axes[i] = new_in_ccm<Axis>(hw_configs[i].axis_config, axis_configs[i],
+                *encoder, *sensorless_estimator, *controller, *motor, *trap, *fusion_estimator);
     }
     
     // Start ADC for temperature measurements and user measurements
@@ -196,6 +650,7 @@ int odrive_main(void) {
         axes[i]->setup();
     }
 
+    gate_driver_poll_init();
     // Start PWM and enable adc interrupts/callbacks
     start_adc_pwm();
 
@@ -204,16 +659,28 @@ int odrive_main(void) {
     //    sense interrupts are firing in background by now)
     //  - Allow a user to interrupt the code, e.g. by flashing a new code,
     //    before it does anything crazy
-    // TODO make timing a function of calibration filter tau
-    osDelay(1500);
+    // With fast_boot, the axes start as soon as the offsets of all motors
+    // have converged (one motor.config.dc_calib_tau, see pwm_trig_adc_cb),
+    // but no later than after the normal delay.
+    uint32_t boot_start = HAL_GetTick();
+    while (HAL_GetTick() - boot_start < 1500) {
+        bool all_converged = true;
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            all_converged = all_converged && axes[i]->motor_.DC_calib_converged_;
+        if (board_config.fast_boot && all_converged)
+            break;
+        osDelay(10);
+    }
 
     // Start state machine threads. Each thread will go through various calibration
     // procedures and then run the actual controller loops.
-    // TODO: generalize for AXIS_COUNT != 2
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
         axes[i]->start_thread();
     }
 
+    read_priorities();
+    system_stats_.total_stack_space = STACK_SIZE_TOTAL * sizeof(StackType_t);
+    system_stats_.boot_time = HAL_GetTick();
     system_stats_.fully_booted = true;
     return 0;
 }
@@ -37,6 +37,11 @@ bool Motor::arm() {
     // Reset controller states, integrators, setpoints, etc.
     axis_->controller_.reset();
     reset_current_control();
+    switch (config_.motor_type) {
+        case MOTOR_TYPE_HIGH_CURRENT: update_fn_ = &Motor::update_motor_type<MOTOR_TYPE_HIGH_CURRENT>; break;
+        case MOTOR_TYPE_GIMBAL: update_fn_ = &Motor::update_motor_type<MOTOR_TYPE_GIMBAL>; break;
+        default: update_fn_ = &Motor::update_unsupported_motor_type; break;
+    }
 
     // Wait until the interrupt handler triggers twice. This gives
     // the control loop the correct time quota to set up modulation timings.
@@ -50,6 +55,15 @@ bool Motor::arm() {
 void Motor::reset_current_control() {
     current_control_.v_current_control_integral_d = 0.0f;
     current_control_.v_current_control_integral_q = 0.0f;
+    current_control_.fw_Id = 0.0f;
+    dpwm_active_ = false;
+    dpwm_hold_count_ = 0;
+}
+
+// @brief Updates the values of other components that are derived from the pole pair count.
+void Motor::update_pole_pairs() {
+    if (axis_)
+        axis_->encoder_.update_elec_rad_per_enc();
 }
 
 // @brief Tune the current controller based on phase resistance and inductance
@@ -60,6 +74,9 @@ void Motor::update_current_controller_gains() {
     current_control_.p_gain = config_.current_control_bandwidth * config_.phase_inductance;
     float plant_pole = config_.phase_resistance / config_.phase_inductance;
     current_control_.i_gain = plant_pole * current_control_.p_gain;
+    // first order approximation of exp(-dt/tau), dt << tau
+    float decay_time = config_.current_integrator_decay_time;
+    current_control_.integral_decay = (decay_time > 0.0f) ? std::max(1.0f - current_meas_period / decay_time, 0.0f) : 1.0f;
 }
 
 // @brief Set up the gate drivers
@@ -117,20 +134,117 @@ void Motor::DRV8301_setup() {
 }
 
 // @brief Checks if the gate driver is in operational state.
+// drv_fault_ tells the type of the fault. It is decoded from the status
+// registers by the background poller, so this doesn't block on the SPI bus.
+// Without the poller (see gate_driver_poll_init), the fault is read here.
 // @returns: true if the gate driver is OK (no fault), false otherwise
 bool Motor::check_DRV_fault() {
     //TODO: make this pin configurable per motor ch
     GPIO_PinState nFAULT_state = HAL_GPIO_ReadPin(gate_driver_config_.nFAULT_port, gate_driver_config_.nFAULT_pin);
-    if (nFAULT_state == GPIO_PIN_RESET) {
-        // Update DRV Fault Code
+    if (nFAULT_state != GPIO_PIN_RESET)
+        return true;
+    if (!gate_driver_config_.spi->hdmarx)
         drv_fault_ = DRV8301_getFaultType(&gate_driver_);
-        // Update/Cache all SPI device registers
-        // DRV_SPI_8301_Vars_t* local_regs = &gate_driver_regs_;
-        // local_regs->RcvCmd = true;
-        // DRV8301_readData(&gate_driver_, local_regs);
-        return false;
-    };
-    return true;
+    return false;
+}
+
+// The gate driver registers of both motors are read in the background, one
+// SPI frame per PWM period, so that neither the fault check nor fibre reads
+// have to wait for the bus. The DRV8301 answers a read command in the next
+// frame, so a sweep over the four registers of one gate driver takes five
+// frames. As for the absolute SPI encoders, the DMA buffers can't live in
+// CCM RAM with the Motor objects.
+static const DRV8301_RegName_e gate_driver_poll_reg_names[] = {
+    DRV8301_RegName_Status_1, DRV8301_RegName_Status_2,
+    DRV8301_RegName_Control_1, DRV8301_RegName_Control_2
+};
+static const size_t gate_driver_poll_frames = 5;
+static const uint32_t gate_driver_poll_interval_ms = 5; // between the start of two sweeps over all gate drivers
+static uint16_t gate_driver_poll_dma_tx = 0;
+static uint16_t gate_driver_poll_dma_rx = 0;
+static Motor* gate_driver_poll_active_motor = nullptr;
+static size_t gate_driver_poll_axis = 0;
+static size_t gate_driver_poll_frame = 0;
+static uint32_t gate_driver_poll_wait = 0; // [PWM periods] until the next sweep
+
+// @brief Links the SPI3 DMA streams that the register poller uses.
+// The RX stream is shared with I2C1, so with I2C the poller stays off and
+// check_DRV_fault() reads the fault type on demand instead.
+void gate_driver_poll_init() {
+    if (!board_config.enable_i2c_instead_of_can && !hspi3.hdmarx)
+        MX_SPI3_DMA_Init();
+}
+
+// @brief Starts the next frame of the gate driver register poller.
+// Called from the TIM1 update interrupt while counting up, a quarter PWM
+// period away from the absolute SPI encoder reads, which use the same bus.
+void gate_driver_poll_start_frame() {
+    if (gate_driver_poll_active_motor)
+        return; // the last frame hasn't completed yet
+    if (gate_driver_poll_frame == 0 && gate_driver_poll_axis == 0) {
+        if (gate_driver_poll_wait > 0) {
+            gate_driver_poll_wait--;
+            return;
+        }
+        gate_driver_poll_wait = (uint32_t)current_meas_hz * gate_driver_poll_interval_ms / 1000;
+    }
+    Motor& motor = axes[gate_driver_poll_axis]->motor_;
+    SPI_HandleTypeDef* spi = motor.gate_driver_config_.spi;
+    if (!spi->hdmarx || !spi->hdmatx)
+        return; // no DMA, see gate_driver_poll_init
+    if (spi->State != HAL_SPI_STATE_READY)
+        return; // retry in the next period
+    // The last frame only clocks out the answer to the one before
+    DRV8301_RegName_e reg_name = gate_driver_poll_reg_names[std::min(gate_driver_poll_frame, (size_t)3)];
+    gate_driver_poll_dma_tx = (uint16_t)DRV8301_buildCtrlWord(DRV8301_CtrlMode_Read, reg_name, 0);
+    gate_driver_poll_active_motor = &motor;
+    HAL_GPIO_WritePin(motor.gate_driver_config_.nCS_port, motor.gate_driver_config_.nCS_pin, GPIO_PIN_RESET);
+    if (HAL_SPI_TransmitReceive_DMA(spi, (uint8_t*)&gate_driver_poll_dma_tx, (uint8_t*)&gate_driver_poll_dma_rx, 1) != HAL_OK) {
+        HAL_GPIO_WritePin(motor.gate_driver_config_.nCS_port, motor.gate_driver_config_.nCS_pin, GPIO_PIN_SET);
+        gate_driver_poll_active_motor = nullptr;
+        motor.gate_driver_poll_error_count_++;
+    }
+}
+
+// @brief Finishes a frame started by gate_driver_poll_start_frame.
+// Called from the SPI DMA complete or error interrupt. Once a sweep is
+// complete, the register values are published to gate_driver_regs_ and
+// a fault found in the status registers is recorded in drv_fault_.
+void Motor::gate_driver_poll_cb() {
+    HAL_GPIO_WritePin(gate_driver_config_.nCS_port, gate_driver_config_.nCS_pin, GPIO_PIN_SET);
+    if (gate_driver_config_.spi->ErrorCode != HAL_SPI_ERROR_NONE) {
+        gate_driver_poll_error_count_++;
+        gate_driver_poll_frame = 0; // start over with the first register
+        return;
+    }
+    if (gate_driver_poll_frame > 0)
+        gate_driver_poll_regs_[gate_driver_poll_frame - 1] = gate_driver_poll_dma_rx & DRV8301_DATA_MASK;
+    if (++gate_driver_poll_frame < gate_driver_poll_frames)
+        return;
+
+    gate_driver_regs_.Stat_Reg_1_Value = gate_driver_poll_regs_[0];
+    gate_driver_regs_.Stat_Reg_2_Value = gate_driver_poll_regs_[1];
+    gate_driver_regs_.Ctrl_Reg_1_Value = gate_driver_poll_regs_[2];
+    gate_driver_regs_.Ctrl_Reg_2_Value = gate_driver_poll_regs_[3];
+    gate_driver_poll_count_++;
+    // Same decoding as DRV8301_getFaultType
+    if (gate_driver_poll_regs_[0] & DRV8301_STATUS1_FAULT_BITS) {
+        DRV8301_FaultType_e fault = (DRV8301_FaultType_e)(gate_driver_poll_regs_[0] & DRV8301_FAULT_TYPE_MASK);
+        if (fault == DRV8301_FaultType_NoFault && (gate_driver_poll_regs_[1] & DRV8301_STATUS2_GVDD_OV_BITS))
+            fault = DRV8301_FaultType_GVDD_OV;
+        if (fault != DRV8301_FaultType_NoFault)
+            drv_fault_ = fault;
+    }
+    gate_driver_poll_frame = 0;
+    gate_driver_poll_axis = (gate_driver_poll_axis + 1) % AXIS_COUNT;
+}
+
+// @brief Dispatches the SPI DMA complete callback to the motor whose gate driver is being read.
+void gate_driver_poll_dispatch_cb(SPI_HandleTypeDef* hspi) {
+    Motor* motor = gate_driver_poll_active_motor;
+    gate_driver_poll_active_motor = nullptr;
+    if (motor && motor->gate_driver_config_.spi == hspi)
+        motor->gate_driver_poll_cb();
 }
 
 void Motor::set_error(Motor::Error_t error){
@@ -143,26 +257,112 @@ bool Motor::do_checks() {
         set_error(ERROR_DRV_FAULT);
         return false;
     }
+    return update_thermal_model();
+}
+
+// @brief Advances the FET and winding thermal models to the latest current
+// measurement and updates the derated current limit.
+// Returns false on over temperature if the derating is enabled.
+bool Motor::update_thermal_model() {
+    uint64_t meas_count = axis_->get_meas_count();
+    float dt = (float)(meas_count - thermal_meas_count_) * current_meas_period;
+    thermal_meas_count_ = meas_count;
+
+    float I_sq = 0.0f;
+    if (armed_state_ == ARMED_STATE_ARMED) {
+        I_sq = SQ(current_control_.Id_measured) + SQ(current_control_.Iq_measured);
+    } else {
+        // No current control updates reach the power accounting
+        power_.electrical = power_.mechanical = power_.loss = 0.0f;
+    }
+    float thermistor_temp = axis_->get_temp();
+    // Copper losses are 3/2 * R * I^2 with the amplitude invariant Clarke transform
+    float motor_coeff = 1.5f * config_.phase_resistance * config_.motor_thermal_resistance;
+    fet_thermal_model_.update(I_sq, config_.fet_thermal_coeff, config_.fet_thermal_tau, dt);
+    motor_thermal_model_.update(I_sq, motor_coeff, config_.motor_thermal_tau, dt);
+
+    thermal_.fet_temp = thermistor_temp + fet_thermal_model_.rise_;
+    thermal_.motor_temp = config_.ambient_temp + motor_thermal_model_.rise_;
+    thermal_.current_lim = std::min(
+        fet_thermal_model_.sustainable_current(thermistor_temp, config_.fet_temp_limit,
+            config_.fet_thermal_coeff, config_.fet_thermal_tau, config_.thermal_horizon),
+        motor_thermal_model_.sustainable_current(config_.ambient_temp, config_.motor_temp_limit,
+            motor_coeff, config_.motor_thermal_tau, config_.thermal_horizon));
+
+    if (config_.enable_thermal_derating
+            && (!(thermal_.fet_temp <= config_.fet_temp_trip) || !(thermal_.motor_temp <= config_.motor_temp_trip))) {
+        set_error(ERROR_OVER_TEMP);
+        return false;
+    }
     return true;
 }
 
-void Motor::log_timing(TimingLog_t log_idx) {
+// @brief Adds one current control update to the power accounting.
+// @param electrical_power: [W] drawn from the DC bus
+// @param I_sq: [A^2] squared magnitude of the measured current
+//
+// The sums are taken over config_.power_window and then added to the
+// energy totals, so that the small increments of a single update don't get
+// lost in the resolution of a large total.
+void Motor::accumulate_power(float electrical_power, float I_sq) {
+    power_sums_.electrical += electrical_power;
+    // Copper losses are 3/2 * R * I^2 with the amplitude invariant Clarke transform
+    power_sums_.loss += (1.5f * config_.phase_resistance) * I_sq;
+    if ((float)(++power_sums_.count) < config_.power_window * (float)current_meas_hz)
+        return;
+    float scale = 1.0f / (float)power_sums_.count;
+    power_.electrical = power_sums_.electrical * scale;
+    power_.loss = power_sums_.loss * scale;
+    power_.mechanical = power_.electrical - power_.loss;
+    float duration = (float)power_sums_.count * current_meas_period;
+    power_.electrical_energy += power_.electrical * duration;
+    power_.loss_energy += power_.loss * duration;
+    power_.mechanical_energy += power_.mechanical * duration;
+    power_sums_ = { 0.0f, 0.0f, 0 };
+}
+
+// @brief Returns the position within the current PWM cycle in [0, 2*tim_1_8_period_clocks).
+// 0 corresponds to the start of the up-counting half period of the motor's timer.
+uint16_t Motor::get_pwm_timing() {
     TIM_HandleTypeDef* htim = hw_config_.timer;
     uint16_t timing = htim->Instance->CNT;
     bool down = htim->Instance->CR1 & TIM_CR1_DIR;
     if (down) {
-        uint16_t delta = TIM_1_8_PERIOD_CLOCKS - timing;
-        timing = TIM_1_8_PERIOD_CLOCKS + delta;
+        uint16_t delta = tim_1_8_period_clocks - timing;
+        timing = tim_1_8_period_clocks + delta;
     }
+    return timing;
+}
+
+void Motor::log_timing(TimingLog_t log_idx) {
+    uint16_t timing = get_pwm_timing();
 
     if (log_idx < TIMING_LOG_NUM_SLOTS) {
         timing_log_[log_idx] = timing;
     }
 }
 
-float Motor::phase_current_from_adcval(uint32_t ADCValue) {
-    int adcval_bal = (int)ADCValue - (1 << 11);
-    float amp_out_volt = (3.3f / (float)(1 << 12)) * (float)adcval_bal;
+// @brief Updates the execution time statistics of one control loop rate.
+// @param start_timing: value of get_pwm_timing() when the loop started
+void Motor::log_loop_timing(LoopTiming_t& loop_timing, uint16_t start_timing) {
+    int32_t duration = (int32_t)get_pwm_timing() - (int32_t)start_timing;
+    if (duration < 0)
+        duration += 2 * tim_1_8_period_clocks; // wrapped into the next PWM cycle
+    loop_timing.count++;
+    loop_timing.last = (uint16_t)duration;
+    if (loop_timing.last > loop_timing.max)
+        loop_timing.max = loop_timing.last;
+}
+
+void Motor::reset_loop_timing() {
+    current_loop_timing_ = { 0 };
+    vel_loop_timing_ = { 0 };
+    pos_loop_timing_ = { 0 };
+}
+
+float Motor::phase_current_from_adcval(float ADCValue) {
+    float adcval_bal = ADCValue - (float)(1 << 11);
+    float amp_out_volt = (3.3f / (float)(1 << 12)) * adcval_bal;
     float shunt_volt = amp_out_volt * phase_current_rev_gain_;
     float current = shunt_volt * hw_config_.shunt_conductance;
     return current;
@@ -173,12 +373,19 @@ float Motor::phase_current_from_adcval(uint32_t ADCValue) {
 //--------------------------------
 
 // TODO check Ibeta balance to verify good motor connection
-bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
+// @brief Regulates a DC current along phase A and returns the voltage that was needed
+// @param duration: [s] maximum test duration. If config_.calibration_tolerance
+//                  is set, the test ends early once the voltage has settled.
+// @param num_cycles: set to the number of control cycles that were used
+bool Motor::measure_dc_voltage(float test_current, float max_voltage, float duration, float* voltage, uint32_t* num_cycles) {
     static const float kI = 10.0f;                                 // [(V/s)/A]
-    static const int num_test_cycles = static_cast<int>(3.0f / CURRENT_MEAS_PERIOD); // Test runs for 3s
+    const uint32_t num_test_cycles = static_cast<uint32_t>(duration / current_meas_period);
+    // Convergence is judged by the voltage change over a window
+    const uint32_t window = std::max(static_cast<uint32_t>(0.05f / current_meas_period), (uint32_t)1);
     float test_voltage = 0.0f;
+    float window_start_voltage = 0.0f;
     
-    size_t i = 0;
+    uint32_t i = 0;
     axis_->run_control_loop([&](){
         float Ialpha = -(current_meas_.phB + current_meas_.phC);
         test_voltage += (kI * current_meas_period) * (test_current - Ialpha);
@@ -190,8 +397,16 @@ bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
             return false; // error set inside enqueue_voltage_timings
         log_timing(TIMING_LOG_MEAS_R);
 
-        return ++i < num_test_cycles;
+        if (++i % window == 0) {
+            bool converged = config_.calibration_tolerance > 0.0f && i >= 2 * window
+                && fabsf(test_voltage - window_start_voltage) <= config_.calibration_tolerance * fabsf(test_voltage);
+            window_start_voltage = test_voltage;
+            if (converged)
+                return false;
+        }
+        return i < num_test_cycles;
     });
+    *num_cycles = i;
     if (axis_->error_ != Axis::ERROR_NONE)
         return false;
 
@@ -199,17 +414,113 @@ bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
     //if (!enqueue_voltage_timings(motor, 0.0f, 0.0f))
     //    return false; // error set inside enqueue_voltage_timings
 
+    *voltage = test_voltage;
+    return true; // if we ran to completion that means success
+}
+
+bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
+    float test_voltage;
+    if (!measure_dc_voltage(test_current, max_voltage, 3.0f, &test_voltage, &calibration_cycles_.resistance)) // Test runs for up to 3s
+        return false;
     float R = test_voltage / test_current;
     config_.phase_resistance = R;
-    return true; // if we ran to completion that means success
+    return true;
+}
+
+// @brief Measures the phase resistance with a PI current loop along phase A.
+// This settles within a few ms, as opposed to the pure integrator in
+// measure_phase_resistance, but requires config_.phase_inductance to be known.
+// @param bandwidth: [rad/s] crossover frequency of the current loop
+bool Motor::measure_phase_resistance_fast(float test_current, float max_voltage, float bandwidth) {
+    // The PI zero sits a decade below the crossover, so the loop is stable
+    // for any resistance and settles with a time constant of about 10/bandwidth
+    const float p_gain = bandwidth * config_.phase_inductance;   // [V/A]
+    const float i_gain = 0.1f * bandwidth * p_gain;              // [V/As]
+    const int num_settle_cycles = static_cast<int>((50.0f / bandwidth) / current_meas_period);
+    const int num_test_cycles = num_settle_cycles + static_cast<int>(0.1f / current_meas_period);
+
+    float integral = 0.0f;
+    float V_sum = 0.0f;
+    float I_sum = 0.0f;
+    int i = 0;
+    axis_->run_control_loop([&](){
+        float Ialpha = -(current_meas_.phB + current_meas_.phC);
+        float Ierr = test_current - Ialpha;
+        integral += Ierr * (i_gain * current_meas_period);
+        if (integral > max_voltage || integral < -max_voltage)
+            return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+        // The proportional part may saturate briefly during the initial step
+        float test_voltage = std::max(std::min(integral + Ierr * p_gain, max_voltage), -max_voltage);
+
+        if (i >= num_settle_cycles) {
+            V_sum += integral;
+            I_sum += Ialpha;
+        }
+
+        // Test voltage along phase A
+        if (!enqueue_voltage_timings(test_voltage, 0.0f))
+            return false; // error set inside enqueue_voltage_timings
+        log_timing(TIMING_LOG_MEAS_R);
+
+        return ++i < num_test_cycles;
+    });
+    calibration_cycles_.resistance = i;
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    float R = V_sum / I_sum;
+    if (!(R > 0.0f))
+        return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+    config_.phase_resistance = R;
+    return true;
 }
 
-bool Motor::measure_phase_inductance(float voltage_low, float voltage_high) {
+// @brief Measures the voltage error caused by the gate driver dead time and
+// derives config_.dead_time_compensation from it.
+//
+// The DC voltage along phase A is measured at the full and at half the test
+// current. The resistive drop scales with the current, while the dead time
+// error does not, so V(I) = R*I + V_dt.
+bool Motor::measure_dead_time(float test_current, float max_voltage) {
+    float saved_compensation = config_.dead_time_compensation;
+    config_.dead_time_compensation = 0.0f; // measure the uncompensated output stage
+    float V_full, V_half;
+    uint32_t cycles_full = 0, cycles_half = 0;
+    bool success = measure_dc_voltage(test_current, max_voltage, 1.0f, &V_full, &cycles_full)
+                && measure_dc_voltage(0.5f * test_current, max_voltage, 1.0f, &V_half, &cycles_half);
+    calibration_cycles_.dead_time = cycles_full + cycles_half;
+    config_.dead_time_compensation = saved_compensation;
+    if (!success)
+        return false;
+
+    float V_dt = 2.0f * V_half - V_full;
+    // Along alpha, phase A loses and phases B and C gain vbus * dead_time / period
+    // each, which adds up to (4/3) * vbus * dead_time / period.
+    float dead_time = 0.75f * V_dt / vbus_voltage * (float)tim_1_8_period_clocks;
+    if (!(dead_time >= 0.0f && dead_time <= 4.0f * TIM_1_8_DEADTIME_CLOCKS))
+        return set_error(ERROR_DEAD_TIME_OUT_OF_RANGE), false;
+    config_.dead_time_compensation = dead_time;
+    return true;
+}
+
+bool Motor::measure_phase_inductance(float voltage_low, float voltage_high, int num_cycles) {
     float test_voltages[2] = {voltage_low, voltage_high};
     float Ialphas[2] = {0.0f};
-    static const int num_cycles = 5000;
 
-    size_t t = 0;
+    float v_L = 0.5f * (voltage_high - voltage_low);
+    // Note: A more correct formula would also take into account that there is a finite timestep.
+    // However, the discretisation in the current control loop inverts the same discrepancy
+    auto estimate_L = [&](uint32_t cycles) {
+        float dI_by_dt = (Ialphas[1] - Ialphas[0]) / (current_meas_period * (float)cycles);
+        return v_L / dI_by_dt;
+    };
+
+    // If config_.calibration_tolerance is set, the test ends early once the
+    // estimate changes by less than the tolerance from one block to the next
+    static const uint32_t block_cycles = 250;
+    float block_start_L = 0.0f;
+
+    uint32_t t = 0;
     axis_->run_control_loop([&](){
         int i = t & 1;
         Ialphas[i] += -current_meas_.phB - current_meas_.phC;
@@ -219,8 +530,19 @@ bool Motor::measure_phase_inductance(float voltage_low, float voltage_high) {
             return false; // error set inside enqueue_voltage_timings
         log_timing(TIMING_LOG_MEAS_L);
 
-        return ++t < (num_cycles << 1);
+        ++t;
+        uint32_t cycles = t >> 1;
+        if ((t & 1) == 0 && cycles % block_cycles == 0) {
+            float L = estimate_L(cycles);
+            bool converged = config_.calibration_tolerance > 0.0f && cycles >= 2 * block_cycles
+                && fabsf(L - block_start_L) <= config_.calibration_tolerance * fabsf(L);
+            block_start_L = L;
+            if (converged)
+                return false;
+        }
+        return t < ((uint32_t)num_cycles << 1);
     });
+    calibration_cycles_.inductance = t >> 1;
     if (axis_->error_ != Axis::ERROR_NONE)
         return false;
 
@@ -228,26 +550,140 @@ bool Motor::measure_phase_inductance(float voltage_low, float voltage_high) {
     //if (!enqueue_voltage_timings(motor, 0.0f, 0.0f))
     //    return false; // error set inside enqueue_voltage_timings
 
-    float v_L = 0.5f * (voltage_high - voltage_low);
-    // Note: A more correct formula would also take into account that there is a finite timestep.
-    // However, the discretisation in the current control loop inverts the same discrepancy
-    float dI_by_dt = (Ialphas[1] - Ialphas[0]) / (current_meas_period * (float)num_cycles);
-    float L = v_L / dI_by_dt;
+    float L = estimate_L(calibration_cycles_.inductance);
 
     config_.phase_inductance = L;
     // TODO arbitrary values set for now
-    if (L < 1e-6f || L > 2500e-6f)
+    if (L < kMinPhaseInductance || L > kMaxPhaseInductance)
         return set_error(ERROR_PHASE_INDUCTANCE_OUT_OF_RANGE), false;
     return true;
 }
 
+// @brief Measures the incremental inductance along phase A at
+// kInductanceTableSize currents from 0 to config_.inductance_table_current
+// and stores it in config_.inductance_table, relative to config_.phase_inductance.
+//
+// At each point, an integrator holds the mean current at the bias, a decade
+// below the electrical pole R/L, while an alternating test voltage on top
+// measures dI/dt as in measure_phase_inductance. The test voltage is chosen
+// for a ripple of a quarter of the point spacing, so that each point sees
+// the inductance close to its bias current. The bias current locks the rotor
+// to phase A, so this measures the d axis, which for most motors saturates
+// similarly to the q axis.
+// Requires config_.phase_resistance and config_.phase_inductance.
+bool Motor::measure_inductance_table(float max_voltage) {
+    const float R = config_.phase_resistance;
+    const float L0 = config_.phase_inductance;
+    const float I_step = config_.inductance_table_current / (float)(kInductanceTableSize - 1);
+    const float k_i = 0.1f * R * R / L0;                                             // [(V/s)/A]
+    const float v_L = std::min(0.25f * I_step * L0 / current_meas_period, 0.5f * max_voltage);
+    const uint32_t num_settle_cycles = static_cast<uint32_t>((50.0f * L0 / R) / current_meas_period) >> 1;
+    static const uint32_t num_test_cycles = 2000;
+    if (!(I_step > 0.0f && R > 0.0f && L0 > 0.0f))
+        return set_error(ERROR_PHASE_INDUCTANCE_OUT_OF_RANGE), false;
+
+    float table[kInductanceTableSize];
+    float test_voltages[2] = {-v_L, v_L};
+    float Ialphas[2] = {0.0f};
+    float bias_voltage = 0.0f;
+    size_t point = 0;
+    uint32_t t = 0;
+    calibration_cycles_.inductance_table = 0;
+    axis_->run_control_loop([&](){
+        int i = t & 1;
+        float Ialpha = -current_meas_.phB - current_meas_.phC;
+        if ((t >> 1) >= num_settle_cycles)
+            Ialphas[i] += Ialpha;
+        bias_voltage += (k_i * current_meas_period) * ((float)point * I_step - Ialpha);
+        if (fabsf(bias_voltage) + v_L > max_voltage)
+            return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+
+        // Test voltage along phase A
+        if (!enqueue_voltage_timings(bias_voltage + test_voltages[i], 0.0f))
+            return false; // error set inside enqueue_voltage_timings
+        log_timing(TIMING_LOG_MEAS_L);
+
+        if (++t < ((num_settle_cycles + num_test_cycles) << 1))
+            return true;
+        float dI_by_dt = (Ialphas[1] - Ialphas[0]) / (current_meas_period * (float)num_test_cycles);
+        table[point] = v_L / dI_by_dt;
+        calibration_cycles_.inductance_table += t >> 1;
+        Ialphas[0] = Ialphas[1] = 0.0f;
+        t = 0;
+        // Step the bias voltage with the current, the integrator only has to
+        // take up the error of the resistance
+        bias_voltage += R * I_step;
+        return ++point < kInductanceTableSize;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE || point < kInductanceTableSize)
+        return false;
+
+    for (size_t j = 0; j < kInductanceTableSize; ++j) {
+        if (!(table[j] >= kMinPhaseInductance && table[j] <= kMaxPhaseInductance))
+            return set_error(ERROR_PHASE_INDUCTANCE_OUT_OF_RANGE), false;
+    }
+    for (size_t j = 0; j < kInductanceTableSize; ++j)
+        config_.inductance_table[j] = table[j] / L0;
+    return true;
+}
+
+// @brief Returns the d axis current [A] that maximizes the torque per
+// ampere for an Iq [A], for a motor with the torque
+//   T ~ Iq * (flux_linkage - lq_minus_ld * Id)
+// Setting dT/dId to 0 at a constant current magnitude gives
+//   lq_minus_ld * Id^2 - flux_linkage * Id - lq_minus_ld * Iq^2 = 0
+// whose negative root is written without the cancellation of the usual
+// form, so that it goes to 0 with lq_minus_ld.
+float Motor::get_mtpa_Id(float Iq) {
+    float psi = config_.flux_linkage;
+    float dL_Iq_sq = config_.lq_minus_ld * SQ(Iq);
+    float den = psi + sqrtf(SQ(psi) + 4.0f * config_.lq_minus_ld * dL_Iq_sq);
+    return den > 0.0f ? -2.0f * dL_Iq_sq / den : 0.0f;
+}
+
+// @brief Returns the MTPA d axis current [A] at a current magnitude Is [A].
+// With Iq^2 = Is^2 - Id^2, the condition of get_mtpa_Id becomes
+//   2 * lq_minus_ld * Id^2 - flux_linkage * Id - lq_minus_ld * Is^2 = 0
+float Motor::get_mtpa_Id_at_magnitude(float Is) {
+    float psi = config_.flux_linkage;
+    float dL_Is_sq = config_.lq_minus_ld * SQ(Is);
+    float den = psi + sqrtf(SQ(psi) + 8.0f * config_.lq_minus_ld * dL_Is_sq);
+    return den > 0.0f ? -2.0f * dL_Is_sq / den : 0.0f;
+}
+
+// @brief Returns config_.inductance_table at a current [A], interpolated
+// linearly and held beyond the last point.
+float Motor::get_inductance_scale(float current) {
+    float x = fabsf(current) * (float)(kInductanceTableSize - 1) / config_.inductance_table_current;
+    if (!(x < (float)(kInductanceTableSize - 1)))
+        return config_.inductance_table[kInductanceTableSize - 1];
+    size_t i = (size_t)x;
+    float frac = x - (float)i;
+    return config_.inductance_table[i] + frac * (config_.inductance_table[i + 1] - config_.inductance_table[i]);
+}
+
 
 bool Motor::run_calibration() {
     float R_calib_max_voltage = config_.resistance_calib_max_voltage;
     if (config_.motor_type == MOTOR_TYPE_HIGH_CURRENT) {
-        if (!measure_phase_resistance(config_.calibration_current, R_calib_max_voltage))
+        if (config_.enable_fast_calibration) {
+            // The resistance measurement needs the inductance, so it comes second here
+            if (!measure_phase_inductance(-R_calib_max_voltage, R_calib_max_voltage, 500))
+                return false;
+            config_.current_control_bandwidth = config_.autotune_bandwidth_fraction * 2.0f * M_PI * (float)current_meas_hz;
+            if (!measure_phase_resistance_fast(config_.calibration_current, R_calib_max_voltage, config_.current_control_bandwidth))
+                return false;
+        } else {
+            if (!measure_phase_resistance(config_.calibration_current, R_calib_max_voltage))
+                return false;
+            if (!measure_phase_inductance(-R_calib_max_voltage, R_calib_max_voltage, 5000))
+                return false;
+        }
+        if (config_.calibrate_dead_time &&
+                !measure_dead_time(config_.calibration_current, R_calib_max_voltage))
             return false;
-        if (!measure_phase_inductance(-R_calib_max_voltage, R_calib_max_voltage))
+        if (config_.calibrate_inductance_table &&
+                !measure_inductance_table(R_calib_max_voltage))
             return false;
     } else if (config_.motor_type == MOTOR_TYPE_GIMBAL) {
         // no calibration needed
@@ -261,21 +697,114 @@ bool Motor::run_calibration() {
     return true;
 }
 
+// @brief Returns true if the stored calibration can be used without running
+// run_calibration() again, i.e. pre_calibrated is set and the stored values
+// are within the limits that the measurements enforce.
+bool Motor::check_calibration() {
+    if (!config_.pre_calibrated)
+        return false;
+    if (config_.motor_type == MOTOR_TYPE_GIMBAL)
+        return true; // nothing is measured
+    if (config_.motor_type != MOTOR_TYPE_HIGH_CURRENT)
+        return false;
+    // The negated comparisons also reject NaN
+    float max_resistance = config_.resistance_calib_max_voltage / config_.calibration_current;
+    if (!(config_.phase_resistance > 0.0f && config_.phase_resistance <= max_resistance))
+        return false;
+    if (!(config_.phase_inductance >= kMinPhaseInductance && config_.phase_inductance <= kMaxPhaseInductance))
+        return false;
+    return true;
+}
+
+// @brief Shifts a rising edge timing to make up for the dead time.
+// While a phase conducts positive current (into the motor), its output is low
+// during the dead time, so the high side on-time is extended, and vice versa.
+// Within the configured current band the correction fades linearly to zero,
+// which keeps it from chattering when the current crosses zero.
+// @param dead_time: dead time as a fraction of the PWM half period
+float Motor::compensate_dead_time(float t, float current, float dead_time) {
+    float polarity = current / std::max(config_.dead_time_comp_current_band, 1e-3f);
+    polarity = std::max(std::min(polarity, 1.0f), -1.0f);
+    t -= polarity * dead_time;
+    return std::max(std::min(t, 1.0f), 0.0f);
+}
+
+// @brief Returns the modulation magnitude limit of the current controller.
+// Without overmodulation this is capped to the linear SVM range.
+float Motor::get_max_modulation() {
+    float max_mod = std::max(config_.max_modulation, 0.0f);
+    max_mod = std::min(max_mod, config_.enable_overmodulation ? two_by_sqrt3 : 1.0f);
+    return max_mod * sqrt3_by_2;
+}
+
+// @brief Chooses between SVM and discontinuous PWM for the next timings.
+// DPWM saves a third of the switching losses, at the cost of more current
+// ripple. It is used while the load is light or slow, and SVM takes over
+// for dpwm_hold_time whenever the load gets heavy or the current controller
+// falls behind its setpoint.
+// @param phase_vel: electrical angular velocity [rad/s]
+void Motor::update_dpwm(float Iq_des, float Ierr_d, float Ierr_q, float phase_vel) {
+    bool light_load = fabsf(Iq_des) < config_.dpwm_max_current
+                   || fabsf(phase_vel) < config_.dpwm_max_vel;
+    bool dynamic_load = SQ(Ierr_d) + SQ(Ierr_q) > SQ(config_.dpwm_max_current_error);
+    if (!config_.enable_dpwm || !light_load || dynamic_load) {
+        dpwm_active_ = false;
+        dpwm_hold_count_ = (uint32_t)(std::max(config_.dpwm_hold_time, 0.0f) * current_meas_hz);
+    } else if (dpwm_hold_count_ > 0) {
+        --dpwm_hold_count_;
+    } else {
+        dpwm_active_ = true;
+    }
+}
+
 bool Motor::enqueue_modulation_timings(float mod_alpha, float mod_beta) {
     float tA, tB, tC;
-    if (SVM(mod_alpha, mod_beta, &tA, &tB, &tC) != 0)
+    int svm_result;
+    {
+        ProfilerScope prof(Profiler::SECTION_SVM);
+        if (config_.enable_overmodulation)
+            svm_result = SVM_overmodulation(mod_alpha, mod_beta, &tA, &tB, &tC);
+        else
+            svm_result = SVM(mod_alpha, mod_beta, &tA, &tB, &tC);
+    }
+    if (svm_result != 0)
         return set_error(ERROR_MODULATION_MAGNITUDE), false;
-    next_timings_[0] = (uint16_t)(tA * (float)TIM_1_8_PERIOD_CLOCKS);
-    next_timings_[1] = (uint16_t)(tB * (float)TIM_1_8_PERIOD_CLOCKS);
-    next_timings_[2] = (uint16_t)(tC * (float)TIM_1_8_PERIOD_CLOCKS);
+    float t[3] = { tA, tB, tC };
+    size_t clamped = 3; // phase that doesn't switch in this period, 3 for none
+    if (dpwm_active_) {
+        // Shift the common mode down until the lowest phase is low for the
+        // whole period. The line voltages stay the same, and the null vector
+        // of the current sample gets longer.
+        clamped = (tA >= tB && tA >= tC) ? 0 : (tB >= tC) ? 1 : 2;
+        float shift = 1.0f - t[clamped];
+        for (size_t i = 0; i < 3; ++i)
+            t[i] += shift;
+    }
+    if (config_.dead_time_compensation != 0.0f) {
+        Iph_BC_t& I = current_meas_;
+        float dt = config_.dead_time_compensation / (float)tim_1_8_period_clocks;
+        float I_ph[3] = { -I.phB - I.phC, I.phB, I.phC };
+        for (size_t i = 0; i < 3; ++i) {
+            if (i != clamped) // a phase that doesn't switch has no dead time
+                t[i] = compensate_dead_time(t[i], I_ph[i], dt);
+        }
+    }
+    // A compare value beyond the period keeps the output low, even in the
+    // middle of the period where a value of exactly the period would glitch.
+    // This also applies to a phase that is tied with the clamped one.
+    for (size_t i = 0; i < 3; ++i) {
+        if (i == clamped || t[i] >= 1.0f)
+            next_timings_[i] = (uint16_t)(tim_1_8_period_clocks + 1);
+        else
+            next_timings_[i] = (uint16_t)(t[i] * (float)tim_1_8_period_clocks);
+    }
     next_timings_valid_ = true;
     return true;
 }
 
 bool Motor::enqueue_voltage_timings(float v_alpha, float v_beta) {
-    float vfactor = 1.0f / ((2.0f / 3.0f) * vbus_voltage);
-    float mod_alpha = vfactor * v_alpha;
-    float mod_beta = vfactor * v_beta;
+    float mod_alpha = vbus_V_to_mod * v_alpha;
+    float mod_beta = vbus_V_to_mod * v_beta;
     if (!enqueue_modulation_timings(mod_alpha, mod_beta))
         return false;
     log_timing(TIMING_LOG_FOC_VOLTAGE);
@@ -284,55 +813,122 @@ bool Motor::enqueue_voltage_timings(float v_alpha, float v_beta) {
 
 // TODO: This doesn't update brake current
 // We should probably make FOC Current call FOC Voltage to avoid duplication.
-bool Motor::FOC_voltage(float v_d, float v_q, float phase) {
-    float c = our_arm_cos_f32(phase);
-    float s = our_arm_sin_f32(phase);
+bool Motor::FOC_voltage(float v_d, float v_q, float phase, float phase_vel) {
+    if (config_.enable_phase_advance)
+        phase += phase_vel * pwm_delay_;
+    float c, s;
+    fast_sincos(phase, &s, &c);
     float v_alpha = c*v_d - s*v_q;
     float v_beta  = c*v_q + s*v_d;
     return enqueue_voltage_timings(v_alpha, v_beta);
 }
 
-bool Motor::FOC_current(float Id_des, float Iq_des, float phase) {
+// @brief Runs the dq current controller and queues the resulting PWM timings.
+// @param phase_vel: electrical angular velocity [rad/s], used for the optional
+//                   decoupling, back-EMF feed forward and phase advance
+RAM_FUNC bool Motor::FOC_current(float Id_des, float Iq_des, float phase, float phase_vel) {
+    ProfilerScope prof(Profiler::SECTION_FOC_CURRENT);
+
     // Syntactic sugar
     CurrentControl_t& ictrl = current_control_;
+    uint16_t start_timing = get_pwm_timing();
 
     // For Reporting
     ictrl.Iq_setpoint = Iq_des;
+    ictrl.Id_setpoint = Id_des;
 
     // Clarke transform
     float Ialpha = -current_meas_.phB - current_meas_.phC;
     float Ibeta = one_by_sqrt3 * (current_meas_.phB - current_meas_.phC);
 
     // Park transform
-    float c = our_arm_cos_f32(phase);
-    float s = our_arm_sin_f32(phase);
+    float c, s;
+    fast_sincos(phase, &s, &c);
     float Id = c * Ialpha + s * Ibeta;
     float Iq = c * Ibeta - s * Ialpha;
     ictrl.Iq_measured = Iq;
+    ictrl.Id_measured = Id;
+
+    // Regen limiting: the bus current is about mod_q * Iq, so with the
+    // modulation of the last update, limit the braking Iq to what the
+    // bus can take (see update_brake_current).
+    float regen_Iq_lim = regen_current_lim;
+    if (ictrl.mod_q * Iq_des < -regen_Iq_lim) {
+        Iq_des = -regen_Iq_lim / ictrl.mod_q;
+        ictrl.Iq_setpoint = Iq_des;
+    }
+    // The same for the current drawn from the supply (see update_dc_bus_limits)
+    if (ictrl.mod_q * Iq_des > bus_current_lim_) {
+        Iq_des = bus_current_lim_ / ictrl.mod_q;
+        ictrl.Iq_setpoint = Iq_des;
+    }
 
     // Current error
     float Ierr_d = Id_des - Id;
     float Ierr_q = Iq_des - Iq;
+    update_dpwm(Iq_des, Ierr_d, Ierr_q, phase_vel);
+
+    // Apply PI control. As the inductance saturates with the current, the
+    // plant gain rises, so p_gain follows the inductance to keep the
+    // bandwidth. i_gain = R * bandwidth doesn't depend on the inductance,
+    // so the PI zero keeps cancelling the plant pole R/L.
+    float p_gain = ictrl.p_gain;
+    if (config_.enable_inductance_scaling) {
+        ictrl.inductance_scale = get_inductance_scale(Iq_des);
+        p_gain *= ictrl.inductance_scale;
+    } else {
+        ictrl.inductance_scale = 1.0f;
+    }
+    float Vd = ictrl.v_current_control_integral_d + Ierr_d * p_gain;
+    float Vq = ictrl.v_current_control_integral_q + Ierr_q * p_gain;
+
+    // Feed forward terms of the motor model
+    //   Vd = R*Id + L*dId/dt - omega*L*Iq
+    //   Vq = R*Iq + L*dIq/dt + omega*L*Id + omega*flux_linkage
+    // so that the integrators don't have to track them at high speed.
+    // The commanded currents are used rather than the measured ones to keep
+    // current sense noise out of the feed forward path.
+    if (config_.enable_current_decoupling) {
+        float omega_L = phase_vel * config_.phase_inductance;
+        Vd -= omega_L * Iq_des;
+        Vq += omega_L * Id_des;
+    }
+    if (config_.enable_bemf_feedforward) {
+        Vq += phase_vel * config_.flux_linkage;
+    }
 
-    // TODO look into feed forward terms (esp omega, since PI pole maps to RL tau)
-    // Apply PI control
-    float Vd = ictrl.v_current_control_integral_d + Ierr_d * ictrl.p_gain;
-    float Vq = ictrl.v_current_control_integral_q + Ierr_q * ictrl.p_gain;
+    // High frequency injection: a square wave on the d axis that alternates
+    // sign on every update. Its effect on the current is demodulated by the
+    // sensorless estimator to track the rotor angle at low speed.
+    if (hfi_voltage_ != 0.0f) {
+        Vd += hfi_sign_ * hfi_voltage_;
+        hfi_sign_ = -hfi_sign_;
+    }
 
     float mod_to_V = (2.0f / 3.0f) * vbus_voltage;
-    float V_to_mod = 1.0f / mod_to_V;
+    float V_to_mod = vbus_V_to_mod;
     float mod_d = V_to_mod * Vd;
     float mod_q = V_to_mod * Vq;
 
+    // Field weakening: integrate the modulation headroom into a negative Id,
+    // which takes effect on the next update
+    const float max_mod = get_max_modulation();
+    float mod_mag = sqrtf(mod_d * mod_d + mod_q * mod_q);
+    if (config_.enable_field_weakening) {
+        float headroom = config_.fw_mod_setpoint * max_mod - mod_mag;
+        ictrl.fw_Id += headroom * (config_.fw_gain * current_meas_period);
+        ictrl.fw_Id = std::max(std::min(ictrl.fw_Id, 0.0f), -config_.fw_max_Id);
+    } else {
+        ictrl.fw_Id = 0.0f;
+    }
+
     // Vector modulation saturation, lock integrator if saturated
-    // TODO make maximum modulation configurable
-    float mod_scalefactor = 0.80f * sqrt3_by_2 * 1.0f / sqrtf(mod_d * mod_d + mod_q * mod_q);
+    float mod_scalefactor = max_mod / mod_mag;
     if (mod_scalefactor < 1.0f) {
         mod_d *= mod_scalefactor;
         mod_q *= mod_scalefactor;
-        // TODO make decayfactor configurable
-        ictrl.v_current_control_integral_d *= 0.99f;
-        ictrl.v_current_control_integral_q *= 0.99f;
+        ictrl.v_current_control_integral_d *= ictrl.integral_decay;
+        ictrl.v_current_control_integral_q *= ictrl.integral_decay;
     } else {
         ictrl.v_current_control_integral_d += Ierr_d * (ictrl.i_gain * current_meas_period);
         ictrl.v_current_control_integral_q += Ierr_q * (ictrl.i_gain * current_meas_period);
@@ -340,8 +936,15 @@ bool Motor::FOC_current(float Id_des, float Iq_des, float phase) {
 
     // Compute estimated bus current
     ictrl.Ibus = mod_d * Id + mod_q * Iq;
-
-    // Inverse park transform
+    ictrl.mod_q = mod_q;
+    accumulate_power(vbus_voltage * ictrl.Ibus, SQ(Id) + SQ(Iq));
+    ictrl.bus_utilization = std::min(mod_mag, max_mod) * (1.0f / sqrt3_by_2);
+
+    // Inverse park transform. The timings are only applied on a later PWM
+    // update (see pwm_delay_), by which time the rotor has moved on from
+    // the phase of the current sample.
+    if (config_.enable_phase_advance)
+        fast_sincos(phase + phase_vel * pwm_delay_, &s, &c);
     float mod_alpha = c * mod_d - s * mod_q;
     float mod_beta  = c * mod_q + s * mod_d;
 
@@ -353,28 +956,49 @@ bool Motor::FOC_current(float Id_des, float Iq_des, float phase) {
     if (!enqueue_modulation_timings(mod_alpha, mod_beta))
         return false; // error set inside enqueue_modulation_timings
     log_timing(TIMING_LOG_FOC_CURRENT);
+    log_loop_timing(current_loop_timing_, start_timing);
 
     return true;
 }
 
 
-bool Motor::update(float current_setpoint, float phase) {
+// @param phase_vel: electrical angular velocity [rad/s] that corresponds to phase
+bool Motor::update_unsupported_motor_type(float current_setpoint, float phase, float phase_vel) {
+    set_error(ERROR_NOT_IMPLEMENTED_MOTOR_TYPE);
+    return false;
+}
+
+// One instance per motor type, see update_fn_
+template<Motor::MotorType_t motor_type>
+bool Motor::update_motor_type(float current_setpoint, float phase, float phase_vel) {
     current_setpoint *= config_.direction;
     phase *= config_.direction;
+    phase_vel *= config_.direction;
 
     // Execute current command
-    // TODO: move this into the mot
-    if (config_.motor_type == MOTOR_TYPE_HIGH_CURRENT) {
-        if(!FOC_current(0.0f, current_setpoint, phase)){
-            return false;
+    if (motor_type == MOTOR_TYPE_HIGH_CURRENT) {
+        float Id_setpoint = current_control_.fw_Id;
+        float Ilim = effective_current_lim();
+        if (config_.enable_mtpa) {
+            // Limit Iq to where the MTPA curve meets the current limit,
+            // field weakening then adds to the MTPA current
+            float Id_lim = get_mtpa_Id_at_magnitude(Ilim);
+            float Iq_lim = sqrtf(std::max(SQ(Ilim) - SQ(Id_lim), 0.0f));
+            current_setpoint = std::max(std::min(current_setpoint, Iq_lim), -Iq_lim);
+            current_control_.mtpa_Id = get_mtpa_Id(current_setpoint);
+            Id_setpoint += current_control_.mtpa_Id;
+        } else {
+            current_control_.mtpa_Id = 0.0f;
         }
-    } else if (config_.motor_type == MOTOR_TYPE_GIMBAL) {
-        //In gimbal motor mode, current is reinterptreted as voltage.
-        if(!FOC_voltage(0.0f, current_setpoint, phase))
-            return false;
+        // Keep the total current within the limit while field weakening
+        if (Id_setpoint != 0.0f) {
+            Id_setpoint = std::max(Id_setpoint, -Ilim);
+            float Iq_lim = sqrtf(std::max(SQ(Ilim) - SQ(Id_setpoint), 0.0f));
+            current_setpoint = std::max(std::min(current_setpoint, Iq_lim), -Iq_lim);
+        }
+        return FOC_current(Id_setpoint, current_setpoint, phase, phase_vel);
     } else {
-        set_error(ERROR_NOT_IMPLEMENTED_MOTOR_TYPE);
-        return false;
+        //In gimbal motor mode, current is reinterptreted as voltage.
+        return FOC_voltage(0.0f, current_setpoint, phase, phase_vel);
     }
-    return true;
 }
@@ -20,7 +20,9 @@ public:
         ERROR_BRAKE_CURRENT_OUT_OF_RANGE = 0x0040,
         ERROR_MODULATION_MAGNITUDE = 0x0080,
         ERROR_BRAKE_DEADTIME_VIOLATION = 0x0100,
-        ERROR_UNEXPECTED_TIMER_CALLBACK = 0x0200
+        ERROR_UNEXPECTED_TIMER_CALLBACK = 0x0200,
+        ERROR_DEAD_TIME_OUT_OF_RANGE = 0x0400,
+        ERROR_OVER_TEMP = 0x0800,
     };
 
     enum MotorType_t {
@@ -37,6 +39,7 @@ public:
     struct CurrentControl_t{
         float p_gain; // [V/A]
         float i_gain; // [V/As]
+        float integral_decay; // integrator factor per update while the modulation saturates
         float v_current_control_integral_d; // [V]
         float v_current_control_integral_q; // [V]
         float Ibus; // DC bus current [A]
@@ -45,9 +48,18 @@ public:
         float final_v_beta; // [V]
         float Iq_setpoint;
         float Iq_measured;
+        float Id_setpoint;
+        float Id_measured;
         float max_allowed_current;
+        float fw_Id; // [A] field weakening current, applied on the next update
+        float mtpa_Id; // [A] maximum torque per ampere current of the last update
+        float bus_utilization; // applied modulation magnitude relative to the linear SVM limit
+        float mod_q; // q axis modulation of the last update, used to predict the bus current
+        float inductance_scale; // p_gain multiplier of the last update, see enable_inductance_scaling
     };
 
+    static constexpr size_t kInductanceTableSize = 5;
+
     // NOTE: for gimbal motors, all units of A are instead V.
     // example: vel_gain is [V/(count/s)] instead of [A/(count/s)]
     // example: current_lim and calibration_current will instead determine the maximum voltage applied to the motor.
@@ -66,6 +78,66 @@ public:
         // Value used to compute shunt amplifier gains
         float requested_current_range = 70.0f; // [A]
         float current_control_bandwidth = 1000.0f;  // [rad/s]
+        float calibration_tolerance = 0.0f;     //<! relative change below which the R, L and dead time measurements
+                                                //<! are considered converged and end early. 0 runs them to full length.
+        bool enable_fast_calibration = false;   //<! measure L with fewer cycles, then R with a fast current loop, and
+                                                //<! pick current_control_bandwidth from the current measurement rate
+        float autotune_bandwidth_fraction = 0.05f; //<! current loop crossover chosen by the fast calibration, as a fraction
+                                                   //<! of the current measurement rate (0.05 keeps ~60deg phase margin
+                                                   //<! against the 1.5 sample modulation delay)
+        bool enable_current_decoupling = false; //<! feed forward the omega*L cross coupling between the d and q axes
+        bool enable_bemf_feedforward = false;   //<! feed forward the back-EMF omega*flux_linkage on the q axis
+        bool enable_phase_advance = false;      //<! rotate the output voltage ahead by phase_vel * pwm_delay, the
+                                                //<! electrical angle that the rotor turns until the voltage is applied
+        float flux_linkage = 0.0f;              //<! [V/(rad/s)] permanent magnet flux linkage, per electrical rad/s.
+                                                //<! For a sinusoidal motor this is 2/3 * torque_constant / pole_pairs,
+                                                //<! with the torque constant in Nm/A.
+        float max_modulation = 0.80f;           //<! modulation limit of the current controller, as a fraction of the
+                                                //<! linear SVM range (the circle inscribed in the voltage hexagon).
+                                                //<! Values above 1.0 require enable_overmodulation.
+        bool enable_overmodulation = false;     //<! allow modulation beyond the linear range, up to the hexagon
+                                                //<! vertices at max_modulation = 1.155 (six-step)
+        float dead_time_compensation = 0.0f;    //<! [TIM1/TIM8 clocks] timing correction for the gate driver dead time,
+                                                //<! 0 disables the compensation. Set by the calibration if calibrate_dead_time is set.
+        float dead_time_comp_current_band = 0.5f; //<! [A] phase currents below this are only partially compensated
+        bool calibrate_dead_time = false;       //<! measure dead_time_compensation as part of the motor calibration
+        bool enable_dpwm = false;               //<! switch to discontinuous PWM at light or slow load, which holds the
+                                                //<! lowest phase low and cuts the switching events by a third
+        float dpwm_max_current = 10.0f;         //<! [A] DPWM is used below this Iq setpoint magnitude,
+        float dpwm_max_vel = 200.0f;            //<! [rad/s] or below this electrical speed
+        float dpwm_max_current_error = 2.0f;    //<! [A] dq current error of a dynamic load, which switches back to SVM
+        float dpwm_hold_time = 0.05f;           //<! [s] time without a heavy or dynamic load before DPWM is used again
+        bool enable_field_weakening = false;    //<! inject negative Id once the modulation approaches saturation
+        float fw_max_Id = 10.0f;                //<! [A] maximum magnitude of the field weakening current
+        float fw_mod_setpoint = 0.95f;          //<! fraction of the maximum modulation above which field weakening kicks in
+        float fw_gain = 500.0f;                 //<! [A/s] integral gain from modulation headroom to field weakening current
+        bool enable_mtpa = false;               //<! request the maximum torque per ampere Id for the Iq setpoint,
+                                                //<! for interior PM motors. Requires flux_linkage and lq_minus_ld.
+        float lq_minus_ld = 0.0f;               //<! [H] difference between the q and d axis inductances
+        float current_integrator_decay_time = 0.0125f; //<! [s] time constant of the integrator decay while the
+                                                //   modulation saturates, 0 to hold the integrator instead
+        bool enable_thermal_derating = false;   //<! limit the current by the thermal models and trip on over temperature
+        float thermal_horizon = 1.0f;           //<! [s] the derated current is sustainable for at least this long,
+                                                //<! 0 derates to the continuous current
+        float fet_temp_limit = 100.0f;          //<! [degC] estimated FET temperature that the derating keeps to
+        float fet_temp_trip = 120.0f;           //<! [degC] ERROR_OVER_TEMP above this estimated FET temperature
+        float fet_thermal_coeff = 0.01f;        //<! [K/A^2] steady state rise of the FETs above the thermistor
+        float fet_thermal_tau = 2.0f;           //<! [s] time constant of the FET rise above the thermistor
+        float motor_temp_limit = 90.0f;         //<! [degC] estimated winding temperature that the derating keeps to
+        float motor_temp_trip = 110.0f;         //<! [degC] ERROR_OVER_TEMP above this estimated winding temperature
+        float motor_thermal_resistance = 0.0f;  //<! [K/W] winding to ambient, 0 disables the motor model
+        float motor_thermal_tau = 60.0f;        //<! [s] thermal time constant of the winding
+        float ambient_temp = 25.0f;             //<! [degC] reference of the motor model
+        float dc_calib_tau = 0.2f;              //<! [s] time constant of the phase current offset filter
+        bool freeze_dc_calib_while_armed = false; //<! stop updating the offsets while the motor is armed,
+                                                //<! once they have converged
+        float power_window = 0.1f;              //<! [s] averaging time of the power and update period of the energy totals
+        bool calibrate_inductance_table = false; //<! measure inductance_table as part of the motor calibration
+        bool enable_inductance_scaling = false; //<! scale p_gain with inductance_table at the present Iq setpoint
+        float inductance_table_current = 10.0f; //<! [A] current of the last inductance_table point
+        float inductance_table[kInductanceTableSize] = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+                                                //<! incremental inductance relative to phase_inductance, at evenly
+                                                //<! spaced currents from 0 to inductance_table_current
     };
 
     enum TimingLog_t {
@@ -81,6 +153,12 @@ public:
         TIMING_LOG_NUM_SLOTS
     };
 
+    struct LoopTiming_t {
+        uint32_t count;  // number of executions since reset
+        uint16_t last;   // [timer clocks] duration of the last execution
+        uint16_t max;    // [timer clocks] longest execution since reset
+    };
+
     enum ArmedState_t {
         ARMED_STATE_DISARMED,
         ARMED_STATE_WAITING_FOR_TIMINGS,
@@ -88,6 +166,10 @@ public:
         ARMED_STATE_ARMED,
     };
 
+    // [H] range of plausible phase inductances
+    static constexpr float kMinPhaseInductance = 1e-6f;
+    static constexpr float kMaxPhaseInductance = 2500e-6f;
+
     Motor(const MotorHardwareConfig_t& hw_config,
          const GateDriverHardwareConfig_t& gate_driver_config,
          Config_t& config);
@@ -96,55 +178,113 @@ public:
     void disarm();
     void setup() {
         DRV8301_setup();
+        is_calibrated_ = check_calibration();
     }
     void reset_current_control();
 
+    // @brief Returns the current limit [A] that is in effect right now.
+    float effective_current_lim() {
+        float Ilim = std::min(config_.current_lim, current_control_.max_allowed_current);
+        if (config_.enable_thermal_derating)
+            Ilim = std::min(Ilim, thermal_.current_lim);
+        return Ilim;
+    }
     void update_current_controller_gains();
+    void update_pole_pairs();
     void DRV8301_setup();
     bool check_DRV_fault();
+    void gate_driver_poll_cb();
     void set_error(Error_t error);
     bool do_checks();
+    bool update_thermal_model();
+    void accumulate_power(float electrical_power, float I_sq);
+    uint16_t get_pwm_timing();
     void log_timing(TimingLog_t log_idx);
-    float phase_current_from_adcval(uint32_t ADCValue);
+    void log_loop_timing(LoopTiming_t& loop_timing, uint16_t start_timing);
+    void reset_loop_timing();
+    float get_max_modulation();
+    float compensate_dead_time(float t, float current, float dead_time);
+    void update_dpwm(float Iq_des, float Ierr_d, float Ierr_q, float phase_vel);
+    float phase_current_from_adcval(float ADCValue);
+    bool measure_dc_voltage(float test_current, float max_voltage, float duration, float* voltage, uint32_t* num_cycles);
     bool measure_phase_resistance(float test_current, float max_voltage);
-    bool measure_phase_inductance(float voltage_low, float voltage_high);
+    bool measure_phase_resistance_fast(float test_current, float max_voltage, float bandwidth);
+    bool measure_dead_time(float test_current, float max_voltage);
+    bool measure_phase_inductance(float voltage_low, float voltage_high, int num_cycles);
+    bool measure_inductance_table(float max_voltage);
+    float get_inductance_scale(float current);
+    float get_mtpa_Id(float Iq);
+    float get_mtpa_Id_at_magnitude(float Is);
     bool run_calibration();
+    bool check_calibration();
     bool enqueue_modulation_timings(float mod_alpha, float mod_beta);
     bool enqueue_voltage_timings(float v_alpha, float v_beta);
-    bool FOC_voltage(float v_d, float v_q, float phase);
-    bool FOC_current(float Id_des, float Iq_des, float phase);
-    bool update(float current_setpoint, float phase);
+    bool FOC_voltage(float v_d, float v_q, float phase, float phase_vel);
+    bool FOC_current(float Id_des, float Iq_des, float phase, float phase_vel);
+    // @brief Runs the update of the motor type that arm() selected
+    bool update(float current_setpoint, float phase, float phase_vel) {
+        return (this->*update_fn_)(current_setpoint, phase, phase_vel);
+    }
+    template<MotorType_t motor_type> bool update_motor_type(float current_setpoint, float phase, float phase_vel);
+    bool update_unsupported_motor_type(float current_setpoint, float phase, float phase_vel);
 
     const MotorHardwareConfig_t& hw_config_;
     const GateDriverHardwareConfig_t gate_driver_config_;
     Config_t& config_;
     Axis* axis_ = nullptr; // set by Axis constructor
+    // update_motor_type<config_.motor_type>, so that the hot path has no
+    // motor type branches. A new motor type takes effect at the next arm().
+    bool (Motor::*update_fn_)(float current_setpoint, float phase, float phase_vel) = &Motor::update_unsupported_motor_type;
 
 //private:
 
     DRV8301_Obj gate_driver_; // initialized in constructor
     uint16_t next_timings_[3] = {
-        TIM_1_8_PERIOD_CLOCKS / 2,
-        TIM_1_8_PERIOD_CLOCKS / 2,
-        TIM_1_8_PERIOD_CLOCKS / 2
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2)
     };
     bool next_timings_valid_ = false;
     uint16_t last_cpu_time_ = 0;
     int timing_log_index_ = 0;
     uint16_t timing_log_[TIMING_LOG_NUM_SLOTS] = { 0 };
+    // Execution time of each control loop rate
+    LoopTiming_t current_loop_timing_ = { 0 };
+    LoopTiming_t vel_loop_timing_ = { 0 };
+    LoopTiming_t pos_loop_timing_ = { 0 };
 
     // variables exposed on protocol
     Error_t error_ = ERROR_NONE;
     // Do not write to this variable directly!
     // It is for exclusive use by the safety_critical_... functions.
     ArmedState_t armed_state_ = ARMED_STATE_DISARMED; 
-    bool is_calibrated_ = config_.pre_calibrated;
+    bool is_calibrated_ = false; // set by setup() if the stored calibration is valid
+    struct {
+        uint32_t resistance;  // [control cycles] used by the last resistance measurement
+        uint32_t inductance;  // [square wave periods] used by the last inductance measurement
+        uint32_t dead_time;   // [control cycles] used by the last dead time measurement
+        uint32_t inductance_table; // [square wave periods] used by the last inductance table measurement
+    } calibration_cycles_ = { 0, 0, 0, 0 };
     Iph_BC_t current_meas_ = {0.0f, 0.0f};
     Iph_BC_t DC_calib_ = {0.0f, 0.0f};
+    uint32_t DC_calib_samples_ = 0; // DC_CAL samples taken so far, saturating at the filter length
+    bool DC_calib_converged_ = false; // the offsets have averaged a full time constant of samples
     float phase_current_rev_gain_ = 0.0f; // Reverse gain for ADC to Amps (to be set by DRV8301_setup)
+    // High frequency injection for the sensorless estimator, see FOC_current
+    float hfi_voltage_ = 0.0f;  // [V] amplitude of the d axis square wave, 0 to disable
+    float hfi_sign_ = 1.0f;     // sign of the injection on the next update
+    // [s] from the current sample to the middle of the PWM period in which
+    // the resulting timings are applied, set by start_adc_pwm()
+    float pwm_delay_ = 0.0f;
+    // Discontinuous PWM, see update_dpwm()
+    bool dpwm_active_ = false;
+    uint32_t dpwm_hold_count_ = 0; // [current measurements] until DPWM may be used again
+    // [A] bus current that this motor may draw from the supply, set by update_dc_bus_limits()
+    float bus_current_lim_ = INFINITY;
     CurrentControl_t current_control_ = {
         .p_gain = 0.0f,        // [V/A] should be auto set after resistance and inductance measurement
         .i_gain = 0.0f,        // [V/As] should be auto set after resistance and inductance measurement
+        .integral_decay = 1.0f,
         .v_current_control_integral_d = 0.0f,
         .v_current_control_integral_q = 0.0f,
         .Ibus = 0.0f,
@@ -152,10 +292,45 @@ public:
         .final_v_beta = 0.0f,
         .Iq_setpoint = 0.0f,
         .Iq_measured = 0.0f,
+        .Id_setpoint = 0.0f,
+        .Id_measured = 0.0f,
         .max_allowed_current = 0.0f,
+        .fw_Id = 0.0f,
+        .mtpa_Id = 0.0f,
+        .bus_utilization = 0.0f,
+        .mod_q = 0.0f,
+        .inductance_scale = 1.0f,
     };
+    // Thermal models of the FETs (relative to the thermistor) and the winding (relative to ambient_temp)
+    ThermalModel fet_thermal_model_;
+    ThermalModel motor_thermal_model_;
+    uint64_t thermal_meas_count_ = 0; // current measurement of the last thermal model update
+    struct {
+        float fet_temp;    // [degC] thermistor plus the modelled FET rise
+        float motor_temp;  // [degC] ambient_temp plus the modelled winding rise
+        float current_lim; // [A] current that both stay below their limit with for thermal_horizon
+    } thermal_ = { 0.0f, 0.0f, INFINITY };
     DRV8301_FaultType_e drv_fault_ = DRV8301_FaultType_NoFault;
     DRV_SPI_8301_Vars_t gate_driver_regs_; //Local view of DRV registers (initialized by DRV8301_setup)
+    uint16_t gate_driver_poll_regs_[4] = { 0 }; // registers of the sweep in progress, see gate_driver_poll_cb
+    uint32_t gate_driver_poll_count_ = 0;       // completed background reads of all registers
+    uint32_t gate_driver_poll_error_count_ = 0; // aborted background reads
+    // Power accounting of the current controller, see accumulate_power.
+    // The mechanical power is the electrical power minus the copper
+    // losses, i.e. the torque times the speed, including the friction.
+    struct {
+        float electrical;        // [W] drawn from the DC bus, averaged over power_window
+        float mechanical;        // [W] delivered to the rotor
+        float loss;              // [W] copper losses in the winding
+        float electrical_energy; // [J] totals since startup, can be written to reset them
+        float mechanical_energy; // [J]
+        float loss_energy;       // [J]
+    } power_ = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    struct {
+        float electrical;        // [W] sum over the running window
+        float loss;              // [W]
+        uint32_t count;          // current control updates in the running window
+    } power_sums_ = { 0.0f, 0.0f, 0 };
 
     // Communication protocol definitions
     auto make_protocol_definitions() {
@@ -163,10 +338,20 @@ public:
             make_protocol_property("error", &error_),
             make_protocol_ro_property("armed_state", &armed_state_),
             make_protocol_ro_property("is_calibrated", &is_calibrated_),
+            make_protocol_object("calibration_cycles",
+                make_protocol_ro_property("resistance", &calibration_cycles_.resistance),
+                make_protocol_ro_property("inductance", &calibration_cycles_.inductance),
+                make_protocol_ro_property("dead_time", &calibration_cycles_.dead_time),
+                make_protocol_ro_property("inductance_table", &calibration_cycles_.inductance_table)
+            ),
             make_protocol_ro_property("current_meas_phB", &current_meas_.phB),
             make_protocol_ro_property("current_meas_phC", &current_meas_.phC),
             make_protocol_property("DC_calib_phB", &DC_calib_.phB),
             make_protocol_property("DC_calib_phC", &DC_calib_.phC),
+            make_protocol_ro_property("DC_calib_converged", &DC_calib_converged_),
+            make_protocol_ro_property("pwm_delay", &pwm_delay_),
+            make_protocol_ro_property("bus_current_lim", &bus_current_lim_),
+            make_protocol_ro_property("dpwm_active", &dpwm_active_),
             make_protocol_property("phase_current_rev_gain", &phase_current_rev_gain_),
             make_protocol_object("current_control",
                 make_protocol_property("p_gain", &current_control_.p_gain),
@@ -178,14 +363,35 @@ public:
                 make_protocol_property("final_v_beta", &current_control_.final_v_beta),
                 make_protocol_property("Iq_setpoint", &current_control_.Iq_setpoint),
                 make_protocol_property("Iq_measured", &current_control_.Iq_measured),
-                make_protocol_property("max_allowed_current", &current_control_.max_allowed_current)
+                make_protocol_property("Id_setpoint", &current_control_.Id_setpoint),
+                make_protocol_property("Id_measured", &current_control_.Id_measured),
+                make_protocol_property("max_allowed_current", &current_control_.max_allowed_current),
+                make_protocol_ro_property("fw_Id", &current_control_.fw_Id),
+                make_protocol_ro_property("mtpa_Id", &current_control_.mtpa_Id),
+                make_protocol_ro_property("bus_utilization", &current_control_.bus_utilization),
+                make_protocol_ro_property("inductance_scale", &current_control_.inductance_scale)
+            ),
+            make_protocol_object("power",
+                make_protocol_ro_property("electrical", &power_.electrical),
+                make_protocol_ro_property("mechanical", &power_.mechanical),
+                make_protocol_ro_property("loss", &power_.loss),
+                make_protocol_property("electrical_energy", &power_.electrical_energy),
+                make_protocol_property("mechanical_energy", &power_.mechanical_energy),
+                make_protocol_property("loss_energy", &power_.loss_energy)
+            ),
+            make_protocol_object("thermal",
+                make_protocol_ro_property("fet_temp", &thermal_.fet_temp),
+                make_protocol_ro_property("motor_temp", &thermal_.motor_temp),
+                make_protocol_ro_property("current_lim", &thermal_.current_lim)
             ),
             make_protocol_object("gate_driver",
-                make_protocol_ro_property("drv_fault", &drv_fault_)
-                // make_protocol_ro_property("status_reg_1", &gate_driver_regs_.Stat_Reg_1_Value),
-                // make_protocol_ro_property("status_reg_2", &gate_driver_regs_.Stat_Reg_2_Value),
-                // make_protocol_ro_property("ctrl_reg_1", &gate_driver_regs_.Ctrl_Reg_1_Value),
-                // make_protocol_ro_property("ctrl_reg_2", &gate_driver_regs_.Ctrl_Reg_2_Value)
+                make_protocol_ro_property("drv_fault", &drv_fault_),
+                make_protocol_ro_property("status_reg_1", &gate_driver_regs_.Stat_Reg_1_Value),
+                make_protocol_ro_property("status_reg_2", &gate_driver_regs_.Stat_Reg_2_Value),
+                make_protocol_ro_property("ctrl_reg_1", &gate_driver_regs_.Ctrl_Reg_1_Value),
+                make_protocol_ro_property("ctrl_reg_2", &gate_driver_regs_.Ctrl_Reg_2_Value),
+                make_protocol_ro_property("poll_count", &gate_driver_poll_count_),
+                make_protocol_ro_property("poll_error_count", &gate_driver_poll_error_count_)
             ),
             make_protocol_object("timing_log",
                 make_protocol_ro_property("TIMING_LOG_GENERAL", &timing_log_[TIMING_LOG_GENERAL]),
@@ -198,9 +404,28 @@ public:
                 make_protocol_ro_property("TIMING_LOG_FOC_VOLTAGE", &timing_log_[TIMING_LOG_FOC_VOLTAGE]),
                 make_protocol_ro_property("TIMING_LOG_FOC_CURRENT", &timing_log_[TIMING_LOG_FOC_CURRENT])
             ),
+            make_protocol_object("loop_timing",
+                make_protocol_object("current_loop",
+                    make_protocol_ro_property("count", &current_loop_timing_.count),
+                    make_protocol_ro_property("last", &current_loop_timing_.last),
+                    make_protocol_ro_property("max", &current_loop_timing_.max)
+                ),
+                make_protocol_object("vel_loop",
+                    make_protocol_ro_property("count", &vel_loop_timing_.count),
+                    make_protocol_ro_property("last", &vel_loop_timing_.last),
+                    make_protocol_ro_property("max", &vel_loop_timing_.max)
+                ),
+                make_protocol_object("pos_loop",
+                    make_protocol_ro_property("count", &pos_loop_timing_.count),
+                    make_protocol_ro_property("last", &pos_loop_timing_.last),
+                    make_protocol_ro_property("max", &pos_loop_timing_.max)
+                ),
+                make_protocol_function("reset", *this, &Motor::reset_loop_timing)
+            ),
             make_protocol_object("config",
                 make_protocol_property("pre_calibrated", &config_.pre_calibrated),
-                make_protocol_property("pole_pairs", &config_.pole_pairs),
+                make_protocol_property("pole_pairs", &config_.pole_pairs,
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_pole_pairs(); }, this),
                 make_protocol_property("calibration_current", &config_.calibration_current),
                 make_protocol_property("resistance_calib_max_voltage", &config_.resistance_calib_max_voltage),
                 make_protocol_property("phase_inductance", &config_.phase_inductance),
@@ -210,7 +435,56 @@ public:
                 make_protocol_property("current_lim", &config_.current_lim),
                 make_protocol_property("requested_current_range", &config_.requested_current_range),
                 make_protocol_property("current_control_bandwidth", &config_.current_control_bandwidth,
-                    [](void* ctx) { static_cast<Motor*>(ctx)->update_current_controller_gains(); }, this)
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_current_controller_gains(); }, this),
+                make_protocol_property("calibration_tolerance", &config_.calibration_tolerance),
+                make_protocol_property("enable_fast_calibration", &config_.enable_fast_calibration),
+                make_protocol_property("autotune_bandwidth_fraction", &config_.autotune_bandwidth_fraction),
+                make_protocol_property("enable_current_decoupling", &config_.enable_current_decoupling),
+                make_protocol_property("enable_bemf_feedforward", &config_.enable_bemf_feedforward),
+                make_protocol_property("enable_phase_advance", &config_.enable_phase_advance),
+                make_protocol_property("flux_linkage", &config_.flux_linkage),
+                make_protocol_property("max_modulation", &config_.max_modulation),
+                make_protocol_property("enable_overmodulation", &config_.enable_overmodulation),
+                make_protocol_property("dead_time_compensation", &config_.dead_time_compensation),
+                make_protocol_property("dead_time_comp_current_band", &config_.dead_time_comp_current_band),
+                make_protocol_property("calibrate_dead_time", &config_.calibrate_dead_time),
+                make_protocol_property("enable_dpwm", &config_.enable_dpwm),
+                make_protocol_property("dpwm_max_current", &config_.dpwm_max_current),
+                make_protocol_property("dpwm_max_vel", &config_.dpwm_max_vel),
+                make_protocol_property("dpwm_max_current_error", &config_.dpwm_max_current_error),
+                make_protocol_property("dpwm_hold_time", &config_.dpwm_hold_time),
+                make_protocol_property("enable_field_weakening", &config_.enable_field_weakening),
+                make_protocol_property("fw_max_Id", &config_.fw_max_Id),
+                make_protocol_property("fw_mod_setpoint", &config_.fw_mod_setpoint),
+                make_protocol_property("fw_gain", &config_.fw_gain),
+                make_protocol_property("enable_mtpa", &config_.enable_mtpa),
+                make_protocol_property("lq_minus_ld", &config_.lq_minus_ld),
+                make_protocol_property("current_integrator_decay_time", &config_.current_integrator_decay_time,
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_current_controller_gains(); }, this),
+                make_protocol_property("enable_thermal_derating", &config_.enable_thermal_derating),
+                make_protocol_property("thermal_horizon", &config_.thermal_horizon),
+                make_protocol_property("fet_temp_limit", &config_.fet_temp_limit),
+                make_protocol_property("fet_temp_trip", &config_.fet_temp_trip),
+                make_protocol_property("fet_thermal_coeff", &config_.fet_thermal_coeff),
+                make_protocol_property("fet_thermal_tau", &config_.fet_thermal_tau),
+                make_protocol_property("motor_temp_limit", &config_.motor_temp_limit),
+                make_protocol_property("motor_temp_trip", &config_.motor_temp_trip),
+                make_protocol_property("motor_thermal_resistance", &config_.motor_thermal_resistance),
+                make_protocol_property("motor_thermal_tau", &config_.motor_thermal_tau),
+                make_protocol_property("ambient_temp", &config_.ambient_temp),
+                make_protocol_property("dc_calib_tau", &config_.dc_calib_tau),
+                make_protocol_property("freeze_dc_calib_while_armed", &config_.freeze_dc_calib_while_armed),
+                make_protocol_property("power_window", &config_.power_window),
+                make_protocol_property("calibrate_inductance_table", &config_.calibrate_inductance_table),
+                make_protocol_property("enable_inductance_scaling", &config_.enable_inductance_scaling),
+                make_protocol_property("inductance_table_current", &config_.inductance_table_current),
+                make_protocol_object("inductance_table",
+                    make_protocol_property("point0", &config_.inductance_table[0]),
+                    make_protocol_property("point1", &config_.inductance_table[1]),
+                    make_protocol_property("point2", &config_.inductance_table[2]),
+                    make_protocol_property("point3", &config_.inductance_table[3]),
+                    make_protocol_property("point4", &config_.inductance_table[4])
+                )
             )
         );
     }
@@ -218,4 +492,8 @@ public:
 
 DEFINE_ENUM_FLAG_OPERATORS(Motor::Error_t)
 
+void gate_driver_poll_init();
+void gate_driver_poll_start_frame();
+void gate_driver_poll_dispatch_cb(SPI_HandleTypeDef* hspi);
+
 #endif // __MOTOR_HPP
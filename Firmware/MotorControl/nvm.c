@@ -40,9 +40,13 @@
 
 // refer to page 75 of datasheet:
 // http://www.st.com/content/ccc/resource/technical/document/reference_manual/3d/6d/5a/66/b4/99/40/d4/DM00031020.pdf/files/DM00031020.pdf/jcr:content/translations/en.DM00031020.pdf
+#ifndef FLASH_SECTOR_9_BASE // the unit tests map the sectors to RAM (see test/stubs)
+#define FLASH_SECTOR_9_BASE (const volatile uint8_t*)0x80A0000UL
 #define FLASH_SECTOR_10_BASE (const volatile uint8_t*)0x80C0000UL
-#define FLASH_SECTOR_10_SIZE 0x20000UL
 #define FLASH_SECTOR_11_BASE (const volatile uint8_t*)0x80E0000UL
+#endif
+#define FLASH_SECTOR_9_SIZE 0x20000UL
+#define FLASH_SECTOR_10_SIZE 0x20000UL
 #define FLASH_SECTOR_11_SIZE 0x20000UL
 
 #define HAL_FLASH_ClearError() __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR | FLASH_FLAG_PGPERR)
@@ -83,6 +87,32 @@ uint8_t read_sector_; // 0 or 1 to indicate which sector to read from and which
 size_t n_staging_area_; // number of 64-bit values that were reserved using NVM_start_write
 size_t n_valid_; // number of 64-bit fields that can be read
 
+// record log, see NVM_log_init
+#define NVM_LOG_MAGIC 0x31474f4cUL // "LOG1"
+#define NVM_LOG_ID_SECTOR 0xffff   // sector header, the data is the generation
+#define NVM_LOG_MAX_IDS 32
+
+typedef struct {
+    uint32_t magic;
+    uint16_t id;
+    uint16_t length; //!< data length in bytes, the data starts at the next field
+} log_header_t;
+
+typedef struct {
+    uint16_t id;
+    size_t index; //!< header field of the latest record with this ID
+} log_entry_t;
+
+int log_sector_ = -1;               // sector that holds the log, -1 if there is none
+int compaction_sector_ = -1;        // target sector of a compaction in progress, -1 if there is none
+uint32_t log_generation_;           // generation of the log sector, incremented by every compaction
+size_t log_index_;                  // next field to be written to in the log or compaction sector
+log_entry_t log_entries_[NVM_LOG_MAX_IDS];
+size_t n_log_entries_;
+uint16_t append_id_;                // record opened with NVM_log_start_append
+size_t append_index_;
+size_t append_fields_;              // 0 if no record is open
+
 // @brief Erases a flash sector. This sets all bits in the sector to 1.
 // The sector's current index is reset to the minimum value (n_reserved).
 // @returns 0 on success or a non-zero error code otherwise
@@ -110,6 +140,37 @@ fail:
 }
 
 
+// @brief Programs erased flash. The address and length may be unaligned.
+// @returns 0 on success or a non-zero error code otherwise
+int program(uintptr_t address, const uint8_t *data, size_t length) {
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+
+    // handle unaligned start
+    for (; (address & 0x3) && length; ++data, ++address, --length)
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address, *data) != HAL_OK)
+            goto fail;
+
+    // write 32-bit values (64-bit doesn't work)
+    for (; length >= 4; data += 4, address += 4, length -= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, word) != HAL_OK)
+            goto fail;
+    }
+
+    // handle unaligned end
+    for (; length; ++data, ++address, --length)
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address, *data) != HAL_OK)
+            goto fail;
+
+    HAL_FLASH_Lock();
+    return 0;
+fail:
+    HAL_FLASH_Lock();
+    return HAL_FLASH_GetError(); // non-zero
+}
+
 // @brief Writes states into the allocation table.
 // The write operation goes in the direction of increasing indices.
 // @param state: 11: erased, 10: writing, 00: valid data
@@ -239,6 +300,11 @@ int NVM_init(void) {
 // @returns 0 on success or a non-zero error code otherwise
 int NVM_erase(void) {
     read_sector_ = 0;
+    log_sector_ = -1;
+    compaction_sector_ = -1;
+    log_generation_ = 0;
+    n_log_entries_ = 0;
+    append_fields_ = 0;
     sectors[0].index = sectors[0].n_reserved;
     sectors[1].index = sectors[1].n_reserved;
 
@@ -248,6 +314,61 @@ int NVM_erase(void) {
     return state;
 }
 
+// @brief Returns the sector that is reserved for large calibration data
+// (the anti-cogging maps). It is not part of the configuration store and is
+// read directly from flash.
+const volatile uint8_t *NVM_large_data(void) {
+    return FLASH_SECTOR_9_BASE;
+}
+
+size_t NVM_large_data_size(void) {
+    return FLASH_SECTOR_9_SIZE;
+}
+
+int NVM_large_data_erase(void) {
+    FLASH_EraseInitTypeDef erase_struct = {
+        .TypeErase = FLASH_TYPEERASE_SECTORS,
+        .Banks = 0, // only used for mass erase
+        .Sector = FLASH_SECTOR_9,
+        .NbSectors = 1,
+        .VoltageRange = FLASH_VOLTAGE_RANGE_3
+    };
+    uint32_t sector_error;
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+    if (HAL_FLASHEx_Erase(&erase_struct, &sector_error) != HAL_OK)
+        goto fail;
+    HAL_FLASH_Lock();
+    return 0;
+fail:
+    HAL_FLASH_Lock();
+    return HAL_FLASH_GetError(); // non-zero
+}
+
+// @brief Writes to the erased large data sector.
+// @param offset: offset in bytes, must be a multiple of 4
+// @param length: length in bytes, must be a multiple of 4
+// @returns 0 on success or a non-zero error code otherwise
+int NVM_large_data_write(size_t offset, const uint8_t *data, size_t length) {
+    if ((offset & 0x3) || (length & 0x3) || offset + length > FLASH_SECTOR_9_SIZE)
+        return -1;
+
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+    for (; length >= 4; data += 4, offset += 4, length -= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
+                (uintptr_t)FLASH_SECTOR_9_BASE + offset, word) != HAL_OK)
+            goto fail;
+    }
+    HAL_FLASH_Lock();
+    return 0;
+fail:
+    HAL_FLASH_Lock();
+    return HAL_FLASH_GetError(); // non-zero
+}
+
 // @brief Returns the maximum number of bytes that can be read using NVM_read.
 // This holds until NVM_commit is called.
 size_t NVM_get_max_read_length(void) {
@@ -275,6 +396,16 @@ int NVM_read(size_t offset, uint8_t *data, size_t length) {
     return 0;
 }
 
+// @brief Returns the latest committed block in place, for readers that can
+// work on memory mapped flash directly instead of copying it with NVM_read.
+// The pointer is valid until NVM_commit or NVM_erase is called.
+// @param length: receives the length of the block in bytes
+const volatile uint8_t *NVM_get_read_data(size_t *length) {
+    sector_t *read_sector = &sectors[read_sector_];
+    *length = n_valid_ << 3;
+    return (const volatile uint8_t *)&read_sector->data[read_sector->index - n_valid_];
+}
+
 // @brief Starts an atomic write operation.
 //
 // The most recent valid NVM data is not modified or invalidated until NVM_commit is called.
@@ -317,33 +448,7 @@ int NVM_write(size_t offset, uint8_t *data, size_t length) {
     if (offset + length > (n_staging_area_ << 3))
         return -1;
     sector_t *target = &sectors[1 - read_sector_];
-
-    HAL_FLASH_Unlock();
-    HAL_FLASH_ClearError();
-
-    // handle unaligned start
-    for (; (offset & 0x3) && length; ++data, ++offset, --length)
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,
-                ((uintptr_t)&target->data[target->index]) + offset, *data) != HAL_OK)
-            goto fail;
-
-    // write 32-bit values (64-bit doesn't work)
-    for (; length >= 4; data += 4, offset += 4, length -=4)
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
-                ((uintptr_t)&target->data[target->index]) + offset, *(uint32_t*)data) != HAL_OK)
-            goto fail;
-
-    // handle unaligned end
-    for (; length; ++data, ++offset, --length)
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,
-                ((uintptr_t)&target->data[target->index]) + offset, *data) != HAL_OK)
-            goto fail;
-
-    HAL_FLASH_Lock();
-    return 0;
-fail:
-    HAL_FLASH_Lock();
-    return HAL_FLASH_GetError(); // non-zero
+    return program(((uintptr_t)&target->data[target->index]) + offset, data, length);
 }
 
 // @brief Commits the new data to NVM atomically.
@@ -370,6 +475,224 @@ int NVM_commit(void) {
     return status;
 }
 
+/* Record log ---------------------------------------------------------------
+*
+* Instead of one block, the sectors can hold a log of records. Each record is
+* a header field followed by its data. Like a block, it is written atomically:
+* its fields are marked invalid, written and then marked valid. Only the
+* latest record of each ID counts, so single objects are updated by appending
+* a new record.
+*
+* When the active sector is full, the latest version of all objects is
+* written to the other sector (compaction). The new records stay invalid
+* until a sector header record is written, then all of them are marked valid
+* at once and the old sector is erased. On startup, the sector with a sector
+* header and the highest generation holds the log. If neither sector has a
+* sector header, the sectors hold a block (or nothing) instead and the first
+* compaction replaces it.
+*/
+
+field_state_t get_allocation_state(const sector_t *sector, size_t index) {
+    return (field_state_t)((sector->alloc_table[index >> 2] >> ((index & 0x3) << 1)) & 0x3);
+}
+
+sector_t *log_target(void) {
+    int sector = (compaction_sector_ >= 0) ? compaction_sector_ : log_sector_;
+    return (sector >= 0) ? &sectors[sector] : NULL;
+}
+
+void set_log_entry(uint16_t id, size_t index) {
+    for (size_t i = 0; i < n_log_entries_; ++i) {
+        if (log_entries_[i].id == id) {
+            log_entries_[i].index = index;
+            return;
+        }
+    }
+    if (n_log_entries_ < NVM_LOG_MAX_IDS)
+        log_entries_[n_log_entries_++] = (log_entry_t){ .id = id, .index = index };
+}
+
+// @brief Walks the records of a sector. Invalid fields and records that
+// were interrupted are skipped.
+// @param collect: if non-zero, the latest record of each ID is entered into log_entries_
+// @param generation: set to the generation of the sector header, if there is one
+// @param end: set to the first erased field, where the next record goes
+// @returns non-zero if the sector has a valid sector header
+int scan_log(sector_t *sector, int collect, uint32_t *generation, size_t *end) {
+    int has_header = 0;
+    size_t index = sector->n_reserved;
+    if (collect)
+        n_log_entries_ = 0;
+
+    while (index < sector->n_data) {
+        field_state_t state = get_allocation_state(sector, index);
+        if (state == ERASED)
+            break;
+        const volatile log_header_t *header = (const volatile log_header_t *)&sector->data[index];
+        size_t n_fields = 1 + ((header->length + 7) >> 3);
+        int valid = (state == VALID) && (header->magic == NVM_LOG_MAGIC)
+                && (index + n_fields <= sector->n_data);
+        for (size_t i = 1; valid && i < n_fields; ++i)
+            valid = get_allocation_state(sector, index + i) == VALID;
+        if (!valid) {
+            index++;
+            continue;
+        }
+
+        if (header->id == NVM_LOG_ID_SECTOR) {
+            has_header = 1;
+            *generation = *(const volatile uint32_t *)&sector->data[index + 1];
+        } else if (collect) {
+            set_log_entry(header->id, index);
+        }
+        index += n_fields;
+    }
+    *end = index;
+    return has_header;
+}
+
+// @brief Finds the record log.
+// @returns 0 if there is a log or non-zero if the NVM holds a block or nothing
+int NVM_log_init(void) {
+    int has_log[2];
+    uint32_t generation[2] = { 0, 0 };
+    size_t end[2];
+    for (size_t i = 0; i < 2; ++i)
+        has_log[i] = scan_log(&sectors[i], 0, &generation[i], &end[i]);
+
+    compaction_sector_ = -1;
+    append_fields_ = 0;
+    n_log_entries_ = 0;
+    if (has_log[0] && has_log[1]) // a compaction was interrupted before the old sector was erased
+        log_sector_ = ((int32_t)(generation[1] - generation[0]) > 0) ? 1 : 0;
+    else if (has_log[0] || has_log[1])
+        log_sector_ = has_log[1] ? 1 : 0;
+    else
+        log_sector_ = -1;
+    if (log_sector_ < 0) {
+        log_generation_ = 0;
+        return -1;
+    }
+    scan_log(&sectors[log_sector_], 1, &log_generation_, &log_index_);
+    return 0;
+}
+
+// @brief Returns the data of the latest record with the given ID, or NULL
+// if there is none. The data is read directly from flash.
+const volatile uint8_t *NVM_log_find(uint16_t id, size_t *length) {
+    if (log_sector_ < 0)
+        return NULL;
+    sector_t *sector = &sectors[log_sector_];
+    for (size_t i = 0; i < n_log_entries_; ++i) {
+        if (log_entries_[i].id == id) {
+            const volatile log_header_t *header = (const volatile log_header_t *)&sector->data[log_entries_[i].index];
+            *length = header->length;
+            return (const volatile uint8_t *)&sector->data[log_entries_[i].index + 1];
+        }
+    }
+    return NULL;
+}
+
+// @brief Returns the space in bytes that a record with the given data length takes.
+size_t NVM_log_record_size(size_t length) {
+    return (1 + ((length + 7) >> 3)) << 3;
+}
+
+// @brief Returns the space in bytes that is left for records without a compaction.
+size_t NVM_log_free_space(void) {
+    sector_t *target = log_target();
+    if (!target || log_index_ + 1 >= target->n_data)
+        return 0;
+    return (target->n_data - 1 - log_index_) << 3;
+}
+
+// @brief Opens a new record at the end of the log (or the compaction sector).
+// The fields are taken even if the record is never committed.
+// @param length: Data length in bytes
+// @returns 0 on success or a non-zero error code otherwise
+int NVM_log_start_append(uint16_t id, size_t length) {
+    sector_t *target = log_target();
+    if (!target || length > 0xffff)
+        return -1;
+    size_t n_fields = 1 + ((length + 7) >> 3);
+    if (log_index_ + n_fields >= target->n_data)
+        return -1;
+
+    int status = set_allocation_state(target, log_index_, n_fields, INVALID);
+    if (status)
+        return status;
+    append_id_ = id;
+    append_index_ = log_index_;
+    append_fields_ = n_fields;
+    log_index_ += n_fields;
+
+    log_header_t header = { .magic = NVM_LOG_MAGIC, .id = id, .length = (uint16_t)length };
+    return program((uintptr_t)&target->data[append_index_], (const uint8_t *)&header, sizeof(header));
+}
+
+// @brief Writes to the record that was opened with NVM_log_start_append.
+// @param offset: The offset in bytes, 0 being the beginning of the record data.
+int NVM_log_write(size_t offset, const uint8_t *data, size_t length) {
+    sector_t *target = log_target();
+    if (!target || !append_fields_ || offset + length > ((append_fields_ - 1) << 3))
+        return -1;
+    return program(((uintptr_t)&target->data[append_index_ + 1]) + offset, data, length);
+}
+
+// @brief Makes the record that was opened with NVM_log_start_append valid.
+// During a compaction, this is deferred to NVM_log_finish_compaction.
+int NVM_log_commit(void) {
+    sector_t *target = log_target();
+    if (!target || !append_fields_)
+        return -1;
+    int status = 0;
+    if (compaction_sector_ < 0) {
+        status = set_allocation_state(target, append_index_, append_fields_, VALID);
+        if (!status)
+            set_log_entry(append_id_, append_index_);
+    }
+    append_fields_ = 0;
+    return status;
+}
+
+// @brief Erases the sector that doesn't hold the log. The following records
+// go there, until NVM_log_finish_compaction makes it the log sector.
+// Caution: this function may take a long time (like 1 second)
+int NVM_log_start_compaction(void) {
+    int target = (log_sector_ >= 0) ? 1 - log_sector_ : 1 - read_sector_;
+    int status = erase(&sectors[target]);
+    if (status)
+        return status;
+    compaction_sector_ = target;
+    log_index_ = sectors[target].n_reserved;
+    append_fields_ = 0;
+    return 0;
+}
+
+// @brief Writes the sector header, makes the new records valid and erases
+// the old sector. Afterwards, the log is found again with NVM_log_init.
+// Caution: this function may take a long time (like 1 second)
+int NVM_log_finish_compaction(void) {
+    if (compaction_sector_ < 0)
+        return -1;
+    sector_t *target = &sectors[compaction_sector_];
+    uint32_t generation = log_generation_ + 1;
+    int status;
+    if ((status = NVM_log_start_append(NVM_LOG_ID_SECTOR, sizeof(generation))))
+        return status;
+    if ((status = NVM_log_write(0, (const uint8_t *)&generation, sizeof(generation))))
+        return status;
+    if ((status = NVM_log_commit()))
+        return status;
+
+    // The sector header is the last record, so it becomes valid last
+    if ((status = set_allocation_state(target, target->n_reserved, log_index_ - target->n_reserved, VALID)))
+        return status;
+    status = erase(&sectors[1 - compaction_sector_]);
+    status |= NVM_log_init();
+    return status;
+}
+
 
 #include <cmsis_os.h>
 /** @brief Call this at startup to test/demo the NVM driver
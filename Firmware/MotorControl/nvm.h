@@ -21,11 +21,27 @@ int NVM_erase(void);
 size_t NVM_get_max_read_length(void);
 size_t NVM_get_max_write_length(void);
 int NVM_read(size_t offset, uint8_t *data, size_t length);
+const volatile uint8_t *NVM_get_read_data(size_t *length);
 int NVM_start_write(size_t length);
 int NVM_write(size_t offset, uint8_t *data, size_t length);
 int NVM_commit(void);
 void NVM_demo(void);
 
+int NVM_log_init(void);
+const volatile uint8_t *NVM_log_find(uint16_t id, size_t *length);
+size_t NVM_log_record_size(size_t length);
+size_t NVM_log_free_space(void);
+int NVM_log_start_append(uint16_t id, size_t length);
+int NVM_log_write(size_t offset, const uint8_t *data, size_t length);
+int NVM_log_commit(void);
+int NVM_log_start_compaction(void);
+int NVM_log_finish_compaction(void);
+
+const volatile uint8_t *NVM_large_data(void);
+size_t NVM_large_data_size(void);
+int NVM_large_data_erase(void);
+int NVM_large_data_write(size_t offset, const uint8_t *data, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,10 +9,16 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stm32f405xx.h>
 
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
 #include "nvm.h"
 #include <fibre/crc.hpp>
+#include <fibre/protocol.hpp>
 
 
 /* Private defines -----------------------------------------------------------*/
@@ -26,7 +32,8 @@
 /* Private constant data -----------------------------------------------------*/
 
 // IMPORTANT: if you change, reorder or otherwise modify any of the fields in
-// the config structs, make sure to increment this number:
+// the config structs, make sure to increment this number. The fields of the
+// saved configuration are then migrated by their tags (see ConfigRecord_t):
 static constexpr uint16_t config_version = 0x0001;
 
 /* Private variables ---------------------------------------------------------*/
@@ -51,8 +58,7 @@ struct Config<> {
     static size_t get_size() {
         return 0;
     }
-    static int load_config(size_t offset, uint16_t* crc16) {
-        return 0;
+    static void copy_config(const uint8_t* data) {
     }
     static int store_config(size_t offset, uint16_t* crc16) {
         return 0;
@@ -65,22 +71,10 @@ struct Config<T, Ts...> {
         return sizeof(T) + Config<Ts...>::get_size();
     }
 
-    // @brief Loads one or more consecutive objects from the NVM.
-    // During loading this function also calculates the CRC over the loaded data.
-    // @param offset: 0 means that the function should start reading at the beginning
-    // of the last comitted NVM block
-    // @param crc16: the result of the CRC calculation is written to this address
-    // @param val0, vals: the values to be loaded
-    static int load_config(size_t offset, uint16_t* crc16, T* val0, Ts* ... vals) {
-        size_t size = sizeof(T);
-        // save current CRC (in case val0 and crc16 point to the same address)
-        size_t previous_crc16 = *crc16;
-        if (NVM_read(offset, (uint8_t *)val0, size))
-            return -1;
-        *crc16 = calc_crc16<CONFIG_CRC16_POLYNOMIAL>(previous_crc16, (uint8_t *)val0, size);
-        if (Config<Ts...>::load_config(offset + size, crc16, vals...))
-            return -1;
-        return 0;
+    // @brief Copies one or more consecutive objects out of a validated block.
+    static void copy_config(const uint8_t* data, T* val0, Ts* ... vals) {
+        memcpy((void *)val0, data, sizeof(T));
+        Config<Ts...>::copy_config(data + sizeof(T), vals...);
     }
 
     // @brief Stores one or more consecutive objects to the NVM.
@@ -101,17 +95,20 @@ struct Config<T, Ts...> {
         return 0;
     }
 
-    // @brief Loads one or more consecutive objects from the NVM. The loaded data
-    // is validated using a CRC value that is stored at the beginning of the data.
+    // @brief Loads one or more consecutive objects from the NVM. The data is
+    // validated in place in the memory mapped flash using a CRC value that is
+    // stored at the end of the data and only then copied into the objects, so
+    // they are left unchanged if the data is invalid.
     static int safe_load_config(T* val0, Ts* ... vals) {
-        //printf("have %d bytes\r\n", NVM_get_max_read_length()); osDelay(5);
-        if (Config<T, Ts..., uint16_t>::get_size() > NVM_get_max_read_length())
+        size_t length = 0;
+        const uint8_t* data = (const uint8_t *)NVM_get_read_data(&length);
+        size_t size = Config<T, Ts..., uint16_t>::get_size();
+        if (size > length)
             return -1;
-        uint16_t crc16 = CONFIG_CRC16_INIT ^ config_version;
-        if (Config<T, Ts..., uint16_t>::load_config(0, &crc16, val0, vals..., &crc16))
-            return -1;
-        if (crc16)
+        // The CRC over the data and the stored CRC is 0
+        if (calc_crc16<CONFIG_CRC16_POLYNOMIAL>(CONFIG_CRC16_INIT ^ config_version, data, size))
             return -1;
+        copy_config(data, val0, vals...);
         return 0;
     }
 
@@ -138,4 +135,337 @@ struct Config<T, Ts...> {
             return -1;
         return 0;
     }
+
+};
+
+
+// @brief Type code of a tagged field of a ConfigRecord_t
+enum ConfigFieldType_t : uint8_t {
+    CONFIG_FIELD_NONE,
+    CONFIG_FIELD_BOOL,
+    CONFIG_FIELD_UINT8,
+    CONFIG_FIELD_INT8,
+    CONFIG_FIELD_UINT16,
+    CONFIG_FIELD_INT16,
+    CONFIG_FIELD_UINT32,
+    CONFIG_FIELD_INT32,
+    CONFIG_FIELD_UINT64,
+    CONFIG_FIELD_INT64,
+    CONFIG_FIELD_FLOAT,
+    CONFIG_FIELD_ENDPOINT_REF,
+};
+
+static constexpr ConfigFieldType_t get_integer_field_type(size_t size, bool is_signed) {
+    return size == 1 ? (is_signed ? CONFIG_FIELD_INT8 : CONFIG_FIELD_UINT8)
+         : size == 2 ? (is_signed ? CONFIG_FIELD_INT16 : CONFIG_FIELD_UINT16)
+         : size == 4 ? (is_signed ? CONFIG_FIELD_INT32 : CONFIG_FIELD_UINT32)
+         : size == 8 ? (is_signed ? CONFIG_FIELD_INT64 : CONFIG_FIELD_UINT64)
+         : CONFIG_FIELD_NONE;
+}
+
+// Maps the type of a property to its ConfigFieldType_t. Enum properties
+// already arrive as their underlying type (see make_protocol_property).
+template<typename T, typename = void>
+struct ConfigFieldType { static constexpr ConfigFieldType_t value = CONFIG_FIELD_NONE; };
+template<typename T>
+struct ConfigFieldType<T, std::enable_if_t<std::is_integral<T>::value>> {
+    static constexpr ConfigFieldType_t value = std::is_same<T, bool>::value ? CONFIG_FIELD_BOOL
+            : get_integer_field_type(sizeof(T), std::is_signed<T>::value);
+};
+template<>
+struct ConfigFieldType<float> { static constexpr ConfigFieldType_t value = CONFIG_FIELD_FLOAT; };
+template<>
+struct ConfigFieldType<endpoint_ref_t> { static constexpr ConfigFieldType_t value = CONFIG_FIELD_ENDPOINT_REF; };
+
+static inline size_t get_config_field_size(ConfigFieldType_t type) {
+    switch (type) {
+        case CONFIG_FIELD_BOOL: return sizeof(bool);
+        case CONFIG_FIELD_UINT8: case CONFIG_FIELD_INT8: return 1;
+        case CONFIG_FIELD_UINT16: case CONFIG_FIELD_INT16: return 2;
+        case CONFIG_FIELD_UINT32: case CONFIG_FIELD_INT32: return 4;
+        case CONFIG_FIELD_UINT64: case CONFIG_FIELD_INT64: return 8;
+        case CONFIG_FIELD_FLOAT: return sizeof(float);
+        case CONFIG_FIELD_ENDPOINT_REF: return sizeof(endpoint_ref_t);
+        default: return 0;
+    }
+}
+
+template<typename T>
+static T read_config_field(const uint8_t* value) {
+    T result;
+    memcpy(&result, value, sizeof(result));
+    return result;
+}
+
+// @brief Reads a stored numeric field as a double.
+// @returns false if the field is not numeric
+static inline bool config_field_to_double(ConfigFieldType_t type, const uint8_t* value, double* number) {
+    switch (type) {
+        case CONFIG_FIELD_BOOL: *number = read_config_field<bool>(value) ? 1.0 : 0.0; return true;
+        case CONFIG_FIELD_UINT8: *number = read_config_field<uint8_t>(value); return true;
+        case CONFIG_FIELD_INT8: *number = read_config_field<int8_t>(value); return true;
+        case CONFIG_FIELD_UINT16: *number = read_config_field<uint16_t>(value); return true;
+        case CONFIG_FIELD_INT16: *number = read_config_field<int16_t>(value); return true;
+        case CONFIG_FIELD_UINT32: *number = read_config_field<uint32_t>(value); return true;
+        case CONFIG_FIELD_INT32: *number = read_config_field<int32_t>(value); return true;
+        case CONFIG_FIELD_UINT64: *number = read_config_field<uint64_t>(value); return true;
+        case CONFIG_FIELD_INT64: *number = read_config_field<int64_t>(value); return true;
+        case CONFIG_FIELD_FLOAT: *number = read_config_field<float>(value); return true;
+        default: return false;
+    }
+}
+
+// @brief Writes a number to an integer field, rounded and clamped to its range.
+template<typename T>
+static void write_integer_field(void* field, double number) {
+    T result;
+    if (number != number) {
+        result = 0; // NaN
+    } else if (number <= (double)std::numeric_limits<T>::lowest()) {
+        result = std::numeric_limits<T>::lowest();
+    } else if (number >= (double)std::numeric_limits<T>::max()) {
+        result = std::numeric_limits<T>::max();
+    } else {
+        result = (T)std::round(number);
+    }
+    memcpy(field, &result, sizeof(result));
+}
+
+// @brief Converts a stored field to the type of the field in the firmware.
+// Numeric types are converted through a double, other type changes leave
+// the field unchanged.
+static inline void convert_config_field(ConfigFieldType_t type, void* field,
+        ConfigFieldType_t stored_type, const uint8_t* value) {
+    if (type == stored_type) {
+        memcpy(field, value, get_config_field_size(type));
+        return;
+    }
+    double number;
+    if (!config_field_to_double(stored_type, value, &number))
+        return;
+    switch (type) {
+        case CONFIG_FIELD_BOOL: { bool result = number != 0.0; memcpy(field, &result, sizeof(result)); } break;
+        case CONFIG_FIELD_UINT8: write_integer_field<uint8_t>(field, number); break;
+        case CONFIG_FIELD_INT8: write_integer_field<int8_t>(field, number); break;
+        case CONFIG_FIELD_UINT16: write_integer_field<uint16_t>(field, number); break;
+        case CONFIG_FIELD_INT16: write_integer_field<int16_t>(field, number); break;
+        case CONFIG_FIELD_UINT32: write_integer_field<uint32_t>(field, number); break;
+        case CONFIG_FIELD_INT32: write_integer_field<int32_t>(field, number); break;
+        case CONFIG_FIELD_UINT64: write_integer_field<uint64_t>(field, number); break;
+        case CONFIG_FIELD_INT64: write_integer_field<int64_t>(field, number); break;
+        case CONFIG_FIELD_FLOAT: { float result = (float)number; memcpy(field, &result, sizeof(result)); } break;
+        default: break;
+    }
+}
+
+// @brief Receives the writable properties of the object tree that can be
+// stored as tagged config fields, see for_each_config_field().
+class ConfigFieldVisitor {
+public:
+    // @param tag: hash of the path of the property, see hash_path_segment()
+    virtual void visit(uint32_t tag, ConfigFieldType_t type, void* field) = 0;
+
+    template<typename T>
+    void operator()(uint32_t tag, T* property) {
+        constexpr ConfigFieldType_t type = ConfigFieldType<T>::value;
+        if (!std::is_const<T>::value && type != CONFIG_FIELD_NONE)
+            visit(tag, type, (void*)property);
+    }
+};
+
+// @brief Calls the visitor for every property of the published object tree.
+// Does nothing while the tree is not yet published.
+// This is defined in communication.cpp, next to the tree.
+void for_each_config_field(ConfigFieldVisitor& visitor);
+
+// @brief Calls the visitor for every property of the board configuration,
+// with the same tags as for_each_config_field(). This also works before the
+// tree is published. Defined in communication.cpp as well.
+void for_each_board_config_field(ConfigFieldVisitor& visitor);
+
+// @brief Destination of ConfigRecord_t::serialize()
+class ConfigRecordSink {
+public:
+    virtual bool write(size_t offset, const uint8_t* data, size_t length) = 0;
+};
+
+// @brief One configuration object that is stored as a record of the NVM log
+// (see NVM_log_init), so that it is only written again when it changed.
+//
+// The record data is:
+//  - config_version (uint16_t) and the size of the object (uint16_t)
+//  - a copy of the object
+//  - the tagged fields: for every property of the object tree that lies
+//    within the object, the hash of its path (uint32_t), its
+//    ConfigFieldType_t (uint8_t) and its value
+//  - a CRC16 over all of the above (big endian)
+// Multi-byte values are little endian.
+//
+// The copy is loaded as is if the version and size match. Otherwise the
+// object is migrated field by field from the tags once the tree is
+// published, see migrate(). Fields without a tag keep their defaults.
+// The ID of an object must never change.
+struct ConfigRecord_t {
+    static constexpr size_t kHeaderSize = 4;
+    static constexpr size_t kFieldHeaderSize = 5;
+
+    uint16_t id;
+    void* object;
+    size_t size;
+
+    bool contains(const void* field, ConfigFieldType_t type) const {
+        uintptr_t begin = (uintptr_t)object;
+        uintptr_t address = (uintptr_t)field;
+        return address >= begin && address + get_config_field_size(type) <= begin + size;
+    }
+
+    // @brief Writes the record data for a copy of the object.
+    // @param image: the object or a snapshot of it
+    // @param sink: receives the data, nullptr to only calculate the length
+    // @returns the length of the record data, 0 if the sink failed
+    size_t serialize(const uint8_t* image, ConfigRecordSink* sink) const {
+        struct Serializer : ConfigFieldVisitor {
+            const ConfigRecord_t* record;
+            const uint8_t* image;
+            ConfigRecordSink* sink;
+            size_t offset = 0;
+            uint16_t crc = CONFIG_CRC16_INIT;
+            bool ok = true;
+
+            void write(const uint8_t* data, size_t length) {
+                if (sink)
+                    ok = ok && sink->write(offset, data, length);
+                crc = calc_crc16<CONFIG_CRC16_POLYNOMIAL>(crc, data, length);
+                offset += length;
+            }
+            void visit(uint32_t tag, ConfigFieldType_t type, void* field) override {
+                if (!record->contains(field, type))
+                    return;
+                uint8_t header[kFieldHeaderSize] = {
+                    (uint8_t)tag, (uint8_t)(tag >> 8), (uint8_t)(tag >> 16), (uint8_t)(tag >> 24), type
+                };
+                write(header, sizeof(header));
+                write(image + ((uintptr_t)field - (uintptr_t)record->object), get_config_field_size(type));
+            }
+        } serializer;
+        serializer.record = this;
+        serializer.image = image;
+        serializer.sink = sink;
+
+        uint8_t header[kHeaderSize] = {
+            (uint8_t)config_version, (uint8_t)(config_version >> 8), (uint8_t)size, (uint8_t)(size >> 8)
+        };
+        serializer.write(header, sizeof(header));
+        serializer.write(image, size);
+        for_each_config_field(serializer);
+        uint8_t crc_bytes[2] = { (uint8_t)(serializer.crc >> 8), (uint8_t)serializer.crc };
+        serializer.write(crc_bytes, sizeof(crc_bytes));
+        return serializer.ok ? serializer.offset : 0;
+    }
+
+    // @brief Returns the length of the record data in bytes.
+    size_t length() const {
+        return serialize((const uint8_t *)object, nullptr);
+    }
+
+    // @brief Returns the latest record, if its CRC is valid.
+    const uint8_t* find(size_t* length) const {
+        const uint8_t* data = (const uint8_t *)NVM_log_find(id, length);
+        if (!data || *length < kHeaderSize + 2)
+            return nullptr;
+        // The CRC over the data and the stored CRC is 0
+        if (calc_crc16<CONFIG_CRC16_POLYNOMIAL>(CONFIG_CRC16_INIT, data, *length))
+            return nullptr;
+        return data;
+    }
+
+    // @brief Returns true if the copy in the latest record has the current
+    // version and matches the object.
+    bool is_stored() const {
+        size_t stored_length;
+        const uint8_t* data = find(&stored_length);
+        return data && has_current_format(data, stored_length)
+            && !memcmp(data + kHeaderSize, object, size);
+    }
+
+    // @brief Loads the object from the copy in the latest record.
+    // @returns false if there is no record with the current version and
+    // size, the object is unchanged then
+    bool load() const {
+        size_t stored_length;
+        const uint8_t* data = find(&stored_length);
+        if (!data || !has_current_format(data, stored_length))
+            return false;
+        memcpy(object, data + kHeaderSize, size);
+        return true;
+    }
+
+    // @brief Loads every field of the object that has a tag in the latest
+    // record, converting its type if necessary.
+    // @param for_each_field: walks the fields of the object, by default the
+    // published object tree
+    // @returns false if there is no valid record
+    bool migrate(void (*for_each_field)(ConfigFieldVisitor&) = for_each_config_field) const {
+        size_t stored_length;
+        const uint8_t* data = find(&stored_length);
+        if (!data)
+            return false;
+        size_t stored_size = data[2] | (data[3] << 8);
+        if (kHeaderSize + stored_size + 2 > stored_length)
+            return false;
+
+        struct Migrator : ConfigFieldVisitor {
+            const ConfigRecord_t* record;
+            const uint8_t* fields;
+            size_t length;
+
+            void visit(uint32_t tag, ConfigFieldType_t type, void* field) override {
+                if (!record->contains(field, type))
+                    return;
+                for (size_t i = 0; i + kFieldHeaderSize <= length; ) {
+                    uint32_t stored_tag = data_u32(&fields[i]);
+                    ConfigFieldType_t stored_type = (ConfigFieldType_t)fields[i + 4];
+                    size_t field_size = get_config_field_size(stored_type);
+                    if (!field_size || i + kFieldHeaderSize + field_size > length)
+                        return; // unknown type, the rest can't be parsed
+                    if (stored_tag == tag) {
+                        convert_config_field(type, field, stored_type, &fields[i + kFieldHeaderSize]);
+                        return;
+                    }
+                    i += kFieldHeaderSize + field_size;
+                }
+            }
+            static uint32_t data_u32(const uint8_t* data) {
+                return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+            }
+        } migrator;
+        migrator.record = this;
+        migrator.fields = data + kHeaderSize + stored_size;
+        migrator.length = stored_length - kHeaderSize - stored_size - 2;
+        for_each_field(migrator);
+        return true;
+    }
+
+    // @brief Appends a record of a copy of the object to the log.
+    // @param image: the object or a snapshot of it
+    // @returns 0 on success or a non-zero error code otherwise
+    int store(const uint8_t* image) const {
+        struct : ConfigRecordSink {
+            bool write(size_t offset, const uint8_t* data, size_t length) override {
+                return !NVM_log_write(offset, data, length);
+            }
+        } log_sink;
+        size_t length = serialize(image, nullptr);
+        if (NVM_log_start_append(id, length) || serialize(image, &log_sink) != length)
+            return -1;
+        return NVM_log_commit();
+    }
+
+private:
+    bool has_current_format(const uint8_t* data, size_t length) const {
+        uint16_t version = data[0] | (data[1] << 8);
+        size_t stored_size = data[2] | (data[3] << 8);
+        return version == config_version && stored_size == size
+            && kHeaderSize + size + 2 <= length;
+    }
 };
@@ -33,9 +33,12 @@ extern "C" {
 //default timeout waiting for phase measurement signals
 #define PH_CURRENT_MEAS_TIMEOUT 2 // [ms]
 
-//TODO clean this up
-static const float current_meas_period = CURRENT_MEAS_PERIOD;
-static const int current_meas_hz = CURRENT_MEAS_HZ;
+// Control loop timing. These are derived from board_config.pwm_period_clocks
+// by init_pwm_timing() at boot and are constant afterwards.
+extern uint16_t tim_1_8_period_clocks; // [TIM1/TIM8 clocks] half period of the center aligned motor PWM
+extern float current_meas_period;      // [s]
+extern int32_t current_meas_hz;        // [Hz]
+extern float pwm_phase_offset;         // [PWM periods] lag of the M1 carrier behind M0
 // extern const float elec_rad_per_enc;
 extern uint32_t _reboot_cookie;
 extern bool user_config_loaded_;
@@ -47,13 +50,40 @@ typedef struct {
     bool fully_booted;
     uint32_t uptime; // [ms]
     uint32_t min_heap_space; // FreeRTOS heap [Bytes]
-    uint32_t min_stack_space_axis0; // minimum remaining space since startup [Bytes]
-    uint32_t min_stack_space_axis1;
+    uint32_t min_stack_space_axes[AXIS_COUNT]; // minimum remaining space since startup [Bytes]
     uint32_t min_stack_space_comms;
     uint32_t min_stack_space_usb;
+    uint32_t min_stack_space_usb_cdc; // 0 if the thread is not started
     uint32_t min_stack_space_uart;
     uint32_t min_stack_space_usb_irq;
     uint32_t min_stack_space_startup;
+    uint32_t min_stack_space_log;
+    uint32_t total_stack_space; // statically allocated stacks of all threads [Bytes]
+    uint32_t ccm_pool_free;   // remaining space in the CCM pool for objects and tables [Bytes]
+    uint32_t table_pool_free; // remaining space in the SRAM table pool [Bytes]
+    uint32_t table_heap_used; // tables that fit in neither pool and came from the heap [Bytes]
+    uint32_t table_alloc_failures; // number of tables that fit in neither pool nor the heap
+    uint32_t boot_time;  // [ms] from reset until the axis threads are started
+    uint32_t ready_time; // [ms] from reset until all axes finished their startup sequence, 0 before that
+    struct {
+        // Preemption priorities as read back from the NVIC, lower is more urgent (see priorities.h)
+        uint8_t pwm_timer;
+        uint8_t encoder_spi;
+        uint8_t current_sense;
+        uint8_t pwm_input;
+        uint8_t usb;
+        uint8_t can;
+        uint8_t uart;
+        uint8_t i2c;
+        // Thread priorities as read back from the scheduler, higher is more urgent
+        int32_t thread_axes[AXIS_COUNT];
+        int32_t thread_usb_irq;
+        int32_t thread_comms;
+        int32_t thread_usb;
+        int32_t thread_usb_cdc; // osPriorityError unless the ASCII protocol is enabled on USB
+        int32_t thread_uart; // osPriorityError if the UART is disabled
+        int32_t thread_log;
+    } priorities;
 } SystemStats_t;
 extern SystemStats_t system_stats_;
 
@@ -69,6 +99,7 @@ struct PWMMapping_t {
 // @brief general user configurable board configuration
 struct BoardConfig_t {
     bool enable_uart = true;
+    uint32_t uart_baudrate = 115200;   //<! [baud] UART4 baud rate, up to 5250000. Applied at boot (requires save_configuration and a reboot).
     bool enable_i2c_instead_of_can = false;
     bool enable_ascii_protocol_on_usb = true;
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 5 && HW_VERSION_VOLTAGE >= 48
@@ -81,6 +112,40 @@ struct BoardConfig_t {
                                                                         //<! This protects against cases in which the power supply fails to dissipate
                                                                         //<! the brake power if the brake resistor is disabled.
                                                                         //<! The default is 26V for the 24V board version and 52V for the 48V board version.
+    float vbus_filter_tau = 0.002f;      //<! [s] time constant of vbus_voltage_filtered, which the over and undervoltage
+                                         //<! checks and the vbus regulation use, so that they don't trip on spikes
+    float vbus_fast_filter_tau = 0.0f;   //<! [s] time constant of vbus_voltage, which the modulation is compensated with.
+                                         //<! 0 takes the latest ADC average, which follows the ripple of the bus.
+    uint32_t pwm_period_clocks = TIM_1_8_PERIOD_CLOCKS; //<! [TIM1/TIM8 clocks] half period of the motor PWM, which also sets the
+                                                        //<! current measurement rate to TIM_1_8_CLOCK_HZ / (2 * pwm_period_clocks).
+                                                        //<! Applied at boot (requires save_configuration and a reboot).
+    float pwm_phase_offset = 0.25f; //<! [PWM periods] lag of the M1 PWM carrier behind M0. Interleaving the carriers
+                                    //<! spreads the ripple current of the DC bus capacitors over the period. The
+                                    //<! default of a quarter period leaves each axis the same time to compute its
+                                    //<! timings. Values outside [0.1, 0.4] fall back to 0.25, to keep the current
+                                    //<! measurements of the two motors apart. Applied at boot (requires save_configuration and a reboot).
+    bool enable_dual_axis_isr = false; //<! While both axes run their current loop in the ISR (<axis>.config.enable_isr_current_control),
+                                       //<! service both of them from a single interrupt (M1's current measurement).
+                                       //<! This halves the number of interrupts that run control code and lets both
+                                       //<! axis threads be woken up on the same interrupt exit.
+    uint32_t current_oversampling = 1; //<! Number of conversions averaged per phase current sample of M0 (1 to 4).
+                                       //<! Each extra conversion lengthens the sampling window by 0.7us, so
+                                       //<! lower the max_modulation of M0 if the samples leave SVM vector 0.
+                                       //<! M1 always takes a single sample. Applied at boot.
+    bool enable_vbus_regulation = false;  //<! Hold vbus below vbus_regulation_setpoint with the brake resistor, and limit
+                                          //<! the regenerative current of the motors once the brake resistor is saturated.
+    float vbus_regulation_setpoint = 1.04f * HW_VERSION_VOLTAGE; //<! [V] vbus above which the regulator adds brake current.
+                                                                 //<! Keep it below dc_bus_overvoltage_trip_level.
+    float vbus_regulation_gain = 5.0f;    //<! [A/V] additional brake current per volt above the setpoint. The same
+                                          //<! amount is taken off the allowed regenerative current.
+    bool enable_dc_bus_limit = false;     //<! Share dc_bus_current_limit and dc_bus_power_limit between the motors,
+                                          //<! see update_dc_bus_limits()
+    float dc_bus_current_limit = 10.0f;   //<! [A] total current that the motors may draw from the supply
+    float dc_bus_power_limit = 240.0f;    //<! [W] total power that the motors may draw from the supply, applied as a
+                                          //<! current limit at vbus_voltage_filtered. The lower of the two limits applies.
+    bool fast_boot = false; //<! Start the axes as soon as the current sense offsets have converged instead of after 1.5s.
+                            //<! This leaves less time to interrupt the firmware (e.g. to flash a new one)
+                            //<! before the startup sequence runs.
     PWMMapping_t pwm_mappings[GPIO_COUNT];
 };
 extern BoardConfig_t board_config;
@@ -89,13 +154,10 @@ extern bool user_config_loaded_;
 class Axis;
 class Motor;
 
-constexpr size_t AXIS_COUNT = 2;
 extern Axis *axes[AXIS_COUNT];
 
-// if you use the oscilloscope feature you can bump up this value
-#define OSCILLOSCOPE_SIZE 128
-extern float oscilloscope[OSCILLOSCOPE_SIZE];
-extern size_t oscilloscope_pos;
+// total number of floats in the oscilloscope buffer, shared by all channels
+#define OSCILLOSCOPE_SIZE 1024
 
 // TODO: move
 // this is technically not thread-safe but practically it might be
@@ -112,12 +174,29 @@ inline ENUMTYPE operator ~ (ENUMTYPE a) { return static_cast<ENUMTYPE>(~static_c
 // ODrive specific includes
 #include <utils.h>
 #include <low_level.h>
+#include <profiler.hpp>
+#include <cycle_log.hpp>
+#include <axis_snapshot.hpp>
+#include <oscilloscope.hpp>
+#include <trace.hpp>
+#include <logger.hpp>
+#include <cpu_load.hpp>
+#include <pll.hpp>
+#include <thermal_model.hpp>
+#include <input_shaper.hpp>
+#include <path_planner.hpp>
 #include <encoder.hpp>
 #include <sensorless_estimator.hpp>
+#include <fusion_estimator.hpp>
+#include <freq_response.hpp>
+#include <trapTraj.hpp>
+#include <scurveTraj.hpp>
 #include <controller.hpp>
 #include <motor.hpp>
-#include <trapTraj.hpp>
 #include <axis.hpp>
+#include <input_recorder.hpp>
+#include <benchmark.hpp>
+#include <gcode.hpp>
 #include <communication/communication.h>
 
 #endif // __cplusplus
@@ -126,6 +205,21 @@ inline ENUMTYPE operator ~ (ENUMTYPE a) { return static_cast<ENUMTYPE>(~static_c
 // general system functions defined in main.cpp
 void save_configuration(void);
 void erase_configuration(void);
+#ifdef __cplusplus
+bool load_anticogging_map(Axis& axis);
+bool reference_anticogging_map(Axis& axis);
+
+enum ConfigSaveState_t {
+    CONFIG_SAVE_STATE_IDLE,
+    CONFIG_SAVE_STATE_WRITING, //<! save_configuration_async() is writing in the background
+    CONFIG_SAVE_STATE_DONE,
+    CONFIG_SAVE_STATE_FAILED,
+};
+extern volatile ConfigSaveState_t config_save_state_;
+bool save_configuration_async(void);
+extern bool config_migrated_;
+void migrate_configuration(void);
+#endif
 void enter_dfu_mode(void);
 
 #endif /* __ODRIVE_MAIN_H */
@@ -0,0 +1,148 @@
+
+#include "odrive_main.h"
+
+Oscilloscope oscilloscope;
+
+// @brief Looks up the configured channels and starts a new capture.
+// @returns false if no valid channel is configured
+bool Oscilloscope::start() {
+    if (!configure())
+        return false;
+    state_ = STATE_PRETRIGGER;
+    return true;
+}
+
+// @brief Starts recording continuously into the ring buffer, see write_count_.
+// @returns false if no valid channel is configured
+bool Oscilloscope::start_streaming() {
+    if (!configure())
+        return false;
+    // A power of two number of rows stays aligned when write_count_ wraps
+    n_samples_ = 1u << (31 - __builtin_clz(n_samples_));
+    buffer_length_ = n_samples_ * n_channels_ * sizeof(float);
+    state_ = STATE_STREAMING;
+    return true;
+}
+
+// @brief Stops the capture and prepares a new one from config_.
+bool Oscilloscope::configure() {
+    if (input_recorder.active())
+        return false;
+    stop();
+    input_recorder.discard(); // the capture overwrites the recording
+
+    size_t n_channels = 0;
+    for (; n_channels < kMaxChannels; ++n_channels) {
+        Endpoint* endpoint = get_endpoint(config_.channels[n_channels]);
+        float value;
+        if (!endpoint || !endpoint->get_as_float(&value))
+            break;
+        endpoints_[n_channels] = endpoint;
+    }
+    if (n_channels == 0 || config_.trigger_channel >= n_channels)
+        return false;
+
+    n_channels_ = n_channels;
+    n_samples_ = OSCILLOSCOPE_SIZE / n_channels;
+    buffer_length_ = n_samples_ * n_channels_ * sizeof(float);
+    if (config_.decimation < 1)
+        config_.decimation = 1;
+    if (config_.pretrigger_samples >= n_samples_)
+        config_.pretrigger_samples = n_samples_ - 1;
+    sample_period_ = current_meas_period * config_.decimation;
+
+    row_ = 0;
+    write_count_ = 0;
+    recorded_rows_ = 0;
+    decimation_cnt_ = 0;
+    force_trigger_ = false;
+    last_trigger_value_ = NAN; // the first row can't be an edge
+    had_error_ = true; // only new errors trigger
+    return true;
+}
+
+// @brief Aborts the capture, the buffer keeps what was recorded so far.
+void Oscilloscope::stop() {
+    state_ = STATE_IDLE;
+}
+
+// @brief Triggers the capture regardless of the trigger condition.
+void Oscilloscope::trigger() {
+    force_trigger_ = true;
+}
+
+bool Oscilloscope::is_triggered(float value) {
+    bool triggered = force_trigger_;
+    switch (config_.trigger_mode) {
+        case TRIGGER_IMMEDIATE: {
+            triggered = true;
+        } break;
+        case TRIGGER_RISING: {
+            triggered |= last_trigger_value_ < config_.trigger_level && value >= config_.trigger_level;
+        } break;
+        case TRIGGER_FALLING: {
+            triggered |= last_trigger_value_ > config_.trigger_level && value <= config_.trigger_level;
+        } break;
+        case TRIGGER_ERROR: {
+            bool error = false;
+            for (size_t i = 0; i < AXIS_COUNT; ++i)
+                error |= axes[i]->error_ != Axis::ERROR_NONE || axes[i]->motor_.error_ != Motor::ERROR_NONE;
+            triggered |= error && !had_error_;
+            had_error_ = error;
+        } break;
+    }
+    last_trigger_value_ = value;
+    return triggered;
+}
+
+// @brief Records one row of samples.
+// This is called from the current measurement interrupt.
+void Oscilloscope::sample() {
+    State_t state = state_;
+    if (state == STATE_IDLE || state == STATE_DONE)
+        return;
+    if (++decimation_cnt_ < config_.decimation)
+        return;
+    decimation_cnt_ = 0;
+
+    // Once the history is recorded, every new row is checked for the trigger
+    if (state == STATE_PRETRIGGER && recorded_rows_ >= config_.pretrigger_samples)
+        state = STATE_ARMED;
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->snapshot_buffer_.read(&snapshots_[i]);
+    float* row = &buffer_[row_ * n_channels_];
+    for (size_t i = 0; i < n_channels_; ++i)
+        endpoints_[i]->get_as_float(&row[i]);
+    // The later rows follow at sample_period_ on the same clock
+    if (recorded_rows_ == 0)
+        first_row_time_us_ = micros64();
+    uint32_t this_row = row_;
+    row_ = (row_ + 1) % n_samples_;
+    write_count_ = write_count_ + 1;
+    if (recorded_rows_ < n_samples_)
+        ++recorded_rows_;
+    if (state == STATE_STREAMING)
+        return;
+
+    if (state == STATE_PRETRIGGER) {
+        last_trigger_value_ = row[config_.trigger_channel];
+    } else if (state == STATE_ARMED) {
+        if (is_triggered(row[config_.trigger_channel])) {
+            trigger_row_ = this_row;
+            trigger_time_us_ = micros64();
+            remaining_rows_ = n_samples_ - config_.pretrigger_samples - 1;
+            state = STATE_TRIGGERED;
+        }
+    } else if (state == STATE_TRIGGERED) {
+        --remaining_rows_;
+    }
+
+    // The buffer is full at this point: pretrigger_samples rows before the
+    // trigger row and the rest after it.
+    if (state == STATE_TRIGGERED && remaining_rows_ == 0) {
+        start_row_ = row_;
+        state = STATE_DONE;
+    }
+    state_ = state;
+}
@@ -0,0 +1,129 @@
+#ifndef __OSCILLOSCOPE_HPP
+#define __OSCILLOSCOPE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Triggered multi-channel capture of numeric properties.
+//
+// Any numeric property of the object tree can be selected as a channel.
+// The channels are sampled as floats once per current measurement period
+// (after both axes were serviced), divided by config_.decimation.
+//
+// After start(), the capture keeps a history of pretrigger_samples and then
+// waits for the trigger condition on the trigger channel. Once triggered, it
+// fills the rest of the buffer and stops. The buffer then holds n_samples_
+// rows of n_channels_ floats. It is a ring buffer, the oldest row is at
+// start_row_. Read it out in bulk through the "buffer" endpoint, see
+// capture_oscilloscope in tools/odrive/utils.py.
+//
+// After start_streaming(), the capture records continuously without a
+// trigger. write_count_ counts the rows, row k is at k % n_samples_ and was
+// sampled at k * sample_period_. The host follows write_count_ and reads the
+// new rows before they are overwritten, see OscilloscopeSource in
+// tools/odrive/utils.py.
+//
+// Before each row, the newest snapshot of each axis is copied to
+// snapshots_ (the "axis0", "axis1", ... objects). Channels on these are from
+// the same control loop iteration, unlike the live encoder and controller
+// properties, which may be sampled while the axis thread updates them.
+class Oscilloscope {
+public:
+    static constexpr size_t kMaxChannels = 4;
+
+    enum State_t {
+        STATE_IDLE,
+        STATE_PRETRIGGER, //<! recording the history before the trigger
+        STATE_ARMED,      //<! waiting for the trigger condition
+        STATE_TRIGGERED,  //<! recording the samples after the trigger
+        STATE_DONE,
+        STATE_STREAMING,  //<! recording continuously, see start_streaming()
+    };
+
+    enum TriggerMode_t {
+        TRIGGER_IMMEDIATE, //<! trigger as soon as the history is recorded
+        TRIGGER_RISING,    //<! the trigger channel crosses trigger_level upwards
+        TRIGGER_FALLING,   //<! the trigger channel crosses trigger_level downwards
+        TRIGGER_ERROR,     //<! an axis or motor error occurs
+    };
+
+    struct Config_t {
+        endpoint_ref_t channels[kMaxChannels]; //<! sampled properties, the first invalid one ends the list
+        uint32_t decimation = 1;               //<! record every n-th current measurement
+        TriggerMode_t trigger_mode = TRIGGER_IMMEDIATE;
+        uint32_t trigger_channel = 0;
+        float trigger_level = 0.0f;
+        uint32_t pretrigger_samples = 0;       //<! number of samples before the trigger
+    };
+
+    bool start();
+    bool start_streaming();
+    void stop();
+    void trigger();
+    void sample();
+
+    Config_t config_;
+
+    float buffer_[OSCILLOSCOPE_SIZE] = { 0.0f };
+    size_t buffer_length_ = 0;       // [bytes] valid part of the buffer
+    volatile State_t state_ = STATE_IDLE;
+    uint32_t n_channels_ = 0;
+    uint32_t n_samples_ = 0;         // number of rows
+    uint32_t start_row_ = 0;         // oldest row, valid in STATE_DONE
+    uint32_t trigger_row_ = 0;       // row of the trigger sample, valid in STATE_DONE
+    float sample_period_ = 0.0f;     // [s]
+    volatile uint32_t write_count_ = 0; // rows written since the start, wraps around
+    uint64_t first_row_time_us_ = 0; // [us] micros64() at the first row since the start
+    uint64_t trigger_time_us_ = 0;   // [us] micros64() at the trigger row, valid in STATE_DONE
+    AxisSnapshot_t snapshots_[AXIS_COUNT] = {};
+
+#define OSCILLOSCOPE_AXIS_SNAPSHOT(i, snapshots) make_protocol_object("axis" #i, make_axis_snapshot_definitions(snapshots[i])),
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_object("config",
+                make_protocol_property("channel0", &config_.channels[0]),
+                make_protocol_property("channel1", &config_.channels[1]),
+                make_protocol_property("channel2", &config_.channels[2]),
+                make_protocol_property("channel3", &config_.channels[3]),
+                make_protocol_property("decimation", &config_.decimation),
+                make_protocol_property("trigger_mode", &config_.trigger_mode),
+                make_protocol_property("trigger_channel", &config_.trigger_channel),
+                make_protocol_property("trigger_level", &config_.trigger_level),
+                make_protocol_property("pretrigger_samples", &config_.pretrigger_samples)
+            ),
+            make_protocol_ro_property("state", const_cast<State_t*>(&state_)),
+            make_protocol_ro_property("n_channels", &n_channels_),
+            make_protocol_ro_property("n_samples", &n_samples_),
+            make_protocol_ro_property("start_row", &start_row_),
+            make_protocol_ro_property("trigger_row", &trigger_row_),
+            make_protocol_ro_property("sample_period", &sample_period_),
+            make_protocol_ro_property("write_count", const_cast<uint32_t*>(&write_count_)),
+            make_protocol_ro_property("first_row_time_us", &first_row_time_us_),
+            make_protocol_ro_property("trigger_time_us", &trigger_time_us_),
+            make_protocol_buffer("buffer", buffer_, &buffer_length_),
+            FOR_EACH_AXIS(OSCILLOSCOPE_AXIS_SNAPSHOT, snapshots_)
+            make_protocol_function("start", *this, &Oscilloscope::start),
+            make_protocol_function("start_streaming", *this, &Oscilloscope::start_streaming),
+            make_protocol_function("stop", *this, &Oscilloscope::stop),
+            make_protocol_function("trigger", *this, &Oscilloscope::trigger)
+        );
+    }
+
+private:
+    bool configure();
+    bool is_triggered(float value);
+
+    Endpoint* endpoints_[kMaxChannels] = { nullptr };
+    uint32_t row_ = 0;               // next row to be written
+    uint32_t recorded_rows_ = 0;     // rows recorded since the start, saturates at n_samples_
+    uint32_t remaining_rows_ = 0;    // rows left to record after the trigger
+    uint32_t decimation_cnt_ = 0;
+    float last_trigger_value_ = 0.0f;
+    volatile bool force_trigger_ = false;
+    bool had_error_ = false;
+};
+
+extern Oscilloscope oscilloscope;
+
+#endif // __OSCILLOSCOPE_HPP
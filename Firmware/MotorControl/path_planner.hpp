@@ -0,0 +1,310 @@
+#ifndef __PATH_PLANNER_HPP
+#define __PATH_PLANNER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+// This header does not depend on the rest of the firmware so that it can
+// be tested on the host (see test/run_tests.cpp).
+
+// @brief Look-ahead planner for a path of straight lines and dwells through
+// kAxes dimensions, such as the G-code moves of the ASCII protocol.
+//
+// Each line accelerates, cruises and decelerates along its length with a
+// trapezoidal speed profile. The speed at a corner is limited like in Grbl:
+// by the junction deviation, the distance from the corner that a circular
+// arc tangent to both lines would keep at the speed's centripetal
+// acceleration. Straight junctions pass at full speed, reversals and
+// dwells stop.
+//
+// After every push, the speeds at the junctions are replanned over all
+// buffered segments: a backward pass from a stop after the last segment and
+// a forward pass from the segment in progress, so that every segment can
+// reach its exit speed within its length. The segment in progress is
+// frozen, its profile is computed when it starts.
+//
+// The planner is driven by eval() with a monotonic tick, e.g. the
+// current measurement count. It doesn't synchronize, the caller must.
+template<size_t kAxes>
+class PathPlanner {
+public:
+    static constexpr size_t kLength = 16;
+
+    struct Segment_t {
+        float start[kAxes];    // [units]
+        float dir[kAxes];      // unit vector along the line, 0 for a dwell
+        float length;          // [units], 0 for a dwell
+        float dwell;           // [s] of a dwell
+        float vel_limit;       // [units/s] along the line
+        float accel;           // [units/s^2] along the line
+        float entry_vel_limit; // [units/s] at the junction with the previous segment
+        float entry_vel;       // [units/s] planned
+        float exit_vel;        // [units/s] planned, the entry_vel of the next segment
+        // Speed profile, computed by plan_profile() when the segment starts
+        float cruise_vel;      // [units/s]
+        float t_accel;         // [s]
+        float t_cruise;        // [s]
+        float duration;        // [s]
+    };
+
+    // @brief Empties the planner and places the path at pos [units]
+    void reset(const float pos[kAxes]) {
+        clear();
+        for (size_t i = 0; i < kAxes; ++i)
+            end_pos_[i] = last_pos_[i] = pos[i];
+    }
+
+    // @brief Drops all segments, including the one in progress. The path
+    // ends where it was last evaluated.
+    void clear() {
+        if (running_) {
+            for (size_t i = 0; i < kAxes; ++i)
+                end_pos_[i] = last_pos_[i];
+        }
+        count_ = 0;
+        running_ = false;
+        executing_ = false;
+    }
+
+    size_t count() const { return count_; }
+    size_t free_slots() const { return kLength - count_; }
+    bool running() const { return running_; }
+    const float* end_pos() const { return end_pos_; }
+
+    // @brief Appends a line from the end of the path to target [units].
+    // The speed along the line is limited to feed [units/s] and each axis
+    // to its vel_limits [units/s], the acceleration of each axis to its
+    // accel_limits [units/s^2]. feed <= 0 only applies the axis limits.
+    // A line of zero length is accepted and does nothing.
+    // @param junction_deviation: [units] see the class description
+    // @returns false if the buffer is full or the limits are invalid
+    bool push_line(const float target[kAxes], float feed, const float vel_limits[kAxes],
+            const float accel_limits[kAxes], float junction_deviation) {
+        if (count_ >= kLength)
+            return false;
+        Segment_t& s = segments_[(read_ + count_) % kLength];
+        float length_sq = 0.0f;
+        for (size_t i = 0; i < kAxes; ++i) {
+            s.dir[i] = target[i] - end_pos_[i];
+            length_sq += s.dir[i] * s.dir[i];
+        }
+        float length = std::sqrt(length_sq);
+        if (!(length > 0.0f))
+            return true;
+
+        float vel_limit = feed > 0.0f ? feed : INFINITY;
+        float accel = INFINITY;
+        for (size_t i = 0; i < kAxes; ++i) {
+            s.dir[i] /= length;
+            float share = std::fabs(s.dir[i]);
+            if (share > 0.0f) {
+                vel_limit = std::min(vel_limit, vel_limits[i] / share);
+                accel = std::min(accel, accel_limits[i] / share);
+            }
+        }
+        if (!(vel_limit > 0.0f && vel_limit < INFINITY) || !(accel > 0.0f && accel < INFINITY))
+            return false;
+
+        for (size_t i = 0; i < kAxes; ++i)
+            s.start[i] = end_pos_[i];
+        s.length = length;
+        s.dwell = 0.0f;
+        s.vel_limit = vel_limit;
+        s.accel = accel;
+        s.entry_vel_limit = 0.0f;
+        if (count_ > 0) {
+            const Segment_t& prev = segments_[(read_ + count_ - 1) % kLength];
+            if (prev.length > 0.0f)
+                s.entry_vel_limit = junction_vel_limit(prev, s, junction_deviation);
+        }
+        for (size_t i = 0; i < kAxes; ++i)
+            end_pos_[i] = target[i];
+        ++count_;
+        replan();
+        return true;
+    }
+
+    // @brief Appends a stop of duration [s] at the end of the path
+    // @returns false if the buffer is full or the duration is negative
+    bool push_dwell(float duration) {
+        if (count_ >= kLength || !(duration >= 0.0f))
+            return false;
+        Segment_t& s = segments_[(read_ + count_) % kLength];
+        for (size_t i = 0; i < kAxes; ++i) {
+            s.start[i] = end_pos_[i];
+            s.dir[i] = 0.0f;
+        }
+        s.length = 0.0f;
+        s.dwell = duration;
+        s.vel_limit = 0.0f;
+        s.accel = 0.0f;
+        s.entry_vel_limit = 0.0f;
+        ++count_;
+        replan();
+        return true;
+    }
+
+    // @brief Starts the path at tick. Until then, eval() holds the start.
+    void start_at(uint64_t tick) {
+        seg_tick_ = tick;
+        seg_offset_ = 0.0f;
+        running_ = true;
+        executing_ = false;
+    }
+
+    // @brief Evaluates the path at tick, which must not decrease between
+    // calls, and drops the segments that have ended.
+    // @param tick_period: [s] per tick
+    // @param pos, vel, accel: [units], [units/s], [units/s^2] per axis
+    // @returns false once the path has ended, pos is then its end
+    bool eval(uint64_t tick, float tick_period, float pos[kAxes], float vel[kAxes], float accel[kAxes]) {
+        if (!running_ || count_ == 0) {
+            running_ = false;
+            for (size_t i = 0; i < kAxes; ++i) {
+                pos[i] = last_pos_[i] = end_pos_[i];
+                vel[i] = accel[i] = 0.0f;
+            }
+            return false;
+        }
+
+        float t = local_time(tick, tick_period);
+        for (;;) {
+            Segment_t& s = segments_[read_];
+            if (t < 0.0f) {
+                // Waiting for the start
+                sample(s, 0.0f, pos, vel, accel);
+                return true;
+            }
+            if (!executing_) {
+                plan_profile(s);
+                executing_ = true;
+            }
+            if (t < s.duration)
+                break;
+            // The segment has ended, the next one starts at its end time
+            float end = seg_offset_ + s.duration;
+            float ticks = std::floor(end / tick_period);
+            seg_tick_ += (uint64_t)ticks;
+            seg_offset_ = std::max(end - ticks * tick_period, 0.0f);
+            read_ = (read_ + 1) % kLength;
+            --count_;
+            executing_ = false;
+            if (count_ == 0)
+                return eval(tick, tick_period, pos, vel, accel);
+            t = local_time(tick, tick_period);
+        }
+        sample(segments_[read_], t, pos, vel, accel);
+        return true;
+    }
+
+    Segment_t segments_[kLength];
+    size_t read_ = 0;        // index of the oldest segment, the one in progress
+    size_t count_ = 0;       // number of buffered segments, including the one in progress
+    bool running_ = false;   // start_at() was called and the path hasn't ended
+    bool executing_ = false; // the profile of segments_[read_] is computed and frozen
+    uint64_t seg_tick_ = 0;  // the segments_[read_] starts seg_offset_ after this tick
+    float seg_offset_ = 0.0f; // [s]
+    float end_pos_[kAxes] = { 0.0f };  // [units] end of the last segment
+    float last_pos_[kAxes] = { 0.0f }; // [units] position of the last eval()
+
+private:
+    // @brief Speed limit at the corner from prev to next
+    static float junction_vel_limit(const Segment_t& prev, const Segment_t& next, float junction_deviation) {
+        float max_vel = std::min(prev.vel_limit, next.vel_limit);
+        float cos_theta = 0.0f; // of the angle between the lines, 1 for a reversal
+        for (size_t i = 0; i < kAxes; ++i)
+            cos_theta -= prev.dir[i] * next.dir[i];
+        if (cos_theta < -0.999999f)
+            return max_vel; // straight on
+        if (cos_theta > 0.999999f || !(junction_deviation > 0.0f))
+            return 0.0f;
+        float sin_half = std::sqrt(0.5f * (1.0f - cos_theta));
+        float accel = std::min(prev.accel, next.accel);
+        return std::min(std::sqrt(accel * junction_deviation * sin_half / (1.0f - sin_half)), max_vel);
+    }
+
+    float local_time(uint64_t tick, float tick_period) const {
+        return (float)(int64_t)(tick - seg_tick_) * tick_period - seg_offset_;
+    }
+
+    // @brief Plans the entry and exit speeds of the segments after the frozen one
+    void replan() {
+        size_t first = executing_ ? 1 : 0;
+        if (first >= count_)
+            return;
+        float vel = 0.0f; // entry speed of the segment after the current one
+        for (size_t k = count_; k-- > first;) {
+            Segment_t& s = segments_[(read_ + k) % kLength];
+            s.exit_vel = vel;
+            s.entry_vel = std::min(s.entry_vel_limit, std::sqrt(vel * vel + 2.0f * s.accel * s.length));
+            vel = s.entry_vel;
+        }
+        vel = executing_ ? segments_[read_].exit_vel : 0.0f;
+        for (size_t k = first; k < count_; ++k) {
+            Segment_t& s = segments_[(read_ + k) % kLength];
+            s.entry_vel = std::min(s.entry_vel, vel);
+            s.exit_vel = std::min(s.exit_vel, std::sqrt(s.entry_vel * s.entry_vel + 2.0f * s.accel * s.length));
+            vel = s.exit_vel;
+        }
+    }
+
+    // @brief Computes the trapezoidal speed profile from entry_vel to exit_vel
+    static void plan_profile(Segment_t& s) {
+        if (!(s.length > 0.0f)) {
+            s.cruise_vel = 0.0f;
+            s.t_accel = s.t_cruise = 0.0f;
+            s.duration = s.dwell;
+            return;
+        }
+        float v0 = s.entry_vel;
+        float v1 = s.exit_vel;
+        float a = s.accel;
+        float peak = std::sqrt(a * s.length + 0.5f * (v0 * v0 + v1 * v1));
+        float vc = std::max(std::min(s.vel_limit, peak), std::max(v0, v1));
+        float d_accel = (vc * vc - v0 * v0) / (2.0f * a);
+        float d_decel = (vc * vc - v1 * v1) / (2.0f * a);
+        float d_cruise = std::max(s.length - d_accel - d_decel, 0.0f);
+        s.cruise_vel = vc;
+        s.t_accel = (vc - v0) / a;
+        s.t_cruise = d_cruise / vc;
+        s.duration = s.t_accel + s.t_cruise + (vc - v1) / a;
+    }
+
+    // @brief Evaluates segment s at t [s] after its start
+    void sample(const Segment_t& s, float t, float pos[kAxes], float vel[kAxes], float accel[kAxes]) {
+        float dist, v, a;
+        if (!(s.length > 0.0f) || t <= 0.0f) {
+            dist = 0.0f;
+            v = (s.length > 0.0f) ? s.entry_vel : 0.0f;
+            a = 0.0f;
+        } else if (t < s.t_accel) {
+            dist = t * (s.entry_vel + 0.5f * s.accel * t);
+            v = s.entry_vel + s.accel * t;
+            a = s.accel;
+        } else if (t < s.t_accel + s.t_cruise) {
+            dist = 0.5f * (s.entry_vel + s.cruise_vel) * s.t_accel + s.cruise_vel * (t - s.t_accel);
+            v = s.cruise_vel;
+            a = 0.0f;
+        } else if (t < s.duration) {
+            float td = t - s.t_accel - s.t_cruise;
+            dist = 0.5f * (s.entry_vel + s.cruise_vel) * s.t_accel + s.cruise_vel * s.t_cruise
+                    + td * (s.cruise_vel - 0.5f * s.accel * td);
+            v = s.cruise_vel - s.accel * td;
+            a = -s.accel;
+        } else {
+            dist = s.length;
+            v = s.exit_vel;
+            a = 0.0f;
+        }
+        dist = std::min(dist, s.length);
+        for (size_t i = 0; i < kAxes; ++i) {
+            pos[i] = last_pos_[i] = s.start[i] + s.dir[i] * dist;
+            vel[i] = s.dir[i] * v;
+            accel[i] = s.dir[i] * a;
+        }
+    }
+};
+
+#endif // __PATH_PLANNER_HPP
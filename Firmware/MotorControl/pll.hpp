@@ -0,0 +1,149 @@
+#ifndef __PLL_HPP
+#define __PLL_HPP
+
+#include <stdint.h>
+#include <cmath>
+#include <type_traits>
+
+// This header does not depend on the rest of the firmware so that it can
+// be tested and benchmarked on the host (see test/run_tests.cpp).
+
+enum PllMode_t {
+    PLL_MODE_LINEAR, //<! the position is unbounded
+    PLL_MODE_WRAP,   //<! the position wraps around within one period
+};
+
+// @brief Critically damped second order tracking PLL.
+//
+// The PLL only holds the gains. The position and velocity state stays with
+// the estimator that owns it, so that several positions can be tracked with
+// the same gains (e.g. the encoder's linear and in-turn positions).
+//
+// One update consists of predict(), the computation of the phase error by
+// the caller (see error()) and correct().
+//
+// T is a floating point type. See the int32_t specialization for fixed point.
+template<typename T, PllMode_t Mode>
+class Pll {
+    static_assert(std::is_floating_point<T>::value, "use Pll<int32_t, PLL_MODE_WRAP> for fixed point");
+
+public:
+    typedef T pos_t;
+    typedef T vel_t;
+
+    // @brief Sets the gains for the given bandwidth [rad/s] and update period [s].
+    void set_bandwidth(float bandwidth, float dt) {
+        kp_ = (T)2 * (T)bandwidth;
+        ki_ = (T)0.25 * (kp_ * kp_);
+        dt_ = (T)dt;
+        kp_dt_ = kp_ * dt_;
+        ki_dt_ = ki_ * dt_;
+    }
+
+    // @brief Sets the range [min, min + period) of the position in PLL_MODE_WRAP.
+    void set_period(T period, T min) {
+        period_ = period;
+        min_ = min;
+    }
+
+    // @brief Returns false if the discrete time approximation breaks down at this bandwidth.
+    bool is_stable() const { return kp_dt_ < (T)1; }
+
+    void predict(T& pos, T vel) const {
+        pos = wrap(pos + dt_ * vel);
+    }
+
+    // @brief Returns the phase error, wrapped to [-period/2, period/2) in PLL_MODE_WRAP.
+    T error(T measured, T pos) const {
+        return wrap_error(measured - pos);
+    }
+
+    T wrap_error(T err) const {
+        if (Mode == PLL_MODE_WRAP) {
+            const T half_period = (T)0.5 * period_;
+            if (err >= half_period || err < -half_period)
+                err -= period_ * std::floor(err / period_ + (T)0.5);
+        }
+        return err;
+    }
+
+    void correct(T& pos, T& vel, T err) const {
+        pos = wrap(pos + kp_dt_ * err);
+        vel += ki_dt_ * err;
+    }
+
+    // @brief Corrects a position that shares its velocity with another one.
+    void correct_pos(T& pos, T err) const {
+        pos = wrap(pos + kp_dt_ * err);
+    }
+
+    T kp_ = (T)0;    // [1/s]
+    T ki_ = (T)0;    // [1/s^2]
+
+private:
+    T wrap(T pos) const {
+        // Positions written from outside may be far out of range,
+        // so this must not loop.
+        if (Mode == PLL_MODE_WRAP) {
+            if (pos >= min_ + period_ || pos < min_)
+                pos -= period_ * std::floor((pos - min_) / period_);
+        }
+        return pos;
+    }
+
+    T dt_ = (T)0;
+    T kp_dt_ = (T)0;
+    T ki_dt_ = (T)0;
+    T period_ = (T)1;
+    T min_ = (T)0;
+};
+
+// @brief Fixed point PLL for angles.
+//
+// The position is an int32_t where one period is 2^32, so wrapping comes for
+// free with two's complement arithmetic. The velocity is kept in units of
+// 2^-32 position LSB per update to avoid losing small velocities.
+// Use vel_to_float() to convert it to position LSB per second.
+template<>
+class Pll<int32_t, PLL_MODE_WRAP> {
+public:
+    typedef int32_t pos_t;
+    typedef int64_t vel_t;
+
+    void set_bandwidth(float bandwidth, float dt) {
+        float kp_dt = 2.0f * bandwidth * dt;
+        kp_dt_q32_ = (int64_t)(kp_dt * 4294967296.0f);
+        ki_dt2_q32_ = (int64_t)(0.25f * (kp_dt * kp_dt) * 4294967296.0f);
+        dt_ = dt;
+    }
+
+    bool is_stable() const { return kp_dt_q32_ < ((int64_t)1 << 32); }
+
+    void predict(int32_t& pos, int64_t vel) const {
+        pos = (int32_t)((uint32_t)pos + (uint32_t)((vel + ((int64_t)1 << 31)) >> 32));
+    }
+
+    int32_t error(int32_t measured, int32_t pos) const {
+        return (int32_t)((uint32_t)measured - (uint32_t)pos);
+    }
+
+    void correct(int32_t& pos, int64_t& vel, int32_t err) const {
+        correct_pos(pos, err);
+        vel += (int64_t)err * ki_dt2_q32_;
+    }
+
+    void correct_pos(int32_t& pos, int32_t err) const {
+        pos = (int32_t)((uint32_t)pos + (uint32_t)(((int64_t)err * kp_dt_q32_ + ((int64_t)1 << 31)) >> 32));
+    }
+
+    float vel_to_float(int64_t vel) const {
+        return (float)vel * (1.0f / 4294967296.0f) / dt_;
+    }
+
+private:
+    int64_t kp_dt_q32_ = 0;
+    int64_t ki_dt2_q32_ = 0;
+    float dt_ = 1.0f;
+};
+
+#endif // __PLL_HPP
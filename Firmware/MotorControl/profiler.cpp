@@ -0,0 +1,48 @@
+
+#include "odrive_main.h"
+
+Profiler profiler;
+
+void ProfilerSection::record(uint32_t cycles) {
+    size_t bin = 0;
+    if (cycles >> kFirstBinLog2) {
+        bin = (31 - __builtin_clz(cycles)) - kFirstBinLog2 + 1;
+        if (bin >= kNumBins)
+            bin = kNumBins - 1;
+    }
+
+    // Sections are recorded from both threads and interrupts, up to the current measurement
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    count_++;
+    total_ += cycles;
+    last_ = cycles;
+    if (cycles < min_) min_ = cycles;
+    bool new_max = cycles > max_;
+    if (new_max) max_ = cycles;
+    mean_ += ((float)cycles - mean_) / (float)count_;
+    histogram_[bin]++;
+    cpu_exit_masked_critical(basepri);
+
+    // Only new maxima are traced, which keeps the event rate low
+    if (new_max)
+        trace.emit(Trace::EVENT_PROFILER_MAX, Trace::kNoAxis, this - profiler.sections_, cycles);
+}
+
+void ProfilerSection::reset() {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    *this = ProfilerSection();
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Enables the DWT cycle counter.
+// The counter is not reset, because it is also the FreeRTOS run time stats
+// clock, which runs since the scheduler started (see cpu_load.cpp).
+void Profiler::init() {
+    configure_run_time_counter();
+    cpu_hz_ = HAL_RCC_GetHCLKFreq();
+}
+
+void Profiler::reset() {
+    for (size_t i = 0; i < SECTION_NUM_SECTIONS; ++i)
+        sections_[i].reset();
+}
@@ -0,0 +1,109 @@
+#ifndef __PROFILER_HPP
+#define __PROFILER_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Execution time statistics of one code section, in CPU cycles.
+//
+// The histogram has logarithmic bins: bin 0 counts executions shorter than
+// 2^kFirstBinLog2 cycles, each following bin covers twice the range of the
+// previous one and the last bin collects everything above.
+class ProfilerSection {
+public:
+    static constexpr size_t kNumBins = 8;
+    static constexpr uint32_t kFirstBinLog2 = 8; // bin 0: [0, 256) cycles
+
+    void record(uint32_t cycles);
+    void reset();
+
+    uint32_t count_ = 0;
+    uint32_t total_ = 0;         // [cycles] sum of all executions, wraps around (see CpuLoad)
+    uint32_t last_ = 0;          // [cycles]
+    uint32_t min_ = UINT32_MAX;  // [cycles]
+    uint32_t max_ = 0;           // [cycles]
+    float mean_ = 0.0f;          // [cycles]
+    uint32_t histogram_[kNumBins] = { 0 };
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("count", &count_),
+            make_protocol_ro_property("last", &last_),
+            make_protocol_ro_property("min", &min_),
+            make_protocol_ro_property("max", &max_),
+            make_protocol_ro_property("mean", &mean_),
+            make_protocol_object("histogram",
+                make_protocol_ro_property("bin0", &histogram_[0]),
+                make_protocol_ro_property("bin1", &histogram_[1]),
+                make_protocol_ro_property("bin2", &histogram_[2]),
+                make_protocol_ro_property("bin3", &histogram_[3]),
+                make_protocol_ro_property("bin4", &histogram_[4]),
+                make_protocol_ro_property("bin5", &histogram_[5]),
+                make_protocol_ro_property("bin6", &histogram_[6]),
+                make_protocol_ro_property("bin7", &histogram_[7])
+            )
+        );
+    }
+};
+
+// @brief Cycle accurate profiler for the control loop hot path,
+// based on the Cortex-M4 DWT cycle counter.
+//
+// Note that a section that gets preempted by an interrupt also accounts
+// for the time spent in the interrupt.
+class Profiler {
+public:
+    enum Section_t {
+        SECTION_ADC_CB,
+        SECTION_ENCODER_UPDATE,
+        SECTION_SENSORLESS_UPDATE,
+        SECTION_CONTROLLER_UPDATE,
+        SECTION_FOC_CURRENT,
+        SECTION_SVM,
+        SECTION_THREAD_WAKEUP, // from the current measurement ISR until the axis thread runs
+        SECTION_NUM_SECTIONS
+    };
+
+    void init();
+    void reset();
+
+    ProfilerSection sections_[SECTION_NUM_SECTIONS];
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("cpu_hz", &cpu_hz_),
+            make_protocol_object("adc_cb", sections_[SECTION_ADC_CB].make_protocol_definitions()),
+            make_protocol_object("encoder_update", sections_[SECTION_ENCODER_UPDATE].make_protocol_definitions()),
+            make_protocol_object("sensorless_update", sections_[SECTION_SENSORLESS_UPDATE].make_protocol_definitions()),
+            make_protocol_object("controller_update", sections_[SECTION_CONTROLLER_UPDATE].make_protocol_definitions()),
+            make_protocol_object("foc_current", sections_[SECTION_FOC_CURRENT].make_protocol_definitions()),
+            make_protocol_object("svm", sections_[SECTION_SVM].make_protocol_definitions()),
+            make_protocol_object("thread_wakeup", sections_[SECTION_THREAD_WAKEUP].make_protocol_definitions()),
+            make_protocol_function("reset", *this, &Profiler::reset)
+        );
+    }
+
+    uint32_t cpu_hz_ = 0;
+};
+
+extern Profiler profiler;
+
+// @brief Records the CPU cycles spent between construction and
+// destruction of this object into a profiler section.
+class ProfilerScope {
+public:
+    explicit ProfilerScope(Profiler::Section_t section) :
+        section_(profiler.sections_[section]), start_(DWT->CYCCNT) {}
+    explicit ProfilerScope(ProfilerSection& section) :
+        section_(section), start_(DWT->CYCCNT) {}
+    ~ProfilerScope() { section_.record(DWT->CYCCNT - start_); }
+
+    uint32_t elapsed() const { return DWT->CYCCNT - start_; }
+
+private:
+    ProfilerSection& section_;
+    uint32_t start_;
+};
+
+#endif // __PROFILER_HPP
@@ -0,0 +1,153 @@
+#include <math.h>
+#include "odrive_main.h"
+#include "utils.h"
+
+// Symbol                     Description
+// Ta, Tv and Td              Duration of the acceleration, coast and deceleration stages
+// Xi, Vi and Ai              Initial conditions
+// Xf                         Position set-point
+// s                          Direction (sign) of the trajectory
+// Vmax, Amax, Dmax and Jmax  Kinematic bounds
+// Vr                         Reached velocity
+
+void SCurveTrajectory::VelocityRamp_t::plan(float v_start, float v_end, float Amax, float Jmax) {
+    v0 = v_start;
+    v1 = v_end;
+    float dV = fabsf(v1 - v0);
+    float s = (v1 >= v0) ? 1.0f : -1.0f;
+    if (dV >= SQ(Amax) / Jmax) {
+        // The peak acceleration is reached
+        Tj = Amax / Jmax;
+        Tc = dV / Amax - Tj;
+        a = s * Amax;
+    } else {
+        Tj = sqrtf(dV / Jmax);
+        Tc = 0.0f;
+        a = s * Jmax * Tj;
+    }
+    j = s * Jmax;
+    T = 2.0f * Tj + Tc;
+    // The velocity is point symmetric around the middle of the ramp
+    dX = 0.5f * (v0 + v1) * T;
+}
+
+SCurveTrajectory::Step_t SCurveTrajectory::VelocityRamp_t::eval(float t) const {
+    Step_t step;
+    if (t < Tj) {  // Jerk phase
+        step.Y   = v0*t + j*t*t*t*(1.0f/6.0f);
+        step.Yd  = v0 + 0.5f*j*SQ(t);
+        step.Ydd = j*t;
+    } else if (t < Tj + Tc) {  // Constant acceleration
+        float tc = t - Tj;
+        float vj = v0 + 0.5f*j*SQ(Tj);
+        step.Y   = v0*Tj + j*Tj*Tj*Tj*(1.0f/6.0f) + vj*tc + 0.5f*a*SQ(tc);
+        step.Yd  = vj + a*tc;
+        step.Ydd = a;
+    } else if (t < T) {  // Jerk phase, mirrored from the end
+        float u = T - t;
+        step.Y   = dX - (v1*u - j*u*u*u*(1.0f/6.0f));
+        step.Yd  = v1 - 0.5f*j*SQ(u);
+        step.Ydd = j*u;
+    } else {
+        step.Y   = dX;
+        step.Yd  = v1;
+        step.Ydd = 0.0f;
+    }
+    return step;
+}
+
+bool SCurveTrajectory::planSCurve(float Xf, float Xi, float Vi, float Ai,
+                                  float Vmax, float Amax, float Dmax, float Jmax) {
+    // A move that starts accelerating continues with that acceleration by
+    // starting t0 into its first jerk phase: (Xi, Vi, Ai) is the state t0
+    // after a virtual start at zero acceleration. This only fits if the
+    // plan from the virtual start accelerates the same way for at least t0,
+    // otherwise the acceleration steps.
+    if (Ai != 0.0f && Jmax > 0.0f) {
+        float a0 = std::max(std::min(Ai, Amax), -Amax);
+        float j = std::copysign(Jmax, a0);
+        float t0 = fabsf(a0) / Jmax;
+        float v_start = Vi - 0.5f*j*SQ(t0);
+        float x_start = Xi - (v_start*t0 + j*t0*t0*t0*(1.0f/6.0f));
+        planZeroAccel(Xf, x_start, v_start, Vmax, Amax, Dmax, Jmax);
+        if (accel_.j == j && accel_.Tj >= t0) {
+            t0_ = t0;
+            return true;
+        }
+    }
+    planZeroAccel(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax);
+    t0_ = 0.0f;
+    return true;
+}
+
+void SCurveTrajectory::planZeroAccel(float Xf, float Xi, float Vi,
+                                     float Vmax, float Amax, float Dmax, float Jmax) {
+    float dX = Xf - Xi;  // Distance to travel
+    VelocityRamp_t stop;
+    stop.plan(Vi, 0.0f, Dmax, Jmax);
+    float s = (dX - stop.dX < 0.0f) ? -1.0f : 1.0f; // Sign of coast velocity (if any)
+
+    // Displacement of accelerating to the signed velocity v and stopping from there
+    auto displacement = [&](float v) {
+        VelocityRamp_t up, down;
+        up.plan(Vi, v, Amax, Jmax);
+        down.plan(v, 0.0f, Dmax, Jmax);
+        return up.dX + down.dX;
+    };
+
+    Vr_ = s * Vmax;
+    float dXmin = displacement(Vr_);
+    if (s*dX >= s*dXmin) {
+        // Long move, coast at Vmax
+        Tv_ = (dX - dXmin) / Vr_;
+    } else {
+        // Short move, find the peak velocity by bisection.
+        // The displacement grows with the peak velocity.
+        float lo = std::max(0.0f, std::min(s * Vi, Vmax));
+        float hi = Vmax;
+        for (int i = 0; i < 32; ++i) {
+            float mid = 0.5f * (lo + hi);
+            if (s*displacement(s * mid) < s*dX)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        Vr_ = s * lo;
+        Tv_ = 0.0f;
+    }
+
+    accel_.plan(Vi, Vr_, Amax, Jmax);
+    decel_.plan(Vr_, 0.0f, Dmax, Jmax);
+
+    // Fill in the rest of the values used at evaluation-time
+    Ta_ = accel_.T;
+    Td_ = decel_.T;
+    Tf_ = Ta_ + Tv_ + Td_;
+    Xi_ = Xi;
+    Xf_ = Xf;
+    yAccel_ = Xi + accel_.dX; // pos at end of accel phase
+}
+
+SCurveTrajectory::Step_t SCurveTrajectory::eval(float t) {
+    Step_t trajStep;
+    if (t < 0.0f) {  // Initial Condition
+        trajStep.Y   = Xi_;
+        trajStep.Yd  = accel_.v0;
+        trajStep.Ydd = 0.0f;
+    } else if (t < Ta_) {  // Accelerating
+        trajStep = accel_.eval(t);
+        trajStep.Y += Xi_;
+    } else if (t < Ta_ + Tv_) {  // Coasting
+        trajStep.Y   = yAccel_ + Vr_*(t - Ta_);
+        trajStep.Yd  = Vr_;
+        trajStep.Ydd = 0.0f;
+    } else if (t < Tf_) {  // Deceleration, relative to the end point
+        trajStep = decel_.eval(t - Ta_ - Tv_);
+        trajStep.Y += Xf_ - decel_.dX;
+    } else {  // Final Condition
+        trajStep.Y   = Xf_;
+        trajStep.Yd  = 0.0f;
+        trajStep.Ydd = 0.0f;
+    }
+    return trajStep;
+}
@@ -0,0 +1,52 @@
+#ifndef _SCURVE_TRAJ_H
+#define _SCURVE_TRAJ_H
+
+// @brief Jerk limited (S-curve) point to point trajectory.
+//
+// Same structure as TrapezoidalTrajectory (accelerate, coast, decelerate),
+// but each velocity change is a jerk limited ramp, so the acceleration and
+// with it the A_per_css feed forward current are continuous.
+class SCurveTrajectory {
+public:
+    typedef TrapezoidalTrajectory::Step_t Step_t;
+
+    // @brief Velocity change from v0 to v1 with bounded acceleration and jerk.
+    // The acceleration ramps up for Tj, stays at its peak for Tc and ramps down for Tj.
+    struct VelocityRamp_t {
+        float v0;
+        float v1;
+        float a;     // signed peak acceleration
+        float j;     // signed jerk
+        float Tj;
+        float Tc;
+        float T;     // total duration
+        float dX;    // displacement
+
+        void plan(float v_start, float v_end, float Amax, float Jmax);
+        Step_t eval(float t) const;
+    };
+
+    bool planSCurve(float Xf, float Xi, float Vi, float Ai,
+                    float Vmax, float Amax, float Dmax, float Jmax);
+    void planZeroAccel(float Xf, float Xi, float Vi,
+                       float Vmax, float Amax, float Dmax, float Jmax);
+    Step_t eval(float t);
+
+    float Xi_;
+    float Xf_;
+    float Vr_;
+
+    VelocityRamp_t accel_;
+    VelocityRamp_t decel_;
+
+    float Ta_;
+    float Tv_;
+    float Td_;
+    float Tf_;
+
+    float yAccel_;
+
+    float t0_ = 0.0f; // [s] time of the initial conditions in the plan, > 0 if it starts accelerating
+};
+
+#endif
@@ -3,7 +3,60 @@
 
 SensorlessEstimator::SensorlessEstimator(Config_t& config) :
         config_(config)
-    {};
+{
+    update_pll_gains();
+    update_observer_gains();
+};
+
+void SensorlessEstimator::update_pll_gains() {
+    pll_.set_bandwidth(config_.pll_bandwidth, current_meas_period);
+    pll_bandwidth_ = config_.pll_bandwidth;
+    pll_.set_period(2.0f * M_PI, -M_PI);
+    hfi_pll_.set_bandwidth(config_.hfi_bandwidth, current_meas_period);
+    hfi_pll_.set_period(2.0f * M_PI, -M_PI);
+}
+
+void SensorlessEstimator::update_observer_gains() {
+    pm_flux_sqr_ = config_.pm_flux_linkage * config_.pm_flux_linkage;
+    float bandwidth_factor = 1.0f / pm_flux_sqr_;
+    observer_scale_ = 0.5f * (config_.observer_gain * bandwidth_factor);
+    observer_gain_ = config_.observer_gain;
+}
+
+// @brief Interpolates the observer gain and the PLL bandwidth from
+// config_.gain_schedule at |vel_estimate_|. Outside of the range of the
+// points, the first or last point applies. Without points, the constant
+// config_.observer_gain and config_.pll_bandwidth apply.
+// A high gain makes the observer converge at low speed, where the back-EMF
+// is small, a lower one rejects the measurement noise at high speed.
+// The gains are only recomputed when they change.
+void SensorlessEstimator::update_gain_schedule() {
+    int32_t n = std::min(config_.gain_schedule_points, (int32_t)kGainScheduleSize);
+    float observer_gain = config_.observer_gain;
+    float pll_bandwidth = config_.pll_bandwidth;
+    if (n > 0) {
+        float vel = fabsf(vel_estimate_);
+        const GainSchedulePoint_t* points = config_.gain_schedule;
+        int32_t i = 0;
+        while (i < n - 2 && vel >= points[i + 1].vel)
+            ++i;
+        const GainSchedulePoint_t& p0 = points[i];
+        const GainSchedulePoint_t& p1 = points[std::min(i + 1, n - 1)];
+        float frac = 0.0f;
+        if (p1.vel > p0.vel)
+            frac = std::max(std::min((vel - p0.vel) / (p1.vel - p0.vel), 1.0f), 0.0f);
+        observer_gain = p0.observer_gain + frac * (p1.observer_gain - p0.observer_gain);
+        pll_bandwidth = p0.pll_bandwidth + frac * (p1.pll_bandwidth - p0.pll_bandwidth);
+    }
+    if (observer_gain != observer_gain_) {
+        observer_scale_ = 0.5f * observer_gain / pm_flux_sqr_;
+        observer_gain_ = observer_gain;
+    }
+    if (pll_bandwidth != pll_bandwidth_) {
+        pll_.set_bandwidth(pll_bandwidth, current_meas_period);
+        pll_bandwidth_ = pll_bandwidth;
+    }
+}
 
 bool SensorlessEstimator::update() {
     // Algorithm based on paper: Sensorless Control of Surface-Mount Permanent-Magnet Synchronous Motors Based on a Nonlinear Observer
@@ -13,6 +66,14 @@ bool SensorlessEstimator::update() {
     // The V_alpha_beta applied immedietly prior to the current measurement associated with this cycle
     // is the one computed two cycles ago. To get the correct measurement, it was stored twice:
     // once by final_v_alpha/final_v_beta in the current control reporting, and once by V_alpha_beta_memory.
+    // That holds for the default PWM timing, where the timings are applied from one to two periods
+    // after their current sample (Motor::pwm_delay_ of 1.5 periods). For a shorter delay the last
+    // period also saw part of the voltage computed one cycle ago, so the two are blended.
+    const Motor::CurrentControl_t& ictrl = axis_->motor_.current_control_;
+    float memory_weight = std::min(std::max(axis_->motor_.pwm_delay_ / current_meas_period - 0.5f, 0.0f), 1.0f);
+    float V_alpha_beta[2] = {
+        memory_weight * V_alpha_beta_memory_[0] + (1.0f - memory_weight) * ictrl.final_v_alpha,
+        memory_weight * V_alpha_beta_memory_[1] + (1.0f - memory_weight) * ictrl.final_v_beta * axis_->motor_.config_.direction};
 
     // Clarke transform
     float I_alpha_beta[2] = {
@@ -22,11 +83,13 @@ bool SensorlessEstimator::update() {
     // Swap sign of I_beta if motor is reversed
     I_alpha_beta[1] *= axis_->motor_.config_.direction;
 
+    update_gain_schedule();
+
     // alpha-beta vector operations
     float eta[2];
     for (int i = 0; i <= 1; ++i) {
         // y is the total flux-driving voltage (see paper eqn 4)
-        float y = -axis_->motor_.config_.phase_resistance * I_alpha_beta[i] + V_alpha_beta_memory_[i];
+        float y = -axis_->motor_.config_.phase_resistance * I_alpha_beta[i] + V_alpha_beta[i];
         // flux dynamics (prediction)
         float x_dot = y;
         // integrate prediction to current timestep
@@ -37,10 +100,8 @@ bool SensorlessEstimator::update() {
     }
 
     // Non-linear observer (see paper eqn 8):
-    float pm_flux_sqr = config_.pm_flux_linkage * config_.pm_flux_linkage;
     float est_pm_flux_sqr = eta[0] * eta[0] + eta[1] * eta[1];
-    float bandwidth_factor = 1.0f / pm_flux_sqr;
-    float eta_factor = 0.5f * (config_.observer_gain * bandwidth_factor) * (pm_flux_sqr - est_pm_flux_sqr);
+    float eta_factor = observer_scale_ * (pm_flux_sqr_ - est_pm_flux_sqr);
 
     // alpha-beta vector operations
     for (int i = 0; i <= 1; ++i) {
@@ -53,29 +114,82 @@ bool SensorlessEstimator::update() {
     }
 
     // Flux state estimation done, store V_alpha_beta for next timestep
-    V_alpha_beta_memory_[0] = axis_->motor_.current_control_.final_v_alpha;
-    V_alpha_beta_memory_[1] = axis_->motor_.current_control_.final_v_beta * axis_->motor_.config_.direction;
+    V_alpha_beta_memory_[0] = ictrl.final_v_alpha;
+    V_alpha_beta_memory_[1] = ictrl.final_v_beta * axis_->motor_.config_.direction;
 
     // PLL
-    // TODO: the PLL part has some code duplication with the encoder PLL
-    // Pll gains as a function of bandwidth
-    float pll_kp = 2.0f * config_.pll_bandwidth;
-    // Critically damped
-    float pll_ki = 0.25f * (pll_kp * pll_kp);
     // Check that we don't get problems with discrete time approximation
-    if (!(current_meas_period * pll_kp < 1.0f)) {
+    if (!pll_.is_stable()) {
         error_ |= ERROR_UNSTABLE_GAIN;
         return false;
     }
 
     // predict PLL phase with velocity
-    pll_pos_ = wrap_pm_pi(pll_pos_ + current_meas_period * vel_estimate_);
+    pll_.predict(pll_pos_, vel_estimate_);
     // update PLL phase with observer permanent magnet phase
     phase_ = fast_atan2(eta[1], eta[0]);
-    float delta_phase = wrap_pm_pi(phase_ - pll_pos_);
-    pll_pos_ = wrap_pm_pi(pll_pos_ + current_meas_period * pll_kp * delta_phase);
-    // update PLL velocity
-    vel_estimate_ += current_meas_period * pll_ki * delta_phase;
+    float delta_phase = pll_.error(phase_, pll_pos_);
+    pll_.correct(pll_pos_, vel_estimate_, delta_phase);
+
+    // Below hfi_max_vel the HFI tracker replaces the back-EMF observer (with some hysteresis)
+    if (config_.enable_hfi) {
+        if (hfi_active_ && fabsf(hfi_vel_) > config_.hfi_max_vel) {
+            hfi_active_ = false;
+        } else if (!hfi_active_ && fabsf(vel_estimate_) < 0.8f * config_.hfi_max_vel) {
+            hfi_active_ = true;
+            hfi_phase_ = pll_pos_;
+            hfi_vel_ = vel_estimate_;
+            hfi_I_prev_[0] = I_alpha_beta[0];
+            hfi_I_prev_[1] = I_alpha_beta[1];
+        }
+    } else {
+        hfi_active_ = false;
+    }
+
+    if (hfi_active_) {
+        update_hfi(I_alpha_beta);
+        phase_ = hfi_phase_;
+        pll_pos_ = hfi_phase_;
+        vel_estimate_ = hfi_vel_;
+        // Keep the observer consistent with the HFI angle for a smooth handover
+        float c, s;
+        fast_sincos(hfi_phase_, &s, &c);
+        flux_state_[0] = config_.pm_flux_linkage * c + axis_->motor_.config_.phase_inductance * I_alpha_beta[0];
+        flux_state_[1] = config_.pm_flux_linkage * s + axis_->motor_.config_.phase_inductance * I_alpha_beta[1];
+    }
 
     return true;
 };
+
+// @brief Tracks the rotor angle from the response to the d axis square wave
+// injected by Motor::FOC_current.
+//
+// In the estimated frame, a voltage step V on the d axis changes the current by
+//   dI_d = V*T * (cos^2(err)/Ld + sin^2(err)/Lq)
+//   dI_q = V*T * sin(2*err)/2 * (1/Ld - 1/Lq)
+// where err is the angle error. So dI_q / dI_d is about saliency * err.
+// The sign of the injection is multiplied out to remove the fundamental.
+void SensorlessEstimator::update_hfi(const float I_alpha_beta[2]) {
+    // The current change since the last measurement was caused by the voltage
+    // computed two cycles ago. As the injection alternates, that is the same
+    // sign as the one the motor is going to apply next.
+    float sign = axis_->motor_.hfi_sign_;
+    float dI_alpha = I_alpha_beta[0] - hfi_I_prev_[0];
+    float dI_beta = I_alpha_beta[1] - hfi_I_prev_[1];
+    hfi_I_prev_[0] = I_alpha_beta[0];
+    hfi_I_prev_[1] = I_alpha_beta[1];
+
+    float c, s;
+    fast_sincos(hfi_phase_, &s, &c);
+    hfi_dI_d_ = sign * (c * dI_alpha + s * dI_beta);
+    float dI_q = sign * (c * dI_beta - s * dI_alpha);
+    hfi_dI_d_filt_ += 0.1f * (hfi_dI_d_ - hfi_dI_d_filt_);
+
+    float err = 0.0f;
+    if (hfi_dI_d_filt_ > 1e-3f)
+        err = dI_q / (hfi_dI_d_filt_ * config_.hfi_saliency);
+    err = std::max(std::min(err, 1.0f), -1.0f);
+
+    hfi_pll_.predict(hfi_phase_, hfi_vel_);
+    hfi_pll_.correct(hfi_phase_, hfi_vel_, err);
+}
@@ -6,17 +6,45 @@ public:
     enum Error_t {
         ERROR_NONE = 0,
         ERROR_UNSTABLE_GAIN = 0x01,
+        ERROR_FLUX_IDENTIFICATION_FAILED = 0x02,
     };
 
+    // @brief Gains at |vel_estimate_| = vel, see update_gain_schedule()
+    struct GainSchedulePoint_t {
+        float vel = 0.0f;              // [rad/s] electrical
+        float observer_gain = 1000.0f; // [rad/s]
+        float pll_bandwidth = 1000.0f; // [rad/s]
+    };
+    static constexpr size_t kGainScheduleSize = 4;
+
     struct Config_t {
         float observer_gain = 1000.0f; // [rad/s]
         float pll_bandwidth = 1000.0f;  // [rad/s]
         float pm_flux_linkage = 1.58e-3f; // [V / (rad/s)]  { 5.51328895422 / (<pole pairs> * <rpm/v>) }
+
+        // High frequency injection (HFI) for low speed, requires a salient motor (Ld < Lq)
+        bool enable_hfi = false;
+        float hfi_voltage = 2.0f;           // [V] amplitude of the injected square wave
+        float hfi_bandwidth = 200.0f;       // [rad/s] angle tracking bandwidth
+        float hfi_saliency = 0.2f;          // (Lq - Ld) / Lq, normalizes the demodulated angle error
+        float hfi_max_vel = 300.0f;         // [rad/s] above this the back-EMF observer takes over
+        float hfi_converge_time = 0.1f;     // [s] tracking time before the polarity detection
+        float hfi_polarity_current = 5.0f;  // [A] d axis current used for the polarity detection
+        float hfi_polarity_time = 0.05f;    // [s] duration of each polarity detection pulse
+
+        // Speed dependent observer gain and PLL bandwidth, which replace the two above.
+        // The points must be sorted by vel.
+        int32_t gain_schedule_points = 0;   //<! number of gain_schedule points used, 0 for the constant gains
+        GainSchedulePoint_t gain_schedule[kGainScheduleSize];
     };
 
     SensorlessEstimator(Config_t& config);
 
     bool update();
+    void update_hfi(const float I_alpha_beta[2]);
+    void update_pll_gains();
+    void update_observer_gains();
+    void update_gain_schedule();
 
     Axis* axis_ = nullptr; // set by Axis constructor
     Config_t& config_;
@@ -26,11 +54,29 @@ public:
     float phase_ = 0.0f;                        // [rad]
     float pll_pos_ = 0.0f;                      // [rad]
     float vel_estimate_ = 0.0f;                      // [rad/s]
-    // float pll_kp_ = 0.0f;                       // [rad/s / rad]
-    // float pll_ki_ = 0.0f;                       // [(rad/s^2) / rad]
+    Pll<float, PLL_MODE_WRAP> pll_;             // pll_pos_ and vel_estimate_
+    Pll<float, PLL_MODE_WRAP> hfi_pll_;         // hfi_phase_ and hfi_vel_
+    float pm_flux_sqr_ = 0.0f;                  // [(Vs)^2]
+    float observer_scale_ = 0.0f;               // [rad/s / (Vs)^2] 0.5 * observer_gain_ / pm_flux_sqr
+    float observer_gain_ = 0.0f;                // [rad/s] in use, from the config or the gain schedule
+    float pll_bandwidth_ = 0.0f;                // [rad/s] in use, from the config or the gain schedule
     float flux_state_[2] = {0.0f, 0.0f};        // [Vs]
     float V_alpha_beta_memory_[2] = {0.0f, 0.0f}; // [V]
     bool estimator_good_ = false;
+    bool hfi_active_ = false;                   // phase_, pll_pos_ and vel_estimate_ come from the HFI tracker
+    float hfi_phase_ = 0.0f;                    // [rad]
+    float hfi_vel_ = 0.0f;                      // [rad/s]
+    float hfi_dI_d_ = 0.0f;                     // [A] demodulated d axis current response of the last cycle
+    float hfi_dI_d_filt_ = 0.0f;                // [A]
+    float hfi_I_prev_[2] = {0.0f, 0.0f};        // [A]
+
+    static auto make_gain_schedule_point_definitions(GainSchedulePoint_t& point) {
+        return make_protocol_member_list(
+            make_protocol_property("vel", &point.vel),
+            make_protocol_property("observer_gain", &point.observer_gain),
+            make_protocol_property("pll_bandwidth", &point.pll_bandwidth)
+        );
+    }
 
     // Communication protocol definitions
     auto make_protocol_definitions() {
@@ -39,12 +85,36 @@ public:
             make_protocol_property("phase", &phase_),
             make_protocol_property("pll_pos", &pll_pos_),
             make_protocol_property("vel_estimate", &vel_estimate_),
-            // make_protocol_property("pll_kp", &pll_kp_),
-            // make_protocol_property("pll_ki", &pll_ki_),
+            make_protocol_ro_property("observer_gain", &observer_gain_),
+            make_protocol_ro_property("pll_bandwidth", &pll_bandwidth_),
+            make_protocol_ro_property("hfi_active", &hfi_active_),
+            make_protocol_ro_property("hfi_phase", &hfi_phase_),
+            make_protocol_ro_property("hfi_vel", &hfi_vel_),
+            // make_protocol_property("pll_kp", &pll_.kp_),
+            // make_protocol_property("pll_ki", &pll_.ki_),
             make_protocol_object("config",
-                make_protocol_property("observer_gain", &config_.observer_gain),
-                make_protocol_property("pll_bandwidth", &config_.pll_bandwidth),
-                make_protocol_property("pm_flux_linkage", &config_.pm_flux_linkage)
+                make_protocol_property("observer_gain", &config_.observer_gain,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_observer_gains(); }, this),
+                make_protocol_property("pll_bandwidth", &config_.pll_bandwidth,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_pll_gains(); }, this),
+                make_protocol_property("pm_flux_linkage", &config_.pm_flux_linkage,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_observer_gains(); }, this),
+                make_protocol_property("enable_hfi", &config_.enable_hfi),
+                make_protocol_property("hfi_voltage", &config_.hfi_voltage),
+                make_protocol_property("hfi_bandwidth", &config_.hfi_bandwidth,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_pll_gains(); }, this),
+                make_protocol_property("hfi_saliency", &config_.hfi_saliency),
+                make_protocol_property("hfi_max_vel", &config_.hfi_max_vel),
+                make_protocol_property("hfi_converge_time", &config_.hfi_converge_time),
+                make_protocol_property("hfi_polarity_current", &config_.hfi_polarity_current),
+                make_protocol_property("hfi_polarity_time", &config_.hfi_polarity_time),
+                make_protocol_property("gain_schedule_points", &config_.gain_schedule_points),
+                make_protocol_object("gain_schedule",
+                    make_protocol_object("point0", make_gain_schedule_point_definitions(config_.gain_schedule[0])),
+                    make_protocol_object("point1", make_gain_schedule_point_definitions(config_.gain_schedule[1])),
+                    make_protocol_object("point2", make_gain_schedule_point_definitions(config_.gain_schedule[2])),
+                    make_protocol_object("point3", make_gain_schedule_point_definitions(config_.gain_schedule[3]))
+                )
             )
         );
     }
@@ -0,0 +1,54 @@
+tup.include('../../fibre/tupfiles/build.lua')
+
+-- Host build of the hardware independent MotorControl code.
+-- The stubs directory stands in for the RTOS and HAL headers.
+motorcontrol_tests = define_package{
+    sources={'run_tests.cpp', '../utils.c', '../nvm.c'},
+    headers={'stubs', '..', '../../fibre/cpp/include'},
+    cpp_flags={'-std=c++14'},
+    libs={'m'}
+}
+
+-- Host simulation of the full motor control stack (motor, encoder,
+-- controller, axis state machine and the current measurement interrupts)
+-- against an average value model of two motors. sim/stubs stands in for the
+-- HAL, CMSIS and RTOS headers, sim/sim_hal.cpp for the peripherals.
+motorcontrol_sim = define_package{
+    sources={
+        'sim/run_sim.cpp', 'sim/sim_hal.cpp',
+        '../motor.cpp', '../encoder.cpp', '../controller.cpp',
+        '../sensorless_estimator.cpp', '../fusion_estimator.cpp',
+        '../freq_response.cpp', '../trapTraj.cpp', '../scurveTraj.cpp',
+        '../axis.cpp',
+        '../low_level.cpp', '../profiler.cpp', '../trace.cpp',
+        '../cycle_log.cpp', '../oscilloscope.cpp', '../benchmark.cpp', '../gcode.cpp', '../input_recorder.cpp',
+        '../logger.cpp',
+        '../../communication/ascii_protocol.cpp',
+        '../utils.c', '../arm_sin_f32.c', '../arm_cos_f32.c'
+    },
+    headers={'sim/stubs', 'sim', '../../Board/v3/Inc', '..', '../..',
+             '../../fibre/cpp/include', '../../Drivers/DRV8301'},
+    cpp_flags={'-std=c++14'},
+    libs={'m', 'pthread'}
+}
+
+-- Checks the trapezoidal planner against golden vectors of the Python
+-- reference (tools/motion_planning/TrapGoldenVectors.py) and times it.
+motorcontrol_trap_traj_harness = define_package{
+    sources={'trap_traj_harness.cpp', '../trapTraj.cpp', '../utils.c'},
+    headers={'sim/stubs', 'sim', '../../Board/v3/Inc', '..', '../..',
+             '../../fibre/cpp/include', '../../Drivers/DRV8301'},
+    cpp_flags={'-std=c++14'},
+    libs={'m'}
+}
+
+toolchain=GCCToolchain('', 'build', {'-O2', '-g', '-Wall'}, {})
+sim_toolchain=GCCToolchain('', 'build', {'-O2', '-g', '-Wall',
+    '-DHW_VERSION_MAJOR=3', '-DHW_VERSION_MINOR=5', '-DHW_VERSION_VOLTAGE=24',
+    '-DBENCHMARK_HOST_CLOCK'}, {})
+
+if tup.getconfig("BUILD_MOTORCONTROL_TESTS") == "true" then
+    build_executable('run_tests', motorcontrol_tests, toolchain)
+    build_executable('run_sim', motorcontrol_sim, sim_toolchain)
+    build_executable('trap_traj_harness', motorcontrol_trap_traj_harness, sim_toolchain)
+end
@@ -0,0 +1,1170 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <chrono>
+
+#include <utils.h>
+#include <pll.hpp>
+#include <thermal_model.hpp>
+#include <input_shaper.hpp>
+#include <path_planner.hpp>
+#include <nvm.h>
+#include <nvm_config.hpp>
+#include <stm32f4xx_hal.h>
+
+// Benchmark helper: returns the average runtime of fn() in nanoseconds
+template<typename T>
+double benchmark(const T& fn, size_t iterations) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        fn(i);
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (double)iterations;
+}
+
+// Prevents the compiler from optimizing away benchmarked results
+volatile float benchmark_sink;
+
+/* SVM -----------------------------------------------------------------------*/
+
+// The original sextant based SVM implementation, kept as reference
+static int SVM_reference(float alpha, float beta, float* tA, float* tB, float* tC) {
+    int Sextant;
+
+    if (beta >= 0.0f) {
+        if (alpha >= 0.0f) {
+            //quadrant I
+            if (one_by_sqrt3 * beta > alpha)
+                Sextant = 2; //sextant v2-v3
+            else
+                Sextant = 1; //sextant v1-v2
+
+        } else {
+            //quadrant II
+            if (-one_by_sqrt3 * beta > alpha)
+                Sextant = 3; //sextant v3-v4
+            else
+                Sextant = 2; //sextant v2-v3
+        }
+    } else {
+        if (alpha >= 0.0f) {
+            //quadrant IV
+            if (-one_by_sqrt3 * beta > alpha)
+                Sextant = 5; //sextant v5-v6
+            else
+                Sextant = 6; //sextant v6-v1
+        } else {
+            //quadrant III
+            if (one_by_sqrt3 * beta > alpha)
+                Sextant = 4; //sextant v4-v5
+            else
+                Sextant = 5; //sextant v5-v6
+        }
+    }
+
+    switch (Sextant) {
+        // sextant v1-v2
+        case 1: {
+            // Vector on-times
+            float t1 = alpha - one_by_sqrt3 * beta;
+            float t2 = two_by_sqrt3 * beta;
+
+            // PWM timings
+            *tA = (1.0f - t1 - t2) * 0.5f;
+            *tB = *tA + t1;
+            *tC = *tB + t2;
+
+            break;
+        }
+        // sextant v2-v3
+        case 2: {
+            // Vector on-times
+            float t2 = alpha + one_by_sqrt3 * beta;
+            float t3 = -alpha + one_by_sqrt3 * beta;
+
+            // PWM timings
+            *tB = (1.0f - t2 - t3) * 0.5f;
+            *tA = *tB + t3;
+            *tC = *tA + t2;
+
+            break;
+        }
+        // sextant v3-v4
+        case 3: {
+            // Vector on-times
+            float t3 = two_by_sqrt3 * beta;
+            float t4 = -alpha - one_by_sqrt3 * beta;
+
+            // PWM timings
+            *tB = (1.0f - t3 - t4) * 0.5f;
+            *tC = *tB + t3;
+            *tA = *tC + t4;
+
+            break;
+        }
+        // sextant v4-v5
+        case 4: {
+            // Vector on-times
+            float t4 = -alpha + one_by_sqrt3 * beta;
+            float t5 = -two_by_sqrt3 * beta;
+
+            // PWM timings
+            *tC = (1.0f - t4 - t5) * 0.5f;
+            *tB = *tC + t5;
+            *tA = *tB + t4;
+
+            break;
+        }
+        // sextant v5-v6
+        case 5: {
+            // Vector on-times
+            float t5 = -alpha - one_by_sqrt3 * beta;
+            float t6 = alpha - one_by_sqrt3 * beta;
+
+            // PWM timings
+            *tC = (1.0f - t5 - t6) * 0.5f;
+            *tA = *tC + t5;
+            *tB = *tA + t6;
+
+            break;
+        }
+        // sextant v6-v1
+        case 6: {
+            // Vector on-times
+            float t6 = -two_by_sqrt3 * beta;
+            float t1 = alpha + one_by_sqrt3 * beta;
+
+            // PWM timings
+            *tA = (1.0f - t6 - t1) * 0.5f;
+            *tC = *tA + t1;
+            *tB = *tC + t6;
+
+            break;
+        }
+    }
+
+    // if any of the results becomes NaN, result_valid will evaluate to false
+    int result_valid =
+            *tA >= 0.0f && *tA <= 1.0f
+         && *tB >= 0.0f && *tB <= 1.0f
+         && *tC >= 0.0f && *tC <= 1.0f;
+    return result_valid ? 0 : -1;
+}
+
+bool svm_equivalence_test() {
+    const float tolerance = 1e-6f;
+    size_t n_tested = 0;
+
+    // Polar grid that covers the entire linear range and a bit beyond
+    for (int i_mag = 0; i_mag <= 200; ++i_mag) {
+        for (int i_phase = 0; i_phase < 720; ++i_phase) {
+            float mag = 1.05f * sqrt3_by_2 * (float)i_mag / 200.0f;
+            float phase = 2.0f * M_PI * (float)i_phase / 720.0f;
+            float alpha = mag * cosf(phase);
+            float beta = mag * sinf(phase);
+
+            float ref[3], opt[3];
+            int ref_result = SVM_reference(alpha, beta, &ref[0], &ref[1], &ref[2]);
+            int opt_result = SVM(alpha, beta, &opt[0], &opt[1], &opt[2]);
+
+            // Close to the hexagon boundary, rounding can legitimately flip the result
+            bool at_boundary = false;
+            for (int k = 0; k < 3; ++k)
+                at_boundary = at_boundary || fabsf(ref[k]) < tolerance || fabsf(ref[k] - 1.0f) < tolerance;
+
+            if (ref_result != opt_result && !at_boundary) {
+                printf("SVM(%f, %f): expected result %d but got %d\n", alpha, beta, ref_result, opt_result);
+                return false;
+            }
+            for (int k = 0; k < 3; ++k) {
+                if (!(fabsf(ref[k] - opt[k]) <= tolerance)) {
+                    printf("SVM(%f, %f): timing %d: expected %f but got %f\n", alpha, beta, k, ref[k], opt[k]);
+                    return false;
+                }
+            }
+            n_tested++;
+        }
+    }
+
+    // Invalid inputs must be rejected
+    float tA, tB, tC;
+    if (SVM(NAN, 0.0f, &tA, &tB, &tC) == 0 || SVM(0.0f, NAN, &tA, &tB, &tC) == 0) {
+        printf("SVM accepted NaN input\n");
+        return false;
+    }
+
+    printf("SVM: %zu points match the reference implementation\n", n_tested);
+    return true;
+}
+
+bool svm_overmodulation_test() {
+    const float tolerance = 1e-5f;
+    for (int i_mag = 0; i_mag <= 150; ++i_mag) {
+        for (int i_phase = 0; i_phase < 720; ++i_phase) {
+            float mag = 1.5f * (float)i_mag / 150.0f;
+            float phase = 2.0f * M_PI * (float)i_phase / 720.0f;
+            float alpha = mag * cosf(phase);
+            float beta = mag * sinf(phase);
+
+            float ref[3], opt[3];
+            int ref_result = SVM(alpha, beta, &ref[0], &ref[1], &ref[2]);
+            if (SVM_overmodulation(alpha, beta, &opt[0], &opt[1], &opt[2]) != 0) {
+                printf("SVM_overmodulation(%f, %f) failed\n", alpha, beta);
+                return false;
+            }
+
+            float t_min = MACRO_MIN(opt[0], MACRO_MIN(opt[1], opt[2]));
+            float t_max = MACRO_MAX(opt[0], MACRO_MAX(opt[1], opt[2]));
+            if (t_min < 0.0f || t_max > 1.0f) {
+                printf("SVM_overmodulation(%f, %f): timings out of range\n", alpha, beta);
+                return false;
+            }
+
+            if (ref_result == 0) {
+                // Inside the hexagon both must agree
+                for (int k = 0; k < 3; ++k) {
+                    if (!(fabsf(ref[k] - opt[k]) <= tolerance)) {
+                        printf("SVM_overmodulation(%f, %f): timing %d: expected %f but got %f\n", alpha, beta, k, ref[k], opt[k]);
+                        return false;
+                    }
+                }
+            } else {
+                // Outside, the vector must lie on the hexagon boundary and keep its angle
+                // (inverse of the timing computation, up to a common scale factor)
+                float out_alpha = -(2.0f * opt[0] - opt[1] - opt[2]) / 3.0f;
+                float out_beta = -(opt[1] - opt[2]) * one_by_sqrt3;
+                float angle_err = wrap_pm_pi(atan2f(out_beta, out_alpha) - atan2f(beta, alpha));
+                if (fabsf(t_max - t_min - 1.0f) > tolerance || fabsf(angle_err) > 1e-3f) {
+                    printf("SVM_overmodulation(%f, %f): not clamped onto the hexagon (span %f, angle error %f)\n",
+                           alpha, beta, t_max - t_min, angle_err);
+                    return false;
+                }
+            }
+        }
+    }
+
+    float tA, tB, tC;
+    if (SVM_overmodulation(NAN, 0.0f, &tA, &tB, &tC) == 0 || SVM_overmodulation(0.0f, NAN, &tA, &tB, &tC) == 0) {
+        printf("SVM_overmodulation accepted NaN input\n");
+        return false;
+    }
+
+    printf("SVM_overmodulation: ok\n");
+    return true;
+}
+
+void svm_benchmark() {
+    const size_t iterations = 10000000;
+    const size_t n_inputs = 1024;
+    static float inputs[n_inputs][2];
+    for (size_t i = 0; i < n_inputs; ++i) {
+        float phase = 2.0f * M_PI * (float)rand() / (float)RAND_MAX;
+        float mag = sqrt3_by_2 * (float)rand() / (float)RAND_MAX;
+        inputs[i][0] = mag * cosf(phase);
+        inputs[i][1] = mag * sinf(phase);
+    }
+
+    double t_ref = benchmark([&](size_t i) {
+        float tA, tB, tC;
+        SVM_reference(inputs[i % n_inputs][0], inputs[i % n_inputs][1], &tA, &tB, &tC);
+        benchmark_sink = tA + tB + tC;
+    }, iterations);
+    double t_opt = benchmark([&](size_t i) {
+        float tA, tB, tC;
+        SVM(inputs[i % n_inputs][0], inputs[i % n_inputs][1], &tA, &tB, &tC);
+        benchmark_sink = tA + tB + tC;
+    }, iterations);
+    printf("SVM benchmark: reference %.2f ns/call, optimized %.2f ns/call\n", t_ref, t_opt);
+}
+
+/* sin/cos -------------------------------------------------------------------*/
+
+bool sincos_accuracy_test() {
+    const float tolerance = 1e-4f;
+    fast_sincos_init();
+
+    float max_error = 0.0f;
+    for (int i = -100000; i <= 100000; ++i) {
+        float x = 4.0f * M_PI * (float)i / 100000.0f;
+        float s, c;
+        fast_sincos(x, &s, &c);
+        float err = MACRO_MAX(fabsf(s - sinf(x)), fabsf(c - cosf(x)));
+        if (!(err <= tolerance)) {
+            printf("fast_sincos(%f): expected (%f, %f) but got (%f, %f)\n", x, sinf(x), cosf(x), s, c);
+            return false;
+        }
+        max_error = MACRO_MAX(max_error, err);
+    }
+
+    printf("fast_sincos: max error %g\n", max_error);
+    return true;
+}
+
+void sincos_benchmark() {
+    const size_t iterations = 10000000;
+    const size_t n_inputs = 1024;
+    static float inputs[n_inputs];
+    for (size_t i = 0; i < n_inputs; ++i)
+        inputs[i] = 2.0f * M_PI * ((float)rand() / (float)RAND_MAX - 0.5f);
+
+    double t_libm = benchmark([&](size_t i) {
+        float x = inputs[i % n_inputs];
+        benchmark_sink = sinf(x) + cosf(x);
+    }, iterations);
+    double t_fused = benchmark([&](size_t i) {
+        float s, c;
+        fast_sincos(inputs[i % n_inputs], &s, &c);
+        benchmark_sink = s + c;
+    }, iterations);
+    printf("sincos benchmark: sinf+cosf %.2f ns/call, fast_sincos %.2f ns/call\n", t_libm, t_fused);
+}
+
+/* atan2 ---------------------------------------------------------------------*/
+
+// Both variants against libm, over all angles and a range of magnitudes
+bool atan2_accuracy_test() {
+    const float tolerance = FAST_ATAN2_MAX_ERROR;
+    const char* names[] = { "fast_atan2", "fast_atan2_octant" };
+    float (*fns[])(float, float) = { fast_atan2, fast_atan2_octant };
+
+    for (size_t f = 0; f < 2; ++f) {
+        float max_error = 0.0f;
+        for (float radius = 1e-3f; radius < 1e4f; radius *= 1e3f) {
+            for (int i = -100000; i <= 100000; ++i) {
+                double angle = M_PI * (double)i / 100000.0;
+                float x = radius * (float)cos(angle), y = radius * (float)sin(angle);
+                float err = fabsf((float)remainder((double)fns[f](y, x) - atan2((double)y, (double)x), 2.0 * M_PI));
+                if (!(err <= tolerance)) {
+                    printf("%s(%f, %f): expected %f but got %f\n", names[f], y, x, atan2f(y, x), fns[f](y, x));
+                    return false;
+                }
+                max_error = MACRO_MAX(max_error, err);
+            }
+        }
+        if (fns[f](0.0f, 0.0f) != 0.0f) {
+            printf("%s(0, 0): expected 0 but got %f\n", names[f], fns[f](0.0f, 0.0f));
+            return false;
+        }
+        printf("%s: max error %g rad (order %d)\n", names[f], max_error, FAST_ATAN2_ORDER);
+    }
+    return true;
+}
+
+void atan2_benchmark() {
+    const size_t iterations = 10000000;
+    const size_t n_inputs = 1024;
+    static float inputs[n_inputs][2];
+    for (size_t i = 0; i < n_inputs; ++i) {
+        inputs[i][0] = (float)rand() / (float)RAND_MAX - 0.5f;
+        inputs[i][1] = (float)rand() / (float)RAND_MAX - 0.5f;
+    }
+
+    double t_libm = benchmark([&](size_t i) {
+        benchmark_sink = atan2f(inputs[i % n_inputs][0], inputs[i % n_inputs][1]);
+    }, iterations);
+    double t_fast = benchmark([&](size_t i) {
+        benchmark_sink = fast_atan2(inputs[i % n_inputs][0], inputs[i % n_inputs][1]);
+    }, iterations);
+    double t_octant = benchmark([&](size_t i) {
+        benchmark_sink = fast_atan2_octant(inputs[i % n_inputs][0], inputs[i % n_inputs][1]);
+    }, iterations);
+    printf("atan2 benchmark: atan2f %.2f ns/call, fast_atan2 %.2f ns/call, fast_atan2_octant %.2f ns/call\n",
+           t_libm, t_fast, t_octant);
+}
+
+/* PLL -----------------------------------------------------------------------*/
+
+static const float pll_dt = 1.0f / 8000.0f;
+
+// Compares the step response with the continuous time one of the critically
+// damped loop, y(t) = 1 - exp(-bw*t) * (1 - bw*t)
+bool pll_step_response_test() {
+    const float bandwidth = 200.0f;
+    const float tolerance = 0.01f;
+    Pll<float, PLL_MODE_LINEAR> pll;
+    pll.set_bandwidth(bandwidth, pll_dt);
+    if (!pll.is_stable()) {
+        printf("PLL: bandwidth %f reported as unstable\n", bandwidth);
+        return false;
+    }
+
+    float pos = 0.0f, vel = 0.0f;
+    for (int i = 1; i <= 400; ++i) {
+        pll.predict(pos, vel);
+        pll.correct(pos, vel, pll.error(1.0f, pos));
+        float t = (float)i * pll_dt;
+        float expected = 1.0f - expf(-bandwidth * t) * (1.0f - bandwidth * t);
+        if (!(fabsf(pos - expected) <= tolerance)) {
+            printf("PLL step response at t=%f: expected %f but got %f\n", t, expected, pos);
+            return false;
+        }
+    }
+
+    Pll<float, PLL_MODE_LINEAR> unstable;
+    unstable.set_bandwidth(0.6f / pll_dt, pll_dt);
+    if (unstable.is_stable()) {
+        printf("PLL: bandwidth %f not reported as unstable\n", 0.6f / pll_dt);
+        return false;
+    }
+
+    printf("PLL step response: ok\n");
+    return true;
+}
+
+// Tracks a constant velocity across many wrap-arounds, in floating and fixed point
+bool pll_ramp_test() {
+    const float bandwidth = 500.0f;
+    const float pos_vel = 50.0f * 2.0f * M_PI; // [rad/s]
+    const int n = 8000;
+
+    Pll<float, PLL_MODE_WRAP> pll;
+    pll.set_bandwidth(bandwidth, pll_dt);
+    pll.set_period(2.0f * M_PI, -M_PI);
+    float pos = 0.0f, vel = 0.0f;
+    for (int i = 1; i <= n; ++i) {
+        float measured = wrap_pm_pi(fmodf(pos_vel * (float)i * pll_dt, 2.0f * M_PI));
+        pll.predict(pos, vel);
+        pll.correct(pos, vel, pll.error(measured, pos));
+        if (!(pos >= -M_PI && pos < M_PI)) {
+            printf("PLL: position %f out of range\n", pos);
+            return false;
+        }
+    }
+    float expected_pos = wrap_pm_pi(fmodf(pos_vel * (float)n * pll_dt, 2.0f * M_PI));
+    if (!(fabsf(vel - pos_vel) < 0.01f * pos_vel) || !(fabsf(wrap_pm_pi(pos - expected_pos)) < 0.01f)) {
+        printf("PLL ramp: expected (%f, %f) but got (%f, %f)\n", expected_pos, pos_vel, pos, vel);
+        return false;
+    }
+
+    // One period is 2^32, the ramp advances by 2^32 / 160 per update
+    Pll<int32_t, PLL_MODE_WRAP> pll_fixed;
+    pll_fixed.set_bandwidth(bandwidth, pll_dt);
+    const uint32_t step = (uint32_t)(4294967296.0 / 160.0);
+    int32_t pos_fixed = 0;
+    int64_t vel_fixed = 0;
+    for (int i = 1; i <= n; ++i) {
+        int32_t measured = (int32_t)(step * (uint32_t)i);
+        pll_fixed.predict(pos_fixed, vel_fixed);
+        pll_fixed.correct(pos_fixed, vel_fixed, pll_fixed.error(measured, pos_fixed));
+    }
+    float vel_fixed_f = pll_fixed.vel_to_float(vel_fixed);
+    float expected_vel_fixed = (float)step / pll_dt;
+    int32_t pos_err = pll_fixed.error((int32_t)(step * (uint32_t)n), pos_fixed);
+    if (!(fabsf(vel_fixed_f - expected_vel_fixed) < 0.01f * expected_vel_fixed) || abs(pos_err) > 1000) {
+        printf("PLL fixed point ramp: velocity error %f, position error %d\n",
+                vel_fixed_f - expected_vel_fixed, pos_err);
+        return false;
+    }
+
+    printf("PLL ramp: ok\n");
+    return true;
+}
+
+void pll_benchmark() {
+    const size_t iterations = 10000000;
+    const size_t n_inputs = 1024;
+    static float inputs[n_inputs];
+    static int32_t inputs_fixed[n_inputs];
+    for (size_t i = 0; i < n_inputs; ++i) {
+        inputs[i] = 2.0f * M_PI * ((float)rand() / (float)RAND_MAX - 0.5f);
+        inputs_fixed[i] = (int32_t)(inputs[i] * (4294967296.0f / (2.0f * M_PI)));
+    }
+
+    Pll<float, PLL_MODE_WRAP> pll;
+    pll.set_bandwidth(1000.0f, pll_dt);
+    pll.set_period(2.0f * M_PI, -M_PI);
+    float pos = 0.0f, vel = 0.0f;
+    double t_float = benchmark([&](size_t i) {
+        pll.predict(pos, vel);
+        pll.correct(pos, vel, pll.error(inputs[i % n_inputs], pos));
+        benchmark_sink = pos;
+    }, iterations);
+
+    Pll<int32_t, PLL_MODE_WRAP> pll_fixed;
+    pll_fixed.set_bandwidth(1000.0f, pll_dt);
+    int32_t pos_fixed = 0;
+    int64_t vel_fixed = 0;
+    double t_fixed = benchmark([&](size_t i) {
+        pll_fixed.predict(pos_fixed, vel_fixed);
+        pll_fixed.correct(pos_fixed, vel_fixed, pll_fixed.error(inputs_fixed[i % n_inputs], pos_fixed));
+        benchmark_sink = (float)pos_fixed;
+    }, iterations);
+    printf("PLL benchmark: float %.2f ns/update, fixed point %.2f ns/update\n", t_float, t_fixed);
+}
+
+/* Number conversion ---------------------------------------------------------*/
+
+static bool parse_number(const char* str, float* value) {
+    NumberToken_t token;
+    number_token_reset(&token);
+    for (const char* c = str; *c; ++c) {
+        if (!number_token_push(&token, *c))
+            return false;
+    }
+    return number_token_value(&token, value);
+}
+
+// Compares the incremental number parser against strtof
+bool number_token_test() {
+    const char* valid[] = { "0", "-0", "+7", "12", "-12.5", ".5", "5.", "3.14159265358979",
+            "1e3", "1.5E-3", "-2.5e+2", "123456789012", "0.000001234", "4294967295", "1e38", "1e-38" };
+    for (const char* str : valid) {
+        float value;
+        float expected = strtof(str, nullptr);
+        if (!parse_number(str, &value) || !(fabsf(value - expected) <= 2e-7f * fabsf(expected))) {
+            printf("number token \"%s\": expected %g but got %g\n", str, expected, value);
+            return false;
+        }
+    }
+    const char* invalid[] = { "", "-", ".", "-.", "1e", "1e-", "1.2.3", "1-2", "e5", "abc", "1,5" };
+    for (const char* str : invalid) {
+        float value;
+        if (parse_number(str, &value)) {
+            printf("number token \"%s\": accepted as %g\n", str, value);
+            return false;
+        }
+    }
+
+    NumberToken_t token;
+    uint32_t uint_value;
+    const char* uints[] = { "1", "4294967295", "-1", "1.0", "1e1", "12345678901" };
+    const bool is_uint[] = { true, false, false, false, false, false };
+    for (size_t i = 0; i < sizeof(uints) / sizeof(uints[0]); ++i) {
+        number_token_reset(&token);
+        for (const char* c = uints[i]; *c; ++c)
+            number_token_push(&token, *c);
+        if (number_token_uint(&token, &uint_value) != is_uint[i]) {
+            printf("number token \"%s\": wrong unsigned classification\n", uints[i]);
+            return false;
+        }
+    }
+
+    printf("number token: ok\n");
+    return true;
+}
+
+static bool format_float_matches_printf(float value) {
+    char buf[FORMAT_FLOAT_MAX_LENGTH];
+    char expected[64];
+    size_t len = format_float(buf, value);
+    snprintf(expected, sizeof(expected), "%f", (double)value);
+    if (strlen(buf) != len || strcmp(buf, expected)) {
+        printf("format_float(%g): expected \"%s\" but got \"%s\"\n", (double)value, expected, buf);
+        return false;
+    }
+    return true;
+}
+
+// Checks that format_float matches printf("%f"), including the rounding of ties
+bool format_float_test() {
+    const float values[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 1e-7f, -1e-7f, 0.0000005f, 0.9999996f,
+            0.0078125f, 3.14159265f, -123.456789f, 8192.0f, 65535.99f, 1e6f, -16777216.0f, 4e9f,
+            1e10f, -3e20f, INFINITY, -INFINITY, NAN,
+            // below 2^-8, where a fraction of 32 bits is not exact
+            5.5e-6f, -5.5e-6f, 1.5e-6f, 2.5e-6f, 4.9999997e-7f, 5.0000006e-7f, 3.0517578e-5f, 0.00390624f, 1e-30f };
+    for (float value : values) {
+        if (!format_float_matches_printf(value))
+            return false;
+    }
+    for (int i = -200000; i <= 200000; ++i) {
+        if (!format_float_matches_printf((float)i * 0.001234f))
+            return false;
+    }
+    for (int i = -200000; i <= 200000; ++i) {
+        if (!format_float_matches_printf((float)i * 1.9531e-8f))
+            return false;
+    }
+
+    printf("format_float: ok\n");
+    return true;
+}
+
+void format_float_benchmark() {
+    const size_t iterations = 1000000;
+    char buf[64];
+    double format_ns = benchmark([&](size_t i) {
+        format_float(buf, (float)i * 0.37f - 1000.0f);
+        benchmark_sink = buf[0];
+    }, iterations);
+    double printf_ns = benchmark([&](size_t i) {
+        snprintf(buf, sizeof(buf), "%f", (double)((float)i * 0.37f - 1000.0f));
+        benchmark_sink = buf[0];
+    }, iterations);
+    printf("format_float: %.1f ns, snprintf: %.1f ns\n", format_ns, printf_ns);
+}
+
+/* Test runner ---------------------------------------------------------------*/
+
+// Checks the step response of the thermal model and that a part which starts
+// cold and runs at the predicted sustainable current ends the horizon at the limit
+bool thermal_model_test() {
+    const float dt = 1.0f / 8000.0f;
+    const float coeff = 0.01f, tau = 2.0f, horizon = 1.0f;
+    const float reference = 25.0f, limit = 100.0f;
+    const float tolerance = 0.05f; // [K]
+
+    ThermalModel model;
+    float continuous = model.sustainable_current(reference, limit, coeff, tau, 0.0f);
+    float expected_continuous = sqrtf((limit - reference) / coeff);
+    if (!(fabsf(continuous - expected_continuous) <= 1e-3f * expected_continuous)) {
+        printf("thermal model: continuous current %f instead of %f\n", continuous, expected_continuous);
+        return false;
+    }
+
+    float peak = model.sustainable_current(reference, limit, coeff, tau, horizon);
+    if (!(peak > 1.5f * continuous)) {
+        printf("thermal model: peak current %f not above the continuous %f\n", peak, continuous);
+        return false;
+    }
+    int n = (int)(horizon / dt + 0.5f);
+    for (int i = 0; i < n; ++i)
+        model.update(peak * peak, coeff, tau, dt);
+    if (!(fabsf(reference + model.rise_ - limit) <= tolerance)) {
+        printf("thermal model: %f after the horizon instead of %f\n", reference + model.rise_, limit);
+        return false;
+    }
+
+    // At the limit, only the continuous current is left
+    float hot = model.sustainable_current(reference, limit, coeff, tau, horizon);
+    if (!(fabsf(hot - continuous) <= 0.01f * continuous)) {
+        printf("thermal model: %f at the limit instead of %f\n", hot, continuous);
+        return false;
+    }
+    if (model.sustainable_current(reference, limit, 0.0f, tau, horizon) != INFINITY) {
+        printf("thermal model: not disabled without a coefficient\n");
+        return false;
+    }
+
+    printf("thermal model: ok\n");
+    return true;
+}
+
+// Residual vibration of a damped second order plant at plant_frequency
+// after a unit step through the shaper, relative to the unshaped step
+static float shaped_step_residual(InputShaperType_t type, float frequency, float plant_frequency,
+        float damping, float dt, uint32_t* decimation) {
+    InputShaper shaper;
+    if (!shaper.configure(type, frequency, damping, 0.05f, dt))
+        return INFINITY;
+    *decimation = shaper.decimation_;
+    shaper.reset({ 0.0f, 0.0f, 0.0f });
+    double omega = 2.0 * M_PI * plant_frequency;
+    double x = 0.0, v = 0.0, residual = 0.0;
+    int settle = (int)(shaper.duration_ / dt) + 2;
+    int n = settle + (int)(4.0f / (plant_frequency * dt));
+    for (int i = 0; i < n; ++i) {
+        double u = shaper.update({ 1.0f, 0.0f, 0.0f }).pos;
+        v += (omega * omega * (u - x) - 2.0 * damping * omega * v) * dt;
+        x += v * dt;
+        if (i >= settle)
+            residual = std::max(residual, fabs(x - 1.0));
+    }
+    // The overshoot of an unshaped step
+    double unshaped = exp(-damping * M_PI / sqrt(1.0 - damping * damping));
+    return (float)(residual / unshaped);
+}
+
+bool input_shaper_test() {
+    const float dt = 1.0f / 8000.0f;
+    struct {
+        InputShaperType_t type;
+        float frequency, plant_frequency, damping;
+        float max_residual;
+    } cases[] = {
+        { INPUT_SHAPER_ZV, 10.0f, 10.0f, 0.0f, 0.02f },
+        { INPUT_SHAPER_ZV, 10.0f, 10.0f, 0.1f, 0.02f },
+        { INPUT_SHAPER_ZVD, 10.0f, 10.0f, 0.1f, 0.02f },
+        { INPUT_SHAPER_EI, 10.0f, 10.0f, 0.0f, 0.07f },
+        { INPUT_SHAPER_ZVD, 10.0f, 8.0f, 0.0f, 0.15f },  // 20% off the design frequency
+        { INPUT_SHAPER_ZVD, 0.5f, 0.5f, 0.05f, 0.02f },  // through the decimated history
+    };
+    for (auto& c : cases) {
+        uint32_t decimation;
+        float residual = shaped_step_residual(c.type, c.frequency, c.plant_frequency, c.damping, dt, &decimation);
+        if (!(residual <= c.max_residual)) {
+            printf("input shaper: residual %f of type %d at %f Hz for %f Hz\n", residual, c.type,
+                   c.plant_frequency, c.frequency);
+            return false;
+        }
+        if (c.frequency < 1.0f && decimation <= 1) {
+            printf("input shaper: no decimation at %f Hz\n", c.frequency);
+            return false;
+        }
+    }
+
+    // ZVD tolerates the frequency error better than ZV
+    uint32_t decimation;
+    float zv = shaped_step_residual(INPUT_SHAPER_ZV, 10.0f, 8.0f, 0.0f, dt, &decimation);
+    float zvd = shaped_step_residual(INPUT_SHAPER_ZVD, 10.0f, 8.0f, 0.0f, dt, &decimation);
+    if (!(zvd < 0.5f * zv)) {
+        printf("input shaper: ZVD residual %f not below ZV %f off the design frequency\n", zvd, zv);
+        return false;
+    }
+
+    InputShaper shaper;
+    if (shaper.configure(INPUT_SHAPER_ZV, 10.0f, 1.0f, 0.05f, dt) || shaper.update({ 2.0f, 0.0f, 0.0f }).pos != 2.0f) {
+        printf("input shaper: invalid damping accepted\n");
+        return false;
+    }
+
+    printf("input shaper: ok\n");
+    return true;
+}
+
+// Runs the buffered path to its end and checks that it is continuous and
+// within the limits. Returns the lowest speed within radius of corner.
+static bool run_path(PathPlanner<2>& planner, float dt, float max_vel, float max_accel,
+        const float end[2], const float corner[2], float radius, float* corner_speed) {
+    float pos[2], vel[2], accel[2];
+    float prev[2] = { planner.last_pos_[0], planner.last_pos_[1] };
+    *corner_speed = INFINITY;
+    uint64_t tick = 0;
+    for (; tick < 1000000 && planner.eval(tick, dt, pos, vel, accel); ++tick) {
+        float speed = hypotf(vel[0], vel[1]);
+        float step = hypotf(pos[0] - prev[0], pos[1] - prev[1]);
+        if (!(speed <= 1.001f * max_vel) || !(step <= 1.01f * max_vel * dt + 1e-5f)
+                || !(fabsf(accel[0]) <= 1.001f * max_accel) || !(fabsf(accel[1]) <= 1.001f * max_accel)) {
+            printf("path planner: speed %f, step %f or acceleration %f %f out of range at tick %llu\n",
+                   speed, step, accel[0], accel[1], (unsigned long long)tick);
+            return false;
+        }
+        if (hypotf(pos[0] - corner[0], pos[1] - corner[1]) < radius)
+            *corner_speed = std::min(*corner_speed, speed);
+        prev[0] = pos[0];
+        prev[1] = pos[1];
+    }
+    if (planner.count() != 0 || fabsf(pos[0] - end[0]) > 1e-4f || fabsf(pos[1] - end[1]) > 1e-4f
+            || vel[0] != 0.0f || vel[1] != 0.0f) {
+        printf("path planner: ended at %f %f with %zu segments\n", pos[0], pos[1], planner.count());
+        return false;
+    }
+    return true;
+}
+
+bool path_planner_test() {
+    const float dt = 1.0f / 8000.0f;
+    const float vel_limits[2] = { 100.0f, 100.0f };
+    const float accel_limits[2] = { 1000.0f, 1000.0f };
+    const float feed = 50.0f;
+    const float deviation = 0.05f;
+    const float origin[2] = { 0.0f, 0.0f };
+    PathPlanner<2> planner;
+
+    // A right-angle corner is taken at the junction deviation speed
+    const float a[2] = { 10.0f, 0.0f }, b[2] = { 10.0f, 10.0f };
+    planner.reset(origin);
+    planner.push_line(a, feed, vel_limits, accel_limits, deviation);
+    planner.push_line(b, feed, vel_limits, accel_limits, deviation);
+    planner.start_at(0);
+    float sin_half = sqrtf(0.5f);
+    float expected = sqrtf(accel_limits[0] * deviation * sin_half / (1.0f - sin_half));
+    float corner_speed;
+    if (!run_path(planner, dt, feed, accel_limits[0], b, a, 0.1f, &corner_speed))
+        return false;
+    if (fabsf(corner_speed - expected) > 0.02f * expected) {
+        printf("path planner: corner speed %f instead of %f\n", corner_speed, expected);
+        return false;
+    }
+
+    // Collinear lines blend at full speed, also when the second one is
+    // pushed while the first one is executing
+    const float c[2] = { 20.0f, 0.0f };
+    planner.reset(origin);
+    planner.push_line(a, feed, vel_limits, accel_limits, deviation);
+    planner.push_line(a, feed, vel_limits, accel_limits, deviation); // zero length
+    planner.push_line(c, feed, vel_limits, accel_limits, deviation);
+    planner.start_at(0);
+    if (!run_path(planner, dt, feed, accel_limits[0], c, a, 0.1f, &corner_speed))
+        return false;
+    if (corner_speed < 0.999f * feed) {
+        printf("path planner: collinear junction at %f instead of %f\n", corner_speed, feed);
+        return false;
+    }
+
+    // A dwell stops at its position for its duration
+    planner.reset(origin);
+    planner.push_line(a, feed, vel_limits, accel_limits, deviation);
+    planner.push_dwell(0.1f);
+    planner.push_line(b, feed, vel_limits, accel_limits, deviation);
+    planner.start_at(0);
+    float pos[2], vel[2], accel[2];
+    uint32_t stopped_ticks = 0;
+    for (uint64_t tick = 0; planner.eval(tick, dt, pos, vel, accel); ++tick) {
+        if (vel[0] == 0.0f && vel[1] == 0.0f && fabsf(pos[0] - a[0]) < 1e-4f && fabsf(pos[1] - a[1]) < 1e-4f)
+            ++stopped_ticks;
+    }
+    if (fabsf((float)stopped_ticks * dt - 0.1f) > 2.0f * dt) {
+        printf("path planner: stopped for %f s at the dwell\n", (float)stopped_ticks * dt);
+        return false;
+    }
+
+    // The buffer holds kLength segments, invalid limits are rejected
+    planner.reset(origin);
+    for (size_t i = 0; i < PathPlanner<2>::kLength; ++i) {
+        float target[2] = { (float)(i + 1), 0.0f };
+        if (!planner.push_line(target, feed, vel_limits, accel_limits, deviation)) {
+            printf("path planner: push %zu rejected\n", i);
+            return false;
+        }
+    }
+    const float zero_limits[2] = { 0.0f, 0.0f };
+    if (planner.push_dwell(0.0f) || planner.free_slots() != 0) {
+        printf("path planner: full buffer accepted a segment\n");
+        return false;
+    }
+    planner.clear();
+    if (planner.push_line(b, feed, zero_limits, accel_limits, deviation) || planner.count() != 0) {
+        printf("path planner: zero velocity limit accepted\n");
+        return false;
+    }
+
+    // Segments pushed while the path runs
+    const float square[4][2] = { { 10.0f, 0.0f }, { 10.0f, 10.0f }, { 0.0f, 10.0f }, { 0.0f, 0.0f } };
+    planner.reset(origin);
+    planner.push_line(square[0], feed, vel_limits, accel_limits, deviation);
+    planner.start_at(100);
+    size_t pushed = 1;
+    float prev[2] = { 0.0f, 0.0f };
+    uint64_t tick = 0;
+    for (; planner.eval(tick, dt, pos, vel, accel); ++tick) {
+        if (pushed < 4 && tick % 800 == 0)
+            planner.push_line(square[pushed++], feed, vel_limits, accel_limits, deviation);
+        if (hypotf(pos[0] - prev[0], pos[1] - prev[1]) > 1.01f * feed * dt + 1e-5f) {
+            printf("path planner: jump at tick %llu\n", (unsigned long long)tick);
+            return false;
+        }
+        prev[0] = pos[0];
+        prev[1] = pos[1];
+    }
+    if (pushed != 4 || fabsf(pos[0]) > 1e-4f || fabsf(pos[1]) > 1e-4f) {
+        printf("path planner: streamed square ended at %f %f\n", pos[0], pos[1]);
+        return false;
+    }
+
+    printf("path planner: ok\n");
+    return true;
+}
+
+// Two per-count anti-cogging maps at the default 8192 CPR exceed both pools,
+// so the last one must come from the heap rather than fail
+bool table_alloc_test() {
+    const size_t map_bytes = 8192 * sizeof(float);
+    void* maps[3];
+    for (void*& map : maps) {
+        map = table_alloc(map_bytes);
+        if (!map || ((uintptr_t)map & 7)) {
+            printf("table_alloc: map not allocated\n");
+            return false;
+        }
+        memset(map, 0, map_bytes);
+    }
+    if (table_heap_bytes_used() < map_bytes || table_alloc_failure_count() != 0) {
+        printf("table_alloc: expected a heap fallback without failures\n");
+        return false;
+    }
+    printf("table_alloc: ok\n");
+    return true;
+}
+
+/* NVM record log ------------------------------------------------------------*/
+
+// Simulated flash of the stubbed HAL
+uint8_t test_flash[3][TEST_FLASH_SECTOR_SIZE];
+int test_flash_budget = -1;
+static uint8_t flash_snapshot[3][TEST_FLASH_SECTOR_SIZE];
+
+static bool nvm_log_append(uint16_t id, uint8_t seed, size_t length) {
+    uint8_t data[64];
+    for (size_t i = 0; i < length; ++i)
+        data[i] = (uint8_t)(seed + i);
+    return !NVM_log_start_append(id, length) && !NVM_log_write(0, data, length) && !NVM_log_commit();
+}
+
+// @brief Returns true if the latest record with the given ID is the one that
+// nvm_log_append() wrote with the same seed and length
+static bool nvm_log_holds(uint16_t id, uint8_t seed, size_t length) {
+    size_t stored_length = 0;
+    const volatile uint8_t* data = NVM_log_find(id, &stored_length);
+    if (!data || stored_length != length)
+        return false;
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] != (uint8_t)(seed + i))
+            return false;
+    }
+    return true;
+}
+
+// @brief Simulates a reboot: the power is back and the log is searched again
+static bool nvm_log_reboot() {
+    test_flash_budget = -1;
+    return !NVM_log_init();
+}
+
+static bool nvm_log_compact(uint8_t seed1, uint8_t seed2) {
+    return !NVM_log_start_compaction() && nvm_log_append(1, seed1, 20)
+        && nvm_log_append(2, seed2, 36) && !NVM_log_finish_compaction();
+}
+
+// Cuts the power after every single flash operation of an append and of a
+// compaction in turn. After the reboot the log must hold either the old or
+// the new records, never a mix or garbage, and must take new records.
+// The log is also filled up and compacted until both sectors were used twice.
+bool nvm_log_test() {
+    memset(test_flash, 0xff, sizeof(test_flash));
+    if (NVM_log_init() == 0 || NVM_log_find(1, nullptr)) {
+        printf("nvm log: erased flash has a log\n");
+        return false;
+    }
+    if (!nvm_log_compact(10, 20) || !nvm_log_reboot() || !nvm_log_holds(1, 10, 20) || !nvm_log_holds(2, 20, 36)) {
+        printf("nvm log: first compaction failed\n");
+        return false;
+    }
+
+    // interrupted append
+    memcpy(flash_snapshot, test_flash, sizeof(test_flash));
+    for (int budget = 0; ; ++budget) {
+        memcpy(test_flash, flash_snapshot, sizeof(test_flash));
+        if (!nvm_log_reboot()) {
+            printf("nvm log: snapshot lost\n");
+            return false;
+        }
+        test_flash_budget = budget;
+        nvm_log_append(1, 30, 20);
+        bool interrupted = test_flash_budget == 0;
+        if (!nvm_log_reboot() || !(nvm_log_holds(1, 30, 20) || (interrupted && nvm_log_holds(1, 10, 20)))
+                || !nvm_log_holds(2, 20, 36)) {
+            printf("nvm log: append cut after %d operations left a broken log\n", budget);
+            return false;
+        }
+        if (!nvm_log_append(1, 40, 20) || !nvm_log_reboot() || !nvm_log_holds(1, 40, 20)) {
+            printf("nvm log: no append after a cut after %d operations\n", budget);
+            return false;
+        }
+        if (!interrupted)
+            break;
+    }
+
+    // wrap-around: fill the log and compact it into the other sector, twice
+    for (int round = 0; round < 4; ++round) {
+        uint8_t seed = 0;
+        while (NVM_log_free_space() >= NVM_log_record_size(36)) {
+            if (!nvm_log_append(2, ++seed, 36)) {
+                printf("nvm log: append failed with free space left\n");
+                return false;
+            }
+        }
+        if (nvm_log_append(2, 100, 36) || !nvm_log_reboot() || !nvm_log_holds(2, seed, 36)) {
+            printf("nvm log: full log took a record or lost the latest one\n");
+            return false;
+        }
+        if (!nvm_log_compact(50 + round, 60 + round) || !nvm_log_reboot()
+                || !nvm_log_holds(1, 50 + round, 20) || !nvm_log_holds(2, 60 + round, 36)
+                || NVM_log_free_space() < (TEST_FLASH_SECTOR_SIZE / 2)) {
+            printf("nvm log: compaction of a full log failed in round %d\n", round);
+            return false;
+        }
+    }
+
+    // interrupted compaction, into either sector
+    uint8_t old_seed1 = 53, old_seed2 = 63;
+    for (int pass = 0; pass < 2; ++pass) {
+        uint8_t seed1 = 70 + pass, seed2 = 80 + pass;
+        memcpy(flash_snapshot, test_flash, sizeof(test_flash));
+        for (int budget = 0; ; ++budget) {
+            memcpy(test_flash, flash_snapshot, sizeof(test_flash));
+            nvm_log_reboot();
+            test_flash_budget = budget;
+            nvm_log_compact(seed1, seed2);
+            bool interrupted = test_flash_budget == 0;
+            bool is_new = nvm_log_reboot() && nvm_log_holds(1, seed1, 20) && nvm_log_holds(2, seed2, 36);
+            bool is_old = nvm_log_reboot() && nvm_log_holds(1, old_seed1, 20) && nvm_log_holds(2, old_seed2, 36);
+            if (!(is_new || (interrupted && is_old))) {
+                printf("nvm log: compaction cut after %d operations left a broken log\n", budget);
+                return false;
+            }
+            if (interrupted && (!nvm_log_append(2, 100, 36) || !nvm_log_reboot() || !nvm_log_holds(2, 100, 36))) {
+                printf("nvm log: no append after a compaction cut after %d operations\n", budget);
+                return false;
+            }
+            if (!interrupted)
+                break;
+        }
+        if (!nvm_log_append(1, 90 + pass, 20) || !nvm_log_reboot() || !nvm_log_holds(1, 90 + pass, 20)) {
+            printf("nvm log: no append after a compaction\n");
+            return false;
+        }
+        old_seed1 = 90 + pass;
+        old_seed2 = seed2;
+    }
+
+    printf("nvm log: ok\n");
+    return true;
+}
+
+/* Config migration ----------------------------------------------------------*/
+
+// A config object as saved by an older firmware and as it is now: "count"
+// changed its type, "mode" became a float, "removed" is gone and "added" and
+// "limit" are new
+struct MigrationConfigOld {
+    float gain = 0.0f;
+    int32_t count = 0;
+    uint8_t mode = 0;
+    float removed = 0.0f;
+};
+struct MigrationConfigNew {
+    uint8_t added = 7;
+    float gain = 0.0f;
+    uint16_t count = 0;
+    float mode = 0.0f;
+    float limit = 0.5f;
+};
+static MigrationConfigOld migration_old;
+static MigrationConfigNew migration_new;
+static bool migration_use_new_tree = false;
+
+static void for_each_old_config_field(ConfigFieldVisitor& visitor) {
+    auto tree = make_protocol_object("config",
+        make_protocol_property("gain", &migration_old.gain),
+        make_protocol_property("count", &migration_old.count),
+        make_protocol_property("mode", &migration_old.mode),
+        make_protocol_property("removed", &migration_old.removed));
+    tree.for_each_property(visitor, kPathHashInit);
+}
+
+static void for_each_new_config_field(ConfigFieldVisitor& visitor) {
+    auto tree = make_protocol_object("config",
+        make_protocol_property("added", &migration_new.added),
+        make_protocol_property("gain", &migration_new.gain),
+        make_protocol_property("count", &migration_new.count),
+        make_protocol_property("mode", &migration_new.mode),
+        make_protocol_property("limit", &migration_new.limit));
+    tree.for_each_property(visitor, kPathHashInit);
+}
+
+// Stands in for the published tree of the firmware
+void for_each_config_field(ConfigFieldVisitor& visitor) {
+    if (migration_use_new_tree)
+        for_each_new_config_field(visitor);
+    else
+        for_each_old_config_field(visitor);
+}
+
+template<typename TTo, typename TFrom>
+static TTo convert_test_field(TFrom value) {
+    TTo result;
+    memset(&result, 0xa5, sizeof(result));
+    uint8_t stored[sizeof(TFrom)];
+    memcpy(stored, &value, sizeof(value));
+    convert_config_field(ConfigFieldType<TTo>::value, &result, ConfigFieldType<TFrom>::value, stored);
+    return result;
+}
+
+bool convert_config_field_test() {
+    bool ok = convert_test_field<int32_t>(2.6f) == 3
+        && convert_test_field<int32_t>(-2.5f) == -3
+        && convert_test_field<uint8_t>(-4.0f) == 0
+        && convert_test_field<uint8_t>((int32_t)300) == 255
+        && convert_test_field<int16_t>((int64_t)-100000) == -32768
+        && convert_test_field<uint32_t>(NAN) == 0
+        && convert_test_field<int32_t>(INFINITY) == std::numeric_limits<int32_t>::max()
+        && convert_test_field<float>((uint32_t)123456) == 123456.0f
+        && convert_test_field<float>(true) == 1.0f
+        && convert_test_field<bool>(0.25f) == true
+        && convert_test_field<bool>((int8_t)0) == false
+        && convert_test_field<uint64_t>((uint64_t)0xfedcba9876543210ULL) == 0xfedcba9876543210ULL
+        && convert_test_field<int8_t>((uint16_t)77) == 77;
+    // non-numeric fields only migrate to their own type
+    endpoint_ref_t ref = { 12, 34 };
+    ok = ok && convert_test_field<float>(ref) != 0.0f;
+    endpoint_ref_t copied = convert_test_field<endpoint_ref_t>(ref);
+    ok = ok && copied.endpoint_id == ref.endpoint_id && copied.json_crc == ref.json_crc;
+    if (!ok) {
+        printf("convert_config_field: wrong conversion\n");
+        return false;
+    }
+    printf("convert_config_field: ok\n");
+    return true;
+}
+
+// Stores a record of the old object and migrates it into the new one
+bool config_migration_test() {
+    memset(test_flash, 0xff, sizeof(test_flash));
+    test_flash_budget = -1;
+    NVM_log_init();
+    if (NVM_log_start_compaction() || NVM_log_finish_compaction()) {
+        printf("config migration: no log\n");
+        return false;
+    }
+
+    const ConfigRecord_t old_record = { 0x0102, &migration_old, sizeof(migration_old) };
+    const ConfigRecord_t new_record = { 0x0102, &migration_new, sizeof(migration_new) };
+    migration_old = { 1.5f, 70000, 3, 9.0f };
+    migration_use_new_tree = false;
+    if (old_record.store((const uint8_t *)&migration_old) || NVM_log_init() || !old_record.is_stored()) {
+        printf("config migration: store failed\n");
+        return false;
+    }
+
+    // The layout changed, so the copy can't be loaded as a whole
+    migration_use_new_tree = true;
+    migration_new = MigrationConfigNew();
+    if (new_record.load()) {
+        printf("config migration: loaded a copy of a different size\n");
+        return false;
+    }
+    if (!new_record.migrate() || migration_new.added != 7 || migration_new.gain != 1.5f
+            || migration_new.count != 65535 || migration_new.mode != 3.0f || migration_new.limit != 0.5f) {
+        printf("config migration: wrong fields %u %f %u %f\n", migration_new.added,
+               migration_new.gain, migration_new.count, migration_new.mode);
+        return false;
+    }
+
+    // The tree can also be passed explicitly, as for board_config at boot
+    migration_use_new_tree = false;
+    migration_new = MigrationConfigNew();
+    if (!new_record.migrate(for_each_new_config_field) || migration_new.gain != 1.5f) {
+        printf("config migration: explicit tree not used\n");
+        return false;
+    }
+
+    // A corrupted record is not migrated at all
+    size_t length;
+    const uint8_t* data = (const uint8_t *)NVM_log_find(0x0102, &length);
+    size_t offset = (const uint8_t *)data + 6 - &test_flash[0][0];
+    (&test_flash[0][0])[offset] &= 0x7f; // only clearing bits is possible
+    migration_new = MigrationConfigNew();
+    if (new_record.migrate(for_each_new_config_field) || migration_new.gain != 0.0f) {
+        printf("config migration: corrupted record migrated\n");
+        return false;
+    }
+
+    printf("config migration: ok\n");
+    return true;
+}
+
+int main(int argc, const char** argv) {
+    bool run_benchmarks = argc > 1 && (argv[1][0] == 'b');
+
+    if (!svm_equivalence_test() || !svm_overmodulation_test() || !sincos_accuracy_test()
+            || !atan2_accuracy_test() || !pll_step_response_test() || !pll_ramp_test() || !thermal_model_test()
+            || !input_shaper_test() || !path_planner_test() || !number_token_test() || !format_float_test()
+            || !table_alloc_test() || !nvm_log_test() || !convert_config_field_test()
+            || !config_migration_test()) {
+        printf("test failed\n");
+        return -1;
+    }
+    printf("all tests passed\n");
+
+    if (run_benchmarks) {
+        svm_benchmark();
+        sincos_benchmark();
+        atan2_benchmark();
+        pll_benchmark();
+        format_float_benchmark();
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef __SIM_PLANT_HPP
+#define __SIM_PLANT_HPP
+
+#include <algorithm>
+#include <cmath>
+
+// @brief Average value model of a PMSM with a rigid load, with a surface
+// mount rotor unless lq_minus_ld is set.
+//
+// The inverter is ideal: each phase is at vbus * duty, the PWM ripple and the
+// dead time are not modelled. While the inverter is disabled, the phase
+// currents are taken to be zero. The electrical equations are integrated in
+// the stationary alpha/beta frame with implicit Euler, so that step sizes up
+// to the electrical time constant stay stable.
+class PmsmPlant {
+public:
+    struct Params_t {
+        float phase_resistance = 0.039f;   // [Ohm]
+        float phase_inductance = 15.7e-6f; // [H]
+        float inductance_saturation = 0.0f; // [1/A] the inductance drops to phase_inductance / (1 + inductance_saturation * |I|)
+        float lq_minus_ld = 0.0f;          // [H] saliency of an interior PM motor, with Ld = phase_inductance
+        float flux_linkage = 2.92e-3f;     // [V/(rad/s)] per electrical rad/s
+        int pole_pairs = 7;
+        float inertia = 1.0e-4f;           // [kg m^2]
+        float viscous_friction = 1.0e-4f;  // [Nm/(rad/s)]
+        float load_torque = 0.0f;          // [Nm] external torque against the positive direction
+        float coulomb_friction = 0.0f;     // [Nm] against the direction of motion, fading in below 0.1 rad/s
+    };
+
+    explicit PmsmPlant(const Params_t& params) : params_(params) {}
+
+    // @param duty: fraction of the PWM period that each phase is high
+    // @param enabled: false while the inverter floats the phases
+    // @param vbus: bus voltage [V]
+    // @param dt: step size [s]
+    void step(const float duty[3], bool enabled, float vbus, float dt) {
+        const Params_t& p = params_;
+        float theta_e = p.pole_pairs * theta_;
+        float omega_e = p.pole_pairs * omega_;
+        float c = cosf(theta_e), s = sinf(theta_e);
+
+        if (enabled) {
+            float va = vbus * duty[0], vb = vbus * duty[1], vc = vbus * duty[2];
+            float v_alpha = (2.0f / 3.0f) * (va - 0.5f * (vb + vc));
+            float v_beta = (vb - vc) * 0.57735026919f;
+            float e_alpha = -omega_e * p.flux_linkage * s;
+            float e_beta = omega_e * p.flux_linkage * c;
+            float I_mag = sqrtf(I_alpha_ * I_alpha_ + I_beta_ * I_beta_);
+            float L = p.phase_inductance / (1.0f + p.inductance_saturation * I_mag);
+            if (p.lq_minus_ld == 0.0f) {
+                float k = dt / L;
+                float den = 1.0f + k * p.phase_resistance;
+                I_alpha_ = (I_alpha_ + k * (v_alpha - e_alpha)) / den;
+                I_beta_ = (I_beta_ + k * (v_beta - e_beta)) / den;
+            } else {
+                // Salient rotor: integrate in the rotor frame, with the
+                // cross coupling taken from the previous step
+                float Lq = L + p.lq_minus_ld;
+                float v_d = c * v_alpha + s * v_beta, v_q = c * v_beta - s * v_alpha;
+                float I_d = c * I_alpha_ + s * I_beta_, I_q = c * I_beta_ - s * I_alpha_;
+                float I_d_next = (I_d + dt / L * (v_d + omega_e * Lq * I_q)) / (1.0f + dt / L * p.phase_resistance);
+                I_q = (I_q + dt / Lq * (v_q - omega_e * (L * I_d + p.flux_linkage))) / (1.0f + dt / Lq * p.phase_resistance);
+                I_d = I_d_next;
+                I_alpha_ = c * I_d - s * I_q;
+                I_beta_ = s * I_d + c * I_q;
+            }
+            Ibus_ = 1.5f * (v_alpha * I_alpha_ + v_beta * I_beta_) / vbus;
+        } else {
+            I_alpha_ = 0.0f;
+            I_beta_ = 0.0f;
+            Ibus_ = 0.0f;
+        }
+
+        float Id = c * I_alpha_ + s * I_beta_;
+        float Iq = c * I_beta_ - s * I_alpha_;
+        torque_ = 1.5f * p.pole_pairs * (p.flux_linkage - p.lq_minus_ld * Id) * Iq;
+        float coulomb = p.coulomb_friction * std::max(std::min(10.0f * omega_, 1.0f), -1.0f);
+        omega_ += (torque_ - p.load_torque - coulomb - p.viscous_friction * omega_) / p.inertia * dt;
+        theta_ += omega_ * dt;
+    }
+
+    // Phase currents [A], positive into the motor
+    float I_a() const { return I_alpha_; }
+    float I_b() const { return -0.5f * I_alpha_ + 0.86602540378f * I_beta_; }
+    float I_c() const { return -0.5f * I_alpha_ - 0.86602540378f * I_beta_; }
+
+    Params_t params_;
+    float I_alpha_ = 0.0f;  // [A]
+    float I_beta_ = 0.0f;   // [A]
+    float Ibus_ = 0.0f;     // [A] average DC bus current drawn by the inverter
+    float torque_ = 0.0f;   // [Nm]
+    float theta_ = 0.0f;    // [rad] mechanical, does not wrap
+    float omega_ = 0.0f;    // [rad/s] mechanical
+};
+
+#endif // __SIM_PLANT_HPP
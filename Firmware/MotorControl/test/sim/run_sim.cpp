@@ -0,0 +1,2000 @@
+// Host simulation of the motor control stack.
+//
+// The unmodified MotorControl sources run against the simulated peripherals
+// in sim_hal.cpp and one PmsmPlant per axis. The simulation loop stands in
+// for the timers and ADCs: it steps the plants, writes the phase currents,
+// encoder counts and vbus into the peripheral registers and calls the same
+// interrupt callbacks as the firmware, then runs the axis threads until they
+// block again.
+//
+// Usage: run_sim [b]
+//   Runs the regression scenarios. With "b", also reports how long the
+//   interrupt and thread side of the control loop take on the host.
+
+#define __MAIN_CPP__
+#include "odrive_main.h"
+#include "communication/ascii_protocol.hpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <complex>
+#include <functional>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "sim_hal.hpp"
+#include "plant.hpp"
+
+// These are defined by main.cpp in the firmware
+BoardConfig_t board_config;
+Encoder::Config_t encoder_configs[AXIS_COUNT];
+SensorlessEstimator::Config_t sensorless_configs[AXIS_COUNT];
+FusionEstimator::Config_t fusion_configs[AXIS_COUNT];
+Controller::Config_t controller_configs[AXIS_COUNT];
+Motor::Config_t motor_configs[AXIS_COUNT];
+Axis::Config_t axis_configs[AXIS_COUNT];
+TrapezoidalTrajectory::Config_t trap_configs[AXIS_COUNT];
+bool user_config_loaded_;
+SystemStats_t system_stats_ = { 0 };
+Axis *axes[AXIS_COUNT];
+char serial_number_str[13] = "000000000000";
+EndpointProvider* application_endpoints_ = nullptr; // no object tree, the scenarios don't use "r" and "w"
+
+bool load_anticogging_map(Axis& axis) {
+    (void)axis;
+    return false;
+}
+
+bool reference_anticogging_map(Axis& axis) {
+    (void)axis;
+    return false;
+}
+
+/* Board ---------------------------------------------------------------------*/
+
+static PmsmPlant* plants[AXIS_COUNT];
+static uint32_t active_timings[AXIS_COUNT][3]; // the timer compare values after the preload
+static int32_t plant_counts[AXIS_COUNT];        // encoder position of the plants at the last step [counts]
+static float sim_vbus = 24.0f;             // [V] ideal supply
+static const size_t plant_substeps = 4;    // per quarter PWM period
+static const float thermistor_adc = 1000;  // [ADC counts] about 25degC on the board thermistors
+
+// Host time spent in the firmware code, for the benchmark
+struct HostTiming_t {
+    double isr_ns = 0.0;
+    uint64_t isr_calls = 0;
+    double thread_ns = 0.0;
+    uint64_t periods = 0;
+};
+static HostTiming_t host_timing;
+
+template<typename T>
+static double host_ns(const T& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// @brief Inverse of Motor::phase_current_from_adcval
+static uint32_t current_to_adcval(const Motor& motor, float current) {
+    float shunt_volt = current / motor.hw_config_.shunt_conductance;
+    float amp_out_volt = shunt_volt / motor.phase_current_rev_gain_;
+    int adcval = (1 << 11) + (int)lroundf(amp_out_volt * ((float)(1 << 12) / 3.3f));
+    return (uint32_t)std::min(std::max(adcval, 0), (1 << 12) - 1);
+}
+
+// @brief Fills the ADC1 DMA buffer with vbus and the board thermistors
+static void update_slow_adc() {
+    uint16_t vbus_adc = (uint16_t)(sim_vbus / (adc_ref_voltage * VBUS_S_DIVIDER_RATIO) * adc_full_scale);
+    for (size_t i = 0; i < ADC_OVERSAMPLING; ++i) {
+        adc_measurements_[i][VBUS_S_ADC_CHANNEL] = vbus_adc;
+        for (size_t axis = 0; axis < AXIS_COUNT; ++axis)
+            adc_measurements_[i][hw_configs[axis].axis_config.thermistor_adc_ch] = (uint16_t)thermistor_adc;
+    }
+}
+
+// @brief Advances the plants with the phase voltages that the timers currently output
+static void step_plants(float dt) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        TIM_TypeDef* tim = hw_configs[i].motor_config.timer->Instance;
+        float period = (float)tim->ARR;
+        // The SVM timings are the time each phase is low, see Motor::enqueue_modulation_timings
+        float duty[3];
+        for (size_t n = 0; n < 3; ++n)
+            duty[n] = std::max(1.0f - (float)active_timings[i][n] / period, 0.0f); // beyond the period the output stays low
+        bool enabled = tim->BDTR & TIM_BDTR_MOE;
+        for (size_t n = 0; n < plant_substeps; ++n)
+            plants[i]->step(duty, enabled, sim_vbus, dt / plant_substeps);
+
+        // Incremental encoder on the timer in encoder mode, with the motor direction as counting direction.
+        // The timer counts the edges, so that writes to CNT offset it like on the target.
+        const Encoder& encoder = axes[i]->encoder_;
+        int32_t counts = (int32_t)floorf(plants[i]->theta_ * (float)encoder.config_.cpr / (2.0f * M_PI));
+        TIM_TypeDef* enc_tim = hw_configs[i].encoder_config.timer->Instance;
+        enc_tim->CNT = (enc_tim->CNT + (uint32_t)(counts - plant_counts[i])) & 0xffff;
+        plant_counts[i] = counts;
+    }
+}
+
+// @brief Simulates one current measurement period.
+// The timers reach their update events and trigger ADC2 and ADC3 in the order
+// M0 (TIM1) counting up, M1 (TIM8) counting up pwm_phase_offset later, then
+// both counting down half a period after that. Counting up samples the phase
+// currents, counting down the zero current offset (see pwm_trig_adc_cb).
+static void sim_step_period() {
+    float lag = pwm_phase_offset * current_meas_period;
+    for (size_t k = 0; k < 4; ++k) {
+        float dt = (k % 2) ? lag : 0.5f * current_meas_period - lag;
+        step_plants(dt);
+        sim_advance_time((uint64_t)(dt * 1e9f));
+
+        size_t axis_num = k % 2;
+        bool counting_down = k >= 2;
+        Motor& motor = axes[axis_num]->motor_;
+        TIM_HandleTypeDef* htim = motor.hw_config_.timer;
+        if (counting_down)
+            htim->Instance->CR1 |= TIM_CR1_DIR;
+        else
+            htim->Instance->CR1 &= ~TIM_CR1_DIR;
+        htim->Instance->CNT = 1;
+        // The compare registers are preloaded, new timings take effect on the update event
+        active_timings[axis_num][0] = htim->Instance->CCR1;
+        active_timings[axis_num][1] = htim->Instance->CCR2;
+        active_timings[axis_num][2] = htim->Instance->CCR3;
+
+        // Counting down, only a phase that is held low conducts through its shunt
+        uint32_t period = htim->Instance->ARR;
+        float I_b = (counting_down && active_timings[axis_num][1] <= period) ? 0.0f : plants[axis_num]->I_b();
+        float I_c = (counting_down && active_timings[axis_num][2] <= period) ? 0.0f : plants[axis_num]->I_c();
+        const MotorHardwareConfig_t& hw_config = motor.hw_config_;
+        bool injected = hw_config.adc_injected;
+        if (injected) {
+            hw_config.phB_adc->Instance->JDR1 = current_to_adcval(motor, I_b);
+            hw_config.phC_adc->Instance->JDR1 = current_to_adcval(motor, I_c);
+        } else {
+            hw_config.phB_adc->Instance->DR = current_to_adcval(motor, I_b);
+            hw_config.phC_adc->Instance->DR = current_to_adcval(motor, I_c);
+        }
+
+        host_timing.isr_ns += host_ns([&]{
+            tim_update_cb(htim);
+            pwm_trig_adc_cb(hw_config.phB_adc, injected);
+            pwm_trig_adc_cb(hw_config.phC_adc, injected);
+        });
+        host_timing.isr_calls++;
+        host_timing.thread_ns += host_ns(sim_run_threads);
+    }
+    host_timing.periods++;
+}
+
+void sim_run_for(uint64_t ns) {
+    uint64_t end = sim_time() + ns;
+    while (sim_time() < end)
+        sim_step_period();
+}
+
+// @brief Runs the simulation until done() returns true or the timeout [s] expires.
+// @returns true if done() returned true
+static bool sim_run_until(const std::function<bool()>& done, float timeout) {
+    uint64_t end = sim_time() + (uint64_t)(timeout * 1e9f);
+    while (sim_time() < end) {
+        if (done())
+            return true;
+        sim_step_period();
+    }
+    return done();
+}
+
+// @brief Boots the simulated board, following odrive_main()
+static void sim_boot(const PmsmPlant::Params_t& plant_params) {
+    profiler.init();
+    fast_sincos_init();
+    init_pwm_timing();
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        motor_configs[i].pole_pairs = plant_params.pole_pairs;
+        plants[i] = new PmsmPlant(plant_params);
+        Encoder *encoder = new Encoder(hw_configs[i].encoder_config, encoder_configs[i]);
+        SensorlessEstimator *sensorless_estimator = new SensorlessEstimator(sensorless_configs[i]);
+        Controller *controller = new Controller(controller_configs[i]);
+        Motor *motor = new Motor(hw_configs[i].motor_config, hw_configs[i].gate_driver_config, motor_configs[i]);
+        TrapezoidalTrajectory *trap = new TrapezoidalTrajectory(trap_configs[i]);
+        FusionEstimator *fusion_estimator = new FusionEstimator(fusion_configs[i]);
+        axes[i] = new Axis(hw_configs[i].axis_config, axis_configs[i],
+                *encoder, *sensorless_estimator, *controller, *motor, *trap, *fusion_estimator);
+    }
+
+    start_general_purpose_adc();
+    update_slow_adc();
+    // the gate drivers never report a fault
+    HAL_GPIO_WritePin(nFAULT_GPIO_Port, nFAULT_Pin, GPIO_PIN_SET);
+    nFAULT_GPIO_Port->IDR |= nFAULT_Pin;
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->setup();
+    gate_driver_poll_init();
+    start_adc_pwm();
+    osDelay(1500); // let the current sense offset calibration converge
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->start_thread();
+    system_stats_.fully_booted = true;
+}
+
+/* Scenarios -----------------------------------------------------------------*/
+
+static bool check_no_errors(const char* scenario) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        if (axis.error_ || axis.motor_.error_ || axis.encoder_.error_) {
+            printf("%s: axis%zu error 0x%x, motor error 0x%x, encoder error 0x%x\n", scenario, i,
+                   (unsigned)axis.error_, (unsigned)axis.motor_.error_, (unsigned)axis.encoder_.error_);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool request_state(Axis::State_t state) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->requested_state_ = state;
+    return sim_run_until([]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->requested_state_ != Axis::AXIS_STATE_UNDEFINED)
+                return false;
+        }
+        return true;
+    }, 0.1f);
+}
+
+// Both axes run the full calibration sequence and must measure the plant
+static bool calibration_test(const PmsmPlant::Params_t& plant) {
+    if (!request_state(Axis::AXIS_STATE_FULL_CALIBRATION_SEQUENCE))
+        return printf("calibration: state request not picked up\n"), false;
+    bool done = sim_run_until([]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->current_state_ != Axis::AXIS_STATE_IDLE)
+                return false;
+        }
+        return true;
+    }, 30.0f);
+    if (!done)
+        return printf("calibration: did not finish\n"), false;
+    if (!check_no_errors("calibration"))
+        return false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        float R = axis.motor_.config_.phase_resistance;
+        float L = axis.motor_.config_.phase_inductance;
+        if (!axis.motor_.is_calibrated_ || !axis.encoder_.is_ready_)
+            return printf("calibration: axis%zu not calibrated\n", i), false;
+        if (fabsf(R / plant.phase_resistance - 1.0f) > 0.05f)
+            return printf("calibration: axis%zu phase resistance %g instead of %g\n", i, R, plant.phase_resistance), false;
+        if (fabsf(L / plant.phase_inductance - 1.0f) > 0.1f)
+            return printf("calibration: axis%zu phase inductance %g instead of %g\n", i, L, plant.phase_inductance), false;
+    }
+    printf("calibration: R %g, L %g, encoder offset %d: ok\n", axes[0]->motor_.config_.phase_resistance,
+           axes[0]->motor_.config_.phase_inductance, (int)axes[0]->encoder_.config_.offset);
+    return true;
+}
+
+// @brief Returns the mechanical velocity of the plant [counts/s]
+static float plant_vel(size_t axis_num) {
+    return plants[axis_num]->omega_ * (float)axes[axis_num]->encoder_.config_.cpr / (2.0f * M_PI);
+}
+
+// Both axes track a velocity setpoint in closed loop, one of them against a load
+static bool velocity_test() {
+    const float vel_setpoint = 20000.0f; // [counts/s]
+    if (!request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL))
+        return printf("velocity control: state request not picked up\n"), false;
+    // arming resets the setpoints
+    sim_run_for(10000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_vel_setpoint(i ? -vel_setpoint : vel_setpoint, 0.0f);
+    plants[1]->params_.load_torque = -0.05f; // [Nm] against the negative direction
+    sim_run_for(2000000000ull); // 2s, the velocity integrator takes up the load
+    bool ok = check_no_errors("velocity control");
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        float expected = i ? -vel_setpoint : vel_setpoint;
+        if (fabsf(plant_vel(i) - expected) > 0.02f * vel_setpoint) {
+            printf("velocity control: axis%zu at %f counts/s instead of %f\n", i, plant_vel(i), expected);
+            ok = false;
+        }
+    }
+    plants[1]->params_.load_torque = 0.0f;
+    if (ok)
+        printf("velocity control: %.0f and %.0f counts/s: ok\n", plant_vel(0), plant_vel(1));
+    return ok;
+}
+
+// Both axes settle after a position step
+static bool position_test() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Controller& controller = axes[i]->controller_;
+        float target = roundf(axes[i]->encoder_.pos_estimate_) + 2.0f * axes[i]->encoder_.config_.cpr;
+        controller.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+        controller.set_pos_setpoint(target, 0.0f, 0.0f);
+    }
+    sim_run_for(2000000000ull); // 2s to settle
+    // then the encoder quantization may only cause a limit cycle of a few counts
+    float max_error[AXIS_COUNT] = { 0.0f };
+    sim_run_until([&]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            float error = axes[i]->controller_.pos_setpoint_ - axes[i]->encoder_.pos_estimate_;
+            max_error[i] = std::max(max_error[i], fabsf(error));
+        }
+        return false;
+    }, 0.2f);
+    bool ok = check_no_errors("position control");
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        if (max_error[i] > 5.0f) {
+            printf("position control: axis%zu error up to %f counts\n", i, max_error[i]);
+            ok = false;
+        }
+    }
+    if (ok)
+        printf("position control: ok\n");
+    return ok;
+}
+
+// Setpoint commands take effect together at the next control loop update,
+// and only the newest one of those posted in between
+static bool setpoint_mailbox_test() {
+    Controller& controller = axes[0]->controller_;
+    float pos = controller.pos_setpoint_;
+    controller.set_vel_setpoint(1000.0f, 0.1f);
+    controller.set_pos_setpoint(pos + 10.0f, 50.0f, 0.05f);
+    bool ok = controller.pos_setpoint_ == pos && controller.vel_setpoint_ == 0.0f;
+    sim_run_for(1000000ull); // 1ms, a few control loop iterations
+    ok = ok && controller.pos_setpoint_ == pos + 10.0f && controller.vel_setpoint_ == 50.0f
+            && controller.current_setpoint_ == 0.05f
+            && controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL;
+    controller.set_pos_setpoint(pos, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("setpoint mailbox") && ok;
+    printf("setpoint mailbox: %s\n", ok ? "ok" : "setpoints not applied together");
+    return ok;
+}
+
+// The snapshot holds the state of the last control loop iteration
+static bool snapshot_test() {
+    bool ok = true;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        sim_run_for(1000000ull);
+        ok = ok && axis.take_snapshot();
+        const AxisSnapshot_t& snapshot = axis.snapshot_;
+        uint32_t age = (uint32_t)axis.get_meas_count() - snapshot.meas_count;
+        ok = ok && age <= axis.control_loop_divider() && snapshot.pos_setpoint == axis.controller_.pos_setpoint_
+                && snapshot.current_state == Axis::AXIS_STATE_CLOSED_LOOP_CONTROL
+                && fabsf(snapshot.pos_estimate - axis.encoder_.pos_estimate_) < 5.0f;
+    }
+    printf("snapshot: %s\n", ok ? "ok" : "not from the last control loop iteration");
+    return ok;
+}
+
+// Closed loop control only runs the encoder, unless other estimators are shadowed
+static bool estimator_selection_test() {
+    Axis& axis = *axes[0];
+    sim_run_for(1000000ull);
+    bool ok = axis.active_estimators_ == Axis::ESTIMATOR_ENCODER;
+    float vel_estimate = axis.sensorless_estimator_.vel_estimate_;
+    sim_run_for(10000000ull);
+    ok = ok && axis.sensorless_estimator_.vel_estimate_ == vel_estimate;
+    axis.config_.shadow_estimators = Axis::ESTIMATOR_SENSORLESS;
+    sim_run_for(10000000ull);
+    ok = ok && axis.active_estimators_ == (Axis::ESTIMATOR_ENCODER | Axis::ESTIMATOR_SENSORLESS)
+            && axis.sensorless_estimator_.vel_estimate_ != vel_estimate;
+    axis.config_.shadow_estimators = Axis::ESTIMATOR_NONE;
+    ok = check_no_errors("estimator selection") && ok;
+    printf("estimator selection: %s\n", ok ? "ok" : "unexpected estimators running");
+    return ok;
+}
+
+// M0 latches the count of the index edge in its encoder timer, M1 takes the count at the interrupt
+static bool index_capture_test() {
+    bool ok = true;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Encoder& encoder = axes[i]->encoder_;
+        const EncoderHardwareConfig_t& hw_config = hw_configs[i].encoder_config;
+        TIM_TypeDef* tim = hw_config.timer->Instance;
+        uint32_t cnt = tim->CNT;
+        int32_t shadow_count = encoder.shadow_count_;
+        int32_t count_in_cpr = encoder.count_in_cpr_;
+        bool use_index = encoder.config_.use_index;
+        bool is_ready = encoder.is_ready_;
+
+        // The index edge was 7 counts ago
+        encoder.config_.use_index = true;
+        encoder.index_found_ = false;
+        tim->CCR4 = (cnt - 7) & 0xffff;
+        tim->SR = TIM_FLAG_CC1 << (TIM_CHANNEL_4 >> 2);
+        encoder.enc_index_cb();
+        int32_t expected = hw_config.index_capture_af ? 7 : 0;
+        ok = ok && encoder.index_found_ && encoder.shadow_count_ == expected
+                && encoder.count_in_cpr_ == expected;
+
+        encoder.set_linear_count(shadow_count);
+        encoder.set_circular_count(count_in_cpr, false);
+        tim->CNT = cnt;
+        tim->SR = 0;
+        encoder.config_.use_index = use_index;
+        encoder.is_ready_ = is_ready;
+    }
+    ok = check_no_errors("index capture") && ok;
+    printf("index capture: %s\n", ok ? "ok" : "wrong count at the index");
+    return ok;
+}
+
+// A sin/cos encoder with offset, gain and phase errors that the calibration
+// values correct. The signals are fed to the ADC1 results directly, the position
+// estimate must resolve the position within the count.
+static bool sincos_test() {
+    Encoder::Config_t config;
+    config.mode = Encoder::MODE_SINCOS;
+    config.sincos_periods = 4;
+    config.cpr = 4 * 256;
+    config.sincos_offset_sin = 2000.0f;
+    config.sincos_offset_cos = 2100.0f;
+    config.sincos_gain_sin = 1.0f / 900.0f;
+    config.sincos_gain_cos = 1.0f / 1000.0f;
+    config.sincos_phase = 0.1f;
+    Encoder encoder(hw_configs[1].encoder_config, config);
+    encoder.axis_ = axes[1];
+    encoder.update_elec_rad_per_enc();
+    encoder.update_fn_ = &Encoder::update_mode<Encoder::MODE_SINCOS>;
+    encoder.sincos_rank_sin_ = 0;
+    encoder.sincos_rank_cos_ = 1;
+
+    const float vel = 300.0f; // [counts/s]
+    const float rad_per_count = 2.0f * (float)M_PI * (float)config.sincos_periods / (float)config.cpr;
+    float max_err = 0.0f;
+    bool ok = true;
+    const uint32_t n = (uint32_t)current_meas_hz; // 1s
+    for (uint32_t i = 0; i < n && ok; ++i) {
+        float pos = 100.0f + vel * (float)i * current_meas_period;
+        float angle = pos * rad_per_count;
+        ADC1->JDR1 = (uint32_t)lroundf(2000.0f + 900.0f * sinf(angle));
+        ADC1->JDR2 = (uint32_t)lroundf(2100.0f + 1000.0f * cosf(angle + 0.1f));
+        ok = encoder.update();
+        if (i > n / 2)
+            max_err = std::max(max_err, fabsf(encoder.pos_estimate_ - pos));
+    }
+    ok = ok && max_err < 0.25f && fabsf(encoder.sincos_amplitude_ - 1.0f) < 0.01f;
+    printf("sin/cos encoder: %s (max error %.3f counts)\n", ok ? "ok" : "position not resolved", max_err);
+    return ok;
+}
+
+// The load position comes from the snapshot of the other axis, scaled to the counts of this axis
+static bool load_encoder_test() {
+    Axis& axis = *axes[0];
+    axis.config_.load_encoder_ratio = 2.5f;
+    axis.config_.load_encoder_axis = 1;
+    int32_t pos_turns = 0;
+    float pos_in_turn = 0.0f;
+    bool ok = axis.get_load_position(&pos_turns, &pos_in_turn) && axes[1]->take_snapshot();
+    const AxisSnapshot_t& load = axes[1]->snapshot_;
+    double expected = ((double)load.pos_estimate_turns * axes[1]->encoder_.config_.cpr + load.pos_estimate_in_turn) * 2.5;
+    double actual = (double)pos_turns * axis.encoder_.config_.cpr + pos_in_turn;
+    ok = ok && fabs(actual - expected) < 1e-3 && pos_in_turn >= 0.0f && pos_in_turn < (float)axis.encoder_.config_.cpr;
+
+    // An axis can't be its own load encoder
+    axis.config_.load_encoder_axis = 0;
+    ok = ok && !axis.get_load_position(&pos_turns, &pos_in_turn) && (axis.error_ & Axis::ERROR_LOAD_ENCODER_FAILED);
+    axis.error_ = Axis::ERROR_NONE;
+    axis.config_.load_encoder_axis = -1;
+    axis.config_.load_encoder_ratio = 1.0f;
+    ok = check_no_errors("load encoder") && ok;
+    printf("load encoder: %s\n", ok ? "ok" : "wrong load position");
+    return ok;
+}
+
+// With oversampling, M0's phase current is the mean of the injected ranks
+static bool current_oversampling_test() {
+    Motor& motor = axes[0]->motor_;
+    set_current_oversampling(4);
+    const float samples[] = { 1.0f, 1.5f, 2.0f, 3.5f };
+    for (size_t i = 0; i < 4; ++i)
+        (&hadc2.Instance->JDR1)[i] = current_to_adcval(motor, samples[i]);
+    float expected = 0.0f;
+    for (size_t i = 0; i < 4; ++i)
+        expected += 0.25f * motor.phase_current_from_adcval((float)(&hadc2.Instance->JDR1)[i]);
+    expected -= motor.DC_calib_.phB;
+    // ADC2 also applies the pending M1 timings, which the next period expects to find
+    bool m1_timings_valid = axes[1]->motor_.next_timings_valid_;
+    motor.hw_config_.timer->Instance->CR1 &= ~TIM_CR1_DIR;
+    pwm_trig_adc_cb(&hadc2, true);
+    axes[1]->motor_.next_timings_valid_ = m1_timings_valid;
+    bool ok = fabsf(motor.current_meas_.phB - expected) < 1e-4f;
+    set_current_oversampling(board_config.current_oversampling);
+    sim_run_for(10000000ull);
+    ok = check_no_errors("current oversampling") && ok;
+    printf("current oversampling: %s\n", ok ? "ok" : "samples not averaged");
+    return ok;
+}
+
+// The offsets converge during the boot delay, and freeze while armed if requested
+static bool dc_calib_test() {
+    Motor& motor = axes[0]->motor_;
+    bool ok = axes[0]->motor_.DC_calib_converged_ && axes[1]->motor_.DC_calib_converged_
+            && fabsf(motor.DC_calib_.phB) < 0.05f && motor.armed_state_ != Motor::ARMED_STATE_DISARMED;
+    motor.config_.freeze_dc_calib_while_armed = true;
+    float offset = motor.DC_calib_.phB + 0.1f;
+    motor.DC_calib_.phB = offset;
+    sim_run_for(10000000ull);
+    ok = ok && motor.DC_calib_.phB == offset;
+    motor.config_.freeze_dc_calib_while_armed = false;
+    sim_run_for(10000000ull);
+    ok = ok && motor.DC_calib_.phB < offset;
+    ok = check_no_errors("dc calib") && ok;
+    printf("dc calib: %s\n", ok ? "ok" : "offsets not converged or not frozen");
+    return ok;
+}
+
+// The gate driver registers are read in the background. The simulated SPI
+// doesn't complete transfers on its own, so the test completes them.
+// Without the SPI DMA (as with I2C enabled), the poller must stay off.
+static bool gate_driver_poll_test() {
+    uint32_t counts[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        counts[i] = axes[i]->motor_.gate_driver_poll_count_;
+    for (size_t n = 0; n < (size_t)current_meas_hz / 50; ++n) {
+        sim_step_period();
+        HAL_SPI_TxRxCpltCallback(&hspi3);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        const Motor& motor = axes[i]->motor_;
+        ok = ok && motor.gate_driver_poll_count_ > counts[i] + 1 && motor.gate_driver_poll_error_count_ == 0
+                && motor.drv_fault_ == DRV8301_FaultType_NoFault;
+        counts[i] = motor.gate_driver_poll_count_;
+    }
+
+    DMA_HandleTypeDef* hdmarx = hspi3.hdmarx;
+    hspi3.hdmarx = nullptr;
+    for (size_t n = 0; n < (size_t)current_meas_hz / 50; ++n) {
+        sim_step_period();
+        HAL_SPI_TxRxCpltCallback(&hspi3);
+    }
+    hspi3.hdmarx = hdmarx;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        ok = ok && axes[i]->motor_.gate_driver_poll_count_ == counts[i];
+    ok = check_no_errors("gate driver poll") && ok;
+    printf("gate driver poll: %s\n", ok ? "ok" : "registers not refreshed");
+    return ok;
+}
+
+// Axis 1 follows axis 0 at a ratio, without jumping when gearing starts
+static bool gearing_test() {
+    Controller& leader = axes[0]->controller_;
+    Controller& follower = axes[1]->controller_;
+    follower.config_.gear_axis = 0;
+    follower.config_.gear_ratio = -0.5f;
+    float start_pos = follower.pos_setpoint_;
+    follower.start_gearing();
+    sim_run_for(10000000ull);
+    bool ok = fabsf(follower.pos_setpoint_ - start_pos) < 5.0f;
+    leader.set_vel_setpoint(8000.0f, 0.0f);
+    sim_run_for(500000000ull);
+    float expected = follower.config_.gear_offset - 0.5f * axes[0]->encoder_.pos_estimate_;
+    ok = ok && fabsf(follower.pos_setpoint_ - expected) < 10.0f
+            && fabsf(axes[1]->encoder_.pos_estimate_ - expected) < 50.0f
+            && fabsf(axes[1]->encoder_.vel_estimate_ + 4000.0f) < 200.0f;
+
+    // The cam table is interpolated over its period
+    follower.config_.cam_points = 4;
+    follower.config_.cam_period = 8192.0f;
+    const float cam[] = { 0.0f, 100.0f, 0.0f, -100.0f };
+    for (size_t i = 0; i < 4; ++i)
+        follower.config_.cam_table[i] = cam[i];
+    float slope;
+    ok = ok && fabsf(follower.cam_lookup(8192.0 * 3 + 1024.0, &slope) - 50.0f) < 1e-3f
+            && fabsf(slope - 100.0f * 4.0f / 8192.0f) < 1e-6f
+            && fabsf(follower.cam_lookup(-1024.0, &slope) + 50.0f) < 1e-3f;
+    follower.config_.cam_points = 0;
+
+    leader.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    follower.set_pos_setpoint(follower.pos_setpoint_, 0.0f, 0.0f);
+    follower.config_.gear_axis = -1;
+    ok = check_no_errors("gearing") && ok;
+    printf("gearing: %s\n", ok ? "ok" : "follower off the geared position");
+    return ok;
+}
+
+// Axis 0's controller commands both motors, with a preload between them
+static bool torque_share_test() {
+    Axis& leader = *axes[0];
+    Axis& follower = *axes[1];
+    leader.config_.torque_share_axis = 1;
+    leader.config_.torque_share_ratio = 0.5f;
+    leader.config_.torque_share_preload = 0.05f;
+    bool ok = true;
+    for (size_t n = 0; n < (size_t)current_meas_hz / 50; ++n) {
+        sim_step_period();
+        // Both iterations of a period use the controller output of that period
+        float Iq = leader.controller_.Iq_filtered_;
+        if (n > 2)
+            ok = ok && fabsf(leader.motor_.current_control_.Iq_setpoint - (0.5f * Iq + 0.05f)) < 1e-4f
+                    && fabsf(follower.motor_.current_control_.Iq_setpoint - (0.5f * Iq - 0.05f)) < 1e-4f;
+    }
+    leader.config_.torque_share_axis = -1;
+    leader.config_.torque_share_preload = 0.0f;
+    sim_run_for(10000000ull);
+    follower.controller_.set_pos_setpoint(follower.encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("torque share") && ok;
+    printf("torque share: %s\n", ok ? "ok" : "current command not split");
+    return ok;
+}
+
+// A velocity step on axis0 is slewed at vel_ramp_rate
+static bool vel_ramp_test() {
+    Controller& controller = axes[0]->controller_;
+    controller.config_.vel_ramp_enable = true;
+    controller.config_.vel_ramp_rate = 20000.0f; // [counts/s^2]
+    controller.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(10000000ull);
+    controller.set_vel_setpoint(10000.0f, 0.0f);
+    sim_run_for(250000000ull); // half way
+    float mid = controller.vel_setpoint_;
+    sim_run_for(500000000ull);
+    bool ok = fabsf(mid - 5000.0f) < 200.0f && controller.vel_setpoint_ == 10000.0f
+            && fabsf(plant_vel(0) - 10000.0f) < 500.0f;
+    controller.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(600000000ull);
+    controller.config_.vel_ramp_enable = false;
+    controller.set_pos_setpoint(axes[0]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("velocity ramp") && ok;
+    printf("velocity ramp: %.0f counts/s half way: %s\n", mid, ok ? "ok" : "not ramped");
+    return ok;
+}
+
+// The segment coefficients of the trapezoidal planner reproduce the closed
+// form profile, for increasing times and after jumping back
+static bool trap_traj_test() {
+    TrapezoidalTrajectory::Config_t config;
+    TrapezoidalTrajectory traj(config);
+    const float moves[][3] = { // Xf, Xi, Vi
+        { 100000.0f, 0.0f, 0.0f },     // trapezoid
+        { 1000.0f, 0.0f, 0.0f },       // triangle
+        { -5000.0f, 2000.0f, 3000.0f }, // reversal
+        { 50000.0f, 0.0f, 40000.0f },  // double deceleration
+    };
+    float max_error = 0.0f;
+    for (auto& move : moves) {
+        traj.planTrapezoidal(move[0], move[1], move[2], config.vel_limit, config.accel_limit, config.decel_limit);
+        auto check = [&](float t) {
+            TrapezoidalTrajectory::Step_t step = traj.eval(t);
+            float Y, Yd, Ydd;
+            if (t < 0.0f) {
+                Y = traj.Xi_; Yd = traj.Vi_; Ydd = 0.0f;
+            } else if (t < traj.Ta_) {
+                Y = traj.Xi_ + traj.Vi_*t + 0.5f*traj.Ar_*t*t; Yd = traj.Vi_ + traj.Ar_*t; Ydd = traj.Ar_;
+            } else if (t < traj.Ta_ + traj.Tv_) {
+                Y = traj.yAccel_ + traj.Vr_*(t - traj.Ta_); Yd = traj.Vr_; Ydd = 0.0f;
+            } else if (t < traj.Tf_) {
+                float td = t - traj.Tf_;
+                Y = traj.Xf_ + 0.5f*traj.Dr_*td*td; Yd = traj.Dr_*td; Ydd = traj.Dr_;
+            } else {
+                Y = traj.Xf_; Yd = 0.0f; Ydd = 0.0f;
+            }
+            float scale = fabsf(traj.Xf_ - traj.Xi_) + 1.0f;
+            max_error = std::max(max_error, std::max(fabsf(step.Y - Y) / scale,
+                    std::max(fabsf(step.Yd - Yd), fabsf(step.Ydd - Ydd)) / (fabsf(traj.Vr_) + fabsf(traj.Vi_) + 1.0f)));
+        };
+        for (float t = -0.01f; t < traj.Tf_ + 0.1f; t += 0.001f)
+            check(t);
+        for (float t = traj.Tf_ + 0.1f; t > -0.01f; t -= 0.37f)
+            check(t);
+    }
+    bool ok = max_error < 1e-5f;
+    printf("trapezoidal trajectory: max relative error %g: %s\n", max_error, ok ? "ok" : "not matching the closed form");
+    return ok;
+}
+
+// Retargeting axis0 at 100 Hz during a move keeps the setpoints continuous,
+// with both planners. An S-curve retargeted while accelerating further in
+// the same direction also keeps its acceleration.
+static bool replan_test() {
+    Controller& controller = axes[0]->controller_;
+    TrapezoidalTrajectory::Config_t& traj_config = axes[0]->trap_.config_;
+    TrapezoidalTrajectory::Config_t saved_config = traj_config;
+    traj_config.vel_limit = 20000.0f;
+    traj_config.accel_limit = 50000.0f;
+    traj_config.decel_limit = 50000.0f;
+    traj_config.jerk_limit = 1000000.0f;
+    traj_config.A_per_css = 1e-6f; // [A/(count/s^2)] to observe the acceleration
+    bool ok = true;
+    float max_dv = 0.0f, max_da = 0.0f; // relative to the limits
+    for (int scurve = 0; scurve < 2; ++scurve) {
+        traj_config.use_scurve = scurve;
+        float base = roundf(controller.pos_setpoint_);
+        float last_vel = controller.vel_setpoint_, last_accel = 0.0f;
+        uint64_t last_time = sim_time();
+        auto sample = [&](bool check_accel) {
+            float dt = (float)(sim_time() - last_time) * 1e-9f;
+            float accel = controller.current_setpoint_ / traj_config.A_per_css;
+            max_dv = std::max(max_dv, fabsf(controller.vel_setpoint_ - last_vel) / (traj_config.accel_limit * dt));
+            if (check_accel)
+                max_da = std::max(max_da, fabsf(accel - last_accel) / (traj_config.jerk_limit * dt));
+            last_vel = controller.vel_setpoint_;
+            last_accel = accel;
+            last_time = sim_time();
+        };
+        // A target that moves at 100 Hz
+        for (int n = 0; n < 50; ++n) {
+            controller.move_to_pos(base + 5000.0f * sinf(2.0f * M_PI * 2.0f * 0.01f * (float)n));
+            uint64_t end = sim_time() + 10000000ull;
+            while (sim_time() < end) {
+                sim_step_period();
+                sample(false);
+            }
+        }
+        controller.move_to_pos(base);
+        sim_run_until([&]{ sample(false); return controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL; }, 1.0f);
+        ok = ok && controller.pos_setpoint_ == base;
+        if (scurve) {
+            // Extend a move while it is in its first jerk phase
+            controller.move_to_pos(base + 20000.0f);
+            uint64_t end = sim_time() + 20000000ull;
+            while (sim_time() < end) {
+                sim_step_period();
+                sample(true);
+            }
+            controller.move_to_pos(base + 30000.0f);
+            ok = ok && sim_run_until([&]{ sample(true); return controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL; }, 2.0f);
+        }
+    }
+    traj_config = saved_config;
+    ok = ok && max_dv < 1.05f && max_da < 1.05f;
+    sim_run_for(300000000ull);
+    ok = check_no_errors("replanning") && ok;
+    printf("replanning: velocity step %.2f, acceleration step %.2f of the limits: %s\n", max_dv, max_da,
+           ok ? "ok" : "discontinuous");
+    return ok;
+}
+
+// A synced move starts and arrives on both axes together, on a straight line
+static bool synced_move_test() {
+    float start[AXIS_COUNT], goal[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        start[i] = axes[i]->controller_.pos_setpoint_;
+        goal[i] = roundf(start[i]) + (i ? -5000.0f : 20000.0f);
+    }
+    if (!move_to_pos_synced(goal[0], goal[1]))
+        return printf("synced move: rejected\n"), false;
+    float max_path_error = 0.0f;
+    uint64_t done_time[AXIS_COUNT] = { 0 };
+    sim_run_until([&]{
+        float progress[AXIS_COUNT];
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            Controller& controller = axes[i]->controller_;
+            progress[i] = (controller.pos_setpoint_ - start[i]) / (goal[i] - start[i]);
+            if (!done_time[i] && controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL
+                    && controller.pos_setpoint_ == goal[i])
+                done_time[i] = sim_time();
+        }
+        max_path_error = std::max(max_path_error, fabsf(progress[0] - progress[1]));
+        return done_time[0] && done_time[1];
+    }, 10.0f);
+    float arrival_skew = fabsf((float)done_time[0] - (float)done_time[1]) * 1e-9f; // [s]
+    // The control loops of the two axes run a measurement apart
+    bool ok = done_time[0] && done_time[1] && arrival_skew <= 2.0f * current_meas_period
+            && max_path_error < 2e-3f;
+    sim_run_for(300000000ull);
+    ok = check_no_errors("synced move") && ok;
+    printf("synced move: arrival %.0f us apart, path error %.4f: %s\n", arrival_skew * 1e6f, max_path_error,
+           ok ? "ok" : "not synchronized");
+    return ok;
+}
+
+// A G-code square is followed by both axes and ends where it started
+static bool gcode_path_test() {
+    float start[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        gcode.config_.counts_per_unit[i] = 100.0f;
+        start[i] = axes[i]->controller_.pos_setpoint_;
+    }
+    const float square[][2] = { { 5.0f, 0.0f }, { 0.0f, 5.0f }, { -5.0f, 0.0f }, { 0.0f, -5.0f } };
+    const bool given[AXIS_COUNT] = { true, true };
+    gcode.set_absolute(false);
+    gcode.set_feed_rate(600.0f); // [units/min]
+    for (const auto& move : square) {
+        if (!gcode.line(move, given, false))
+            return printf("gcode path: move rejected\n"), false;
+    }
+    gcode.set_absolute(true);
+    bool started = false;
+    float max_vel = 0.0f;
+    sim_run_until([&]{
+        bool done = true;
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            Controller& controller = axes[i]->controller_;
+            started = started || controller.config_.control_mode == Controller::CTRL_MODE_PATH_CONTROL;
+            done = done && controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL;
+        }
+        max_vel = std::max(max_vel, hypotf(axes[0]->controller_.vel_setpoint_, axes[1]->controller_.vel_setpoint_));
+        return started && done;
+    }, 10.0f);
+    float end_error = 0.0f;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        end_error = std::max(end_error, fabsf(axes[i]->controller_.pos_setpoint_ - start[i]));
+    // The feed rate of 10 units/s is reached on the straights
+    bool ok = started && gcode.queue_count_ == 0 && end_error < 1.0f && max_vel > 990.0f && max_vel < 1001.0f;
+    sim_run_for(300000000ull);
+    ok = check_no_errors("gcode path") && ok;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        gcode.config_.counts_per_unit[i] = 1.0f;
+    printf("gcode path: end error %.2f counts, top speed %.0f counts/s: %s\n", end_error, max_vel,
+           ok ? "ok" : "failed");
+    return ok;
+}
+
+// The friction identification measures the Coulomb and viscous friction of the plant
+static bool friction_identification_test() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        plants[i]->params_.coulomb_friction = 0.02f; // [Nm]
+    if (!request_state(Axis::AXIS_STATE_FRICTION_IDENTIFICATION))
+        return printf("friction identification: state request not picked up\n"), false;
+    bool done = sim_run_until([]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->current_state_ != Axis::AXIS_STATE_IDLE)
+                return false;
+        }
+        return true;
+    }, 20.0f);
+    bool ok = done && check_no_errors("friction identification");
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        const PmsmPlant::Params_t& p = plants[i]->params_;
+        float kt = 1.5f * p.pole_pairs * p.flux_linkage; // [Nm/A]
+        float rad_per_count = 2.0f * M_PI / (float)axes[i]->encoder_.config_.cpr;
+        float coulomb = p.coulomb_friction / kt;                    // [A]
+        float viscous = p.viscous_friction * rad_per_count / kt;    // [A/(counts/s)]
+        Controller::Config_t& config = axes[i]->controller_.config_;
+        if (fabsf(config.friction_coulomb - coulomb) > 0.1f * coulomb
+                || fabsf(config.friction_viscous - viscous) > 0.2f * viscous) {
+            printf("friction identification: axis%zu measured %f A + %g A/(counts/s) instead of %f A + %g A/(counts/s)\n",
+                   i, config.friction_coulomb, config.friction_viscous, coulomb, viscous);
+            ok = false;
+        }
+    }
+    if (ok)
+        printf("friction identification: %.3f A + %.3g A/(counts/s): ok\n",
+               axes[0]->controller_.config_.friction_coulomb, axes[0]->controller_.config_.friction_viscous);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        plants[i]->params_.coulomb_friction = 0.0f;
+    request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL);
+    sim_run_for(10000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        axes[i]->controller_.set_pos_setpoint(axes[i]->encoder_.pos_estimate_, 0.0f, 0.0f);
+        axes[i]->controller_.config_.friction_coulomb = 0.0f;
+        axes[i]->controller_.config_.friction_viscous = 0.0f;
+    }
+    sim_run_for(300000000ull);
+    return check_no_errors("friction identification") && ok;
+}
+
+// Measures the plant with current injection while holding the position and
+// compares it with the inertia and viscous friction of the plant model,
+// behind the current loop and followed by the velocity estimator. The back-EMF feedforward keeps the
+// back-EMF out of the current loop, which would otherwise damp the motion.
+static bool frequency_response_test() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        axes[i]->motor_.config_.enable_bemf_feedforward = true;
+        axes[i]->motor_.config_.flux_linkage = plants[i]->params_.flux_linkage;
+        FrequencyResponse::Config_t& config = axes[i]->freq_response_.config_;
+        config.injection = FrequencyResponse::INJECT_CURRENT;
+        config.amplitude = 1.0f;
+        config.min_frequency = 15.0f;
+        config.max_frequency = 45.0f;
+        config.num_points = 3;
+    }
+    if (!request_state(Axis::AXIS_STATE_FREQUENCY_RESPONSE))
+        return printf("frequency response: state request not picked up\n"), false;
+    bool done = sim_run_until([]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->current_state_ != Axis::AXIS_STATE_IDLE)
+                return false;
+        }
+        return true;
+    }, 10.0f);
+    bool ok = done && check_no_errors("frequency response");
+    float worst_gain_err = 0.0f;
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        const FrequencyResponse& fr = axes[i]->freq_response_;
+        const PmsmPlant::Params_t& p = plants[i]->params_;
+        float kt = 1.5f * p.pole_pairs * p.flux_linkage; // [Nm/A]
+        float counts_per_rad = (float)axes[i]->encoder_.config_.cpr / (2.0f * M_PI);
+        if (fr.num_points_done_ != fr.config_.num_points) {
+            printf("frequency response: axis%zu measured %u points\n", i, (unsigned)fr.num_points_done_);
+            ok = false;
+            break;
+        }
+        for (size_t k = 0; k < fr.num_points_done_; ++k) {
+            const float* row = &fr.results_[k * FrequencyResponse::kValuesPerRow];
+            std::complex<float> command(row[1], row[2]), output(row[3], row[4]);
+            std::complex<float> plant = output / command;
+            float omega = 2.0f * (float)M_PI * row[0];
+            float pll_bandwidth = axes[i]->encoder_.config_.bandwidth; // critically damped, see Pll
+            std::complex<float> pll_pole(1.0f, omega / pll_bandwidth);
+            std::complex<float> current_loop_pole(1.0f, omega / axes[i]->motor_.config_.current_control_bandwidth);
+            std::complex<float> model = kt * counts_per_rad / (std::complex<float>(p.viscous_friction, omega * p.inertia)
+                    * current_loop_pole * pll_pole * pll_pole);
+            float gain_err = fabsf(std::abs(plant) / std::abs(model) - 1.0f);
+            float phase_err = fabsf(std::arg(plant / model)) * 180.0f / (float)M_PI;
+            worst_gain_err = std::max(worst_gain_err, gain_err);
+            if (gain_err > 0.1f || phase_err > 10.0f) {
+                printf("frequency response: axis%zu at %.1f Hz measured %g counts/s/A at %.0f deg instead of %g at %.0f deg\n",
+                       i, row[0], std::abs(plant), std::arg(plant) * 180.0f / M_PI,
+                       std::abs(model), std::arg(model) * 180.0f / M_PI);
+                ok = false;
+            }
+        }
+    }
+    if (ok)
+        printf("frequency response: plant gain within %.1f%% of the model: ok\n", 100.0f * worst_gain_err);
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        axes[i]->motor_.config_.enable_bemf_feedforward = false;
+        axes[i]->motor_.config_.flux_linkage = 0.0f;
+    }
+    request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL);
+    sim_run_for(300000000ull);
+    return check_no_errors("frequency response") && ok;
+}
+
+// Tunes both axes, checks the inertia against the plant model and then
+// measures the loop gain of the tuned velocity loop at the target crossover.
+// As in frequency_response_test, the back-EMF feedforward keeps the current
+// loop from damping the plant.
+static bool auto_tuning_test() {
+    Controller::Config_t saved_config[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        saved_config[i] = axes[i]->controller_.config_;
+        axes[i]->motor_.config_.enable_bemf_feedforward = true;
+        axes[i]->motor_.config_.flux_linkage = plants[i]->params_.flux_linkage;
+    }
+    if (!request_state(Axis::AXIS_STATE_AUTO_TUNING))
+        return printf("auto tuning: state request not picked up\n"), false;
+    auto all_idle = []{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->current_state_ != Axis::AXIS_STATE_IDLE)
+                return false;
+        }
+        return true;
+    };
+    bool ok = sim_run_until(all_idle, 10.0f) && check_no_errors("auto tuning");
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        const PmsmPlant::Params_t& p = plants[i]->params_;
+        float kt = 1.5f * p.pole_pairs * p.flux_linkage; // [Nm/A]
+        float rad_per_count = 2.0f * M_PI / (float)axes[i]->encoder_.config_.cpr;
+        float inertia = p.inertia * rad_per_count / kt; // [A/(counts/s^2)]
+        float measured = axes[i]->controller_.config_.inertia;
+        if (fabsf(measured - inertia) > 0.1f * inertia) {
+            printf("auto tuning: axis%zu measured an inertia of %g instead of %g A/(counts/s^2)\n", i, measured, inertia);
+            ok = false;
+        }
+    }
+
+    // Loop gain at the crossover, in velocity control
+    const float wc = axes[0]->config_.auto_tune_vel_bandwidth;
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        axes[i]->controller_.set_vel_setpoint(0.0f, 0.0f);
+        FrequencyResponse::Config_t& config = axes[i]->freq_response_.config_;
+        config.injection = FrequencyResponse::INJECT_CURRENT;
+        config.amplitude = 0.5f;
+        config.min_frequency = config.max_frequency = wc / (2.0f * M_PI);
+        config.num_points = 1;
+    }
+    ok = ok && request_state(Axis::AXIS_STATE_FREQUENCY_RESPONSE) && sim_run_until(all_idle, 10.0f)
+            && check_no_errors("auto tuning");
+    float loop_gain_mag = 0.0f, phase_margin = 0.0f;
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        const float* row = axes[i]->freq_response_.results_;
+        std::complex<float> loop_gain = 1.0f / std::complex<float>(row[1], row[2]) - 1.0f;
+        loop_gain_mag = std::abs(loop_gain);
+        phase_margin = 180.0f + std::arg(loop_gain) * 180.0f / (float)M_PI;
+        float target_margin = axes[i]->config_.auto_tune_phase_margin;
+        if (fabsf(loop_gain_mag - 1.0f) > 0.2f || fabsf(phase_margin - target_margin) > 10.0f) {
+            printf("auto tuning: axis%zu loop gain %.2f with %.0f deg phase margin at %.0f rad/s\n",
+                   i, loop_gain_mag, phase_margin, wc);
+            ok = false;
+        }
+    }
+    if (ok)
+        printf("auto tuning: vel_gain %.3g, vel_integrator_gain %.3g, loop gain %.2f with %.0f deg phase margin: ok\n",
+               axes[0]->controller_.config_.vel_gain, axes[0]->controller_.config_.vel_integrator_gain,
+               loop_gain_mag, phase_margin);
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        axes[i]->controller_.config_ = saved_config[i];
+        axes[i]->motor_.config_.enable_bemf_feedforward = false;
+        axes[i]->motor_.config_.flux_linkage = 0.0f;
+    }
+    request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL);
+    sim_run_for(10000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_pos_setpoint(axes[i]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    return check_no_errors("auto tuning") && ok;
+}
+
+// The adaptive PLL bandwidth stays at the configured bandwidth at
+// standstill, reaches bandwidth_max at speed and comes back down
+static bool adaptive_pll_test() {
+    Encoder& encoder = axes[0]->encoder_;
+    Controller& controller = axes[0]->controller_;
+    Encoder::Config_t saved_config = encoder.config_;
+    encoder.config_.enable_adaptive_bandwidth = true;
+    encoder.config_.bandwidth_max = 3.0f * saved_config.bandwidth;
+    encoder.config_.adaptive_bandwidth_vel = 10000.0f;
+    encoder.update_pll_gains();
+
+    controller.set_vel_setpoint(5000.0f, 0.0f);
+    sim_run_for(1000000000ull);
+    float half_way_bandwidth = encoder.pll_bandwidth_;
+    controller.set_vel_setpoint(15000.0f, 0.0f);
+    sim_run_for(1000000000ull);
+    float speed_bandwidth = encoder.pll_bandwidth_;
+    bool tracking = fabsf(plant_vel(0) - 15000.0f) < 300.0f;
+    controller.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(1000000000ull);
+    controller.set_pos_setpoint(encoder.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    float standstill_bandwidth = encoder.pll_bandwidth_;
+
+    bool ok = check_no_errors("adaptive PLL") && tracking
+            && fabsf(half_way_bandwidth - 2.0f * saved_config.bandwidth) < 0.05f * saved_config.bandwidth
+            && speed_bandwidth == encoder.config_.bandwidth_max
+            && standstill_bandwidth == saved_config.bandwidth;
+    encoder.config_ = saved_config;
+    encoder.update_pll_gains();
+    sim_run_for(300000000ull);
+    ok = check_no_errors("adaptive PLL") && ok;
+    printf("adaptive PLL: %.0f, %.0f and %.0f rad/s at 5000, 15000 and 0 counts/s: %s\n",
+           half_way_bandwidth, speed_bandwidth, standstill_bandwidth, ok ? "ok" : "failed");
+    return ok;
+}
+
+// @brief Returns how far the current of axis 0 has risen 4 current
+// measurements after a 1 A step from Iq, as a fraction of the step
+static float current_step_rise(float Iq) {
+    Controller& controller = axes[0]->controller_;
+    controller.set_current_setpoint(Iq);
+    sim_run_for(20000000ull);
+    controller.set_current_setpoint(Iq + 1.0f);
+    const Motor& motor = axes[0]->motor_;
+    sim_run_until([&]{ return motor.current_control_.Iq_setpoint == Iq + 1.0f; }, 0.01f);
+    for (size_t i = 0; i < 4; ++i)
+        sim_step_period();
+    float rise = motor.current_control_.Iq_measured - Iq;
+    controller.set_current_setpoint(0.0f);
+    return rise;
+}
+
+// Calibrates the inductance table against a saturating plant, then compares
+// the rise of axis 0's current after a step at low and at high current,
+// while a large inertia holds the rotor. Without the gain scaling, the
+// saturated plant responds faster at high current.
+static bool inductance_table_test() {
+    const float saturation = 0.0667f; // [1/A] 40% lower inductance at 10 A
+    Motor::Config_t saved_configs[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        saved_configs[i] = axes[i]->motor_.config_;
+        plants[i]->params_.inductance_saturation = saturation;
+        axes[i]->motor_.config_.calibrate_inductance_table = true;
+    }
+    if (!request_state(Axis::AXIS_STATE_MOTOR_CALIBRATION))
+        return printf("inductance table: state request not picked up\n"), false;
+    bool done = sim_run_until([]{
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            if (axes[i]->current_state_ != Axis::AXIS_STATE_IDLE)
+                return false;
+        }
+        return true;
+    }, 30.0f);
+    bool ok = done && check_no_errors("inductance table");
+    for (size_t i = 0; ok && i < AXIS_COUNT; ++i) {
+        const Motor::Config_t& config = axes[i]->motor_.config_;
+        for (size_t j = 0; j < Motor::kInductanceTableSize; ++j) {
+            float current = config.inductance_table_current * (float)j / (float)(Motor::kInductanceTableSize - 1);
+            float expected = plants[i]->params_.phase_inductance / (1.0f + saturation * current) / config.phase_inductance;
+            if (fabsf(config.inductance_table[j] / expected - 1.0f) > 0.05f) {
+                printf("inductance table: axis%zu measured %f at %.1f A instead of %f\n",
+                       i, config.inductance_table[j], current, expected);
+                ok = false;
+            }
+        }
+    }
+
+    Motor& motor = axes[0]->motor_;
+    Controller& controller = axes[0]->controller_;
+    float saved_inertia = plants[0]->params_.inertia;
+    plants[0]->params_.inertia = 1e3f;
+    controller.config_.control_mode = Controller::CTRL_MODE_CURRENT_CONTROL;
+    controller.set_current_setpoint(0.0f);
+    request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL);
+    float unscaled_ratio = current_step_rise(8.0f) / current_step_rise(0.0f);
+    motor.config_.enable_inductance_scaling = true;
+    float scaled_ratio = current_step_rise(8.0f) / current_step_rise(0.0f);
+    ok = ok && check_no_errors("inductance table") && unscaled_ratio > 1.15f && fabsf(scaled_ratio - 1.0f) < 0.1f;
+    printf("inductance table: %.2f at 0 A, %.2f at %.0f A, step response at 8 A vs 0 A %.2f unscaled, %.2f scaled: %s\n",
+           motor.config_.inductance_table[0], motor.config_.inductance_table[Motor::kInductanceTableSize - 1],
+           motor.config_.inductance_table_current, unscaled_ratio, scaled_ratio, ok ? "ok" : "failed");
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.inductance_saturation = 0.0f;
+        axes[i]->motor_.config_ = saved_configs[i];
+        axes[i]->motor_.update_current_controller_gains();
+    }
+    plants[0]->params_.inertia = saved_inertia;
+    controller.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+    request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL);
+    sim_run_for(10000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_pos_setpoint(axes[i]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    return check_no_errors("inductance table") && ok;
+}
+
+// Axis 0 drives a salient plant at the current limit, first with Id = 0 and
+// then on the MTPA curve, while a large inertia holds the rotor. The MTPA
+// current must give more torque without exceeding the current limit.
+static bool mtpa_test() {
+    Motor& motor = axes[0]->motor_;
+    Controller& controller = axes[0]->controller_;
+    PmsmPlant& plant = *plants[0];
+    Motor::Config_t saved_config = motor.config_;
+    float saved_inertia = plant.params_.inertia;
+    plant.params_.inertia = 1e3f;
+    plant.params_.lq_minus_ld = 150e-6f;
+    motor.config_.flux_linkage = plant.params_.flux_linkage;
+    motor.config_.lq_minus_ld = plant.params_.lq_minus_ld;
+    float Ilim = motor.config_.current_lim;
+
+    controller.set_current_setpoint(Ilim);
+    sim_run_for(500000000ull);
+    float plain_torque = plant.torque_;
+    motor.config_.enable_mtpa = true;
+    sim_run_for(500000000ull);
+    float mtpa_torque = plant.torque_;
+    float I_mag = sqrtf(SQ(plant.I_alpha_) + SQ(plant.I_beta_));
+    const Motor::CurrentControl_t& ictrl = motor.current_control_;
+    bool ok = check_no_errors("MTPA") && mtpa_torque > 1.05f * plain_torque && I_mag < 1.01f * Ilim
+            && ictrl.mtpa_Id < 0.0f && fabsf(ictrl.Id_measured - ictrl.mtpa_Id) < 0.1f;
+    printf("MTPA: %.3f Nm with Id = 0, %.3f Nm with Id %.2f A, Iq %.2f A: %s\n", plain_torque, mtpa_torque,
+           ictrl.Id_measured, ictrl.Iq_measured, ok ? "ok" : "failed");
+
+    controller.set_current_setpoint(0.0f);
+    sim_run_for(10000000ull);
+    motor.config_ = saved_config;
+    plant.params_.lq_minus_ld = 0.0f;
+    plant.params_.inertia = saved_inertia;
+    controller.set_pos_setpoint(axes[0]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    return check_no_errors("MTPA") && ok;
+}
+
+// Axis 0 drives a load at constant speed. The power accounting must match
+// the power flow of the plant and the energy totals its integral over 1s.
+static bool power_accounting_test() {
+    Motor& motor = axes[0]->motor_;
+    PmsmPlant& plant = *plants[0];
+    axes[0]->controller_.set_vel_setpoint(20000.0f, 0.0f);
+    plant.params_.load_torque = 0.1f; // [Nm]
+    sim_run_for(1000000000ull);
+    float electrical_energy = motor.power_.electrical_energy;
+    float mechanical_energy = motor.power_.mechanical_energy;
+    float loss_energy = motor.power_.loss_energy;
+    float plant_electrical = 0.0f, plant_mechanical = 0.0f, plant_loss = 0.0f;
+    const size_t num_periods = (size_t)current_meas_hz; // 1s
+    for (size_t i = 0; i < num_periods; ++i) {
+        sim_step_period();
+        plant_electrical += vbus_voltage * plant.Ibus_;
+        plant_mechanical += plant.torque_ * plant.omega_;
+        plant_loss += 1.5f * plant.params_.phase_resistance * (SQ(plant.I_alpha_) + SQ(plant.I_beta_));
+    }
+    plant_electrical /= (float)num_periods;
+    plant_mechanical /= (float)num_periods;
+    plant_loss /= (float)num_periods;
+    electrical_energy = motor.power_.electrical_energy - electrical_energy;
+    mechanical_energy = motor.power_.mechanical_energy - mechanical_energy;
+    loss_energy = motor.power_.loss_energy - loss_energy;
+    // The averages only cover the last power_window and see the speed ripple
+    bool ok = check_no_errors("power accounting")
+            && fabsf(motor.power_.electrical / plant_electrical - 1.0f) < 0.05f
+            && fabsf(motor.power_.mechanical / plant_mechanical - 1.0f) < 0.05f
+            && fabsf(motor.power_.loss / plant_loss - 1.0f) < 0.05f
+            && fabsf(electrical_energy / plant_electrical - 1.0f) < 0.02f
+            && fabsf(mechanical_energy / plant_mechanical - 1.0f) < 0.02f
+            && fabsf(loss_energy / plant_loss - 1.0f) < 0.02f;
+    printf("power accounting: %.2f W electrical, %.2f W mechanical, %.3f W loss, plant %.2f W, %.2f W, %.3f W: %s\n",
+           motor.power_.electrical, motor.power_.mechanical, motor.power_.loss,
+           plant_electrical, plant_mechanical, plant_loss, ok ? "ok" : "failed");
+    plant.params_.load_torque = 0.0f;
+    axes[0]->controller_.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(1000000000ull);
+    axes[0]->controller_.set_pos_setpoint(axes[0]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    return check_no_errors("power accounting") && ok;
+}
+
+// @brief Returns the average bus current [A] of each plant over duration [s]
+static void measure_plant_Ibus(float duration, float Ibus[AXIS_COUNT]) {
+    const size_t num_periods = (size_t)(duration * (float)current_meas_hz);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        Ibus[i] = 0.0f;
+    for (size_t n = 0; n < num_periods; ++n) {
+        sim_step_period();
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            Ibus[i] += plants[i]->Ibus_ / (float)num_periods;
+    }
+}
+
+// Both axes drive a load that needs more than the supply limit: the total
+// bus current stays at the limit and the axes get equal shares of it. With
+// one axis idle, the other one may take more than its share.
+static bool dc_bus_limit_test() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.load_torque = 0.1f; // [Nm]
+        axes[i]->controller_.set_vel_setpoint(20000.0f, 0.0f);
+    }
+    sim_run_for(1000000000ull);
+    float unlimited[AXIS_COUNT];
+    measure_plant_Ibus(0.25f, unlimited);
+    float limit = 0.75f * (unlimited[0] + unlimited[1]);
+    board_config.dc_bus_current_limit = limit;
+    board_config.enable_dc_bus_limit = true;
+    sim_run_for(1000000000ull);
+    float shared[AXIS_COUNT];
+    measure_plant_Ibus(0.25f, shared);
+
+    // One axis coasts, the other one gets the whole budget
+    plants[1]->params_.load_torque = 0.0f;
+    axes[1]->controller_.set_current_setpoint(0.0f);
+    sim_run_for(1000000000ull);
+    float single[AXIS_COUNT];
+    measure_plant_Ibus(0.25f, single);
+
+    board_config.enable_dc_bus_limit = false;
+    board_config.dc_bus_current_limit = BoardConfig_t().dc_bus_current_limit;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.load_torque = 0.0f;
+        axes[i]->controller_.set_vel_setpoint(0.0f, 0.0f);
+    }
+    sim_run_for(1000000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_pos_setpoint(axes[i]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+
+    float total = shared[0] + shared[1];
+    bool ok = check_no_errors("dc bus limit") && total < 1.03f * limit && total > 0.9f * limit
+            && fabsf(shared[0] - shared[1]) < 0.1f * limit
+            && single[0] > 0.95f * unlimited[0] && single[0] > 0.6f * limit;
+    printf("dc bus limit: %.2f A unlimited, %.2f + %.2f A at %.2f A, %.2f A alone: %s\n",
+           unlimited[0] + unlimited[1], shared[0], shared[1], limit, single[0], ok ? "ok" : "failed");
+    return ok;
+}
+
+// The shadowed sensorless estimator of axis 0 schedules its gains with its
+// velocity estimate while the encoder drives the motor: high gains at low
+// speed, lower ones at high speed
+static bool sensorless_gain_schedule_test() {
+    Axis& axis = *axes[0];
+    SensorlessEstimator& sensorless = axis.sensorless_estimator_;
+    SensorlessEstimator::Config_t& config = sensorless_configs[0];
+    config.gain_schedule_points = 2;
+    config.gain_schedule[0] = { 0.0f, 1500.0f, 1500.0f };
+    config.gain_schedule[1] = { 1000.0f, 300.0f, 300.0f };
+    axis.config_.shadow_estimators = Axis::ESTIMATOR_SENSORLESS;
+    axis.controller_.set_vel_setpoint(40000.0f, 0.0f);
+    sim_run_for(1000000000ull);
+
+    float vel = fabsf(sensorless.vel_estimate_);
+    float plant_vel = plants[0]->omega_ * (float)plants[0]->params_.pole_pairs; // [rad/s] electrical
+    float expected = 1500.0f - std::min(vel / 1000.0f, 1.0f) * 1200.0f;
+    float observer_gain = sensorless.observer_gain_;
+    float pll_bandwidth = sensorless.pll_bandwidth_;
+    bool ok = fabsf(vel - plant_vel) < 0.2f * plant_vel
+            && observer_gain > 300.0f && observer_gain < 1500.0f
+            && fabsf(observer_gain - expected) < 0.05f * expected
+            && fabsf(pll_bandwidth - expected) < 0.05f * expected
+            && sensorless.pll_.kp_ == 2.0f * pll_bandwidth;
+
+    // Without points, the constant gains apply again
+    config.gain_schedule_points = 0;
+    sim_run_for(10000000ull);
+    ok = ok && sensorless.observer_gain_ == config.observer_gain
+            && sensorless.pll_bandwidth_ == config.pll_bandwidth;
+
+    axis.config_.shadow_estimators = Axis::ESTIMATOR_NONE;
+    axis.controller_.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(1000000000ull);
+    axis.controller_.set_pos_setpoint(axis.encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("sensorless gain schedule") && ok;
+    printf("sensorless gain schedule: %.0f rad/s, observer gain %.0f, pll bandwidth %.0f rad/s: %s\n",
+           vel, observer_gain, pll_bandwidth, ok ? "ok" : "failed");
+    return ok;
+}
+
+// @brief Copies of the objects that the control loop state is in, to run
+// the same cycles twice. The objects are copied byte by byte, so that the
+// references and pointers in them stay the same.
+class SimStateCopy {
+public:
+    template<typename T>
+    void add(T& object) { objects_.push_back({ reinterpret_cast<uint8_t*>(&object), sizeof(T) }); }
+
+    void save() {
+        data_.clear();
+        for (const Object_t& object : objects_)
+            data_.insert(data_.end(), object.ptr, object.ptr + object.size);
+    }
+
+    void restore() const {
+        size_t pos = 0;
+        for (const Object_t& object : objects_) {
+            memcpy(object.ptr, &data_[pos], object.size);
+            pos += object.size;
+        }
+    }
+
+private:
+    struct Object_t {
+        uint8_t* ptr;
+        size_t size;
+    };
+    std::vector<Object_t> objects_;
+    std::vector<uint8_t> data_;
+};
+
+// @brief Steps one period and appends the outputs of the control loop of both axes to trace
+static void step_and_trace(std::vector<float>* trace) {
+    sim_step_period();
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        const Axis& axis = *axes[i];
+        TIM_TypeDef* tim = hw_configs[i].motor_config.timer->Instance;
+        trace->insert(trace->end(), {
+            axis.motor_.current_control_.Iq_measured, axis.motor_.current_control_.Iq_setpoint,
+            axis.encoder_.pos_estimate_, axis.encoder_.vel_estimate_, axis.controller_.vel_integrator_current_,
+            (float)tim->CCR1, (float)tim->CCR2, (float)tim->CCR3 });
+    }
+}
+
+// A recording of the control loop inputs, with a velocity command in the
+// middle, is replayed from the state it started in. The plants then produce
+// other inputs and another command is posted, but the replay must run the
+// same cycles bit for bit.
+static bool record_replay_test() {
+    SimStateCopy state;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        state.add(axis);
+        state.add(axis.encoder_);
+        state.add(axis.sensorless_estimator_);
+        state.add(axis.controller_);
+        state.add(axis.motor_);
+        state.add(axis.trap_);
+        state.add(axis.fusion_estimator_);
+        state.add(*plants[i]);
+        state.add(*hw_configs[i].motor_config.timer->Instance);
+        state.add(*hw_configs[i].encoder_config.timer->Instance);
+    }
+    state.add(active_timings);
+    state.add(plant_counts);
+    state.add(vbus_voltage);
+    state.add(vbus_voltage_filtered);
+    state.add(vbus_V_to_mod);
+    state.add(regen_current_lim);
+    state.add(brake_power);
+    state.add(brake_energy);
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.load_torque = 0.05f; // [Nm]
+        axes[i]->controller_.set_vel_setpoint(5000.0f, 0.0f);
+    }
+    sim_run_for(500000000ull);
+    state.save();
+
+    std::vector<float> recorded;
+    bool ok = input_recorder.start();
+    size_t periods = 0;
+    while (input_recorder.state_ == InputRecorder::STATE_RECORDING && periods < 10000) {
+        if (periods == 40)
+            axes[0]->controller_.set_vel_setpoint(8000.0f, 0.0f);
+        step_and_trace(&recorded);
+        ++periods;
+    }
+    uint32_t num_records = input_recorder.num_records_;
+    ok = ok && input_recorder.num_setpoints_ == 1;
+
+    state.restore();
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.load_torque = 0.2f;
+        plants[i]->omega_ += 10.0f; // [rad/s]
+    }
+    ok = ok && input_recorder.start_replay();
+    axes[0]->controller_.set_vel_setpoint(-3000.0f, 0.0f);
+    std::vector<float> replayed;
+    for (size_t n = 0; n < periods; ++n)
+        step_and_trace(&replayed);
+    // The recording ends within the last period, which then runs on live inputs
+    size_t compared = recorded.size() - recorded.size() / periods;
+    ok = ok && replayed.size() == recorded.size()
+            && memcmp(replayed.data(), recorded.data(), compared * sizeof(float)) == 0
+            && input_recorder.replay_mismatches_ == 0;
+    sim_step_period();
+    ok = ok && input_recorder.state_ == InputRecorder::STATE_DONE;
+
+    // A recording of one axis can't be replayed, the other axis would feed
+    // live values into the shared vbus voltage and DC bus budget
+    input_recorder.config_.axes = 1;
+    ok = ok && input_recorder.start();
+    for (size_t n = 0; n < 10; ++n)
+        sim_step_period();
+    input_recorder.stop();
+    ok = ok && input_recorder.header()->axes == 1 && !input_recorder.start_replay();
+    input_recorder.config_.axes = (1u << AXIS_COUNT) - 1;
+
+    // Back to the recorded run, where the plants and the firmware agree
+    state.restore();
+    input_recorder.discard();
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        plants[i]->params_.load_torque = 0.0f;
+        axes[i]->controller_.set_vel_setpoint(0.0f, 0.0f);
+    }
+    sim_run_for(1000000000ull);
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.set_pos_setpoint(axes[i]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("record and replay") && ok;
+    printf("record and replay: %u records over %zu periods, %u mismatches: %s\n", (unsigned)num_records,
+           periods, (unsigned)input_recorder.replay_mismatches_, ok ? "ok" : "failed");
+    return ok;
+}
+
+// @brief Replays a recording written by record_inputs() in
+// tools/odrive/utils.py and writes the outputs of the control loop of each
+// axis in every current measurement as CSV to output_filename.
+// The replay starts from the configuration of this simulation (sim_boot()
+// and the config structs above, edit them to match the device) with both
+// axes calibrated and in closed loop control at rest.
+static bool replay_recording(const char* filename, const char* output_filename, const PmsmPlant::Params_t& plant_params) {
+    std::vector<uint8_t> data(InputRecorder::kBufferBytes + 1);
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return fprintf(stderr, "replay: can't open %s\n", filename), false;
+    size_t length = fread(data.data(), 1, data.size(), file);
+    fclose(file);
+    if (length != InputRecorder::kBufferBytes)
+        return fprintf(stderr, "replay: %s has %zu bytes instead of %zu\n", filename, length,
+                       InputRecorder::kBufferBytes), false;
+
+    if (!calibration_test(plant_params) || !request_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL))
+        return false;
+    sim_run_for(100000000ull);
+    memcpy(oscilloscope.buffer_, data.data(), length);
+    const InputRecorder::Header_t* header = input_recorder.header();
+    if (!input_recorder.start_replay())
+        return fprintf(stderr, "replay: the recording (axes 0x%x, %g Hz, oversampling %u) doesn't match "
+                       "this firmware (%d Hz, oversampling %u) or isn't of all axes\n",
+                       (unsigned)header->axes, header->current_meas_hz, (unsigned)header->current_oversampling,
+                       (int)current_meas_hz, (unsigned)board_config.current_oversampling), false;
+
+    FILE* output = fopen(output_filename, "w");
+    if (!output)
+        return fprintf(stderr, "replay: can't write %s\n", output_filename), false;
+    fprintf(output, "cycle,axis,Iq_measured,Iq_setpoint,pos_estimate,vel_estimate,vel_integrator_current,CCR1,CCR2,CCR3\n");
+    std::vector<float> trace;
+    for (size_t cycle = 0; input_recorder.state_ == InputRecorder::STATE_REPLAYING; ++cycle) {
+        trace.clear();
+        step_and_trace(&trace);
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            const float* v = &trace[i * 8];
+            fprintf(output, "%zu,%zu,%g,%g,%g,%g,%g,%.0f,%.0f,%.0f\n", cycle, i, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        }
+    }
+    fclose(output);
+    printf("replay: %u records, %u setpoint commands, %u mismatches\n", (unsigned)header->num_records,
+           (unsigned)header->num_setpoints, (unsigned)input_recorder.replay_mismatches_);
+    return true;
+}
+
+// @brief Returns the average number of phases of axis 0 that switch in a PWM
+// period, over the next num_periods current measurements
+static float switching_phases(size_t num_periods) {
+    uint32_t period = hw_configs[0].motor_config.timer->Instance->ARR;
+    uint32_t switching = 0;
+    for (size_t i = 0; i < num_periods; ++i) {
+        sim_step_period();
+        for (size_t n = 0; n < 3; ++n)
+            switching += active_timings[0][n] > 0 && active_timings[0][n] <= period;
+    }
+    return (float)switching / (float)num_periods;
+}
+
+// Axis 0 turns slowly at light load with DPWM, which must keep the speed and
+// the current offsets with one phase less switching. A heavy load then
+// returns to SVM, and DPWM only comes back dpwm_hold_time after it.
+static bool dpwm_test() {
+    Axis& axis = *axes[0];
+    Motor& motor = axis.motor_;
+    Motor::Config_t saved_config = motor.config_;
+    axis.controller_.set_vel_setpoint(20000.0f, 0.0f);
+    sim_run_for(500000000ull);
+    float svm_phases = switching_phases(1000);
+    Motor::Iph_BC_t DC_calib = motor.DC_calib_;
+
+    motor.config_.enable_dpwm = true;
+    sim_run_for(500000000ull);
+    float dpwm_phases = switching_phases(1000);
+    bool engaged = motor.dpwm_active_;
+    float vel = axis.encoder_.vel_estimate_;
+    float DC_calib_drift = std::max(fabsf(motor.DC_calib_.phB - DC_calib.phB),
+                                    fabsf(motor.DC_calib_.phC - DC_calib.phC));
+
+    // The same motion counts as a heavy load with lower limits
+    motor.config_.dpwm_max_current = 0.0f;
+    motor.config_.dpwm_max_vel = 10.0f;
+    sim_run_for(10000000ull);
+    bool heavy_svm = !motor.dpwm_active_ && switching_phases(100) > 2.9f;
+    motor.config_.dpwm_max_vel = saved_config.dpwm_max_vel;
+    sim_run_for((uint64_t)(0.5f * saved_config.dpwm_hold_time * 1e9f));
+    bool held = !motor.dpwm_active_;
+    sim_run_for((uint64_t)(saved_config.dpwm_hold_time * 1e9f));
+    bool reengaged = motor.dpwm_active_;
+
+    // With phases B and C tied at the top, both stay low for the whole period.
+    // No compare value may be exactly the period, which would glitch.
+    uint16_t period = (uint16_t)hw_configs[0].motor_config.timer->Instance->ARR;
+    bool timings_ok = true;
+    for (float mod : { 0.3f, 0.5f }) {
+        uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+        timings_ok = motor.enqueue_modulation_timings(mod, 0.0f) && timings_ok;
+        for (size_t i = 0; i < 3; ++i)
+            timings_ok = timings_ok && (motor.next_timings_[i] < period || motor.next_timings_[i] == period + 1);
+        cpu_exit_masked_critical(basepri);
+    }
+
+    motor.config_ = saved_config;
+    axis.controller_.set_vel_setpoint(0.0f, 0.0f);
+    sim_run_for(500000000ull);
+    axis.controller_.set_pos_setpoint(axis.encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    bool ok = check_no_errors("dpwm") && engaged && svm_phases > 2.9f
+            && dpwm_phases > 1.9f && dpwm_phases < 2.1f
+            && fabsf(vel - 20000.0f) < 0.05f * 20000.0f && DC_calib_drift < 0.01f
+            && heavy_svm && held && reengaged && timings_ok && !motor.dpwm_active_;
+    printf("dpwm: %.2f switching phases with SVM, %.2f with DPWM at %.0f counts/s, offset drift %.4f A: %s\n",
+           svm_phases, dpwm_phases, vel, DC_calib_drift, ok ? "ok" : "failed");
+    return ok;
+}
+
+// Collects the responses of the ASCII protocol, one string per line
+class ResponseLines : public StreamSink {
+public:
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) override {
+        for (size_t i = 0; i < length; ++i) {
+            if (buffer[i] == '\n')
+                lines_.push_back(std::move(line_)), line_.clear();
+            else if (buffer[i] != '\r')
+                line_ += (char)buffer[i];
+        }
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+    size_t get_free_space() override { return SIZE_MAX; }
+    std::vector<std::string> lines_;
+private:
+    std::string line_;
+};
+
+// G-code lines reach Gcode through the ASCII protocol also with a line
+// number in front and in lower case, and the path runs
+static bool ascii_gcode_test() {
+    float start[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        gcode.config_.counts_per_unit[i] = 100.0f;
+        start[i] = axes[i]->controller_.pos_setpoint_;
+    }
+    const char input[] = "G91\nN10 G1 X2 Y1 F600\ng1 x-2 y-1\nn11 g90\nM3\n";
+    ResponseLines responses;
+    ASCII_protocol_parse_stream((const uint8_t*)input, sizeof(input) - 1, responses, ASCII_CHANNEL_UART);
+    std::vector<std::string>& lines = responses.lines_;
+    bool ok = lines.size() == 5 && lines[4] == "unknown command";
+    for (size_t i = 0; ok && i < 4; ++i)
+        ok = lines[i].compare(0, 3, "ok ") == 0;
+
+    bool started = false;
+    sim_run_until([&]{
+        bool done = true;
+        for (size_t i = 0; i < AXIS_COUNT; ++i) {
+            Controller& controller = axes[i]->controller_;
+            started = started || controller.config_.control_mode == Controller::CTRL_MODE_PATH_CONTROL;
+            done = done && controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL;
+        }
+        return started && done;
+    }, 5.0f);
+    float end_error = 0.0f;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        end_error = std::max(end_error, fabsf(axes[i]->controller_.pos_setpoint_ - start[i]));
+    ok = ok && started && gcode.queue_count_ == 0 && end_error < 1.0f;
+    sim_run_for(300000000ull);
+    ok = check_no_errors("ascii gcode") && ok;
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        gcode.config_.counts_per_unit[i] = 1.0f;
+    printf("ascii gcode: %zu responses, \"%s\" first, end error %.2f counts: %s\n", lines.size(),
+           lines.empty() ? "" : lines[0].c_str(), end_error, ok ? "ok" : "failed");
+    return ok;
+}
+
+// Messages longer than kMaxMessageLength are cut and marked, messages that
+// don't fit into the buffer any more are dropped whole
+static bool logger_test() {
+    logger.consume(logger.write_count_ - logger.read_count_);
+    uint32_t start = logger.write_count_;
+    char text[Logger::kMaxMessageLength + 40];
+    memset(text, 'a', sizeof(text));
+    bool ok = logger.write(Logger::LEVEL_INFO, text, Logger::kMaxMessageLength)
+            && logger.write(Logger::LEVEL_INFO, text, sizeof(text));
+    log_printf(Logger::LEVEL_WARNING, "%*d", (int)Logger::kMaxMessageLength + 10, 1);
+    const size_t marker_len = sizeof(Logger::kTruncationMarker) - 1;
+    for (int i = 0; i < 2; ++i) {
+        uint32_t end = start + (uint32_t)(i + 2) * Logger::kMaxMessageLength;
+        for (size_t j = 0; j < marker_len; ++j)
+            ok = ok && logger.buffer_[(end - marker_len + j) & (Logger::kBufferSize - 1)] == Logger::kTruncationMarker[j];
+    }
+    ok = ok && logger.write_count_ - start == 3 * Logger::kMaxMessageLength
+            && logger.truncated_messages_ == 2 && logger.dropped_messages_ == 0;
+
+    // Fill the buffer, then one more message is dropped
+    while (logger.write(Logger::LEVEL_INFO, text, Logger::kMaxMessageLength))
+        ;
+    ok = ok && logger.write_count_ - logger.read_count_ == Logger::kBufferSize && logger.dropped_messages_ == 1;
+    logger.consume(logger.write_count_ - logger.read_count_);
+    printf("logger: %u truncated, %u dropped: %s\n", (unsigned)logger.truncated_messages_,
+           (unsigned)logger.dropped_messages_, ok ? "ok" : "failed");
+    return ok;
+}
+
+// Axis 0 idles at a low thread rate while its rotor is turned by hand. The
+// encoder must keep tracking the rotor and the thread must run less often.
+static bool low_rate_idle_test() {
+    Axis& axis = *axes[0];
+    axis.config_.enable_low_rate_idle = true;
+    axis.requested_state_ = Axis::AXIS_STATE_IDLE;
+    sim_run_for(10000000ull);
+    bool active = axis.isr_idle_active_;
+
+    auto counts = [&]{ return plants[0]->theta_ * (float)axis.encoder_.config_.cpr / (2.0f * M_PI); };
+    float offset = axis.encoder_.pos_estimate_ - counts();
+    plants[0]->omega_ = 50.0f; // [rad/s]
+    size_t num_periods = (size_t)current_meas_hz / 10;
+    uint32_t iterations = 0;
+    AxisSnapshot_t snapshot;
+    axis.snapshot_buffer_.read(&snapshot);
+    uint32_t last_meas_count = snapshot.meas_count;
+    for (size_t i = 0; i < num_periods; ++i) {
+        sim_step_period();
+        axis.snapshot_buffer_.read(&snapshot);
+        iterations += snapshot.meas_count != last_meas_count;
+        last_meas_count = snapshot.meas_count;
+    }
+    float tracking_error = fabsf(axis.encoder_.pos_estimate_ - counts() - offset);
+    uint32_t expected = (uint32_t)(num_periods / axis.config_.idle_loop_divider);
+
+    axis.config_.enable_low_rate_idle = false;
+    plants[0]->omega_ = 0.0f;
+    axis.requested_state_ = Axis::AXIS_STATE_CLOSED_LOOP_CONTROL;
+    sim_run_for(10000000ull);
+    axis.controller_.set_pos_setpoint(axis.encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    bool ok = check_no_errors("low rate idle") && active && !axis.isr_idle_active_
+            && iterations >= expected - 1 && iterations <= expected + 1 && tracking_error < 50.0f;
+    printf("low rate idle: %u thread iterations in %zu measurements, tracking error %.1f counts: %s\n",
+           (unsigned)iterations, num_periods, tracking_error, ok ? "ok" : "failed");
+    return ok;
+}
+
+// A state sequence runs its moves and goes on to the next state without the host
+static bool state_sequence_test() {
+    Axis& axis = *axes[0];
+    float base = roundf(axis.encoder_.pos_estimate_);
+    axis.sequence_clear();
+    bool accepted = axis.sequence_add_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL)
+            && axis.sequence_add_move(base + 20000.0f) && axis.sequence_add_move(base - 5000.0f)
+            && axis.sequence_add_state(Axis::AXIS_STATE_IDLE);
+    bool rejected = !axis.sequence_add_move(base) && !axis.sequence_add_state(Axis::AXIS_STATE_SEQUENCE);
+    axis.requested_state_ = Axis::AXIS_STATE_SEQUENCE;
+    float max_pos = base;
+    bool done = sim_run_until([&]{
+        max_pos = std::max(max_pos, axis.encoder_.pos_estimate_);
+        return axis.current_state_ == Axis::AXIS_STATE_IDLE;
+    }, 10.0f);
+    float idle_error = fabsf(axis.encoder_.pos_estimate_ - (base - 5000.0f));
+
+    // The last closed loop step holds its goal
+    axis.sequence_clear();
+    accepted = accepted && axis.sequence_add_state(Axis::AXIS_STATE_CLOSED_LOOP_CONTROL)
+            && axis.sequence_add_move(base);
+    axis.requested_state_ = Axis::AXIS_STATE_SEQUENCE;
+    sim_run_for(3000000000ull);
+    bool holding = axis.current_state_ == Axis::AXIS_STATE_CLOSED_LOOP_CONTROL
+            && axis.controller_.pos_setpoint_ == base;
+    float hold_error = fabsf(axis.encoder_.pos_estimate_ - base);
+    axis.sequence_clear();
+
+    bool ok = check_no_errors("state sequence") && accepted && rejected && done && holding
+            && max_pos > base + 19000.0f && idle_error < 500.0f && hold_error < 50.0f;
+    printf("state sequence: peak %.0f of 20000 counts, idle at %.0f, holding at %.1f counts: %s\n",
+           max_pos - base, idle_error, hold_error, ok ? "ok" : "failed");
+    return ok;
+}
+
+// Homing finds the endstop edge, or the index pulse next to it, and backs off
+static bool homing_test() {
+    Axis& axis = *axes[0];
+    Encoder& encoder = axis.encoder_;
+    const int32_t cpr = encoder.config_.cpr;
+    Axis::Config_t saved_config = axis.config_;
+    bool saved_use_index = encoder.config_.use_index;
+    GPIO_TypeDef* endstop_port = get_gpio_port_by_pin(3);
+    uint16_t endstop_pin = get_gpio_pin_by_pin(3);
+    const EncoderHardwareConfig_t& enc_hw = hw_configs[0].encoder_config;
+    // Pins that something else uses are refused
+    bool ok = true;
+    axis.config_.homing_endstop_gpio = 7;
+    axes[1]->config_.enable_step_dir = true;
+    ok = ok && !axis.endstop_gpio_available();
+    axes[1]->config_.enable_step_dir = false;
+    ok = ok && axis.endstop_gpio_available();
+    axis.config_.homing_endstop_gpio = 1;
+    ok = ok && !axis.endstop_gpio_available(); // UART
+
+    // The endstop starts out in analog mode and gets it back after homing
+    GPIO_InitTypeDef analog_init = { endstop_pin, GPIO_MODE_ANALOG, GPIO_NOPULL, 0, 0 };
+    HAL_GPIO_Init(endstop_port, &analog_init);
+    const uint32_t field_shift = 2U * __builtin_ctz(endstop_pin);
+    axis.config_.homing_endstop_gpio = 3;
+    axis.config_.homing_vel = -4000.0f;
+    axis.config_.homing_offset = 100.0f;
+    axis.config_.homing_backoff = 1000.0f;
+
+    // The switch closes below endstop [counts of the plant], the index is at multiples of cpr
+    auto plant_counts = [&]{ return (int32_t)floorf(plants[0]->theta_ * (float)cpr / (2.0f * M_PI)); };
+    int32_t endstop = 0;
+    auto drive_inputs = [&]{
+        int32_t counts = plant_counts();
+        sim_set_gpio(endstop_port, endstop_pin, counts >= endstop); // active low
+        sim_set_gpio(enc_hw.index_port, enc_hw.index_pin, ((counts % cpr) + cpr) % cpr < 4);
+    };
+    float errors[3] = { 0.0f };
+    for (int run = 0; run < 3; ++run) {
+        bool use_index = run == 2;
+        axis.config_.homing_use_index = use_index;
+        encoder.config_.use_index = use_index;
+        // The second run starts on the endstop
+        endstop = plant_counts() + (run == 1 ? 200 : -(int32_t)(1.6f * (float)cpr));
+        drive_inputs();
+        axis.requested_state_ = Axis::AXIS_STATE_HOMING;
+        sim_run_for(1000000ull);
+        bool done = sim_run_until([&]{
+            drive_inputs();
+            return axis.current_state_ == Axis::AXIS_STATE_IDLE;
+        }, 10.0f);
+        // Position of the plant counts in the homed frame
+        float offset = encoder.pos_estimate_ - (float)plant_counts();
+        int32_t reference = use_index ? (int32_t)ceilf((float)endstop / (float)cpr) * cpr : endstop;
+        errors[run] = fabsf((float)reference + offset - axis.config_.homing_offset);
+        float final_pos = axis.config_.homing_offset + axis.config_.homing_backoff;
+        ok = ok && done && axis.is_homed_ && errors[run] <= 2.0f
+                && fabsf(encoder.pos_estimate_ - final_pos) <= 20.0f
+                && ((endstop_port->MODER >> field_shift) & 0x3U) == GPIO_MODE_ANALOG
+                && ((endstop_port->PUPDR >> field_shift) & 0x3U) == GPIO_NOPULL;
+    }
+
+    axis.config_ = saved_config;
+    encoder.config_.use_index = saved_use_index;
+    sim_set_gpio(enc_hw.index_port, enc_hw.index_pin, false);
+    axis.requested_state_ = Axis::AXIS_STATE_CLOSED_LOOP_CONTROL;
+    sim_run_for(10000000ull);
+    axis.controller_.set_pos_setpoint(encoder.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("homing") && ok;
+    printf("homing: reference error %.0f, %.0f from the endstop, %.0f at the index [counts]: %s\n",
+           errors[0], errors[1], errors[2], ok ? "ok" : "failed");
+    return ok;
+}
+
+// In circular mode, setpoints many turns away are reached the shorter way
+// round, directly and with a trajectory, and the held setpoint stays within
+// one revolution
+static bool circular_setpoint_test() {
+    Axis& axis = *axes[0];
+    Controller& controller = axis.controller_;
+    Encoder& encoder = axis.encoder_;
+    const float cpr = (float)encoder.config_.cpr;
+    controller.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+    controller.set_pos_setpoint(roundf(encoder.pos_estimate_), 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    controller.config_.circular_setpoints = true;
+
+    bool ok = true;
+    const float steps[] = { -0.1f, 0.3f }; // [turns] the first one directly, the second as a move
+    for (size_t i = 0; i < 2; ++i) {
+        float start = encoder.pos_estimate_;
+        int32_t turns_before = controller.pos_setpoint_turns_;
+        float goal = controller.pos_setpoint_ + steps[i] * cpr + 100.0f * cpr;
+        if (i == 0)
+            controller.set_pos_setpoint(goal, 0.0f, 0.0f);
+        else
+            controller.move_to_pos(goal);
+        sim_run_for(2000000000ull);
+        float moved = encoder.pos_estimate_ - start;
+        bool step_ok = fabsf(moved - steps[i] * cpr) < 5.0f
+                && controller.config_.control_mode == Controller::CTRL_MODE_POSITION_CONTROL
+                && controller.pos_setpoint_ >= 0.0f && controller.pos_setpoint_ < cpr;
+        if (i == 0) // the direct setpoint is held as given, minus whole turns
+            step_ok = step_ok && fabsf(controller.pos_setpoint_ + (float)(controller.pos_setpoint_turns_ - turns_before) * cpr - goal) < 1.0f;
+        if (!step_ok)
+            printf("circular setpoints: step %zu moved %.0f counts instead of %.0f, setpoint %.0f\n",
+                   i, moved, steps[i] * cpr, controller.pos_setpoint_);
+        ok = ok && step_ok;
+    }
+
+    controller.config_.circular_setpoints = false;
+    controller.set_pos_setpoint(roundf(encoder.pos_estimate_), 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    ok = check_no_errors("circular setpoints") && ok;
+    printf("circular setpoints: %s\n", ok ? "ok" : "failed");
+    return ok;
+}
+
+// Axis 0 takes a current step at a high electrical speed, held by a large
+// inertia. Without the phase advance, the voltage is applied to a rotor that
+// has turned on by phase_vel * pwm_delay, which couples the step into Id.
+static bool phase_advance_test() {
+    Motor& motor = axes[0]->motor_;
+    Controller& controller = axes[0]->controller_;
+    PmsmPlant& plant = *plants[0];
+    float saved_inertia = plant.params_.inertia;
+    plant.params_.inertia = 1e3f;
+    controller.config_.control_mode = Controller::CTRL_MODE_CURRENT_CONTROL;
+    controller.set_current_setpoint(0.0f);
+    const float phase_vel = 2500.0f; // [rad/s] electrical, with 8kHz PWM about 30deg in pwm_delay
+    plant.omega_ = phase_vel / (float)plant.params_.pole_pairs;
+    sim_run_for(200000000ull); // the encoder estimate settles
+
+    auto step_Id_peak = [&]{
+        controller.set_current_setpoint(0.0f);
+        sim_run_for(20000000ull);
+        controller.set_current_setpoint(5.0f);
+        float peak = 0.0f;
+        for (size_t i = 0; i < 40; ++i) {
+            sim_step_period();
+            peak = std::max(peak, fabsf(motor.current_control_.Id_measured));
+        }
+        return peak;
+    };
+    float plain_peak = step_Id_peak();
+    motor.config_.enable_phase_advance = true;
+    float advanced_peak = step_Id_peak();
+    bool ok = check_no_errors("phase advance") && advanced_peak < 0.7f * plain_peak
+            && fabsf(motor.pwm_delay_ - 1.5f * current_meas_period) < 1e-7f;
+    printf("phase advance: Id peak after a 5A step %.2f A plain, %.2f A advanced by %.1f us: %s\n",
+           plain_peak, advanced_peak, motor.pwm_delay_ * 1e6f, ok ? "ok" : "failed");
+
+    motor.config_.enable_phase_advance = false;
+    controller.set_current_setpoint(0.0f);
+    sim_run_for(10000000ull);
+    plant.omega_ = 0.0f;
+    plant.params_.inertia = saved_inertia;
+    controller.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+    sim_run_for(50000000ull);
+    controller.set_pos_setpoint(axes[0]->encoder_.pos_estimate_, 0.0f, 0.0f);
+    sim_run_for(300000000ull);
+    return check_no_errors("phase advance") && ok;
+}
+
+// The vbus measurement spikes above the overvoltage trip level for a few
+// PWM periods while both axes hold their position. The modulation follows
+// the fast estimate, the protection the filtered one and must not trip.
+static bool vbus_spike_test() {
+    float spike = board_config.dc_bus_overvoltage_trip_level + 3.0f; // [V]
+    uint16_t spike_adc = (uint16_t)std::min(spike / (adc_ref_voltage * VBUS_S_DIVIDER_RATIO) * adc_full_scale, 4095.0f);
+    uint16_t normal_adc = adc_measurements_[0][VBUS_S_ADC_CHANNEL];
+    float fast_peak = 0.0f, filtered_peak = 0.0f;
+    for (size_t i = 0; i < ADC_OVERSAMPLING; ++i)
+        adc_measurements_[i][VBUS_S_ADC_CHANNEL] = spike_adc;
+    for (size_t i = 0; i < 3; ++i) {
+        sim_step_period();
+        fast_peak = std::max(fast_peak, vbus_voltage);
+        filtered_peak = std::max(filtered_peak, vbus_voltage_filtered);
+    }
+    for (size_t i = 0; i < ADC_OVERSAMPLING; ++i)
+        adc_measurements_[i][VBUS_S_ADC_CHANNEL] = normal_adc;
+    sim_run_for(20000000ull);
+
+    bool ok = check_no_errors("vbus spike") && fast_peak > board_config.dc_bus_overvoltage_trip_level
+            && filtered_peak < board_config.dc_bus_overvoltage_trip_level
+            && fabsf(vbus_voltage_filtered - sim_vbus) < 0.2f && fabsf(vbus_voltage - sim_vbus) < 0.2f;
+    printf("vbus spike: %.1f V fast, %.1f V filtered: %s\n", fast_peak, filtered_peak, ok ? "ok" : "failed");
+    return ok;
+}
+
+static void control_loop_benchmark() {
+    host_timing = HostTiming_t();
+    auto start = std::chrono::steady_clock::now();
+    sim_run_for(1000000000ull); // 1s of closed loop control on both axes
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("control loop benchmark: %.0f ns per current measurement callback, %.0f ns per thread wakeup, "
+           "simulation at %.1fx real time\n",
+           host_timing.isr_ns / host_timing.isr_calls,
+           host_timing.thread_ns / host_timing.isr_calls, 1.0 / wall_s);
+}
+
+// The kernels of the on-target benchmark, timed with the host clock
+static void kernel_benchmark() {
+    static const char* names[Benchmark::KERNEL_NUM_KERNELS] = {
+        "SVM", "fast_atan2", "fast_atan2_octant", "our_arm_sin_f32 + our_arm_cos_f32", "fast_sincos",
+        "Encoder::update", "SensorlessEstimator::update", "Motor::FOC_current",
+        "TrapezoidalTrajectory::eval"
+    };
+    request_state(Axis::AXIS_STATE_IDLE);
+    sim_run_for(10000000ull);
+    if (!benchmark.run(Benchmark::kMaxIterations)) {
+        printf("kernel benchmark: axis0 not idle\n");
+        return;
+    }
+    float ns_per_tick = 1e9f / (float)benchmark.clock_hz_;
+    for (size_t i = 0; i < Benchmark::KERNEL_NUM_KERNELS; ++i) {
+        const BenchmarkResult_t& result = benchmark.results_[i];
+        printf("kernel benchmark: %s min %.0f ns, mean %.1f ns", names[i],
+               (float)result.min * ns_per_tick, result.mean * ns_per_tick);
+        if (result.max_error > 0.0f)
+            printf(", max error %.3g", result.max_error);
+        printf("\n");
+    }
+}
+
+int main(int argc, const char** argv) {
+    bool run_benchmarks = argc > 1 && (argv[1][0] == 'b');
+
+    PmsmPlant::Params_t plant_params;
+    sim_boot(plant_params);
+
+    // run_sim replay <recording> <output.csv>, see replay_recording()
+    if (argc > 3 && !strcmp(argv[1], "replay"))
+        return replay_recording(argv[2], argv[3], plant_params) ? 0 : -1;
+
+    if (!calibration_test(plant_params) || !velocity_test() || !position_test() || !setpoint_mailbox_test() || !snapshot_test()
+            || !estimator_selection_test() || !index_capture_test()
+            || !sincos_test() || !load_encoder_test() || !current_oversampling_test() || !dc_calib_test() || !gate_driver_poll_test() || !gearing_test() || !torque_share_test()
+            || !vel_ramp_test() || !trap_traj_test()
+            || !replan_test() || !synced_move_test()
+            || !friction_identification_test() || !frequency_response_test()
+            || !auto_tuning_test() || !adaptive_pll_test() || !inductance_table_test()
+            || !mtpa_test() || !power_accounting_test() || !low_rate_idle_test()
+            || !state_sequence_test() || !homing_test() || !circular_setpoint_test()
+            || !phase_advance_test() || !vbus_spike_test() || !gcode_path_test() || !dc_bus_limit_test()
+            || !sensorless_gain_schedule_test() || !record_replay_test()
+            || !dpwm_test() || !ascii_gcode_test() || !logger_test()) {
+        printf("simulation failed\n");
+        return -1;
+    }
+    printf("all scenarios passed\n");
+
+    if (run_benchmarks) {
+        control_loop_benchmark();
+        kernel_benchmark();
+    }
+    return 0;
+}
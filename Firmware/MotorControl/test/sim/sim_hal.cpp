@@ -0,0 +1,445 @@
+// Simulated HAL, RTOS and board support for the host build of the motor
+// control stack. See stubs/cmsis_os.h for how the threads are scheduled.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "odrive_main.h"
+#include "sim_hal.hpp"
+#include "arm_common_tables.h"
+
+/* Peripherals ---------------------------------------------------------------*/
+
+DWT_Type sim_dwt;
+ITM_Type sim_itm;
+CoreDebug_Type sim_core_debug;
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc, sim_gpiod;
+TIM_TypeDef sim_tim1, sim_tim2, sim_tim3, sim_tim4, sim_tim5, sim_tim8, sim_tim13, sim_tim14;
+DMA_Stream_TypeDef sim_dma1_streams[8];
+ADC_TypeDef sim_adc1, sim_adc2, sim_adc3;
+uint32_t SystemCoreClock = 168000000;
+
+TIM_HandleTypeDef htim1 = { TIM1, {} };
+TIM_HandleTypeDef htim2 = { TIM2, {} };
+TIM_HandleTypeDef htim3 = { TIM3, {} };
+TIM_HandleTypeDef htim4 = { TIM4, {} };
+TIM_HandleTypeDef htim5 = { TIM5, {} };
+TIM_HandleTypeDef htim8 = { TIM8, {} };
+ADC_HandleTypeDef hadc1 = { ADC1, {} };
+ADC_HandleTypeDef hadc2 = { ADC2, {} };
+ADC_HandleTypeDef hadc3 = { ADC3, {} };
+SPI_HandleTypeDef hspi3 = { nullptr, {}, nullptr, nullptr, HAL_SPI_STATE_READY, HAL_SPI_ERROR_NONE };
+DMA_HandleTypeDef hdma_spi3_rx;
+DMA_HandleTypeDef hdma_spi3_tx;
+CAN_HandleTypeDef hcan1;
+I2C_HandleTypeDef hi2c1;
+
+static uint64_t sim_time_ns = 0;
+
+uint64_t sim_time() {
+    return sim_time_ns;
+}
+
+void sim_advance_time(uint64_t ns) {
+    sim_time_ns += ns;
+    uint64_t us = sim_time_ns / 1000;
+    DWT->CYCCNT = (uint32_t)(sim_time_ns * (SystemCoreClock / 1000000) / 1000);
+    TIM_TIME_BASE->CNT = (uint32_t)(us % 1000);
+}
+
+extern "C" {
+
+uint32_t HAL_GetTick(void) {
+    return (uint32_t)(sim_time_ns / 1000000);
+}
+
+void HAL_Delay(uint32_t ms) {
+    osDelay(ms);
+}
+
+uint32_t osKernelSysTick(void) {
+    return HAL_GetTick();
+}
+
+void configure_run_time_counter(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void _Error_Handler(char* file, int line) {
+    fprintf(stderr, "error handler called from %s:%d\n", file, line);
+    abort();
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef* h, uint32_t* data, uint32_t length) {
+    (void)h; (void)data; (void)length;
+    return HAL_OK; // the simulation writes adc_measurements_ directly
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* h, uint8_t* tx, uint16_t size, uint32_t timeout) {
+    (void)h; (void)tx; (void)size; (void)timeout;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* h, uint8_t* tx, uint8_t* rx, uint16_t size, uint32_t timeout) {
+    (void)h; (void)tx; (void)timeout;
+    memset(rx, 0, size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* h, uint8_t* tx, uint8_t* rx, uint16_t size) {
+    (void)tx;
+    // The HAL dereferences the DMA handles, which faults on the target
+    if (!h->hdmarx || !h->hdmatx) {
+        fprintf(stderr, "HAL_SPI_TransmitReceive_DMA without linked DMA handles\n");
+        abort();
+    }
+    memset(rx, 0, size);
+    return HAL_OK;
+}
+
+void MX_SPI3_DMA_Init(void) {
+    hspi3.hdmatx = &hdma_spi3_tx;
+    hspi3.hdmarx = &hdma_spi3_rx;
+}
+
+/* GPIO interrupts -----------------------------------------------------------*/
+
+// One EXTI line per pin number, like on the target: the newest subscription
+// to a pin number gets the line. sim_set_gpio() drives the inputs and runs
+// the callbacks. The other pins are not simulated.
+struct SimExtiLine {
+    GPIO_TypeDef* port;
+    void (*callback)(void*);
+    void* ctx;
+    bool both_edges;
+    bool enabled;
+};
+static SimExtiLine exti_lines[16];
+
+static SimExtiLine& exti_line(uint16_t GPIO_pin) {
+    return exti_lines[__builtin_ctz(GPIO_pin)];
+}
+
+bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+        uint32_t pull_up_down, void (*callback)(void*), void* ctx) {
+    (void)pull_up_down;
+    exti_line(GPIO_pin) = { GPIO_port, callback, ctx, false, true };
+    return true;
+}
+
+bool GPIO_subscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+        void (*callback)(void*), void* ctx) {
+    exti_line(GPIO_pin) = { GPIO_port, callback, ctx, true, false };
+    return true;
+}
+
+void GPIO_set_edge_interrupt_enabled(uint16_t GPIO_pin, bool enabled) {
+    exti_line(GPIO_pin).enabled = enabled;
+}
+
+void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+    SimExtiLine& line = exti_line(GPIO_pin);
+    if (line.port == GPIO_port)
+        line = {};
+}
+
+void GPIO_set_to_analog(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+    (void)GPIO_port; (void)GPIO_pin;
+}
+
+uint16_t get_gpio_pin_by_pin(uint16_t GPIO_pin) {
+    switch (GPIO_pin) {
+        case 2: return GPIO_2_Pin;
+        case 3: return GPIO_3_Pin;
+        case 4: return GPIO_4_Pin;
+        case 5: return GPIO_5_Pin;
+        case 6: return GPIO_6_Pin;
+        case 7: return GPIO_7_Pin;
+        case 8: return GPIO_8_Pin;
+        default: return GPIO_1_Pin;
+    }
+}
+
+GPIO_TypeDef* get_gpio_port_by_pin(uint16_t GPIO_pin) {
+    switch (GPIO_pin) {
+        case 2: return GPIO_2_GPIO_Port;
+        case 3: return GPIO_3_GPIO_Port;
+        case 4: return GPIO_4_GPIO_Port;
+        case 5: return GPIO_5_GPIO_Port;
+        case 6: return GPIO_6_GPIO_Port;
+        case 7: return GPIO_7_GPIO_Port;
+        case 8: return GPIO_8_GPIO_Port;
+        default: return GPIO_1_GPIO_Port;
+    }
+}
+
+} // extern "C"
+
+void sim_set_gpio(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin, bool level) {
+    bool previous = GPIO_port->IDR & GPIO_pin;
+    if (level)
+        GPIO_port->IDR |= GPIO_pin;
+    else
+        GPIO_port->IDR &= ~(uint32_t)GPIO_pin;
+    const SimExtiLine& line = exti_line(GPIO_pin);
+    if (level != previous && line.port == GPIO_port && line.callback && line.enabled
+            && (level || line.both_edges))
+        line.callback(line.ctx);
+}
+
+extern "C" {
+
+/* Gate driver ---------------------------------------------------------------*/
+
+// The DRV8301 is simulated as always healthy (nFAULT is held high by the
+// simulation), so its SPI register interface is reduced to no-ops.
+void DRV8301_enable(DRV8301_Handle handle) { (void)handle; }
+void DRV8301_setupSpi(DRV8301_Handle handle, DRV_SPI_8301_Vars_t* vars) { (void)handle; (void)vars; }
+void DRV8301_writeData(DRV8301_Handle handle, DRV_SPI_8301_Vars_t* vars) { (void)handle; vars->SndCmd = false; }
+void DRV8301_readData(DRV8301_Handle handle, DRV_SPI_8301_Vars_t* vars) { (void)handle; vars->RcvCmd = false; }
+DRV8301_FaultType_e DRV8301_getFaultType(DRV8301_Handle handle) { (void)handle; return DRV8301_FaultType_NoFault; }
+
+/* CMSIS-DSP -----------------------------------------------------------------*/
+
+float32_t sinTable_f32[FAST_MATH_TABLE_SIZE + 1];
+
+static struct SinTableInit {
+    SinTableInit() {
+        for (size_t i = 0; i <= FAST_MATH_TABLE_SIZE; ++i)
+            sinTable_f32[i] = sinf(2.0f * PI * (float)i / (float)FAST_MATH_TABLE_SIZE);
+    }
+} sin_table_init;
+
+void arm_biquad_cascade_df2T_init_f32(arm_biquad_cascade_df2T_instance_f32* S,
+        uint8_t numStages, float32_t* pCoeffs, float32_t* pState) {
+    S->numStages = numStages;
+    S->pCoeffs = pCoeffs;
+    S->pState = pState;
+    memset(pState, 0, 2u * numStages * sizeof(float32_t));
+}
+
+void arm_biquad_cascade_df2T_f32(const arm_biquad_cascade_df2T_instance_f32* S,
+        float32_t* pSrc, float32_t* pDst, uint32_t blockSize) {
+    const float32_t* coeffs = S->pCoeffs;
+    float32_t* state = S->pState;
+    const float32_t* in = pSrc;
+    for (uint32_t stage = 0; stage < S->numStages; ++stage) {
+        float32_t b0 = coeffs[0], b1 = coeffs[1], b2 = coeffs[2], a1 = coeffs[3], a2 = coeffs[4];
+        float32_t d1 = state[0], d2 = state[1];
+        for (uint32_t i = 0; i < blockSize; ++i) {
+            float32_t x = in[i];
+            float32_t y = b0 * x + d1;
+            d1 = b1 * x + a1 * y + d2;
+            d2 = b2 * x + a2 * y;
+            pDst[i] = y;
+        }
+        state[0] = d1;
+        state[1] = d2;
+        coeffs += 5;
+        state += 2;
+        in = pDst; // the following stages work in place
+    }
+}
+
+} // extern "C"
+
+/* Benchmark -----------------------------------------------------------------*/
+
+// The simulated cycle counter doesn't advance during a kernel, so the
+// benchmark measures the host's time instead (see benchmark.hpp)
+uint32_t benchmark_clock() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+uint32_t benchmark_clock_hz() {
+    return 1000000000;
+}
+
+/* Fibre ---------------------------------------------------------------------*/
+
+// There is no object tree in the simulation, so no endpoint reference is valid
+bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref) {
+    (void)endpoint_ref;
+    return false;
+}
+
+Endpoint* get_endpoint(endpoint_ref_t endpoint_ref) {
+    (void)endpoint_ref;
+    return nullptr;
+}
+
+/* Threads -------------------------------------------------------------------*/
+
+struct sim_thread {
+    os_pthread function;
+    void* argument;
+    osPriority priority;
+    enum { READY, WAITING_FOR_SIGNAL, WAITING_FOR_NOTIFICATION, DELAYED, DONE } state = READY;
+    int32_t signals = 0;
+    int32_t wait_mask = 0;
+    uint32_t notifications = 0;
+    bool has_timeout = false;
+    uint64_t wake_time = 0; // [ns] end of the delay or of the signal timeout
+    bool has_baton = false;
+    std::condition_variable cv;
+    std::thread host_thread;
+};
+
+static std::mutex baton_mutex;
+static std::condition_variable sim_loop_cv;
+static sim_thread* running_thread = nullptr; // null while the simulation loop has the baton
+static std::vector<sim_thread*> threads;
+
+// Hands the baton back to the simulation loop and waits until the thread is
+// scheduled again
+static void yield_to_sim_loop(std::unique_lock<std::mutex>& lock, sim_thread* self) {
+    self->has_baton = false;
+    running_thread = nullptr;
+    sim_loop_cv.notify_one();
+    self->cv.wait(lock, [self]{ return self->has_baton; });
+}
+
+static bool is_runnable(const sim_thread* t) {
+    switch (t->state) {
+        case sim_thread::READY:
+            return true;
+        case sim_thread::WAITING_FOR_SIGNAL:
+            return (t->signals & t->wait_mask) || (t->has_timeout && sim_time_ns >= t->wake_time);
+        case sim_thread::WAITING_FOR_NOTIFICATION:
+            return t->notifications || (t->has_timeout && sim_time_ns >= t->wake_time);
+        case sim_thread::DELAYED:
+            return sim_time_ns >= t->wake_time;
+        default:
+            return false;
+    }
+}
+
+void sim_run_threads() {
+    std::unique_lock<std::mutex> lock(baton_mutex);
+    for (;;) {
+        sim_thread* next = nullptr;
+        for (sim_thread* t : threads) {
+            if (is_runnable(t) && (!next || t->priority > next->priority))
+                next = t;
+        }
+        if (!next)
+            return;
+        running_thread = next;
+        next->has_baton = true;
+        next->cv.notify_one();
+        sim_loop_cv.wait(lock, []{ return running_thread == nullptr; });
+    }
+}
+
+extern "C" {
+
+osThreadId osThreadCreate(const osThreadDef_t* thread_def, void* argument) {
+    sim_thread* t = new sim_thread();
+    t->function = thread_def->pthread;
+    t->argument = argument;
+    t->priority = thread_def->tpriority;
+    t->host_thread = std::thread([t]{
+        std::unique_lock<std::mutex> lock(baton_mutex);
+        t->cv.wait(lock, [t]{ return t->has_baton; });
+        lock.unlock();
+        t->function(t->argument);
+        lock.lock();
+        t->state = sim_thread::DONE;
+        t->has_baton = false;
+        running_thread = nullptr;
+        sim_loop_cv.notify_one();
+    });
+    t->host_thread.detach();
+    std::lock_guard<std::mutex> lock(baton_mutex);
+    threads.push_back(t);
+    return t;
+}
+
+osPriority osThreadGetPriority(osThreadId thread_id) {
+    return thread_id ? thread_id->priority : osPriorityError;
+}
+
+int32_t osSignalSet(osThreadId thread_id, int32_t signals) {
+    // Called from the simulated interrupts, which run while the simulation
+    // loop holds the baton, or from a thread that holds it
+    int32_t previous = thread_id->signals;
+    thread_id->signals |= signals;
+    return previous;
+}
+
+osEvent osSignalWait(int32_t signals, uint32_t millisec) {
+    osEvent event = {};
+    sim_thread* self = running_thread;
+    if (!self) {
+        event.status = osErrorParameter; // only threads can wait
+        return event;
+    }
+    std::unique_lock<std::mutex> lock(baton_mutex);
+    if (!(self->signals & signals) && millisec != 0) {
+        self->state = sim_thread::WAITING_FOR_SIGNAL;
+        self->wait_mask = signals;
+        self->has_timeout = millisec != osWaitForever;
+        self->wake_time = sim_time_ns + (uint64_t)millisec * 1000000;
+        yield_to_sim_loop(lock, self);
+        self->state = sim_thread::READY;
+    }
+    if (self->signals & signals) {
+        event.status = osEventSignal;
+        event.value.signals = self->signals;
+        self->signals &= ~signals;
+    } else {
+        event.status = osEventTimeout;
+    }
+    return event;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higher_priority_task_woken) {
+    // Called from the simulated interrupts, like osSignalSet
+    task->notifications++;
+    if (higher_priority_task_woken)
+        *higher_priority_task_woken = pdTRUE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait) {
+    sim_thread* self = running_thread;
+    if (!self)
+        return 0; // only threads can wait
+    std::unique_lock<std::mutex> lock(baton_mutex);
+    if (!self->notifications && ticks_to_wait != 0) {
+        self->state = sim_thread::WAITING_FOR_NOTIFICATION;
+        self->has_timeout = ticks_to_wait != osWaitForever;
+        self->wake_time = sim_time_ns + (uint64_t)ticks_to_wait * 1000000;
+        yield_to_sim_loop(lock, self);
+        self->state = sim_thread::READY;
+    }
+    uint32_t count = self->notifications;
+    if (count)
+        self->notifications = clear_count_on_exit ? 0 : count - 1;
+    return count;
+}
+
+osStatus osDelay(uint32_t millisec) {
+    sim_thread* self = running_thread;
+    if (!self) {
+        // Called during the simulated boot, before the threads run
+        sim_run_for(millisec * 1000000ull);
+        return osOK;
+    }
+    std::unique_lock<std::mutex> lock(baton_mutex);
+    self->state = sim_thread::DELAYED;
+    self->wake_time = sim_time_ns + (uint64_t)(millisec ? millisec : 1) * 1000000;
+    yield_to_sim_loop(lock, self);
+    self->state = sim_thread::READY;
+    return osOK;
+}
+
+} // extern "C"
@@ -0,0 +1,27 @@
+#ifndef __SIM_HAL_HPP
+#define __SIM_HAL_HPP
+
+#include <stdint.h>
+#include <stm32f4xx_hal.h>
+
+// @brief Returns the simulated time since the start [ns]
+uint64_t sim_time();
+
+// @brief Advances the simulated time, including HAL_GetTick(), the DWT cycle
+// counter and the microsecond time base
+void sim_advance_time(uint64_t ns);
+
+// @brief Runs the threads created with osThreadCreate, highest priority
+// first, until all of them are blocked in osSignalWait, ulTaskNotifyTake or osDelay
+void sim_run_threads();
+
+// @brief Runs the simulation loop (plant, interrupts and threads) for the
+// specified time [ns]. Implemented by the simulation, osDelay() calls this
+// when it is used outside of a thread.
+void sim_run_for(uint64_t ns);
+
+// @brief Drives a GPIO input and runs its edge interrupt callback, if it
+// has one that the edge triggers
+void sim_set_gpio(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin, bool level);
+
+#endif // __SIM_HAL_HPP
@@ -0,0 +1,18 @@
+// Host stand-in for the CMSIS-DSP lookup tables used by arm_sin_f32.c and
+// arm_cos_f32.c. sim_hal.cpp computes the table at startup.
+#ifndef __SIM_STUBS_ARM_COMMON_TABLES_H
+#define __SIM_STUBS_ARM_COMMON_TABLES_H
+
+#include "arm_math.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern float32_t sinTable_f32[FAST_MATH_TABLE_SIZE + 1];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SIM_STUBS_ARM_COMMON_TABLES_H
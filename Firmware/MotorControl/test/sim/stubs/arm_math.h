@@ -0,0 +1,36 @@
+// Host stand-in for the CMSIS-DSP functions used by the motor control stack.
+// The implementations in sim_hal.cpp follow the CMSIS reference code.
+#ifndef __SIM_STUBS_ARM_MATH_H
+#define __SIM_STUBS_ARM_MATH_H
+
+#include <stdint.h>
+#include <math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef float float32_t;
+
+#ifndef PI
+#define PI 3.14159265358979f
+#endif
+
+#define FAST_MATH_TABLE_SIZE 512
+
+typedef struct {
+    uint8_t numStages;
+    float32_t* pState;
+    float32_t* pCoeffs;
+} arm_biquad_cascade_df2T_instance_f32;
+
+void arm_biquad_cascade_df2T_init_f32(arm_biquad_cascade_df2T_instance_f32* S,
+        uint8_t numStages, float32_t* pCoeffs, float32_t* pState);
+void arm_biquad_cascade_df2T_f32(const arm_biquad_cascade_df2T_instance_f32* S,
+        float32_t* pSrc, float32_t* pDst, uint32_t blockSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SIM_STUBS_ARM_MATH_H
@@ -0,0 +1,96 @@
+// Simulated CMSIS-RTOS API for the host build of the motor control stack.
+//
+// Threads created with osThreadCreate run on host threads, but only one of
+// them runs at a time: sim_hal.cpp hands a baton from the simulation loop to
+// each ready thread in turn, and the thread hands it back when it blocks in
+// osSignalWait, ulTaskNotifyTake or osDelay. Time only advances in the simulation loop, so a
+// run is deterministic and independent of the host speed.
+#ifndef __SIM_STUBS_CMSIS_OS_H
+#define __SIM_STUBS_CMSIS_OS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define osWaitForever 0xFFFFFFFF
+#define osKernelSysTickFrequency 1000
+#define configMINIMAL_STACK_SIZE 128
+
+typedef enum {
+    osPriorityIdle          = -3,
+    osPriorityLow           = -2,
+    osPriorityBelowNormal   = -1,
+    osPriorityNormal        =  0,
+    osPriorityAboveNormal   = +1,
+    osPriorityHigh          = +2,
+    osPriorityRealtime      = +3,
+    osPriorityError         =  0x84
+} osPriority;
+
+typedef enum {
+    osOK                    =     0,
+    osEventSignal           =  0x08,
+    osEventTimeout          =  0x40,
+    osErrorParameter        =  0x80,
+    osErrorOS               =  0xFF
+} osStatus;
+
+typedef struct {
+    osStatus status;
+    union {
+        uint32_t v;
+        void* p;
+        int32_t signals;
+    } value;
+} osEvent;
+
+typedef uint32_t StackType_t;
+typedef struct sim_thread* osThreadId;
+typedef void* osSemaphoreId;
+typedef struct { uint8_t unused; } osStaticThreadDef_t;
+typedef void (*os_pthread)(void* argument);
+
+typedef struct os_thread_def {
+    const char* name;
+    os_pthread pthread;
+    osPriority tpriority;
+    uint32_t instances;
+    uint32_t stacksize;
+    uint32_t* buffer;
+    osStaticThreadDef_t* controlblock;
+} osThreadDef_t;
+
+#define osThreadStaticDef(name, thread, priority, instances, stacksz, buffer, control) \
+const osThreadDef_t os_thread_def_##name = \
+{ #name, (thread), (priority), (instances), (stacksz), (buffer), (control) }
+#define osThread(name) &os_thread_def_##name
+
+osThreadId osThreadCreate(const osThreadDef_t* thread_def, void* argument);
+osPriority osThreadGetPriority(osThreadId thread_id);
+int32_t osSignalSet(osThreadId thread_id, int32_t signals);
+osEvent osSignalWait(int32_t signals, uint32_t millisec);
+osStatus osDelay(uint32_t millisec);
+uint32_t osKernelSysTick(void);
+
+// From FreeRTOS task.h: direct to task notifications, see Axis::signal_current_meas
+typedef long BaseType_t;
+typedef uint32_t TickType_t;
+typedef struct sim_thread* TaskHandle_t;
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define portTICK_PERIOD_MS ((TickType_t)1)
+#define portYIELD_FROM_ISR(x) ((void)(x)) // the simulated threads run after each interrupt anyway
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higher_priority_task_woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait);
+
+// From FreeRTOSConfig.h: sets up the DWT cycle counter for the run time stats
+void configure_run_time_counter(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SIM_STUBS_CMSIS_OS_H
@@ -0,0 +1,7 @@
+// The simulated peripherals are all declared in stm32f4xx_hal.h
+#ifndef __SIM_STUBS_STM32F405XX_H
+#define __SIM_STUBS_STM32F405XX_H
+
+#include "stm32f4xx_hal.h"
+
+#endif // __SIM_STUBS_STM32F405XX_H
@@ -0,0 +1,461 @@
+// Simulated STM32 HAL for the host build of the motor control stack.
+//
+// The peripherals are plain structs in RAM (see sim_hal.cpp). The simulation
+// reads the PWM compare registers from them and writes the ADC results,
+// encoder counts and GPIO inputs into them. Only what the MotorControl and
+// DRV8301 sources use is provided.
+#ifndef __SIM_STUBS_STM32F4XX_HAL_H
+#define __SIM_STUBS_STM32F4XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO volatile
+#define __ASM __asm__
+#define __weak __attribute__((weak))
+#define UNUSED(x) ((void)(x))
+
+typedef enum {
+    HAL_OK = 0x00,
+    HAL_ERROR = 0x01,
+    HAL_BUSY = 0x02,
+    HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+/* Core ----------------------------------------------------------------------*/
+
+typedef struct {
+    __IO uint32_t CTRL;
+    __IO uint32_t CYCCNT; // advanced by the simulation, see sim_advance_cycles()
+} DWT_Type;
+
+typedef struct {
+    union {
+        __IO uint8_t u8;
+        __IO uint16_t u16;
+        __IO uint32_t u32;
+    } PORT[32];
+    __IO uint32_t TER;
+    __IO uint32_t TCR;
+} ITM_Type;
+
+typedef struct {
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type sim_dwt;
+extern ITM_Type sim_itm;
+extern CoreDebug_Type sim_core_debug;
+#define DWT (&sim_dwt)
+#define ITM (&sim_itm)
+#define CoreDebug (&sim_core_debug)
+
+#define DWT_CTRL_CYCCNTENA_Msk      (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk  (1UL << 24)
+#define ITM_TCR_ITMENA_Msk          (1UL << 0)
+
+// The simulation runs the interrupts and threads one after the other, so
+// critical sections are no-ops
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t primask) { (void)primask; }
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+static inline uint32_t __get_BASEPRI(void) { return 0; }
+static inline void __set_BASEPRI(uint32_t basepri) { (void)basepri; }
+static inline void __set_BASEPRI_MAX(uint32_t basepri) { (void)basepri; }
+#define __NVIC_PRIO_BITS 4
+static inline void __DSB(void) {}
+static inline void __DMB(void) {}
+static inline void __ISB(void) {}
+
+typedef enum {
+    TIM1_UP_TIM10_IRQn,
+    TIM8_UP_TIM13_IRQn,
+    TIM5_IRQn,
+    ADC_IRQn,
+    EXTI0_IRQn,
+    EXTI1_IRQn,
+    EXTI2_IRQn,
+    EXTI3_IRQn,
+    EXTI4_IRQn,
+    EXTI9_5_IRQn,
+    EXTI15_10_IRQn,
+} IRQn_Type;
+
+static inline void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t prio, uint32_t sub) { (void)irq; (void)prio; (void)sub; }
+static inline void HAL_NVIC_EnableIRQ(IRQn_Type irq) { (void)irq; }
+static inline void HAL_NVIC_DisableIRQ(IRQn_Type irq) { (void)irq; }
+
+extern uint32_t SystemCoreClock;
+uint32_t HAL_GetTick(void);
+static inline uint32_t HAL_RCC_GetHCLKFreq(void) { return 168000000; }
+void HAL_Delay(uint32_t ms);
+
+/* GPIO ----------------------------------------------------------------------*/
+
+typedef struct {
+    __IO uint32_t MODER;
+    __IO uint32_t PUPDR;
+    __IO uint32_t IDR; // inputs, written by the simulation
+    __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc, sim_gpiod;
+#define GPIOA (&sim_gpioa)
+#define GPIOB (&sim_gpiob)
+#define GPIOC (&sim_gpioc)
+#define GPIOD (&sim_gpiod)
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+#define GPIO_PIN_0   ((uint16_t)0x0001)
+#define GPIO_PIN_1   ((uint16_t)0x0002)
+#define GPIO_PIN_2   ((uint16_t)0x0004)
+#define GPIO_PIN_3   ((uint16_t)0x0008)
+#define GPIO_PIN_4   ((uint16_t)0x0010)
+#define GPIO_PIN_5   ((uint16_t)0x0020)
+#define GPIO_PIN_6   ((uint16_t)0x0040)
+#define GPIO_PIN_7   ((uint16_t)0x0080)
+#define GPIO_PIN_8   ((uint16_t)0x0100)
+#define GPIO_PIN_9   ((uint16_t)0x0200)
+#define GPIO_PIN_10  ((uint16_t)0x0400)
+#define GPIO_PIN_11  ((uint16_t)0x0800)
+#define GPIO_PIN_12  ((uint16_t)0x1000)
+#define GPIO_PIN_13  ((uint16_t)0x2000)
+#define GPIO_PIN_14  ((uint16_t)0x4000)
+#define GPIO_PIN_15  ((uint16_t)0x8000)
+
+#define GPIO_MODE_INPUT      0x00000000U
+#define GPIO_MODE_OUTPUT_PP  0x00000001U
+#define GPIO_MODE_AF_PP      0x00000002U
+#define GPIO_MODE_ANALOG     0x00000003U
+#define GPIO_NOPULL          0x00000000U
+#define GPIO_PULLUP          0x00000001U
+#define GPIO_PULLDOWN        0x00000002U
+#define GPIO_SPEED_FREQ_LOW        0x00000000U
+#define GPIO_SPEED_FREQ_VERY_HIGH  0x00000003U
+#define GPIO_AF1_TIM2  0x01U
+#define GPIO_AF2_TIM3  0x02U
+#define GPIO_AF2_TIM4  0x02U
+#define GPIO_AF2_TIM5  0x02U
+#define GPIO_AF6_SPI3  0x06U
+
+// The mode and pull values above are the MODER and PUPDR fields
+static inline void HAL_GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init) {
+    for (uint32_t position = 0; position < 16; ++position) {
+        if (!(init->Pin & (1U << position)))
+            continue;
+        uint32_t mask = 0x3U << (2U * position);
+        port->MODER = (port->MODER & ~mask) | ((init->Mode & 0x3U) << (2U * position));
+        port->PUPDR = (port->PUPDR & ~mask) | ((init->Pull & 0x3U) << (2U * position));
+    }
+}
+static inline void HAL_GPIO_DeInit(GPIO_TypeDef* port, uint32_t pin) { (void)port; (void)pin; }
+static inline GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin) {
+    return (port->IDR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+static inline void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state) {
+    if (state == GPIO_PIN_SET)
+        port->ODR |= pin;
+    else
+        port->ODR &= ~(uint32_t)pin;
+}
+
+/* Timers --------------------------------------------------------------------*/
+
+typedef struct {
+    __IO uint32_t CR1;
+    __IO uint32_t CR2;
+    __IO uint32_t SMCR;
+    __IO uint32_t DIER;
+    __IO uint32_t SR;
+    __IO uint32_t EGR;
+    __IO uint32_t CNT;
+    __IO uint32_t ARR;
+    __IO uint32_t CCR1;
+    __IO uint32_t CCR2;
+    __IO uint32_t CCR3;
+    __IO uint32_t CCR4;
+    __IO uint32_t BDTR;
+} TIM_TypeDef;
+
+extern TIM_TypeDef sim_tim1, sim_tim2, sim_tim3, sim_tim4, sim_tim5, sim_tim8, sim_tim13, sim_tim14;
+#define TIM1 (&sim_tim1)
+#define TIM2 (&sim_tim2)
+#define TIM3 (&sim_tim3)
+#define TIM4 (&sim_tim4)
+#define TIM5 (&sim_tim5)
+#define TIM8 (&sim_tim8)
+#define TIM13 (&sim_tim13)
+#define TIM14 (&sim_tim14)
+
+typedef struct {
+    uint32_t Prescaler;
+    uint32_t CounterMode;
+    uint32_t Period;
+} TIM_Base_InitTypeDef;
+
+typedef struct {
+    TIM_TypeDef* Instance;
+    TIM_Base_InitTypeDef Init;
+} TIM_HandleTypeDef;
+
+typedef struct {
+    uint32_t ICPolarity;
+    uint32_t ICSelection;
+    uint32_t ICPrescaler;
+    uint32_t ICFilter;
+} TIM_IC_InitTypeDef;
+
+typedef struct {
+    uint32_t SlaveMode;
+    uint32_t InputTrigger;
+    uint32_t TriggerPolarity;
+    uint32_t TriggerPrescaler;
+    uint32_t TriggerFilter;
+} TIM_SlaveConfigTypeDef;
+
+#define TIM_CR1_CEN   (1UL << 0)
+#define TIM_CR1_DIR   (1UL << 4)
+#define TIM_CR1_CMS   (3UL << 5)
+#define TIM_CR2_MMS   (7UL << 4)
+#define TIM_SMCR_SMS  (7UL << 0)
+#define TIM_SMCR_TS   (7UL << 4)
+#define TIM_BDTR_MOE  (1UL << 15)
+#define TIM_TRGO_ENABLE (1UL << 4)
+#define TIM_CLOCKSOURCE_ITR0 0x00000000U
+#define TIM_SLAVEMODE_TRIGGER   0x00000006U
+#define TIM_SLAVEMODE_EXTERNAL1 0x00000007U
+#define TIM_TS_TI1FP1 0x00000050U
+#define TIM_TRIGGERPOLARITY_RISING 0x00000000U
+#define TIM_TRIGGERPRESCALER_DIV1  0x00000000U
+#define TIM_INPUTCHANNELPOLARITY_RISING   0x00000000U
+#define TIM_INPUTCHANNELPOLARITY_BOTHEDGE 0x0000000AU
+#define TIM_ICSELECTION_DIRECTTI 0x00000001U
+#define TIM_ICPSC_DIV1 0x00000000U
+#define TIM_CHANNEL_1   0x00000000U
+#define TIM_CHANNEL_2   0x00000004U
+#define TIM_CHANNEL_3   0x00000008U
+#define TIM_CHANNEL_4   0x0000000CU
+#define TIM_CHANNEL_ALL 0x00000018U
+#define TIM_IT_UPDATE   (1UL << 0)
+#define TIM_FLAG_CC1    (1UL << 1)
+
+#define __HAL_TIM_ENABLE(h) ((h)->Instance->CR1 |= TIM_CR1_CEN)
+#define __HAL_TIM_ENABLE_IT(h, it) ((h)->Instance->DIER |= (it))
+#define __HAL_TIM_ENABLE_DMA(h, dma) ((h)->Instance->DIER |= (dma))
+#define TIM_DMA_CC1 (1UL << 9)
+#define TIM_DMA_CC2 (1UL << 10)
+#define TIM_DMA_CC3 (1UL << 11)
+#define TIM_DMA_CC4 (1UL << 12)
+#define __HAL_TIM_GET_FLAG(h, flag) (((h)->Instance->SR & (flag)) == (flag))
+#define __HAL_TIM_CLEAR_FLAG(h, flag) ((h)->Instance->SR = ~(flag))
+#define __HAL_TIM_GET_COMPARE(h, ch) (*(&(h)->Instance->CCR1 + ((ch) >> 2)))
+#define __HAL_TIM_SET_AUTORELOAD(h, v) ((h)->Instance->ARR = (v))
+#define __HAL_TIM_MOE_ENABLE(h) ((h)->Instance->BDTR |= TIM_BDTR_MOE)
+#define __HAL_TIM_MOE_DISABLE_UNCONDITIONALLY(h) ((h)->Instance->BDTR &= ~TIM_BDTR_MOE)
+#define __HAL_DBGMCU_FREEZE_TIM1()
+#define __HAL_DBGMCU_FREEZE_TIM8()
+
+static inline HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef* h, uint32_t ch) { (void)ch; h->Instance->CR1 |= TIM_CR1_CEN; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_TIM_PWM_Start_IT(TIM_HandleTypeDef* h, uint32_t ch) { return HAL_TIM_PWM_Start(h, ch); }
+static inline HAL_StatusTypeDef HAL_TIMEx_PWMN_Start(TIM_HandleTypeDef* h, uint32_t ch) { (void)h; (void)ch; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_TIM_Encoder_Start(TIM_HandleTypeDef* h, uint32_t ch) { return HAL_TIM_PWM_Start(h, ch); }
+static inline HAL_StatusTypeDef HAL_TIM_IC_Start_IT(TIM_HandleTypeDef* h, uint32_t ch) { return HAL_TIM_PWM_Start(h, ch); }
+static inline HAL_StatusTypeDef HAL_TIM_IC_Start(TIM_HandleTypeDef* h, uint32_t ch) { return HAL_TIM_PWM_Start(h, ch); }
+static inline HAL_StatusTypeDef HAL_TIM_IC_ConfigChannel(TIM_HandleTypeDef* h, TIM_IC_InitTypeDef* c, uint32_t ch) { (void)h; (void)c; (void)ch; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_TIM_SlaveConfigSynchronization(TIM_HandleTypeDef* h, TIM_SlaveConfigTypeDef* c) { (void)h; (void)c; return HAL_OK; }
+
+/* ADC -----------------------------------------------------------------------*/
+
+typedef struct {
+    __IO uint32_t SR;
+    __IO uint32_t CR1;
+    __IO uint32_t CR2;
+    __IO uint32_t JSQR;
+    __IO uint32_t JDR1; // injected results, written by the simulation
+    __IO uint32_t JDR2;
+    __IO uint32_t JDR3;
+    __IO uint32_t JDR4;
+    __IO uint32_t DR;   // regular result, written by the simulation
+} ADC_TypeDef;
+
+extern ADC_TypeDef sim_adc1, sim_adc2, sim_adc3;
+#define ADC1 (&sim_adc1)
+#define ADC2 (&sim_adc2)
+#define ADC3 (&sim_adc3)
+
+typedef struct {
+    uint32_t ClockPrescaler;
+    uint32_t Resolution;
+    uint32_t DataAlign;
+    uint32_t ScanConvMode;
+    uint32_t EOCSelection;
+    uint32_t ContinuousConvMode;
+    uint32_t NbrOfConversion;
+    uint32_t DiscontinuousConvMode;
+    uint32_t ExternalTrigConv;
+    uint32_t ExternalTrigConvEdge;
+    uint32_t DMAContinuousRequests;
+} ADC_InitTypeDef;
+
+typedef struct {
+    ADC_TypeDef* Instance;
+    ADC_InitTypeDef Init;
+} ADC_HandleTypeDef;
+
+typedef struct {
+    uint32_t Channel;
+    uint32_t Rank;
+    uint32_t SamplingTime;
+} ADC_ChannelConfTypeDef;
+
+typedef struct {
+    uint32_t InjectedChannel;
+    uint32_t InjectedRank;
+    uint32_t InjectedSamplingTime;
+    uint32_t InjectedOffset;
+    uint32_t InjectedNbrOfConversion;
+    uint32_t AutoInjectedConv;
+    uint32_t InjectedDiscontinuousConvMode;
+    uint32_t ExternalTrigInjecConv;
+    uint32_t ExternalTrigInjecConvEdge;
+} ADC_InjectionConfTypeDef;
+
+#define ADC_CLOCK_SYNC_PCLK_DIV4 0x00010000U
+#define ADC_RESOLUTION_12B 0x00000000U
+#define ADC_DATAALIGN_RIGHT 0x00000000U
+#define ADC_EOC_SINGLE_CONV 0x00000001U
+#define ADC_SOFTWARE_START 0x0F000001U
+#define ADC_EXTERNALTRIGCONVEDGE_NONE 0x00000000U
+#define ADC_SAMPLETIME_3CYCLES  0x00000000U
+#define ADC_SAMPLETIME_15CYCLES 0x00000001U
+#define ADC_EXTERNALTRIGINJECCONVEDGE_RISING 0x00100000U
+#define ADC_EXTERNALTRIGINJECCONV_T1_TRGO    0x00010000U
+#define ADC_CR1_AWDCH_Pos 0U
+#define ADC_CR2_JEXTEN (3UL << 20)
+#define ADC_INJECTED_RANK_1 0x00000001U
+#define ADC_CHANNEL_10 0x0000000AU
+#define ADC_CHANNEL_11 0x0000000BU
+#define ADC_IT_EOC  (1UL << 5)
+#define ADC_IT_JEOC (1UL << 7)
+
+#define ENABLE 1U
+#define DISABLE 0U
+#define SET_BIT(REG, BIT) ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT) ((REG) &= ~(BIT))
+
+#define __HAL_ADC_ENABLE(h) ((h)->Instance->CR2 |= 1U)
+#define __HAL_ADC_ENABLE_IT(h, it) ((h)->Instance->CR1 |= (it))
+
+static inline HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef* h) { (void)h; return HAL_OK; }
+static inline HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef* h, ADC_ChannelConfTypeDef* c) { (void)h; (void)c; return HAL_OK; }
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef* h, uint32_t* data, uint32_t length);
+static inline uint32_t HAL_ADC_GetValue(ADC_HandleTypeDef* h) { return h->Instance->DR; }
+static inline HAL_StatusTypeDef HAL_ADCEx_InjectedConfigChannel(ADC_HandleTypeDef* h, ADC_InjectionConfTypeDef* c) { (void)h; (void)c; return HAL_OK; }
+static inline uint32_t HAL_ADCEx_InjectedGetValue(ADC_HandleTypeDef* h, uint32_t rank) { (void)rank; return h->Instance->JDR1; }
+
+/* SPI, DMA and others -------------------------------------------------------*/
+
+typedef enum {
+    HAL_SPI_STATE_RESET = 0x00,
+    HAL_SPI_STATE_READY = 0x01,
+    HAL_SPI_STATE_BUSY = 0x02
+} HAL_SPI_StateTypeDef;
+
+#define HAL_SPI_ERROR_NONE 0x00000000U
+
+typedef struct {
+    uint32_t Mode;
+} SPI_InitTypeDef;
+
+typedef struct {
+    __IO uint32_t CR;
+    __IO uint32_t NDTR;
+} DMA_Stream_TypeDef;
+
+extern DMA_Stream_TypeDef sim_dma1_streams[8];
+#define DMA1_Stream1 (&sim_dma1_streams[1])
+#define DMA1_Stream2 (&sim_dma1_streams[2])
+#define DMA1_Stream4 (&sim_dma1_streams[4])
+
+typedef struct {
+    uint32_t Channel;
+    uint32_t Direction;
+    uint32_t PeriphInc;
+    uint32_t MemInc;
+    uint32_t PeriphDataAlignment;
+    uint32_t MemDataAlignment;
+    uint32_t Mode;
+    uint32_t Priority;
+    uint32_t FIFOMode;
+} DMA_InitTypeDef;
+
+typedef struct {
+    void* Instance;
+    DMA_InitTypeDef Init;
+} DMA_HandleTypeDef;
+
+#define DMA_CHANNEL_6         0x0C000000U
+#define DMA_PERIPH_TO_MEMORY  0x00000000U
+#define DMA_PINC_DISABLE      0x00000000U
+#define DMA_MINC_ENABLE       0x00000400U
+#define DMA_PDATAALIGN_WORD   0x00001000U
+#define DMA_MDATAALIGN_WORD   0x00004000U
+#define DMA_CIRCULAR          0x00000100U
+#define DMA_PRIORITY_LOW      0x00000000U
+#define DMA_FIFOMODE_DISABLE  0x00000000U
+
+// Nothing is transferred in the simulation. The addresses are dropped before
+// they are cast, because they don't fit into 32 bits on the host.
+static inline HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* h) { (void)h; return HAL_OK; }
+static inline HAL_StatusTypeDef sim_dma_start(DMA_HandleTypeDef* h, uint32_t length) {
+    ((DMA_Stream_TypeDef*)h->Instance)->NDTR = length;
+    return HAL_OK;
+}
+#define HAL_DMA_Start(h, src, dst, length) sim_dma_start(h, length)
+#define __HAL_DMA_GET_COUNTER(h) (((DMA_Stream_TypeDef*)(h)->Instance)->NDTR)
+
+typedef struct {
+    void* Instance;
+    SPI_InitTypeDef Init;
+    DMA_HandleTypeDef* hdmatx;
+    DMA_HandleTypeDef* hdmarx;
+    __IO HAL_SPI_StateTypeDef State;
+    __IO uint32_t ErrorCode;
+} SPI_HandleTypeDef;
+
+typedef struct { void* Instance; } CAN_HandleTypeDef;
+typedef struct { void* Instance; } I2C_HandleTypeDef;
+typedef struct { void* Instance; } UART_HandleTypeDef;
+
+// The DRV8301 and the absolute SPI encoders are not simulated: every transfer
+// succeeds and reads zeros, which the DRV8301 driver reports as no fault.
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* h, uint8_t* tx, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* h, uint8_t* tx, uint8_t* rx, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef* h, uint8_t* tx, uint8_t* rx, uint16_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Like the real stm32f4xx_hal_conf.h, this makes the board pin definitions available
+#include "main.h"
+
+#endif // __SIM_STUBS_STM32F4XX_HAL_H
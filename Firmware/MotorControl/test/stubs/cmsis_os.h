@@ -0,0 +1,12 @@
+// Host stand-in for the CMSIS-RTOS API, for building MotorControl
+// sources in the unit tests. Only what the tested sources use is provided.
+#ifndef __TEST_STUBS_CMSIS_OS_H
+#define __TEST_STUBS_CMSIS_OS_H
+
+#include <stdint.h>
+
+#define osKernelSysTickFrequency 1000
+static inline uint32_t osKernelSysTick(void) { return 0; }
+static inline void osDelay(uint32_t millisec) { (void)millisec; }
+
+#endif // __TEST_STUBS_CMSIS_OS_H
@@ -0,0 +1,8 @@
+// Host stand-in for the STM32F405xx device header, for building MotorControl
+// sources in the unit tests. The peripherals are in stm32f4xx_hal.h.
+#ifndef __TEST_STUBS_STM32F405XX_H
+#define __TEST_STUBS_STM32F405XX_H
+
+#define STM32F405xx
+
+#endif // __TEST_STUBS_STM32F405XX_H
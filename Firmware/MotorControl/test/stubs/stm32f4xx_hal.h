@@ -0,0 +1,101 @@
+// Host stand-in for the STM32 HAL, for building MotorControl
+// sources in the unit tests. Only what the tested sources use is provided.
+#ifndef __TEST_STUBS_STM32F4XX_HAL_H
+#define __TEST_STUBS_STM32F4XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+    volatile uint32_t CNT;
+} TIM_TypeDef;
+
+static TIM_TypeDef test_time_base_timer __attribute__((unused));
+#define TIM_TIME_BASE (&test_time_base_timer)
+
+static inline uint32_t HAL_GetTick(void) { return 0; }
+
+#define __ASM __asm__
+
+// The tests are single threaded, so critical sections are no-ops
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t primask) { (void)primask; }
+static inline void __disable_irq(void) {}
+
+// Flash: the NVM sectors 9 to 11 are mapped to RAM. Like real flash,
+// programming can only clear bits and erasing sets a whole sector to 0xff.
+// test_flash_budget simulates a power loss: once it reaches 0, all further
+// program and erase operations fail without touching the flash. It is
+// negative while no power loss is scheduled.
+#define TEST_FLASH_SECTOR_SIZE 0x20000
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern uint8_t test_flash[3][TEST_FLASH_SECTOR_SIZE];
+extern int test_flash_budget;
+#ifdef __cplusplus
+}
+#endif
+
+#define FLASH_SECTOR_9 9
+#define FLASH_SECTOR_10 10
+#define FLASH_SECTOR_11 11
+#define FLASH_SECTOR_9_BASE ((const volatile uint8_t*)test_flash[0])
+#define FLASH_SECTOR_10_BASE ((const volatile uint8_t*)test_flash[1])
+#define FLASH_SECTOR_11_BASE ((const volatile uint8_t*)test_flash[2])
+
+typedef enum { HAL_OK = 0, HAL_ERROR = 1 } HAL_StatusTypeDef;
+
+#define FLASH_TYPEERASE_SECTORS 0
+#define FLASH_VOLTAGE_RANGE_3 2
+#define FLASH_TYPEPROGRAM_BYTE 0
+#define FLASH_TYPEPROGRAM_WORD 2
+#define FLASH_FLAG_EOP 0
+#define FLASH_FLAG_OPERR 0
+#define FLASH_FLAG_WRPERR 0
+#define FLASH_FLAG_PGAERR 0
+#define FLASH_FLAG_PGSERR 0
+#define FLASH_FLAG_PGPERR 0
+#define __HAL_FLASH_CLEAR_FLAG(flags) ((void)(flags))
+
+typedef struct {
+    uint32_t TypeErase;
+    uint32_t Banks;
+    uint32_t Sector;
+    uint32_t NbSectors;
+    uint32_t VoltageRange;
+} FLASH_EraseInitTypeDef;
+
+static inline bool test_flash_powered(void) {
+    if (test_flash_budget == 0)
+        return false;
+    if (test_flash_budget > 0)
+        test_flash_budget--;
+    return true;
+}
+
+static inline void HAL_FLASH_Unlock(void) {}
+static inline void HAL_FLASH_Lock(void) {}
+static inline uint32_t HAL_FLASH_GetError(void) { return 1; }
+
+static inline HAL_StatusTypeDef HAL_FLASH_Program(uint32_t type, uintptr_t address, uint64_t data) {
+    size_t size = (type == FLASH_TYPEPROGRAM_WORD) ? 4 : 1;
+    uintptr_t begin = (uintptr_t)test_flash;
+    if (address < begin || address + size > begin + sizeof(test_flash) || !test_flash_powered())
+        return HAL_ERROR;
+    for (size_t i = 0; i < size; ++i)
+        ((uint8_t*)address)[i] &= (uint8_t)(data >> (i << 3));
+    return HAL_OK;
+}
+
+static inline HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* erase, uint32_t* sector_error) {
+    *sector_error = 0xffffffff;
+    if (erase->Sector < FLASH_SECTOR_9 || erase->Sector > FLASH_SECTOR_11 || !test_flash_powered())
+        return HAL_ERROR;
+    for (size_t i = 0; i < TEST_FLASH_SECTOR_SIZE; ++i)
+        test_flash[erase->Sector - FLASH_SECTOR_9][i] = 0xff;
+    return HAL_OK;
+}
+
+#endif // __TEST_STUBS_STM32F4XX_HAL_H
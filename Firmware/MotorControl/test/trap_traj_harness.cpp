@@ -0,0 +1,177 @@
+// Compares TrapezoidalTrajectory with the Python reference in
+// tools/motion_planning/PlanTrap.py and measures its cost per call.
+//
+// Usage: trap_traj_harness [vectors file] [tolerance]
+// The vectors are generated by tools/motion_planning/TrapGoldenVectors.py,
+// by default they are read from MotorControl/test/trap_traj_vectors.txt.
+// The deviations are relative to the scale of the move: the distance
+// covered for positions, the larger of Vmax and |Vi| for velocities and so
+// on. Exits with an error if any of them exceeds the tolerance (default 1e-4).
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "odrive_main.h"
+
+// The time base that utils.c refers to, which sim_hal.cpp provides in the
+// simulation. The planner itself doesn't use it.
+TIM_TypeDef sim_tim14;
+uint32_t HAL_GetTick(void) { return 0; }
+uint32_t osKernelSysTick(void) { return 0; }
+
+struct Eval_t {
+    float t;
+    double Y, Yd, Ydd;
+};
+
+struct Move_t {
+    float Xf, Xi, Vi, Vmax, Amax, Dmax;
+    double Ar, Vr, Dr, Ta, Tv, Td, Tf;
+    std::vector<Eval_t> evals;
+};
+
+struct Deviation_t {
+    const char* name;
+    double max = 0.0;
+    size_t move = 0;
+
+    void add(double observed, double expected, double scale, size_t move_idx) {
+        double deviation = fabs(observed - expected) / scale;
+        if (deviation > max) {
+            max = deviation;
+            move = move_idx;
+        }
+    }
+};
+
+static bool load_vectors(const char* path, std::vector<Move_t>& moves) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("cannot open %s\n", path);
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        Move_t move;
+        Eval_t eval;
+        if (sscanf(line, "move %f %f %f %f %f %f %lf %lf %lf %lf %lf %lf %lf",
+                &move.Xf, &move.Xi, &move.Vi, &move.Vmax, &move.Amax, &move.Dmax,
+                &move.Ar, &move.Vr, &move.Dr, &move.Ta, &move.Tv, &move.Td, &move.Tf) == 13) {
+            moves.push_back(move);
+        } else if (sscanf(line, "eval %f %lf %lf %lf", &eval.t, &eval.Y, &eval.Yd, &eval.Ydd) == 4) {
+            if (moves.empty())
+                break;
+            moves.back().evals.push_back(eval);
+        } else if (line[0] != '#' && line[0] != '\n') {
+            printf("invalid line: %s", line);
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    return !moves.empty();
+}
+
+// Prints the average runtime of fn() in nanoseconds and in host cycles
+template<typename T>
+void time_calls(const char* name, const T& fn, size_t iterations) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t start_cycles = __rdtsc();
+#endif
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        fn(i);
+    auto end = std::chrono::high_resolution_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / (double)iterations;
+#if defined(__x86_64__) || defined(__i386__)
+    double cycles = (double)(__rdtsc() - start_cycles) / (double)iterations;
+    printf("%-24s %8.1f ns %8.1f cycles per call\n", name, ns, cycles);
+#else
+    printf("%-24s %8.1f ns per call\n", name, ns);
+#endif
+}
+
+// Prevents the compiler from optimizing away benchmarked results
+volatile float time_calls_sink;
+
+int main(int argc, const char** argv) {
+    const char* path = argc > 1 ? argv[1] : "MotorControl/test/trap_traj_vectors.txt";
+    double tolerance = argc > 2 ? atof(argv[2]) : 1e-4;
+
+    std::vector<Move_t> moves;
+    if (!load_vectors(path, moves))
+        return -1;
+
+    TrapezoidalTrajectory::Config_t config;
+    TrapezoidalTrajectory traj(config);
+
+    Deviation_t deviations[] = {
+        { "Ar" }, { "Vr" }, { "Dr" }, { "Ta" }, { "Tv" }, { "Td" }, { "Tf" },
+        { "Y" }, { "Yd" }, { "Ydd" }
+    };
+    size_t num_evals = 0;
+    for (size_t i = 0; i < moves.size(); ++i) {
+        const Move_t& m = moves[i];
+        traj.planTrapezoidal(m.Xf, m.Xi, m.Vi, m.Vmax, m.Amax, m.Dmax);
+        double accel_scale = std::max(m.Amax, m.Dmax);
+        double vel_scale = std::max(m.Vmax, fabsf(m.Vi));
+        double time_scale = std::max(m.Tf, 1e-3);
+        double pos_scale = std::max(fabs((double)m.Xf - (double)m.Xi), vel_scale * time_scale);
+        deviations[0].add(traj.Ar_, m.Ar, accel_scale, i);
+        deviations[1].add(traj.Vr_, m.Vr, vel_scale, i);
+        deviations[2].add(traj.Dr_, m.Dr, accel_scale, i);
+        deviations[3].add(traj.Ta_, m.Ta, time_scale, i);
+        deviations[4].add(traj.Tv_, m.Tv, time_scale, i);
+        deviations[5].add(traj.Td_, m.Td, time_scale, i);
+        deviations[6].add(traj.Tf_, m.Tf, time_scale, i);
+        for (const Eval_t& e : m.evals) {
+            TrapezoidalTrajectory::Step_t step = traj.eval(e.t);
+            deviations[7].add(step.Y, e.Y, pos_scale, i);
+            deviations[8].add(step.Yd, e.Yd, vel_scale, i);
+            // The acceleration jumps at the phase boundaries, where float
+            // and double may fall on different sides
+            if (fabs(step.Ydd - e.Ydd) > 0.0 && (fabs(e.t - m.Ta) < 1e-4 * time_scale
+                    || fabs(e.t - (m.Ta + m.Tv)) < 1e-4 * time_scale || fabs(e.t - m.Tf) < 1e-4 * time_scale))
+                continue;
+            deviations[9].add(step.Ydd, e.Ydd, accel_scale, i);
+        }
+        num_evals += m.evals.size();
+    }
+
+    bool passed = true;
+    printf("%zu moves, %zu points\n", moves.size(), num_evals);
+    for (const Deviation_t& deviation : deviations) {
+        bool ok = deviation.max <= tolerance;
+        printf("%-4s max relative deviation %.3g (move %zu)%s\n", deviation.name,
+               deviation.max, deviation.move, ok ? "" : " FAILED");
+        passed = passed && ok;
+    }
+
+    size_t iterations = 1000000;
+    time_calls("planTrapezoidal", [&](size_t i) {
+        const Move_t& m = moves[i % moves.size()];
+        traj.planTrapezoidal(m.Xf, m.Xi, m.Vi, m.Vmax, m.Amax, m.Dmax);
+        time_calls_sink = traj.Tf_;
+    }, iterations);
+
+    // Like the control loop: consecutive times on one move
+    const Move_t& m = moves[0];
+    traj.planTrapezoidal(m.Xf, m.Xi, m.Vi, m.Vmax, m.Amax, m.Dmax);
+    float dt = 1.1f * traj.Tf_ / (float)iterations;
+    time_calls("eval (sequential t)", [&](size_t i) {
+        time_calls_sink = traj.eval((float)i * dt).Y;
+    }, iterations);
+    // Random access, which has to search for the segment
+    time_calls("eval (random t)", [&](size_t i) {
+        time_calls_sink = traj.eval(m.evals[i % m.evals.size()].t).Y;
+    }, iterations);
+
+    printf(passed ? "all vectors passed\n" : "vectors failed\n");
+    return passed ? 0 : -1;
+}
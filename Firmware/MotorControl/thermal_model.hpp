@@ -0,0 +1,50 @@
+#ifndef __THERMAL_MODEL_HPP
+#define __THERMAL_MODEL_HPP
+
+#include <cmath>
+
+// This header does not depend on the rest of the firmware so that it can
+// be tested on the host (see test/run_tests.cpp).
+
+// @brief First order model of the temperature rise of a part that is heated
+// by I^2 losses.
+//
+// The rise above a reference temperature (a thermistor or the ambient)
+// follows the steady state rise coeff * I^2 with the time constant tau.
+//
+// sustainable_current() predicts how much current the part can take for a
+// given time without exceeding a temperature limit. A cold part allows a
+// multiple of the continuous current for short peaks, a hot part converges
+// to the continuous current.
+class ThermalModel {
+public:
+    // @param I_sq: squared current magnitude [A^2]
+    // @param coeff: steady state rise per squared current [K/A^2]
+    // @param tau: thermal time constant [s]
+    // @param dt: time since the last update [s]
+    void update(float I_sq, float coeff, float tau, float dt) {
+        float k = tau > dt ? dt / tau : 1.0f;
+        rise_ += (coeff * I_sq - rise_) * k;
+    }
+
+    // @brief Returns the largest current [A] that keeps the temperature below
+    // temp_limit for the next horizon seconds. Returns INFINITY if the model
+    // is disabled (coeff or tau not positive).
+    float sustainable_current(float reference_temp, float temp_limit,
+            float coeff, float tau, float horizon) const {
+        if (!(coeff > 0.0f) || !(tau > 0.0f))
+            return INFINITY;
+        // After the horizon, the rise has moved by (1 - a) towards the steady state
+        float a = horizon > 0.0f ? expf(-horizon / tau) : 0.0f;
+        float max_steady_rise = (temp_limit - reference_temp - rise_ * a) / (1.0f - a);
+        if (!(max_steady_rise > 0.0f))
+            return 0.0f;
+        return sqrtf(max_steady_rise / coeff);
+    }
+
+    void reset() { rise_ = 0.0f; }
+
+    float rise_ = 0.0f; // [K] above the reference temperature
+};
+
+#endif // __THERMAL_MODEL_HPP
@@ -0,0 +1,68 @@
+
+#include "odrive_main.h"
+
+Trace trace;
+
+static_assert(sizeof(Trace::Record_t) == 12, "the record layout is part of the protocol");
+static_assert((Trace::kNumRecords & (Trace::kNumRecords - 1)) == 0, "kNumRecords must be a power of 2");
+
+// @brief Appends a record. Takes a few dozen cycles and may be called from
+// any thread and from interrupts up to the current measurement.
+void Trace::emit(Event_t event, uint8_t source, uint16_t arg, uint32_t value) {
+    if (!enabled_)
+        return;
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    Record_t& rec = records_[write_count_ & (kNumRecords - 1)];
+    rec.timestamp = DWT->CYCCNT;
+    rec.event = event;
+    rec.source = source;
+    rec.arg = arg;
+    rec.value = value;
+    write_count_ = write_count_ + 1;
+    cpu_exit_masked_critical(basepri);
+}
+
+// @brief Forwards new records to the ITM, as far as the ITM FIFO has room.
+// This is called from the idle hook and must not block.
+void Trace::drain_itm() {
+    if (!(ITM->TCR & ITM_TCR_ITMENA_Msk) || !(ITM->TER & (1UL << kItmPort))) {
+        // No debugger is listening, start with the newest records once it is
+        itm_read_count_ = write_count_;
+        itm_word_ = 0;
+        return;
+    }
+
+    constexpr size_t words_per_record = sizeof(Record_t) / sizeof(uint32_t);
+    for (;;) {
+        uint32_t write_count = write_count_;
+        // Skip overwritten records. A record that is already partly sent is
+        // finished, so that the host stays aligned to the record boundaries.
+        if (itm_word_ == 0 && write_count - itm_read_count_ > kNumRecords) {
+            dropped_ += write_count - itm_read_count_ - kNumRecords;
+            itm_read_count_ = write_count - kNumRecords;
+        }
+        if (itm_read_count_ == write_count)
+            return;
+        if (ITM->PORT[kItmPort].u32 == 0)
+            return; // FIFO full, continue next time
+
+        uint32_t word;
+        memcpy(&word, reinterpret_cast<const uint8_t*>(&records_[itm_read_count_ & (kNumRecords - 1)])
+                + itm_word_ * sizeof(uint32_t), sizeof(word));
+        ITM->PORT[kItmPort].u32 = word;
+        if (++itm_word_ == words_per_record) {
+            itm_word_ = 0;
+            ++itm_read_count_;
+        }
+    }
+}
+
+void Trace::reset() {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CURRENT_SENSE);
+    write_count_ = 0;
+    itm_read_count_ = 0;
+    itm_word_ = 0;
+    dropped_ = 0;
+    memset(records_, 0, sizeof(records_));
+    cpu_exit_masked_critical(basepri);
+}
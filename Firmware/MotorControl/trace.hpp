@@ -0,0 +1,85 @@
+#ifndef __TRACE_HPP
+#define __TRACE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Non-blocking event trace.
+//
+// emit() appends a compact binary record to a RAM ring buffer and never
+// blocks, so it can be used from the control loop and from interrupts.
+// When the ring buffer is full, the oldest record is overwritten.
+//
+// The buffer is drained in two ways:
+//  - The idle task forwards new records to ITM stimulus port kItmPort (SWO),
+//    if a debugger enabled that port. It only writes while the ITM FIFO has
+//    room and continues in the next iteration otherwise.
+//  - The host reads the records through the "records" buffer endpoint and
+//    tracks write_count_, see tools/odrive_trace.py.
+// Both readers keep their own position, so neither one consumes records
+// for the other. Records that are overwritten before a reader gets to them
+// are lost for that reader only.
+class Trace {
+public:
+    static constexpr size_t kNumRecords = 256; // must be a power of 2
+    static constexpr uint32_t kItmPort = 1;
+
+    enum Event_t {
+        EVENT_NONE,
+        EVENT_AXIS_STATE,     //<! arg: new state, value: axis error
+        EVENT_AXIS_ERROR,     //<! value: new axis error
+        EVENT_MOTOR_ERROR,    //<! value: new motor error
+        EVENT_ENCODER_ERROR,  //<! value: new encoder error
+        EVENT_PROFILER_MAX,   //<! arg: Profiler::Section_t, value: new maximum [CPU cycles]
+        EVENT_USER,           //<! free for debugging
+    };
+
+    // 12 bytes, no padding. The layout is part of the protocol, see
+    // tools/odrive_trace.py.
+    struct Record_t {
+        uint32_t timestamp; // [CPU cycles] DWT cycle counter
+        uint8_t event;      // Event_t
+        uint8_t source;     // axis number, 0xff if not axis specific
+        uint16_t arg;
+        uint32_t value;
+    };
+    static constexpr uint8_t kNoAxis = 0xff;
+
+    void emit(Event_t event, uint8_t source, uint16_t arg, uint32_t value);
+    void drain_itm();
+    void reset();
+
+    Record_t records_[kNumRecords];
+    const size_t records_bytes_ = sizeof(records_);
+    volatile uint32_t write_count_ = 0;  // total number of records written
+    uint32_t dropped_ = 0;               // records dropped because the ITM reader fell behind
+    bool enabled_ = true;
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_property("enabled", &enabled_),
+            make_protocol_ro_property("write_count", const_cast<uint32_t*>(&write_count_)),
+            make_protocol_ro_property("dropped", &dropped_),
+            make_protocol_buffer("records", records_, &records_bytes_),
+            make_protocol_function("reset", *this, &Trace::reset)
+        );
+    }
+
+private:
+    uint32_t itm_read_count_ = 0; // records forwarded to the ITM
+    uint32_t itm_word_ = 0;       // next word of the record at itm_read_count_
+};
+
+extern Trace trace;
+
+// @brief Returns the axis number for Trace::Record_t::source.
+inline uint8_t trace_source(const Axis* axis) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (axes[i] == axis)
+            return i;
+    }
+    return Trace::kNoAxis;
+}
+
+#endif // __TRACE_HPP
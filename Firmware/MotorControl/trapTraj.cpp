@@ -60,35 +60,40 @@ bool TrapezoidalTrajectory::planTrapezoidal(float Xf, float Xi, float Vi,
     Vi_ = Vi;
     yAccel_ = Xi + Vi*Ta_ + 0.5f*Ar_*SQ(Ta_); // pos at end of accel phase
 
+    // Each phase is expanded around the time at which its closed form is
+    // exact: the deceleration around Tf, so that the move ends at Xf.
+    segments_[0] = { Ta_,       0.0f, { 0.5f * Ar_, Vi,   Xi } };      // Accelerating
+    segments_[1] = { Ta_ + Tv_, Ta_,  { 0.0f,       Vr_,  yAccel_ } }; // Coasting
+    segments_[2] = { Tf_,       Tf_,  { 0.5f * Dr_, 0.0f, Xf } };      // Deceleration
+    segments_[3] = { INFINITY,  0.0f, { 0.0f,       0.0f, Xf } };      // Final Condition
+    segment_ = 0;
+
     return true;
 }
 
+// @brief Evaluates the profile at t [s] since the start of the move.
+// The search for the segment starts at the one of the previous call, so
+// the control loop, whose t only increases, finds it in constant time.
 TrapezoidalTrajectory::Step_t TrapezoidalTrajectory::eval(float t) {
     Step_t trajStep;
     if (t < 0.0f) {  // Initial Condition
         trajStep.Y   = Xi_;
         trajStep.Yd  = Vi_;
         trajStep.Ydd = 0.0f;
-    } else if (t < Ta_) {  // Accelerating
-        trajStep.Y   = Xi_ + Vi_*t + 0.5f*Ar_*SQ(t);
-        trajStep.Yd  = Vi_ + Ar_*t;
-        trajStep.Ydd = Ar_;
-    } else if (t < Ta_ + Tv_) {  // Coasting
-        trajStep.Y   = yAccel_ + Vr_*(t - Ta_);
-        trajStep.Yd  = Vr_;
-        trajStep.Ydd = 0.0f;
-    } else if (t < Tf_) {  // Deceleration
-        float td     = t - Tf_;
-        trajStep.Y   = Xf_ + 0.5f*Dr_*SQ(td);
-        trajStep.Yd  = Dr_*td;
-        trajStep.Ydd = Dr_;
-    } else if (t >= Tf_) {  // Final Condition
-        trajStep.Y   = Xf_;
-        trajStep.Yd  = 0.0f;
-        trajStep.Ydd = 0.0f;
-    } else {
-        // TODO: report error here
+        return trajStep;
     }
 
+    size_t i = segment_;
+    if (i > 0 && t < segments_[i - 1].t_end)
+        i = 0;
+    while (i < kNumSegments - 1 && t >= segments_[i].t_end)
+        ++i;
+    segment_ = i;
+
+    const Segment_t& segment = segments_[i];
+    float tau = t - segment.t_origin;
+    trajStep.Y   = horner_fma(tau, segment.coeffs, 3);
+    trajStep.Yd  = fmaf(2.0f * segment.coeffs[0], tau, segment.coeffs[1]);
+    trajStep.Ydd = 2.0f * segment.coeffs[0];
     return trajStep;
-}
\ No newline at end of file
+}
@@ -8,12 +8,23 @@ public:
         float accel_limit = 5000.0f; // [count/s^2]
         float decel_limit = 5000.0f; // [count/s^2]
         float A_per_css = 0.0f;      // [A/(count/s^2)]
+        bool use_scurve = false;     // plan jerk limited moves, see SCurveTrajectory
+        float jerk_limit = 100000.0f; // [count/s^3]
     };
     struct Step_t {
         float Y;
         float Yd;
         float Ydd;
     };
+    // @brief One segment of the planned profile: until t_end, the position
+    // is the polynomial coeffs (highest order first) in t - t_origin.
+    struct Segment_t {
+        float t_end;     // [s]
+        float t_origin;  // [s]
+        float coeffs[3]; // [counts/s^2 / 2, counts/s, counts]
+    };
+    // Accelerate, coast, decelerate, final condition
+    static constexpr size_t kNumSegments = 4;
 
     TrapezoidalTrajectory(Config_t& config);
     bool planTrapezoidal(float Xf, float Xi, float Vi,
@@ -26,7 +37,9 @@ public:
                 make_protocol_property("vel_limit", &config_.vel_limit),
                 make_protocol_property("accel_limit", &config_.accel_limit),
                 make_protocol_property("decel_limit", &config_.decel_limit),
-                make_protocol_property("A_per_css", &config_.A_per_css)
+                make_protocol_property("A_per_css", &config_.A_per_css),
+                make_protocol_property("use_scurve", &config_.use_scurve),
+                make_protocol_property("jerk_limit", &config_.jerk_limit)
             )
         );
     }
@@ -48,6 +61,9 @@ public:
     float Tf_;
 
     float yAccel_;
+
+    Segment_t segments_[kNumSegments];
+    size_t segment_ = 0; // segment of the last eval(), where the search starts
 };
 
 #endif
\ No newline at end of file
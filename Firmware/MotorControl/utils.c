@@ -2,124 +2,32 @@
 #include <utils.h>
 #include <math.h>
 #include <float.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <cmsis_os.h>
 #include <stm32f4xx_hal.h>
 
 
-int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
-    int Sextant;
-
-    if (beta >= 0.0f) {
-        if (alpha >= 0.0f) {
-            //quadrant I
-            if (one_by_sqrt3 * beta > alpha)
-                Sextant = 2; //sextant v2-v3
-            else
-                Sextant = 1; //sextant v1-v2
-
-        } else {
-            //quadrant II
-            if (-one_by_sqrt3 * beta > alpha)
-                Sextant = 3; //sextant v3-v4
-            else
-                Sextant = 2; //sextant v2-v3
-        }
-    } else {
-        if (alpha >= 0.0f) {
-            //quadrant IV
-            if (-one_by_sqrt3 * beta > alpha)
-                Sextant = 5; //sextant v5-v6
-            else
-                Sextant = 6; //sextant v6-v1
-        } else {
-            //quadrant III
-            if (one_by_sqrt3 * beta > alpha)
-                Sextant = 4; //sextant v4-v5
-            else
-                Sextant = 5; //sextant v5-v6
-        }
-    }
-
-    switch (Sextant) {
-        // sextant v1-v2
-        case 1: {
-            // Vector on-times
-            float t1 = alpha - one_by_sqrt3 * beta;
-            float t2 = two_by_sqrt3 * beta;
-
-            // PWM timings
-            *tA = (1.0f - t1 - t2) * 0.5f;
-            *tB = *tA + t1;
-            *tC = *tB + t2;
-
-            break;
-        }
-        // sextant v2-v3
-        case 2: {
-            // Vector on-times
-            float t2 = alpha + one_by_sqrt3 * beta;
-            float t3 = -alpha + one_by_sqrt3 * beta;
-
-            // PWM timings
-            *tB = (1.0f - t2 - t3) * 0.5f;
-            *tA = *tB + t3;
-            *tC = *tA + t2;
+// SVM by midpoint clamping (min/max zero sequence injection).
+// This is equivalent to the classic sextant based formulation, but the
+// only data dependent operations are compare/select pairs which compile
+// to IT blocks instead of branches, so the execution time is constant.
+RAM_FUNC int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
+    // Inverse clarke transform to (magnitude invariant) phase voltages
+    float vA = alpha;
+    float vB = -0.5f * alpha + sqrt3_by_2 * beta;
+    float vC = -0.5f * alpha - sqrt3_by_2 * beta;
 
-            break;
-        }
-        // sextant v3-v4
-        case 3: {
-            // Vector on-times
-            float t3 = two_by_sqrt3 * beta;
-            float t4 = -alpha - one_by_sqrt3 * beta;
-
-            // PWM timings
-            *tB = (1.0f - t3 - t4) * 0.5f;
-            *tC = *tB + t3;
-            *tA = *tC + t4;
-
-            break;
-        }
-        // sextant v4-v5
-        case 4: {
-            // Vector on-times
-            float t4 = -alpha + one_by_sqrt3 * beta;
-            float t5 = -two_by_sqrt3 * beta;
-
-            // PWM timings
-            *tC = (1.0f - t4 - t5) * 0.5f;
-            *tB = *tC + t5;
-            *tA = *tB + t4;
+    // Shift the common mode such that the phase voltages are centered
+    // between the extremes. This yields the same null-vector split as SVM.
+    float vmax = MACRO_MAX(vA, MACRO_MAX(vB, vC));
+    float vmin = MACRO_MIN(vA, MACRO_MIN(vB, vC));
+    float vmid = 0.5f * (vmax + vmin);
 
-            break;
-        }
-        // sextant v5-v6
-        case 5: {
-            // Vector on-times
-            float t5 = -alpha - one_by_sqrt3 * beta;
-            float t6 = alpha - one_by_sqrt3 * beta;
-
-            // PWM timings
-            *tC = (1.0f - t5 - t6) * 0.5f;
-            *tA = *tC + t5;
-            *tB = *tA + t6;
-
-            break;
-        }
-        // sextant v6-v1
-        case 6: {
-            // Vector on-times
-            float t6 = -two_by_sqrt3 * beta;
-            float t1 = alpha + one_by_sqrt3 * beta;
-
-            // PWM timings
-            *tA = (1.0f - t6 - t1) * 0.5f;
-            *tC = *tA + t1;
-            *tB = *tC + t6;
-
-            break;
-        }
-    }
+    // PWM timings (rising edge, so a higher voltage means an earlier edge)
+    *tA = 0.5f - (2.0f / 3.0f) * (vA - vmid);
+    *tB = 0.5f - (2.0f / 3.0f) * (vB - vmid);
+    *tC = 0.5f - (2.0f / 3.0f) * (vC - vmid);
 
     // if any of the results becomes NaN, result_valid will evaluate to false
     int result_valid =
@@ -129,6 +37,72 @@ int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
     return result_valid ? 0 : -1;
 }
 
+// Same as SVM, but vectors beyond the hexagon are not rejected. Instead they
+// are shortened onto the hexagon boundary while keeping their angle
+// (minimum phase error overmodulation).
+RAM_FUNC int SVM_overmodulation(float alpha, float beta, float* tA, float* tB, float* tC) {
+    float vA = alpha;
+    float vB = -0.5f * alpha + sqrt3_by_2 * beta;
+    float vC = -0.5f * alpha - sqrt3_by_2 * beta;
+
+    float vmax = MACRO_MAX(vA, MACRO_MAX(vB, vC));
+    float vmin = MACRO_MIN(vA, MACRO_MIN(vB, vC));
+    float vmid = 0.5f * (vmax + vmin);
+
+    // The timings span (2/3) * (vmax - vmin), which must not exceed one period
+    float k = 2.0f / 3.0f;
+    float span = vmax - vmin;
+    if (span > 1.5f)
+        k = 1.0f / span;
+
+    *tA = 0.5f - k * (vA - vmid);
+    *tB = 0.5f - k * (vB - vmid);
+    *tC = 0.5f - k * (vC - vmid);
+
+    // Rounding may land marginally outside of [0, 1]
+    *tA = MACRO_MIN(MACRO_MAX(*tA, 0.0f), 1.0f);
+    *tB = MACRO_MIN(MACRO_MAX(*tB, 0.0f), 1.0f);
+    *tC = MACRO_MIN(MACRO_MAX(*tC, 0.0f), 1.0f);
+
+    // The clamping above would mask NaN input, so check for it explicitly
+    return (isnan(alpha) || isnan(beta)) ? -1 : 0;
+}
+
+// Odd minimax polynomial of atan(a) on [0, 1] of order FAST_ATAN2_ORDER.
+// The coefficients are fitted with the Remez algorithm, the error
+// alternates between +/- FAST_ATAN2_MAX_ERROR.
+static inline float atan_poly(float a) {
+    float s = a * a;
+#if FAST_ATAN2_ORDER == 3
+    return (-0.191947954f * s + 0.972394118f) * a;
+#elif FAST_ATAN2_ORDER == 5
+    return ((0.0793390414f * s - 0.288690238f) * s + 0.995357955f) * a;
+#elif FAST_ATAN2_ORDER == 7
+    return (((-0.0389865142f * s + 0.146264464f) * s - 0.321174969f) * s + 0.999213813f) * a;
+#else
+    return ((((0.0208451142f * s - 0.0851563509f) * s + 0.180159295f) * s - 0.330304786f) * s + 0.999866329f) * a;
+#endif
+}
+
+// Newton steps of fast_recip, each one squares the relative error of about
+// 0.12 of the initial guess. Enough to stay well below FAST_ATAN2_MAX_ERROR.
+#if FAST_ATAN2_ORDER <= 5
+#define FAST_RECIP_STEPS 2
+#else
+#define FAST_RECIP_STEPS 3
+#endif
+
+// @brief Reciprocal of 0 < d < 1e37 without a division: an initial guess
+// from the exponent bits, refined by Newton steps r = r * (2 - d * r)
+static inline float fast_recip(float d) {
+    union { float f; uint32_t u; } guess = { d };
+    guess.u = 0x7EF311C7u - guess.u;
+    float r = guess.f;
+    for (int i = 0; i < FAST_RECIP_STEPS; ++i)
+        r = r * (2.0f - d * r);
+    return r;
+}
+
 // based on https://math.stackexchange.com/a/1105038/81278
 float fast_atan2(float y, float x) {
     // a := min (|x|, |y|) / max (|x|, |y|)
@@ -136,10 +110,7 @@ float fast_atan2(float y, float x) {
     float abs_x = fabsf(x);
     // inject FLT_MIN in denominator to avoid division by zero
     float a = MACRO_MIN(abs_x, abs_y) / (MACRO_MAX(abs_x, abs_y) + FLT_MIN);
-    // s := a * a
-    float s = a * a;
-    // r := ((-0.0464964749 * s + 0.15931422) * s - 0.327622764) * s * a + a
-    float r = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+    float r = atan_poly(a);
     // if |y| > |x| then r := 1.57079637 - r
     if (abs_y > abs_x)
         r = 1.57079637f - r;
@@ -153,6 +124,53 @@ float fast_atan2(float y, float x) {
     return r;
 }
 
+// Same reduction as fast_atan2, but the selects compile to IT blocks and the
+// division to a few multiplications, so the execution time is constant
+float fast_atan2_octant(float y, float x) {
+    float abs_y = fabsf(y);
+    float abs_x = fabsf(x);
+    float num = MACRO_MIN(abs_x, abs_y);
+    float den = MACRO_MAX(abs_x, abs_y) + FLT_MIN;
+    float r = atan_poly(num * fast_recip(den));
+    // undo the reduction to the first octant, then to the first quadrant
+    r = (abs_y > abs_x) ? 1.57079637f - r : r;
+    r = (x < 0.0f) ? 3.14159274f - r : r;
+    return (y < 0.0f) ? -r : r;
+}
+
+#define SINCOS_TABLE_SIZE 256
+
+// One period of sin() plus a guard entry, so that the interpolation never
+// needs to wrap. Lives in CCM RAM (zero wait states, no bus contention with DMA).
+// Filled in by fast_sincos_init().
+CCM_DATA static float sincos_table[SINCOS_TABLE_SIZE + 1];
+
+void fast_sincos_init(void) {
+    for (size_t i = 0; i <= SINCOS_TABLE_SIZE; ++i)
+        sincos_table[i] = sinf(2.0f * M_PI * (float)i / (float)SINCOS_TABLE_SIZE);
+}
+
+// Table lookup with linear interpolation.
+// cos(x) = sin(x + pi/2) is a quarter table offset, so the index and fraction
+// computation is shared between both results.
+void fast_sincos(float x, float* sin_x, float* cos_x) {
+    // Scale to table units and floor towards -infinity
+    float findex = x * ((float)SINCOS_TABLE_SIZE / (2.0f * M_PI));
+    int32_t n = (int32_t)findex;
+    if (findex < 0.0f)
+        n--;
+    float fract = findex - (float)n;
+
+    // Index into one period
+    uint32_t idx_s = (uint32_t)n & (SINCOS_TABLE_SIZE - 1);
+    uint32_t idx_c = (idx_s + SINCOS_TABLE_SIZE / 4) & (SINCOS_TABLE_SIZE - 1);
+
+    float s0 = sincos_table[idx_s];
+    float c0 = sincos_table[idx_c];
+    *sin_x = s0 + fract * (sincos_table[idx_s + 1] - s0);
+    *cos_x = c0 + fract * (sincos_table[idx_c + 1] - c0);
+}
+
 // Evaluate polynomials using Fused Multiply Add intrisic instruction.
 // coeffs[0] is highest order, as per numpy.polyfit
 // p(x) = coeffs[0] * x^deg + ... + coeffs[deg], for some degree "deg"
@@ -163,6 +181,251 @@ float horner_fma(float x, const float *coeffs, size_t count) {
     return result;
 }
 
+#define CCM_POOL_SIZE (48 * 1024)
+CCM_DATA static uint8_t ccm_pool[CCM_POOL_SIZE] __attribute__((aligned(8)));
+static size_t ccm_pool_used = 0;
+
+void* ccm_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7; // keep 8 byte alignment
+    void* ptr = NULL;
+    uint32_t prim = __get_PRIMASK();
+    __disable_irq();
+    if (size <= CCM_POOL_SIZE - ccm_pool_used) {
+        ptr = &ccm_pool[ccm_pool_used];
+        ccm_pool_used += size;
+    }
+    __set_PRIMASK(prim);
+    return ptr;
+}
+
+size_t ccm_bytes_free(void) {
+    return CCM_POOL_SIZE - ccm_pool_used;
+}
+
+// Second pool for large tables that do not fit in CCM any more. Keeping it
+// separate from the newlib heap means a table that is too large cannot eat
+// into the memory that the rest of the firmware allocates at runtime.
+// Tables that fit in neither pool come from the heap, which only happens at
+// startup: the default two axis configuration needs two 32 kB anti-cogging
+// maps, which is more than both pools hold next to the axis objects.
+#define TABLE_POOL_SIZE (16 * 1024)
+static uint8_t table_pool[TABLE_POOL_SIZE] __attribute__((aligned(8)));
+static size_t table_pool_used = 0;
+static size_t table_heap_used = 0;
+static uint32_t table_alloc_failures = 0;
+
+void* table_alloc(size_t size) {
+    void* ptr = ccm_alloc(size);
+    if (ptr)
+        return ptr;
+    size = (size + 7) & ~(size_t)7;
+    uint32_t prim = __get_PRIMASK();
+    __disable_irq();
+    if (size <= TABLE_POOL_SIZE - table_pool_used) {
+        ptr = &table_pool[table_pool_used];
+        table_pool_used += size;
+    }
+    __set_PRIMASK(prim);
+    if (ptr)
+        return ptr;
+    ptr = malloc(size);
+    prim = __get_PRIMASK();
+    __disable_irq();
+    if (ptr)
+        table_heap_used += size;
+    else
+        ++table_alloc_failures;
+    __set_PRIMASK(prim);
+    return ptr;
+}
+
+size_t table_pool_bytes_free(void) {
+    return TABLE_POOL_SIZE - table_pool_used;
+}
+
+size_t table_heap_bytes_used(void) {
+    return table_heap_used;
+}
+
+uint32_t table_alloc_failure_count(void) {
+    return table_alloc_failures;
+}
+
+enum {
+    NUMBER_START,      // nothing yet
+    NUMBER_SIGN,       // after the sign
+    NUMBER_INTEGER,    // in the integer digits
+    NUMBER_POINT,      // after a point without integer digits
+    NUMBER_FRACTION,   // in the fraction digits, or after a point that follows digits
+    NUMBER_EXP,        // after the 'e'
+    NUMBER_EXP_SIGN,   // after the sign of the exponent
+    NUMBER_EXP_DIGITS, // in the exponent digits
+};
+
+void number_token_reset(NumberToken_t* token) {
+    token->mantissa = 0;
+    token->exponent = 0;
+    token->exp_digits = 0;
+    token->state = NUMBER_START;
+    token->negative = false;
+    token->exp_negative = false;
+    token->truncated = false;
+}
+
+static void number_token_add_digit(NumberToken_t* token, uint32_t digit, bool fraction) {
+    if (token->mantissa < 100000000) {
+        token->mantissa = 10 * token->mantissa + digit;
+        if (fraction)
+            token->exponent--;
+    } else {
+        // Further digits are below the float resolution
+        token->truncated = true;
+        if (!fraction)
+            token->exponent++;
+    }
+}
+
+bool number_token_push(NumberToken_t* token, char c) {
+    bool is_digit = c >= '0' && c <= '9';
+    switch (token->state) {
+        case NUMBER_START:
+            if (c == '-' || c == '+') {
+                token->negative = (c == '-');
+                token->state = NUMBER_SIGN;
+                return true;
+            }
+            // fall through
+        case NUMBER_SIGN:
+            if (c == '.') {
+                token->state = NUMBER_POINT;
+                return true;
+            }
+            // fall through
+        case NUMBER_INTEGER:
+            if (is_digit) {
+                number_token_add_digit(token, c - '0', false);
+                token->state = NUMBER_INTEGER;
+                return true;
+            }
+            if (token->state == NUMBER_INTEGER && c == '.') {
+                token->state = NUMBER_FRACTION;
+                return true;
+            }
+            break;
+        case NUMBER_POINT:
+        case NUMBER_FRACTION:
+            if (is_digit) {
+                number_token_add_digit(token, c - '0', true);
+                token->state = NUMBER_FRACTION;
+                return true;
+            }
+            break;
+        case NUMBER_EXP:
+            if (c == '-' || c == '+') {
+                token->exp_negative = (c == '-');
+                token->state = NUMBER_EXP_SIGN;
+                return true;
+            }
+            // fall through
+        case NUMBER_EXP_SIGN:
+        case NUMBER_EXP_DIGITS:
+            if (is_digit) {
+                if (token->exp_digits < 1000)
+                    token->exp_digits = 10 * token->exp_digits + (c - '0');
+                token->state = NUMBER_EXP_DIGITS;
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+    if ((c == 'e' || c == 'E') && (token->state == NUMBER_INTEGER || token->state == NUMBER_FRACTION)) {
+        token->state = NUMBER_EXP;
+        return true;
+    }
+    return false;
+}
+
+bool number_token_value(const NumberToken_t* token, float* value) {
+    if (token->state != NUMBER_INTEGER && token->state != NUMBER_FRACTION
+            && token->state != NUMBER_EXP_DIGITS)
+        return false;
+    int32_t exponent = token->exponent + (token->exp_negative ? -token->exp_digits : token->exp_digits);
+    // 10^|exponent| by squaring, 1e1 to 1e8 are exact in float
+    static const float powers[] = { 1e1f, 1e2f, 1e4f, 1e8f, 1e16f, 1e32f };
+    uint32_t n = exponent < 0 ? -exponent : exponent;
+    float scale = 1.0f;
+    for (size_t i = 0; i < sizeof(powers) / sizeof(powers[0]) && n; ++i, n >>= 1) {
+        if (n & 1)
+            scale *= powers[i];
+    }
+    float result = (float)token->mantissa;
+    if (token->mantissa == 0)
+        result = 0.0f;
+    else if (n)
+        result = exponent < 0 ? 0.0f : INFINITY;
+    else
+        result = exponent < 0 ? result / scale : result * scale;
+    *value = token->negative ? -result : result;
+    return true;
+}
+
+bool number_token_uint(const NumberToken_t* token, uint32_t* value) {
+    if (token->state != NUMBER_INTEGER || token->negative || token->truncated)
+        return false;
+    *value = token->mantissa;
+    return true;
+}
+
+size_t format_uint(char* buf, uint32_t value) {
+    char digits[10];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (size_t i = 0; i < n; ++i)
+        buf[i] = digits[n - 1 - i];
+    buf[n] = 0;
+    return n;
+}
+
+size_t format_float(char* buf, float value) {
+    // The integer part must fit in 32 bits, printf handles the rest
+    if (!(fabsf(value) < 4294967296.0f))
+        return snprintf(buf, FORMAT_FLOAT_MAX_LENGTH, "%f", (double)value);
+    size_t len = 0;
+    if (signbit(value)) {
+        buf[len++] = '-';
+        value = -value;
+    }
+    uint32_t integer = (uint32_t)value;
+    // The fraction in 0.64 fixed point is exact for values above 2^-40,
+    // smaller ones round to 0 anyway. Scaling it in integers (in two 32 bit
+    // halves) rounds like printf, to nearest and ties to even, where a float
+    // multiplication would be off by up to 0.03 of the last digit.
+    uint64_t fraction = (uint64_t)((value - (float)integer) * 18446744073709551616.0f);
+    uint64_t low = (fraction & 0xffffffffu) * 1000000;
+    uint64_t high = (fraction >> 32) * 1000000 + (low >> 32);
+    uint32_t micro = (uint32_t)(high >> 32);
+    uint64_t remainder = (high << 32) | (uint32_t)low; // 0.64 fixed point
+    if (remainder > 0x8000000000000000ull || (remainder == 0x8000000000000000ull && (micro & 1)))
+        micro++;
+    if (micro >= 1000000) {
+        micro -= 1000000;
+        integer++;
+    }
+    len += format_uint(buf + len, integer);
+    buf[len++] = '.';
+    for (int i = 5; i >= 0; --i) {
+        buf[len + i] = '0' + micro % 10;
+        micro /= 10;
+    }
+    len += 6;
+    buf[len] = 0;
+    return len;
+}
+
 // Modulo (as opposed to remainder), per https://stackoverflow.com/a/19288271
 int mod(int dividend, int divisor){
     int r = dividend % divisor;
@@ -202,6 +465,36 @@ uint32_t micros(void) {
     return (ms * 1000) + cycle_cnt;
 }
 
+// @brief: Returns number of microseconds since system startup as a 64-bit
+// value, which doesn't wrap after 71 minutes like micros().
+// The wraps of the millisecond tick are counted on the way, so this must
+// be called at least once every 49 days, which the idle hook does. A caller
+// that was preempted between the read of the tick and the count gets the
+// count from before the wrap that it hasn't seen.
+uint64_t micros64(void) {
+    static uint32_t last_ms = 0;
+    static uint32_t ms_wraps = 0;
+    uint32_t ms, cycle_cnt;
+    do {
+        ms = HAL_GetTick();
+        cycle_cnt = TIM_TIME_BASE->CNT;
+    } while (ms != HAL_GetTick());
+
+    uint32_t prim = __get_PRIMASK();
+    __disable_irq();
+    uint32_t wraps = ms_wraps;
+    if ((int32_t)(ms - last_ms) >= 0) {
+        if (ms < last_ms)
+            wraps = ++ms_wraps;
+        last_ms = ms;
+    } else if (ms > last_ms) {
+        --wraps; // older than the wrap that another caller has seen
+    }
+    __set_PRIMASK(prim);
+
+    return (((uint64_t)wraps << 32) | ms) * 1000 + cycle_cnt;
+}
+
 // @brief: Busy wait delay for given amount of microseconds (us)
 void delay_us(uint32_t us)
 {
@@ -6,7 +6,9 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <math.h>
 
 /**
@@ -60,6 +62,15 @@ extern "C" {
 #endif
 #define M_PI 3.14159265358979323846f
 
+// Places a variable in the 64kB core coupled memory. CCM has zero wait states
+// and no contention with DMA, but it is not accessible by DMA and it is not
+// initialized at boot.
+#define CCM_DATA __attribute__((section(".ccmram")))
+
+// Runs a function from SRAM, so that it does not stall on flash wait states
+// when the ART cache misses. The code is copied along with .data at boot.
+#define RAM_FUNC __attribute__((section(".ramfunc"), noinline))
+
 #define MACRO_MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MACRO_MIN(x, y) (((x) < (y)) ? (x) : (y))
 
@@ -95,7 +106,41 @@ static inline float fmodf_pos(float x, float y) {
 // Returns 0 on success, and -1 if the input was out of range
 int SVM(float alpha, float beta, float* tA, float* tB, float* tC);
 
+// Like SVM, but an alpha-beta vector outside of the hexagon (magnitude up to 1
+// at the vertices) is clamped onto the hexagon boundary, keeping its angle.
+// Returns 0 on success, and -1 if the input was NaN
+int SVM_overmodulation(float alpha, float beta, float* tA, float* tB, float* tC);
+
+// Order of the odd minimax polynomial that fast_atan2 and fast_atan2_octant
+// use for atan on [0, 1]: 3, 5, 7 or 9. Select it with a build flag, e.g.
+// -DFAST_ATAN2_ORDER=5. FAST_ATAN2_MAX_ERROR is the resulting worst case
+// error [rad] against atan2 (see atan2_accuracy_test in test/run_tests.cpp).
+#ifndef FAST_ATAN2_ORDER
+#define FAST_ATAN2_ORDER 7
+#endif
+#if FAST_ATAN2_ORDER == 3
+#define FAST_ATAN2_MAX_ERROR 5.0e-3f
+#elif FAST_ATAN2_ORDER == 5
+#define FAST_ATAN2_MAX_ERROR 6.2e-4f
+#elif FAST_ATAN2_ORDER == 7
+#define FAST_ATAN2_MAX_ERROR 8.5e-5f
+#elif FAST_ATAN2_ORDER == 9
+#define FAST_ATAN2_MAX_ERROR 1.5e-5f
+#else
+#error "FAST_ATAN2_ORDER must be 3, 5, 7 or 9"
+#endif
+
 float fast_atan2(float y, float x);
+// Like fast_atan2, but without divisions or branches: the ratio of the octant
+// reduction is taken with a refined reciprocal estimate. |x| and |y| must be
+// below 1e37.
+float fast_atan2_octant(float y, float x);
+
+// Computes sin(x) and cos(x) in one go, using a shared interpolated lookup table.
+// Accurate to about 1e-4. fast_sincos_init() must be called once before use.
+// Unlike our_arm_sin_f32/our_arm_cos_f32, any finite angle of moderate size is accepted.
+void fast_sincos_init(void);
+void fast_sincos(float x, float* sin_x, float* cos_x);
 float horner_fma(float x, const float *coeffs, size_t count);
 int mod(int dividend, int divisor);
 
@@ -103,7 +148,51 @@ uint32_t deadline_to_timeout(uint32_t deadline_ms);
 uint32_t timeout_to_deadline(uint32_t timeout_ms);
 int is_in_the_future(uint32_t time_ms);
 
+// Allocates from a static pool in CCM RAM. Returns NULL when the pool is exhausted.
+// There is no way to free the memory again, so this is only meant for
+// objects that live for the entire uptime.
+void* ccm_alloc(size_t size);
+size_t ccm_bytes_free(void);
+
+// Allocates a large table (such as the anti-cogging map) from the CCM pool,
+// or from a fixed 16kB pool in SRAM if CCM is exhausted, and from the heap
+// if both are. Returns NULL and counts a failure when the heap is exhausted
+// too. Like ccm_alloc(), the memory is never freed.
+void* table_alloc(size_t size);
+size_t table_pool_bytes_free(void);
+size_t table_heap_bytes_used(void);
+uint32_t table_alloc_failure_count(void);
+
+// Incremental parser for decimal numbers such as "-12", "0.5" or "1.5e-3",
+// fed one character at a time as the bytes arrive.
+typedef struct {
+    uint32_t mantissa;    // up to 9 significant digits
+    int32_t exponent;     // decimal exponent of the mantissa
+    int32_t exp_digits;   // value after the 'e'
+    uint8_t state;
+    bool negative;
+    bool exp_negative;
+    bool truncated;       // more than 9 significant digits
+} NumberToken_t;
+
+void number_token_reset(NumberToken_t* token);
+// Returns false if c cannot continue the number
+bool number_token_push(NumberToken_t* token, char c);
+// Returns false if the characters so far are not a complete number
+bool number_token_value(const NumberToken_t* token, float* value);
+// Returns false unless the number is a plain unsigned integer
+bool number_token_uint(const NumberToken_t* token, uint32_t* value);
+
+// Formats a float like printf("%f") (6 decimals) with an integer conversion
+// instead of the printf machinery. buf must hold FORMAT_FLOAT_MAX_LENGTH
+// bytes. Returns the length, without the terminating null.
+#define FORMAT_FLOAT_MAX_LENGTH 48
+size_t format_float(char* buf, float value);
+// Formats an unsigned integer in decimal. buf must hold 11 bytes.
+size_t format_uint(char* buf, uint32_t value);
+
 uint32_t micros(void);
+uint64_t micros64(void);
 void delay_us(uint32_t us);
 
 float our_arm_sin_f32(float x);
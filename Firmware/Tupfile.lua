@@ -64,6 +64,15 @@ else
     error("unknown UART protocol "..tup.getconfig("UART_PROTOCOL"))
 end
 
+if tup.getconfig("UART_RX_BUFFER_SIZE") ~= "" then
+    FLAGS += "-DUART_RX_BUFFER_SIZE="..tup.getconfig("UART_RX_BUFFER_SIZE")
+end
+
+-- Math settings
+if tup.getconfig("FAST_ATAN2_ORDER") ~= "" then
+    FLAGS += "-DFAST_ATAN2_ORDER="..tup.getconfig("FAST_ATAN2_ORDER")
+end
+
 -- GPIO settings
 if tup.getconfig("STEP_DIR") == "y" then
     if tup.getconfig("UART_PROTOCOL") == "none" then
@@ -158,7 +167,19 @@ build{
         'MotorControl/encoder.cpp',
         'MotorControl/controller.cpp',
         'MotorControl/sensorless_estimator.cpp',
+        'MotorControl/fusion_estimator.cpp',
+        'MotorControl/freq_response.cpp',
         'MotorControl/trapTraj.cpp',
+        'MotorControl/scurveTraj.cpp',
+        'MotorControl/profiler.cpp',
+        'MotorControl/cycle_log.cpp',
+        'MotorControl/oscilloscope.cpp',
+        'MotorControl/input_recorder.cpp',
+        'MotorControl/trace.cpp',
+        'MotorControl/logger.cpp',
+        'MotorControl/cpu_load.cpp',
+        'MotorControl/benchmark.cpp',
+        'MotorControl/gcode.cpp',
         'MotorControl/main.cpp',
         'communication/communication.cpp',
         'communication/ascii_protocol.cpp',
@@ -176,3 +197,9 @@ build{
         '.'
     }
 }
+
+-- report which memory the hot control loop code and data ended up in
+tup.frule{
+    inputs={'build/ODriveFirmware.map'},
+    command='python ../tools/memory_report.py %f'
+}
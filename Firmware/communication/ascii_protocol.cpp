@@ -1,8 +1,17 @@
 /*
 * The ASCII protocol is a simpler, human readable alternative to the main native
 * protocol.
-* In the future this protocol might be extended to support selected GCode commands.
+* It also accepts a subset of G-code (G0, G1, G4, G90 and G91) for the path
+* of axis0 (X) and axis1 (Y), see Gcode.
 * For a list of supported commands see doc/ascii-protocol.md
+*
+* Binary frames for the most frequent commands can be mixed with the text
+* lines. They start with BINARY_FRAME_START, which is not a valid ASCII
+* character, and are protected by the same CRC16 as the native protocol:
+*   BINARY_FRAME_START | cmd | payload | CRC16 over cmd and payload (big endian)
+* The upper nibble of cmd is the opcode, the lower 3 bits are the axis.
+* If BINARY_FLAG_FEEDBACK is set, the device responds with a BINARY_OP_FEEDBACK
+* frame after executing the command. Floats are little endian.
 */
 
 /* Includes ------------------------------------------------------------------*/
@@ -13,6 +22,7 @@
 #include "ascii_protocol.hpp"
 #include <utils.h>
 #include <fibre/cpp_utils.hpp>
+#include <fibre/crc.hpp>
 
 /* Private macros ------------------------------------------------------------*/
 /* Private typedef -----------------------------------------------------------*/
@@ -24,72 +34,268 @@
 #define TO_STR_INNER(s) #s
 #define TO_STR(s) TO_STR_INNER(s)
 
+#define BINARY_FRAME_START 0xA5
+#define BINARY_OP_POSITION 0x10 //<! payload: float pos, float vel_ff, float current_ff
+#define BINARY_OP_VELOCITY 0x20 //<! payload: float vel, float current_ff
+#define BINARY_OP_CURRENT  0x30 //<! payload: float current
+#define BINARY_OP_FEEDBACK 0x40 //<! no payload, response: float pos_estimate, vel_estimate, Iq_measured for each axis
+#define BINARY_FLAG_FEEDBACK 0x08
+#define BINARY_AXIS_MASK 0x07
+
 /* Private variables ---------------------------------------------------------*/
 /* Private function prototypes -----------------------------------------------*/
 /* Function implementations --------------------------------------------------*/
 
-// @brief Sends a line on the specified output.
-template<typename ... TArgs>
-void respond(StreamSink& output, bool include_checksum, const char * fmt, TArgs&& ... args) {
-    char response[64];
-    size_t len = snprintf(response, sizeof(response), fmt, std::forward<TArgs>(args)...);
-    output.process_bytes((uint8_t*)response, len, nullptr); // TODO: use process_all instead
+// @brief Appends the checksum if requested and the line ending to a line of
+// len characters and sends it in one piece. buf must have room for 6 more bytes.
+static void send_line(StreamSink& output, bool include_checksum, char* buf, size_t len) {
     if (include_checksum) {
         uint8_t checksum = 0;
         for (size_t i = 0; i < len; ++i)
-            checksum ^= response[i];
-        len = snprintf(response, sizeof(response), "*%u", checksum);
-        output.process_bytes((uint8_t*)response, len, nullptr);
+            checksum ^= buf[i];
+        buf[len++] = '*';
+        len += format_uint(buf + len, checksum);
     }
-    output.process_bytes((const uint8_t*)"\r\n", 2, nullptr);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    output.process_bytes((uint8_t*)buf, len, nullptr); // TODO: use process_all instead
+}
+
+// @brief Sends a line on the specified output.
+template<typename ... TArgs>
+void respond(StreamSink& output, bool include_checksum, const char * fmt, TArgs&& ... args) {
+    char response[64 + 6];
+    int len = snprintf(response, 64, fmt, std::forward<TArgs>(args)...);
+    send_line(output, include_checksum, response, std::min(std::max(len, 0), 63));
 }
 
+// @brief Responds with the estimated position, velocity and Iq of an axis.
+// This is the reply to the frequent commands, so it avoids snprintf.
+static void respond_feedback(StreamSink& output, bool include_checksum, unsigned motor_number) {
+    Axis& axis = *axes[motor_number];
+    char response[3 * FORMAT_FLOAT_MAX_LENGTH + 6];
+    size_t len = format_float(response, axis.encoder_.pos_estimate_);
+    response[len++] = ' ';
+    len += format_float(response + len, axis.encoder_.vel_estimate_);
+    response[len++] = ' ';
+    len += format_float(response + len, axis.motor_.current_control_.Iq_measured);
+    send_line(output, include_checksum, response, len);
+}
+
+// @brief The words of a G-code line: a number for each letter that occurs
+struct GcodeWords_t {
+    uint32_t given = 0; // bit mask of the letters A to Z
+    float values[26];
 
-// @brief Executes an ASCII protocol command
-// @param buffer buffer of ASCII encoded characters
-// @param len size of the buffer
-void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink& response_channel) {
-    static_assert(sizeof(char) == sizeof(uint8_t));
+    bool has(char letter) const { return given & (1UL << (letter - 'A')); }
+    float operator[](char letter) const { return values[letter - 'A']; }
+};
 
-    // scan line to find beginning of checksum and prune comment
-    uint8_t checksum = 0;
-    size_t checksum_start = SIZE_MAX;
-    for (size_t i = 0; i < len; ++i) {
-        if (buffer[i] == ';') { // ';' is the comment start char
-            len = i;
-            break;
+// @brief Splits a G-code line into words such as "G1" or "X-2.5". The words
+// may be separated by spaces, each letter may occur once.
+// Returns false if a word is malformed.
+static bool parse_gcode_words(const char* line, GcodeWords_t& words) {
+    const char* c = line;
+    for (;;) {
+        while (*c == ' ' || *c == '\t')
+            ++c;
+        if (!*c)
+            return true;
+        char letter = (*c >= 'a' && *c <= 'z') ? (char)(*c - 'a' + 'A') : *c;
+        if (letter < 'A' || letter > 'Z' || words.has(letter))
+            return false;
+        ++c;
+        NumberToken_t token;
+        number_token_reset(&token);
+        while (*c && number_token_push(&token, *c))
+            ++c;
+        float value;
+        if (!number_token_value(&token, &value))
+            return false;
+        words.values[letter - 'A'] = value;
+        words.given |= 1UL << (letter - 'A');
+    }
+}
+
+// @brief Executes one line of G-code. Every accepted line is answered with
+// "ok" and the number of free slots in the path buffer. A move that doesn't
+// fit is answered with "full" and dropped, the host sends it again later.
+static void execute_gcode(const char* line, StreamSink& response_channel, bool use_checksum) {
+    GcodeWords_t words;
+    if (!parse_gcode_words(line, words) || !words.has('G')) {
+        respond(response_channel, use_checksum, "invalid command format");
+        return;
+    }
+    const uint32_t supported = (1UL << ('G' - 'A')) | (1UL << ('X' - 'A')) | (1UL << ('Y' - 'A'))
+            | (1UL << ('F' - 'A')) | (1UL << ('P' - 'A')) | (1UL << ('S' - 'A')) | (1UL << ('N' - 'A'));
+    float g = words['G'];
+    bool motion = g == 0.0f || g == 1.0f || g == 4.0f;
+    if ((words.given & ~supported) || !(motion || g == 90.0f || g == 91.0f)) {
+        respond(response_channel, use_checksum, "unsupported G-code");
+        return;
+    }
+    if (motion && gcode.free_slots_ == 0) {
+        respond(response_channel, use_checksum, "full");
+        return;
+    }
+    if (words.has('F')) {
+        if (!(words['F'] > 0.0f)) {
+            respond(response_channel, use_checksum, "invalid command format");
+            return;
         }
-        if (checksum_start > i) {
-            if (buffer[i] == '*') {
-                checksum_start = i + 1;
-            } else {
-                checksum ^= buffer[i];
+        gcode.set_feed_rate(words['F']);
+    }
+
+    bool ok = true;
+    if (g == 0.0f || g == 1.0f) {
+        float values[AXIS_COUNT] = { words['X'], words['Y'] };
+        bool given[AXIS_COUNT] = { words.has('X'), words.has('Y') };
+        ok = gcode.line(values, given, g == 0.0f);
+    } else if (g == 4.0f) {
+        ok = gcode.dwell(words.has('P') ? 0.001f * words['P'] : words.has('S') ? words['S'] : 0.0f);
+    } else {
+        gcode.set_absolute(g == 90.0f);
+    }
+    if (ok)
+        respond(response_channel, use_checksum, "ok %u", (unsigned)gcode.free_slots_);
+    else
+        respond(response_channel, use_checksum, "move rejected");
+}
+
+// @brief Incremental parser for one line of the ASCII protocol.
+// The bytes are consumed as they arrive: comments are dropped, the checksum
+// is accumulated and the numeric arguments are converted right away. When
+// the line ends, the motion commands execute from the converted arguments
+// without a second pass over the line or sscanf. The text of the line is
+// kept for the commands that take property names.
+class AsciiLineParser {
+public:
+    static constexpr size_t kMaxArgs = 8;
+    static constexpr uint32_t kNotUint = UINT32_MAX;
+
+    void reset() {
+        len_ = 0;
+        section_ = SECTION_COMMAND;
+        checksum_ = 0;
+        received_checksum_ = 0;
+        checksum_chars_ = 0;
+        checksum_digits_ = 0;
+        in_token_ = false;
+        args_done_ = false;
+        num_args_ = 0;
+    }
+
+    // @brief Consumes one character of the line, without the line ending.
+    // Returns false if the line is too long.
+    bool push(uint8_t c) {
+        if (section_ == SECTION_COMMENT)
+            return true;
+        if (c == ';') { // ';' is the comment start char
+            finish_token();
+            section_ = SECTION_COMMENT;
+            return true;
+        }
+        if (section_ == SECTION_CHECKSUM) {
+            if (checksum_chars_++ == checksum_digits_ && c >= '0' && c <= '9' && checksum_digits_ < 4) {
+                received_checksum_ = 10 * received_checksum_ + (c - '0');
+                checksum_digits_++;
+            }
+            return true;
+        }
+        if (c == '*') {
+            finish_token();
+            section_ = SECTION_CHECKSUM;
+            return true;
+        }
+
+        if (len_ >= MAX_LINE_LENGTH)
+            return false;
+        line_[len_++] = c;
+        checksum_ ^= c;
+        if (len_ == 1)
+            return true; // the command character
+
+        // Tokenize the arguments
+        if (c == ' ' || c == '\t') {
+            finish_token();
+        } else if (!args_done_) {
+            if (!in_token_) {
+                number_token_reset(&token_);
+                in_token_ = true;
+            }
+            if (!number_token_push(&token_, c)) {
+                in_token_ = false;
+                args_done_ = true; // like sscanf, stop at the first invalid argument
             }
         }
+        return true;
     }
 
-    // copy everything into a local buffer so we can insert null-termination
-    char cmd[MAX_LINE_LENGTH + 1];
-    if (len > MAX_LINE_LENGTH) len = MAX_LINE_LENGTH;
-    memcpy(cmd, buffer, len);
+    void execute(StreamSink& response_channel);
 
-    // optional checksum validation
-    bool use_checksum = (checksum_start < len);
-    if (use_checksum) {
-        unsigned int received_checksum;
-        sscanf((const char *)cmd + checksum_start, "%u", &received_checksum);
-        if (received_checksum != checksum)
+private:
+    void finish_token() {
+        if (!in_token_)
             return;
-        len = checksum_start - 1; // prune checksum and asterisk
+        in_token_ = false;
+        float value;
+        if (num_args_ < kMaxArgs && number_token_value(&token_, &value)) {
+            args_[num_args_] = value;
+            if (!number_token_uint(&token_, &uint_args_[num_args_]))
+                uint_args_[num_args_] = kNotUint;
+            num_args_++;
+        } else {
+            args_done_ = true;
+        }
     }
 
-    cmd[len] = 0; // null-terminate
+    enum Section_t {
+        SECTION_COMMAND,
+        SECTION_CHECKSUM, // after '*'
+        SECTION_COMMENT,  // after ';'
+    };
+
+    char line_[MAX_LINE_LENGTH + 1];
+    size_t len_ = 0;
+    Section_t section_ = SECTION_COMMAND;
+    uint8_t checksum_ = 0;            // XOR of the characters before the checksum
+    uint32_t received_checksum_ = 0;
+    size_t checksum_chars_ = 0;       // characters after '*'
+    size_t checksum_digits_ = 0;      // leading digits among them
+    NumberToken_t token_;
+    bool in_token_ = false;
+    bool args_done_ = false;          // an argument was invalid, the rest is ignored
+    size_t num_args_ = 0;
+    float args_[kMaxArgs] = { 0.0f };
+    uint32_t uint_args_[kMaxArgs] = { 0 }; // kNotUint unless the argument is an unsigned integer
+};
+
+// @brief Validates the checksum and executes the line
+void AsciiLineParser::execute(StreamSink& response_channel) {
+    finish_token();
+
+    // optional checksum validation
+    bool use_checksum = (checksum_chars_ > 0);
+    if (use_checksum && (checksum_digits_ == 0 || received_checksum_ != checksum_))
+        return;
+
+    line_[len_] = 0; // null-terminate
+    const char* cmd = line_;
+
+    // Number of leading arguments that are valid, like the return value of
+    // sscanf with "%u" for the axis numbers and "%f" for the rest
+    int numscan = (int)num_args_;
+    if (numscan > 0 && uint_args_[0] == kNotUint)
+        numscan = 0;
+    if (cmd[0] == 'u' && numscan > 4 && uint_args_[4] == kNotUint)
+        numscan = 4;
+    float* args = args_;
 
     // check incoming packet type
     if (cmd[0] == 'p') { // position control
-        unsigned motor_number;
-        float pos_setpoint, vel_feed_forward, current_feed_forward;
-        int numscan = sscanf(cmd, "p %u %f %f %f", &motor_number, &pos_setpoint, &vel_feed_forward, &current_feed_forward);
+        unsigned motor_number = uint_args_[0];
+        float pos_setpoint = args[1];
+        float vel_feed_forward = args[2], current_feed_forward = args[3];
         if (numscan < 2) {
             respond(response_channel, use_checksum, "invalid command format");
         } else if (motor_number >= AXIS_COUNT) {
@@ -103,9 +309,8 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
         }
 
     } else if (cmd[0] == 'v') { // velocity control
-        unsigned motor_number;
-        float vel_setpoint, current_feed_forward;
-        int numscan = sscanf(cmd, "v %u %f %f", &motor_number, &vel_setpoint, &current_feed_forward);
+        unsigned motor_number = uint_args_[0];
+        float vel_setpoint = args[1], current_feed_forward = args[2];
         if (numscan < 2) {
             respond(response_channel, use_checksum, "invalid command format");
         } else if (motor_number >= AXIS_COUNT) {
@@ -117,9 +322,8 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
         }
 
     } else if (cmd[0] == 'c') { // current control
-        unsigned motor_number;
-        float current_setpoint;
-        int numscan = sscanf(cmd, "c %u %f", &motor_number, &current_setpoint);
+        unsigned motor_number = uint_args_[0];
+        float current_setpoint = args[1];
         if (numscan < 2) {
             respond(response_channel, use_checksum, "invalid command format");
         } else if (motor_number >= AXIS_COUNT) {
@@ -129,9 +333,8 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
         }
 
     } else if (cmd[0] == 't') { // trapezoidal trajectory
-        unsigned motor_number;
-        float goal_point;
-        int numscan = sscanf(cmd, "t %u %f", &motor_number, &goal_point);
+        unsigned motor_number = uint_args_[0];
+        float goal_point = args[1];
         if (numscan < 2) {
             respond(response_channel, use_checksum, "invalid command format");
         } else if (motor_number >= AXIS_COUNT) {
@@ -140,6 +343,71 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
             axes[motor_number]->controller_.move_to_pos(goal_point);
         }
 
+    } else if (cmd[0] == 'q') { // queued trajectory
+        unsigned motor_number = uint_args_[0];
+        float goal_point = args[1];
+        if (numscan < 2) {
+            respond(response_channel, use_checksum, "invalid command format");
+        } else if (motor_number >= AXIS_COUNT) {
+            respond(response_channel, use_checksum, "invalid motor %u", motor_number);
+        } else if (!axes[motor_number]->controller_.queue_move(goal_point)) {
+            respond(response_channel, use_checksum, "move queue full");
+        }
+
+    } else if (cmd[0] == 's') { // streamed setpoint
+        unsigned motor_number = uint_args_[0];
+        float t = args[1], pos = args[2], vel = args[3], current = args[4];
+        if (numscan < 3) {
+            respond(response_channel, use_checksum, "invalid command format");
+        } else if (motor_number >= AXIS_COUNT) {
+            respond(response_channel, use_checksum, "invalid motor %u", motor_number);
+        } else {
+            if (numscan < 4)
+                vel = 0.0f;
+            if (numscan < 5)
+                current = 0.0f;
+            Controller& controller = axes[motor_number]->controller_;
+            if (controller.config_.control_mode != Controller::CTRL_MODE_STREAMING_CONTROL)
+                controller.start_stream();
+            if (!controller.push_stream_sample(t, pos, vel, current))
+                respond(response_channel, use_checksum, "stream sample rejected");
+        }
+
+    } else if (cmd[0] == 'f') { // feedback
+        unsigned motor_number = uint_args_[0];
+        if (numscan < 1) {
+            respond(response_channel, use_checksum, "invalid command format");
+        } else if (motor_number >= AXIS_COUNT) {
+            respond(response_channel, use_checksum, "invalid motor %u", motor_number);
+        } else {
+            respond_feedback(response_channel, use_checksum, motor_number);
+        }
+
+    } else if (cmd[0] == 'u') { // position update with feedback, for one or two axes
+        unsigned motor_number[2] = { uint_args_[0], uint_args_[4] };
+        float pos_setpoint[2] = { args[1], args[5] };
+        float vel_feed_forward[2] = { args[2], args[6] }, current_feed_forward[2] = { args[3], args[7] };
+        for (size_t i = 0; i < 2; ++i) {
+            if (numscan < (int)(4 * i + 3))
+                vel_feed_forward[i] = 0.0f;
+            if (numscan < (int)(4 * i + 4))
+                current_feed_forward[i] = 0.0f;
+        }
+        size_t n_axes = numscan >= 6 ? 2 : 1;
+        if (numscan < 2 || numscan == 5) {
+            respond(response_channel, use_checksum, "invalid command format");
+        } else if (motor_number[0] >= AXIS_COUNT || (n_axes == 2 && motor_number[1] >= AXIS_COUNT)) {
+            respond(response_channel, use_checksum, "invalid motor");
+        } else {
+            for (size_t i = 0; i < n_axes; ++i)
+                axes[motor_number[i]]->controller_.set_pos_setpoint(pos_setpoint[i], vel_feed_forward[i], current_feed_forward[i]);
+            for (size_t i = 0; i < n_axes; ++i)
+                respond_feedback(response_channel, use_checksum, motor_number[i]);
+        }
+
+    } else if (cmd[0] == 'G' || cmd[0] == 'g' || cmd[0] == 'N' || cmd[0] == 'n') { // G-code, maybe with a line number
+        execute_gcode(cmd, response_channel, use_checksum);
+
     } else if (cmd[0] == 'h') {  // Help
         respond(response_channel, use_checksum, "Please see documentation for more details");
         respond(response_channel, use_checksum, "");
@@ -147,6 +415,9 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
         respond(response_channel, use_checksum, "Position: p axis pos vel-ff I-ff");
         respond(response_channel, use_checksum, "Velocity: v axis vel I-ff");
         respond(response_channel, use_checksum, "Current: c axis I");
+        respond(response_channel, use_checksum, "Feedback: f axis");
+        respond(response_channel, use_checksum, "Position with feedback: u axis pos vel-ff I-ff [axis pos vel-ff I-ff]");
+        respond(response_channel, use_checksum, "G-code: G0/G1 X Y F, G4 P|S, G90, G91");
         respond(response_channel, use_checksum, "");
         respond(response_channel, use_checksum, "Properties start at odrive root, such as axis0.requested_state");
         respond(response_channel, use_checksum, "Read: r property");
@@ -201,30 +472,123 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
     }
 }
 
-void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel) {
-    static uint8_t parse_buffer[MAX_LINE_LENGTH];
-    static bool read_active = true;
-    static uint32_t parse_buffer_idx = 0;
+// @brief Returns the payload length of a binary command or -1 if the opcode is unknown.
+static int binary_payload_length(uint8_t cmd) {
+    switch (cmd & 0xf0) {
+        case BINARY_OP_POSITION: return 3 * sizeof(float);
+        case BINARY_OP_VELOCITY: return 2 * sizeof(float);
+        case BINARY_OP_CURRENT: return sizeof(float);
+        case BINARY_OP_FEEDBACK: return 0;
+        default: return -1;
+    }
+}
 
-    while (len--) {
-        // if the line becomes too long, reset buffer and wait for the next line
-        if (parse_buffer_idx >= MAX_LINE_LENGTH) {
-            read_active = false;
-            parse_buffer_idx = 0;
-        }
+static void send_binary_frame(StreamSink& output, uint8_t cmd, const uint8_t* payload, size_t len) {
+    uint8_t header[] = { BINARY_FRAME_START, cmd };
+    uint16_t crc16 = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, &header[1], 1);
+    crc16 = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(crc16, payload, len);
+    uint8_t trailer[] = { (uint8_t)(crc16 >> 8), (uint8_t)crc16 };
+    output.process_bytes(header, sizeof(header), nullptr);
+    output.process_bytes(payload, len, nullptr);
+    output.process_bytes(trailer, sizeof(trailer), nullptr);
+}
+
+// @brief Executes a binary command
+// @param frame the command byte followed by the payload, without start byte and CRC
+// @param payload_length length of the payload, as validated by the parser
+static void ASCII_protocol_process_binary(const uint8_t* frame, size_t payload_length, StreamSink& response_channel) {
+    uint8_t cmd = frame[0];
+    unsigned motor_number = cmd & BINARY_AXIS_MASK;
+    float args[3];
+    memcpy(args, frame + 1, std::min(payload_length, sizeof(args)));
+
+    switch (cmd & 0xf0) {
+        case BINARY_OP_POSITION:
+        case BINARY_OP_VELOCITY:
+        case BINARY_OP_CURRENT: {
+            if (motor_number >= AXIS_COUNT)
+                return;
+            Controller& controller = axes[motor_number]->controller_;
+            if ((cmd & 0xf0) == BINARY_OP_POSITION)
+                controller.set_pos_setpoint(args[0], args[1], args[2]);
+            else if ((cmd & 0xf0) == BINARY_OP_VELOCITY)
+                controller.set_vel_setpoint(args[0], args[1]);
+            else
+                controller.set_current_setpoint(args[0]);
+            if (!(cmd & BINARY_FLAG_FEEDBACK))
+                return;
+        } break;
+        case BINARY_OP_FEEDBACK: break;
+        default: return;
+    }
+
+    float feedback[3 * AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        feedback[3 * i + 0] = axes[i]->encoder_.pos_estimate_;
+        feedback[3 * i + 1] = axes[i]->encoder_.vel_estimate_;
+        feedback[3 * i + 2] = axes[i]->motor_.current_control_.Iq_measured;
+    }
+    send_binary_frame(response_channel, BINARY_OP_FEEDBACK, (const uint8_t*)feedback, sizeof(feedback));
+}
+
+// @brief The state of the ASCII protocol on one channel. The channels are
+// served by different threads, so each one needs its own.
+struct AsciiStream_t {
+    AsciiLineParser line_parser;
+    uint8_t binary_frame[1 + 3 * sizeof(float) + 2];
+    bool read_active = true;
+    bool line_empty = true;
+    uint32_t binary_frame_idx = 0;
+    uint32_t binary_frame_length = 0; // nonzero while a binary frame is being received
+};
+static AsciiStream_t ascii_streams[ASCII_CHANNEL_COUNT];
+
+void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel, AsciiChannel_t channel) {
+    AsciiStream_t& stream = ascii_streams[channel];
 
+    while (len--) {
         // Fetch the next char
         uint8_t c = *(buffer++);
+
+        // Binary frames may contain line endings, so they are handled first
+        if (stream.binary_frame_length) {
+            stream.binary_frame[stream.binary_frame_idx++] = c;
+            if (stream.binary_frame_idx == 1) {
+                int payload_length = binary_payload_length(c);
+                if (payload_length < 0) {
+                    stream.binary_frame_length = 0; // not a binary frame, drop the line
+                    stream.binary_frame_idx = 0;
+                    stream.read_active = false;
+                    stream.line_empty = false;
+                    continue;
+                }
+                stream.binary_frame_length = 1 + payload_length + 2;
+            }
+            if (stream.binary_frame_idx == stream.binary_frame_length) {
+                if (calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, stream.binary_frame, stream.binary_frame_idx) == 0)
+                    ASCII_protocol_process_binary(stream.binary_frame, stream.binary_frame_length - 3, response_channel);
+                stream.binary_frame_length = 0;
+                stream.binary_frame_idx = 0;
+            }
+            continue;
+        }
+        if (c == BINARY_FRAME_START && stream.read_active && stream.line_empty) {
+            stream.binary_frame_length = 1; // length is known once the command byte arrives
+            continue;
+        }
+
         bool is_end_of_line = (c == '\r' || c == '\n' || c == '!');
         if (is_end_of_line) {
-            if (read_active)
-                ASCII_protocol_process_line(parse_buffer, parse_buffer_idx, response_channel);
-            parse_buffer_idx = 0;
-            read_active = true;
+            if (stream.read_active)
+                stream.line_parser.execute(response_channel);
+            stream.line_parser.reset();
+            stream.line_empty = true;
+            stream.read_active = true;
         } else {
-            if (read_active) {
-                parse_buffer[parse_buffer_idx++] = c;
-            }
+            stream.line_empty = false;
+            // if the line becomes too long, drop it and wait for the next line
+            if (stream.read_active && !stream.line_parser.push(c))
+                stream.read_active = false;
         }
     }
 }
@@ -10,13 +10,20 @@
 #include <stdbool.h>
 
 /* Exported types ------------------------------------------------------------*/
+// Each channel keeps its own line, so that they can be served concurrently
+enum AsciiChannel_t {
+    ASCII_CHANNEL_UART,
+    ASCII_CHANNEL_USB,
+    ASCII_CHANNEL_COUNT
+};
+
 /* Exported constants --------------------------------------------------------*/
 /* Exported variables --------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions --------------------------------------------------------*/
 
 /* Exported functions --------------------------------------------------------*/
-void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel);
+void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel, AsciiChannel_t channel);
 
 
 #endif /* __ASCII_PROTOCOL_H */
@@ -9,6 +9,7 @@
 #include "interface_i2c.h"
 
 #include "odrive_main.h"
+#include "nvm_config.hpp"
 #include "freertos_vars.h"
 #include "utils.h"
 
@@ -64,6 +65,9 @@ const uint8_t fw_version_revision = FW_VERSION_REVISION;
 const uint8_t fw_version_unreleased = FW_VERSION_UNRELEASED; // 0 for official releases, 1 otherwise
 
 osThreadId comm_thread;
+osThreadId log_thread;
+static uint32_t comm_thread_stack[STACK_SIZE_COMMUNICATION];
+static osStaticThreadDef_t comm_thread_tcb;
 volatile bool endpoint_list_valid = false;
 
 static uint32_t test_property = 0;
@@ -84,7 +88,8 @@ void init_communication(void) {
     printf("hi!\r\n");
 
     // Start command handling thread
-    osThreadDef(task_cmd_parse, communication_task, osPriorityNormal, 0, 5000 /* in 32-bit words */); // TODO: fix stack issues
+    osThreadStaticDef(task_cmd_parse, communication_task, THREAD_PRIO_COMMS, 0, STACK_SIZE_COMMUNICATION,
+            comm_thread_stack, &comm_thread_tcb);
     comm_thread = osThreadCreate(osThread(task_cmd_parse), NULL);
 
     while (!endpoint_list_valid)
@@ -92,10 +97,6 @@ void init_communication(void) {
 }
 
 
-float oscilloscope[OSCILLOSCOPE_SIZE] = {0};
-size_t oscilloscope_pos = 0;
-
-
 static CAN_context can1_ctx;
 
 // Helper class because the protocol library doesn't yet
@@ -104,10 +105,14 @@ static CAN_context can1_ctx;
 class StaticFunctions {
 public:
     void save_configuration_helper() { save_configuration(); }
+    bool save_configuration_async_helper() { return save_configuration_async(); }
     void erase_configuration_helper() { erase_configuration(); }
     void NVIC_SystemReset_helper() { NVIC_SystemReset(); }
     void enter_dfu_mode_helper() { enter_dfu_mode(); }
-    float get_oscilloscope_val(uint32_t index) { return oscilloscope[index]; }
+    void reset_link_stats_helper() { usb_reset_stats(); uart_reset_stats(); i2c_reset_stats(); }
+    bool move_to_pos_synced_helper(float goal_axis0, float goal_axis1) { return move_to_pos_synced(goal_axis0, goal_axis1); }
+    uint64_t get_time_us() { return micros64(); }
+    float get_oscilloscope_val(uint32_t index) { return index < OSCILLOSCOPE_SIZE ? oscilloscope.buffer_[index] : 0.0f; }
     float get_adc_voltage_(uint32_t gpio) { return get_adc_voltage(get_gpio_port_by_pin(gpio), get_gpio_pin_by_pin(gpio)); }
     int32_t test_function(int32_t delta) { static int cnt = 0; return cnt += delta; }
 } static_functions;
@@ -115,9 +120,49 @@ public:
 // When adding new functions/variables to the protocol, be careful not to
 // blow the communication stack. You can check comm_stack_info to see
 // how much headroom you have.
+// The per-axis entries, for use with FOR_EACH_AXIS (see board_config_v3.h)
+#define AXIS_OBJECT(i, axes) make_protocol_object("axis" #i, axes[i]->make_protocol_definitions()),
+#define AXIS_STACK_SPACE(i, stats) make_protocol_ro_property("min_stack_space_axis" #i, &stats.min_stack_space_axes[i]),
+#define AXIS_THREAD_PRIORITY(i, priorities) make_protocol_ro_property("thread_axis" #i, &priorities.thread_axes[i]),
+
+// The board configuration, on its own so that board_config can be migrated
+// before the tree is published (see for_each_board_config_field)
+static inline auto make_board_config_definitions() {
+    return make_protocol_member_list(
+        make_protocol_property("brake_resistance", &board_config.brake_resistance),
+        // TODO: changing this currently requires a reboot - fix this
+        make_protocol_property("enable_uart", &board_config.enable_uart),
+        make_protocol_property("uart_baudrate", &board_config.uart_baudrate), // requires a reboot
+        make_protocol_property("enable_i2c_instead_of_can" , &board_config.enable_i2c_instead_of_can), // requires a reboot
+        make_protocol_property("enable_ascii_protocol_on_usb", &board_config.enable_ascii_protocol_on_usb),
+        make_protocol_property("dc_bus_undervoltage_trip_level", &board_config.dc_bus_undervoltage_trip_level),
+        make_protocol_property("dc_bus_overvoltage_trip_level", &board_config.dc_bus_overvoltage_trip_level),
+        make_protocol_property("vbus_filter_tau", &board_config.vbus_filter_tau),
+        make_protocol_property("vbus_fast_filter_tau", &board_config.vbus_fast_filter_tau),
+        make_protocol_property("pwm_period_clocks", &board_config.pwm_period_clocks), // requires a reboot
+        make_protocol_property("pwm_phase_offset", &board_config.pwm_phase_offset), // requires a reboot
+        make_protocol_property("enable_dual_axis_isr", &board_config.enable_dual_axis_isr),
+        make_protocol_property("current_oversampling", &board_config.current_oversampling), // requires a reboot
+        make_protocol_property("enable_vbus_regulation", &board_config.enable_vbus_regulation),
+        make_protocol_property("vbus_regulation_setpoint", &board_config.vbus_regulation_setpoint),
+        make_protocol_property("vbus_regulation_gain", &board_config.vbus_regulation_gain),
+        make_protocol_property("enable_dc_bus_limit", &board_config.enable_dc_bus_limit),
+        make_protocol_property("dc_bus_current_limit", &board_config.dc_bus_current_limit),
+        make_protocol_property("dc_bus_power_limit", &board_config.dc_bus_power_limit),
+        make_protocol_property("fast_boot", &board_config.fast_boot),
+#if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
+        make_protocol_object("gpio1_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[0])),
+        make_protocol_object("gpio2_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[1])),
+        make_protocol_object("gpio3_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[2])),
+#endif
+        make_protocol_object("gpio4_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[3]))
+    );
+}
+
 static inline auto make_obj_tree() {
     return make_protocol_member_list(
         make_protocol_ro_property("vbus_voltage", &vbus_voltage),
+        make_protocol_ro_property("vbus_voltage_filtered", &vbus_voltage_filtered),
         make_protocol_ro_property("serial_number", &serial_number),
         make_protocol_ro_property("hw_version_major", &hw_version_major),
         make_protocol_ro_property("hw_version_minor", &hw_version_minor),
@@ -127,60 +172,113 @@ static inline auto make_obj_tree() {
         make_protocol_ro_property("fw_version_revision", &fw_version_revision),
         make_protocol_ro_property("fw_version_unreleased", &fw_version_unreleased),
         make_protocol_ro_property("user_config_loaded", const_cast<const bool *>(&user_config_loaded_)),
+        make_protocol_ro_property("config_save_state", const_cast<const ConfigSaveState_t *>(&config_save_state_)),
+        make_protocol_ro_property("config_migrated", &config_migrated_),
         make_protocol_ro_property("brake_resistor_armed", &brake_resistor_armed),
+        make_protocol_ro_property("brake_power", &brake_power),
+        make_protocol_property("brake_energy", &brake_energy),
+        make_protocol_ro_property("regen_current_lim", &regen_current_lim),
+        make_protocol_ro_property("current_meas_hz", &current_meas_hz),
+        make_protocol_object("usb_telemetry",
+            make_protocol_property("enabled", &usb_telemetry_.enabled),
+            make_protocol_ro_property("frame_cnt", &usb_telemetry_.frame_cnt),
+            make_protocol_ro_property("skipped_cnt", &usb_telemetry_.skipped_cnt)
+        ),
         make_protocol_object("system_stats",
             make_protocol_ro_property("uptime", &system_stats_.uptime),
             make_protocol_ro_property("min_heap_space", &system_stats_.min_heap_space),
-            make_protocol_ro_property("min_stack_space_axis0", &system_stats_.min_stack_space_axis0),
-            make_protocol_ro_property("min_stack_space_axis1", &system_stats_.min_stack_space_axis1),
+            FOR_EACH_AXIS(AXIS_STACK_SPACE, system_stats_)
             make_protocol_ro_property("min_stack_space_comms", &system_stats_.min_stack_space_comms),
             make_protocol_ro_property("min_stack_space_usb", &system_stats_.min_stack_space_usb),
+            make_protocol_ro_property("min_stack_space_usb_cdc", &system_stats_.min_stack_space_usb_cdc),
             make_protocol_ro_property("min_stack_space_uart", &system_stats_.min_stack_space_uart),
             make_protocol_ro_property("min_stack_space_usb_irq", &system_stats_.min_stack_space_usb_irq),
             make_protocol_ro_property("min_stack_space_startup", &system_stats_.min_stack_space_startup),
+            make_protocol_ro_property("min_stack_space_log", &system_stats_.min_stack_space_log),
+            make_protocol_ro_property("total_stack_space", &system_stats_.total_stack_space),
+            make_protocol_ro_property("ccm_pool_free", &system_stats_.ccm_pool_free),
+            make_protocol_ro_property("table_pool_free", &system_stats_.table_pool_free),
+            make_protocol_ro_property("table_heap_used", &system_stats_.table_heap_used),
+            make_protocol_ro_property("table_alloc_failures", &system_stats_.table_alloc_failures),
+            make_protocol_ro_property("cpu_load_total", &cpu_load.total_),
+            make_protocol_ro_property("cpu_load_isr", &cpu_load.isr_),
+            make_protocol_ro_property("cpu_idle_per_period", &cpu_load.idle_per_period_),
+            make_protocol_object("cpu_load_threads", cpu_load.make_protocol_definitions()),
+            make_protocol_ro_property("boot_time", &system_stats_.boot_time),
+            make_protocol_ro_property("ready_time", &system_stats_.ready_time),
+            make_protocol_object("priorities",
+                make_protocol_ro_property("pwm_timer", &system_stats_.priorities.pwm_timer),
+                make_protocol_ro_property("encoder_spi", &system_stats_.priorities.encoder_spi),
+                make_protocol_ro_property("current_sense", &system_stats_.priorities.current_sense),
+                make_protocol_ro_property("pwm_input", &system_stats_.priorities.pwm_input),
+                make_protocol_ro_property("usb", &system_stats_.priorities.usb),
+                make_protocol_ro_property("can", &system_stats_.priorities.can),
+                make_protocol_ro_property("uart", &system_stats_.priorities.uart),
+                make_protocol_ro_property("i2c", &system_stats_.priorities.i2c),
+                FOR_EACH_AXIS(AXIS_THREAD_PRIORITY, system_stats_.priorities)
+                make_protocol_ro_property("thread_usb_irq", &system_stats_.priorities.thread_usb_irq),
+                make_protocol_ro_property("thread_comms", &system_stats_.priorities.thread_comms),
+                make_protocol_ro_property("thread_usb", &system_stats_.priorities.thread_usb),
+                make_protocol_ro_property("thread_usb_cdc", &system_stats_.priorities.thread_usb_cdc),
+                make_protocol_ro_property("thread_uart", &system_stats_.priorities.thread_uart),
+                make_protocol_ro_property("thread_log", &system_stats_.priorities.thread_log)
+            ),
             make_protocol_object("usb",
-                make_protocol_ro_property("rx_cnt", &usb_stats_.rx_cnt),
-                make_protocol_ro_property("tx_cnt", &usb_stats_.tx_cnt),
-                make_protocol_ro_property("tx_overrun_cnt", &usb_stats_.tx_overrun_cnt)
+                make_transport_stats_definitions(usb_stats_),
+                make_protocol_object("request_latency", usb_request_latency_.make_protocol_definitions())
+            ),
+            make_protocol_object("uart",
+                make_transport_stats_definitions(uart_stats_),
+                make_protocol_object("request_latency", uart_request_latency_.make_protocol_definitions())
             ),
             make_protocol_object("i2c",
                 make_protocol_ro_property("addr", &i2c_stats_.addr),
                 make_protocol_ro_property("addr_match_cnt", &i2c_stats_.addr_match_cnt),
-                make_protocol_ro_property("rx_cnt", &i2c_stats_.rx_cnt),
-                make_protocol_ro_property("error_cnt", &i2c_stats_.error_cnt)
-            )
-        ),
-        make_protocol_object("config",
-            make_protocol_property("brake_resistance", &board_config.brake_resistance),
-            // TODO: changing this currently requires a reboot - fix this
-            make_protocol_property("enable_uart", &board_config.enable_uart),
-            make_protocol_property("enable_i2c_instead_of_can" , &board_config.enable_i2c_instead_of_can), // requires a reboot
-            make_protocol_property("enable_ascii_protocol_on_usb", &board_config.enable_ascii_protocol_on_usb),
-            make_protocol_property("dc_bus_undervoltage_trip_level", &board_config.dc_bus_undervoltage_trip_level),
-            make_protocol_property("dc_bus_overvoltage_trip_level", &board_config.dc_bus_overvoltage_trip_level),
-#if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
-            make_protocol_object("gpio1_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[0])),
-            make_protocol_object("gpio2_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[1])),
-            make_protocol_object("gpio3_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[2])),
-#endif
-            make_protocol_object("gpio4_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[3]))
+                make_protocol_ro_property("burst_cnt", &i2c_stats_.burst_cnt),
+                make_transport_stats_definitions(i2c_stats_.link),
+                make_protocol_object("request_latency", i2c_request_latency_.make_protocol_definitions())
+            ),
+            make_protocol_function("reset_link_stats", static_functions, &StaticFunctions::reset_link_stats_helper)
         ),
-        make_protocol_object("axis0", axes[0]->make_protocol_definitions()),
-        make_protocol_object("axis1", axes[1]->make_protocol_definitions()),
+        make_protocol_object("config", make_board_config_definitions()),
+        make_protocol_object("profiler", profiler.make_protocol_definitions()),
+        make_protocol_object("cycle_log", cycle_log.make_protocol_definitions()),
+        make_protocol_object("oscilloscope", oscilloscope.make_protocol_definitions()),
+        make_protocol_object("input_recorder", input_recorder.make_protocol_definitions()),
+        make_protocol_object("trace", trace.make_protocol_definitions()),
+        make_protocol_object("log", logger.make_protocol_definitions()),
+        make_protocol_object("benchmark", benchmark.make_protocol_definitions()),
+        make_protocol_object("gcode", gcode.make_protocol_definitions()),
+        FOR_EACH_AXIS(AXIS_OBJECT, axes)
         make_protocol_object("can", can1_ctx.make_protocol_definitions()),
         make_protocol_property("test_property", &test_property),
         make_protocol_function("test_function", static_functions, &StaticFunctions::test_function, "delta"),
+        make_protocol_function("get_time_us", static_functions, &StaticFunctions::get_time_us),
         make_protocol_function("get_oscilloscope_val", static_functions, &StaticFunctions::get_oscilloscope_val, "index"),
         make_protocol_function("get_adc_voltage", static_functions, &StaticFunctions::get_adc_voltage_, "gpio"),
         make_protocol_function("save_configuration", static_functions, &StaticFunctions::save_configuration_helper),
+        make_protocol_function("save_configuration_async", static_functions, &StaticFunctions::save_configuration_async_helper),
         make_protocol_function("erase_configuration", static_functions, &StaticFunctions::erase_configuration_helper),
         make_protocol_function("reboot", static_functions, &StaticFunctions::NVIC_SystemReset_helper),
-        make_protocol_function("enter_dfu_mode", static_functions, &StaticFunctions::enter_dfu_mode_helper)
+        make_protocol_function("enter_dfu_mode", static_functions, &StaticFunctions::enter_dfu_mode_helper),
+        make_protocol_function("move_to_pos_synced", static_functions, &StaticFunctions::move_to_pos_synced_helper,
+            "goal_axis0", "goal_axis1")
     );
 }
 
 using tree_type = decltype(make_obj_tree());
 uint8_t tree_buffer[sizeof(tree_type)];
+static tree_type* published_tree = nullptr;
+
+void for_each_config_field(ConfigFieldVisitor& visitor) {
+    if (published_tree)
+        published_tree->for_each_property(visitor, kPathHashInit);
+}
+
+void for_each_board_config_field(ConfigFieldVisitor& visitor) {
+    auto board_config_object = make_protocol_object("config", make_board_config_definitions());
+    board_config_object.for_each_property(visitor, kPathHashInit);
+}
 
 
 // Thread to handle deffered processing of USB interrupt, and
@@ -193,17 +291,21 @@ void communication_task(void * ctx) {
     // ends up with a stupid stack size of around 8000 bytes. Fix this.
     auto tree_ptr = new (tree_buffer) tree_type(make_obj_tree());
     fibre_publish(*tree_ptr);
+    published_tree = tree_ptr;
+
+    // The tags of the config fields are the paths in the tree
+    migrate_configuration();
 
     // Allow main init to continue
     endpoint_list_valid = true;
     
     start_uart_server();
     start_usb_server();
+    start_log_thread();
     if (board_config.enable_i2c_instead_of_can) {
         start_i2c_server();
     } else {
-        // TODO: finish implementing CAN
-        // start_can_server(can1_ctx, CAN1, serial_number);
+        start_can_server(can1_ctx, CAN1, serial_number); // only returns on failure
     }
 
     for (;;) {
@@ -215,13 +317,48 @@ extern "C" {
 int _write(int file, const char* data, int len);
 }
 
-// @brief This is what printf calls internally
+// @brief This is what printf calls internally.
+// The output goes to the log and is sent by the log thread, so printf never
+// waits for USB or UART.
 int _write(int file, const char* data, int len) {
-#ifdef USB_PROTOCOL_STDOUT
-    usb_stream_output_ptr->process_bytes((const uint8_t *)data, len, nullptr);
-#endif
-#ifdef UART_PROTOCOL_STDOUT
-    uart4_stream_output_ptr->process_bytes((const uint8_t *)data, len, nullptr);
-#endif
+    logger.write(Logger::LEVEL_INFO, data, len);
     return len;
 }
+
+// @brief Sends the log to the stdout interfaces.
+static void log_thread_fn(void * ctx) {
+    (void) ctx;
+
+    for (;;) {
+        const uint8_t* data;
+        size_t len;
+        while ((len = logger.peek(&data)) > 0) {
+            // Don't block on a busy port, the rest is drained next time.
+            // With both ports, the slower one sets the pace.
+#if defined(USB_PROTOCOL_STDOUT) && defined(UART_PROTOCOL_STDOUT)
+            len = std::min(len, uart4_stream_output_ptr->get_tx_space());
+            if (len)
+                len = usb_stream_output_ptr->write_nonblocking(data, len);
+            if (len)
+                uart4_stream_output_ptr->process_bytes(data, len, nullptr);
+#elif defined(USB_PROTOCOL_STDOUT)
+            len = usb_stream_output_ptr->write_nonblocking(data, len);
+#elif defined(UART_PROTOCOL_STDOUT)
+            len = uart4_stream_output_ptr->write_nonblocking(data, len);
+#endif
+            if (!len)
+                break;
+            logger.consume(len);
+        }
+        osDelay(Logger::kDrainPeriodMs);
+    }
+}
+
+static uint32_t log_thread_stack[STACK_SIZE_LOG];
+static osStaticThreadDef_t log_thread_tcb;
+
+void start_log_thread() {
+    osThreadStaticDef(log_thread_def, log_thread_fn, THREAD_PRIO_LOG, 0, STACK_SIZE_LOG,
+            log_thread_stack, &log_thread_tcb);
+    log_thread = osThreadCreate(osThread(log_thread_def), NULL);
+}
@@ -15,6 +15,7 @@ extern "C" {
 #include <cmsis_os.h>
 
 extern osThreadId comm_thread;
+extern osThreadId log_thread;
 
 extern const uint8_t hw_version_major;
 extern const uint8_t hw_version_minor;
@@ -22,6 +23,7 @@ extern const uint8_t hw_version_variant;
 
 void init_communication(void);
 void communication_task(void * ctx);
+void start_log_thread(void);
 
 #ifdef __cplusplus
 }
@@ -25,16 +25,72 @@
 * d) At a given point in time, a node MUST NOT send any regular message with
 *   a node ID that is not self-assigned.
 *
+* Motion protocol
+* ---------------
+*
+* Each axis listens on and sends from the 32 standard IDs
+* (axis.config.can_node_id << 5) | command. These are statically configured
+* and below 0x700, so they never collide with heartbeat messages and are not
+* subject to the node ID negotiation above. Multi-byte values are little endian.
+*
+*   0x01 AXIS_ERROR (TX, sent when the axis error changes to a nonzero value)
+*       uint32 axis.error, uint32 axis.motor.error
+*   0x03 AXIS_STATE (TX, sent when axis.current_state changes)
+*       uint32 axis.current_state, uint32 axis.error
+*   0x07 SET_REQUESTED_STATE (RX)
+*       uint32 requested_state
+*   0x09 ENCODER_FEEDBACK (TX, every axis.config.can_feedback_period_ms)
+*       float pos_estimate [counts], float vel_estimate [counts/s]
+*   0x0C SET_POS_SETPOINT (RX)
+*       int32 pos_setpoint [counts], int16 vel_ff [10 counts/s], int16 current_ff [10 mA]
+*   0x0D SET_VEL_SETPOINT (RX)
+*       float vel_setpoint [counts/s], float current_ff [A]
+*   0x0E SET_CURRENT_SETPOINT (RX)
+*       float current_setpoint [A]
+*   0x14 IQ_FEEDBACK (TX, every axis.config.can_feedback_period_ms)
+*       float Iq_setpoint [A], float Iq_measured [A]
+*   0x1E FIBRE_RX (RX, axis 0's node ID only)
+*   0x1F FIBRE_TX (TX, axis 0's node ID only)
+*       fibre packets segmented like ISO 15765-2 (ISO-TP), see below
+*
+* SYNC (ID 0x080, any payload) is a broadcast to all nodes. Axes with
+* config.can_use_sync latch the setpoints they receive and apply the last one
+* on SYNC, so that axes on different boards start moving in the same control
+* period regardless of bus arbitration. Their feedback is sampled on SYNC and
+* sent right after it instead of periodically.
+*
+* Fibre over CAN
+* --------------
+*
+* The whole fibre object tree is reachable through FIBRE_RX/FIBRE_TX. Each
+* fibre packet is segmented into frames whose first byte (PCI) gives the type:
+*   0x0L        single frame, L = 1..7 payload bytes follow
+*   0x1H LL     first frame, 12-bit packet length 0xHLL, 6 payload bytes follow
+*   0x2N        consecutive frame, N = sequence number (1, 2, ..., 15, 0, ...), up to 7 payload bytes
+*   0x3S BS ST  flow control sent by the receiver of a first frame: S = 0 continue,
+*               1 wait, 2 overflow, BS = frames until the next flow control (0 = all),
+*               ST = minimum gap between consecutive frames (0x00-0x7F ms, 0xF1-0xF9 100-900 us)
+* Flow control for packets from the ODrive travels on FIBRE_RX and vice versa.
+*
 * Hardware allocation
 * -------------------
 *   RX FIFO0:
 *       - filter bank 0: heartbeat messages
+*   RX FIFO1:
+*       - filter bank 1: motion protocol messages of axis 0 and axis 1
+*       - filter bank 2: SYNC
+*
+* Both RX interrupts drain their FIFO into CAN_context::rx_queue and wake up
+* the server thread, which handles the messages. Only SYNC is handled directly
+* in the interrupt, because its point in time matters.
 */
 
 #include "interface_can.hpp"
 #include "fibre/crc.hpp"
 #include "utils.h"
 
+#include <odrive_main.h>
+
 #include <can.h>
 #include <stm32f4xx_hal.h>
 #include <cmsis_os.h>
@@ -42,6 +98,254 @@
 #define CAN_HEARTBEAT_INTERVAL  1000 // [ms]
 #define CAN_HEARTBEAT_MARGIN    10 // maximum time that a heartbeat message can be delayed until we stop sending other messages [ms]
 
+#define CAN_CMD_BITS            5
+#define CAN_CMD_MASK            ((1u << CAN_CMD_BITS) - 1)
+#define CAN_MAX_MOTION_NODE_ID  0x37u // highest node ID whose message IDs stay below the heartbeat range
+#define CAN_SYNC_ID             0x080u
+
+enum CanSignal_t {
+    CAN_SIGNAL_SEND_HEARTBEAT = 1u << 0,
+    CAN_SIGNAL_RX = 1u << 1,
+    CAN_SIGNAL_TX = 1u << 2, // a TX mailbox became free while a fibre packet is being sent
+};
+
+enum CanMotionCmd_t {
+    CAN_CMD_AXIS_ERROR = 0x01,
+    CAN_CMD_AXIS_STATE = 0x03,
+    CAN_CMD_SET_REQUESTED_STATE = 0x07,
+    CAN_CMD_ENCODER_FEEDBACK = 0x09,
+    CAN_CMD_SET_POS_SETPOINT = 0x0C,
+    CAN_CMD_SET_VEL_SETPOINT = 0x0D,
+    CAN_CMD_SET_CURRENT_SETPOINT = 0x0E,
+    CAN_CMD_IQ_FEEDBACK = 0x14,
+    CAN_CMD_FIBRE_RX = 0x1E,
+    CAN_CMD_FIBRE_TX = 0x1F,
+};
+
+static constexpr float kCanVelFfScale = 10.0f; // [counts/s] per LSB of SET_POS_SETPOINT.vel_ff
+static constexpr float kCanCurrentFfScale = 0.01f; // [A] per LSB of SET_POS_SETPOINT.current_ff
+
+// Feedback messages that are due but did not fit into a TX mailbox yet
+enum {
+    FEEDBACK_PENDING_ENCODER = 1u << 0,
+    FEEDBACK_PENDING_IQ = 1u << 1,
+};
+
+struct CanMotionState_t {
+    uint32_t filter_node_id; // node ID the RX filter was configured for
+    uint32_t next_feedback_ms;
+    uint32_t feedback_pending;
+    uint32_t reported_error; // last axis error sent in an AXIS_ERROR message
+    uint32_t reported_state; // last axis state sent in an AXIS_STATE message
+
+    // SYNC mode, shared with the RX interrupt that handles SYNC
+    uint32_t latched_cmd; // setpoint command waiting for SYNC, 0 if none
+    float latched_setpoint[3];
+    bool feedback_sampled; // feedback_pending refers to the values below
+    float sampled_feedback[4]; // pos_estimate, vel_estimate, Iq_setpoint, Iq_measured
+};
+
+static CanMotionState_t can_motion_state[AXIS_COUNT];
+
+#define ISOTP_SINGLE_FRAME        0x0
+#define ISOTP_FIRST_FRAME         0x1
+#define ISOTP_CONSECUTIVE_FRAME   0x2
+#define ISOTP_FLOW_CONTROL        0x3
+#define ISOTP_FC_CONTINUE         0x0
+#define ISOTP_FC_WAIT             0x1
+#define ISOTP_FC_OVERFLOW         0x2
+#define ISOTP_TIMEOUT_MS          1000 // N_Bs and N_Cr of ISO 15765-2
+
+static bool send_motion_msg(CAN_context* ctx, uint32_t node_id, uint32_t cmd, const uint8_t* data, uint32_t length);
+
+// @brief Segments fibre packets into FIBRE_TX frames.
+// process_packet() only copies the packet, the frames are sent from poll() so
+// that the server thread can receive the flow control in the meantime.
+class CanFibreSender : public PacketSink {
+public:
+    size_t get_mtu() { return MAX_PACKET_SIZE; }
+
+    int process_packet(const uint8_t* buffer, size_t length) {
+        if (state_ != STATE_IDLE || length == 0 || length > sizeof(buffer_))
+            return -1;
+        memcpy(buffer_, buffer, length);
+        length_ = length;
+        offset_ = 0;
+        state_ = STATE_SEND_FIRST;
+        return 0;
+    }
+
+    void on_flow_control(const uint8_t* data, uint8_t dlc) {
+        if (state_ != STATE_WAIT_FC || dlc < 3)
+            return;
+        switch (data[0] & 0xf) {
+            case ISOTP_FC_CONTINUE:
+                block_size_ = data[1];
+                block_remaining_ = block_size_;
+                // Sub-millisecond gaps are rounded up to the 1 ms resolution of the server tick
+                st_min_ms_ = data[2] <= 0x7f ? data[2] : (data[2] >= 0xf1 && data[2] <= 0xf9) ? 1 : 0x7f;
+                next_frame_ms_ = osKernelSysTick();
+                state_ = STATE_SEND_CONSECUTIVE;
+                break;
+            case ISOTP_FC_WAIT:
+                deadline_ms_ = osKernelSysTick() + ISOTP_TIMEOUT_MS;
+                break;
+            default: // overflow or invalid
+                abort();
+                break;
+        }
+    }
+
+    // @brief Sends as many frames as there are free TX mailboxes and the flow control allows.
+    void poll(CAN_context* ctx, uint32_t node_id) {
+        uint8_t frame[8];
+        if (state_ == STATE_SEND_FIRST) {
+            if (length_ <= 7) {
+                frame[0] = (ISOTP_SINGLE_FRAME << 4) | length_;
+                memcpy(&frame[1], buffer_, length_);
+                if (send_motion_msg(ctx, node_id, CAN_CMD_FIBRE_TX, frame, 1 + length_))
+                    state_ = STATE_IDLE;
+                return;
+            }
+            frame[0] = (ISOTP_FIRST_FRAME << 4) | (length_ >> 8);
+            frame[1] = length_ & 0xff;
+            memcpy(&frame[2], buffer_, 6);
+            if (!send_motion_msg(ctx, node_id, CAN_CMD_FIBRE_TX, frame, 8))
+                return;
+            offset_ = 6;
+            seq_ = 1;
+            deadline_ms_ = osKernelSysTick() + ISOTP_TIMEOUT_MS;
+            state_ = STATE_WAIT_FC;
+        }
+        if (state_ == STATE_WAIT_FC && !is_in_the_future(deadline_ms_)) {
+            ctx->fibre_errors++;
+            abort();
+        }
+        while (state_ == STATE_SEND_CONSECUTIVE && !is_in_the_future(next_frame_ms_)) {
+            size_t chunk = std::min(length_ - offset_, (size_t)7);
+            frame[0] = (ISOTP_CONSECUTIVE_FRAME << 4) | (seq_ & 0xf);
+            memcpy(&frame[1], &buffer_[offset_], chunk);
+            if (!send_motion_msg(ctx, node_id, CAN_CMD_FIBRE_TX, frame, 1 + chunk))
+                return; // retried when a mailbox becomes free
+            offset_ += chunk;
+            seq_++;
+            next_frame_ms_ = osKernelSysTick() + st_min_ms_;
+            if (offset_ >= length_) {
+                state_ = STATE_IDLE;
+            } else if (block_size_ && --block_remaining_ == 0) {
+                deadline_ms_ = osKernelSysTick() + ISOTP_TIMEOUT_MS;
+                state_ = STATE_WAIT_FC;
+            }
+        }
+    }
+
+    // @brief Returns true while the sender waits for free TX mailboxes.
+    bool wants_tx_mailbox() const {
+        return state_ == STATE_SEND_FIRST || (state_ == STATE_SEND_CONSECUTIVE && st_min_ms_ == 0);
+    }
+
+    void abort() { state_ = STATE_IDLE; }
+
+private:
+    enum State_t {
+        STATE_IDLE,
+        STATE_SEND_FIRST,
+        STATE_WAIT_FC,
+        STATE_SEND_CONSECUTIVE,
+    };
+
+    uint8_t buffer_[MAX_PACKET_SIZE];
+    size_t length_ = 0;
+    size_t offset_ = 0;
+    uint8_t seq_ = 0;
+    uint8_t block_size_ = 0;
+    uint8_t block_remaining_ = 0;
+    uint32_t st_min_ms_ = 0;
+    uint32_t next_frame_ms_ = 0;
+    uint32_t deadline_ms_ = 0;
+    State_t state_ = STATE_IDLE;
+};
+
+// @brief Reassembles fibre packets from FIBRE_RX frames.
+class CanFibreReceiver {
+public:
+    CanFibreReceiver(PacketSink& output) : output_(output) {}
+
+    void on_frame(CAN_context* ctx, const uint8_t* data, uint8_t dlc) {
+        if (dlc < 1)
+            return;
+        uint8_t pci = data[0] >> 4;
+        if (pci == ISOTP_SINGLE_FRAME) {
+            size_t length = data[0] & 0xf;
+            if (length == 0 || length > (size_t)dlc - 1u) {
+                ctx->fibre_errors++;
+                return;
+            }
+            active_ = false; // a new packet aborts the previous one
+            ctx->fibre_rx_packets++;
+            output_.process_packet(&data[1], length);
+        } else if (pci == ISOTP_FIRST_FRAME) {
+            if (dlc < 8)
+                return;
+            length_ = ((data[0] & 0xf) << 8) | data[1];
+            if (length_ > sizeof(buffer_)) {
+                active_ = false;
+                fc_pending_ = ISOTP_FC_OVERFLOW;
+                ctx->fibre_errors++;
+                return;
+            }
+            memcpy(buffer_, &data[2], 6);
+            offset_ = 6;
+            next_seq_ = 1;
+            deadline_ms_ = osKernelSysTick() + ISOTP_TIMEOUT_MS;
+            active_ = true;
+            fc_pending_ = ISOTP_FC_CONTINUE;
+        } else if (pci == ISOTP_CONSECUTIVE_FRAME) {
+            if (!active_)
+                return;
+            if ((data[0] & 0xf) != (next_seq_ & 0xf) || !is_in_the_future(deadline_ms_)) {
+                active_ = false;
+                ctx->fibre_errors++;
+                return;
+            }
+            size_t chunk = std::min(length_ - offset_, (size_t)dlc - 1u);
+            memcpy(&buffer_[offset_], &data[1], chunk);
+            offset_ += chunk;
+            next_seq_++;
+            deadline_ms_ = osKernelSysTick() + ISOTP_TIMEOUT_MS;
+            if (offset_ >= length_) {
+                active_ = false;
+                ctx->fibre_rx_packets++;
+                output_.process_packet(buffer_, length_);
+            }
+        }
+    }
+
+    // @brief Sends a pending flow control frame.
+    void poll(CAN_context* ctx, uint32_t node_id) {
+        if (fc_pending_ < 0)
+            return;
+        // Receive the whole packet without further flow control and without gaps
+        uint8_t frame[3] = { (uint8_t)((ISOTP_FLOW_CONTROL << 4) | fc_pending_), 0, 0 };
+        if (send_motion_msg(ctx, node_id, CAN_CMD_FIBRE_TX, frame, sizeof(frame)))
+            fc_pending_ = -1;
+    }
+
+private:
+    PacketSink& output_;
+    uint8_t buffer_[RX_BUF_SIZE];
+    size_t length_ = 0;
+    size_t offset_ = 0;
+    uint8_t next_seq_ = 0;
+    uint32_t deadline_ms_ = 0;
+    bool active_ = false;
+    int fc_pending_ = -1; // flow status to send, -1 if none
+};
+
+static CanFibreSender can_fibre_sender;
+static BidirectionalPacketBasedChannel can_fibre_channel(can_fibre_sender);
+static CanFibreReceiver can_fibre_receiver(can_fibre_channel);
+
 // defined in can.c
 extern CAN_HandleTypeDef hcan1;
 extern CAN_HandleTypeDef hcan2;
@@ -92,14 +396,329 @@ bool select_another_node_id(CAN_context* ctx) {
 }
 
 
+static bool is_valid_motion_node_id(uint32_t node_id) {
+    return node_id <= CAN_MAX_MOTION_NODE_ID;
+}
+
+// @brief Configures one filter bank per two axes to pass their motion
+// protocol messages into RX FIFO1: bank 1 for axis 0 and 1 and banks 3, 4, ...
+// for the axes after that (bank 2 takes the SYNC message). Axes with an
+// invalid node ID receive nothing.
+static bool config_motion_filter(CAN_context* ctx) {
+    static_assert((AXIS_COUNT + 1) / 2 + 2 <= 14, "CAN1 only has the filter banks 0-13");
+    for (size_t bank = 0; bank < (AXIS_COUNT + 1) / 2; ++bank) {
+        // With an odd number of axes, the last one fills both halves of its bank
+        uint32_t node_ids[2];
+        for (size_t j = 0; j < 2; ++j) {
+            size_t axis_num = 2 * bank + j < AXIS_COUNT ? 2 * bank + j : AXIS_COUNT - 1;
+            node_ids[j] = axes[axis_num]->config_.can_node_id;
+        }
+        // A rejected node ID reuses the filter of the other axis
+        if (!is_valid_motion_node_id(node_ids[0]))
+            node_ids[0] = node_ids[1];
+        if (!is_valid_motion_node_id(node_ids[1]))
+            node_ids[1] = node_ids[0];
+
+        CAN_FilterTypeDef sFilterConfig = {
+            .FilterIdHigh = (node_ids[0] << (CAN_CMD_BITS + 5)), // standard ID, no RTR
+            .FilterIdLow = (node_ids[1] << (CAN_CMD_BITS + 5)), // standard ID, no RTR
+            .FilterMaskIdHigh = ((0x7ffu & ~CAN_CMD_MASK) << 5) | (0x3 << 3),
+            .FilterMaskIdLow = ((0x7ffu & ~CAN_CMD_MASK) << 5) | (0x3 << 3),
+            .FilterFIFOAssignment = CAN_RX_FIFO1,
+            .FilterBank = (uint32_t)(bank ? bank + 2 : 1),
+            .FilterMode = CAN_FILTERMODE_IDMASK,
+            .FilterScale = CAN_FILTERSCALE_16BIT, // two 16-bit filters
+            .FilterActivation = is_valid_motion_node_id(node_ids[0]) ? ENABLE : DISABLE,
+            .SlaveStartFilterBank = 14
+        };
+        if (HAL_CAN_ConfigFilter(ctx->handle, &sFilterConfig) != HAL_OK)
+            return false;
+    }
+
+    CAN_FilterTypeDef sSyncFilterConfig = {
+        .FilterIdHigh = CAN_SYNC_ID << 5, // standard ID, no RTR
+        .FilterIdLow = CAN_SYNC_ID << 5,
+        .FilterMaskIdHigh = CAN_SYNC_ID << 5, // in list mode these are two more IDs
+        .FilterMaskIdLow = CAN_SYNC_ID << 5,
+        .FilterFIFOAssignment = CAN_RX_FIFO1,
+        .FilterBank = 2,
+        .FilterMode = CAN_FILTERMODE_IDLIST,
+        .FilterScale = CAN_FILTERSCALE_16BIT, // four 16-bit IDs
+        .FilterActivation = ENABLE,
+        .SlaveStartFilterBank = 14
+    };
+    if (HAL_CAN_ConfigFilter(ctx->handle, &sSyncFilterConfig) != HAL_OK)
+        return false;
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        can_motion_state[i].filter_node_id = axes[i]->config_.can_node_id;
+    return true;
+}
+
+static bool send_motion_msg(CAN_context* ctx, uint32_t node_id, uint32_t cmd, const uint8_t* data, uint32_t length) {
+    CAN_TxHeaderTypeDef header = {
+        .StdId = (node_id << CAN_CMD_BITS) | cmd,
+        .ExtId = 0,
+        .IDE = CAN_ID_STD,
+        .RTR = CAN_RTR_DATA,
+        .DLC = length,
+        .TransmitGlobalTime = DISABLE
+    };
+    uint32_t mailbox;
+    if (HAL_CAN_AddTxMessage(ctx->handle, &header, const_cast<uint8_t*>(data), &mailbox) != HAL_OK) {
+        ctx->tx_dropped++;
+        return false;
+    }
+    return true;
+}
+
+static bool send_float_pair(CAN_context* ctx, uint32_t node_id, uint32_t cmd, float a, float b) {
+    uint8_t data[8];
+    memcpy(&data[0], &a, sizeof(a));
+    memcpy(&data[4], &b, sizeof(b));
+    return send_motion_msg(ctx, node_id, cmd, data, sizeof(data));
+}
+
+// @brief Sends the feedback and error messages that are due.
+// A message that finds all TX mailboxes busy is retried on the next call.
+static void serve_motion_protocol(CAN_context* ctx) {
+    bool filter_outdated = false;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        CanMotionState_t& state = can_motion_state[i];
+        uint32_t node_id = axis.config_.can_node_id;
+        filter_outdated = filter_outdated || (node_id != state.filter_node_id);
+        if (!is_valid_motion_node_id(node_id))
+            continue;
+
+        // The RX interrupt schedules the feedback in SYNC mode
+        float feedback[4];
+        uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CAN);
+        uint32_t period = axis.config_.can_feedback_period_ms;
+        if (axis.config_.can_use_sync) {
+            if (!state.feedback_sampled)
+                state.feedback_pending = 0; // nothing sampled since the switch to SYNC mode
+            memcpy(feedback, state.sampled_feedback, sizeof(feedback));
+        } else {
+            if (state.feedback_sampled) {
+                state.feedback_sampled = false;
+                state.feedback_pending = 0;
+            }
+            if (period && !is_in_the_future(state.next_feedback_ms)) {
+                state.feedback_pending = FEEDBACK_PENDING_ENCODER | FEEDBACK_PENDING_IQ;
+                state.next_feedback_ms += period;
+                if (!is_in_the_future(state.next_feedback_ms))
+                    state.next_feedback_ms = osKernelSysTick() + period; // fast-forward if we fell behind
+            }
+            feedback[0] = axis.encoder_.pos_estimate_;
+            feedback[1] = axis.encoder_.vel_estimate_;
+            feedback[2] = axis.motor_.current_control_.Iq_setpoint;
+            feedback[3] = axis.motor_.current_control_.Iq_measured;
+        }
+        uint32_t pending = state.feedback_pending;
+        cpu_exit_masked_critical(basepri);
+
+        uint32_t sent = 0;
+        if ((pending & FEEDBACK_PENDING_ENCODER)
+                && send_float_pair(ctx, node_id, CAN_CMD_ENCODER_FEEDBACK, feedback[0], feedback[1]))
+            sent |= FEEDBACK_PENDING_ENCODER;
+        if ((pending & FEEDBACK_PENDING_IQ)
+                && send_float_pair(ctx, node_id, CAN_CMD_IQ_FEEDBACK, feedback[2], feedback[3]))
+            sent |= FEEDBACK_PENDING_IQ;
+        basepri = cpu_enter_masked_critical(IRQ_PRIO_CAN);
+        state.feedback_pending &= ~sent;
+        cpu_exit_masked_critical(basepri);
+
+        uint32_t error = axis.error_;
+        if (error != state.reported_error) {
+            if (error == Axis::ERROR_NONE) {
+                state.reported_error = error;
+            } else {
+                uint32_t motor_error = axis.motor_.error_;
+                uint8_t data[8];
+                memcpy(&data[0], &error, sizeof(error));
+                memcpy(&data[4], &motor_error, sizeof(motor_error));
+                if (send_motion_msg(ctx, node_id, CAN_CMD_AXIS_ERROR, data, sizeof(data)))
+                    state.reported_error = error;
+            }
+        }
+
+        uint32_t current_state = axis.current_state_;
+        if (current_state != state.reported_state) {
+            uint8_t data[8];
+            memcpy(&data[0], &current_state, sizeof(current_state));
+            memcpy(&data[4], &error, sizeof(error));
+            if (send_motion_msg(ctx, node_id, CAN_CMD_AXIS_STATE, data, sizeof(data)))
+                state.reported_state = current_state;
+        }
+    }
+    if (filter_outdated)
+        config_motion_filter(ctx);
+}
+
+static void apply_setpoint(Axis& axis, uint32_t cmd, const float setpoint[3]) {
+    switch (cmd) {
+        case CAN_CMD_SET_POS_SETPOINT: axis.controller_.set_pos_setpoint(setpoint[0], setpoint[1], setpoint[2]); break;
+        case CAN_CMD_SET_VEL_SETPOINT: axis.controller_.set_vel_setpoint(setpoint[0], setpoint[1]); break;
+        case CAN_CMD_SET_CURRENT_SETPOINT: axis.controller_.set_current_setpoint(setpoint[0]); break;
+        default: break;
+    }
+}
+
+// @brief Decodes the payload of a SET_..._SETPOINT message into the arguments
+// of the corresponding Controller::set_..._setpoint() function.
+static bool decode_setpoint(uint32_t cmd, const CAN_context::RxMsg_t& msg, float setpoint[3]) {
+    const uint8_t* data = msg.data;
+    setpoint[0] = setpoint[1] = setpoint[2] = 0.0f;
+    switch (cmd) {
+        case CAN_CMD_SET_POS_SETPOINT: {
+            if (msg.dlc < 8) return false;
+            int32_t pos_setpoint;
+            int16_t vel_ff, current_ff;
+            memcpy(&pos_setpoint, &data[0], sizeof(pos_setpoint));
+            memcpy(&vel_ff, &data[4], sizeof(vel_ff));
+            memcpy(&current_ff, &data[6], sizeof(current_ff));
+            setpoint[0] = (float)pos_setpoint;
+            setpoint[1] = (float)vel_ff * kCanVelFfScale;
+            setpoint[2] = (float)current_ff * kCanCurrentFfScale;
+        } return true;
+        case CAN_CMD_SET_VEL_SETPOINT: {
+            if (msg.dlc < 8) return false;
+            memcpy(&setpoint[0], &data[0], sizeof(float));
+            memcpy(&setpoint[1], &data[4], sizeof(float));
+        } return true;
+        case CAN_CMD_SET_CURRENT_SETPOINT: {
+            if (msg.dlc < 4) return false;
+            memcpy(&setpoint[0], &data[0], sizeof(float));
+        } return true;
+        default:
+            return false;
+    }
+}
+
+// @brief Applies the latched setpoints and samples the feedback of all axes
+// in SYNC mode.
+static void handle_sync(CAN_context* ctx) {
+    ctx->sync_cnt++;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        CanMotionState_t& state = can_motion_state[i];
+        if (!axis.config_.can_use_sync)
+            continue;
+        if (state.latched_cmd) {
+            apply_setpoint(axis, state.latched_cmd, state.latched_setpoint);
+            state.latched_cmd = 0;
+        }
+        state.sampled_feedback[0] = axis.encoder_.pos_estimate_;
+        state.sampled_feedback[1] = axis.encoder_.vel_estimate_;
+        state.sampled_feedback[2] = axis.motor_.current_control_.Iq_setpoint;
+        state.sampled_feedback[3] = axis.motor_.current_control_.Iq_measured;
+        state.feedback_sampled = true;
+        if (axis.config_.can_feedback_period_ms)
+            state.feedback_pending = FEEDBACK_PENDING_ENCODER | FEEDBACK_PENDING_IQ;
+    }
+}
+
+// @brief Applies a motion protocol message to the axis it is addressed to,
+// or latches it until the next SYNC if the axis is in SYNC mode.
+static void handle_motion_msg(CAN_context* ctx, const CAN_context::RxMsg_t& msg) {
+    uint32_t node_id = msg.std_id >> CAN_CMD_BITS;
+    uint32_t cmd = msg.std_id & CAN_CMD_MASK;
+    size_t axis_num = AXIS_COUNT;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (axes[i]->config_.can_node_id == node_id)
+            axis_num = i;
+    }
+    if (axis_num >= AXIS_COUNT) {
+        ctx->unhandled_messages++;
+        return;
+    }
+    Axis& axis = *axes[axis_num];
+
+    if (cmd == CAN_CMD_FIBRE_RX && axis_num == 0) {
+        // Flow control for our own packets arrives on the same ID
+        if ((msg.dlc >= 1) && (msg.data[0] >> 4) == ISOTP_FLOW_CONTROL)
+            can_fibre_sender.on_flow_control(msg.data, msg.dlc);
+        else
+            can_fibre_receiver.on_frame(ctx, msg.data, msg.dlc);
+        return;
+    }
+
+    if (cmd == CAN_CMD_SET_REQUESTED_STATE && msg.dlc >= 4) {
+        uint32_t requested_state;
+        memcpy(&requested_state, &msg.data[0], sizeof(requested_state));
+        axis.requested_state_ = (Axis::State_t)requested_state;
+        ctx->motion_msg_cnt++;
+        return;
+    }
+
+    float setpoint[3];
+    if (!decode_setpoint(cmd, msg, setpoint)) {
+        ctx->unhandled_messages++;
+        return;
+    }
+    ctx->motion_msg_cnt++;
+    if (axis.config_.can_use_sync) {
+        CanMotionState_t& state = can_motion_state[axis_num];
+        uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_CAN);
+        state.latched_cmd = cmd;
+        memcpy(state.latched_setpoint, setpoint, sizeof(setpoint));
+        cpu_exit_masked_critical(basepri);
+    } else {
+        apply_setpoint(axis, cmd, setpoint);
+    }
+}
+
+static void handle_heartbeat_msg(CAN_context* ctx, const CAN_context::RxMsg_t& msg) {
+    uint8_t node_id = msg.std_id & 0x07fu;
+    if ((msg.std_id & 0x780u) == 0x700u) {
+        ctx->received_ack++;
+        consider_node_id_in_use(ctx, node_id);
+    } else {
+        ctx->unhandled_messages++;
+    }
+}
+
+static void process_rx_queue(CAN_context* ctx) {
+    uint32_t tail = ctx->rx_queue_tail;
+    while (tail != ctx->rx_queue_head) {
+        const CAN_context::RxMsg_t& msg = ctx->rx_queue[tail & (CAN_context::kRxQueueSize - 1)];
+        if (msg.fifo == CAN_RX_FIFO0)
+            handle_heartbeat_msg(ctx, msg);
+        else
+            handle_motion_msg(ctx, msg);
+        __DMB(); // finish reading the slot before handing it back to the interrupt
+        ctx->rx_queue_tail = ++tail;
+    }
+}
+
+static void serve_fibre(CAN_context* ctx) {
+    uint32_t node_id = axes[0]->config_.can_node_id;
+    if (!is_valid_motion_node_id(node_id)) {
+        can_fibre_sender.abort();
+        return;
+    }
+    can_fibre_channel.update_subscription(osKernelSysTick());
+    can_fibre_receiver.poll(ctx, node_id);
+    can_fibre_sender.poll(ctx, node_id);
+    ctx->wake_on_tx_complete = can_fibre_sender.wants_tx_mailbox();
+}
+
 void server_thread(CAN_context* ctx) {
     uint32_t next_1s_tick = osKernelSysTick() + 1000;
     for (;;) {
-        if (deadline_to_timeout(next_1s_tick) == 0)
-            
-        // wait until either the next heartbeat is due or a hearbeat was requested
-        // by releasing the semaphore
-        osSemaphoreWait(ctx->sem_send_heartbeat, deadline_to_timeout(next_1s_tick));
+        // Wake up on received messages and at least every millisecond to serve
+        // the motion protocol. The heartbeat is sent when it is due or when it
+        // was requested with CAN_SIGNAL_SEND_HEARTBEAT.
+        osEvent event = osSignalWait(CAN_SIGNAL_SEND_HEARTBEAT | CAN_SIGNAL_RX | CAN_SIGNAL_TX, 1);
+        bool heartbeat_requested = (event.status == osEventSignal)
+                && (event.value.signals & CAN_SIGNAL_SEND_HEARTBEAT);
+        process_rx_queue(ctx);
+        serve_motion_protocol(ctx);
+        serve_fibre(ctx);
+        if (!heartbeat_requested && is_in_the_future(next_1s_tick))
+            continue;
+
         if (!is_in_the_future(next_1s_tick))
             memcpy(ctx->node_ids_in_use_1, ctx->node_ids_in_use_0, sizeof(ctx->node_ids_in_use_1));
         next_1s_tick += 1000;
@@ -145,11 +764,9 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
 
     HAL_StatusTypeDef status;
 
-    ctx.node_id = calc_crc<uint8_t, 1>(0, (const uint8_t*)UID_BASE, 12);
+    ctx.node_id = calc_crc<uint8_t, 1, false>(0, (const uint8_t*)UID_BASE, 12);
     ctx.serial_number = serial_number;
-    osSemaphoreDef(sem_send_heartbeat);
-    ctx.sem_send_heartbeat = osSemaphoreCreate(osSemaphore(sem_send_heartbeat), 1);
-    osSemaphoreWait(ctx.sem_send_heartbeat, 0);
+    ctx.thread_id = osThreadGetId(); // the server runs in the calling thread
 
     //// Set up heartbeat filter
     CAN_FilterTypeDef sFilterConfig = {
@@ -162,20 +779,28 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
         .FilterMode = CAN_FILTERMODE_IDMASK,
         .FilterScale = CAN_FILTERSCALE_16BIT, // two 16-bit filters
         .FilterActivation = ENABLE,
-        .SlaveStartFilterBank = 0
+        .SlaveStartFilterBank = 14 // banks 0-13 belong to CAN1
     };
     status = HAL_CAN_ConfigFilter(ctx.handle, &sFilterConfig);
     if (status != HAL_OK)
         return false;
 
+    //// Set up motion protocol filter
+    uint32_t now = osKernelSysTick();
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        can_motion_state[i] = { .filter_node_id = 0, .next_feedback_ms = now, .feedback_pending = 0, .reported_error = Axis::ERROR_NONE,
+                                .latched_cmd = 0, .latched_setpoint = { 0.0f, 0.0f, 0.0f }, .feedback_sampled = false,
+                                .sampled_feedback = { 0.0f, 0.0f, 0.0f, 0.0f } };
+    if (!config_motion_filter(&ctx))
+        return false;
+
     status = HAL_CAN_Start(ctx.handle);
     if (status != HAL_OK)
         return false;
 
     status = HAL_CAN_ActivateNotification(ctx.handle,
         CAN_IT_TX_MAILBOX_EMPTY |
-        CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING | /* we probably only want this */
-        CAN_IT_RX_FIFO0_FULL | CAN_IT_RX_FIFO1_FULL |
+        CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING |
         CAN_IT_RX_FIFO0_OVERRUN | CAN_IT_RX_FIFO1_OVERRUN |
         CAN_IT_WAKEUP | CAN_IT_SLEEP_ACK |
         CAN_IT_ERROR_WARNING | CAN_IT_ERROR_PASSIVE |
@@ -192,11 +817,13 @@ void tx_complete_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
     CAN_context *ctx = get_can_ctx(hcan);
     if (!ctx) return;
     ctx->tx_msg_cnt++;
-    if (mailbox_idx == ctx->last_heartbeat_mailbox) {
+    if ((1u << mailbox_idx) == ctx->last_heartbeat_mailbox) { // last_heartbeat_mailbox is a CAN_TX_MAILBOXx bit
         // we succeeded in sending a heartbeat
         // now we're allowed to send messages for the next second plus a small margin
         ctx->node_id_expiry = osKernelSysTick() + CAN_HEARTBEAT_INTERVAL + CAN_HEARTBEAT_MARGIN;
     }
+    if (ctx->wake_on_tx_complete && ctx->thread_id)
+        osSignalSet(ctx->thread_id, CAN_SIGNAL_TX);
 }
 
 void tx_aborted_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
@@ -207,13 +834,13 @@ void tx_aborted_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
 }
 
 void tx_error(CAN_context *ctx, uint8_t mailbox_idx) {
-    if (mailbox_idx == ctx->last_heartbeat_mailbox) {
+    if ((1u << mailbox_idx) == ctx->last_heartbeat_mailbox) {
         // Consider the node ID in use
         consider_node_id_in_use(ctx, ctx->node_id);
         // Try to find a new node ID that is not in use and immediately
         // resend heartbeat if we find one
         if (select_another_node_id(ctx))
-            osSemaphoreRelease(ctx->sem_send_heartbeat);
+            osSignalSet(ctx->thread_id, CAN_SIGNAL_SEND_HEARTBEAT);
     }
 }
 
@@ -224,31 +851,58 @@ void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan) { tx_aborted_callb
 void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan) { tx_aborted_callback(hcan, 1); }
 void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan) { tx_aborted_callback(hcan, 2); }
 
-void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo0FullCallbackCnt++; }
+
+// @brief Moves all messages from the given RX FIFO into the RX queue.
+static void receive_from_fifo(CAN_HandleTypeDef *hcan, uint32_t fifo) {
     CAN_context *ctx = get_can_ctx(hcan);
     if (!ctx) return;
-    ctx->received_msg_cnt++;
 
-    CAN_RxHeaderTypeDef header;
-    uint8_t data[8];
-    HAL_StatusTypeDef status = HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &header, data);
-    if (status != HAL_OK) {
-        ctx->unexpected_errors++;
-        return;
-    }
+    bool received = false;
+    while (HAL_CAN_GetRxFifoFillLevel(hcan, fifo) > 0) {
+        uint32_t head = ctx->rx_queue_head;
+        uint32_t fill = head - ctx->rx_queue_tail;
+        CAN_context::RxMsg_t& msg = ctx->rx_queue[head & (CAN_context::kRxQueueSize - 1)];
+        CAN_RxHeaderTypeDef header;
+        uint8_t data[8];
+        if (HAL_CAN_GetRxMessage(hcan, fifo, &header, data) != HAL_OK) {
+            ctx->unexpected_errors++;
+            break;
+        }
+        ctx->received_msg_cnt++;
 
-    uint8_t node_id = header.StdId & 0x07fu;
-    if ((header.StdId & 0x780u) == 0x700u) {
-        ctx->received_ack++;
-        consider_node_id_in_use(ctx, node_id);
-    } else {
-        ctx->unhandled_messages++;
+        if (header.IDE == CAN_ID_STD && header.StdId == CAN_SYNC_ID) {
+            handle_sync(ctx);
+            continue;
+        }
+        if (fill >= CAN_context::kRxQueueSize) {
+            ctx->rx_queue_overflows++;
+            continue;
+        }
+        msg.std_id = header.StdId;
+        msg.fifo = (uint8_t)fifo;
+        msg.dlc = (uint8_t)header.DLC;
+        memcpy(msg.data, data, sizeof(msg.data));
+        __DMB(); // finish writing the slot before publishing it
+        ctx->rx_queue_head = head + 1;
+        if (fill + 1 > ctx->rx_queue_max_fill)
+            ctx->rx_queue_max_fill = fill + 1;
+        received = true;
     }
+    if (received && ctx->thread_id)
+        osSignalSet(ctx->thread_id, CAN_SIGNAL_RX);
 }
 
-void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo0FullCallbackCnt++; }
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+    if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo0MsgPendingCallbackCnt++;
+    receive_from_fifo(hcan, CAN_RX_FIFO0);
+}
+
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+    if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo1MsgPendingCallbackCnt++;
+    receive_from_fifo(hcan, CAN_RX_FIFO1);
+}
 
-void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo1MsgPendingCallbackCnt++; }
 void HAL_CAN_RxFifo1FullCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo1FullCallbackCnt++; }
 void HAL_CAN_SleepCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->SleepCallbackCnt++; }
 void HAL_CAN_WakeUpFromRxMsgCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->WakeUpFromRxMsgCallbackCnt++; }
@@ -291,6 +945,11 @@ void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan) {
         hcan->ErrorCode &= ~HAL_CAN_ERROR_TX_TERR2;
     }
 
+    if (hcan->ErrorCode & (HAL_CAN_ERROR_RX_FOV0 | HAL_CAN_ERROR_RX_FOV1)) {
+        ctx->rx_fifo_overruns++;
+        hcan->ErrorCode &= ~(HAL_CAN_ERROR_RX_FOV0 | HAL_CAN_ERROR_RX_FOV1);
+    }
+
     if (hcan->ErrorCode)
         ctx->unexpected_errors++;
 }
@@ -19,7 +19,27 @@ struct CAN_context {
     
     uint8_t node_id_rng_state = 0;
 
-    osSemaphoreId sem_send_heartbeat;
+    osThreadId thread_id = nullptr; // thread running the server, woken up by the signals below
+
+    // Received messages on their way from the RX interrupts to the server thread.
+    // Both RX interrupts have the same priority, so there is only one producer.
+    struct RxMsg_t {
+        uint32_t std_id;
+        uint8_t fifo;
+        uint8_t dlc;
+        uint8_t data[8];
+    };
+    static constexpr size_t kRxQueueSize = 64; // must be a power of two
+    RxMsg_t rx_queue[kRxQueueSize];
+    volatile uint32_t rx_queue_head = 0; // only written by the RX interrupts
+    volatile uint32_t rx_queue_tail = 0; // only written by the server thread
+    uint32_t rx_queue_overflows = 0; // messages dropped because the queue was full
+    uint32_t rx_queue_max_fill = 0; // high water mark of the queue
+    uint32_t rx_fifo_overruns = 0; // messages dropped by the hardware because an RX FIFO was full
+    volatile bool wake_on_tx_complete = false; // signal the server thread when a TX mailbox becomes free
+
+    uint32_t fibre_rx_packets = 0;
+    uint32_t fibre_errors = 0; // fibre packets that were lost to a sequence error, timeout or overflow
 
     // count occurrence various callbacks
     uint32_t TxMailboxCompleteCallbackCnt = 0;
@@ -36,6 +56,9 @@ struct CAN_context {
     uint32_t received_ack = 0;
     uint32_t unexpected_errors = 0;
     uint32_t unhandled_messages = 0;
+    uint32_t motion_msg_cnt = 0; // setpoint and state messages applied to an axis
+    uint32_t tx_dropped = 0; // feedback messages that found all TX mailboxes busy
+    uint32_t sync_cnt = 0;
 
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -45,7 +68,15 @@ struct CAN_context {
             make_protocol_ro_property("received_msg_cnt", &received_msg_cnt),
             make_protocol_ro_property("received_ack", &received_ack),
             make_protocol_ro_property("unexpected_errors", &unexpected_errors),
-            make_protocol_ro_property("unhandled_messages", &unhandled_messages)
+            make_protocol_ro_property("unhandled_messages", &unhandled_messages),
+            make_protocol_ro_property("motion_msg_cnt", &motion_msg_cnt),
+            make_protocol_ro_property("tx_dropped", &tx_dropped),
+            make_protocol_ro_property("sync_cnt", &sync_cnt),
+            make_protocol_ro_property("rx_queue_overflows", &rx_queue_overflows),
+            make_protocol_ro_property("rx_queue_max_fill", &rx_queue_max_fill),
+            make_protocol_ro_property("rx_fifo_overruns", &rx_fifo_overruns),
+            make_protocol_ro_property("fibre_rx_packets", &fibre_rx_packets),
+            make_protocol_ro_property("fibre_errors", &fibre_errors)
         );
     }
 };
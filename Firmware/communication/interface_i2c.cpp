@@ -1,29 +1,152 @@
 
+/*
+* I2C slave interface
+* -------------------
+*
+* A write selects an endpoint (register) by its 16-bit ID, optionally followed
+* by the value to write and the 16-bit JSON CRC. A subsequent read returns the
+* endpoint's value. This is handled by a regular fibre channel.
+*
+* Writing only the burst register ID I2C_BURST_REGISTER instead makes the next
+* read return I2CBurst_t, the state of both axes packed into one block. It is
+* sampled when the register ID is written and does not depend on the JSON CRC.
+*
+* Reads by the master are served by DMA, so a burst read only costs the
+* address match and stop interrupts. Writes are short and use interrupts,
+* because both I2C1 RX DMA streams are taken by SPI3.
+*/
+
 #include "interface_i2c.h"
 #include "fibre/protocol.hpp"
 
 #include <i2c.h>
 
+#include <odrive_main.h>
+
 #define I2C_RX_BUFFER_SIZE 128
 #define I2C_RX_BUFFER_PREAMBLE_SIZE   4
 #define I2C_TX_BUFFER_SIZE 128
 
+#define I2C_BURST_REGISTER 0x7ff0
+
+// @brief Layout of a read after selecting I2C_BURST_REGISTER (little endian)
+struct __attribute__((packed)) I2CBurstAxis_t {
+    float pos_estimate;  // [counts]
+    float vel_estimate;  // [counts/s]
+    float Iq_measured;   // [A]
+    uint16_t error;      // lower 16 bits of axis.error
+    uint8_t current_state;
+    uint8_t sub_errors;  // I2C_BURST_..._ERROR flags
+};
+
+// 32 bytes, so that the burst fits into the 32 byte buffer of the AVR Wire library
+struct __attribute__((packed)) I2CBurst_t {
+    I2CBurstAxis_t axes[AXIS_COUNT];
+};
+
+static_assert(sizeof(I2CBurst_t) == 32, "the burst layout is part of the protocol");
+static_assert(sizeof(I2CBurst_t) <= I2C_TX_BUFFER_SIZE, "the burst must fit into the TX buffer");
+
+enum {
+    I2C_BURST_MOTOR_ERROR = 1u << 0,
+    I2C_BURST_ENCODER_ERROR = 1u << 1,
+    I2C_BURST_SENSORLESS_ERROR = 1u << 2,
+};
+
 I2CStats_t i2c_stats_ = {0};
+ProfilerSection i2c_request_latency_;
 
 static uint8_t i2c_rx_buffer[I2C_RX_BUFFER_PREAMBLE_SIZE + I2C_RX_BUFFER_SIZE];
 static uint8_t i2c_tx_buffer[I2C_TX_BUFFER_SIZE];
 
-class I2CSender : public PacketSink {
+// The response is left in the TX buffer for the next read by the master, so
+// this never waits.
+class I2CSender : public TransportPacketSink {
 public:
     int process_packet(const uint8_t* buffer, size_t length) {
         if (length >= 2 && (length - 2) <= sizeof(i2c_tx_buffer))
             memcpy(i2c_tx_buffer, buffer + 2, length - 2);
         return 0;
     }
+    int try_process_packet(const uint8_t* buffer, size_t length) { return process_packet(buffer, length); }
     size_t get_free_space() { return SIZE_MAX; }
 } i2c1_packet_output;
 BidirectionalPacketBasedChannel i2c1_channel(i2c1_packet_output);
 
+// @brief Samples the state of both axes into the TX buffer.
+static void i2c_fill_burst() {
+    I2CBurst_t burst;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        I2CBurstAxis_t& out = burst.axes[i];
+        out.pos_estimate = axis.encoder_.pos_estimate_;
+        out.vel_estimate = axis.encoder_.vel_estimate_;
+        out.Iq_measured = axis.motor_.current_control_.Iq_measured;
+        out.error = (uint16_t)axis.error_;
+        out.current_state = (uint8_t)axis.current_state_;
+        out.sub_errors = (axis.motor_.error_ ? I2C_BURST_MOTOR_ERROR : 0)
+                       | (axis.encoder_.error_ ? I2C_BURST_ENCODER_ERROR : 0)
+                       | (axis.sensorless_estimator_.error_ ? I2C_BURST_SENSORLESS_ERROR : 0);
+    }
+    memcpy(i2c_tx_buffer, &burst, sizeof(burst));
+    i2c_stats_.burst_cnt++;
+}
+
+// @brief Sends the TX buffer by DMA for a read by the master.
+// The HAL only supports DMA outside of listen mode, so this starts the DMA
+// and leaves the state as HAL_I2C_Slave_Sequential_Transmit_IT() would,
+// except that I2C_IT_BUF stays disabled. The STOP handling of the HAL then
+// ends the listen cycle as usual, see HAL_I2C_ListenCpltCallback().
+static bool i2c_transmitting = false;
+
+static void i2c_start_tx_dma(I2C_HandleTypeDef *hi2c) {
+    static uint8_t discard[2]; // the HAL may store up to two "received" bytes on STOP
+
+    i2c_transmitting = true;
+    i2c_stats_.link.tx_cnt++;
+    if (HAL_DMA_Start(hi2c->hdmatx, (uint32_t)i2c_tx_buffer, (uint32_t)&hi2c->Instance->DR, sizeof(i2c_tx_buffer)) != HAL_OK) {
+        HAL_I2C_Slave_Sequential_Transmit_IT(hi2c, i2c_tx_buffer, sizeof(i2c_tx_buffer), I2C_FIRST_AND_LAST_FRAME);
+        return;
+    }
+    hi2c->Instance->CR1 &= ~I2C_CR1_POS;
+    hi2c->State = HAL_I2C_STATE_BUSY_TX_LISTEN;
+    hi2c->Mode = HAL_I2C_MODE_SLAVE;
+    hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+    hi2c->pBuffPtr = discard;
+    hi2c->XferCount = 0;
+    hi2c->XferSize = 0;
+    hi2c->XferOptions = I2C_FIRST_AND_LAST_FRAME;
+    hi2c->Instance->CR2 |= I2C_CR2_DMAEN;
+    __HAL_I2C_CLEAR_ADDRFLAG(hi2c);
+    __HAL_I2C_ENABLE_IT(hi2c, I2C_IT_EVT | I2C_IT_ERR);
+}
+
+// @brief Ends a read by the master, if there was one.
+// The transfer counters then refer to the receive buffer again, which was
+// left untouched since the last write was handled.
+static void i2c_end_tx(I2C_HandleTypeDef *hi2c) {
+    if (hi2c->Instance->CR2 & I2C_CR2_DMAEN) {
+        hi2c->Instance->CR2 &= ~I2C_CR2_DMAEN;
+        i2c_stats_.link.tx_bytes += sizeof(i2c_tx_buffer) - __HAL_DMA_GET_COUNTER(hi2c->hdmatx);
+        HAL_DMA_Abort(hi2c->hdmatx);
+    }
+    if (i2c_transmitting) {
+        i2c_transmitting = false;
+        hi2c->pBuffPtr = I2C_RX_BUFFER_PREAMBLE_SIZE + i2c_rx_buffer;
+        hi2c->XferCount = sizeof(i2c_rx_buffer) - I2C_RX_BUFFER_PREAMBLE_SIZE;
+    }
+}
+
+// @brief Clears the link counters and i2c_request_latency_
+void i2c_reset_stats() {
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_I2C);
+    i2c_stats_.addr_match_cnt = 0;
+    i2c_stats_.burst_cnt = 0;
+    i2c_stats_.link = {};
+    cpu_exit_masked_critical(basepri);
+    i2c_request_latency_.reset();
+}
+
 void start_i2c_server() {
     // CAN H = SDA
     // CAN L = SCL
@@ -33,15 +156,22 @@ void start_i2c_server() {
 void i2c_handle_packet(I2C_HandleTypeDef *hi2c) {
     size_t received = sizeof(i2c_rx_buffer) - hi2c->XferCount;
     if (received > I2C_RX_BUFFER_PREAMBLE_SIZE) {
-        i2c_stats_.rx_cnt++;
-        
-        write_le<uint16_t>(0, i2c_rx_buffer); // hallucinate seq-no (not needed for I2C)
-        i2c_rx_buffer[2] = i2c_rx_buffer[4]; // endpoint-id = I2C register address
-        i2c_rx_buffer[3] = i2c_rx_buffer[5] | 0x80; // MSB must be 1
-        size_t expected_bytes = (TX_BUF_SIZE - 2) < I2C_TX_BUFFER_SIZE ? (TX_BUF_SIZE - 2) : I2C_TX_BUFFER_SIZE;
-        write_le<uint16_t>(expected_bytes, i2c_rx_buffer + 4); // hallucinate maximum number of expected response bytes
-
-        i2c1_channel.process_packet(i2c_rx_buffer, received);
+        ProfilerScope latency(i2c_request_latency_);
+        i2c_stats_.link.rx_cnt++;
+        i2c_stats_.link.rx_bytes += received - I2C_RX_BUFFER_PREAMBLE_SIZE;
+
+        if (received == I2C_RX_BUFFER_PREAMBLE_SIZE + 2
+                && (i2c_rx_buffer[4] | (i2c_rx_buffer[5] << 8)) == I2C_BURST_REGISTER) {
+            i2c_fill_burst();
+        } else {
+            write_le<uint16_t>(0, i2c_rx_buffer); // hallucinate seq-no (not needed for I2C)
+            i2c_rx_buffer[2] = i2c_rx_buffer[4]; // endpoint-id = I2C register address
+            i2c_rx_buffer[3] = i2c_rx_buffer[5] | 0x80; // MSB must be 1
+            size_t expected_bytes = (TX_BUF_SIZE - 2) < I2C_TX_BUFFER_SIZE ? (TX_BUF_SIZE - 2) : I2C_TX_BUFFER_SIZE;
+            write_le<uint16_t>(expected_bytes, i2c_rx_buffer + 4); // hallucinate maximum number of expected response bytes
+
+            i2c1_channel.process_packet(i2c_rx_buffer, received);
+        }
 
         // reset receive buffer
         hi2c->pBuffPtr = I2C_RX_BUFFER_PREAMBLE_SIZE + i2c_rx_buffer;
@@ -55,6 +185,7 @@ void i2c_handle_packet(I2C_HandleTypeDef *hi2c) {
 
 
 void HAL_I2C_ListenCpltCallback(I2C_HandleTypeDef *hi2c) {
+    i2c_end_tx(hi2c);
     i2c_handle_packet(hi2c);
     // restart listening for address
     HAL_I2C_EnableListen_IT(hi2c);
@@ -62,7 +193,8 @@ void HAL_I2C_ListenCpltCallback(I2C_HandleTypeDef *hi2c) {
 
 void HAL_I2C_AddrCallback(I2C_HandleTypeDef *hi2c, uint8_t TransferDirection, uint16_t AddrMatchCode) {
     i2c_stats_.addr_match_cnt += 1;
-    
+
+    i2c_end_tx(hi2c);
     i2c_handle_packet(hi2c);
 
     if (TransferDirection == I2C_DIRECTION_TRANSMIT) {
@@ -70,7 +202,7 @@ void HAL_I2C_AddrCallback(I2C_HandleTypeDef *hi2c, uint8_t TransferDirection, ui
             I2C_RX_BUFFER_PREAMBLE_SIZE + i2c_rx_buffer,
             sizeof(i2c_rx_buffer) - I2C_RX_BUFFER_PREAMBLE_SIZE, I2C_FIRST_AND_LAST_FRAME);
     } else {
-        HAL_I2C_Slave_Sequential_Transmit_IT(hi2c, i2c_tx_buffer, sizeof(i2c_tx_buffer), I2C_FIRST_AND_LAST_FRAME);
+        i2c_start_tx_dma(hi2c);
     }
 }
 
@@ -79,8 +211,9 @@ void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
     if (!(hi2c->ErrorCode & (~HAL_I2C_ERROR_AF)))
         return;
 
-    i2c_stats_.error_cnt += 1;
+    i2c_stats_.link.error_cnt += 1;
 
     // Continue listening
+    i2c_end_tx(hi2c);
     HAL_I2C_EnableListen_IT(hi2c);
 }
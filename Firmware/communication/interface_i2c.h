@@ -1,6 +1,13 @@
 #ifndef __INTERFACE_I2C_HPP
 #define __INTERFACE_I2C_HPP
 
+#include "transport.h"
+
+#ifdef __cplusplus
+class ProfilerSection;
+extern ProfilerSection i2c_request_latency_; // [cycles] to handle a register access or burst
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -10,13 +17,14 @@ extern "C" {
 struct I2CStats_t {
     uint8_t addr;
     uint32_t addr_match_cnt;
-    uint32_t rx_cnt;
-    uint32_t error_cnt;
+    uint32_t burst_cnt;
+    TransportStats_t link;
 };
 
 extern I2CStats_t i2c_stats_;
 
 void start_i2c_server(void);
+void i2c_reset_stats(void);
 
 #ifdef __cplusplus
 }
@@ -10,11 +10,19 @@
 #include <cmsis_os.h>
 #include <freertos_vars.h>
 
-#define UART_TX_BUFFER_SIZE 64
-#define UART_RX_BUFFER_SIZE 64
+#include <odrive_main.h>
+
+#define UART_TX_BUFFER_SIZE 512
+// Can be set with CONFIG_UART_RX_BUFFER_SIZE in tup.config. The thread is
+// woken up when half of the buffer is full, so it must hold at least twice
+// the data that arrives while the thread is busy.
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 512
+#endif
 
 // DMA open loop continous circular buffer
-// 1ms delay periodic, chase DMA ptr around
+// The thread is woken up by the idle line interrupt and the half and full
+// transfer interrupts of the DMA and then chases the DMA ptr around.
 static uint8_t dma_rx_buffer[UART_RX_BUFFER_SIZE];
 static uint32_t dma_last_rcv_idx;
 
@@ -22,23 +30,44 @@ static uint32_t dma_last_rcv_idx;
 // static thread_local uint32_t deadline_ms = 0;
 
 osThreadId uart_thread;
-
-
-class UART4Sender : public StreamSink {
+TransportStats_t uart_stats_ = {0};
+ProfilerSection uart_request_latency_;
+
+
+// @brief Ring buffered UART output.
+//
+// process_bytes() appends to the ring buffer and only blocks if it is full.
+// Writers that must not block use write_nonblocking().
+// The DMA sends the longest contiguous piece of pending data. When a
+// transfer completes, the next one is started right away from the TX
+// complete interrupt, so consecutive writes keep the line busy.
+class UART4Sender : public TransportStreamSink {
 public:
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
         // Loop to ensure all bytes get sent
         while (length) {
-            size_t chunk = length < UART_TX_BUFFER_SIZE ? length : UART_TX_BUFFER_SIZE;
-            // wait for USB interface to become ready
-            // TODO: implement ring buffer to get a more continuous stream of data
-            // if (osSemaphoreWait(sem_uart_dma, deadline_to_timeout(deadline_ms)) != osOK)
-            if (osSemaphoreWait(sem_uart_dma, PROTOCOL_SERVER_TIMEOUT_MS) != osOK)
-                return -1;
-            // transmit chunk
-            memcpy(tx_buf_, buffer, chunk);
-            if (HAL_UART_Transmit_DMA(&huart4, tx_buf_, chunk) != HAL_OK)
-                return -1;
+            size_t free_space = UART_TX_BUFFER_SIZE - (tx_head_ - tx_tail_);
+            if (!free_space) {
+                // wait for the DMA to make room
+                uart_stats_.tx_wait_cnt++;
+                // if (osSemaphoreWait(sem_uart_dma, deadline_to_timeout(deadline_ms)) != osOK)
+                if (osSemaphoreWait(sem_uart_dma, PROTOCOL_SERVER_TIMEOUT_MS) != osOK) {
+                    uart_stats_.tx_overrun_cnt++;
+                    return -1;
+                }
+                continue;
+            }
+            size_t head_idx = tx_head_ % UART_TX_BUFFER_SIZE;
+            size_t chunk = std::min(std::min(length, free_space), UART_TX_BUFFER_SIZE - head_idx);
+            memcpy(tx_buf_ + head_idx, buffer, chunk);
+
+            uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+            tx_head_ += chunk;
+            if (tx_head_ - tx_tail_ > uart_stats_.tx_queue_max_fill)
+                uart_stats_.tx_queue_max_fill = tx_head_ - tx_tail_;
+            start_dma();
+            cpu_exit_masked_critical(basepri);
+
             buffer += chunk;
             length -= chunk;
             if (processed_bytes)
@@ -48,60 +77,166 @@ public:
     }
 
     size_t get_free_space() { return SIZE_MAX; }
+
+    size_t get_tx_space() { return UART_TX_BUFFER_SIZE - (tx_head_ - tx_tail_); }
+
+    // @brief Called from the TX complete interrupt
+    void on_tx_complete() {
+        tx_tail_ += dma_length_;
+        dma_length_ = 0;
+        start_dma();
+        osSemaphoreRelease(sem_uart_dma);
+    }
+
 private:
+    // Must be called with interrupts disabled or from the TX complete interrupt
+    void start_dma() {
+        if (dma_length_ || tx_head_ == tx_tail_)
+            return;
+        size_t tail_idx = tx_tail_ % UART_TX_BUFFER_SIZE;
+        size_t length = std::min(tx_head_ - tx_tail_, UART_TX_BUFFER_SIZE - tail_idx);
+        // On failure the data stays queued until the next write
+        if (HAL_UART_Transmit_DMA(&huart4, tx_buf_ + tail_idx, length) == HAL_OK) {
+            dma_length_ = length;
+            uart_stats_.tx_cnt++;
+            uart_stats_.tx_bytes += length;
+        }
+    }
+
     uint8_t tx_buf_[UART_TX_BUFFER_SIZE];
+    volatile size_t tx_head_ = 0;       // total number of bytes queued
+    volatile size_t tx_tail_ = 0;       // total number of bytes sent
+    volatile size_t dma_length_ = 0;    // length of the ongoing DMA transfer
 } uart4_stream_output;
-StreamSink* uart4_stream_output_ptr = &uart4_stream_output;
+TransportStreamSink* uart4_stream_output_ptr = &uart4_stream_output;
+
+// @brief Records how long the channel takes for each request, including
+// sending the response.
+class LatencyPacketSink : public PacketSink {
+public:
+    LatencyPacketSink(PacketSink& output, ProfilerSection& latency) : output_(output), latency_(latency) {}
+    size_t get_mtu() { return output_.get_mtu(); }
+    int process_packet(const uint8_t* buffer, size_t length) {
+        ProfilerScope scope(latency_);
+        return output_.process_packet(buffer, length);
+    }
+private:
+    PacketSink& output_;
+    ProfilerSection& latency_;
+};
 
 StreamBasedPacketSink uart4_packet_output(uart4_stream_output);
 BidirectionalPacketBasedChannel uart4_channel(uart4_packet_output);
-StreamToPacketSegmenter uart4_stream_input(uart4_channel);
+LatencyPacketSink uart4_timed_channel(uart4_channel, uart_request_latency_);
+StreamToPacketSegmenter uart4_stream_input(uart4_timed_channel);
 
 static void uart_server_thread(void * ctx) {
     (void) ctx;
 
     for (;;) {
+        // Wake up every tick while subscribed values are pushed to the host
+        osSemaphoreWait(sem_uart_rx, uart4_channel.has_subscription() ? 1 : osWaitForever);
+
         // Check for UART errors and restart recieve DMA transfer if required
         if (huart4.ErrorCode != HAL_UART_ERROR_NONE) {
+            uart_stats_.error_cnt++;
             HAL_UART_AbortReceive(&huart4);
             HAL_UART_Receive_DMA(&huart4, dma_rx_buffer, sizeof(dma_rx_buffer));
+            __HAL_UART_ENABLE_IT(&huart4, UART_IT_IDLE);
         }
         // Fetch the circular buffer "write pointer", where it would write next
         uint32_t new_rcv_idx = UART_RX_BUFFER_SIZE - huart4.hdmarx->Instance->NDTR;
+        uint32_t backlog = (new_rcv_idx + UART_RX_BUFFER_SIZE - dma_last_rcv_idx) % UART_RX_BUFFER_SIZE;
+        if (backlog > uart_stats_.rx_queue_max_fill)
+            uart_stats_.rx_queue_max_fill = backlog;
 
         // deadline_ms = timeout_to_deadline(PROTOCOL_SERVER_TIMEOUT_MS);
         // Process bytes in one or two chunks (two in case there was a wrap)
         if (new_rcv_idx < dma_last_rcv_idx) {
+            CycleLogActivity activity(CycleLog::ACTIVITY_UART);
+            uart_stats_.rx_cnt++;
+            uart_stats_.rx_bytes += UART_RX_BUFFER_SIZE - dma_last_rcv_idx;
             uart4_stream_input.process_bytes(dma_rx_buffer + dma_last_rcv_idx,
                     UART_RX_BUFFER_SIZE - dma_last_rcv_idx, nullptr); // TODO: use process_all
             ASCII_protocol_parse_stream(dma_rx_buffer + dma_last_rcv_idx,
-                    UART_RX_BUFFER_SIZE - dma_last_rcv_idx, uart4_stream_output);
+                    UART_RX_BUFFER_SIZE - dma_last_rcv_idx, uart4_stream_output, ASCII_CHANNEL_UART);
             dma_last_rcv_idx = 0;
         }
         if (new_rcv_idx > dma_last_rcv_idx) {
+            CycleLogActivity activity(CycleLog::ACTIVITY_UART);
+            uart_stats_.rx_cnt++;
+            uart_stats_.rx_bytes += new_rcv_idx - dma_last_rcv_idx;
             uart4_stream_input.process_bytes(dma_rx_buffer + dma_last_rcv_idx,
                     new_rcv_idx - dma_last_rcv_idx, nullptr); // TODO: use process_all
             ASCII_protocol_parse_stream(dma_rx_buffer + dma_last_rcv_idx,
-                    new_rcv_idx - dma_last_rcv_idx, uart4_stream_output);
+                    new_rcv_idx - dma_last_rcv_idx, uart4_stream_output, ASCII_CHANNEL_UART);
             dma_last_rcv_idx = new_rcv_idx;
         }
 
-        osDelay(1);
+        uart_stats_.rx_crc_error_cnt = uart4_stream_input.header_error_cnt_ + uart4_stream_input.crc_error_cnt_;
+        uart_stats_.rx_dropped_cnt = uart4_stream_input.oversize_cnt_;
+
+        uart4_channel.update_subscription(osKernelSysTick());
     };
 }
 
+// @brief Clears uart_stats_ and uart_request_latency_
+void uart_reset_stats() {
+    uart4_stream_input.header_error_cnt_ = 0;
+    uart4_stream_input.crc_error_cnt_ = 0;
+    uart4_stream_input.oversize_cnt_ = 0;
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_UART);
+    uart_stats_ = {};
+    cpu_exit_masked_critical(basepri);
+    uart_request_latency_.reset();
+}
+
+// @brief Reconfigures UART4 for the given baud rate.
+// Oversampling by 8 is used above PCLK1 / 16, which allows up to 5.25Mbaud.
+// @returns false if the baud rate cannot be generated
+static bool set_uart_baudrate(uint32_t baudrate) {
+    uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+    if (baudrate == 0 || baudrate > pclk / 8)
+        return false;
+    huart4.Init.BaudRate = baudrate;
+    huart4.Init.OverSampling = (baudrate > pclk / 16) ? UART_OVERSAMPLING_8 : UART_OVERSAMPLING_16;
+    return HAL_UART_Init(&huart4) == HAL_OK;
+}
+
+static uint32_t uart_server_thread_stack[STACK_SIZE_UART_SERVER];
+static osStaticThreadDef_t uart_server_thread_tcb;
+
 void start_uart_server() {
+    if (board_config.uart_baudrate != huart4.Init.BaudRate)
+        set_uart_baudrate(board_config.uart_baudrate);
+
     // DMA is set up to recieve in a circular buffer forever.
-    // We dont use interrupts to fetch the data, instead we periodically read
-    // data out of the circular buffer into a parse buffer, controlled by a state machine
+    // The interrupts only wake up the thread, which then reads the data out
+    // of the circular buffer into a parse buffer, controlled by a state machine
     HAL_UART_Receive_DMA(&huart4, dma_rx_buffer, sizeof(dma_rx_buffer));
     dma_last_rcv_idx = UART_RX_BUFFER_SIZE - huart4.hdmarx->Instance->NDTR;
+    __HAL_UART_ENABLE_IT(&huart4, UART_IT_IDLE);
 
     // Start UART communication thread
-    osThreadDef(uart_server_thread_def, uart_server_thread, osPriorityNormal, 0, 1024 /* the ascii protocol needs considerable stack space */);
+    osThreadStaticDef(uart_server_thread_def, uart_server_thread, THREAD_PRIO_UART, 0, STACK_SIZE_UART_SERVER,
+            uart_server_thread_stack, &uart_server_thread_tcb);
     uart_thread = osThreadCreate(osThread(uart_server_thread_def), NULL);
 }
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart) {
-    osSemaphoreRelease(sem_uart_dma);
+    if (huart == &huart4)
+        uart4_stream_output.on_tx_complete();
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef* huart) {
+    osSemaphoreRelease(sem_uart_rx);
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef* huart) {
+    osSemaphoreRelease(sem_uart_rx);
+}
+
+// The thread restarts the reception
+void HAL_UART_ErrorCallback(UART_HandleTypeDef* huart) {
+    osSemaphoreRelease(sem_uart_rx);
 }
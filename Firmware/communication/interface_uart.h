@@ -1,18 +1,25 @@
 #ifndef __INTERFACE_UART_HPP
 #define __INTERFACE_UART_HPP
 
+#include "transport.h"
+
 #ifdef __cplusplus
 #include "fibre/protocol.hpp"
-extern StreamSink* uart4_stream_output_ptr;
+extern TransportStreamSink* uart4_stream_output_ptr;
+class ProfilerSection;
+extern ProfilerSection uart_request_latency_; // [cycles] to handle a native protocol request
 
 extern "C" {
 #endif
 
 #include <cmsis_os.h>
+#include <stddef.h>
 
 extern osThreadId uart_thread;
+extern TransportStats_t uart_stats_;
 
 void start_uart_server(void);
+void uart_reset_stats(void);
 
 #ifdef __cplusplus
 }
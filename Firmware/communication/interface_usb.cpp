@@ -14,53 +14,90 @@
 #include <odrive_main.h>
 
 osThreadId usb_thread;
-USBStats_t usb_stats_ = {0};
+osThreadId usb_cdc_thread;
+TransportStats_t usb_stats_ = {0};
+ProfilerSection usb_request_latency_;
+USBTelemetry_t usb_telemetry_ = {0};
 
-class USBSender : public PacketSink {
+class USBSender : public TransportPacketSink {
 public:
-    USBSender(uint8_t endpoint_pair, const osSemaphoreId& sem_usb_tx)
-            : endpoint_pair_(endpoint_pair), sem_usb_tx_(sem_usb_tx) {}
+    USBSender(uint8_t endpoint_pair, const osSemaphoreId& sem_usb_tx, size_t max_transfer_size, size_t mtu)
+            : endpoint_pair_(endpoint_pair), sem_usb_tx_(sem_usb_tx),
+              max_transfer_size_(max_transfer_size), mtu_(mtu) {}
+
+    size_t get_mtu() { return mtu_; }
 
     int process_packet(const uint8_t* buffer, size_t length) {
         // cannot send partial packets
-        if (length > USB_TX_DATA_SIZE)
+        if (length > max_transfer_size_)
             return -1;
         // wait for USB interface to become ready
-        if (osSemaphoreWait(sem_usb_tx_, PROTOCOL_SERVER_TIMEOUT_MS) != osOK) {
-            // If the host resets the device it might be that the TX-complete handler is never called
-            // and the sem_usb_tx_ semaphore is never released. To handle this we just override the
-            // TX buffer if this wait times out. The implication is that the channel is no longer lossless.
-            // TODO: handle endpoint reset properly
-            usb_stats_.tx_overrun_cnt++;
+        if (osSemaphoreWait(sem_usb_tx_, 0) != osOK) {
+            usb_stats_.tx_wait_cnt++;
+            if (osSemaphoreWait(sem_usb_tx_, PROTOCOL_SERVER_TIMEOUT_MS) != osOK) {
+                // If the host resets the device it might be that the TX-complete handler is never called
+                // and the sem_usb_tx_ semaphore is never released. To handle this we just override the
+                // TX buffer if this wait times out. The implication is that the channel is no longer lossless.
+                // TODO: handle endpoint reset properly
+                usb_stats_.tx_overrun_cnt++;
+            }
         }
-        // transmit packet
+        return transmit(buffer, length);
+    }
+
+    int try_process_packet(const uint8_t* buffer, size_t length) {
+        if (length > max_transfer_size_)
+            return -1;
+        if (osSemaphoreWait(sem_usb_tx_, 0) != osOK)
+            return -1;
+        return transmit(buffer, length);
+    }
+
+    // @brief True if the previous transfer on the endpoint has completed
+    bool tx_ready() { return osSemaphoreGetCount(sem_usb_tx_) > 0; }
+
+private:
+    // Must be called with sem_usb_tx_ taken
+    int transmit(const uint8_t* buffer, size_t length) {
         uint8_t status = CDC_Transmit_FS(
                 const_cast<uint8_t*>(buffer) /* casting this const away is safe because...
                 well... it's not actually. Stupid STM. */, length, endpoint_pair_);
         if (status != USBD_OK) {
             osSemaphoreRelease(sem_usb_tx_);
+            usb_stats_.error_cnt++;
             return -1;
         }
         usb_stats_.tx_cnt++;
+        usb_stats_.tx_bytes += length;
         return 0;
     }
-private:
+
     uint8_t endpoint_pair_;
     const osSemaphoreId& sem_usb_tx_;
+    size_t max_transfer_size_;
+    size_t mtu_;
 };
 
-// Note we could have independent semaphores here to allow concurrent transmission
-USBSender usb_packet_output_cdc(CDC_OUT_EP, sem_usb_tx);
-USBSender usb_packet_output_native(ODRIVE_OUT_EP, sem_usb_tx);
+// Each endpoint pair has its own semaphore, so CDC output (e.g. printf) does
+// not hold up native protocol responses and vice versa.
+// Packets on the CDC endpoint stay below one full USB packet, because nothing
+// marks the end of a full one. The native endpoint sends packets of up to
+// USB_NATIVE_TX_DATA_SIZE as one multi-packet transfer, ended by a short or
+// zero length packet (see USBD_CDC_DataIn), so large responses such as
+// buffer reads take a single transfer.
+USBSender usb_packet_output_cdc(CDC_OUT_EP, sem_usb_tx_cdc, USB_TX_DATA_SIZE, USB_TX_DATA_SIZE - 1);
+USBSender usb_packet_output_native(ODRIVE_OUT_EP, sem_usb_tx_native, USB_NATIVE_TX_DATA_SIZE, USB_NATIVE_TX_DATA_SIZE);
 
-class TreatPacketSinkAsStreamSink : public StreamSink {
+// @brief Sends a stream on the CDC endpoint, one USB packet per chunk.
+// Without waiting, one packet can be sent whenever the endpoint is idle.
+class TreatPacketSinkAsStreamSink : public TransportStreamSink {
 public:
-    TreatPacketSinkAsStreamSink(PacketSink& output) : output_(output) {}
+    TreatPacketSinkAsStreamSink(USBSender& output) : output_(output) {}
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
         // Loop to ensure all bytes get sent
         while (length) {
             size_t chunk = length < USB_TX_DATA_SIZE ? length : USB_TX_DATA_SIZE;
-            if (output_.process_packet(buffer, length) != 0)
+            if (output_.process_packet(buffer, chunk) != 0)
                 return -1;
             buffer += chunk;
             length -= chunk;
@@ -70,13 +107,18 @@ public:
         return 0;
     }
     size_t get_free_space() { return SIZE_MAX; }
+    size_t get_tx_space() { return output_.tx_ready() ? USB_TX_DATA_SIZE : 0; }
+    size_t write_nonblocking(const uint8_t* buffer, size_t length) {
+        size_t chunk = length < USB_TX_DATA_SIZE ? length : USB_TX_DATA_SIZE;
+        return output_.try_process_packet(buffer, chunk) == 0 ? chunk : 0;
+    }
 private:
-    PacketSink& output_;
+    USBSender& output_;
 } usb_stream_output(usb_packet_output_cdc);
 
 // This is used by the printf feature. Hence the above statics, and below seemingly random ptr (it's externed)
 // TODO: less spaghetti code
-StreamSink* usb_stream_output_ptr = &usb_stream_output;
+TransportStreamSink* usb_stream_output_ptr = &usb_stream_output;
 
 #if defined(USB_PROTOCOL_NATIVE)
 BidirectionalPacketBasedChannel usb_channel(usb_packet_output_native);
@@ -86,72 +128,146 @@ BidirectionalPacketBasedChannel usb_channel(usb_packetized_output);
 StreamToPacketSegmenter usb_native_stream_input(usb_channel);
 #endif
 
+// @brief Double buffered reception on one endpoint pair.
+//
+// The USB stack receives into a buffer and hands it to usb_rx_process_packet.
+// If the other buffer is free, reception is immediately re-armed into it, so
+// the host can send the next packet while the server thread is still
+// processing the previous one. Received packets are processed in place.
+// Only if both buffers are full the endpoint NAKs until one is processed.
 struct USBInterface {
-    uint8_t* rx_buf = nullptr;
-    uint32_t rx_len = 0;
-    bool data_pending = false;
     uint8_t out_ep;
     uint8_t in_ep;
     USBSender& usb_sender;
+    uint8_t* driver_buf;                    // buffer set up by CDC_Init_FS, learned from the first packet
+    uint8_t spare_buf[USB_RX_DATA_SIZE];
+    uint8_t* rx_buf[2];                     // received packets, oldest first
+    uint32_t rx_len[2];
+    volatile uint8_t rx_pending;            // number of valid entries in rx_buf
+    volatile bool rx_armed;                 // reception is armed into the buffer that is not pending
+    osSemaphoreId* sem_rx;                  // released for every received packet
 };
 
 // Note: statics make this less modular.
-// Note: we use a single rx semaphore and loop over data_pending to allow a single pump loop thread
+// Note: both interfaces share sem_usb_rx and the native server thread,
+// unless the ASCII protocol is enabled on USB at startup. The CDC interface
+// then has its own semaphore and lower priority thread, so that a slow ASCII
+// response doesn't delay the native protocol.
 static USBInterface CDC_interface = {
-    .rx_buf = nullptr,
-    .rx_len = 0,
-    .data_pending = false,
     .out_ep = CDC_OUT_EP,
     .in_ep = CDC_IN_EP,
     .usb_sender = usb_packet_output_cdc,
+    .driver_buf = nullptr,
+    .spare_buf = { 0 },
+    .rx_buf = { nullptr, nullptr },
+    .rx_len = { 0, 0 },
+    .rx_pending = 0,
+    .rx_armed = true,
+    .sem_rx = &sem_usb_rx,
 };
 static USBInterface ODrive_interface = {
-    .rx_buf = nullptr,
-    .rx_len = 0,
-    .data_pending = false,
     .out_ep = ODRIVE_OUT_EP,
     .in_ep = ODRIVE_IN_EP,
     .usb_sender = usb_packet_output_native,
+    .driver_buf = nullptr,
+    .spare_buf = { 0 },
+    .rx_buf = { nullptr, nullptr },
+    .rx_len = { 0, 0 },
+    .rx_pending = 0,
+    .rx_armed = true,
+    .sem_rx = &sem_usb_rx,
 };
+static bool cdc_ascii_thread = false; // the CDC interface is served by usb_cdc_server_thread
+
+static void arm_reception(USBInterface& iface, uint8_t* buf) {
+    iface.rx_armed = true;
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, buf, iface.out_ep);
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS, iface.out_ep);
+}
+
+// @brief Returns the oldest received packet or false if there is none.
+static bool peek_packet(USBInterface& iface, uint8_t** buf, uint32_t* len) {
+    if (!iface.rx_pending)
+        return false;
+    *buf = iface.rx_buf[0];
+    *len = iface.rx_len[0];
+    return true;
+}
+
+// @brief Releases the oldest received packet and re-arms reception into it
+// if both buffers were full.
+static void release_packet(USBInterface& iface) {
+    uint8_t* buf = iface.rx_buf[0];
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_USB);
+    iface.rx_buf[0] = iface.rx_buf[1];
+    iface.rx_len[0] = iface.rx_len[1];
+    iface.rx_pending--;
+    bool rearm = !iface.rx_armed;
+    cpu_exit_masked_critical(basepri);
+    // Reception is not armed, so the USB stack can't call back concurrently
+    if (rearm)
+        arm_reception(iface, buf);
+}
 
 static void usb_server_thread(void * ctx) {
     (void) ctx;
     
     for (;;) {
         // const uint32_t usb_check_timeout = 1; // ms
-        osStatus sem_stat = osSemaphoreWait(sem_usb_rx, osWaitForever);
+        // Wake up every tick while subscribed values are pushed to the host
+        osStatus sem_stat = osSemaphoreWait(sem_usb_rx, usb_channel.has_subscription() ? 1 : osWaitForever);
         if (sem_stat == osOK) {
-            usb_stats_.rx_cnt++;
+            CycleLogActivity activity(CycleLog::ACTIVITY_USB);
+            uint8_t* buf;
+            uint32_t len;
 
-            // CDC Interface
-            if (CDC_interface.data_pending) {
-                CDC_interface.data_pending = false;
+            // CDC Interface, unless it has its own thread
+            while (!cdc_ascii_thread && peek_packet(CDC_interface, &buf, &len)) {
                 if (board_config.enable_ascii_protocol_on_usb) {
-                    ASCII_protocol_parse_stream(CDC_interface.rx_buf,
-                            CDC_interface.rx_len, usb_stream_output);
+                    ASCII_protocol_parse_stream(buf, len, usb_stream_output, ASCII_CHANNEL_USB);
                 } else {
 #if defined(USB_PROTOCOL_NATIVE)
-                    usb_channel.process_packet(CDC_interface.rx_buf, CDC_interface.rx_len);
+                    ProfilerScope latency(usb_request_latency_);
+                    usb_channel.process_packet(buf, len);
 #elif defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
-                    usb_native_stream_input.process_bytes(
-                            CDC_interface.rx_buf, CDC_interface.rx_len, nullptr);
+                    usb_native_stream_input.process_bytes(buf, len, nullptr);
 #endif
                 }
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS, CDC_interface.out_ep);  // Allow next packet
+                release_packet(CDC_interface);
             }
 
             // Native Interface
-            if (ODrive_interface.data_pending) {
-                ODrive_interface.data_pending = false;
+            while (peek_packet(ODrive_interface, &buf, &len)) {
 #if defined(USB_PROTOCOL_NATIVE)
-                usb_channel.process_packet(ODrive_interface.rx_buf, ODrive_interface.rx_len);
+                ProfilerScope latency(usb_request_latency_);
+                usb_channel.process_packet(buf, len);
 #elif defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
-                usb_native_stream_input.process_bytes(
-                        ODrive_interface.rx_buf, ODrive_interface.rx_len, nullptr);
+                usb_native_stream_input.process_bytes(buf, len, nullptr);
+                usb_stats_.rx_crc_error_cnt = usb_native_stream_input.header_error_cnt_ + usb_native_stream_input.crc_error_cnt_;
+                usb_stats_.rx_dropped_cnt = usb_native_stream_input.oversize_cnt_;
 #endif
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS, ODrive_interface.out_ep);  // Allow next packet
+                release_packet(ODrive_interface);
             }
         }
+
+        usb_channel.update_subscription(osKernelSysTick());
+    }
+}
+
+// @brief Runs the ASCII protocol on the CDC interface.
+static void usb_cdc_server_thread(void * ctx) {
+    (void) ctx;
+
+    for (;;) {
+        // Packets may have arrived before the thread was started
+        uint8_t* buf;
+        uint32_t len;
+        while (peek_packet(CDC_interface, &buf, &len)) {
+            CycleLogActivity activity(CycleLog::ACTIVITY_USB_CDC);
+            ASCII_protocol_parse_stream(buf, len, usb_stream_output, ASCII_CHANNEL_USB);
+            release_packet(CDC_interface);
+        }
+        osSemaphoreWait(sem_usb_rx_cdc, osWaitForever);
     }
 }
 
@@ -167,16 +283,128 @@ void usb_rx_process_packet(uint8_t *buf, uint32_t len, uint8_t endpoint_pair) {
         return;
     }
 
-    // We don't allow the next USB packet until the previous one has been processed completely.
-    // Therefore it's safe to write to these vars directly since we know previous processing is complete.
-    usb_iface->rx_buf = buf;
-    usb_iface->rx_len = len;
-    usb_iface->data_pending = true;
-    osSemaphoreRelease(sem_usb_rx);
+    if (buf != usb_iface->spare_buf)
+        usb_iface->driver_buf = buf;
+
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_USB);
+    // Reception is only armed while a buffer is free, so this can't overflow
+    usb_iface->rx_buf[usb_iface->rx_pending] = buf;
+    usb_iface->rx_len[usb_iface->rx_pending] = len;
+    usb_iface->rx_pending++;
+    usb_iface->rx_armed = false;
+    usb_stats_.rx_cnt++;
+    usb_stats_.rx_bytes += len;
+    if (usb_iface->rx_pending > usb_stats_.rx_queue_max_fill)
+        usb_stats_.rx_queue_max_fill = usb_iface->rx_pending;
+    bool rearm = usb_iface->rx_pending < 2;
+    cpu_exit_masked_critical(basepri);
+
+    // Receive the next packet into the other buffer while this one is processed
+    if (rearm)
+        arm_reception(*usb_iface, buf == usb_iface->spare_buf ? usb_iface->driver_buf : usb_iface->spare_buf);
+    osSemaphoreRelease(*usb_iface->sem_rx);
 }
 
+// @brief Fixed-size status of both axes for real-time host control loops.
+// The layout must match USB_TELEMETRY_FORMAT in tools/odrive/utils.py.
+struct USBTelemetryFrame {
+    uint16_t frame_count;       // 15 bit counter, MSB clear
+    uint16_t endpoint_id;       // TELEMETRY_ENDPOINT_ID
+    uint32_t meas_count;        // [current measurements] low 32 bits of axis0.meas_count
+    float vbus_voltage;         // [V]
+    struct {
+        float pos_estimate;     // [counts]
+        float vel_estimate;     // [counts/s]
+        float Iq_setpoint;      // [A]
+        float Iq_measured;      // [A]
+        uint16_t error;
+        uint16_t motor_error;
+        uint16_t encoder_error;
+        uint8_t current_state;
+        uint8_t reserved;
+    } axes[AXIS_COUNT];
+} __attribute__((packed));
+static_assert(sizeof(USBTelemetryFrame) < CDC_DATA_FS_MAX_PACKET_SIZE, "telemetry must fit into one USB packet");
+
+// @brief Pushes a telemetry frame on the native endpoint while
+// usb_telemetry_.enabled is set.
+//
+// This runs at the start of every 1 ms USB frame, so that the frame is in the
+// endpoint before the host polls it and its values are never older than one
+// frame. It does not go through usb_server_thread. If a response is still
+// being sent, this frame is skipped instead of waiting.
+void usb_start_of_frame() {
+    if (!usb_telemetry_.enabled)
+        return;
+    if (!usb_packet_output_native.tx_ready()) {
+        usb_telemetry_.skipped_cnt++;
+        return;
+    }
+
+    static uint16_t frame_count = 0;
+    USBTelemetryFrame frame = {};
+    frame.frame_count = frame_count;
+    frame.endpoint_id = TELEMETRY_ENDPOINT_ID;
+    // Each axis is reported as of its last control loop iteration
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        AxisSnapshot_t snapshot;
+        if (!axes[i] || !axes[i]->snapshot_buffer_.read(&snapshot))
+            continue;
+        if (i == 0) {
+            frame.meas_count = snapshot.meas_count;
+            frame.vbus_voltage = snapshot.vbus_voltage;
+        }
+        frame.axes[i].pos_estimate = snapshot.pos_estimate;
+        frame.axes[i].vel_estimate = snapshot.vel_estimate;
+        frame.axes[i].Iq_setpoint = snapshot.Iq_setpoint;
+        frame.axes[i].Iq_measured = snapshot.Iq_measured;
+        frame.axes[i].error = snapshot.error;
+        frame.axes[i].motor_error = snapshot.motor_error;
+        frame.axes[i].encoder_error = snapshot.encoder_error;
+        frame.axes[i].current_state = snapshot.current_state;
+    }
+
+    if (usb_packet_output_native.try_process_packet(reinterpret_cast<uint8_t*>(&frame), sizeof(frame)) != 0) {
+        usb_telemetry_.skipped_cnt++;
+        return;
+    }
+    frame_count = (frame_count + 1) & 0x7fff;
+    usb_telemetry_.frame_cnt++;
+}
+
+static uint32_t usb_server_thread_stack[STACK_SIZE_USB_SERVER];
+static osStaticThreadDef_t usb_server_thread_tcb;
+static uint32_t usb_cdc_server_thread_stack[STACK_SIZE_USB_CDC_SERVER];
+static osStaticThreadDef_t usb_cdc_server_thread_tcb;
+
 void start_usb_server() {
+    // The CDC interface is assigned to a thread once, so that the two threads
+    // never process the same interface. If enable_ascii_protocol_on_usb is
+    // only set later, the native thread runs the ASCII protocol until the
+    // next reboot, and a CDC thread that was started keeps running it.
+    if (board_config.enable_ascii_protocol_on_usb) {
+        CDC_interface.sem_rx = &sem_usb_rx_cdc; // single word, the USB interrupt sees either one
+        cdc_ascii_thread = true;
+        osThreadStaticDef(usb_cdc_server_thread_def, usb_cdc_server_thread, THREAD_PRIO_USB_CDC, 0,
+                STACK_SIZE_USB_CDC_SERVER, usb_cdc_server_thread_stack, &usb_cdc_server_thread_tcb);
+        usb_cdc_thread = osThreadCreate(osThread(usb_cdc_server_thread_def), NULL);
+    }
+
     // Start USB communication thread
-    osThreadDef(usb_server_thread_def, usb_server_thread, osPriorityNormal, 0, 512);
+    osThreadStaticDef(usb_server_thread_def, usb_server_thread, THREAD_PRIO_USB, 0, STACK_SIZE_USB_SERVER,
+            usb_server_thread_stack, &usb_server_thread_tcb);
     usb_thread = osThreadCreate(osThread(usb_server_thread_def), NULL);
 }
+
+// @brief Clears usb_stats_ and usb_request_latency_
+void usb_reset_stats() {
+#if defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
+    usb_native_stream_input.header_error_cnt_ = 0;
+    usb_native_stream_input.crc_error_cnt_ = 0;
+    usb_native_stream_input.oversize_cnt_ = 0;
+#endif
+    uint32_t basepri = cpu_enter_masked_critical(IRQ_PRIO_USB);
+    usb_stats_ = {};
+    cpu_exit_masked_critical(basepri);
+    usb_request_latency_.reset();
+}
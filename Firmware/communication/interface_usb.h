@@ -1,28 +1,38 @@
 #ifndef __INTERFACE_USB_HPP
 #define __INTERFACE_USB_HPP
 
+#include "transport.h"
+
 #ifdef __cplusplus
 #include "fibre/protocol.hpp"
-extern StreamSink* usb_stream_output_ptr;
+extern TransportStreamSink* usb_stream_output_ptr;
+class ProfilerSection;
+extern ProfilerSection usb_request_latency_; // [cycles] to handle a native protocol request
 
 extern "C" {
 #endif
 
 #include <cmsis_os.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 extern osThreadId usb_thread;
+extern osThreadId usb_cdc_thread; // NULL unless the ASCII protocol is enabled on USB at startup
+
+extern TransportStats_t usb_stats_;
 
 typedef struct {
-    uint32_t rx_cnt;
-    uint32_t tx_cnt;
-    uint32_t tx_overrun_cnt;
-} USBStats_t;
+    bool enabled;          // push a telemetry frame at the start of every USB frame, cleared when the host reconfigures the device
+    uint32_t frame_cnt;    // frames that were sent
+    uint32_t skipped_cnt;  // USB frames without telemetry because a response was being sent
+} USBTelemetry_t;
 
-extern USBStats_t usb_stats_;
+extern USBTelemetry_t usb_telemetry_;
 
 void usb_rx_process_packet(uint8_t *buf, uint32_t len, uint8_t endpoint_pair);
+void usb_start_of_frame(void);
 void start_usb_server(void);
+void usb_reset_stats(void);
 
 #ifdef __cplusplus
 }
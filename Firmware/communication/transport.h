@@ -0,0 +1,83 @@
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// @brief Statistics that every host interface (USB, UART, I2C) keeps in the
+// same form, so that the links can be compared with each other.
+typedef struct {
+    uint32_t rx_cnt;            // packets (USB, I2C) or DMA chunks (UART) received
+    uint32_t rx_bytes;
+    uint32_t tx_cnt;            // packets (USB) or DMA transfers (UART, I2C) started
+    uint32_t tx_bytes;
+    uint32_t tx_wait_cnt;       // writes that had to wait for the interface to become ready
+    uint32_t tx_overrun_cnt;    // writes that timed out waiting, the data was overwritten or dropped
+    uint32_t error_cnt;         // errors reported by the peripheral
+    uint32_t rx_crc_error_cnt;  // frames with a bad header or payload CRC (stream based links)
+    uint32_t rx_dropped_cnt;    // frames dropped because they were too large
+    uint32_t rx_queue_max_fill; // highest receive backlog: buffers (USB) or bytes (UART)
+    uint32_t tx_queue_max_fill; // [bytes] highest transmit backlog (UART)
+} TransportStats_t;
+
+#ifdef __cplusplus
+}
+
+#include <fibre/protocol.hpp>
+#include <algorithm>
+
+// @brief Output stream of a host interface that can also be written without
+// waiting.
+//
+// process_bytes() keeps blocking until everything is queued. Writers that
+// must not block, such as the log thread or periodic telemetry, use
+// write_nonblocking() and retry the rest later. This is the flow control:
+// the interface takes what it can send and the writer keeps the remainder.
+class TransportStreamSink : public StreamSink {
+public:
+    // @brief Number of bytes that process_bytes() takes right now without waiting
+    virtual size_t get_tx_space() = 0;
+
+    // @brief Writes as much of buffer as fits without waiting
+    // @returns the number of bytes that were taken
+    virtual size_t write_nonblocking(const uint8_t* buffer, size_t length) {
+        size_t processed_bytes = 0;
+        length = std::min(length, get_tx_space());
+        if (length)
+            process_bytes(buffer, length, &processed_bytes);
+        return processed_bytes;
+    }
+};
+
+// @brief Packet output of a host interface that can also be written without
+// waiting.
+class TransportPacketSink : public PacketSink {
+public:
+    // @brief Sends the packet only if the interface is ready for it right now
+    // @returns 0 on success, otherwise non-zero and nothing was sent
+    virtual int try_process_packet(const uint8_t* buffer, size_t length) = 0;
+};
+
+// @brief Exposes all counters of a TransportStats_t as read-only properties.
+// Can be passed among the other members of an interface object.
+inline auto make_transport_stats_definitions(TransportStats_t& stats) {
+    return make_protocol_member_list(
+        make_protocol_ro_property("rx_cnt", &stats.rx_cnt),
+        make_protocol_ro_property("rx_bytes", &stats.rx_bytes),
+        make_protocol_ro_property("tx_cnt", &stats.tx_cnt),
+        make_protocol_ro_property("tx_bytes", &stats.tx_bytes),
+        make_protocol_ro_property("tx_wait_cnt", &stats.tx_wait_cnt),
+        make_protocol_ro_property("tx_overrun_cnt", &stats.tx_overrun_cnt),
+        make_protocol_ro_property("error_cnt", &stats.error_cnt),
+        make_protocol_ro_property("rx_crc_error_cnt", &stats.rx_crc_error_cnt),
+        make_protocol_ro_property("rx_dropped_cnt", &stats.rx_dropped_cnt),
+        make_protocol_ro_property("rx_queue_max_fill", &stats.rx_queue_max_fill),
+        make_protocol_ro_property("tx_queue_max_fill", &stats.tx_queue_max_fill)
+    );
+}
+#endif
+
+#endif // __TRANSPORT_H
@@ -0,0 +1,279 @@
+
+#include <fibre/client.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+/* ClientChannel -------------------------------------------------------------*/
+
+bool ClientChannel::connect(uint16_t expected_json_crc) {
+    uint8_t offset[4];
+    uint8_t info[10];
+    size_t received = 0;
+    write_le<uint32_t>(JSONDescriptorEndpoint::kInfoOffset, offset);
+    if (!operation(0, nullptr, offset, sizeof(offset), info, sizeof(info), &received))
+        return false;
+    bool has_info = received >= 2;
+    if (has_info)
+        read_le<uint16_t>(&json_crc_, info);
+
+    // The length of the first chunk of the JSON tells if the server sends
+    // large responses. Older servers have no info, so the CRC is calculated
+    // over the whole JSON like the Python client does.
+    CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
+    uint8_t chunk[kMaxResponseSize];
+    for (uint32_t json_offset = 0; ; json_offset += received) {
+        write_le<uint32_t>(json_offset, offset);
+        if (!operation(0, nullptr, offset, sizeof(offset), chunk, sizeof(chunk), &received))
+            return false;
+        if (json_offset == 0)
+            large_responses_ = received > kLegacyMaxResponseSize;
+        if (has_info || !received)
+            break;
+        crc16_calculator.process_bytes(chunk, received, nullptr);
+    }
+    if (!has_info)
+        json_crc_ = crc16_calculator.get_crc16();
+
+    use_path_hashes_ = expected_json_crc && (json_crc_ != expected_json_crc);
+    return true;
+}
+
+bool ClientChannel::endpoint_operation(RemoteEndpoint endpoint, const uint8_t* input, size_t input_length,
+                                       uint8_t* output, size_t output_length, size_t* received) {
+    if (use_path_hashes_ && endpoint.id != 0)
+        return endpoint.path_hash && operation(HASHED_ENDPOINT_ID, &endpoint.path_hash,
+                                               input, input_length, output, output_length, received);
+    return operation(endpoint.id, nullptr, input, input_length, output, output_length, received);
+}
+
+int ClientChannel::subscribe(const RemoteEndpoint* endpoints, size_t count, uint16_t interval_ms,
+                             frame_callback_t callback, void* ctx) {
+    if (use_path_hashes_ || count > MAX_SUBSCRIBED_ENDPOINTS)
+        return 0;
+    uint8_t request[2 + 2 * MAX_SUBSCRIBED_ENDPOINTS];
+    write_le<uint16_t>(interval_ms, request);
+    for (size_t i = 0; i < count; ++i)
+        write_le<uint16_t>(endpoints[i].id, request + 2 + 2 * i);
+
+    // The first frame may arrive right after the response
+    subscription_callback_ = callback;
+    subscription_ctx_ = ctx;
+    uint8_t response[2];
+    size_t received = 0;
+    if (!operation(SUBSCRIPTION_ENDPOINT_ID, nullptr, request, 2 + 2 * count, response, sizeof(response), &received)
+        || received != sizeof(response)) {
+        subscription_callback_ = nullptr;
+        return -1;
+    }
+    uint16_t payload_length = 0;
+    read_le<uint16_t>(&payload_length, response);
+    if (!payload_length || !(interval_ms & ~SUBSCRIPTION_ON_CHANGE))
+        subscription_callback_ = nullptr;
+    return payload_length;
+}
+
+int ClientChannel::poll(uint32_t timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    int n_frames = 0;
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return n_frames;
+        uint32_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        size_t length = 0;
+        int status = input_.get_packet(rx_buf_, sizeof(rx_buf_), &length, remaining);
+        if (status < 0)
+            return -1;
+        if (status > 0 && dispatch_frame(rx_buf_, length))
+            n_frames++;
+    }
+}
+
+// @brief Sends a request and waits for its response.
+// @param path_hash: If not null, it is sent in front of the input and the
+//        trailer is the protocol version (see HASHED_ENDPOINT_ID).
+bool ClientChannel::operation(uint16_t endpoint_id, const uint32_t* path_hash, const uint8_t* input, size_t input_length,
+                              uint8_t* output, size_t output_length, size_t* received) {
+    size_t header_length = path_hash ? 10 : 6;
+    size_t request_length = header_length + input_length + 2;
+    if (request_length > kMaxRequestSize || output_length > kMaxResponseSize)
+        return false;
+
+    // Same sequence as the Python client, which keeps bit 7 set to avoid
+    // conflicts with the ASCII protocol
+    seq_no_ = ((seq_no_ + 1) | 0x80) & 0x7fff;
+
+    uint8_t request[kMaxRequestSize];
+    write_le<uint16_t>(seq_no_, request);
+    write_le<uint16_t>(endpoint_id | 0x8000, request + 2);
+    // Larger responses are only sent if the MSB is set (see process_packet())
+    uint16_t expected_length = output_length > kLegacyMaxResponseSize ? (output_length | 0x8000) : output_length;
+    write_le<uint16_t>(expected_length, request + 4);
+    if (path_hash)
+        write_le<uint32_t>(*path_hash, request + 6);
+    if (input_length)
+        memcpy(request + header_length, input, input_length);
+    uint16_t trailer = (endpoint_id == 0 || path_hash) ? PROTOCOL_VERSION : json_crc_;
+    write_le<uint16_t>(trailer, request + header_length + input_length);
+
+    // A resent request gets the cached response, so it is not run twice
+    for (size_t attempt = 0; attempt < send_attempts; ++attempt) {
+        if (output_.process_packet(request, request_length))
+            continue;
+        int status = wait_for_response(seq_no_, output, output_length, received);
+        if (status)
+            return status > 0;
+    }
+    return false;
+}
+
+// @return: 1 if the response arrived, 0 on timeout, -1 if the link is broken
+int ClientChannel::wait_for_response(uint16_t seq_no, uint8_t* output, size_t output_length, size_t* received) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return 0;
+        uint32_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        size_t length = 0;
+        int status = input_.get_packet(rx_buf_, sizeof(rx_buf_), &length, remaining);
+        if (status < 0)
+            return -1;
+        if (status == 0 || length < 2)
+            continue;
+
+        uint16_t packet_seq_no = 0;
+        read_le<uint16_t>(&packet_seq_no, rx_buf_);
+        if (packet_seq_no == (seq_no | 0x8000)) {
+            size_t n_copy = std::min(length - 2, output_length);
+            if (n_copy)
+                memcpy(output, rx_buf_ + 2, n_copy);
+            if (received)
+                *received = n_copy;
+            return 1;
+        }
+        dispatch_frame(rx_buf_, length);
+    }
+}
+
+// @brief Passes a frame that the device pushed to its callback.
+// Responses to earlier requests that timed out and NACK frames (which are
+// only sent to hosts that send acks) are dropped.
+// @return: true if the packet was a subscription or telemetry frame
+bool ClientChannel::dispatch_frame(const uint8_t* packet, size_t length) {
+    if (length < 4 || (packet[1] & 0x80))
+        return false;
+    uint16_t frame_no = 0;
+    uint16_t endpoint_id = 0;
+    read_le<uint16_t>(&frame_no, packet);
+    read_le<uint16_t>(&endpoint_id, packet + 2);
+    if (endpoint_id == SUBSCRIPTION_ENDPOINT_ID) {
+        if (subscription_callback_)
+            subscription_callback_(subscription_ctx_, frame_no, packet + 4, length - 4);
+        return true;
+    } else if (endpoint_id == TELEMETRY_ENDPOINT_ID) {
+        if (telemetry_callback_)
+            telemetry_callback_(telemetry_ctx_, frame_no, packet + 4, length - 4);
+        return true;
+    }
+    return false;
+}
+
+
+/* ClientBatch ---------------------------------------------------------------*/
+
+bool ClientBatch::add(RemoteEndpoint endpoint, const uint8_t* input, size_t input_length,
+                      size_t output_length, void* output, decoder_t decoder) {
+    if (n_operations_ >= kMaxOperations || input_length > kMaxInputSize
+        || output_length > ClientChannel::kLegacyMaxResponseSize) {
+        overflow_ = true;
+        return false;
+    }
+    Operation& op = operations_[n_operations_++];
+    op.endpoint = endpoint;
+    if (input_length)
+        memcpy(op.input, input, input_length);
+    op.input_length = input_length;
+    op.output_length = output_length;
+    op.output = output;
+    op.decoder = decoder;
+    return true;
+}
+
+bool ClientBatch::execute() {
+    size_t n_operations = n_operations_;
+    n_operations_ = 0;
+    if (overflow_) {
+        overflow_ = false;
+        return false;
+    }
+
+    // Batches address endpoints by ID, so with path hashes the operations
+    // are sent one by one
+    if (channel_.uses_path_hashes()) {
+        for (size_t i = 0; i < n_operations; ++i) {
+            Operation& op = operations_[i];
+            uint8_t output[ClientChannel::kLegacyMaxResponseSize];
+            size_t received = 0;
+            if (!channel_.endpoint_operation(op.endpoint, op.input, op.input_length, output, op.output_length, &received)
+                || received != op.output_length)
+                return false;
+            if (op.decoder)
+                op.decoder(output, op.output);
+        }
+        return true;
+    }
+
+    size_t max_response_length = channel_.get_max_batch_response_size();
+    size_t begin = 0;
+    size_t request_length = 0;
+    size_t response_length = 0;
+    for (size_t i = 0; i < n_operations; ++i) {
+        size_t size = 4 + operations_[i].input_length;
+        if (i > begin && (request_length + size > ClientChannel::kMaxBatchRequestSize
+                          || response_length + operations_[i].output_length > max_response_length)) {
+            if (!send(begin, i, request_length, response_length))
+                return false;
+            begin = i;
+            request_length = 0;
+            response_length = 0;
+        }
+        request_length += size;
+        response_length += operations_[i].output_length;
+    }
+    return begin == n_operations || send(begin, n_operations, request_length, response_length);
+}
+
+// @brief Sends the operations [begin, end) in one batch request and decodes their outputs
+bool ClientBatch::send(size_t begin, size_t end, size_t request_length, size_t response_length) {
+    uint8_t request[ClientChannel::kMaxBatchRequestSize];
+    uint8_t response[ClientChannel::kMaxBatchRequestSize];
+    size_t offset = 0;
+    for (size_t i = begin; i < end; ++i) {
+        Operation& op = operations_[i];
+        write_le<uint16_t>(op.endpoint.id, request + offset);
+        request[offset + 2] = op.input_length;
+        request[offset + 3] = op.output_length;
+        if (op.input_length)
+            memcpy(request + offset + 4, op.input, op.input_length);
+        offset += 4 + op.input_length;
+    }
+
+    // The device stops at the first operation that fails, so the response
+    // is shorter in that case
+    size_t received = 0;
+    if (!channel_.operation(BATCH_ENDPOINT_ID, nullptr, request, request_length, response, response_length, &received)
+        || received != response_length)
+        return false;
+
+    offset = 0;
+    for (size_t i = begin; i < end; ++i) {
+        Operation& op = operations_[i];
+        if (op.decoder)
+            op.decoder(response + offset, op.output);
+        offset += op.output_length;
+    }
+    return true;
+}
@@ -0,0 +1,239 @@
+#ifndef __FIBRE_CLIENT_HPP
+#define __FIBRE_CLIENT_HPP
+
+// Host side of the fibre protocol, for C++ programs that talk to a device
+// without going through Python. The typed accessors for a specific device are
+// generated from its JSON definition, e.g. with
+//   odrivetool generate-code --template odrive_client_template.hpp.in --output odrive_client.hpp
+
+#include "protocol.hpp"
+
+#include <type_traits>
+
+// @brief Source of incoming packets for a ClientChannel, e.g. a USB bulk IN endpoint.
+class PacketSource {
+public:
+    // @brief Waits up to timeout_ms for the next packet.
+    // @return: 1 if a packet was received, 0 on timeout, -1 if the link is broken
+    virtual int get_packet(uint8_t* buffer, size_t max_length, size_t* length, uint32_t timeout_ms) = 0;
+};
+
+// @brief Address of an endpoint on the device.
+// Requests go to the ID as long as the device has the JSON definition that
+// the ID was taken from, otherwise to the path hash (see HASHED_ENDPOINT_ID).
+struct RemoteEndpoint {
+    uint16_t id;
+    uint32_t path_hash; // see hash_path_segment(), 0 if unknown
+};
+
+// @brief Sends requests to a device and dispatches the frames that it pushes.
+//
+// All calls are blocking and the channel is not thread safe. While a call
+// waits for its response, subscription and telemetry frames are passed to
+// their callbacks on the calling thread. When no request is pending, call
+// poll() to receive them.
+class ClientChannel {
+public:
+    // A request must fit into one packet of a full speed USB endpoint
+    static constexpr size_t kMaxRequestSize = 64;
+    static constexpr size_t kMaxBatchRequestSize = kMaxRequestSize - 8;
+    // Responses without the MSB of the expected length (see process_packet())
+    static constexpr size_t kLegacyMaxResponseSize = TX_BUF_SIZE - 2;
+    static constexpr size_t kMaxResponseSize = MAX_PACKET_SIZE - 2;
+
+    typedef void (*frame_callback_t)(void* ctx, uint16_t frame_no, const uint8_t* payload, size_t length);
+
+    ClientChannel(PacketSink& output, PacketSource& input) :
+        output_(output), input_(input) {}
+
+    // @brief Reads the CRC of the device's JSON definition, which is the
+    // trailer of all further requests, and checks if it sends large responses.
+    // @param expected_json_crc: The CRC the endpoint IDs were taken from, or
+    //        0 to accept any. On a mismatch the requests use path hashes.
+    // @return: true if the device answered
+    bool connect(uint16_t expected_json_crc = 0);
+
+    // @brief Runs an operation on an endpoint and waits for its response.
+    // Requests that got no response in time are sent again, up to
+    // send_attempts times. The device runs each request at most once.
+    // @param received: If not null, set to the number of bytes in output.
+    // @return: true if the device responded
+    bool endpoint_operation(RemoteEndpoint endpoint, const uint8_t* input, size_t input_length,
+                            uint8_t* output, size_t output_length, size_t* received = nullptr);
+
+    template<typename T>
+    bool read(RemoteEndpoint endpoint, T* value) {
+        uint8_t buffer[sizeof(T)];
+        size_t received = 0;
+        if (!endpoint_operation(endpoint, nullptr, 0, buffer, sizeof(buffer), &received) || received != sizeof(buffer))
+            return false;
+        read_le<T>(value, buffer);
+        return true;
+    }
+
+    template<typename T>
+    bool write(RemoteEndpoint endpoint, T value) {
+        uint8_t buffer[sizeof(T)];
+        write_le<T>(value, buffer);
+        return endpoint_operation(endpoint, buffer, sizeof(buffer), nullptr, 0);
+    }
+
+    // @brief Triggers a function endpoint (its inputs must be written first)
+    bool call(RemoteEndpoint endpoint) {
+        return endpoint_operation(endpoint, nullptr, 0, nullptr, 0);
+    }
+
+    // @brief Makes the device push the values of the given properties every
+    // interval_ms, replacing the previous subscription. An interval of 0
+    // cancels it. With SUBSCRIPTION_ON_CHANGE in interval_ms, the device also
+    // pushes them as soon as one changes. callback gets the packed values in
+    // the order of endpoints. Not available if the requests use path hashes.
+    // @return: the length of the pushed values, 0 if the device rejected
+    //          the subscription or -1 if it did not respond
+    int subscribe(const RemoteEndpoint* endpoints, size_t count, uint16_t interval_ms,
+                  frame_callback_t callback, void* ctx);
+
+    // @brief Sets the callback for frames to TELEMETRY_ENDPOINT_ID
+    void set_telemetry_callback(frame_callback_t callback, void* ctx) {
+        telemetry_callback_ = callback;
+        telemetry_ctx_ = ctx;
+    }
+
+    // @brief Receives pushed frames for up to timeout_ms.
+    // @return: the number of frames that were received, -1 if the link is broken
+    int poll(uint32_t timeout_ms);
+
+    uint16_t get_json_crc() { return json_crc_; }
+    bool uses_path_hashes() { return use_path_hashes_; }
+    // @brief The largest response to a batch (see ClientBatch)
+    size_t get_max_batch_response_size() {
+        return large_responses_ ? kMaxBatchRequestSize : kLegacyMaxResponseSize;
+    }
+
+    uint32_t timeout_ms = 200; // per attempt
+    size_t send_attempts = 5;
+
+private:
+    friend class ClientBatch;
+
+    bool operation(uint16_t endpoint_id, const uint32_t* path_hash, const uint8_t* input, size_t input_length,
+                   uint8_t* output, size_t output_length, size_t* received);
+    int wait_for_response(uint16_t seq_no, uint8_t* output, size_t output_length, size_t* received);
+    bool dispatch_frame(const uint8_t* packet, size_t length);
+
+    PacketSink& output_;
+    PacketSource& input_;
+    uint16_t seq_no_ = 0;
+    uint16_t json_crc_ = 0;
+    bool use_path_hashes_ = false;
+    bool large_responses_ = false;
+    frame_callback_t subscription_callback_ = nullptr;
+    void* subscription_ctx_ = nullptr;
+    frame_callback_t telemetry_callback_ = nullptr;
+    void* telemetry_ctx_ = nullptr;
+    uint8_t rx_buf_[MAX_PACKET_SIZE];
+};
+
+// @brief A property on the device
+template<typename T>
+class RemoteProperty {
+public:
+    RemoteProperty(ClientChannel& channel, RemoteEndpoint endpoint) :
+        channel_(channel), endpoint_(endpoint) {}
+
+    bool get(T* value) { return channel_.read(endpoint_, value); }
+    bool set(T value) { return channel_.write(endpoint_, value); }
+    RemoteEndpoint endpoint() const { return endpoint_; }
+
+private:
+    ClientChannel& channel_;
+    RemoteEndpoint endpoint_;
+};
+
+// @brief A read-only property on the device
+template<typename T>
+class RemoteProperty<const T> {
+public:
+    RemoteProperty(ClientChannel& channel, RemoteEndpoint endpoint) :
+        channel_(channel), endpoint_(endpoint) {}
+
+    bool get(T* value) { return channel_.read(endpoint_, value); }
+    RemoteEndpoint endpoint() const { return endpoint_; }
+
+private:
+    ClientChannel& channel_;
+    RemoteEndpoint endpoint_;
+};
+
+// @brief Collects endpoint operations and runs them with as few requests to
+// BATCH_ENDPOINT_ID as possible (see handle_batch_request()).
+// The outputs are only written by execute().
+//
+// Usage example:
+//   ClientBatch batch(channel);
+//   batch.read(odrv.axis0.encoder.pos_estimate, &pos);
+//   batch.write(odrv.axis0.controller.input_pos, 1.0f);
+//   success = batch.execute();
+class ClientBatch {
+public:
+    static constexpr size_t kMaxOperations = 32;
+    static constexpr size_t kMaxInputSize = 8;
+
+    explicit ClientBatch(ClientChannel& channel) : channel_(channel) {}
+
+    template<typename T>
+    bool read(RemoteEndpoint endpoint, T* value) {
+        return add(endpoint, nullptr, 0, sizeof(T), value, [](const uint8_t* buffer, void* output) {
+            read_le<T>(reinterpret_cast<T*>(output), buffer);
+        });
+    }
+
+    template<typename T>
+    bool write(RemoteEndpoint endpoint, T value) {
+        uint8_t buffer[sizeof(T)];
+        write_le<T>(value, buffer);
+        return add(endpoint, buffer, sizeof(buffer), 0, nullptr, nullptr);
+    }
+
+    bool call(RemoteEndpoint endpoint) {
+        return add(endpoint, nullptr, 0, 0, nullptr, nullptr);
+    }
+
+    template<typename T>
+    bool read(const RemoteProperty<T>& property, std::remove_const_t<T>* value) {
+        return read(property.endpoint(), value);
+    }
+
+    template<typename T>
+    bool write(const RemoteProperty<T>& property, std::remove_const_t<T> value) {
+        static_assert(!std::is_const<T>::value, "the property is read-only");
+        return write(property.endpoint(), value);
+    }
+
+    // @brief Runs all operations in the order in which they were added.
+    // @return: true if the device ran all of them. If the requests use path
+    //          hashes, the operations are sent one by one.
+    bool execute();
+
+private:
+    typedef void (*decoder_t)(const uint8_t* buffer, void* output);
+    struct Operation {
+        RemoteEndpoint endpoint;
+        uint8_t input[kMaxInputSize];
+        uint8_t input_length;
+        uint8_t output_length;
+        void* output;
+        decoder_t decoder;
+    };
+
+    bool add(RemoteEndpoint endpoint, const uint8_t* input, size_t input_length,
+             size_t output_length, void* output, decoder_t decoder);
+    bool send(size_t begin, size_t end, size_t request_length, size_t response_length);
+
+    ClientChannel& channel_;
+    Operation operations_[kMaxOperations];
+    size_t n_operations_ = 0;
+    bool overflow_ = false;
+};
+
+#endif // __FIBRE_CLIENT_HPP
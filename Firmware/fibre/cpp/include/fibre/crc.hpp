@@ -7,7 +7,7 @@
 // Calculates an arbitrary CRC for one byte.
 // Adapted from https://barrgroup.com/Embedded-Systems/How-To/CRC-Calculation-C-Code
 template<typename T, unsigned POLYNOMIAL>
-static T calc_crc(T remainder, uint8_t value) {
+static constexpr T calc_crc(T remainder, uint8_t value) {
     constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
     constexpr T TOPBIT = ((T)1 << (BIT_WIDTH - 1));
     
@@ -26,10 +26,42 @@ static T calc_crc(T remainder, uint8_t value) {
     return remainder;
 }
 
+// Lookup table of the division results of all byte values, generated at
+// compile time so that it ends up in flash.
 template<typename T, unsigned POLYNOMIAL>
+struct CrcTable {
+    constexpr CrcTable() : entries() {
+        for (unsigned i = 0; i < 256; ++i)
+            entries[i] = calc_crc<T, POLYNOMIAL>((T)0, (uint8_t)i);
+    }
+    T entries[256];
+};
+
+template<typename T, unsigned POLYNOMIAL>
+struct CrcTableInstance {
+    static constexpr CrcTable<T, POLYNOMIAL> table{};
+};
+
+template<typename T, unsigned POLYNOMIAL>
+constexpr CrcTable<T, POLYNOMIAL> CrcTableInstance<T, POLYNOMIAL>::table;
+
+// Calculates an arbitrary CRC over a buffer.
+// By default this processes one byte per table lookup, at the cost of a table
+// of 256 entries per polynomial. Set USE_TABLE to false for rarely used
+// polynomials where the table is not worth the flash space.
+// Note that the STM32 CRC peripheral only implements the 32 bit Ethernet CRC,
+// so it cannot calculate these.
+template<typename T, unsigned POLYNOMIAL, bool USE_TABLE = true>
 static T calc_crc(T remainder, const uint8_t* buffer, size_t length) {
-    while (length--)
-        remainder = calc_crc<T, POLYNOMIAL>(remainder, *(buffer++));
+    if (USE_TABLE) {
+        constexpr unsigned BIT_WIDTH = (CHAR_BIT * sizeof(T));
+        const T* table = CrcTableInstance<T, POLYNOMIAL>::table.entries;
+        while (length--)
+            remainder = (T)((remainder << 8) ^ table[(uint8_t)((remainder >> (BIT_WIDTH - 8)) ^ *(buffer++))]);
+    } else {
+        while (length--)
+            remainder = calc_crc<T, POLYNOMIAL>(remainder, *(buffer++));
+    }
     return remainder;
 }
 
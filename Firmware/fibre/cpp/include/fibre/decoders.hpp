@@ -231,6 +231,64 @@ inline VarintStreamDecoder<GET_TYPE_OF(&ReceiverState::length)> make_length_deco
 
 
 
+// @brief Decodes count little endian values of type T into an array.
+// Complete values are copied straight from the input with read_le_span(), only
+// a value that is split across two calls to process_bytes() is buffered.
+template<typename T>
+class ArrayStreamDecoder : public StreamDecoder {
+public:
+    ArrayStreamDecoder(T* values, size_t count) :
+        values_(values), count_(count)
+    {}
+
+    int get_status() final {
+        return 0;
+    }
+
+    size_t get_expected_bytes() final {
+        return (count_ - pos_) * sizeof(T) - partial_length_;
+    }
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) final {
+        length = std::min(length, get_expected_bytes());
+        if (processed_bytes) (*processed_bytes) += length;
+
+        // complete the value that was started by the previous call
+        if (partial_length_) {
+            size_t n_copy = std::min(length, sizeof(T) - partial_length_);
+            memcpy(partial_ + partial_length_, buffer, n_copy);
+            buffer += n_copy;
+            length -= n_copy;
+            partial_length_ += n_copy;
+            if (partial_length_ < sizeof(T))
+                return 0;
+            read_le_span(values_ + pos_++, 1, partial_);
+            partial_length_ = 0;
+        }
+
+        size_t n_values = length / sizeof(T);
+        buffer += read_le_span(values_ + pos_, n_values, buffer);
+        pos_ += n_values;
+        partial_length_ = length - n_values * sizeof(T);
+        memcpy(partial_, buffer, partial_length_);
+        return 0;
+    }
+
+    size_t get_free_space() { return SIZE_MAX; } // TODO: deprecate
+private:
+    T* values_;
+    size_t count_;
+    size_t pos_ = 0; // number of complete values
+    size_t partial_length_ = 0;
+    uint8_t partial_[sizeof(T)];
+};
+
+template<typename T>
+inline ArrayStreamDecoder<T> make_array_decoder(T* values, size_t count) {
+    return ArrayStreamDecoder<T>(values, count);
+}
+
+
 template<uint8_t INIT, uint8_t POLYNOMIAL, typename TDecoder,
         ENABLE_IF(TypeChecker<TDecoder>::template all_are<StreamDecoder>())>
 class CRC8BlockDecoder : public BlockDecoder<CRC8_BLOCKSIZE> {
@@ -214,6 +214,57 @@ VarintStreamEncoder<GET_TYPE_OF(&Request::endpoint_id)> make_endpoint_id_encoder
 VarintStreamEncoder<GET_TYPE_OF(&Request::length)> make_length_encoder(const Request& request) {
     return make_varint_encoder(request.length);
 }
+// @brief Encodes count values of type T from an array in little endian order.
+// Complete values are copied straight to the output with write_le_span(), only
+// a value that is split across two calls to get_bytes() is encoded separately.
+template<typename T>
+class ArrayStreamEncoder : public StreamEncoder {
+public:
+    ArrayStreamEncoder(const T* values, size_t count) :
+        values_(values), count_(count)
+    {}
+
+    int get_status() final {
+        return 0;
+    }
+
+    size_t get_available_bytes() final {
+        return count_ * sizeof(T) - pos_;
+    }
+
+    int get_bytes(uint8_t* buffer, size_t length, size_t* generated_bytes) final {
+        length = std::min(length, get_available_bytes());
+        if (generated_bytes) (*generated_bytes) += length;
+        while (length) {
+            size_t index = pos_ / sizeof(T);
+            size_t offset = pos_ % sizeof(T);
+            size_t n_copy;
+            if (!offset && length >= sizeof(T)) {
+                n_copy = write_le_span(values_ + index, length / sizeof(T), buffer);
+            } else {
+                uint8_t value[sizeof(T)];
+                write_le_span(values_ + index, 1, value);
+                n_copy = std::min(length, sizeof(T) - offset);
+                memcpy(buffer, value + offset, n_copy);
+            }
+            buffer += n_copy;
+            length -= n_copy;
+            pos_ += n_copy;
+        }
+        return 0;
+    }
+
+private:
+    const T* values_;
+    size_t count_;
+    size_t pos_ = 0; // byte position
+};
+
+template<typename T>
+ArrayStreamEncoder<T> make_array_encoder(const T* values, size_t count) {
+    return ArrayStreamEncoder<T>(values, count);
+}
+
 
 template<uint8_t INIT, uint8_t POLYNOMIAL, typename TEncoder,
         ENABLE_IF(TypeChecker<TEncoder>::template all_are<StreamEncoder>())>
@@ -0,0 +1,45 @@
+#ifndef __FIBRE_LIBUSB_TRANSPORT_HPP
+#define __FIBRE_LIBUSB_TRANSPORT_HPP
+
+#include "client.hpp"
+
+struct libusb_context;
+struct libusb_device_handle;
+
+// @brief Packet transport over the native (vendor specific) USB interface,
+// for use with ClientChannel. Needs libusb-1.0.
+//
+// Usage example:
+//   LibusbTransport usb;
+//   if (usb.open()) {
+//       ClientChannel channel(usb, usb);
+//       channel.connect();
+//   }
+class LibusbTransport : public PacketSink, public PacketSource {
+public:
+    // A response is one bulk transfer of up to this many bytes (see USB_NATIVE_TX_DATA_SIZE)
+    static constexpr size_t kMaxTransferSize = 512;
+
+    ~LibusbTransport() { close(); }
+
+    // @brief Opens the first ODrive whose serial number matches.
+    // @param serial_number: 12 upper case hex digits as shown by lsusb,
+    //        or null to open any ODrive.
+    bool open(const char* serial_number = nullptr);
+    void close();
+
+    size_t get_mtu() final { return ClientChannel::kMaxRequestSize; }
+    int process_packet(const uint8_t* buffer, size_t length) final;
+    int get_packet(uint8_t* buffer, size_t max_length, size_t* length, uint32_t timeout_ms) final;
+
+private:
+    bool claim_native_interface();
+
+    libusb_context* context_ = nullptr;
+    libusb_device_handle* handle_ = nullptr;
+    int interface_number_ = -1;
+    uint8_t endpoint_in_ = 0;
+    uint8_t endpoint_out_ = 0;
+};
+
+#endif // __FIBRE_LIBUSB_TRANSPORT_HPP
@@ -8,6 +8,8 @@ see protocol.md for the protocol specification
 // TODO: resolve assert
 #define assert(expr)
 
+#include <algorithm>
+#include <array>
 #include <functional>
 #include <limits>
 #include <cmath>
@@ -65,16 +67,62 @@ struct ReceiverState {
 
 
 #include <unistd.h>
+#include <stdio.h>
 
 constexpr uint16_t PROTOCOL_VERSION = 1;
 
 // This value must not be larger than USB_TX_DATA_SIZE defined in usbd_cdc_if.h
 constexpr uint16_t TX_BUF_SIZE = 32; // does not work with 64 for some reason
-constexpr uint16_t RX_BUF_SIZE = 128; // larger values than 128 have currently no effect because of protocol limitations
+
+// Largest packet with the extended stream header (see StreamToPacketSegmenter).
+// Responses can only be larger than TX_BUF_SIZE if the client asks for it,
+// so that older clients keep working.
+constexpr uint16_t MAX_PACKET_SIZE = 512;
+constexpr uint16_t RX_BUF_SIZE = MAX_PACKET_SIZE + 2; // including the CRC16
 
 // Maximum time we allocate for processing and responding to a request
 constexpr uint32_t PROTOCOL_SERVER_TIMEOUT_MS = 10;
 
+// Requests to this endpoint ID set up the subscription of a channel, see
+// BidirectionalPacketBasedChannel::handle_subscription_request().
+// The pushed frames are addressed to the same ID.
+constexpr uint16_t SUBSCRIPTION_ENDPOINT_ID = 0x7fff;
+constexpr size_t MAX_SUBSCRIBED_ENDPOINTS = 8;
+// Set in the interval of a subscription request to push a frame as soon as a
+// value changes. The interval then is the longest time between frames.
+constexpr uint16_t SUBSCRIPTION_ON_CHANGE = 0x8000;
+
+// Requests to this endpoint ID carry a list of endpoint operations, see
+// BidirectionalPacketBasedChannel::handle_batch_request().
+constexpr uint16_t BATCH_ENDPOINT_ID = 0x7ffe;
+
+// Frames addressed to this ID tell the host that the request with the given
+// sequence number was lost, see BidirectionalPacketBasedChannel::track_request().
+constexpr uint16_t NACK_ENDPOINT_ID = 0x7ffd;
+
+// Frames addressed to this ID carry the fixed-size status that the native USB
+// interface pushes once per USB frame, see usb_start_of_frame().
+constexpr uint16_t TELEMETRY_ENDPOINT_ID = 0x7ffc;
+
+// Requests to this endpoint ID address an endpoint by the hash of its path
+// (see hash_path_segment) instead of its ID. The hash is sent as u32 in front
+// of the endpoint's input and the trailer is PROTOCOL_VERSION instead of the
+// JSON CRC, so the request stays valid when the object tree changes.
+constexpr uint16_t HASHED_ENDPOINT_ID = 0x7ffb;
+
+// Frames addressed to this ID are sent instead of the response to a request
+// whose input the endpoint refused (see Endpoint::accepts_input()). The
+// request did not run.
+constexpr uint16_t REJECT_ENDPOINT_ID = 0x7ffa;
+
+// Number of responses that a channel keeps to answer resent requests. Hosts
+// shall not have more requests in flight on one channel.
+constexpr size_t RESPONSE_WINDOW_SIZE = 8;
+
+// Sequence number of the first request of a host session. Requests with
+// sequence number 0 come from transports without them and are never replayed.
+constexpr uint16_t FIRST_SEQ_NO = 0x81;
+
 
 typedef struct {
     uint16_t json_crc;
@@ -222,12 +270,64 @@ static inline T read_le(const uint8_t** buffer, size_t* length) {
     return result;
 }
 
+// @brief True if values of type T are stored in memory in the same byte order
+// and layout as on the wire, so that arrays of them can be copied with memcpy.
+// Bools are excluded because any non-zero byte on the wire reads as true.
+template<typename T, typename TValue = std::remove_cv_t<T>>
+struct is_wire_compatible : std::integral_constant<bool,
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    (std::is_integral<TValue>::value && !std::is_same<TValue, bool>::value)
+    || (std::is_same<TValue, float>::value && std::numeric_limits<float>::is_iec559)
+#else
+    false
+#endif
+> {};
+
+// @brief Writes count values of type T to the buffer in little endian order.
+// On little endian targets this is a single memcpy, otherwise each value
+// goes through write_le().
+// @return The number of bytes that were written.
+template<typename T>
+inline std::enable_if_t<is_wire_compatible<T>::value, size_t>
+write_le_span(const T* values, size_t count, uint8_t* buffer) {
+    memcpy(buffer, values, count * sizeof(T));
+    return count * sizeof(T);
+}
+
+template<typename T>
+inline std::enable_if_t<!is_wire_compatible<T>::value, size_t>
+write_le_span(const T* values, size_t count, uint8_t* buffer) {
+    size_t cnt = 0;
+    for (size_t i = 0; i < count; ++i)
+        cnt += write_le<std::remove_const_t<T>>(values[i], buffer + cnt);
+    return cnt;
+}
+
+// @brief Reads count values of type T from a little endian buffer.
+// The buffer needs no particular alignment.
+// @return The number of bytes that were read.
+template<typename T>
+inline std::enable_if_t<is_wire_compatible<T>::value, size_t>
+read_le_span(T* values, size_t count, const uint8_t* buffer) {
+    memcpy(values, buffer, count * sizeof(T));
+    return count * sizeof(T);
+}
+
+template<typename T>
+inline std::enable_if_t<!is_wire_compatible<T>::value, size_t>
+read_le_span(T* values, size_t count, const uint8_t* buffer) {
+    size_t cnt = 0;
+    for (size_t i = 0; i < count; ++i)
+        cnt += read_le<T>(values + i, buffer + cnt);
+    return cnt;
+}
+
 class PacketSink {
 public:
     // @brief Get the maximum packet length (aka maximum transmission unit)
     // A packet size shall take no action and return an error code if the
     // caller attempts to send an oversized packet.
-    //virtual size_t get_mtu() = 0;
+    virtual size_t get_mtu() { return TX_BUF_SIZE; }
 
     // @brief Processes a packet.
     // The blocking behavior shall depend on the thread-local deadline_ms variable.
@@ -282,9 +382,15 @@ public:
     
     size_t get_free_space() { return SIZE_MAX; }
 
+    // Counters of discarded input, the owner may reset them
+    uint32_t header_error_cnt_ = 0; // headers with a bad CRC8
+    uint32_t crc_error_cnt_ = 0;    // packets with a bad CRC16
+    uint32_t oversize_cnt_ = 0;     // packets that don't fit into RX_BUF_SIZE
+
 private:
-    uint8_t header_buffer_[3];
+    uint8_t header_buffer_[4];
     size_t header_index_ = 0;
+    size_t header_length_ = 3; // 4 for the extended header
     uint8_t packet_buffer_[RX_BUF_SIZE];
     size_t packet_index_ = 0;
     size_t packet_length_ = 0;
@@ -299,7 +405,7 @@ public:
     {
     };
     
-    //size_t get_mtu() { return SIZE_MAX; }
+    size_t get_mtu() { return MAX_PACKET_SIZE; }
     int process_packet(const uint8_t *buffer, size_t length);
 
 private:
@@ -415,6 +521,146 @@ private:
     uint16_t crc16_;
 };
 
+// @brief Compresses a byte stream with a small LZ77 variant.
+//
+// The compressed stream is a sequence of tokens:
+//  0x00-0x7F: literal run. Followed by (token + 1) uncompressed bytes.
+//  0x80-0xFF: match. Followed by one byte d. Repeats (token - 0x7D) bytes
+//             starting (d + 1) bytes back in the uncompressed stream. The
+//             match may overlap with the bytes it produces.
+//
+// Matches are searched by brute force within the last kWindowSize bytes,
+// which is slow but needs no memory beyond this object.
+// If buffer is NULL, nothing is written and only the output length is
+// counted, so that a first pass can determine the required buffer size.
+// Call finish() at the end of the stream.
+class LZCompressor : public StreamSink {
+public:
+    static constexpr size_t kWindowSize = 256;
+    static constexpr size_t kMinMatch = 3;
+    static constexpr size_t kMaxMatch = 0x7F + kMinMatch;
+    static constexpr size_t kMaxLiterals = 0x80;
+
+    LZCompressor(uint8_t* buffer, size_t buffer_size) :
+        buffer_(buffer), buffer_size_(buffer_size) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        for (size_t i = 0; i < length; ++i) {
+            ring_[in_end_++ % kRingSize] = buffer[i];
+            if (in_end_ - in_pos_ >= kMaxMatch)
+                encode_next();
+        }
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+
+    size_t get_free_space() { return SIZE_MAX; }
+
+    void finish() {
+        while (in_pos_ < in_end_)
+            encode_next();
+        flush_literals();
+    }
+
+    size_t get_input_length() { return in_end_; }
+    // @brief Returns the number of compressed bytes, including any that did
+    // not fit into the buffer.
+    size_t get_output_length() { return out_length_; }
+
+private:
+    static constexpr size_t kRingSize = 512; // power of two >= kWindowSize + kMaxMatch
+
+    void encode_next() {
+        size_t max_length = std::min(in_end_ - in_pos_, kMaxMatch);
+        size_t max_distance = std::min(in_pos_, kWindowSize);
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        for (size_t distance = 1; distance <= max_distance && best_length < max_length; ++distance) {
+            size_t length = 0;
+            while (length < max_length && ring_[(in_pos_ - distance + length) % kRingSize] == ring_[(in_pos_ + length) % kRingSize])
+                ++length;
+            if (length > best_length) {
+                best_length = length;
+                best_distance = distance;
+            }
+        }
+
+        if (best_length >= kMinMatch) {
+            flush_literals();
+            emit(0x80 | (uint8_t)(best_length - kMinMatch));
+            emit((uint8_t)(best_distance - 1));
+            in_pos_ += best_length;
+        } else {
+            literals_[n_literals_++] = ring_[in_pos_++ % kRingSize];
+            if (n_literals_ == kMaxLiterals)
+                flush_literals();
+        }
+    }
+
+    void flush_literals() {
+        if (!n_literals_)
+            return;
+        emit((uint8_t)(n_literals_ - 1));
+        for (size_t i = 0; i < n_literals_; ++i)
+            emit(literals_[i]);
+        n_literals_ = 0;
+    }
+
+    void emit(uint8_t value) {
+        if (buffer_ && out_length_ < buffer_size_)
+            buffer_[out_length_] = value;
+        out_length_++;
+    }
+
+    uint8_t* buffer_;
+    size_t buffer_size_;
+    size_t out_length_ = 0;
+    uint8_t ring_[kRingSize];
+    size_t in_pos_ = 0; // next byte to be encoded
+    size_t in_end_ = 0; // number of bytes received
+    uint8_t literals_[kMaxLiterals];
+    size_t n_literals_ = 0;
+};
+
+// @brief Decompresses the output of LZCompressor into the output stream.
+// The first skip bytes of the uncompressed stream are not emitted.
+// Stops without error once the output stream is full.
+// @returns 0 on success or -1 if the compressed stream is malformed
+inline int lz_decompress(const uint8_t* buffer, size_t length, size_t skip, StreamSink* output) {
+    uint8_t window[LZCompressor::kWindowSize];
+    size_t out_pos = 0;
+    size_t i = 0;
+    while (i < length) {
+        uint8_t token = buffer[i++];
+        size_t run_length;
+        size_t distance = 0;
+        if (token & 0x80) {
+            if (i >= length)
+                return -1;
+            run_length = (token & 0x7F) + LZCompressor::kMinMatch;
+            distance = (size_t)buffer[i++] + 1;
+            if (distance > out_pos)
+                return -1;
+        } else {
+            run_length = (size_t)token + 1;
+            if (run_length > length - i)
+                return -1;
+        }
+
+        for (size_t j = 0; j < run_length; ++j) {
+            uint8_t value = distance ? window[(out_pos - distance) % LZCompressor::kWindowSize] : buffer[i++];
+            window[out_pos % LZCompressor::kWindowSize] = value;
+            if (out_pos++ >= skip) {
+                if (!output->get_free_space())
+                    return 0;
+                output->process_bytes(&value, 1, nullptr);
+            }
+        }
+    }
+    return 0;
+}
+
 
 // @brief Endpoint request handler
 //
@@ -431,19 +677,40 @@ private:
 typedef std::function<void(void* ctx, const uint8_t* input, size_t input_length, StreamSink* output)> EndpointHandler;
 
 
+// @brief Writes count values of type T to the output in little endian order.
+// Wire compatible values are passed to the output straight from memory.
+// Nothing is written if the values don't fit into the output.
+// @return 0 on success, otherwise a non-zero error code
+template<typename T>
+inline std::enable_if_t<is_wire_compatible<T>::value, int>
+write_le_span(const T* values, size_t count, StreamSink* output) {
+    if (count * sizeof(T) > output->get_free_space())
+        return -1;
+    return output->process_bytes(reinterpret_cast<const uint8_t*>(values), count * sizeof(T), nullptr);
+}
+
+template<typename T>
+inline std::enable_if_t<!is_wire_compatible<T>::value, int>
+write_le_span(const T* values, size_t count, StreamSink* output) {
+    if (count * sizeof(T) > output->get_free_space())
+        return -1;
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t buffer[sizeof(T)];
+        size_t cnt = write_le<std::remove_const_t<T>>(values[i], buffer);
+        if (int status = output->process_bytes(buffer, cnt, nullptr))
+            return status;
+    }
+    return 0;
+}
+
 // @brief Default endpoint handler for const types
 // @return: True if endpoint was written to, False otherwise
 template<typename T>
 std::enable_if_t<!std::is_same<T, endpoint_ref_t>::value && std::is_const<T>::value, bool>
 default_readwrite_endpoint_handler(T* value, const uint8_t* input, size_t input_length, StreamSink* output) {
     // If the old value was requested, call the corresponding little endian serialization function
-    if (output) {
-        // TODO: make buffer size dependent on the type
-        uint8_t buffer[sizeof(T)];
-        size_t cnt = write_le<T>(*value, buffer);
-        if (cnt <= output->get_free_space())
-            output->process_bytes(buffer, cnt, nullptr);
-    }
+    if (output)
+        write_le_span<T>(value, 1, output);
     return false; // We don't ever write to const types
 }
 
@@ -455,9 +722,8 @@ default_readwrite_endpoint_handler(T* value, const uint8_t* input, size_t input_
     default_readwrite_endpoint_handler<const T>(const_cast<const T*>(value), input, input_length, output);
     
     // If a new value was passed, call the corresponding little endian deserialization function
-    uint8_t buffer[sizeof(T)] = { 0 }; // TODO: make buffer size dependent on the type
-    if (input_length >= sizeof(buffer)) {
-        read_le<T>(value, input);
+    if (input_length >= sizeof(T)) {
+        read_le_span<T>(value, 1, input);
         return true;
     } else {
         return false;
@@ -555,9 +821,25 @@ class Endpoint {
 public:
     //const char* const name_;
     virtual void handle(const uint8_t* input, size_t input_length, StreamSink* output) = 0;
+    // Returns false if handle() ignores an input of this length, so that the
+    // channel can reject the request instead of answering it
+    virtual bool accepts_input(size_t input_length) { return true; }
     virtual bool get_string(char * output, size_t length) { return false; }
     virtual bool set_string(char * buffer, size_t length) { return false; }
     virtual bool set_from_float(float value) { return false; }
+    // Reads a numeric property without going through the protocol. This
+    // doesn't touch the output stream, so it may be called from interrupts.
+    virtual bool get_as_float(float* value) { return false; }
+    // Returns the value of a writable float property, so that code that writes
+    // it often can resolve the endpoint once and skip set_from_float().
+    // Returns NULL for all other endpoints.
+    virtual float* get_float_property() { return nullptr; }
+    // Returns true if handle() without input reads a value and has no side effects
+    virtual bool is_property() { return false; }
+    // Returns the address of a value whose bytes in memory are the same as
+    // on the wire, so that it can be copied without going through handle().
+    // Returns NULL if the value needs to be encoded.
+    virtual const void* get_wire_data(size_t* length) { return nullptr; }
 };
 
 static inline int write_string(const char* str, StreamSink* output) {
@@ -571,6 +853,10 @@ static inline int write_string(const char* str, StreamSink* output) {
 * objects of this class will handle packets passed into process_packet,
 * pass the relevant data to the corresponding endpoints and dispatch response
 * packets on the output.
+*
+* The host can also subscribe to a list of properties. The channel then pushes
+* the values periodically or when they change from update_subscription(),
+* which must be called from the same thread as process_packet().
 */
 class BidirectionalPacketBasedChannel : public PacketSink {
 public:
@@ -582,9 +868,44 @@ public:
     //    return SIZE_MAX;
     //}
     int process_packet(const uint8_t* buffer, size_t length);
+    void update_subscription(uint32_t now_ms);
+    bool has_subscription() const { return n_subscribed_ > 0; }
 private:
+    void handle_subscription_request(const uint8_t* input, size_t input_length, StreamSink* output);
+    void handle_batch_request(const uint8_t* input, size_t input_length, StreamSink* output);
+    void handle_ack(uint16_t seq_no);
+    void track_request(uint16_t seq_no);
+    void reset_session();
+    bool replay_response(uint16_t seq_no, uint16_t request_crc);
+    void cache_response(uint16_t seq_no, uint16_t request_crc, size_t length);
+
     PacketSink& output_;
-    uint8_t tx_buf_[TX_BUF_SIZE];
+    uint8_t tx_buf_[MAX_PACKET_SIZE];
+
+    // The last responses that fit into TX_BUF_SIZE, for replay if the host
+    // resends their request. Slots with length 0 are free.
+    struct CachedResponse_t {
+        uint16_t seq_no;
+        uint16_t request_crc;   // tells a resent request apart from a new one with the same seq_no
+        uint8_t length;         // including the sequence number
+        uint8_t data[TX_BUF_SIZE];
+    };
+    CachedResponse_t response_cache_[RESPONSE_WINDOW_SIZE] = {};
+    size_t next_cache_slot_ = 0;
+    uint16_t last_index_ = 0;       // of the newest request, see seq_no_to_index()
+    bool have_last_index_ = false;
+    bool host_sends_acks_ = false;  // such hosts also understand NACKs
+
+    Endpoint* subscribed_endpoints_[MAX_SUBSCRIBED_ENDPOINTS];
+    const void* subscribed_data_[MAX_SUBSCRIBED_ENDPOINTS]; // see Endpoint::get_wire_data()
+    size_t subscribed_lengths_[MAX_SUBSCRIBED_ENDPOINTS];
+    size_t n_subscribed_ = 0;
+    uint32_t subscription_interval_ms_ = 0;
+    uint32_t next_frame_ms_ = 0;
+    bool subscription_restart_ = false; // send the next frame right away
+    bool subscription_on_change_ = false; // see SUBSCRIPTION_ON_CHANGE
+    uint8_t last_frame_[TX_BUF_SIZE - 4]; // values of the last frame, in on change mode
+    uint16_t frame_count_ = 0;
 };
 
 
@@ -683,6 +1004,19 @@ static bool from_string(const char * buffer, size_t length, T* property, ...) {
 
 /* Object tree ---------------------------------------------------------------*/
 
+// @brief Hashes the path of a property (e.g. "axis0.motor.config.pole_pairs")
+// one name at a time, see for_each_property.
+// This is FNV-1a over the names, each preceded by a '.', which is the same
+// as FNV-1a over the full path with a leading '.' (".axis0.motor...").
+// Function inputs and outputs hash as members of their function.
+static constexpr uint32_t kPathHashInit = 2166136261u;
+inline uint32_t hash_path_segment(uint32_t hash, const char* name) {
+    hash = (hash ^ (uint8_t)'.') * 16777619u;
+    for (; *name; ++name)
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
 template<typename ... TMembers>
 struct MemberList;
 
@@ -694,12 +1028,19 @@ public:
     void write_json(size_t id, StreamSink* output) {
         // no action
     }
-    void register_endpoints(Endpoint** list, size_t id, size_t length) {
-        // no action
+    Endpoint* get_by_id(size_t id) {
+        return nullptr;
     }
     Endpoint* get_by_name(const char * name, size_t length) {
         return nullptr;
     }
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        return nullptr;
+    }
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        // no action
+    }
     std::tuple<> get_names_as_tuple() const { return std::tuple<>(); }
 };
 
@@ -735,9 +1076,31 @@ public:
         else return subsequent_members_.get_by_name(name, length);
     }
 
-    void register_endpoints(Endpoint** list, size_t id, size_t length) /*final*/ {
-        this_member_.register_endpoints(list, id, length);
-        subsequent_members_.register_endpoints(list, id + TMember::endpoint_count, length);
+    // @brief Returns the endpoint whose path hashes to the given value.
+    // @param path_hash: the hash of the path of the list's parent
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        Endpoint* result = this_member_.get_by_path_hash(hash, path_hash);
+        if (result) return result;
+        else return subsequent_members_.get_by_path_hash(hash, path_hash);
+    }
+
+    // @brief Returns the endpoint with the given ID relative to the start of the list.
+    // The endpoint counts are known at compile time, so this compiles to a
+    // chain of comparisons against constants instead of a table in RAM.
+    Endpoint* get_by_id(size_t id) {
+        if (id < TMember::endpoint_count)
+            return this_member_.get_by_id(id);
+        else
+            return subsequent_members_.get_by_id(id - TMember::endpoint_count);
+    }
+
+    // @brief Calls visitor(path_hash, property) for every property in the
+    // tree, with the hash of its path (see hash_path_segment) and a typed
+    // pointer to it. Function arguments are not visited.
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        this_member_.for_each_property(visitor, path_hash);
+        subsequent_members_.for_each_property(visitor, path_hash);
     }
 
     TMember this_member_;
@@ -774,8 +1137,17 @@ public:
             return nullptr;
     }
 
-    void register_endpoints(Endpoint** list, size_t id, size_t length) {
-        member_list_.register_endpoints(list, id, length);
+    Endpoint* get_by_id(size_t id) {
+        return member_list_.get_by_id(id);
+    }
+
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        return member_list_.get_by_path_hash(hash, hash_path_segment(path_hash, name_));
+    }
+
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        member_list_.for_each_property(visitor, hash_path_segment(path_hash, name_));
     }
     
     const char * name_;
@@ -814,6 +1186,23 @@ template<typename T>
 bool set_from_float(float value, T* property) {
     return set_from_float_ex<T>(value, property, 0);
 }
+
+template<typename T, typename = std::enable_if_t<std::is_arithmetic<std::remove_const_t<T>>::value>>
+bool get_as_float_ex(float* value, T* property, int) {
+    return *value = static_cast<float>(*property), true;
+}
+template<typename T>
+bool get_as_float_ex(float* value, T* property, ...) {
+    return false;
+}
+template<typename T>
+bool get_as_float(float* value, T* property) {
+    return get_as_float_ex<T>(value, property, 0);
+}
+
+static inline float* get_float_property(float* property) { return property; }
+template<typename T>
+float* get_float_property(T* property) { return nullptr; }
 }
 
 //template<typename T>
@@ -901,9 +1290,30 @@ public:
         return conversion::set_from_float(value, property_);
     }
 
-    void register_endpoints(Endpoint** list, size_t id, size_t length) {
-        if (id < length)
-            list[id] = this;
+    bool get_as_float(float* value) final {
+        return conversion::get_as_float(value, property_);
+    }
+
+    float* get_float_property() final {
+        return conversion::get_float_property(property_);
+    }
+
+    bool is_property() final { return true; }
+
+    const void* get_wire_data(size_t* length) final {
+        *length = sizeof(TProperty);
+        return is_wire_compatible<TProperty>::value ? property_ : nullptr;
+    }
+
+    Endpoint* get_by_id(size_t id) {
+        return this;
+    }
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        return hash_path_segment(path_hash, name_) == hash ? this : nullptr;
+    }
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        visitor(hash_path_segment(path_hash, name_), property_);
     }
     void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
         bool wrote = default_readwrite_endpoint_handler<TProperty>(property_, input, input_length, output);
@@ -951,6 +1361,97 @@ ProtocolProperty<const std::underlying_type_t<TProperty>> make_protocol_ro_prope
             name, reinterpret_cast<const std::underlying_type_t<TProperty>*>(property), written_hook, ctx);
 };
 
+template<typename T> inline constexpr const char* get_buffer_element_type() { return "uint8"; }
+template<> inline constexpr const char* get_buffer_element_type<float>() { return "float"; }
+template<> inline constexpr const char* get_buffer_element_type<int16_t>() { return "int16"; }
+template<> inline constexpr const char* get_buffer_element_type<uint16_t>() { return "uint16"; }
+template<> inline constexpr const char* get_buffer_element_type<int32_t>() { return "int32"; }
+template<> inline constexpr const char* get_buffer_element_type<uint32_t>() { return "uint32"; }
+
+// @brief Exposes a contiguous array for bulk reads.
+//
+// Like the JSON descriptor, the request contains a 32 bit byte offset and
+// the response holds as many bytes from that offset as fit, so the client
+// selects the range with the offset and the expected response length. The
+// data is copied straight from memory into the response. The host reads
+// the buffer with RemoteBuffer.read(), which stops at the first empty
+// response.
+//
+// The length [bytes] is read at the time of the request, so it may change
+// at runtime. Arrays that are allocated at runtime are passed by the
+// address of their pointer and are empty while the pointer is NULL.
+class ProtocolBuffer : public Endpoint {
+public:
+    static constexpr size_t endpoint_count = 1;
+
+    ProtocolBuffer(const char * name, const char * element_type, const void* data,
+                   const void* const* indirect_data, const size_t* length)
+        : name_(name), element_type_(element_type), data_(data),
+          indirect_data_(indirect_data), length_(length) {}
+
+    void write_json(size_t id, StreamSink* output) {
+        write_string("{\"name\":\"", output);
+        write_string(name_, output);
+        write_string("\",\"id\":", output);
+        char id_buf[10];
+        snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+        write_string(id_buf, output);
+        write_string(",\"type\":\"buffer\",\"element\":\"", output);
+        write_string(element_type_, output);
+        write_string("\",\"access\":\"r\"}", output);
+    }
+
+    Endpoint* get_by_name(const char * name, size_t length) {
+        if (!strncmp(name, name_, length))
+            return this;
+        else
+            return nullptr;
+    }
+
+    Endpoint* get_by_id(size_t id) {
+        return this;
+    }
+
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        return hash_path_segment(path_hash, name_) == hash ? this : nullptr;
+    }
+
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        // no action
+    }
+
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        if (input_length < 4)
+            return;
+        uint32_t offset = 0;
+        read_le<uint32_t>(&offset, input);
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(indirect_data_ ? *indirect_data_ : data_);
+        size_t length = *length_;
+        if (data && offset < length)
+            output->process_bytes(data + offset, std::min(length - offset, output->get_free_space()), nullptr);
+    }
+
+    const char* name_;
+    const char* element_type_;
+    const void* data_;
+    const void* const* indirect_data_;
+    const size_t* length_;
+};
+
+// Arrays with a fixed address
+template<typename T>
+ProtocolBuffer make_protocol_buffer(const char * name, const T* data, const size_t* length) {
+    return ProtocolBuffer(name, get_buffer_element_type<std::remove_cv_t<T>>(), data, nullptr, length);
+}
+
+// Arrays that are allocated at runtime
+template<typename T>
+ProtocolBuffer make_protocol_buffer(const char * name, T* const* data, const size_t* length) {
+    return ProtocolBuffer(name, get_buffer_element_type<std::remove_cv_t<T>>(), nullptr,
+                          reinterpret_cast<const void* const*>(data), length);
+}
+
 
 template<typename ... TArgs>
 struct PropertyListFactory;
@@ -1039,7 +1540,7 @@ public:
         write_string(id_buf, output);
         
         // write arguments
-        write_string(",\"type\":\"function\",\"inputs\":[", output);
+        write_string(",\"type\":\"function\",\"packed\":true,\"inputs\":[", output);
         input_properties_.write_json(id + 1, output),
         write_string("],\"outputs\":[", output);
         output_properties_.write_json(id + 1 + decltype(input_properties_)::endpoint_count, output),
@@ -1051,35 +1552,76 @@ public:
         return nullptr; // can't address functions by name
     }
 
-    void register_endpoints(Endpoint** list, size_t id, size_t length) {
-        if (id < length)
-            list[id] = this;
-        input_properties_.register_endpoints(list, id + 1, length);
-        output_properties_.register_endpoints(list, id + 1 + decltype(input_properties_)::endpoint_count, length);
+    Endpoint* get_by_id(size_t id) {
+        if (id == 0)
+            return this;
+        else if (id < 1 + decltype(input_properties_)::endpoint_count)
+            return input_properties_.get_by_id(id - 1);
+        else
+            return output_properties_.get_by_id(id - 1 - decltype(input_properties_)::endpoint_count);
+    }
+
+    Endpoint* get_by_path_hash(uint32_t hash, uint32_t path_hash) {
+        uint32_t function_hash = hash_path_segment(path_hash, name_);
+        if (function_hash == hash)
+            return this;
+        Endpoint* result = input_properties_.get_by_path_hash(hash, function_hash);
+        if (result) return result;
+        else return output_properties_.get_by_path_hash(hash, function_hash);
+    }
+
+    template<typename TVisitor>
+    void for_each_property(TVisitor& visitor, uint32_t path_hash) {
+        // no action
     }
 
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 0>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) == 0 && std::is_void<T>::value>
     handle_ex() {
         invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
 
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 1>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) == 1 && std::is_void<T>::value>
     handle_ex() {
         std::get<0>(out_args_) = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
     
-    template<typename> std::enable_if_t<sizeof...(TOutputs) >= 2>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) >= 2 && std::is_void<T>::value>
     handle_ex() {
         out_args_ = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
 
+    // @brief Invokes the function.
+    //
+    // Clients that know about packed calls ("packed" in the JSON) pass all
+    // inputs back to back in the request and get all outputs back to back in
+    // the response, so that a call takes one round trip. Other clients write
+    // the input endpoints first, send an empty request and read the output
+    // endpoints afterwards. A request with some but not all of the inputs
+    // does not invoke the function, see accepts_input().
     void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
-        (void) input;
-        (void) input_length;
-        (void) output;
+        if (!accepts_input(input_length))
+            return;
+        constexpr std::array<size_t, sizeof...(TInputs)> input_sizes = {{ sizeof(TInputs)... }};
+        if (sizeof...(TInputs) && input_length) {
+            for (size_t i = 0; i < sizeof...(TInputs); ++i) {
+                input_properties_.get_by_id(i)->handle(input, input_sizes[i], nullptr);
+                input += input_sizes[i];
+            }
+        }
         LOG_FIBRE("tuple still at %x and of size %u\r\n", (uintptr_t)&in_args_, sizeof(in_args_));
-        LOG_FIBRE("invoke function using %d and %.3f\r\n", std::get<0>(in_args_), std::get<1>(in_args_));
         handle_ex<void>();
+        if (output) {
+            for (size_t i = 0; i < sizeof...(TOutputs); ++i)
+                output_properties_.get_by_id(i)->handle(nullptr, 0, output);
+        }
+    }
+
+    bool accepts_input(size_t input_length) final {
+        constexpr std::array<size_t, sizeof...(TInputs)> input_sizes = {{ sizeof(TInputs)... }};
+        size_t packed_length = 0;
+        for (size_t size : input_sizes)
+            packed_length += size;
+        return !sizeof...(TInputs) || !input_length || input_length >= packed_length;
     }
 
     const char * name_;
@@ -1099,12 +1641,33 @@ ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<>> make_protocol_functio
     return ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<>>(name, obj, func_ptr, {names...}, {});
 }
 
+template<typename T>
+struct is_tuple : std::false_type {};
+template<typename ... Ts>
+struct is_tuple<std::tuple<Ts...>> : std::true_type {};
+
 template<typename TObj, typename TRet, typename ... TArgs, typename ... TNames,
-        typename = std::enable_if_t<sizeof...(TArgs) == sizeof...(TNames) && !std::is_void<TRet>::value>>
+        typename = std::enable_if_t<sizeof...(TArgs) == sizeof...(TNames) && !std::is_void<TRet>::value && !is_tuple<TRet>::value>>
 ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>> make_protocol_function(const char * name, TObj& obj, TRet(TObj::*func_ptr)(TArgs...), TNames ... names) {
     return ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<TRet>>(name, obj, func_ptr, {names...}, {"result"});
 }
 
+// @brief Names of the results of a function that returns several values, e.g.
+//  std::tuple<float, float> get_feedback();
+//  make_protocol_function("get_feedback", *this, &Axis::get_feedback, make_protocol_outputs("pos", "vel"))
+// The input names follow the output names.
+template<typename ... TNames>
+std::array<const char *, sizeof...(TNames)> make_protocol_outputs(TNames ... names) {
+    return {{names...}};
+}
+
+template<typename TObj, typename ... TRets, typename ... TArgs, typename ... TNames,
+        typename = std::enable_if_t<sizeof...(TArgs) == sizeof...(TNames) && (sizeof...(TRets) >= 2)>>
+ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<TRets...>> make_protocol_function(const char * name, TObj& obj, std::tuple<TRets...>(TObj::*func_ptr)(TArgs...),
+        std::array<const char *, sizeof...(TRets)> output_names, TNames ... names) {
+    return ProtocolFunction<TObj, std::tuple<TArgs...>, std::tuple<TRets...>>(name, obj, func_ptr, {names...}, output_names);
+}
+
 
 #define FIBRE_EXPORTS(CLASS, ...) \
     struct fibre_export_t { \
@@ -1126,7 +1689,8 @@ public:
     virtual size_t get_endpoint_count() = 0;
     virtual void write_json(size_t id, StreamSink* output) = 0;
     virtual Endpoint* get_by_name(char * name, size_t length) = 0;
-    virtual void register_endpoints(Endpoint** list, size_t id, size_t length) = 0;
+    virtual Endpoint* get_by_id(size_t id) = 0;
+    virtual Endpoint* get_by_path_hash(uint32_t hash) = 0;
 };
 
 template<typename T>
@@ -1139,8 +1703,11 @@ public:
     void write_json(size_t id, StreamSink* output) final {
         return member_list_.write_json(id, output);
     }
-    void register_endpoints(Endpoint** list, size_t id, size_t length) final {
-        return member_list_.register_endpoints(list, id, length);
+    Endpoint* get_by_id(size_t id) final {
+        return member_list_.get_by_id(id);
+    }
+    Endpoint* get_by_path_hash(uint32_t hash) final {
+        return member_list_.get_by_path_hash(hash, kPathHashInit);
     }
     Endpoint* get_by_name(char * name, size_t length) final {
         for (size_t i = 0; i < length; i++) {
@@ -1155,16 +1722,27 @@ public:
 
 
 
-class JSONDescriptorEndpoint : Endpoint {
+class JSONDescriptorEndpoint : public Endpoint {
 public:
     static constexpr size_t endpoint_count = 1;
+    // Reading at this offset returns the descriptor info instead of JSON:
+    // u16 JSON CRC16, u32 JSON length, u32 compressed length (0 if unavailable)
+    static constexpr uint32_t kInfoOffset = 0xFFFFFFFF;
+    // Offsets with this bit set read the compressed JSON (see LZCompressor)
+    static constexpr uint32_t kCompressedOffsetFlag = 0x80000000;
+
     void write_json(size_t id, StreamSink* output);
-    void register_endpoints(Endpoint** list, size_t id, size_t length);
     void handle(const uint8_t* input, size_t input_length, StreamSink* output);
+    void write_json_file(StreamSink* output);
+    uint16_t build_cache();
+
+private:
+    uint8_t* compressed_json_ = nullptr;
+    size_t compressed_length_ = 0;
+    size_t json_length_ = 0;
 };
 
 // defined in protocol.cpp
-extern Endpoint** endpoint_list_;
 extern size_t n_endpoints_;
 extern uint16_t json_crc_;
 extern JSONDescriptorEndpoint json_file_endpoint_;
@@ -1172,30 +1750,23 @@ extern EndpointProvider* application_endpoints_;
 
 bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref);
 Endpoint* get_endpoint(endpoint_ref_t endpoint_ref);
+Endpoint* get_endpoint_by_id(size_t endpoint_id);
+Endpoint* get_endpoint_by_path_hash(uint32_t hash);
 
-// @brief Registers the specified application object list using the provided endpoint table.
+// @brief Publishes the specified application object list.
+// Endpoint 0 is the JSON descriptor, the application endpoints follow. They
+// are looked up by walking the object tree (see MemberList::get_by_id), so
+// no endpoint table needs to be built.
 // This function should only be called once during the lifetime of the application. TODO: fix this.
 // @param application_objects The application objects to be registred.
 template<typename T>
 int fibre_publish(T& application_objects) {
-    static constexpr size_t endpoint_list_size = 1 + T::endpoint_count;
-    static Endpoint* endpoint_list[endpoint_list_size];
     static auto endpoint_provider = EndpointProvider_from_MemberList<T>(application_objects);
 
-    json_file_endpoint_.register_endpoints(endpoint_list, 0, endpoint_list_size);
-    application_objects.register_endpoints(endpoint_list, 1, endpoint_list_size);
-
-    // Update the global endpoint table
-    endpoint_list_ = endpoint_list;
-    n_endpoints_ = endpoint_list_size;
+    n_endpoints_ = 1 + T::endpoint_count;
     application_endpoints_ = &endpoint_provider;
     
-    // Calculate the CRC16 of the JSON file.
-    // The init value is the protocol version.
-    CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
-    uint8_t offset[4] = { 0 };
-    json_file_endpoint_.handle(offset, sizeof(offset), &crc16_calculator);
-    json_crc_ = crc16_calculator.get_crc16();
+    json_crc_ = json_file_endpoint_.build_cache();
 
     return 0;
 }
@@ -0,0 +1,136 @@
+
+#include <fibre/libusb_transport.hpp>
+
+#include <libusb-1.0/libusb.h>
+#include <algorithm>
+#include <string.h>
+
+// Same IDs as WELL_KNOWN_VID_PID_PAIRS in usbbulk_transport.py
+static const struct { uint16_t vid; uint16_t pid; } kKnownDevices[] = {
+    { 0x1209, 0x0D31 },
+    { 0x1209, 0x0D32 },
+    { 0x1209, 0x0D33 },
+};
+
+static bool is_known_device(const libusb_device_descriptor& descriptor) {
+    for (auto& device : kKnownDevices) {
+        if (descriptor.idVendor == device.vid && descriptor.idProduct == device.pid)
+            return true;
+    }
+    return false;
+}
+
+bool LibusbTransport::open(const char* serial_number) {
+    close();
+    if (libusb_init(&context_) != LIBUSB_SUCCESS) {
+        context_ = nullptr;
+        return false;
+    }
+
+    libusb_device** devices = nullptr;
+    ssize_t n_devices = libusb_get_device_list(context_, &devices);
+    for (ssize_t i = 0; i < n_devices && !handle_; ++i) {
+        libusb_device_descriptor descriptor;
+        if (libusb_get_device_descriptor(devices[i], &descriptor) != LIBUSB_SUCCESS || !is_known_device(descriptor))
+            continue;
+        if (libusb_open(devices[i], &handle_) != LIBUSB_SUCCESS) {
+            handle_ = nullptr;
+            continue;
+        }
+        unsigned char serial[32] = { 0 };
+        bool serial_matches = !serial_number
+            || (libusb_get_string_descriptor_ascii(handle_, descriptor.iSerialNumber, serial, sizeof(serial)) > 0
+                && !strcmp(reinterpret_cast<char*>(serial), serial_number));
+        if (!serial_matches || !claim_native_interface()) {
+            libusb_close(handle_);
+            handle_ = nullptr;
+        }
+    }
+    if (n_devices >= 0)
+        libusb_free_device_list(devices, 1);
+
+    if (!handle_)
+        close();
+    return handle_ != nullptr;
+}
+
+// @brief Claims the vendor specific interface (class 0x00, subclass 0x01)
+// and looks up its bulk endpoints
+bool LibusbTransport::claim_native_interface() {
+    libusb_config_descriptor* config = nullptr;
+    if (libusb_get_active_config_descriptor(libusb_get_device(handle_), &config) != LIBUSB_SUCCESS)
+        return false;
+
+    interface_number_ = -1;
+    for (uint8_t i = 0; i < config->bNumInterfaces && interface_number_ < 0; ++i) {
+        if (!config->interface[i].num_altsetting)
+            continue;
+        const libusb_interface_descriptor& intf = config->interface[i].altsetting[0];
+        if (intf.bInterfaceClass != 0x00 || intf.bInterfaceSubClass != 0x01)
+            continue;
+        endpoint_in_ = endpoint_out_ = 0;
+        for (uint8_t j = 0; j < intf.bNumEndpoints; ++j) {
+            const libusb_endpoint_descriptor& endpoint = intf.endpoint[j];
+            if ((endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                continue;
+            if (endpoint.bEndpointAddress & LIBUSB_ENDPOINT_IN)
+                endpoint_in_ = endpoint_in_ ? endpoint_in_ : endpoint.bEndpointAddress;
+            else
+                endpoint_out_ = endpoint_out_ ? endpoint_out_ : endpoint.bEndpointAddress;
+        }
+        if (endpoint_in_ && endpoint_out_)
+            interface_number_ = intf.bInterfaceNumber;
+    }
+    libusb_free_config_descriptor(config);
+
+    if (interface_number_ < 0)
+        return false;
+    libusb_set_auto_detach_kernel_driver(handle_, 1); // not supported on all platforms
+    if (libusb_claim_interface(handle_, interface_number_) != LIBUSB_SUCCESS) {
+        interface_number_ = -1;
+        return false;
+    }
+    return true;
+}
+
+void LibusbTransport::close() {
+    if (handle_) {
+        if (interface_number_ >= 0)
+            libusb_release_interface(handle_, interface_number_);
+        libusb_close(handle_);
+        handle_ = nullptr;
+    }
+    interface_number_ = -1;
+    if (context_) {
+        libusb_exit(context_);
+        context_ = nullptr;
+    }
+}
+
+int LibusbTransport::process_packet(const uint8_t* buffer, size_t length) {
+    if (!handle_ || length > get_mtu())
+        return -1;
+    int transferred = 0;
+    int status = libusb_bulk_transfer(handle_, endpoint_out_, const_cast<uint8_t*>(buffer),
+                                      static_cast<int>(length), &transferred, 100);
+    return (status == LIBUSB_SUCCESS && transferred == static_cast<int>(length)) ? 0 : -1;
+}
+
+int LibusbTransport::get_packet(uint8_t* buffer, size_t max_length, size_t* length, uint32_t timeout_ms) {
+    if (!handle_)
+        return -1;
+    // A transfer shorter than a full response could overflow if the device
+    // sends more, so read into a buffer that holds the largest transfer.
+    uint8_t transfer[kMaxTransferSize];
+    int transferred = 0;
+    // libusb waits forever with a timeout of 0
+    int status = libusb_bulk_transfer(handle_, endpoint_in_, transfer, sizeof(transfer),
+                                      &transferred, timeout_ms ? timeout_ms : 1);
+    if (status == LIBUSB_ERROR_TIMEOUT && !transferred)
+        return 0;
+    if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_TIMEOUT)
+        return -1;
+    *length = std::min(static_cast<size_t>(transferred), max_length);
+    memcpy(buffer, transfer, *length);
+    return 1;
+}
@@ -2,7 +2,15 @@
 tup.include('../tupfiles/build.lua')
 
 fibre_package = define_package{
-    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp'},
+    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp', 'client.cpp'},
     libs={'pthread'},
     headers={'include'}
 }
+
+-- Native USB transport for the C++ client (see client.hpp)
+fibre_libusb_package = define_package{
+    packages={fibre_package},
+    sources={'libusb_transport.cpp'},
+    libs={'usb-1.0'},
+    headers={'include'}
+}
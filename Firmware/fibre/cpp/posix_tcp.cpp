@@ -1,6 +1,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -12,7 +13,11 @@
 
 
 #define TCP_RX_BUF_LEN	512
+#define TCP_TX_BUF_LEN	2048
 
+// @brief Collects the responses to the requests of one received chunk, so
+// that pipelined requests are answered in a single segment.
+// flush() must be called once the chunk is processed.
 class TCPStreamSink : public StreamSink {
 public:
     TCPStreamSink(int socket_fd) :
@@ -20,22 +25,51 @@ public:
     {}
 
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
-        int bytes_sent = send(socket_fd_, buffer, length, 0);
-        if (processed_bytes)
-            *processed_bytes = (bytes_sent == -1) ? 0 : bytes_sent;
-        return (bytes_sent == -1) ? -1 : 0;
+        while (length) {
+            if (length_ == sizeof(buffer_) && flush() != 0)
+                return -1;
+            size_t chunk = std::min(length, sizeof(buffer_) - length_);
+            memcpy(buffer_ + length_, buffer, chunk);
+            length_ += chunk;
+            buffer += chunk;
+            length -= chunk;
+            if (processed_bytes)
+                *processed_bytes += chunk;
+        }
+        return 0;
     }
 
     size_t get_free_space() { return SIZE_MAX; }
 
+    int flush() {
+        size_t offset = 0;
+        while (offset < length_) {
+            ssize_t bytes_sent = send(socket_fd_, buffer_ + offset, length_ - offset, 0);
+            if (bytes_sent == -1) {
+                length_ = 0;
+                return -1;
+            }
+            offset += bytes_sent;
+        }
+        length_ = 0;
+        return 0;
+    }
+
 private:
     int socket_fd_;
+    uint8_t buffer_[TCP_TX_BUF_LEN];
+    size_t length_ = 0;
 };
 
 
 int serve_client(int sock_fd) {
     uint8_t buf[TCP_RX_BUF_LEN];
 
+    // The responses are flushed as soon as a chunk is processed, Nagle's
+    // algorithm would only delay them
+    int nodelay = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     // initialize output stack for this client
     TCPStreamSink tcp_packet_output(sock_fd);
     StreamBasedPacketSink packet2stream(tcp_packet_output);
@@ -58,6 +92,7 @@ int serve_client(int sock_fd) {
         // input processing stack
         size_t processed = 0;
         stream2packet.process_bytes(buf, n_received, &processed);
+        tcp_packet_output.flush();
     }
 }
 
@@ -1,6 +1,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 
+#include <algorithm>
 #include <memory>
 #include <stdlib.h>
 
@@ -13,7 +14,6 @@
 /* Global constant data ------------------------------------------------------*/
 /* Global variables ----------------------------------------------------------*/
 
-Endpoint** endpoint_list_ = nullptr; // initialized by calling fibre_publish
 size_t n_endpoints_ = 0; // initialized by calling fibre_publish
 uint16_t json_crc_; // initialized by calling fibre_publish
 JSONDescriptorEndpoint json_file_endpoint_ = JSONDescriptorEndpoint();
@@ -46,21 +46,32 @@ void hexdump(const uint8_t* buf, size_t len) {
 
 
 
+// The header is the sync byte, the length and a CRC8 over both. With the MSB
+// of the first length byte set, the length is 15 bits in two bytes (big
+// endian), so that the header is 4 bytes.
 int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length, size_t* processed_bytes) {
     int result = 0;
 
     while (length--) {
-        if (header_index_ < sizeof(header_buffer_)) {
+        if (header_index_ < header_length_) {
             // Process header byte
             header_buffer_[header_index_++] = *buffer;
             if (header_index_ == 1 && header_buffer_[0] != CANONICAL_PREFIX) {
                 header_index_ = 0;
-            } else if (header_index_ == 2 && (header_buffer_[1] & 0x80)) {
-                header_index_ = 0; // TODO: support packets larger than 128 bytes
-            } else if (header_index_ == 3 && calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header_buffer_, 3)) {
+            } else if (header_index_ == 2) {
+                header_length_ = (header_buffer_[1] & 0x80) ? 4 : 3;
+            } else if (header_index_ == header_length_ && calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header_buffer_, header_length_)) {
                 header_index_ = 0;
-            } else if (header_index_ == 3) {
-                packet_length_ = header_buffer_[1] + 2;
+                header_error_cnt_++;
+            } else if (header_index_ == header_length_) {
+                size_t payload_length = (header_length_ == 4)
+                        ? (((size_t)(header_buffer_[1] & 0x7f) << 8) | header_buffer_[2])
+                        : header_buffer_[1];
+                if (payload_length + 2 > sizeof(packet_buffer_)) {
+                    header_index_ = 0; // too large for us
+                    oversize_cnt_++;
+                } else
+                    packet_length_ = payload_length + 2;
             }
         } else if (packet_index_ < sizeof(packet_buffer_)) {
             // Process payload byte
@@ -68,9 +79,11 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
         }
 
         // If both header and packet are fully received, hand it on to the packet processor
-        if (header_index_ == 3 && packet_index_ == packet_length_) {
+        if (header_index_ == header_length_ && packet_index_ == packet_length_) {
             if (calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, packet_buffer_, packet_length_) == 0) {
                 result |= output_.process_packet(packet_buffer_, packet_length_ - 2);
+            } else {
+                crc_error_cnt_++;
             }
             header_index_ = packet_index_ = packet_length_ = 0;
         }
@@ -83,19 +96,25 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
 }
 
 int StreamBasedPacketSink::process_packet(const uint8_t *buffer, size_t length) {
-    // TODO: support buffer size >= 128
-    if (length >= 128)
+    if (length > get_mtu())
         return -1;
 
+    // Packets of 128 bytes and more need the extended header, see StreamToPacketSegmenter.
+    // They are only sent when the client asked for them.
     LOG_FIBRE("send header\r\n");
-    uint8_t header[] = {
-        CANONICAL_PREFIX,
-        static_cast<uint8_t>(length),
-        0
-    };
-    header[2] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, 2);
+    uint8_t header[4] = { CANONICAL_PREFIX };
+    size_t header_length;
+    if (length < 128) {
+        header[1] = static_cast<uint8_t>(length);
+        header_length = 3;
+    } else {
+        header[1] = static_cast<uint8_t>(0x80 | (length >> 8));
+        header[2] = static_cast<uint8_t>(length);
+        header_length = 4;
+    }
+    header[header_length - 1] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, header_length - 1);
 
-    if (output_.process_bytes(header, sizeof(header), nullptr))
+    if (output_.process_bytes(header, header_length, nullptr))
         return -1;
     LOG_FIBRE("send payload:\r\n");
     hexdump(buffer, length);
@@ -128,9 +147,45 @@ void JSONDescriptorEndpoint::write_json(size_t id, StreamSink* output) {
     write_string(",\"type\":\"json\",\"access\":\"r\"}", output);
 }
 
-void JSONDescriptorEndpoint::register_endpoints(Endpoint** list, size_t id, size_t length) {
-    if (id < length)
-        list[id] = this;
+// @brief Generates the complete JSON interface definition.
+void JSONDescriptorEndpoint::write_json_file(StreamSink* output) {
+    size_t id = 0;
+    write_string("[", output);
+    json_file_endpoint_.write_json(id, output);
+    id += decltype(json_file_endpoint_)::endpoint_count;
+    write_string(",", output);
+    application_endpoints_->write_json(id, output);
+    write_string("]", output);
+}
+
+// @brief Keeps a compressed copy of the JSON interface definition on the heap.
+// Generating the JSON is slow and it used to be regenerated from the start
+// for every chunk that was read. If the allocation fails, the JSON is still
+// generated on the fly.
+// @returns the CRC16 of the JSON, with the protocol version as init value
+uint16_t JSONDescriptorEndpoint::build_cache() {
+    // drop the cache of a previously published tree
+    free(compressed_json_);
+    compressed_json_ = nullptr;
+    compressed_length_ = 0;
+
+    CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
+    write_json_file(&crc16_calculator);
+
+    LZCompressor counter(nullptr, 0);
+    write_json_file(&counter);
+    counter.finish();
+    json_length_ = counter.get_input_length();
+
+    uint8_t* buffer = (uint8_t*)malloc(counter.get_output_length());
+    if (buffer) {
+        LZCompressor compressor(buffer, counter.get_output_length());
+        write_json_file(&compressor);
+        compressor.finish();
+        compressed_json_ = buffer;
+        compressed_length_ = compressor.get_output_length();
+    }
+    return crc16_calculator.get_crc16();
 }
 
 // Returns part of the JSON interface definition.
@@ -140,48 +195,88 @@ void JSONDescriptorEndpoint::handle(const uint8_t* input, size_t input_length, S
         return;
     uint32_t offset = 0;
     read_le<uint32_t>(&offset, input);
-    NullStreamSink output_with_offset = NullStreamSink(offset, *output);
 
-    size_t id = 0;
-    write_string("[", &output_with_offset);
-    json_file_endpoint_.write_json(id, &output_with_offset);
-    id += decltype(json_file_endpoint_)::endpoint_count;
-    write_string(",", &output_with_offset);
-    application_endpoints_->write_json(id, &output_with_offset);
-    write_string("]", &output_with_offset);
+    if (offset == kInfoOffset) {
+        uint8_t info[10];
+        write_le<uint16_t>(json_crc_, info);
+        write_le<uint32_t>(json_length_, info + 2);
+        write_le<uint32_t>(compressed_length_, info + 6);
+        output->process_bytes(info, std::min(sizeof(info), output->get_free_space()), nullptr);
+    } else if (offset & kCompressedOffsetFlag) {
+        offset &= ~kCompressedOffsetFlag;
+        if (offset < compressed_length_) {
+            size_t length = std::min(compressed_length_ - offset, output->get_free_space());
+            output->process_bytes(compressed_json_ + offset, length, nullptr);
+        }
+    } else if (compressed_json_) {
+        lz_decompress(compressed_json_, compressed_length_, offset, output);
+    } else {
+        NullStreamSink output_with_offset = NullStreamSink(offset, *output);
+        write_json_file(&output_with_offset);
+    }
+}
+
+// Bit 7 of a sequence number is always set, to keep packets apart from the
+// ASCII protocol, so consecutive requests count in the remaining 14 bits.
+static inline uint16_t seq_no_to_index(uint16_t seq_no) {
+    return ((seq_no >> 1) & 0x3f80) | (seq_no & 0x7f);
 }
 
+static inline uint16_t index_to_seq_no(uint16_t index) {
+    return ((index << 1) & 0x7f00) | 0x80 | (index & 0x7f);
+}
+
+// @brief Processes a request or an ack from the host.
+//
+// The host may have up to RESPONSE_WINDOW_SIZE requests in flight. They are
+// processed in the order in which they arrive and each response carries the
+// sequence number of its request, so the host can match them in any order.
+// If the host sends a request again because it did not get the response, the
+// cached response is sent instead of running the request a second time, so
+// writes and function calls take effect at most once.
 int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_t length) {
     LOG_FIBRE("got packet of length %d: \r\n", length);
     hexdump(buffer, length);
     if (length < 4)
         return -1;
 
+    const uint8_t* request = buffer;
+    size_t request_length = length;
     uint16_t seq_no = read_le<uint16_t>(&buffer, &length);
 
     if (seq_no & 0x8000) {
-        // TODO: ack handling
+        handle_ack(seq_no & 0x7fff);
     } else {
-        // TODO: think about some kind of ordering guarantees
-        // currently the seq_no is just used to associate a response with a request
-
         uint16_t endpoint_id = read_le<uint16_t>(&buffer, &length);
         bool expect_response = endpoint_id & 0x8000;
         endpoint_id &= 0x7fff;
 
-        if (endpoint_id >= n_endpoints_)
-            return -1;
-
-        Endpoint* endpoint = endpoint_list_[endpoint_id];
-        if (!endpoint) {
-            LOG_FIBRE("critical: no endpoint at %d", endpoint_id);
-            return -1;
+        // The reserved IDs are handled by the channel itself (endpoint stays null)
+        Endpoint* endpoint = nullptr;
+        bool is_hashed = endpoint_id == HASHED_ENDPOINT_ID;
+        if (is_hashed) {
+            // The path hash follows the expected response length
+            if (length < 2 + 4 + 2)
+                return -1;
+            uint32_t hash = 0;
+            read_le<uint32_t>(&hash, buffer + 2);
+            endpoint = get_endpoint_by_path_hash(hash);
+            if (!endpoint) {
+                LOG_FIBRE("critical: no endpoint with path hash %08x", hash);
+                return -1;
+            }
+        } else if (endpoint_id != SUBSCRIPTION_ENDPOINT_ID && endpoint_id != BATCH_ENDPOINT_ID) {
+            endpoint = get_endpoint_by_id(endpoint_id);
+            if (!endpoint) {
+                LOG_FIBRE("critical: no endpoint at %d", endpoint_id);
+                return -1;
+            }
         }
 
         // Verify packet trailer. The expected trailer value depends on the selected endpoint.
-        // For endpoint 0 this is just the protocol version, for all other endpoints it's a
-        // CRC over the entire JSON descriptor tree (this may change in future versions).
-        uint16_t expected_trailer = endpoint_id ? json_crc_ : PROTOCOL_VERSION;
+        // For endpoint 0 and hashed requests this is just the protocol version, for all
+        // other endpoints it's a CRC over the entire JSON descriptor tree.
+        uint16_t expected_trailer = (endpoint_id && !is_hashed) ? json_crc_ : PROTOCOL_VERSION;
         uint16_t actual_trailer = buffer[length - 2] | (buffer[length - 1] << 8);
         if (expected_trailer != actual_trailer) {
             LOG_FIBRE("trailer mismatch for endpoint %d: expected %04x, got %04x\r\n", endpoint_id, expected_trailer, actual_trailer);
@@ -189,16 +284,52 @@ int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_
         }
         LOG_FIBRE("trailer ok for endpoint %d\r\n", endpoint_id);
 
+        // Sequence number 0 is used by transports without sequence numbers
+        // (e.g. I2C), where a repeated request is a new one
+        bool has_seq_no = seq_no != 0;
+        if (has_seq_no)
+            track_request(seq_no);
+        uint16_t request_crc = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, request, request_length);
+        if (expect_response && has_seq_no && replay_response(seq_no, request_crc))
+            return 0;
+
         // TODO: if more bytes than the MTU were requested, should we abort or just return as much as possible?
 
         uint16_t expected_response_length = read_le<uint16_t>(&buffer, &length);
-
-        // Limit response length according to our local TX buffer size
-        if (expected_response_length > sizeof(tx_buf_) - 2)
-            expected_response_length = sizeof(tx_buf_) - 2;
+        if (is_hashed)
+            read_le<uint32_t>(&buffer, &length); // path hash, resolved above
+
+        // Limit response length according to our local TX buffer size.
+        // Clients that accept responses larger than TX_BUF_SIZE set the MSB of
+        // the expected length. Older servers just limit such a request to TX_BUF_SIZE.
+        size_t max_response_length = TX_BUF_SIZE - 2;
+        if (expected_response_length & 0x8000) {
+            expected_response_length &= 0x7fff;
+            max_response_length = std::min(output_.get_mtu(), sizeof(tx_buf_)) - 2;
+        }
+        if (expected_response_length > max_response_length)
+            expected_response_length = max_response_length;
+
+        // A refused request gets a reject frame instead of a response, which
+        // is not cached, since the request did not run
+        if (endpoint && !endpoint->accepts_input(length - 2)) {
+            LOG_FIBRE("endpoint %d refused an input of length %d\r\n", endpoint_id, length - 2);
+            if (expect_response) {
+                uint8_t reject[4];
+                write_le<uint16_t>(seq_no, reject);
+                write_le<uint16_t>(REJECT_ENDPOINT_ID, reject + 2);
+                output_.process_packet(reject, sizeof(reject));
+            }
+            return 0;
+        }
 
         MemoryStreamSink output(tx_buf_ + 2, expected_response_length);
-        endpoint->handle(buffer, length - 2, &output);
+        if (endpoint)
+            endpoint->handle(buffer, length - 2, &output);
+        else if (endpoint_id == SUBSCRIPTION_ENDPOINT_ID)
+            handle_subscription_request(buffer, length - 2, &output);
+        else
+            handle_batch_request(buffer, length - 2, &output);
 
         // Send response
         if (expect_response) {
@@ -207,6 +338,8 @@ int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_
 
             LOG_FIBRE("send packet:\r\n");
             hexdump(tx_buf_, actual_response_length);
+            if (has_seq_no)
+                cache_response(seq_no, request_crc, actual_response_length);
             output_.process_packet(tx_buf_, actual_response_length);
         }
     }
@@ -214,6 +347,231 @@ int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_
     return 0;
 }
 
+// @brief Handles an ack from the host.
+//
+// An ack is a packet with the sequence number of a request with the MSB set,
+// followed by two reserved bytes. It tells the device that the host received
+// the responses to this request and to all requests before it, so their
+// cached responses are dropped.
+// Hosts that send acks handle NACK frames, so they are only sent after an ack.
+void BidirectionalPacketBasedChannel::handle_ack(uint16_t seq_no) {
+    host_sends_acks_ = true;
+    uint16_t acked_index = seq_no_to_index(seq_no);
+    for (CachedResponse_t& entry : response_cache_) {
+        uint16_t age = (acked_index - seq_no_to_index(entry.seq_no)) & 0x3fff;
+        if (entry.length && age < 0x2000)
+            entry.length = 0;
+    }
+}
+
+// @brief Sends NACK frames for the requests that were skipped.
+//
+// The transports deliver packets in order, so if a request arrives whose
+// sequence number is a few steps ahead of the previous one, the requests in
+// between were lost on the way. The NACK frame has the lost sequence number
+// (bit 15 clear) followed by NACK_ENDPOINT_ID, so the host can send the
+// request again without waiting for its timeout.
+// A jump by more than the window means that the host restarted.
+// The hosts number the requests of a session from FIRST_SEQ_NO on, so the
+// cache of the previous session is dropped when that comes up out of order.
+void BidirectionalPacketBasedChannel::track_request(uint16_t seq_no) {
+    uint16_t index = seq_no_to_index(seq_no);
+    uint16_t first_index = seq_no_to_index(FIRST_SEQ_NO);
+    bool in_order = have_last_index_ && ((index - last_index_) & 0x3fff) <= 1;
+    if (index == first_index && !in_order)
+        reset_session();
+    uint16_t ahead = (index - last_index_) & 0x3fff;
+    if (have_last_index_ && ahead >= 0x4000 - RESPONSE_WINDOW_SIZE)
+        return; // a late or resent request
+    if (have_last_index_ && ahead > 1 && ahead <= RESPONSE_WINDOW_SIZE && host_sends_acks_) {
+        for (uint16_t missing = (last_index_ + 1) & 0x3fff; missing != index; missing = (missing + 1) & 0x3fff) {
+            uint8_t nack[4];
+            write_le<uint16_t>(index_to_seq_no(missing), nack);
+            write_le<uint16_t>(NACK_ENDPOINT_ID, nack + 2);
+            output_.process_packet(nack, sizeof(nack));
+        }
+    }
+    last_index_ = index;
+    have_last_index_ = true;
+}
+
+// @brief Forgets the requests of the previous host session
+void BidirectionalPacketBasedChannel::reset_session() {
+    for (CachedResponse_t& entry : response_cache_)
+        entry.length = 0;
+    have_last_index_ = false;
+    host_sends_acks_ = false;
+}
+
+// @brief Sends the cached response if the request was already processed.
+// @returns: true if the response was sent
+bool BidirectionalPacketBasedChannel::replay_response(uint16_t seq_no, uint16_t request_crc) {
+    for (CachedResponse_t& entry : response_cache_) {
+        if (!entry.length || entry.seq_no != seq_no)
+            continue;
+        if (entry.request_crc != request_crc) {
+            entry.length = 0; // a new request that reuses the sequence number
+            return false;
+        }
+        LOG_FIBRE("replay response to %04x\r\n", seq_no);
+        output_.process_packet(entry.data, entry.length);
+        return true;
+    }
+    return false;
+}
+
+// @brief Keeps the response in tx_buf_ for replay_response().
+// Larger responses (only sent to hosts that ask for them) are not cached, so
+// their requests run again when they are resent.
+void BidirectionalPacketBasedChannel::cache_response(uint16_t seq_no, uint16_t request_crc, size_t length) {
+    if (length > TX_BUF_SIZE)
+        return;
+    CachedResponse_t& entry = response_cache_[next_cache_slot_];
+    next_cache_slot_ = (next_cache_slot_ + 1) % RESPONSE_WINDOW_SIZE;
+    entry.seq_no = seq_no;
+    entry.request_crc = request_crc;
+    entry.length = (uint8_t)length;
+    memcpy(entry.data, tx_buf_, length);
+}
+
+// @brief Replaces the subscription of this channel.
+//
+// The request consists of the interval between frames [ms] as uint16, followed
+// by the uint16 IDs of up to MAX_SUBSCRIBED_ENDPOINTS properties. An interval
+// of 0 or an empty list cancels the subscription. With SUBSCRIPTION_ON_CHANGE
+// in the interval, a frame is also pushed whenever one of the values changed.
+// The response is the uint16 length of the values in one frame, or 0 if the
+// subscription was rejected (unknown ID, not a property or too large for one
+// frame) or cancelled.
+void BidirectionalPacketBasedChannel::handle_subscription_request(const uint8_t* input, size_t input_length, StreamSink* output) {
+    n_subscribed_ = 0;
+    uint16_t frame_length = 0;
+
+    uint16_t interval_ms = 0;
+    if (input_length >= 2)
+        interval_ms = read_le<uint16_t>(&input, &input_length);
+    bool on_change = interval_ms & SUBSCRIPTION_ON_CHANGE;
+    interval_ms &= ~SUBSCRIPTION_ON_CHANGE;
+
+    size_t n = 0;
+    bool ok = interval_ms > 0 && input_length >= 2 && input_length / 2 <= MAX_SUBSCRIBED_ENDPOINTS;
+    while (ok && input_length >= 2) {
+        uint16_t endpoint_id = read_le<uint16_t>(&input, &input_length);
+        Endpoint* endpoint = get_endpoint_by_id(endpoint_id);
+        ok = endpoint && endpoint->is_property();
+        if (ok)
+            subscribed_data_[n] = endpoint->get_wire_data(&subscribed_lengths_[n]);
+        subscribed_endpoints_[n++] = endpoint;
+    }
+
+    if (ok) {
+        // Check that the values fit into one frame after the 4 byte header.
+        // Values that do not fit would be left out without notice.
+        size_t length = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t value[8]; // largest property type
+            MemoryStreamSink value_output(value, sizeof(value));
+            subscribed_endpoints_[i]->handle(nullptr, 0, &value_output);
+            length += sizeof(value) - value_output.get_free_space();
+        }
+        ok = length <= TX_BUF_SIZE - 4;
+        frame_length = (uint16_t)length;
+    }
+
+    if (ok) {
+        subscription_interval_ms_ = interval_ms;
+        subscription_restart_ = true;
+        subscription_on_change_ = on_change;
+        n_subscribed_ = n;
+    } else {
+        frame_length = 0;
+    }
+
+    uint8_t response[2];
+    write_le<uint16_t>(frame_length, response);
+    output->process_bytes(response, sizeof(response), nullptr);
+}
+
+// @brief Executes a list of endpoint operations in order.
+//
+// Each operation consists of the uint16 endpoint ID, the uint8 input length,
+// the uint8 output length and the input. The response is the concatenation of
+// the outputs, each padded with zeros to its output length, so that the
+// client can split it up. Processing stops at the first malformed operation
+// (including an input that the endpoint refuses) or at the first output that
+// does not fit into the response any more, which the client detects from the
+// shorter response.
+void BidirectionalPacketBasedChannel::handle_batch_request(const uint8_t* input, size_t input_length, StreamSink* output) {
+    while (input_length >= 4) {
+        uint16_t endpoint_id = read_le<uint16_t>(&input, &input_length);
+        uint8_t op_input_length = read_le<uint8_t>(&input, &input_length);
+        uint8_t op_output_length = read_le<uint8_t>(&input, &input_length);
+        if (op_input_length > input_length || op_output_length > output->get_free_space())
+            return;
+        Endpoint* endpoint = get_endpoint_by_id(endpoint_id);
+        if (!endpoint || !endpoint->accepts_input(op_input_length))
+            return;
+
+        uint8_t op_output[UINT8_MAX] = { 0 };
+        MemoryStreamSink op_output_sink(op_output, op_output_length);
+        endpoint->handle(input, op_input_length, &op_output_sink);
+        output->process_bytes(op_output, op_output_length, nullptr);
+
+        input += op_input_length;
+        input_length -= op_input_length;
+    }
+}
+
+// @brief Pushes a frame with the subscribed values if one is due.
+//
+// The frame has the same layout as a request: a uint16 frame counter (bit 15
+// clear) in place of the sequence number, SUBSCRIPTION_ENDPOINT_ID in place of
+// the endpoint ID and the values of the subscribed properties, in the order in
+// which they were subscribed. If the output fails, the subscription is
+// cancelled, so that a host that went away does not keep the channel busy.
+// In on change mode, the values are sampled on every call and a frame is due
+// when they differ from the last frame, so that errors and state changes
+// reach the host within one call without polling.
+void BidirectionalPacketBasedChannel::update_subscription(uint32_t now_ms) {
+    if (n_subscribed_ == 0)
+        return;
+    if (subscription_restart_) {
+        subscription_restart_ = false;
+        next_frame_ms_ = now_ms;
+    }
+    bool due = (int32_t)(now_ms - next_frame_ms_) >= 0;
+    if (!due && !subscription_on_change_)
+        return;
+
+    // Values that are stored in wire format are copied straight from memory
+    MemoryStreamSink frame(tx_buf_ + 4, TX_BUF_SIZE - 4);
+    for (size_t i = 0; i < n_subscribed_; ++i) {
+        if (subscribed_data_[i])
+            frame.process_bytes(reinterpret_cast<const uint8_t*>(subscribed_data_[i]), subscribed_lengths_[i], nullptr);
+        else
+            subscribed_endpoints_[i]->handle(nullptr, 0, &frame);
+    }
+    size_t length = TX_BUF_SIZE - 4 - frame.get_free_space();
+    if (subscription_on_change_) {
+        if (!due && memcmp(last_frame_, tx_buf_ + 4, length) == 0)
+            return;
+        memcpy(last_frame_, tx_buf_ + 4, length);
+    }
+
+    if (subscription_on_change_) {
+        next_frame_ms_ = now_ms + subscription_interval_ms_; // heartbeat if nothing changes
+    } else {
+        next_frame_ms_ += subscription_interval_ms_;
+        if ((int32_t)(now_ms - next_frame_ms_) >= 0)
+            next_frame_ms_ = now_ms + subscription_interval_ms_; // fast-forward if we missed several frames
+    }
+    write_le<uint16_t>(frame_count_, tx_buf_);
+    write_le<uint16_t>(SUBSCRIPTION_ENDPOINT_ID, tx_buf_ + 2);
+    frame_count_ = (frame_count_ + 1) & 0x7fff;
+    if (output_.process_packet(tx_buf_, 4 + length) != 0)
+        n_subscribed_ = 0;
+}
+
 bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref) {
     return (endpoint_ref.json_crc == json_crc_)
         && (endpoint_ref.endpoint_id < n_endpoints_);
@@ -221,7 +579,26 @@ bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref) {
 
 Endpoint* get_endpoint(endpoint_ref_t endpoint_ref) {
     if (is_endpoint_ref_valid(endpoint_ref))
-        return endpoint_list_[endpoint_ref.endpoint_id];
+        return get_endpoint_by_id(endpoint_ref.endpoint_id);
     else
         return nullptr;
 }
+
+// @brief Returns the endpoint with the given ID or nullptr if there is none.
+Endpoint* get_endpoint_by_id(size_t endpoint_id) {
+    if (endpoint_id == 0)
+        return &json_file_endpoint_;
+    else if (endpoint_id < n_endpoints_)
+        return application_endpoints_->get_by_id(endpoint_id - 1);
+    else
+        return nullptr;
+}
+
+// @brief Returns the application endpoint whose path hashes to the given
+// value (see hash_path_segment), or nullptr if there is none.
+// This walks the object tree, so it takes longer than get_endpoint_by_id.
+Endpoint* get_endpoint_by_path_hash(uint32_t hash) {
+    if (!application_endpoints_)
+        return nullptr;
+    return application_endpoints_->get_by_path_hash(hash);
+}
@@ -1,5 +1,5 @@
 
 from .discovery import find_any, find_all
 from .utils import Event, Logger, TimeoutError
-from .protocol import ChannelBrokenException, ChannelDamagedException
+from .protocol import ChannelBrokenException, ChannelDamagedException, RequestRejectedException
 from .shell import launch_shell
@@ -0,0 +1,254 @@
+"""
+asyncio interface to fibre objects (requires Python 3.5 or newer).
+
+The blocking interface in remote_object.py waits for every response before
+it sends the next request. Here, each property access and function call
+returns a future right away and its request goes out immediately, so many
+requests can be in flight on one channel. The responses are matched to the
+requests by their sequence number.
+
+Use it through RemoteObject.aio(), e.g.
+    async def read_positions(odrv0):
+        a = odrv0.aio()
+        return await asyncio.gather(a.axis0.encoder.pos_estimate,
+                                    a.axis1.encoder.pos_estimate)
+"""
+
+import asyncio
+import collections
+import fibre.protocol
+from fibre.protocol import ChannelBrokenException, ChannelDamagedException, RequestRejectedException
+from fibre.utils import TimeoutError
+from fibre.remote_object import RemoteObject, RemoteProperty, RemoteFunction, RemoteBuffer
+
+class AckSignal():
+    """
+    Stands in for the threading event of a blocking request in
+    Channel._expected_acks. The receiver thread calls set() when the
+    response or a reject frame arrives, which resolves the future on the
+    event loop, and resend() when the device reports that the request was lost.
+    """
+    def __init__(self, async_channel, seq_no, future):
+        self._async_channel = async_channel
+        self._seq_no = seq_no
+        self._future = future
+
+    def set(self):
+        response = self._async_channel._channel._responses.pop(self._seq_no, None)
+        self._async_channel._loop.call_soon_threadsafe(self._resolve, response)
+
+    def resend(self):
+        self._async_channel._loop.call_soon_threadsafe(self._async_channel._send, self._seq_no)
+
+    def _resolve(self, response):
+        if not self._future.done():
+            if response is None:
+                self._future.set_exception(RequestRejectedException())
+            else:
+                self._future.set_result(response)
+        self._async_channel._on_response(self._seq_no)
+
+class _Request():
+    def __init__(self, packet):
+        self.packet = packet
+        self.sent_at = 0 # position in the order of transmissions
+        self.done = False
+
+class AsyncChannel():
+    """
+    Pipelines endpoint operations on a fibre.protocol.Channel. At most
+    max_in_flight requests are outstanding at a time, which must not exceed
+    the device's response window (RESPONSE_WINDOW_SIZE in protocol.hpp).
+    Requests that are issued in the same iteration of the event loop, e.g.
+    by asyncio.gather(), are sent together.
+
+    Lost packets are recovered without waiting for the resend timeout where
+    possible: the device answers requests in the order in which they arrive,
+    so when a response arrives, the requests that were sent before it and
+    are still unanswered have lost their request or their response. They
+    are sent again right away and the device replays the cached response if
+    it already ran them. The device also reports lost requests in NACK
+    frames once it received an ack. Everything else is sent again after the
+    channel's resend timeout, like in Channel.remote_endpoint_operation().
+    """
+    def __init__(self, channel, loop, max_in_flight=8):
+        self._channel = channel
+        self._loop = loop
+        self._window = asyncio.Semaphore(max_in_flight)
+        self._ack_interval = max(1, max_in_flight // 2)
+        self._function_locks = {}
+        self._pending = set()
+        self._in_flight = collections.OrderedDict() # seq_no => _Request, in the order they were built
+        self._send_count = 0
+        self._send_queue = []
+        self._unacked = 0
+        channel._channel_broken.subscribe(self._on_channel_broken)
+
+    def _on_channel_broken(self):
+        def fail_all():
+            for future in self._pending:
+                if not future.done():
+                    future.set_exception(ChannelBrokenException())
+        self._loop.call_soon_threadsafe(fail_all)
+
+    def _send(self, seq_no):
+        request = self._in_flight.get(seq_no, None)
+        if request is None or request.done:
+            return
+        self._send_count += 1
+        request.sent_at = self._send_count
+        self._send_queue.append(request.packet)
+        if len(self._send_queue) == 1:
+            self._loop.call_soon(self._flush)
+
+    def _flush(self):
+        """
+        Sends the requests that were queued since the last iteration of the
+        event loop. Stream based outputs get them in one write.
+        """
+        packets, self._send_queue = self._send_queue, []
+        output = self._channel._output
+        try:
+            with self._channel._my_lock:
+                if hasattr(output, 'process_packets'):
+                    output.process_packets(packets)
+                else:
+                    for packet in packets:
+                        output.process_packet(packet)
+        except (ChannelDamagedException, TimeoutError):
+            pass # sent again after the resend timeout
+
+    def _on_response(self, seq_no):
+        request = self._in_flight.get(seq_no, None)
+        if request is None or request.done:
+            return
+        lost = [s for (s, r) in self._in_flight.items() if not r.done and r.sent_at < request.sent_at]
+        self._retire(seq_no)
+        for s in lost:
+            self._send(s)
+
+    def _retire(self, seq_no):
+        """
+        Marks the request as done and acks the requests that are done in
+        the order in which they were built, every few requests.
+        """
+        request = self._in_flight.get(seq_no, None)
+        if request is None or request.done:
+            return
+        request.done = True
+        acked_seq_no = None
+        while len(self._in_flight) and next(iter(self._in_flight.values())).done:
+            acked_seq_no = self._in_flight.popitem(last=False)[0]
+            self._unacked += 1
+        if acked_seq_no is not None and self._unacked >= self._ack_interval:
+            self._unacked = 0
+            try:
+                self._channel.send_ack(acked_seq_no)
+            except (ChannelDamagedException, TimeoutError):
+                pass # the next ack covers these requests too
+
+    async def endpoint_operation(self, endpoint_id, input, output_length):
+        channel = self._channel
+        async with self._window:
+            (seq_no, packet) = channel.build_request(endpoint_id, input, True, output_length)
+            self._in_flight[seq_no] = _Request(packet)
+            try:
+                for _ in range(channel._send_attempts):
+                    if channel._channel_broken.is_set():
+                        raise ChannelBrokenException()
+                    future = self._loop.create_future()
+                    self._pending.add(future)
+                    channel._expected_acks[seq_no] = AckSignal(self, seq_no, future)
+                    try:
+                        self._send(seq_no)
+                        return await asyncio.wait_for(future, channel._resend_timeout)
+                    except asyncio.TimeoutError:
+                        continue # resend
+                    finally:
+                        self._pending.discard(future)
+                raise ChannelBrokenException() # Too many resend attempts
+            finally:
+                channel._expected_acks.pop(seq_no, None)
+                channel._responses.pop(seq_no, None)
+                self._retire(seq_no)
+
+    def function_lock(self, function):
+        """
+        Returns the lock that serializes the calls of a remote function,
+        because all calls share the endpoints of the arguments.
+        """
+        lock = self._function_locks.get(function._trigger_id)
+        if lock is None:
+            lock = self._function_locks[function._trigger_id] = asyncio.Lock()
+        return lock
+
+def get_async_channel(channel):
+    """
+    Returns the AsyncChannel of the channel for the running event loop
+    """
+    loop = asyncio.get_event_loop()
+    async_channel = getattr(channel, '_async_channel', None)
+    if async_channel is None or async_channel._loop is not loop:
+        async_channel = AsyncChannel(channel, loop)
+        channel._async_channel = async_channel
+    return async_channel
+
+async def get_value(prop: RemoteProperty):
+    async_channel = get_async_channel(prop.__channel__)
+    buffer = await async_channel.endpoint_operation(prop._id, None, prop._codec.get_length())
+    return prop._codec.deserialize(buffer)
+
+async def set_value(prop: RemoteProperty, value):
+    async_channel = get_async_channel(prop.__channel__)
+    await async_channel.endpoint_operation(prop._id, prop._codec.serialize(value), 0)
+
+async def call(function: RemoteFunction, *args):
+    if (len(function._inputs) != len(args)):
+        raise TypeError("expected {} arguments but have {}".format(len(function._inputs), len(args)))
+    async_channel = get_async_channel(function._parent.__channel__)
+    if function._packed:
+        # One request that carries the inputs and returns the outputs
+        request, codec = function._pack_call(args)
+        buffer = await async_channel.endpoint_operation(function._trigger_id, request, codec.get_length())
+        return codec.deserialize(buffer)
+    async with async_channel.function_lock(function):
+        await asyncio.gather(*[set_value(prop, arg) for prop, arg in zip(function._inputs, args)])
+        await async_channel.endpoint_operation(function._trigger_id, None, 0)
+        if len(function._outputs) > 1:
+            values = await asyncio.gather(*[get_value(prop) for prop in function._outputs])
+            return function._result_type(*values)
+        if len(function._outputs) > 0:
+            return await get_value(function._outputs[0])
+
+class AsyncObject():
+    """
+    asyncio view of a RemoteObject. Reading a property returns a future of
+    its value, calling a function returns a future of its result. Both are
+    sent right away, so they run concurrently until they are awaited.
+    Writes go through set(), e.g.
+        await a.axis0.controller.config.set('vel_gain', 0.001)
+    """
+    def __init__(self, obj: RemoteObject):
+        self._obj = obj
+
+    def __getattr__(self, name):
+        attr = self._obj._remote_attributes.get(name, None)
+        if isinstance(attr, RemoteObject):
+            return AsyncObject(attr)
+        elif isinstance(attr, RemoteProperty):
+            if not attr._can_read:
+                raise Exception("Cannot read from property {}".format(name))
+            return asyncio.ensure_future(get_value(attr))
+        elif isinstance(attr, RemoteFunction):
+            return lambda *args: asyncio.ensure_future(call(attr, *args))
+        elif isinstance(attr, RemoteBuffer):
+            raise Exception("Buffers are only read with the blocking interface ({}.read())".format(name))
+        raise AttributeError("Attribute {} not found".format(name))
+
+    def set(self, name, value):
+        attr = self._obj._remote_attributes.get(name, None)
+        if not isinstance(attr, RemoteProperty):
+            raise AttributeError("Property {} not found".format(name))
+        if not attr._can_write:
+            raise Exception("Cannot write to property {}".format(name))
+        return asyncio.ensure_future(set_value(attr, value))
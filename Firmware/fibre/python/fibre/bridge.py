@@ -0,0 +1,516 @@
+"""
+Serves one fibre channel (e.g. an ODrive on USB) to several TCP and UDP
+clients at once, so that several processes can use the same device.
+
+All sockets are served from one thread with an epoll based selector. The
+device's responses arrive on the channel's receiver thread and are handed
+to the serving thread through a queue.
+
+Requests of the clients are multiplexed onto the channel: each request gets
+a sequence number of the channel, and the response is sent back to the
+client with the client's sequence number. A client that resends a request
+(same sequence number and content) gets the same channel sequence number
+again, so that the device replays the response instead of running the
+request a second time. Acks of the clients are not forwarded, because the
+device's acks are cumulative over the requests of all clients.
+
+Subscriptions are shared: the device pushes the union of the endpoints
+that the clients subscribed to, at the greatest common divisor of their
+intervals, and each client receives its own endpoints at its own interval.
+
+The bridge can also multicast a fixed set of properties to a UDP group
+(see fibre.multicast). The publisher takes part in the shared
+subscription like a client, so any number of listeners cost the device
+no more than one subscriber.
+"""
+
+import collections
+import math
+import selectors
+import socket
+import struct
+import threading
+import time
+
+import fibre.multicast
+import fibre.protocol
+import fibre.remote_object
+import fibre.utils
+from fibre.protocol import SUBSCRIPTION_ENDPOINT_ID, NACK_ENDPOINT_ID, REJECT_ENDPOINT_ID
+
+# Limits of a subscription, see MAX_SUBSCRIBED_ENDPOINTS and TX_BUF_SIZE in protocol.hpp
+MAX_SUBSCRIBED_ENDPOINTS = 8
+MAX_FRAME_PAYLOAD = fibre.protocol.BATCH_MAX_RESPONSE_SIZE - 2
+
+# Requests are recognized as resends for this long [s]. This must cover the
+# clients' resend timeout times their number of attempts.
+ROUTE_LIFETIME = 30.0
+# UDP clients without a subscription are forgotten after this long [s]
+UDP_CLIENT_TIMEOUT = 60.0
+# TCP clients whose unsent responses exceed this are disconnected [bytes].
+# Subscription frames are dropped for clients that are behind by a quarter of it.
+MAX_TCP_BACKLOG = 1024 * 1024
+MAX_TCP_CLIENTS = 32
+
+def get_endpoint_sizes(json_data):
+    """
+    Returns a dict that maps the endpoint ID of each property in the
+    interface definition to the size of its value
+    """
+    sizes = {}
+    for member in json_data:
+        if member.get('type', None) == 'object':
+            sizes.update(get_endpoint_sizes(member.get('members', [])))
+        elif member.get('type', None) == 'function':
+            sizes.update(get_endpoint_sizes(member.get('inputs', []) + member.get('outputs', [])))
+        elif 'id' in member:
+            for codecs in fibre.remote_object.codecs.values():
+                if member['type'] in codecs:
+                    sizes[int(member['id'])] = codecs[member['type']].get_length()
+                    break
+    return sizes
+
+def get_property_endpoints(json_data, prefix=''):
+    """
+    Returns a dict that maps the path of each property in the interface
+    definition (e.g. "axis0.encoder.pos_estimate") to (endpoint ID, type)
+    """
+    endpoints = {}
+    for member in json_data:
+        path = prefix + member.get('name', '')
+        if member.get('type', None) == 'object':
+            endpoints.update(get_property_endpoints(member.get('members', []), path + '.'))
+        elif member.get('type', None) not in ('function', None) and 'id' in member:
+            endpoints[path] = (int(member['id']), member['type'])
+    return endpoints
+
+class _Subscription():
+    def __init__(self, interval_ms, endpoint_ids):
+        self.interval_ms = interval_ms
+        self.endpoint_ids = endpoint_ids
+        self.decimation = 1 # device frames per frame of this subscription
+        self.phase = 0 # device frames since the last frame of this subscription
+        self.frame_no = 0
+
+class _Client():
+    def __init__(self, name):
+        self.name = name
+        self.routes = {} # client seq_no => (channel seq_no, request)
+        self.subscription = None
+        self.last_seen = time.monotonic()
+
+class _TCPClient(_Client, fibre.protocol.PacketSink, fibre.protocol.StreamSink):
+    def __init__(self, bridge, sock, addr):
+        _Client.__init__(self, "TCP client {}:{}".format(*addr[:2]))
+        self.sock = sock
+        self.outbox = bytearray()
+        self._bridge = bridge
+        self._input = fibre.protocol.StreamToPacketSegmenter(self)
+        self._output = fibre.protocol.StreamBasedPacketSink(self)
+
+    def process_packet(self, packet):
+        self._bridge._on_client_packet(self, bytes(packet))
+
+    def process_bytes(self, bytes):
+        self.outbox += bytes
+
+    def send(self, packet):
+        self._output.process_packet(packet)
+        self._bridge._flush(self)
+
+class _UDPClient(_Client):
+    def __init__(self, sock, addr):
+        _Client.__init__(self, "UDP client {}:{}".format(*addr[:2]))
+        self.outbox = b''
+        self._sock = sock
+        self._addr = addr
+
+    def send(self, packet):
+        try:
+            self._sock.sendto(packet, self._addr)
+        except (BlockingIOError, OSError):
+            pass # datagrams may be lost anyway
+
+class _MulticastClient(_Client):
+    """
+    Publishes the frames of its subscription to a multicast group
+    """
+    def __init__(self, group, port, layout, endpoint_ids, interval_ms):
+        _Client.__init__(self, "multicast {}:{}".format(group, port))
+        self.outbox = b''
+        self.subscription = _Subscription(interval_ms, endpoint_ids)
+        (self._layout_id, self.description) = fibre.multicast.encode_description(layout)
+        self._addr = (group, port)
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self._sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+        self._sock.setblocking(False)
+        self._frame_no = None
+        self._seq_no = 0
+
+    def send(self, packet):
+        # The 15 bit frame number of the subscription is extended to 32 bits
+        frame_no = struct.unpack('<H', packet[0:2])[0]
+        if self._frame_no is not None:
+            self._seq_no = (self._seq_no + ((frame_no - self._frame_no) & 0x7fff)) & 0xffffffff
+        self._frame_no = frame_no
+        self._send(fibre.multicast.MULTICAST_DATA_MAGIC + struct.pack('<HI', self._layout_id, self._seq_no) + packet[4:])
+
+    def send_description(self):
+        self._send(self.description)
+
+    def _send(self, datagram):
+        try:
+            self._sock.sendto(datagram, self._addr)
+        except (BlockingIOError, OSError):
+            pass # datagrams may be lost anyway
+
+    def close(self):
+        self._sock.close()
+
+class Bridge():
+    def __init__(self, channel, json_data, logger, port, host='', multicast=None):
+        """
+        Serves the channel on TCP and UDP on the given port.
+        json_data is the interface definition of the device (the "members"
+        of the JSON that is read from endpoint 0).
+        multicast is None or (group, port, paths, interval_ms) to publish
+        the properties at paths to the multicast group, see fibre.multicast.
+        """
+        self._channel = channel
+        self._logger = logger
+        self._endpoint_sizes = get_endpoint_sizes(json_data)
+        self._selector = selectors.DefaultSelector()
+        self._clients = {} # socket or UDP address => _Client
+        self._routes = {} # channel seq_no => (client, client seq_no, time)
+        self._lock = threading.Lock() # protects _routes and _device_subscription for the receiver thread
+        self._device_subscription = None # (interval_ms, endpoint IDs) pushed by the device
+        self._device_frame_no = None
+        self._device_packets = collections.deque()
+
+        self._tcp_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._tcp_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._tcp_sock.bind((host, port))
+        self._tcp_sock.listen(MAX_TCP_CLIENTS)
+        self._tcp_sock.setblocking(False)
+        self._selector.register(self._tcp_sock, selectors.EVENT_READ, self._on_accept)
+
+        self._udp_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._udp_sock.bind((host, port))
+        self._udp_sock.setblocking(False)
+        self._selector.register(self._udp_sock, selectors.EVENT_READ, self._on_datagram)
+
+        # Wakes up the serving thread when the device sent something
+        (self._wakeup_recv, self._wakeup_send) = socket.socketpair()
+        self._wakeup_recv.setblocking(False)
+        self._wakeup_send.setblocking(False)
+        self._selector.register(self._wakeup_recv, selectors.EVENT_READ, self._on_wakeup)
+
+        self._multicast = None
+        if multicast is not None:
+            (group, multicast_port, paths, interval_ms) = multicast
+            endpoints = get_property_endpoints(json_data)
+            unknown = [path for path in paths if path not in endpoints]
+            if unknown:
+                raise ValueError("unknown properties: {}".format(', '.join(unknown)))
+            endpoint_ids = [endpoints[path][0] for path in paths]
+            if (len(set(endpoint_ids)) > MAX_SUBSCRIBED_ENDPOINTS
+                    or sum(self._endpoint_sizes[ep] for ep in set(endpoint_ids)) > MAX_FRAME_PAYLOAD):
+                raise ValueError("at most {} properties of {} bytes together can be multicast"
+                                 .format(MAX_SUBSCRIBED_ENDPOINTS, MAX_FRAME_PAYLOAD))
+            self._multicast = _MulticastClient(group, multicast_port,
+                                               [(path, endpoints[path][1]) for path in paths],
+                                               endpoint_ids, interval_ms)
+            self._clients['multicast'] = self._multicast
+
+        self._forward_packet = channel.process_packet
+        channel.process_packet = self._on_device_packet
+
+    def run(self, cancellation_token):
+        """
+        Serves the clients until cancellation_token is set or the channel breaks
+        """
+        stop = fibre.utils.Event(cancellation_token)
+        self._channel._channel_broken.subscribe(lambda: stop.set())
+        stop.subscribe(self._wakeup)
+        next_cleanup = time.monotonic() + 1.0
+        if self._multicast is not None:
+            self._multicast.send_description()
+            self._update_device_subscription()
+        try:
+            while not stop.is_set():
+                for key, mask in self._selector.select(timeout=1.0):
+                    key.data(key.fileobj, mask)
+                if time.monotonic() >= next_cleanup:
+                    next_cleanup = time.monotonic() + 1.0
+                    self._clean_up()
+        finally:
+            self._channel.process_packet = self._forward_packet
+            for client in list(self._clients.values()):
+                if isinstance(client, _TCPClient):
+                    self._disconnect(client)
+            self._set_device_subscription(None)
+            if self._multicast is not None:
+                self._multicast.close()
+            self._selector.close()
+            self._tcp_sock.close()
+            self._udp_sock.close()
+            self._wakeup_recv.close()
+            self._wakeup_send.close()
+
+    def _wakeup(self):
+        try:
+            self._wakeup_send.send(b'\0')
+        except (BlockingIOError, OSError):
+            pass # a wakeup is already pending
+
+    ## Receiver thread of the channel ##
+
+    def _on_device_packet(self, packet):
+        packet = bytes(packet)
+        if len(packet) < 2:
+            return self._forward_packet(packet)
+        seq_no = struct.unpack('<H', packet[0:2])[0]
+        endpoint_id = struct.unpack('<H', packet[2:4])[0] if len(packet) >= 4 else None
+        with self._lock:
+            if seq_no & 0x8000 or endpoint_id in (NACK_ENDPOINT_ID, REJECT_ENDPOINT_ID):
+                mine = (seq_no & 0x7fff) in self._routes
+            else:
+                mine = endpoint_id == SUBSCRIPTION_ENDPOINT_ID and self._device_subscription is not None
+        if not mine:
+            return self._forward_packet(packet) # a request of this process
+        self._device_packets.append(packet)
+        self._wakeup()
+
+    ## Serving thread ##
+
+    def _on_wakeup(self, sock, mask):
+        try:
+            while sock.recv(512):
+                pass
+        except BlockingIOError:
+            pass
+        while self._device_packets:
+            packet = self._device_packets.popleft()
+            seq_no = struct.unpack('<H', packet[0:2])[0]
+            endpoint_id = struct.unpack('<H', packet[2:4])[0] if len(packet) >= 4 else None
+            if seq_no & 0x8000 or endpoint_id in (NACK_ENDPOINT_ID, REJECT_ENDPOINT_ID):
+                self._on_response(seq_no, packet)
+            else:
+                self._on_frame(seq_no, packet[4:])
+
+    def _on_accept(self, sock, mask):
+        try:
+            (client_sock, addr) = sock.accept()
+        except (BlockingIOError, OSError):
+            return
+        if sum(isinstance(c, _TCPClient) for c in self._clients.values()) >= MAX_TCP_CLIENTS:
+            client_sock.close()
+            return
+        client_sock.setblocking(False)
+        client_sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        client = _TCPClient(self, client_sock, addr)
+        self._clients[client_sock] = client
+        self._selector.register(client_sock, selectors.EVENT_READ, self._on_tcp_ready)
+        self._logger.debug("{} connected".format(client.name))
+
+    def _on_tcp_ready(self, sock, mask):
+        client = self._clients.get(sock, None)
+        if client is None:
+            return
+        if mask & selectors.EVENT_WRITE:
+            self._flush(client)
+        if mask & selectors.EVENT_READ:
+            try:
+                data = sock.recv(4096)
+            except BlockingIOError:
+                return
+            except OSError:
+                data = b''
+            if not data:
+                self._disconnect(client)
+                return
+            client.last_seen = time.monotonic()
+            client._input.process_bytes(data)
+
+    def _on_datagram(self, sock, mask):
+        while True:
+            try:
+                (packet, addr) = sock.recvfrom(1024)
+            except (BlockingIOError, OSError):
+                return
+            client = self._clients.get(addr, None)
+            if client is None:
+                client = self._clients[addr] = _UDPClient(sock, addr)
+                self._logger.debug("{} connected".format(client.name))
+            client.last_seen = time.monotonic()
+            self._on_client_packet(client, packet)
+
+    def _flush(self, client):
+        if client.sock not in self._clients:
+            return # disconnected
+        try:
+            sent = client.sock.send(client.outbox)
+            del client.outbox[:sent]
+        except BlockingIOError:
+            pass
+        except OSError:
+            self._disconnect(client)
+            return
+        if len(client.outbox) > MAX_TCP_BACKLOG:
+            self._logger.warn("{} does not keep up, disconnecting".format(client.name))
+            self._disconnect(client)
+            return
+        events = selectors.EVENT_READ | (selectors.EVENT_WRITE if client.outbox else 0)
+        self._selector.modify(client.sock, events, self._on_tcp_ready)
+
+    def _disconnect(self, client):
+        self._logger.debug("{} disconnected".format(client.name))
+        if isinstance(client, _TCPClient):
+            self._selector.unregister(client.sock)
+            client.sock.close()
+            self._clients.pop(client.sock, None)
+        else:
+            self._clients.pop(client._addr, None)
+        with self._lock:
+            for channel_seq_no in [s for (s, route) in self._routes.items() if route[0] is client]:
+                self._routes.pop(channel_seq_no)
+        if client.subscription is not None:
+            client.subscription = None
+            self._update_device_subscription()
+
+    def _clean_up(self):
+        if self._multicast is not None:
+            self._multicast.send_description() # for listeners that joined later
+        now = time.monotonic()
+        with self._lock:
+            for channel_seq_no in [s for (s, route) in self._routes.items() if route[2] < now - ROUTE_LIFETIME]:
+                (client, client_seq_no, _) = self._routes.pop(channel_seq_no)
+                if client.routes.get(client_seq_no, (None,))[0] == channel_seq_no:
+                    client.routes.pop(client_seq_no)
+        for client in list(self._clients.values()):
+            if isinstance(client, _UDPClient) and client.subscription is None and client.last_seen < now - UDP_CLIENT_TIMEOUT:
+                self._disconnect(client)
+
+    def _on_client_packet(self, client, packet):
+        if len(packet) < 4:
+            return
+        (client_seq_no, endpoint_id) = struct.unpack('<HH', packet[0:4])
+        if client_seq_no & 0x8000:
+            return # ack, see module docstring
+        if (endpoint_id & 0x7fff) == SUBSCRIPTION_ENDPOINT_ID:
+            return self._on_subscription_request(client, client_seq_no, endpoint_id, packet)
+
+        # A resend of a request reuses the channel sequence number
+        request = packet[2:]
+        route = client.routes.get(client_seq_no, None)
+        if route is not None and route[1] == request and route[0] in self._routes:
+            channel_seq_no = route[0]
+        else:
+            channel_seq_no = self._channel.next_seq_no()
+            with self._lock:
+                previous = self._routes.get(channel_seq_no, None)
+                if previous is not None: # the channel's sequence numbers wrapped around
+                    previous[0].routes.pop(previous[1], None)
+                self._routes[channel_seq_no] = (client, client_seq_no, time.monotonic())
+            client.routes[client_seq_no] = (channel_seq_no, request)
+
+        try:
+            with self._channel._my_lock:
+                self._channel._output.process_packet(struct.pack('<H', channel_seq_no) + request)
+        except (fibre.protocol.ChannelDamagedException, fibre.utils.TimeoutError):
+            pass # the client resends it
+
+    def _on_response(self, seq_no, packet):
+        with self._lock:
+            route = self._routes.get(seq_no & 0x7fff, None)
+        if route is None:
+            return # the client is gone
+        (client, client_seq_no, _) = route
+        client.send(struct.pack('<H', client_seq_no | (seq_no & 0x8000)) + packet[2:])
+
+    ## Shared subscriptions ##
+
+    def _on_subscription_request(self, client, client_seq_no, endpoint_id, packet):
+        payload = packet[6:-2]
+        interval_ms = struct.unpack('<H', payload[0:2])[0] if len(payload) >= 2 else 0
+        endpoint_ids = list(struct.unpack('<{}H'.format(len(payload[2:]) // 2), payload[2:2 + len(payload[2:]) // 2 * 2]))
+
+        previous = client.subscription
+        client.subscription = None
+        frame_length = 0
+        if interval_ms > 0 and endpoint_ids and all(ep in self._endpoint_sizes for ep in endpoint_ids):
+            client.subscription = _Subscription(interval_ms, endpoint_ids)
+            union = self._get_subscribed_endpoints()
+            if (len(union) <= MAX_SUBSCRIBED_ENDPOINTS
+                    and sum(self._endpoint_sizes[ep] for ep in union) <= MAX_FRAME_PAYLOAD):
+                frame_length = sum(self._endpoint_sizes[ep] for ep in endpoint_ids)
+            else:
+                client.subscription = None # does not fit in the shared frame
+        if client.subscription is not None or previous is not None:
+            self._update_device_subscription()
+        if endpoint_id & 0x8000:
+            client.send(struct.pack('<HH', client_seq_no | 0x8000, frame_length))
+
+    def _get_subscribed_endpoints(self):
+        endpoint_ids = set()
+        for client in self._clients.values():
+            if client.subscription is not None:
+                endpoint_ids.update(client.subscription.endpoint_ids)
+        return sorted(endpoint_ids)
+
+    def _update_device_subscription(self):
+        subscriptions = [c.subscription for c in self._clients.values() if c.subscription is not None]
+        if not subscriptions:
+            return self._set_device_subscription(None)
+        interval_ms = 0
+        for subscription in subscriptions:
+            interval_ms = math.gcd(interval_ms, subscription.interval_ms)
+        for subscription in subscriptions:
+            subscription.decimation = subscription.interval_ms // interval_ms
+            subscription.phase = subscription.decimation # send the next frame right away
+        self._set_device_subscription((interval_ms, self._get_subscribed_endpoints()))
+
+    def _set_device_subscription(self, subscription):
+        if subscription == self._device_subscription:
+            return
+        (interval_ms, endpoint_ids) = subscription or (0, [])
+        request = struct.pack('<H{}H'.format(len(endpoint_ids)), interval_ms, *endpoint_ids)
+        (seq_no, packet) = self._channel.build_request(SUBSCRIPTION_ENDPOINT_ID, request, False, 0)
+        with self._lock:
+            self._device_subscription = subscription
+            self._device_frame_no = None
+        try:
+            with self._channel._my_lock:
+                self._channel._output.process_packet(packet)
+        except (fibre.protocol.ChannelDamagedException, fibre.utils.TimeoutError):
+            self._logger.warn("failed to update the subscription of the device")
+
+    def _on_frame(self, frame_no, payload):
+        if self._device_subscription is None:
+            return
+        endpoint_ids = self._device_subscription[1]
+        offsets = {}
+        offset = 0
+        for ep in endpoint_ids:
+            offsets[ep] = offset
+            offset += self._endpoint_sizes[ep]
+        if len(payload) != offset:
+            return # a frame of the previous subscription
+
+        # Frames that the device did not send count for the clients' frame numbers
+        step = 1 if self._device_frame_no is None else (frame_no - self._device_frame_no) & 0x7fff
+        self._device_frame_no = frame_no
+        for client in list(self._clients.values()):
+            subscription = client.subscription
+            if subscription is None:
+                continue
+            subscription.phase += step
+            if subscription.phase < subscription.decimation:
+                continue
+            subscription.frame_no = (subscription.frame_no + subscription.phase // subscription.decimation - 1) & 0x7fff
+            subscription.phase %= subscription.decimation
+            if len(client.outbox) > MAX_TCP_BACKLOG // 4:
+                continue # the client is behind, drop telemetry first
+            values = b''.join(payload[offsets[ep]:offsets[ep] + self._endpoint_sizes[ep]] for ep in subscription.endpoint_ids)
+            client.send(struct.pack('<HH', subscription.frame_no, SUBSCRIPTION_ENDPOINT_ID) + values)
+            subscription.frame_no = (subscription.frame_no + 1) & 0x7fff
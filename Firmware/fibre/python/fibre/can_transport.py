@@ -0,0 +1,193 @@
+"""
+Provides a PacketSource/PacketSink for fibre over CAN.
+Fibre packets are segmented into CAN frames like ISO 15765-2 (ISO-TP), see
+the description in Firmware/communication/interface_can.cpp.
+
+requires python-can
+  pip install python-can
+"""
+
+import queue
+import threading
+import time
+import traceback
+import can
+import fibre.protocol
+from fibre.utils import TimeoutError, wait_any
+
+CMD_BITS = 5
+CMD_FIBRE_RX = 0x1E # host -> device
+CMD_FIBRE_TX = 0x1F # device -> host
+
+PCI_SINGLE_FRAME = 0x0
+PCI_FIRST_FRAME = 0x1
+PCI_CONSECUTIVE_FRAME = 0x2
+PCI_FLOW_CONTROL = 0x3
+FC_CONTINUE = 0x0
+FC_WAIT = 0x1
+FC_OVERFLOW = 0x2
+
+ISOTP_TIMEOUT = 1.0 # [s] N_Bs and N_Cr of ISO 15765-2
+DEFAULT_BITRATE = 500000
+
+class CANIsoTpTransport(fibre.protocol.PacketSource, fibre.protocol.PacketSink):
+  """
+  Talks to one device on a CAN bus. The device is addressed by the node ID of
+  its axis0 (<axis>.config.can_node_id).
+  """
+  def __init__(self, bus, node_id, logger):
+    self._bus = bus
+    self._logger = logger
+    self._tx_id = (node_id << CMD_BITS) | CMD_FIBRE_RX
+    self._rx_id = (node_id << CMD_BITS) | CMD_FIBRE_TX
+    self._packets = queue.Queue()
+    self._flow_control = queue.Queue()
+    self._rx_buffer = None
+    self._rx_length = 0
+    self._rx_seq = 0
+    self._rx_deadline = 0
+    self._closed = threading.Event()
+    self._reader = threading.Thread(target=self._reader_thread)
+    self._reader.daemon = True
+    self._reader.start()
+
+  def close(self):
+    self._closed.set()
+
+  def _send_frame(self, data):
+    msg = can.Message(arbitration_id=self._tx_id, data=bytes(data), is_extended_id=False)
+    try:
+      self._bus.send(msg, timeout=ISOTP_TIMEOUT)
+    except can.CanError:
+      raise fibre.protocol.ChannelDamagedException()
+
+  def _reader_thread(self):
+    try:
+      while not self._closed.is_set():
+        msg = self._bus.recv(timeout=0.1)
+        if msg is None or msg.is_extended_id or msg.arbitration_id != self._rx_id or len(msg.data) < 1:
+          continue
+        self._on_frame(bytes(msg.data))
+    except Exception:
+      self._logger.debug("CAN reader thread is exiting: " + traceback.format_exc())
+      self._packets.put(None) # breaks the channel
+
+  def _on_frame(self, data):
+    pci = data[0] >> 4
+    if pci == PCI_FLOW_CONTROL:
+      self._flow_control.put(data)
+    elif pci == PCI_SINGLE_FRAME:
+      length = data[0] & 0xf
+      if 0 < length <= len(data) - 1:
+        self._rx_buffer = None
+        self._packets.put(bytearray(data[1:1 + length]))
+    elif pci == PCI_FIRST_FRAME and len(data) == 8:
+      self._rx_length = ((data[0] & 0xf) << 8) | data[1]
+      self._rx_buffer = bytearray(data[2:8])
+      self._rx_seq = 1
+      self._rx_deadline = time.monotonic() + ISOTP_TIMEOUT
+      # Receive the whole packet without further flow control and without gaps
+      self._send_frame([(PCI_FLOW_CONTROL << 4) | FC_CONTINUE, 0, 0])
+    elif pci == PCI_CONSECUTIVE_FRAME and self._rx_buffer is not None:
+      if (data[0] & 0xf) != (self._rx_seq & 0xf) or time.monotonic() > self._rx_deadline:
+        self._logger.debug("dropping CAN packet after a sequence error or timeout")
+        self._rx_buffer = None
+        return
+      self._rx_buffer += data[1:1 + self._rx_length - len(self._rx_buffer)]
+      self._rx_seq += 1
+      self._rx_deadline = time.monotonic() + ISOTP_TIMEOUT
+      if len(self._rx_buffer) >= self._rx_length:
+        self._packets.put(self._rx_buffer)
+        self._rx_buffer = None
+
+  def _wait_for_flow_control(self):
+    """
+    Returns (block_size, st_min) once the device allows to continue.
+    """
+    deadline = time.monotonic() + ISOTP_TIMEOUT
+    while True:
+      try:
+        data = self._flow_control.get(timeout=max(deadline - time.monotonic(), 0))
+      except queue.Empty:
+        raise TimeoutError()
+      status = data[0] & 0xf
+      if status == FC_CONTINUE and len(data) >= 3:
+        st_min = data[2]
+        if st_min <= 0x7f:
+          st_min = st_min / 1000.0
+        elif 0xf1 <= st_min <= 0xf9:
+          st_min = (st_min - 0xf0) / 10000.0
+        else:
+          st_min = 0.127
+        return data[1], st_min
+      elif status == FC_WAIT:
+        deadline = time.monotonic() + ISOTP_TIMEOUT
+      else:
+        raise fibre.protocol.ChannelDamagedException()
+
+  def process_packet(self, packet):
+    if len(packet) <= 7:
+      self._send_frame(bytearray([(PCI_SINGLE_FRAME << 4) | len(packet)]) + packet)
+      return
+    if len(packet) > 0xfff:
+      raise NotImplementedError("packet larger than 4095 bytes not supported")
+
+    # Discard stale flow control frames from an aborted transfer
+    while not self._flow_control.empty():
+      self._flow_control.get_nowait()
+    self._send_frame(bytearray([(PCI_FIRST_FRAME << 4) | (len(packet) >> 8), len(packet) & 0xff]) + packet[:6])
+    offset = 6
+    seq = 1
+    while offset < len(packet):
+      block_size, st_min = self._wait_for_flow_control()
+      sent_in_block = 0
+      while offset < len(packet) and (block_size == 0 or sent_in_block < block_size):
+        self._send_frame(bytearray([(PCI_CONSECUTIVE_FRAME << 4) | (seq & 0xf)]) + packet[offset:offset + 7])
+        offset += 7
+        seq += 1
+        sent_in_block += 1
+        if st_min:
+          time.sleep(st_min)
+
+  def get_packet(self, deadline):
+    try:
+      packet = self._packets.get(timeout=max(deadline - time.monotonic(), 0))
+    except queue.Empty:
+      raise TimeoutError()
+    if packet is None:
+      raise fibre.protocol.ChannelBrokenException()
+    return packet
+
+
+def discover_channels(path, serial_number, callback, cancellation_token, channel_termination_token, logger):
+  """
+  Connects to a device on a CAN bus based on the path spec
+  INTERFACE:CHANNEL[:NODE_ID], e.g. "socketcan:can0:0" (the node ID of the
+  device's axis0, 0 if omitted). The arguments are passed to python-can.
+  This function blocks until cancellation_token is set.
+  Channels spawned by this function run until channel_termination_token is set.
+  """
+  try:
+    parts = path.split(":")
+    interface = parts[0]
+    channel_name = parts[1]
+    node_id = int(parts[2], 0) if len(parts) > 2 else 0
+  except (ValueError, IndexError):
+    raise Exception('"{}" is not a valid CAN path specification. The format should be '
+                    'something like "socketcan:can0:0".'.format(path))
+
+  while not cancellation_token.is_set():
+    try:
+      bus = can.interface.Bus(bustype=interface, channel=channel_name, bitrate=DEFAULT_BITRATE)
+      transport = CANIsoTpTransport(bus, node_id, logger)
+      channel = fibre.protocol.Channel(
+              "CAN device {}:{} node {}".format(interface, channel_name, node_id),
+              transport, transport, channel_termination_token, logger)
+    except Exception:
+      logger.debug("CAN channel init failed. More info: " + traceback.format_exc())
+    else:
+      callback(channel)
+      wait_any(None, cancellation_token, channel._channel_broken)
+      transport.close()
+      bus.shutdown()
+    time.sleep(1)
@@ -3,7 +3,10 @@ Provides functions for the discovery of Fibre nodes
 """
 
 import sys
+import os
+import importlib
 import json
+import struct
 import time
 import threading
 import traceback
@@ -13,33 +16,82 @@ import fibre.remote_object
 from fibre.utils import Event, Logger
 from fibre.protocol import ChannelBrokenException, TimeoutError
 
-# Load all installed transport layers
+# Offsets on endpoint 0, see JSONDescriptorEndpoint in protocol.hpp
+JSON_INFO_OFFSET = 0xffffffff
+JSON_COMPRESSED_OFFSET_FLAG = 0x80000000
 
-channel_types = {}
+cache_dir = os.path.join(os.path.expanduser("~"), ".cache", "fibre")
 
-try:
-    import fibre.usbbulk_transport
-    channel_types['usb'] = fibre.usbbulk_transport.discover_channels
-except ImportError:
-    pass
+def get_interface_definition(channel, logger):
+    """
+    Reads the JSON interface definition from endpoint 0.
+    If the device reports the CRC of its JSON, a copy from a previous
+    connection is used if available, otherwise the compressed JSON is
+    downloaded if the device offers it. Devices that don't support this
+    answer the info request with an empty response.
+    """
+    info = channel.remote_endpoint_operation(0, struct.pack("<I", JSON_INFO_OFFSET), True, 10)
+    if len(info) < 10:
+        return channel.remote_endpoint_read_buffer(0)
+    json_crc16, json_length, compressed_length = struct.unpack("<HII", info[:10])
 
-try:
-    import fibre.serial_transport
-    channel_types['serial'] = fibre.serial_transport.discover_channels
-except ImportError:
-    pass
+    def is_valid(json_bytes):
+        return (json_bytes is not None and len(json_bytes) == json_length and
+                fibre.protocol.calc_crc16(fibre.protocol.PROTOCOL_VERSION, json_bytes) == json_crc16)
 
-try:
-    import fibre.tcp_transport
-    channel_types['tcp'] = fibre.tcp_transport.discover_channels
-except ImportError:
-    pass
+    # The CRC alone is only 16 bits, so the length is part of the key
+    cache_file = os.path.join(cache_dir, "{:04x}-{}.json".format(json_crc16, json_length))
+    try:
+        with open(cache_file, "rb") as fp:
+            json_bytes = fp.read()
+        if is_valid(json_bytes):
+            logger.debug("using cached JSON from " + cache_file)
+            return json_bytes
+    except IOError:
+        pass
 
-try:
-    import fibre.udp_transport
-    channel_types['udp'] = fibre.udp_transport.discover_channels
-except ImportError:
-    pass
+    json_bytes = None
+    if compressed_length:
+        compressed = channel.remote_endpoint_read_buffer(0, JSON_COMPRESSED_OFFSET_FLAG)
+        try:
+            json_bytes = fibre.protocol.lz_decompress(compressed)
+        except (ValueError, IndexError):
+            logger.debug("failed to decompress JSON")
+        logger.debug("downloaded {} bytes of compressed JSON".format(len(compressed)))
+    if not is_valid(json_bytes):
+        json_bytes = channel.remote_endpoint_read_buffer(0)
+        if not is_valid(json_bytes):
+            return json_bytes
+
+    try:
+        if not os.path.isdir(cache_dir):
+            os.makedirs(cache_dir)
+        with open(cache_file, "wb") as fp:
+            fp.write(json_bytes)
+    except (IOError, OSError) as error:
+        logger.debug("could not cache JSON: " + str(error))
+    return json_bytes
+
+# The transport layers are only imported when a path spec uses them, because
+# some of their dependencies (e.g. python-can) take long to import.
+transport_modules = {
+    'usb': 'fibre.usbbulk_transport',
+    'serial': 'fibre.serial_transport',
+    'tcp': 'fibre.tcp_transport',
+    'udp': 'fibre.udp_transport',
+    'can': 'fibre.can_transport',
+}
+
+def get_discover_channels(prefix, logger):
+    """
+    Returns the discover_channels function of the transport with the given
+    prefix, or None if it is not installed
+    """
+    try:
+        return importlib.import_module(transport_modules[prefix]).discover_channels
+    except ImportError as error:
+        logger.debug("transport {} not available: {}".format(prefix, error))
+        return None
 
 def noprint(text):
     pass
@@ -65,7 +117,7 @@ def find_all(path, serial_number,
         try:
             logger.debug("Connecting to device on " + channel._name)
             try:
-                json_bytes = channel.remote_endpoint_read_buffer(0)
+                json_bytes = get_interface_definition(channel, logger)
             except (TimeoutError, ChannelBrokenException):
                 logger.debug("no response - probably incompatible")
                 return
@@ -89,25 +141,35 @@ def find_all(path, serial_number,
             obj.__dict__['_json_data'] = json_data['members']
             obj.__dict__['_json_crc'] = json_crc16
 
-            device_serial_number = fibre.utils.get_serial_number_str(obj)
-            if serial_number != None and device_serial_number != serial_number:
-                logger.debug("Ignoring device with serial number {}".format(device_serial_number))
-                return
+            if serial_number != None:
+                device_serial_number = fibre.utils.get_serial_number_str(obj)
+                if device_serial_number != serial_number:
+                    logger.debug("Ignoring device with serial number {}".format(device_serial_number))
+                    return
             did_discover_object_callback(obj)
         except Exception:
             logger.debug("Unexpected exception after discovering channel: " + traceback.format_exc())
 
-    # For each connection type, kick off an appropriate discovery loop
+    def connect_in_background(channel):
+        # Several devices on one transport connect in parallel and the
+        # discovery loop of the transport doesn't wait for them
+        t = threading.Thread(target=did_discover_channel, args=(channel,))
+        t.daemon = True
+        t.start()
+
+    # For each connection type, kick off an appropriate discovery loop.
+    # All transports are scanned in parallel.
     for search_spec in path.split(','):
         prefix = search_spec.split(':')[0]
         the_rest = ':'.join(search_spec.split(':')[1:])
-        if prefix in channel_types:
-            t = threading.Thread(target=channel_types[prefix],
-                             args=(the_rest, serial_number, did_discover_channel, search_cancellation_token, channel_termination_token, logger))
+        if not prefix in transport_modules:
+            raise Exception("Invalid path spec \"{}\"".format(search_spec))
+        discover_channels = get_discover_channels(prefix, logger)
+        if discover_channels:
+            t = threading.Thread(target=discover_channels,
+                             args=(the_rest, serial_number, connect_in_background, search_cancellation_token, channel_termination_token, logger))
             t.daemon = True
             t.start()
-        else:
-            raise Exception("Invalid path spec \"{}\"".format(search_spec))
 
 
 def find_any(path="usb", serial_number=None,
@@ -0,0 +1,122 @@
+"""
+Receives the telemetry that a fibre bridge multicasts on the local network,
+see Bridge(multicast=...) in fibre.bridge.
+
+The bridge sends two kinds of datagrams to the group:
+  - Description: MULTICAST_DESCRIPTION_MAGIC, uint16 layout ID, followed by
+    the JSON list of [path, type] of the values in a data datagram. It is
+    repeated every second, so that receivers can join at any time.
+  - Data: MULTICAST_DATA_MAGIC, uint16 layout ID, uint32 sequence number,
+    followed by the values in the order of the description, little endian.
+    The sequence number advances by one per subscription interval, also
+    for frames that were lost between the device and the bridge, so a gap
+    in the sequence numbers is a lost sample.
+The layout ID is the CRC16 of the description JSON.
+
+Example:
+    receiver = TelemetryReceiver('239.255.70.66', 9920)
+    while True:
+        (seq_no, lost, values) = receiver.receive()
+        print(values['axis0.encoder.pos_estimate'])
+"""
+
+import json
+import socket
+import struct
+
+import fibre.protocol
+import fibre.remote_object
+from fibre.utils import TimeoutError
+
+MULTICAST_DESCRIPTION_MAGIC = b'FBMD'
+MULTICAST_DATA_MAGIC = b'FBMT'
+DEFAULT_MULTICAST_GROUP = '239.255.70.66'
+
+def encode_description(layout):
+    """
+    Returns (layout ID, description datagram) for a list of (path, type)
+    """
+    description = json.dumps([[path, type_str] for (path, type_str) in layout]).encode('ascii')
+    layout_id = fibre.protocol.calc_crc16(fibre.protocol.CRC16_INIT, description)
+    return (layout_id, MULTICAST_DESCRIPTION_MAGIC + struct.pack('<H', layout_id) + description)
+
+def get_codec(type_str):
+    for codecs in fibre.remote_object.codecs.values():
+        if type_str in codecs:
+            return codecs[type_str]
+    raise ValueError("unsupported type {}".format(type_str))
+
+class TelemetryReceiver():
+    """
+    Joins the multicast group of a bridge and decodes its telemetry.
+    Any number of receivers can listen to the same group, on the same or on
+    other machines.
+    """
+    def __init__(self, group=DEFAULT_MULTICAST_GROUP, port=9920, interface='0.0.0.0'):
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self._sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._sock.bind(('', port))
+        membership = socket.inet_aton(group) + socket.inet_aton(interface)
+        self._sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+        self._layout_id = None
+        self._fields = [] # (path, codec)
+        self._length = 0
+        self._next_seq_no = None
+        self.received = 0
+        self.lost = 0
+
+    @property
+    def paths(self):
+        return [path for (path, _) in self._fields]
+
+    def _on_description(self, layout_id, description):
+        if layout_id == self._layout_id:
+            return
+        if fibre.protocol.calc_crc16(fibre.protocol.CRC16_INIT, description) != layout_id:
+            return
+        self._fields = [(path, get_codec(type_str)) for (path, type_str) in json.loads(description.decode('ascii'))]
+        self._length = sum(codec.get_length() for (_, codec) in self._fields)
+        self._layout_id = layout_id
+        self._next_seq_no = None
+
+    def receive(self, timeout=None):
+        """
+        Waits for the next sample. Returns (sequence number, number of
+        samples lost since the previous one, dict of path => value).
+        Raises a TimeoutError if no sample arrives within timeout seconds.
+        Data that arrives before the first description is skipped.
+        """
+        self._sock.settimeout(timeout)
+        while True:
+            try:
+                datagram = self._sock.recv(2048)
+            except socket.timeout:
+                raise TimeoutError()
+            if len(datagram) < 6:
+                continue
+            magic = datagram[0:4]
+            layout_id = struct.unpack('<H', datagram[4:6])[0]
+            if magic == MULTICAST_DESCRIPTION_MAGIC:
+                self._on_description(layout_id, datagram[6:])
+                continue
+            if magic != MULTICAST_DATA_MAGIC or layout_id != self._layout_id or len(datagram) != 10 + self._length:
+                continue
+            seq_no = struct.unpack('<I', datagram[6:10])[0]
+            if self._next_seq_no is None:
+                lost = 0
+            else:
+                lost = (seq_no - self._next_seq_no) & 0xffffffff
+                if lost >= 0x80000000:
+                    continue # reordered or duplicate
+            self._next_seq_no = (seq_no + 1) & 0xffffffff
+            self.received += 1
+            self.lost += lost
+            values = {}
+            offset = 10
+            for (path, codec) in self._fields:
+                values[path] = codec.deserialize(datagram[offset:offset + codec.get_length()])
+                offset += codec.get_length()
+            return (seq_no, lost, values)
+
+    def close(self):
+        self._sock.close()
@@ -23,10 +23,35 @@ CRC8_INIT = 0x42
 CRC16_INIT = 0x1337
 PROTOCOL_VERSION = 1
 
+# Endpoint ID of the channel's subscription, see Channel.subscribe()
+SUBSCRIPTION_ENDPOINT_ID = 0x7fff
+SUBSCRIPTION_ON_CHANGE = 0x8000
+# Endpoint ID of batched operations, see Channel.remote_endpoint_batch()
+BATCH_ENDPOINT_ID = 0x7ffe
+# Frames to this ID report a lost request, see Channel.send_ack()
+NACK_ENDPOINT_ID = 0x7ffd
+# Frames to this ID carry the status that native USB pushes every USB frame, see Channel.telemetry_callback
+TELEMETRY_ENDPOINT_ID = 0x7ffc
+# Requests to this ID address an endpoint by its path, see get_path_hash()
+HASHED_ENDPOINT_ID = 0x7ffb
+# Frames to this ID are sent instead of the response to a request that the device refused
+REJECT_ENDPOINT_ID = 0x7ffa
+# A USB packet holds 64 bytes, minus the request header and trailer
+BATCH_MAX_REQUEST_SIZE = 56
+# The device's TX buffer minus the sequence number (TX_BUF_SIZE in protocol.hpp)
+BATCH_MAX_RESPONSE_SIZE = 30
+# Devices that send large responses answer batches that fill a request in full
+BATCH_MAX_EXTENDED_RESPONSE_SIZE = BATCH_MAX_REQUEST_SIZE
+
 CRC8_DEFAULT = 0x37 # this must match the polynomial in the C++ implementation
 CRC16_DEFAULT = 0x3d65 # this must match the polynomial in the C++ implementation
 
 MAX_PACKET_SIZE = 128
+# Packets of MAX_PACKET_SIZE and more use the extended stream header.
+# They are only sent by servers that support it, see Channel.remote_endpoint_operation().
+MAX_EXTENDED_PACKET_SIZE = 0x8000
+# Responses larger than this are only sent if the request sets the MSB of the expected length
+LEGACY_MAX_RESPONSE_SIZE = 30
 
 def calc_crc(remainder, value, polynomial, bitwidth):
     topbit = (1 << (bitwidth - 1))
@@ -41,26 +66,72 @@ def calc_crc(remainder, value, polynomial, bitwidth):
 
     return remainder & ((1 << bitwidth) - 1)
 
+def _make_crc_table(polynomial, bitwidth):
+    return [calc_crc(0, byte, polynomial, bitwidth) for byte in range(256)]
+
+# calc_crc() of every byte value with a zero remainder, so that the CRCs below
+# take one lookup per byte instead of eight shifts
+_crc8_table = _make_crc_table(CRC8_DEFAULT, 8)
+_crc16_table = _make_crc_table(CRC16_DEFAULT, 16)
+
 def calc_crc8(remainder, value):
     if isinstance(value, bytearray) or isinstance(value, bytes) or isinstance(value, list):
+        table = _crc8_table
         for byte in value:
             if not isinstance(byte,int):
                 byte = ord(byte)
-            remainder = calc_crc(remainder, byte, CRC8_DEFAULT, 8)
+            remainder = table[remainder ^ byte]
     else:
-        remainder = calc_crc(remainder, byte, CRC8_DEFAULT, 8)
+        remainder = _crc8_table[remainder ^ value]
     return remainder
 
 def calc_crc16(remainder, value):
     if isinstance(value, bytearray) or isinstance(value, bytes) or isinstance(value, list):
+        table = _crc16_table
         for byte in value:
             if not isinstance(byte, int):
                 byte = ord(byte)
-            remainder = calc_crc(remainder, byte, CRC16_DEFAULT, 16)
+            remainder = ((remainder << 8) & 0xffff) ^ table[(remainder >> 8) ^ byte]
     else:
-        remainder = calc_crc(remainder, value, CRC16_DEFAULT, 16)
+        remainder = ((remainder << 8) & 0xffff) ^ _crc16_table[(remainder >> 8) ^ value]
     return remainder
 
+def get_path_hash(path):
+    """
+    Returns the hash by which requests to HASHED_ENDPOINT_ID address the
+    endpoint at path (e.g. "axis0.encoder.pos_estimate"). Function inputs
+    are members of their function, e.g. "get_adc_voltage.gpio".
+    This is FNV-1a over the path with a leading '.' and must match
+    hash_path_segment() in protocol.hpp.
+    """
+    hash = 2166136261
+    for byte in ('.' + path).encode('ascii'):
+        hash = ((hash ^ byte) * 16777619) & 0xffffffff
+    return hash
+
+def lz_decompress(data):
+    """
+    Decompresses the output of LZCompressor in protocol.hpp
+    """
+    data = bytearray(data)
+    output = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        if token & 0x80:
+            length = (token & 0x7f) + 3
+            distance = data[i] + 1
+            i += 1
+            if distance > len(output):
+                raise ValueError("invalid match distance")
+            for _ in range(length):
+                output.append(output[-distance])
+        else:
+            output += data[i:i + token + 1]
+            i += token + 1
+    return bytes(output)
+
 # Can be verified with http://www.sunshine2k.de/coding/javascript/crc/crc_js.html:
 #print(hex(calc_crc8(0x12, [1, 2, 3, 4, 5, 0x10, 0x13, 0x37])))
 #print(hex(calc_crc16(0xfeef, [1, 2, 3, 4, 5, 0x10, 0x13, 0x37])))
@@ -81,6 +152,20 @@ class ChannelBrokenException(Exception):
     """
     pass
 
+class RequestRejectedException(Exception):
+    """
+    Raised when the device refused a request without running it, e.g. a
+    function call with only some of the inputs
+    """
+    pass
+
+class BatchIncompleteException(Exception):
+    """
+    Raised when the response to a batch is shorter than expected, because
+    the device stopped at an operation it could not execute
+    """
+    pass
+
 
 class StreamSource(ABC):
     @abc.abstractmethod
@@ -103,6 +188,18 @@ class PacketSink(ABC):
         pass
 
 
+def get_header_length(length_byte):
+    """
+    Returns the length of a stream header given its first length byte.
+    With the MSB set, the length is 15 bits in two bytes (extended header).
+    """
+    return 4 if (length_byte & 0x80) else 3
+
+def get_packet_length(header):
+    if len(header) == 4:
+        return ((header[1] & 0x7f) << 8) | header[2]
+    return header[1]
+
 class StreamToPacketSegmenter(StreamSink):
     def __init__(self, output):
         self._header = []
@@ -110,6 +207,9 @@ class StreamToPacketSegmenter(StreamSink):
         self._packet_length = 0
         self._output = output
 
+    def _header_length(self):
+        return get_header_length(self._header[1]) if len(self._header) >= 2 else 3
+
     def process_bytes(self, bytes):
         """
         Processes an arbitrary number of bytes. If one or more full packets are
@@ -118,23 +218,21 @@ class StreamToPacketSegmenter(StreamSink):
         """
 
         for byte in bytes:
-            if (len(self._header) < 3):
+            if (len(self._header) < self._header_length()):
                 # Process header byte
                 self._header.append(byte)
                 if (len(self._header) == 1) and (self._header[0] != SYNC_BYTE):
                     self._header = []
-                elif (len(self._header) == 2) and (self._header[1] & 0x80):
-                    self._header = [] # TODO: support packets larger than 128 bytes
-                elif (len(self._header) == 3) and calc_crc8(CRC8_INIT, self._header):
+                elif (len(self._header) == self._header_length()) and calc_crc8(CRC8_INIT, self._header):
                     self._header = []
-                elif (len(self._header) == 3):
-                    self._packet_length = self._header[1] + 2
+                elif (len(self._header) == self._header_length()):
+                    self._packet_length = get_packet_length(self._header) + 2
             else:
                 # Process payload byte
                 self._packet.append(byte)
 
             # If both header and packet are fully received, hand it on to the packet processor
-            if (len(self._header) == 3) and (len(self._packet) == self._packet_length):
+            if (len(self._header) == self._header_length()) and (len(self._packet) == self._packet_length):
                 if calc_crc16(CRC16_INIT, self._packet) == 0:
                     self._output.process_packet(self._packet[:-2])
                 self._header = []
@@ -146,58 +244,106 @@ class StreamBasedPacketSink(PacketSink):
     def __init__(self, output):
         self._output = output
 
-    def process_packet(self, packet):
-        if (len(packet) >= MAX_PACKET_SIZE):
-            raise NotImplementedError("packet larger than 127 currently not supported")
+    def _encode(self, packet):
+        if (len(packet) >= MAX_EXTENDED_PACKET_SIZE):
+            raise NotImplementedError("packet larger than {} not supported".format(MAX_EXTENDED_PACKET_SIZE - 1))
 
         header = bytearray()
         header.append(SYNC_BYTE)
-        header.append(len(packet))
+        if (len(packet) < MAX_PACKET_SIZE):
+            header.append(len(packet))
+        else:
+            header.append(0x80 | (len(packet) >> 8))
+            header.append(len(packet) & 0xff)
         header.append(calc_crc8(CRC8_INIT, header))
 
-        self._output.process_bytes(header)
-        self._output.process_bytes(packet)
-
         # append CRC in big endian
         crc16 = calc_crc16(CRC16_INIT, packet)
-        self._output.process_bytes(struct.pack('>H', crc16))
+        return bytes(header) + bytes(packet) + struct.pack('>H', crc16)
+
+    def process_packet(self, packet):
+        self._output.process_bytes(self._encode(packet))
+
+    def process_packets(self, packets):
+        """
+        Sends several packets in a single write, so that a TCP stream
+        carries them in one segment
+        """
+        self._output.process_bytes(b''.join(self._encode(packet) for packet in packets))
 
 class PacketFromStreamConverter(PacketSource):
+    """
+    Splits a byte stream into packets. The input is read in chunks into a
+    buffer, from which the frames are taken out with one search for the sync
+    byte instead of one read per byte. Inputs that implement
+    get_available_bytes(max_bytes, deadline) hand over everything they have
+    received in one call. Others are read with get_bytes_or_fail(), for
+    exactly the bytes the current frame still lacks.
+    """
+    _read_size = 4096
+
     def __init__(self, input):
         self._input = input
-    
-    def get_packet(self, deadline):
+        self._buffer = bytearray()
+        self.crc_error_cnt = 0
+
+    def _read(self, n_bytes, deadline):
+        get_available_bytes = getattr(self._input, 'get_available_bytes', None)
+        if get_available_bytes is None:
+            return self._input.get_bytes_or_fail(n_bytes, deadline)
+        data = get_available_bytes(self._read_size, deadline)
+        if not data:
+            raise TimeoutError("no data received")
+        return data
+
+    def _take_packet(self):
         """
-        Requests bytes from the underlying input stream until a full packet is
-        received or the deadline is reached, in which case None is returned. A
-        deadline before the current time corresponds to non-blocking mode.
+        Removes the first valid frame from the buffer and returns
+        (payload, 0), or returns (None, n) if at least n more bytes are
+        needed to complete a frame.
+        Corrupt frames are skipped by searching for the next sync byte
+        after their start.
         """
+        buffer = self._buffer
         while True:
-            header = bytes()
-
-            # TODO: sometimes this call hangs, even though the device apparently sent something
-            header = header + self._input.get_bytes_or_fail(1, deadline)
-            if (header[0] != SYNC_BYTE):
-                #print("sync byte mismatch")
-                continue
-
-            header = header + self._input.get_bytes_or_fail(1, deadline)
-            if (header[1] & 0x80):
-                #print("packet too large")
-                continue # TODO: support packets larger than 128 bytes
-
-            header = header + self._input.get_bytes_or_fail(1, deadline)
+            start = buffer.find(SYNC_BYTE)
+            if start < 0:
+                del buffer[:]
+                return None, 1
+            del buffer[:start]
+            if len(buffer) < 2:
+                return None, 2 - len(buffer)
+            header_length = get_header_length(buffer[1])
+            if len(buffer) < header_length:
+                return None, header_length - len(buffer)
+            header = buffer[:header_length]
             if calc_crc8(CRC8_INIT, header) != 0:
-                #print("crc8 mismatch")
+                self.crc_error_cnt += 1
+                del buffer[:1]
                 continue
-
-            packet_length = header[1] + 2
-            #print("wait for {} bytes".format(packet_length))
-            packet = self._input.get_bytes_or_fail(packet_length, deadline)
+            end = header_length + get_packet_length(header) + 2
+            if len(buffer) < end:
+                return None, end - len(buffer)
+            packet = bytes(buffer[header_length:end])
             if calc_crc16(CRC16_INIT, packet) != 0:
-                #print("crc16 mismatch")
+                self.crc_error_cnt += 1
+                del buffer[:1]
                 continue
-            return packet[:-2]
+            del buffer[:end]
+            return packet[:-2], 0
+
+    def get_packet(self, deadline):
+        """
+        Requests bytes from the underlying input stream until a full packet is
+        received or the deadline is reached, in which case a TimeoutError is
+        raised. A deadline before the current time corresponds to non-blocking
+        mode.
+        """
+        while True:
+            packet, missing = self._take_packet()
+            if packet is not None:
+                return packet
+            self._buffer += self._read(missing, deadline)
 
 
 class Channel(PacketSink):
@@ -221,6 +367,10 @@ class Channel(PacketSink):
         self._interface_definition_crc = 0
         self._expected_acks = {}
         self._responses = {}
+        self._subscription_callback = None
+        # callback(frame_no, payload) for the frames that the device pushes to TELEMETRY_ENDPOINT_ID
+        self.telemetry_callback = None
+        self._batch_context = threading.local() # see remote_object.Batch
         self._my_lock = threading.Lock()
         self._channel_broken = Event(cancellation_token)
         self.start_receiver_thread(Event(self._channel_broken))
@@ -259,7 +409,25 @@ class Channel(PacketSink):
         t.daemon = True
         t.start()
 
-    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length):
+    def next_seq_no(self):
+        """
+        Returns the sequence number for the next request on this channel
+        """
+        self._my_lock.acquire()
+        try:
+            # FIXME: we hardwire one bit of the seq-no to 1 to avoid conflicts with the ascii protocol.
+            # The counter skips the values with this bit clear, so that consecutive
+            # requests have consecutive numbers in the remaining bits.
+            self._outbound_seq_no = ((self._outbound_seq_no + 1) | 0x80) & 0x7fff
+            return self._outbound_seq_no
+        finally:
+            self._my_lock.release()
+
+    def build_request(self, endpoint_id, input, expect_ack, output_length):
+        """
+        Assigns the next sequence number to an endpoint operation and returns
+        (seq_no, packet). The response, if any, arrives with this seq_no.
+        """
         if input is None:
             input = bytearray(0)
         if (len(input) >= 128):
@@ -268,23 +436,27 @@ class Channel(PacketSink):
         if (expect_ack):
             endpoint_id |= 0x8000
 
-        self._my_lock.acquire()
-        try:
-            self._outbound_seq_no = ((self._outbound_seq_no + 1) & 0x7fff)
-            seq_no = self._outbound_seq_no
-        finally:
-            self._my_lock.release()
-        seq_no |= 0x80 # FIXME: we hardwire one bit of the seq-no to 1 to avoid conflicts with the ascii protocol
+        # Ask for responses larger than the legacy size. Servers that support
+        # this limit them to what the transport can carry, older servers to
+        # the legacy size.
+        if (output_length > LEGACY_MAX_RESPONSE_SIZE):
+            output_length = min(output_length, 0x7fff) | 0x8000
+
+        seq_no = self.next_seq_no()
         packet = struct.pack('<HHH', seq_no, endpoint_id, output_length)
         packet = packet + input
 
         crc16 = calc_crc16(CRC16_INIT, packet)
-        if (endpoint_id & 0x7fff == 0):
+        if ((endpoint_id & 0x7fff) in (0, HASHED_ENDPOINT_ID)):
             trailer = PROTOCOL_VERSION
         else:
             trailer = self._interface_definition_crc
         #print("append trailer " + trailer)
         packet = packet + struct.pack('<H', trailer)
+        return (seq_no, packet)
+
+    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length):
+        (seq_no, packet) = self.build_request(endpoint_id, input, expect_ack, output_length)
 
         if (expect_ack):
             ack_event = Event()
@@ -310,7 +482,10 @@ class Channel(PacketSink):
                     except TimeoutError:
                         attempt += 1
                         continue # resend
-                    return self._responses.pop(seq_no)
+                    response = self._responses.pop(seq_no)
+                    if response is None:
+                        raise RequestRejectedException("endpoint {} refused the request".format(endpoint_id))
+                    return response
                     # TODO: record channel statistics
                 raise ChannelBrokenException() # Too many resend attempts
             finally:
@@ -321,7 +496,28 @@ class Channel(PacketSink):
             self._output.process_packet(packet)
             return None
     
-    def remote_endpoint_read_buffer(self, endpoint_id):
+    def remote_endpoint_operation_by_path(self, path, input, expect_ack, output_length):
+        """
+        Like remote_endpoint_operation() but addresses the endpoint by its path.
+        This does not need the JSON descriptor, so it keeps working if the
+        endpoint IDs change between firmware versions.
+        """
+        if input is None:
+            input = bytearray(0)
+        input = struct.pack('<I', get_path_hash(path)) + input
+        return self.remote_endpoint_operation(HASHED_ENDPOINT_ID, input, expect_ack, output_length)
+
+    def send_ack(self, seq_no):
+        """
+        Tells the device that the responses to the request with seq_no and to
+        all requests before it have arrived, so it can drop them from its
+        replay cache. After the first ack, the device reports lost requests
+        in NACK frames, which call resend() on the object in _expected_acks.
+        """
+        with self._my_lock:
+            self._output.process_packet(struct.pack('<HH', seq_no | 0x8000, 0))
+
+    def remote_endpoint_read_buffer(self, endpoint_id, offset_flags=0):
         """
         Handles reads from long endpoints
         """
@@ -329,12 +525,78 @@ class Channel(PacketSink):
         buffer = bytes()
         while True:
             chunk_length = 512
-            chunk = self.remote_endpoint_operation(endpoint_id, struct.pack("<I", len(buffer)), True, chunk_length)
+            chunk = self.remote_endpoint_operation(endpoint_id, struct.pack("<I", offset_flags | len(buffer)), True, chunk_length)
             if (len(chunk) == 0):
                 break
             buffer += chunk
         return buffer
 
+    def remote_endpoint_batch(self, operations, max_response_size=BATCH_MAX_RESPONSE_SIZE):
+        """
+        Executes a list of (endpoint_id, input, output_length) operations in
+        order, packing as many of them into each request as fit.
+        Responses are at most max_response_size bytes. Only devices that
+        support large responses answer more than BATCH_MAX_RESPONSE_SIZE,
+        others raise BatchIncompleteException.
+        Returns the list of outputs.
+        """
+        outputs = []
+        chunk = []
+        request_size = 0
+        response_size = 0
+
+        def send(chunk):
+            request = b''.join(struct.pack('<HBB', endpoint_id, len(input), output_length) + input
+                               for (endpoint_id, input, output_length) in chunk)
+            expected_length = sum(output_length for (_, _, output_length) in chunk)
+            response = self.remote_endpoint_operation(BATCH_ENDPOINT_ID, request, True, expected_length)
+            if len(response) != expected_length:
+                raise BatchIncompleteException("the device did not execute all operations of the batch")
+            offset = 0
+            for (_, _, output_length) in chunk:
+                outputs.append(response[offset:offset + output_length])
+                offset += output_length
+
+        for (endpoint_id, input, output_length) in operations:
+            input = bytes(input or b'')
+            size = 4 + len(input)
+            if size > BATCH_MAX_REQUEST_SIZE or output_length > max_response_size:
+                raise Exception("operation on endpoint {} is too large for a batch".format(endpoint_id))
+            if chunk and (request_size + size > BATCH_MAX_REQUEST_SIZE
+                          or response_size + output_length > max_response_size):
+                send(chunk)
+                chunk = []
+                request_size = 0
+                response_size = 0
+            chunk.append((endpoint_id, input, output_length))
+            request_size += size
+            response_size += output_length
+        if chunk:
+            send(chunk)
+        return outputs
+
+    def subscribe(self, endpoint_ids, interval_ms, callback, on_change=False):
+        """
+        Makes the device push the values of the given property endpoints
+        every interval_ms milliseconds, replacing any previous subscription
+        on this channel. An interval of 0 cancels the subscription. With
+        on_change=True, the device also pushes them as soon as one of them
+        changes, and interval_ms is the longest time between frames.
+        callback(frame_no, payload) is called on the receiver thread for every
+        frame, where frame_no is a 15 bit counter and payload holds the packed
+        values in the order of endpoint_ids.
+        Returns the length of the payload, or 0 if the device rejected the
+        subscription.
+        """
+        self._subscription_callback = callback if interval_ms else None
+        flags = SUBSCRIPTION_ON_CHANGE if on_change and interval_ms else 0
+        request = struct.pack('<H{}H'.format(len(endpoint_ids)), interval_ms | flags, *endpoint_ids)
+        response = self.remote_endpoint_operation(SUBSCRIPTION_ENDPOINT_ID, request, True, 2)
+        payload_length = struct.unpack('<H', response)[0]
+        if payload_length == 0:
+            self._subscription_callback = None
+        return payload_length
+
     def process_packet(self, packet):
         #print("process packet")
         packet = bytes(packet)
@@ -353,6 +615,27 @@ class Channel(PacketSink):
             else:
                 print("received unexpected ACK: " + str(seq_no))
 
+        elif len(packet) >= 4 and struct.unpack('<H', packet[2:4])[0] == SUBSCRIPTION_ENDPOINT_ID:
+            callback = self._subscription_callback
+            if callback:
+                callback(seq_no, packet[4:])
+
+        elif len(packet) >= 4 and struct.unpack('<H', packet[2:4])[0] == TELEMETRY_ENDPOINT_ID:
+            callback = self.telemetry_callback
+            if callback:
+                callback(seq_no, packet[4:])
+
+        elif len(packet) >= 4 and struct.unpack('<H', packet[2:4])[0] == NACK_ENDPOINT_ID:
+            resend = getattr(self._expected_acks.get(seq_no, None), 'resend', None)
+            if resend:
+                resend()
+
+        elif len(packet) >= 4 and struct.unpack('<H', packet[2:4])[0] == REJECT_ENDPOINT_ID:
+            ack_signal = self._expected_acks.get(seq_no, None)
+            if (ack_signal):
+                self._responses[seq_no] = None # raises RequestRejectedException
+                ack_signal.set()
+
         else:
             #if (calc_crc16(CRC16_INIT, struct.pack('<HBB', PROTOCOL_VERSION, packet[-2], packet[-1]))):
             #     raise Exception("CRC16 mismatch")
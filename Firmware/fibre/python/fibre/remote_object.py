@@ -3,16 +3,26 @@ Provides functions for the discovery of Fibre nodes
 """
 
 import sys
+import collections
 import json
 import struct
 import threading
 import fibre.protocol
 
+# Serializes the lazy construction of RemoteObject members
+_build_lock = threading.RLock()
+
 class ObjectDefinitionError(Exception):
     pass
 
 codecs = {}
 
+# struct format character -> numpy dtype
+numpy_dtypes = {
+    '?': '?', 'b': 'i1', 'B': 'u1', 'h': '<i2', 'H': '<u2',
+    'i': '<i4', 'I': '<u4', 'q': '<i8', 'Q': '<u8', 'f': '<f4',
+}
+
 class StructCodec():
     """
     Generic serializer/deserializer based on struct pack
@@ -20,6 +30,7 @@ class StructCodec():
     def __init__(self, struct_format, target_type):
         self._struct_format = struct_format
         self._target_type = target_type
+        self.dtype = numpy_dtypes.get(struct_format[-1], None)
     def get_length(self):
         return struct.calcsize(self._struct_format)
     def serialize(self, value):
@@ -30,6 +41,112 @@ class StructCodec():
         value = value[0] if len(value) == 1 else value
         return self._target_type(value)
 
+class PendingValue(object):
+    """
+    Stands in for the value of a property that was read inside a batch.
+    The value is available once the batch was sent.
+    """
+    def __init__(self, codec):
+        self._codec = codec
+        self._value = None
+        self.done = False
+
+    @property
+    def value(self):
+        if not self.done:
+            raise Exception("the batch was not sent yet")
+        return self._value
+
+    def _resolve(self, buffer):
+        self._value = self._codec.deserialize(buffer)
+        self.done = True
+
+class PendingRecord(object):
+    """
+    Stands in for the named tuple of the outputs of a function that was
+    called inside a batch on a device without packed calls.
+    """
+    def __init__(self, values, result_type):
+        self._values = values
+        self._result_type = result_type
+
+    @property
+    def done(self):
+        return all(value.done for value in self._values)
+
+    @property
+    def value(self):
+        return self._result_type(*[value.value for value in self._values])
+
+class _FunctionResultCodec():
+    """
+    Decodes the response of a packed function call into None, the value of
+    the only output or a named tuple of the outputs.
+    """
+    def __init__(self, record_codec, result_type):
+        self._record_codec = record_codec
+        self._result_type = result_type
+
+    def get_length(self):
+        return self._record_codec.get_length()
+
+    def deserialize(self, buffer):
+        if self.get_length() == 0:
+            return None
+        values = self._record_codec.deserialize(bytes(buffer[:self.get_length()]))
+        if self._result_type is None:
+            return values[0]
+        return self._result_type(*values)
+
+class Batch(object):
+    """
+    Context manager that coalesces the property accesses and function calls
+    of the current thread on one channel, so that they go out in as few
+    packets as possible when the context exits. Writes and calls take effect
+    in order. Reads return a PendingValue. Nested batches join the outer one.
+    Use it through RemoteObject.batch(), e.g.
+        with odrv0.batch():
+            odrv0.axis0.controller.config.vel_gain = 0.001
+            pos = odrv0.axis0.encoder.pos_estimate
+        print(pos.value)
+    """
+    def __init__(self, channel):
+        self._channel = channel
+        self._operations = []
+        self._pending = []
+        self._owner = False
+
+    def __enter__(self):
+        context = self._channel._batch_context
+        if getattr(context, 'batch', None) is None:
+            context.batch = self
+            self._owner = True
+        return context.batch
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if self._owner:
+            self._channel._batch_context.batch = None
+            if exc_type is None:
+                self.flush()
+        return False
+
+    def add(self, endpoint_id, input, codec):
+        pending = PendingValue(codec) if codec else None
+        self._operations.append((endpoint_id, input, codec.get_length() if codec else 0))
+        self._pending.append(pending)
+        return pending
+
+    def flush(self):
+        operations, pending = self._operations, self._pending
+        self._operations, self._pending = [], []
+        outputs = self._channel.remote_endpoint_batch(operations)
+        for value, output in zip(pending, outputs):
+            if value:
+                value._resolve(output)
+
+def get_open_batch(channel):
+    return getattr(channel._batch_context, 'batch', None)
+
 class RemoteProperty():
     """
     Used internally by dynamically created objects to translate
@@ -69,11 +186,18 @@ class RemoteProperty():
         self._can_write = 'w' in access_mode
 
     def get_value(self):
+        batch = get_open_batch(self._parent.__channel__)
+        if batch:
+            return batch.add(self._id, None, self._codec)
         buffer = self._parent.__channel__.remote_endpoint_operation(self._id, None, True, self._codec.get_length())
         return self._codec.deserialize(buffer)
 
     def set_value(self, value):
         buffer = self._codec.serialize(value)
+        batch = get_open_batch(self._parent.__channel__)
+        if batch:
+            batch.add(self._id, buffer, None)
+            return
         # TODO: Currenly we wait for an ack here. Settle on the default guarantee.
         self._parent.__channel__.remote_endpoint_operation(self._id, buffer, True, 0)
 
@@ -88,6 +212,135 @@ class RemoteProperty():
             val_str = str(self.get_value())
         return "{} = {} ({})".format(self._name, val_str, self._property_type.__name__)
 
+# element type -> (numpy dtype, array.array typecode, size)
+buffer_element_types = {
+    'uint8': ('<u1', 'B', 1),
+    'int16': ('<i2', 'h', 2),
+    'uint16': ('<u2', 'H', 2),
+    'int32': ('<i4', 'i', 4),
+    'uint32': ('<u4', 'I', 4),
+    'float': ('<f4', 'f', 4),
+}
+
+class RemoteBuffer():
+    """
+    Read-only array on the device that is read in bulk, see read()
+    """
+    def __init__(self, json_data, parent):
+        self._parent = parent
+        self.__channel__ = parent.__channel__
+        id_str = json_data.get("id", None)
+        if id_str is None:
+            raise ObjectDefinitionError("unspecified endpoint ID")
+        self._id = int(id_str)
+        self._name = json_data.get("name", "[anonymous]")
+        element_type = json_data.get("element", "uint8")
+        if element_type not in buffer_element_types:
+            raise ObjectDefinitionError("unsupported buffer element type {}".format(element_type))
+        (self._dtype, self._typecode, self._element_size) = buffer_element_types[element_type]
+
+    def read_bytes(self, offset=0, length=None):
+        """
+        Reads length bytes starting at the byte offset, or up to the end of
+        the buffer if length is None. The result is shorter if the
+        buffer ends earlier.
+        """
+        buffer = bytes()
+        while length is None or len(buffer) < length:
+            chunk_length = 512 if length is None else min(512, length - len(buffer))
+            chunk = self.__channel__.remote_endpoint_operation(self._id, struct.pack("<I", offset + len(buffer)), True, chunk_length)
+            if len(chunk) == 0:
+                break
+            buffer += chunk
+        return buffer
+
+    def read(self, offset=0, length=None):
+        """
+        Reads length elements starting at element offset (all by default).
+        Returns a numpy array if numpy is installed and an array.array otherwise.
+        """
+        data = self.read_bytes(offset * self._element_size,
+                               None if length is None else length * self._element_size)
+        data = data[:len(data) - len(data) % self._element_size]
+        try:
+            import numpy
+            return numpy.frombuffer(data, dtype=self._dtype)
+        except ImportError:
+            import array
+            result = array.array(self._typecode)
+            result.frombytes(data)
+            return result
+
+    def _dump(self):
+        return "{} (buffer of {}, use .read())".format(self._name, self._dtype)
+
+class RecordCodec():
+    """
+    Decodes the values of a list of properties, packed back to back as in a
+    batch response or a subscription frame, in one call instead of one
+    struct.unpack() per value.
+    """
+    def __init__(self, properties, names):
+        codecs = [prop._codec for prop in properties]
+        if not all(isinstance(codec, StructCodec) for codec in codecs):
+            raise TypeError("only numeric and boolean properties can be decoded in bulk")
+        self._struct = struct.Struct('<' + ''.join(codec._struct_format.lstrip('<') for codec in codecs))
+        self._fields = [(name, codec.dtype) for (name, codec) in zip(names, codecs)]
+        self.names = list(names)
+
+    def get_length(self):
+        return self._struct.size
+
+    def deserialize(self, buffer):
+        """
+        Returns the tuple of values of one record
+        """
+        return self._struct.unpack(buffer)
+
+    def decode(self, data):
+        """
+        Decodes the complete records in data into a numpy structured array
+        with one field per property, or a list of tuples if numpy is not
+        installed.
+        """
+        data = data[:len(data) - len(data) % self._struct.size]
+        try:
+            import numpy
+            return numpy.frombuffer(data, dtype=numpy.dtype(self._fields))
+        except ImportError:
+            return list(self._struct.iter_unpack(data))
+
+class BulkReader():
+    """
+    Reads samples of a fixed list of properties and returns them as a numpy
+    structured array with one row per sample and one field per property.
+    The reads of all samples are packed into as few batch requests as fit
+    (see Channel.remote_endpoint_batch()) and decoded in one call. Use it
+    through RemoteObject.bulk_reader(), e.g.
+        reader = odrv0.bulk_reader(['vbus_voltage', 'axis0.encoder.pos_estimate'])
+        samples = reader.read(100)
+        samples['axis0.encoder.pos_estimate'].mean()
+    The samples are taken back to back as the device handles the batches.
+    For samples at fixed intervals, use a subscription.
+    """
+    def __init__(self, properties, names):
+        self._channel = properties[0].__channel__
+        self._operations = [(prop._id, None, prop._codec.get_length()) for prop in properties]
+        self._codec = RecordCodec(properties, names)
+        self._max_response_size = fibre.protocol.BATCH_MAX_EXTENDED_RESPONSE_SIZE
+
+    def read(self, count=1):
+        operations = self._operations * count
+        try:
+            outputs = self._channel.remote_endpoint_batch(operations, self._max_response_size)
+        except fibre.protocol.BatchIncompleteException:
+            if self._max_response_size == fibre.protocol.BATCH_MAX_RESPONSE_SIZE:
+                raise
+            # The firmware doesn't send responses larger than the legacy size
+            self._max_response_size = fibre.protocol.BATCH_MAX_RESPONSE_SIZE
+            outputs = self._channel.remote_endpoint_batch(operations, self._max_response_size)
+        return self._codec.decode(b''.join(outputs))
+
 class EndpointRefCodec():
     """
     Serializer/deserializer for an endpoint reference
@@ -154,14 +407,54 @@ class RemoteFunction(object):
             param_json["mode"] = "r"
             self._outputs.append(RemoteProperty(param_json, parent))
 
+        # Several outputs are returned as a named tuple
+        self._result_type = None
+        if len(self._outputs) > 1:
+            self._result_type = collections.namedtuple(self._name + "_result", [prop._name for prop in self._outputs])
+
+        # Devices that support packed calls take all inputs in the request and
+        # return all outputs in the response
+        self._packed = None
+        if json_data.get("packed", False):
+            try:
+                self._packed = (RecordCodec(self._inputs, [prop._name for prop in self._inputs]),
+                                RecordCodec(self._outputs, [prop._name for prop in self._outputs]))
+            except TypeError:
+                pass # e.g. object references
+
     def __call__(self, *args):
         if (len(self._inputs) != len(args)):
             raise TypeError("expected {} arguments but have {}".format(len(self._inputs), len(args)))
+        channel = self._parent.__channel__
+        batch = get_open_batch(channel)
+        if self._packed:
+            request, codec = self._pack_call(args)
+            if batch:
+                return batch.add(self._trigger_id, request, codec)
+            response = channel.remote_endpoint_operation(self._trigger_id, request, True, codec.get_length())
+            return codec.deserialize(response)
+
         for i in range(len(args)):
             self._inputs[i].set_value(args[i])
-        self._parent.__channel__.remote_endpoint_operation(self._trigger_id, None, True, 0)
-        if len(self._outputs) > 0:
-            return self._outputs[0].get_value()
+        if batch:
+            batch.add(self._trigger_id, None, None)
+        else:
+            channel.remote_endpoint_operation(self._trigger_id, None, True, 0)
+        if len(self._outputs) == 0:
+            return None
+        values = [prop.get_value() for prop in self._outputs]
+        if self._result_type is None:
+            return values[0]
+        if batch:
+            return PendingRecord(values, self._result_type)
+        return self._result_type(*values)
+
+    def _pack_call(self, args):
+        """
+        Returns the request of a packed call and the codec of its response
+        """
+        request = b''.join(prop._codec.serialize(arg) for (prop, arg) in zip(self._inputs, args))
+        return request, _FunctionResultCodec(self._packed[1], self._result_type)
 
     def _dump(self):
         return "{}({})".format(self._name, ", ".join("{}: {}".format(x._name, x._property_type.__name__) for x in self._inputs))
@@ -173,46 +466,95 @@ class RemoteObject(object):
     def __init__(self, json_data, parent, channel, logger):
         """
         Creates an object that implements the specified JSON type description by
-        communicating over the provided channel
+        communicating over the provided channel.
+        The members are only created on the first access to the object, so
+        that connecting to a device doesn't build the whole tree up front.
         """
         # Directly write to __dict__ to avoid calling __setattr__ too early
-        object.__getattribute__(self, "__dict__")["_remote_attributes"] = {}
-        object.__getattribute__(self, "__dict__")["__sealed__"] = False
-        # Assign once more to make linter happy
-        self._remote_attributes = {}
-        self.__sealed__ = False
-
-        self.__channel__ = channel
-        self.__parent__ = parent
-
-        # Build attribute list from JSON
-        for member_json in json_data.get("members", []):
-            member_name = member_json.get("name", None)
-            if member_name is None:
-                logger.debug("ignoring unnamed attribute")
-                continue
+        d = object.__getattribute__(self, "__dict__")
+        d["_remote_attributes"] = {}
+        d["__channel__"] = channel
+        d["__parent__"] = parent
+        d["_name"] = json_data.get("name", None)
+        d["_member_json"] = json_data.get("members", [])
+        d["_logger"] = logger
+        # Ensure that assignments to undefined attributes raise an exception
+        d["__sealed__"] = True
+        channel._channel_broken.subscribe(object.__getattribute__(self, "_tear_down"))
+
+    def _build_members(self):
+        d = object.__getattribute__(self, "__dict__")
+        with _build_lock:
+            members_json = d["_member_json"]
+            if members_json is None:
+                return # built by another thread in the meantime
+            channel = d["__channel__"]
+            logger = d["_logger"]
+
+            # Build attribute list from JSON
+            attributes = {}
+            for member_json in members_json:
+                member_name = member_json.get("name", None)
+                if member_name is None:
+                    logger.debug("ignoring unnamed attribute")
+                    continue
+
+                try:
+                    type_str = member_json.get("type", None)
+                    if type_str == "object":
+                        attribute = RemoteObject(member_json, self, channel, logger)
+                    elif type_str == "function":
+                        attribute = RemoteFunction(member_json, self)
+                    elif type_str == "buffer":
+                        attribute = RemoteBuffer(member_json, self)
+                    elif type_str != None:
+                        attribute = RemoteProperty(member_json, self)
+                    else:
+                        raise ObjectDefinitionError("no type information")
+                except ObjectDefinitionError as ex:
+                    logger.debug("malformed member {}: {}".format(member_name, str(ex)))
+                    continue
+
+                attributes[member_name] = attribute
+
+            d["_remote_attributes"].update(attributes)
+            d.update(attributes)
+            d["_member_json"] = None
+
+    def batch(self):
+        """
+        Returns a context manager that sends the property accesses and
+        function calls inside it in as few packets as possible, see Batch.
+        """
+        return Batch(self.__channel__)
 
-            try:
-                type_str = member_json.get("type", None)
-                if type_str == "object":
-                    attribute = RemoteObject(member_json, self, channel, logger)
-                elif type_str == "function":
-                    attribute = RemoteFunction(member_json, self)
-                elif type_str != None:
-                    attribute = RemoteProperty(member_json, self)
-                else:
-                    raise ObjectDefinitionError("no type information")
-            except ObjectDefinitionError as ex:
-                logger.debug("malformed member {}: {}".format(member_name, str(ex)))
-                continue
-
-            self._remote_attributes[member_name] = attribute
-            self.__dict__[member_name] = attribute
-
-        # Ensure that from here on out assignments to undefined attributes
-        # raise an exception
-        self.__sealed__ = True
-        channel._channel_broken.subscribe(self._tear_down)
+    def bulk_reader(self, paths):
+        """
+        Returns a BulkReader of the properties at the given paths relative
+        to this object, e.g. ['vbus_voltage', 'axis0.encoder.pos_estimate'].
+        The fields of the samples are named after the paths.
+        """
+        return BulkReader([self._resolve_property(path) for path in paths], paths)
+
+    def _resolve_property(self, path):
+        """
+        Returns the readable RemoteProperty at the dotted path relative to
+        this object, e.g. 'axis0.encoder.pos_estimate'
+        """
+        obj = self
+        for name in path.split('.'):
+            obj = obj._remote_attributes.get(name, None) if isinstance(obj, RemoteObject) else None
+        if not isinstance(obj, RemoteProperty) or not obj._can_read:
+            raise AttributeError("{} is not a readable property".format(path))
+        return obj
+
+    def aio(self):
+        """
+        Returns an asyncio view of this object, whose property reads and
+        function calls return futures and are pipelined, see fibre.aio.
+        """
+        import fibre.aio
+        return fibre.aio.AsyncObject(self)
 
     def _dump(self, indent, depth):
         if depth <= 0:
@@ -233,7 +575,12 @@ class RemoteObject(object):
         return self.__str__()
 
     def __getattribute__(self, name):
-        attr = object.__getattribute__(self, "_remote_attributes").get(name, None)
+        d = object.__getattribute__(self, "__dict__")
+        if name == "__channel__" or name == "__parent__":
+            return d[name] # used while the members are built
+        if d["_member_json"] is not None:
+            object.__getattribute__(self, "_build_members")()
+        attr = d["_remote_attributes"].get(name, None)
         if isinstance(attr, RemoteProperty):
             if attr._can_read:
                 return attr.get_value()
@@ -246,6 +593,8 @@ class RemoteObject(object):
             #raise AttributeError("Attribute {} not found".format(name))
 
     def __setattr__(self, name, value):
+        if object.__getattribute__(self, "__dict__")["_member_json"] is not None:
+            object.__getattribute__(self, "_build_members")()
         attr = object.__getattribute__(self, "_remote_attributes").get(name, None)
         if isinstance(attr, RemoteProperty):
             if attr._can_write:
@@ -259,6 +608,8 @@ class RemoteObject(object):
 
     def _tear_down(self):
         # Clear all remote members
-        for k in self._remote_attributes.keys():
-            self.__dict__.pop(k)
-        self._remote_attributes = {}
+        d = object.__getattribute__(self, "__dict__")
+        d["_member_json"] = None
+        for k in d["_remote_attributes"].keys():
+            d.pop(k)
+        d["_remote_attributes"] = {}
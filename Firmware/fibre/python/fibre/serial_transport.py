@@ -12,7 +12,8 @@ import serial.tools.list_ports
 import fibre
 from fibre.utils import TimeoutError
 
-# TODO: make this customizable
+# Can be overridden per port with a "@<baudrate>" suffix to the path spec,
+# e.g. "serial:/dev/ttyUSB0@921600"
 DEFAULT_BAUDRATE = 115200
 
 class SerialStreamTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSink):
@@ -35,6 +36,22 @@ class SerialStreamTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSi
             self._dev.timeout = max(deadline - time.monotonic(), 0)
         return self._dev.read(n_bytes)
 
+    def get_available_bytes(self, max_bytes, deadline):
+        """
+        Waits until at least one byte arrived or the deadline is reached and
+        returns up to max_bytes of the received bytes, possibly none.
+        """
+        if deadline is None:
+            self._dev.timeout = None
+        else:
+            self._dev.timeout = max(deadline - time.monotonic(), 0)
+        result = self._dev.read(1)
+        if result:
+            available = min(self._dev.in_waiting, max_bytes - 1)
+            if available > 0:
+                result += self._dev.read(available) # returns right away
+        return result
+
     def get_bytes_or_fail(self, n_bytes, deadline):
         result = self.get_bytes(n_bytes, deadline)
         if len(result) < n_bytes:
@@ -58,9 +75,17 @@ def find_pyserial_ports():
 def discover_channels(path, serial_number, callback, cancellation_token, channel_termination_token, logger):
     """
     Scans for serial ports that match the path spec.
+    The path may end in "@<baudrate>" to use another baud rate than
+    DEFAULT_BAUDRATE.
     This function blocks until cancellation_token is set.
     Channels spawned by this function run until channel_termination_token is set.
     """
+    baudrate = DEFAULT_BAUDRATE
+    if path != None and re.match(r'^.*@[0-9]+$', path):
+        path, baudrate = path.rsplit('@', 1)
+        path = path or None # "serial:@921600" scans all ports
+        baudrate = int(baudrate)
+
     if path == None:
         # This regex should match all desired port names on macOS,
         # Linux and Windows but might match some incorrect port names.
@@ -84,11 +109,11 @@ def discover_channels(path, serial_number, callback, cancellation_token, channel
         new_ports = filter(device_matcher, all_ports)
         for port_name in new_ports:
             try:
-                serial_device = SerialStreamTransport(port_name, DEFAULT_BAUDRATE)
+                serial_device = SerialStreamTransport(port_name, baudrate)
                 input_stream = fibre.protocol.PacketFromStreamConverter(serial_device)
                 output_stream = fibre.protocol.StreamBasedPacketSink(serial_device)
                 channel = fibre.protocol.Channel(
-                        "serial port {}@{}".format(port_name, DEFAULT_BAUDRATE),
+                        "serial port {}@{}".format(port_name, baudrate),
                         input_stream, output_stream, channel_termination_token, logger)
                 channel.serial_device = serial_device
             except serial.serialutil.SerialException:
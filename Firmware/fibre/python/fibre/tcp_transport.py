@@ -21,9 +21,26 @@ class TCPTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSink):
     self.target = socket.getaddrinfo(dest_addr, dest_port, family)[0][4]
     # TODO: this blocks until a connection is established, or the system cancels it
     self.sock.connect(self.target)
+    # Requests are small and wait for their response, so don't let Nagle's
+    # algorithm hold them back
+    self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
   def process_bytes(self, buffer):
-    self.sock.send(buffer)
+    self.sock.sendall(buffer)
+
+  def get_available_bytes(self, max_bytes, deadline):
+    """
+    Waits until some bytes arrived or the deadline is reached and returns
+    up to max_bytes of them, possibly none.
+    """
+    self.sock.settimeout(None if deadline is None else max(deadline - time.monotonic(), 0))
+    try:
+      data = self.sock.recv(max_bytes)
+    except (socket.timeout, BlockingIOError): # a deadline in the past makes the socket non-blocking
+      return b''
+    if not data:
+      raise TimeoutError("connection closed") # like get_bytes_or_fail()
+    return data
 
   def get_bytes(self, n_bytes, deadline):
     """
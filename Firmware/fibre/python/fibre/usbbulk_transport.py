@@ -5,6 +5,12 @@ import usb.core
 import usb.util
 import sys
 import time
+import ctypes
+import threading
+try:
+  import queue
+except ImportError:
+  import Queue as queue # Python 2
 import fibre.protocol
 import traceback
 import platform
@@ -18,11 +24,159 @@ WELL_KNOWN_VID_PID_PAIRS = [
   (0x1209, 0x0D33)
 ]
 
+# Devices send packets of up to this size as one multi-packet transfer
+# (USB_NATIVE_TX_DATA_SIZE in usbd_cdc_if.h). Older devices only send single
+# USB packets, which arrive just the same.
+MAX_TRANSFER_SIZE = 512
+# Number of reads that are queued on the IN endpoint at any time
+N_QUEUED_TRANSFERS = 4
+
+# libusb-1.0 definitions for asynchronous transfers, see libusb.h
+_TRANSFER_TYPE_BULK = 2
+_TRANSFER_COMPLETED = 0
+_TRANSFER_TIMED_OUT = 2
+_TRANSFER_CANCELLED = 3
+_TRANSFER_OVERFLOW = 6
+
+class _libusb_transfer(ctypes.Structure):
+  pass
+_libusb_transfer_cb_fn = ctypes.CFUNCTYPE(None, ctypes.POINTER(_libusb_transfer))
+_libusb_transfer._fields_ = [
+  ('dev_handle', ctypes.c_void_p),
+  ('flags', ctypes.c_uint8),
+  ('endpoint', ctypes.c_ubyte),
+  ('type', ctypes.c_ubyte),
+  ('timeout', ctypes.c_uint),
+  ('status', ctypes.c_int),
+  ('length', ctypes.c_int),
+  ('actual_length', ctypes.c_int),
+  ('callback', _libusb_transfer_cb_fn),
+  ('user_data', ctypes.c_void_p),
+  ('buffer', ctypes.c_void_p),
+  ('num_iso_packets', ctypes.c_int)
+]
+
+class _timeval(ctypes.Structure):
+  _fields_ = [('tv_sec', ctypes.c_long), ('tv_usec', ctypes.c_long)]
+
+class AsyncBulkReader():
+  """
+  Keeps several libusb transfers queued on an IN endpoint, so that the device
+  can send the next packet while the host is still busy with the previous
+  one. A thread handles the libusb events and puts the received packets into
+  a queue in the order in which they arrived.
+  This uses the libusb handle of pyusb's libusb1 backend and raises an
+  exception on other backends.
+  """
+  def __init__(self, dev, endpoint_address, logger):
+    resource_manager = dev._ctx
+    backend = resource_manager.backend
+    if type(backend).__module__ != 'usb.backend.libusb1':
+      raise Exception("asynchronous transfers require the libusb1 backend")
+    resource_manager.managed_open()
+    # Use separate function objects, so that the prototypes of pyusb's don't change
+    self._lib = lib = ctypes.CDLL(backend.lib._name)
+    lib.libusb_alloc_transfer.argtypes = [ctypes.c_int]
+    lib.libusb_alloc_transfer.restype = ctypes.POINTER(_libusb_transfer)
+    lib.libusb_submit_transfer.argtypes = [ctypes.POINTER(_libusb_transfer)]
+    lib.libusb_cancel_transfer.argtypes = [ctypes.POINTER(_libusb_transfer)]
+    lib.libusb_free_transfer.argtypes = [ctypes.POINTER(_libusb_transfer)]
+    lib.libusb_handle_events_timeout.argtypes = [ctypes.c_void_p, ctypes.POINTER(_timeval)]
+    self._ctx = backend.ctx
+    self._logger = logger
+    self._packets = queue.Queue()
+    self._lock = threading.Lock()
+    self._pending = 0
+    self._stopping = False
+    self._callback = _libusb_transfer_cb_fn(self._on_transfer_done) # keep a reference
+    self._buffers = []
+    self._transfers = []
+
+    for _ in range(N_QUEUED_TRANSFERS):
+      buffer = ctypes.create_string_buffer(MAX_TRANSFER_SIZE)
+      transfer = lib.libusb_alloc_transfer(0)
+      if not transfer:
+        raise MemoryError()
+      t = transfer.contents
+      t.dev_handle = resource_manager.handle.handle
+      t.endpoint = endpoint_address
+      t.type = _TRANSFER_TYPE_BULK
+      t.timeout = 0
+      t.length = MAX_TRANSFER_SIZE
+      t.callback = self._callback
+      t.buffer = ctypes.cast(buffer, ctypes.c_void_p)
+      self._buffers.append(buffer)
+      self._transfers.append(transfer)
+
+    submitted = True
+    for transfer in self._transfers:
+      submitted = submitted and lib.libusb_submit_transfer(transfer) == 0
+      self._pending += 1 if submitted else 0
+    self._thread = threading.Thread(target=self._handle_events)
+    self._thread.daemon = True
+    self._thread.start()
+    if not submitted:
+      self.stop()
+      raise Exception("failed to submit USB transfer")
+
+  def _handle_events(self):
+    timeout = _timeval(0, 100000)
+    while self._pending:
+      self._lib.libusb_handle_events_timeout(self._ctx, ctypes.byref(timeout))
+    with self._lock:
+      for transfer in self._transfers:
+        self._lib.libusb_free_transfer(transfer)
+      self._transfers = []
+
+  def _on_transfer_done(self, transfer):
+    t = transfer.contents
+    if t.status == _TRANSFER_COMPLETED:
+      self._packets.put(bytearray(ctypes.string_at(t.buffer, t.actual_length)))
+    elif t.status == _TRANSFER_OVERFLOW:
+      self._logger.debug("USB packet larger than {} bytes dropped".format(MAX_TRANSFER_SIZE))
+    elif t.status != _TRANSFER_TIMED_OUT:
+      if t.status != _TRANSFER_CANCELLED:
+        self._logger.debug("USB transfer failed with status {}".format(t.status))
+        self._packets.put(None) # the device went away or the endpoint stalled
+      with self._lock:
+        self._pending -= 1
+      return
+    with self._lock:
+      resubmit = not self._stopping and self._lib.libusb_submit_transfer(transfer) == 0
+      if not resubmit:
+        self._pending -= 1
+    if not resubmit and not self._stopping:
+      self._packets.put(None)
+
+  def get_packet(self, deadline):
+    """
+    Returns the next packet. Raises TimeoutError if none arrived before the
+    deadline and ChannelBrokenException if the transfers failed.
+    """
+    try:
+      packet = self._packets.get(timeout=max(deadline - time.monotonic(), 0))
+    except queue.Empty:
+      raise TimeoutError()
+    if packet is None:
+      self._packets.put(None) # stay broken
+      raise fibre.protocol.ChannelBrokenException()
+    return packet
+
+  def stop(self):
+    with self._lock:
+      self._stopping = True
+      for transfer in self._transfers:
+        self._lib.libusb_cancel_transfer(transfer)
+    thread = getattr(self, '_thread', None)
+    if thread is not None and thread is not threading.current_thread():
+      thread.join(1.0)
+
 class USBBulkTransport(fibre.protocol.PacketSource, fibre.protocol.PacketSink):
   def __init__(self, dev, logger):
     self._logger = logger
     self.dev = dev
     self.intf = None
+    self._reader = None
     self._name = "USB device {}:{}".format(dev.idVendor, dev.idProduct)
     self._was_damaged = False
 
@@ -89,7 +243,19 @@ class USBBulkTransport(fibre.protocol.PacketSource, fibre.protocol.PacketSink):
     assert self.epr is not None
     self._logger.debug("EndpointAddress for reading {}".format(self.epr.bEndpointAddress))
 
+    # Queue several reads, falling back to one read at a time where this
+    # is not supported
+    try:
+      usb.util.claim_interface(self.dev, self.intf)
+      self._reader = AsyncBulkReader(self.dev, self.epr.bEndpointAddress, self._logger)
+    except Exception as ex:
+      self._logger.debug("using synchronous USB reads: {}".format(ex))
+      self._reader = None
+
   def deinit(self):
+    if not self._reader is None:
+      self._reader.stop()
+      self._reader = None
     if not self.intf is None:
       usb.util.release_interface(self.dev, self.intf)
 
@@ -121,8 +287,10 @@ class USBBulkTransport(fibre.protocol.PacketSource, fibre.protocol.PacketSink):
         raise fibre.protocol.ChannelDamagedException()
 
   def get_packet(self, deadline):
+    if not self._reader is None:
+      return self._reader.get_packet(deadline)
     try:
-      bufferLen = self.epr.wMaxPacketSize
+      bufferLen = max(self.epr.wMaxPacketSize, MAX_TRANSFER_SIZE)
       timeout = max(int((deadline - time.monotonic()) * 1000), 0)
       ret = self.epr.read(bufferLen, timeout)
       if self._was_damaged:
@@ -13,6 +13,11 @@ unit_tests = define_package{
     sources={'run_tests.cpp'}
 }
 
+benchmark = define_package{
+    packages={fibre_package},
+    sources={'run_benchmark.cpp'}
+}
+
 
 toolchain=GCCToolchain('', 'build', {'-O3', '-fvisibility=hidden', '-frename-registers', '-funroll-loops'}, {})
 toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
@@ -24,4 +29,5 @@ toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
 if tup.getconfig("BUILD_FIBRE_TESTS") == "true" then
 	build_executable('test_server', test_server, toolchain)
 	--build_executable('run_tests', unit_tests, toolchain)
+	build_executable('run_benchmark', benchmark, toolchain)
 end
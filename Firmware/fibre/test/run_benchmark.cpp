@@ -0,0 +1,371 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//#define DEBUG_PROTOCOL
+void hexdump(const uint8_t* buf, size_t len) {}
+
+#include <fibre/decoders.hpp>
+#include <fibre/encoders.hpp>
+#include <fibre/protocol.hpp>
+#include <fibre/posix_tcp.hpp>
+#include <fibre/posix_udp.hpp>
+
+// Benchmarks of the shared fibre code, run on the host, e.g. after a build
+// with BUILD_FIBRE_TESTS enabled:
+//   run_benchmark [codec] [channel] [tcp] [udp]
+// Without arguments, all of them run.
+//  - codec: encoding and decoding bulk data value by value with the per-type
+//    write_le()/read_le() functions against the span based fast path.
+//  - channel: requests handled by BidirectionalPacketBasedChannel in the
+//    same process, as packets and as a byte stream through
+//    StreamBasedPacketSink and StreamToPacketSegmenter.
+//  - tcp, udp: the same requests to serve_on_tcp() and serve_on_udp() over
+//    loopback, with up to kWindow requests in flight.
+// Each request reads a chunk of a buffer endpoint, so the response size
+// sweeps the packet sizes up to MAX_PACKET_SIZE. The CPU time is that of the
+// whole process, for the loopback benchmarks it includes the client.
+
+// Counts the heap allocations of the process
+static std::atomic<size_t> allocation_count{0};
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+constexpr size_t N_VALUES = 1 << 16;
+constexpr size_t N_ROUNDS = 200;
+
+static float values[N_VALUES];
+static float decoded[N_VALUES];
+static uint8_t encoded[N_VALUES * sizeof(float)];
+
+// Runs fn N_ROUNDS times and prints the throughput in MB/s
+template<typename TFunc>
+static void codec_benchmark(const char* name, TFunc fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_ROUNDS; ++i)
+        fn();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    double megabytes = (double)(N_ROUNDS * sizeof(encoded)) / 1e6;
+    printf("%-36s %8.1f MB/s\n", name, megabytes / duration.count());
+}
+
+static bool codec_benchmarks() {
+    for (size_t i = 0; i < N_VALUES; ++i)
+        values[i] = (float)i * 0.5f;
+
+    // Old path of properties and subscription frames: one write_le() and one
+    // virtual process_bytes() call per value
+    codec_benchmark("encode value by value", [] {
+        MemoryStreamSink sink(encoded, sizeof(encoded));
+        StreamSink* output = &sink;
+        for (size_t i = 0; i < N_VALUES; ++i) {
+            uint8_t buffer[sizeof(float)];
+            size_t cnt = write_le<float>(values[i], buffer);
+            output->process_bytes(buffer, cnt, nullptr);
+        }
+    });
+    codec_benchmark("encode with write_le_span", [] {
+        write_le_span(values, N_VALUES, encoded);
+    });
+    codec_benchmark("encode into sink with write_le_span", [] {
+        MemoryStreamSink sink(encoded, sizeof(encoded));
+        write_le_span(values, N_VALUES, static_cast<StreamSink*>(&sink));
+    });
+    codec_benchmark("ArrayStreamEncoder, 64 byte packets", [] {
+        auto encoder = make_array_encoder(values, N_VALUES);
+        size_t length = 0;
+        while (encoder.get_available_bytes())
+            encoder.get_bytes(encoded + length, 64, &length);
+    });
+    codec_benchmark("ArrayStreamEncoder, 63 byte packets", [] {
+        auto encoder = make_array_encoder(values, N_VALUES);
+        size_t length = 0;
+        while (encoder.get_available_bytes())
+            encoder.get_bytes(encoded + length, 63, &length);
+    });
+
+    codec_benchmark("decode value by value", [] {
+        const uint8_t* buffer = encoded;
+        size_t length = sizeof(encoded);
+        for (size_t i = 0; i < N_VALUES; ++i)
+            decoded[i] = read_le<float>(&buffer, &length);
+    });
+    codec_benchmark("decode with read_le_span", [] {
+        read_le_span(decoded, N_VALUES, encoded);
+    });
+    codec_benchmark("ArrayStreamDecoder, 63 byte packets", [] {
+        auto decoder = make_array_decoder(decoded, N_VALUES);
+        size_t length = 0;
+        while (decoder.get_expected_bytes())
+            decoder.process_bytes(encoded + length, std::min((size_t)63, sizeof(encoded) - length), &length);
+    });
+
+    if (memcmp(values, decoded, sizeof(values))) {
+        printf("decoded values differ\n");
+        return false;
+    }
+    return true;
+}
+
+/* Channel -------------------------------------------------------------------*/
+
+static constexpr uint16_t kLoopbackPort = 9930;
+static constexpr size_t kWindow = 8; // requests in flight on the loopback links
+static const size_t kResponseSizes[] = { 4, 28, 64, 128, 256, 510 };
+
+static uint8_t bench_data[MAX_PACKET_SIZE];
+static size_t bench_data_length = sizeof(bench_data);
+static uint32_t bench_value = 0;
+
+// The buffer must be the first endpoint (ID 1), see make_read_request()
+static auto bench_tree = make_protocol_member_list(
+    make_protocol_buffer("data", bench_data, &bench_data_length),
+    make_protocol_property("value", &bench_value)
+);
+
+// Builds a request for response_size bytes of the buffer endpoint
+static size_t make_read_request(uint8_t* request, uint16_t seq_no, size_t response_size) {
+    write_le<uint16_t>(seq_no & 0x7fff, request);
+    write_le<uint16_t>(1 | 0x8000, request + 2);
+    write_le<uint16_t>((uint16_t)response_size | 0x8000, request + 4);
+    write_le<uint32_t>(0, request + 6); // offset
+    write_le<uint16_t>(json_crc_, request + 10);
+    return 12;
+}
+
+struct CountingPacketSink : PacketSink {
+    size_t packets = 0;
+    size_t bytes = 0;
+    size_t get_mtu() { return MAX_PACKET_SIZE; }
+    int process_packet(const uint8_t* buffer, size_t length) {
+        ++packets;
+        bytes += length;
+        return 0;
+    }
+};
+
+static double cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// Runs fn, which returns the number of response packets and their total
+// size, and prints the rates and the cost per response
+template<typename TFunc>
+static bool channel_benchmark(const char* name, size_t response_size, TFunc fn) {
+    size_t bytes = 0;
+    size_t allocations_before = allocation_count;
+    double cpu_start = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    size_t packets = fn(&bytes);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    double cpu = cpu_seconds() - cpu_start;
+    size_t allocations = allocation_count - allocations_before;
+    if (!packets) {
+        printf("%-16s %4zu B: no responses\n", name, response_size);
+        return false;
+    }
+    printf("%-16s %4zu B %10.0f packets/s %8.2f MB/s %8.0f ns CPU/packet %6.2f allocs/packet\n",
+           name, response_size, (double)packets / duration.count(),
+           (double)bytes / duration.count() / 1e6, cpu * 1e9 / (double)packets,
+           (double)allocations / (double)packets);
+    return true;
+}
+
+static bool channel_benchmarks() {
+    fibre_publish(bench_tree);
+    bool ok = true;
+    for (size_t size : kResponseSizes) {
+        ok = channel_benchmark("packet", size, [size](size_t* bytes) {
+            CountingPacketSink output;
+            BidirectionalPacketBasedChannel channel(output);
+            uint8_t request[12];
+            for (size_t i = 0; i < 200000; ++i)
+                channel.process_packet(request, make_read_request(request, (uint16_t)i, size));
+            *bytes = output.bytes;
+            return output.packets;
+        }) && ok;
+    }
+    for (size_t size : kResponseSizes) {
+        ok = channel_benchmark("stream", size, [size](size_t* bytes) {
+            // The responses are framed and segmented again, like on the host
+            CountingPacketSink responses;
+            StreamToPacketSegmenter response_segmenter(responses);
+            StreamBasedPacketSink packet2stream(response_segmenter);
+            BidirectionalPacketBasedChannel channel(packet2stream);
+            StreamToPacketSegmenter stream2packet(channel);
+            uint8_t request[12];
+            uint8_t frame[32];
+            for (size_t i = 0; i < 200000; ++i) {
+                MemoryStreamSink frame_sink(frame, sizeof(frame));
+                StreamBasedPacketSink encoder(frame_sink);
+                encoder.process_packet(request, make_read_request(request, (uint16_t)i, size));
+                stream2packet.process_bytes(frame, sizeof(frame) - frame_sink.get_free_space(), nullptr);
+            }
+            *bytes = responses.bytes;
+            return responses.packets;
+        }) && ok;
+    }
+    return ok;
+}
+
+/* Loopback ------------------------------------------------------------------*/
+
+static int connect_loopback(int type) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(kLoopbackPort);
+    addr.sin6_addr = in6addr_loopback;
+    // The server thread may not listen yet. A UDP connect() succeeds anyway,
+    // so there the server must answer a request first.
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_INET6, type, 0);
+        if (fd == -1)
+            return -1;
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+            if (type != SOCK_DGRAM)
+                return fd;
+            struct timeval timeout = { 0, 10000 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            uint8_t request[12];
+            uint8_t response[64];
+            if (send(fd, request, make_read_request(request, 0x7fff, 4), 0) > 0
+                    && recv(fd, response, sizeof(response), 0) > 0)
+                return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+static size_t tcp_round(int fd, size_t size, size_t n_requests, size_t* bytes) {
+    CountingPacketSink responses;
+    StreamToPacketSegmenter stream2packet(responses);
+    uint8_t request[12];
+    uint8_t frames[kWindow * 32];
+    size_t sent = 0;
+    while (responses.packets < n_requests) {
+        // Keep kWindow requests in flight, in one segment
+        MemoryStreamSink frame_sink(frames, sizeof(frames));
+        StreamBasedPacketSink encoder(frame_sink);
+        while (sent < n_requests && sent - responses.packets < kWindow) {
+            encoder.process_packet(request, make_read_request(request, (uint16_t)sent, size));
+            ++sent;
+        }
+        size_t length = sizeof(frames) - frame_sink.get_free_space();
+        if (length && send(fd, frames, length, 0) != (ssize_t)length)
+            return 0;
+        uint8_t buf[4096];
+        ssize_t n_received = recv(fd, buf, sizeof(buf), 0);
+        if (n_received <= 0)
+            return 0;
+        stream2packet.process_bytes(buf, n_received, nullptr);
+    }
+    *bytes = responses.bytes;
+    return responses.packets;
+}
+
+static size_t udp_round(int fd, size_t size, size_t n_requests, size_t* bytes) {
+    struct timeval timeout = { 0, 200000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint8_t request[12];
+    size_t sent = 0, received = 0, in_flight = 0;
+    *bytes = 0;
+    while (received < n_requests) {
+        while (sent < n_requests && in_flight < kWindow) {
+            if (send(fd, request, make_read_request(request, (uint16_t)sent, size), 0) < 0)
+                return 0;
+            ++sent;
+            ++in_flight;
+        }
+        uint8_t buf[1024];
+        ssize_t n_received = recv(fd, buf, sizeof(buf), 0);
+        if (n_received < 0) {
+            // Lost on the loopback: count it and refill the window
+            if (sent == n_requests)
+                break;
+            in_flight = 0;
+            continue;
+        }
+        *bytes += n_received;
+        ++received;
+        --in_flight;
+    }
+    return received;
+}
+
+static bool loopback_benchmarks(bool tcp, bool udp) {
+    fibre_publish(bench_tree);
+    bool ok = true;
+    if (tcp) {
+        std::thread(serve_on_tcp, kLoopbackPort).detach();
+        int fd = connect_loopback(SOCK_STREAM);
+        if (fd == -1) {
+            printf("cannot connect to the TCP server on port %u\n", kLoopbackPort);
+            return false;
+        }
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        for (size_t size : kResponseSizes) {
+            ok = channel_benchmark("tcp", size, [fd, size](size_t* bytes) {
+                return tcp_round(fd, size, 20000, bytes);
+            }) && ok;
+        }
+        close(fd);
+    }
+    if (udp) {
+        std::thread(serve_on_udp, kLoopbackPort).detach();
+        int fd = connect_loopback(SOCK_DGRAM);
+        if (fd == -1) {
+            printf("cannot open the UDP socket\n");
+            return false;
+        }
+        for (size_t size : kResponseSizes) {
+            ok = channel_benchmark("udp", size, [fd, size](size_t* bytes) {
+                return udp_round(fd, size, 20000, bytes);
+            }) && ok;
+        }
+        close(fd);
+    }
+    return ok;
+}
+
+int main(int argc, const char** argv) {
+    bool all = argc < 2;
+    auto selected = [&](const char* name) {
+        for (int i = 1; i < argc; ++i)
+            if (!strcmp(argv[i], name))
+                return true;
+        return all;
+    };
+    bool ok = true;
+    if (selected("codec"))
+        ok = codec_benchmarks() && ok;
+    if (selected("channel"))
+        ok = channel_benchmarks() && ok;
+    if (selected("tcp") || selected("udp"))
+        ok = loopback_benchmarks(selected("tcp"), selected("udp")) && ok;
+    return ok ? 0 : -1;
+}
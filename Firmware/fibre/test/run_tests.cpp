@@ -10,6 +10,7 @@ void hexdump(const uint8_t* buf, size_t len);
 #include <fibre/crc.hpp>
 #include <fibre/decoders.hpp>
 #include <fibre/encoders.hpp>
+#include <fibre/client.hpp>
 
 void hexdump(const uint8_t* buf, size_t len) {
     for (size_t pos = 0; pos < len; ++pos) {
@@ -72,6 +73,763 @@ bool varint_decoder_test() {
 
 
 
+// Compares the table driven CRC against the bitwise one
+template<typename T, unsigned POLYNOMIAL>
+bool crc_table_test(T init) {
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 37 + (i >> 3));
+
+    for (size_t length = 0; length <= sizeof(data); length += 13) {
+        T expected = calc_crc<T, POLYNOMIAL, false>(init, data, length);
+        T result = calc_crc<T, POLYNOMIAL>(init, data, length);
+        if (result != expected) {
+            printf("crc over %zu bytes: expected %x but got %x\n", length, (unsigned)expected, (unsigned)result);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compresses JSON-like data and reads it back in chunks at various offsets
+bool lz_test() {
+    static char data[6000];
+    size_t length = 0;
+    for (unsigned i = 0; length + 64 + 301 < sizeof(data); ++i)
+        length += snprintf(data + length, sizeof(data) - length, "{\"name\":\"item%u\",\"id\":%u,\"type\":\"float\"},", i * 7919 % 1000, i);
+    data[length++] = 'a';
+    memset(data + length, 'a', 300); // long overlapping match
+    length += 300;
+
+    LZCompressor counter(nullptr, 0);
+    counter.process_bytes((const uint8_t*)data, length, nullptr);
+    counter.finish();
+    static uint8_t compressed[sizeof(data) * 2];
+    LZCompressor compressor(compressed, sizeof(compressed));
+    for (size_t i = 0; i < length; i += 17) // feed in uneven chunks
+        compressor.process_bytes((const uint8_t*)data + i, std::min((size_t)17, length - i), nullptr);
+    compressor.finish();
+    if (compressor.get_output_length() != counter.get_output_length() || compressor.get_output_length() >= length / 2) {
+        printf("unexpected compressed length %zu for %zu bytes\n", compressor.get_output_length(), length);
+        return false;
+    }
+
+    for (size_t offset = 0; offset <= length; offset += 61) {
+        uint8_t chunk[100];
+        MemoryStreamSink sink(chunk, sizeof(chunk));
+        if (lz_decompress(compressed, compressor.get_output_length(), offset, &sink))
+            return false;
+        size_t expected_length = std::min(sizeof(chunk), length - offset);
+        if (sizeof(chunk) - sink.get_free_space() != expected_length || memcmp(chunk, data + offset, expected_length)) {
+            printf("decompression mismatch at offset %zu\n", offset);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Endpoint IDs must match the order in which write_json() assigns them
+bool endpoint_id_test() {
+    int32_t a = 1, b = 2, c = 3, d = 4;
+    auto tree = make_protocol_member_list(
+        make_protocol_property("a", &a),
+        make_protocol_object("o",
+            make_protocol_property("b", &b),
+            make_protocol_object("empty"),
+            make_protocol_ro_property("c", &c)
+        ),
+        make_protocol_property("d", &d)
+    );
+    static_assert(decltype(tree)::endpoint_count == 4, "unexpected endpoint count");
+
+    for (size_t id = 0; id < 4; ++id) {
+        uint8_t buffer[4];
+        MemoryStreamSink sink(buffer, sizeof(buffer));
+        Endpoint* endpoint = tree.get_by_id(id);
+        if (!endpoint) {
+            printf("no endpoint with ID %zu\n", id);
+            return false;
+        }
+        endpoint->handle(nullptr, 0, &sink);
+        int32_t value = 0;
+        read_le<int32_t>(&value, buffer);
+        if (sink.get_free_space() != 0 || value != (int32_t)id + 1) {
+            printf("endpoint %zu read %d\n", id, (int)value);
+            return false;
+        }
+    }
+    return tree.get_by_id(4) == nullptr;
+}
+
+// Buffers are read in chunks at a byte offset, up to their current length
+bool buffer_endpoint_test() {
+    uint8_t data[100];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 3);
+    size_t length = 70;
+    ProtocolBuffer endpoint = make_protocol_buffer("buf", data, &length);
+
+    for (uint32_t offset = 0; offset <= 80; offset += 16) {
+        uint8_t input[4];
+        write_le<uint32_t>(offset, input);
+        uint8_t chunk[16];
+        MemoryStreamSink sink(chunk, sizeof(chunk));
+        endpoint.handle(input, sizeof(input), &sink);
+        size_t expected_length = offset < length ? std::min(sizeof(chunk), length - offset) : 0;
+        if (sizeof(chunk) - sink.get_free_space() != expected_length || memcmp(chunk, data + offset, expected_length)) {
+            printf("buffer read mismatch at offset %u\n", (unsigned)offset);
+            return false;
+        }
+    }
+
+    // Runtime allocated arrays are empty while their pointer is NULL
+    int16_t* dynamic = nullptr;
+    size_t dynamic_length = sizeof(data);
+    ProtocolBuffer dynamic_endpoint = make_protocol_buffer("dyn", &dynamic, &dynamic_length);
+    for (int pass = 0; pass < 2; ++pass) {
+        uint8_t input[4] = { 0 };
+        uint8_t chunk[16];
+        MemoryStreamSink sink(chunk, sizeof(chunk));
+        dynamic_endpoint.handle(input, sizeof(input), &sink);
+        size_t expected_length = dynamic ? sizeof(chunk) : 0;
+        if (sizeof(chunk) - sink.get_free_space() != expected_length || memcmp(chunk, data, expected_length)) {
+            printf("dynamic buffer read mismatch\n");
+            return false;
+        }
+        dynamic = reinterpret_cast<int16_t*>(data);
+    }
+    if (strcmp(dynamic_endpoint.element_type_, "int16") || strcmp(endpoint.element_type_, "uint8")) {
+        printf("unexpected buffer element type\n");
+        return false;
+    }
+
+    int32_t i = -7;
+    bool b = true;
+    float f = 1.5f, value = 0.0f;
+    if (!make_protocol_ro_property("i", &i).get_as_float(&value) || value != -7.0f
+        || !make_protocol_property("b", &b).get_as_float(&value) || value != 1.0f
+        || !make_protocol_property("f", &f).get_as_float(&value) || value != 1.5f) {
+        printf("get_as_float failed\n");
+        return false;
+    }
+    if (make_protocol_property("f", &f).get_float_property() != &f
+        || make_protocol_ro_property("f", &f).get_float_property()
+        || make_protocol_property("b", &b).get_float_property()) {
+        printf("get_float_property failed\n");
+        return false;
+    }
+    return true;
+}
+
+// Every property is visited once with the hash of its full path, functions
+// and buffers are skipped
+struct PathRecorder {
+    uint32_t hashes[4];
+    void* properties[4];
+    size_t count = 0;
+    template<typename T>
+    void operator()(uint32_t path_hash, T* property) {
+        if (count < 4) {
+            hashes[count] = path_hash;
+            properties[count] = (void*)property;
+        }
+        ++count;
+    }
+};
+
+bool property_visitor_test() {
+    int32_t a = 1;
+    float b = 2.0f;
+    bool c = false;
+    uint8_t data[4];
+    size_t length = sizeof(data);
+    auto tree = make_protocol_member_list(
+        make_protocol_property("a", &a),
+        make_protocol_object("o",
+            make_protocol_object("config",
+                make_protocol_property("b", &b)
+            ),
+            make_protocol_buffer("buf", data, &length),
+            make_protocol_ro_property("c", &c)
+        )
+    );
+    PathRecorder recorder;
+    tree.for_each_property(recorder, kPathHashInit);
+
+    const char* paths[] = { "a", "o.config.b", "o.c" };
+    void* properties[] = { &a, &b, &c };
+    if (recorder.count != 3) {
+        printf("visited %zu properties\n", recorder.count);
+        return false;
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        uint32_t hash = kPathHashInit;
+        char path[16];
+        strcpy(path, paths[i]);
+        for (char* name = strtok(path, "."); name; name = strtok(nullptr, "."))
+            hash = hash_path_segment(hash, name);
+        if (recorder.hashes[i] != hash || recorder.properties[i] != properties[i]) {
+            printf("property %s visited with the wrong hash or address\n", paths[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Arrays encode to the same bytes as value by value with write_le(), no matter
+// how the stream is split up, and decode back to the same values
+template<typename T>
+bool array_codec_test(const char* name, const T* values, size_t count) {
+    uint8_t expected[64];
+    size_t expected_length = 0;
+    for (size_t i = 0; i < count; ++i)
+        expected_length += write_le<T>(values[i], expected + expected_length);
+
+    for (size_t chunk = 1; chunk <= expected_length; ++chunk) {
+        uint8_t encoded[64] = { 0 };
+        size_t encoded_length = 0;
+        auto encoder = make_array_encoder(values, count);
+        while (encoder.get_available_bytes())
+            encoder.get_bytes(encoded + encoded_length, chunk, &encoded_length);
+        if (encoded_length != expected_length || memcmp(encoded, expected, expected_length)) {
+            printf("%s array encoded wrong in chunks of %zu\n", name, chunk);
+            return false;
+        }
+
+        T decoded[16] = { 0 };
+        size_t decoded_length = 0;
+        auto decoder = make_array_decoder(decoded, count);
+        while (decoder.get_expected_bytes())
+            decoder.process_bytes(encoded + decoded_length, std::min(chunk, expected_length - decoded_length), &decoded_length);
+        if (decoded_length != expected_length || memcmp(decoded, values, count * sizeof(T))) {
+            printf("%s array decoded wrong in chunks of %zu\n", name, chunk);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool array_codec_test() {
+    const float floats[] = { 0.0f, -1.5f, 3.25e7f, 1e-30f, 42.0f };
+    const uint16_t shorts[] = { 0x0102, 0xfffe, 7 };
+    const uint64_t longs[] = { 0x0102030405060708ULL, 1 };
+    const bool bools[] = { true, false, true };
+    return array_codec_test("float", floats, 5)
+        && array_codec_test("uint16", shorts, 3)
+        && array_codec_test("uint64", longs, 2)
+        && array_codec_test("bool", bools, 3);
+}
+
+// Wire compatible properties are pushed in subscription frames straight from
+// memory, others such as bools are encoded by their handler
+bool subscription_frame_test() {
+    static float f = 2.5f;
+    static bool b = true;
+    static uint32_t u = 0x01020304;
+    static auto tree = make_protocol_member_list(
+        make_protocol_property("f", &f),
+        make_protocol_property("b", &b),
+        make_protocol_ro_property("u", &u)
+    );
+    fibre_publish(tree);
+    size_t length = 0;
+    if (make_protocol_property("f", &f).get_wire_data(&length) != &f || length != 4
+        || make_protocol_property("b", &b).get_wire_data(&length) != nullptr) {
+        printf("unexpected wire data\n");
+        return false;
+    }
+
+    struct : PacketSink {
+        uint8_t frame[TX_BUF_SIZE];
+        size_t length = 0;
+        int process_packet(const uint8_t* buffer, size_t length) {
+            memcpy(frame, buffer, this->length = std::min(length, sizeof(frame)));
+            return 0;
+        }
+    } host;
+    BidirectionalPacketBasedChannel channel(host);
+    uint8_t request[16];
+    write_le<uint16_t>(0x0001, request);
+    write_le<uint16_t>(SUBSCRIPTION_ENDPOINT_ID | 0x8000, request + 2);
+    write_le<uint16_t>(2, request + 4);
+    write_le<uint16_t>(10, request + 6); // interval [ms]
+    for (uint16_t id = 1; id <= 3; ++id)
+        write_le<uint16_t>(id, request + 6 + 2 * id);
+    write_le<uint16_t>(json_crc_, request + 14);
+    channel.process_packet(request, sizeof(request));
+    channel.update_subscription(0);
+
+    uint8_t expected[9];
+    size_t cnt = write_le<float>(f, expected);
+    cnt += write_le<bool>(b, expected + cnt);
+    cnt += write_le<uint32_t>(u, expected + cnt);
+    if (host.length != 4 + cnt || memcmp(host.frame + 4, expected, cnt)) {
+        printf("subscription frame mismatch\n");
+        return false;
+    }
+    return true;
+}
+
+// In on change mode, a frame is pushed as soon as a value differs from the
+// last frame, and otherwise once per interval
+bool subscription_on_change_test() {
+    static uint32_t state = 1;
+    static auto tree = make_protocol_member_list(
+        make_protocol_ro_property("state", &state)
+    );
+    fibre_publish(tree);
+
+    struct : PacketSink {
+        size_t count = 0;
+        uint32_t value = 0;
+        int process_packet(const uint8_t* buffer, size_t length) {
+            count++;
+            if (length == 8)
+                memcpy(&value, buffer + 4, sizeof(value));
+            return 0;
+        }
+    } host;
+    BidirectionalPacketBasedChannel channel(host);
+    uint8_t request[12];
+    write_le<uint16_t>(0x0001, request);
+    write_le<uint16_t>(SUBSCRIPTION_ENDPOINT_ID | 0x8000, request + 2);
+    write_le<uint16_t>(2, request + 4);
+    write_le<uint16_t>(100 | SUBSCRIPTION_ON_CHANGE, request + 6); // heartbeat interval [ms]
+    write_le<uint16_t>(1, request + 8);
+    write_le<uint16_t>(json_crc_, request + 10);
+    channel.process_packet(request, sizeof(request));
+    size_t n_responses = host.count;
+
+    channel.update_subscription(0);
+    channel.update_subscription(1);
+    channel.update_subscription(2);
+    state = 8;
+    channel.update_subscription(3);
+    channel.update_subscription(4);
+    channel.update_subscription(102);
+    channel.update_subscription(103);
+    size_t n_frames = host.count - n_responses;
+    if (n_frames != 3 || host.value != 8) {
+        printf("on change subscription sent %zu frames, last value %u\n", n_frames, (unsigned)host.value);
+        return false;
+    }
+    return true;
+}
+
+// Records the packets that a channel sends to the host
+struct PacketRecorder : PacketSink {
+    uint8_t packets[8][TX_BUF_SIZE];
+    size_t lengths[8];
+    size_t count = 0;
+    uint16_t get_u16(size_t packet, size_t offset) {
+        return packets[packet][offset] | (packets[packet][offset + 1] << 8);
+    }
+    int process_packet(const uint8_t* buffer, size_t length) {
+        if (count < 8) {
+            memcpy(packets[count], buffer, std::min(length, (size_t)TX_BUF_SIZE));
+            lengths[count] = length;
+        }
+        ++count;
+        return 0;
+    }
+};
+
+static void send_request(BidirectionalPacketBasedChannel& channel, uint16_t seq_no, uint16_t endpoint_id, uint32_t value) {
+    uint8_t request[12];
+    write_le<uint16_t>(seq_no, request);
+    write_le<uint16_t>(endpoint_id | 0x8000, request + 2);
+    write_le<uint16_t>(0, request + 4);
+    write_le<uint32_t>(value, request + 6);
+    write_le<uint16_t>(json_crc_, request + 10);
+    channel.process_packet(request, sizeof(request));
+}
+
+static void send_ack(BidirectionalPacketBasedChannel& channel, uint16_t seq_no) {
+    uint8_t ack[4] = { 0 };
+    write_le<uint16_t>(seq_no | 0x8000, ack);
+    channel.process_packet(ack, sizeof(ack));
+}
+
+// A resent request gets the cached response instead of running again. After
+// the first ack, skipped sequence numbers are reported in NACK frames.
+bool response_window_test() {
+    static uint32_t x = 0;
+    static auto tree = make_protocol_member_list(make_protocol_property("x", &x));
+    fibre_publish(tree);
+    PacketRecorder host;
+    BidirectionalPacketBasedChannel channel(host);
+
+    send_request(channel, 0x0180, 1, 5);
+    x = 0;
+    send_request(channel, 0x0180, 1, 5);
+    if (x != 0 || host.count != 2 || host.lengths[1] != 2 || host.get_u16(1, 0) != 0x8180) {
+        printf("resent request was not replayed\n");
+        return false;
+    }
+
+    send_request(channel, 0x0180, 1, 7); // same seq_no, new request
+    if (x != 7 || host.count != 3) {
+        printf("new request with a reused seq_no was not run\n");
+        return false;
+    }
+
+    send_request(channel, 0x0181, 1, 8);
+    send_ack(channel, 0x0181);
+    send_request(channel, 0x0181, 1, 8); // the cached response was dropped
+    send_request(channel, 0x0184, 1, 9);
+    if (x != 9 || host.count != 8 || host.get_u16(5, 0) != 0x0182 || host.get_u16(6, 2) != NACK_ENDPOINT_ID) {
+        printf("expected NACK frames for skipped requests\n");
+        return false;
+    }
+
+    // Transports without sequence numbers (I2C) send every request with 0
+    x = 0;
+    send_request(channel, 0, 1, 3);
+    x = 0;
+    send_request(channel, 0, 1, 3);
+    if (x != 3 || host.count != 10) {
+        printf("request without a sequence number was replayed\n");
+        return false;
+    }
+
+    // A new host session starts over at FIRST_SEQ_NO
+    send_request(channel, FIRST_SEQ_NO, 1, 4);
+    send_request(channel, 0x0082, 1, 5);
+    send_request(channel, 0x0083, 1, 6);
+    x = 0;
+    send_request(channel, FIRST_SEQ_NO, 1, 4); // a restarted host
+    if (x != 4) {
+        printf("response of the previous session was replayed\n");
+        return false;
+    }
+    x = 0;
+    send_request(channel, FIRST_SEQ_NO, 1, 4); // a resend within the new session
+    if (x != 0) {
+        printf("resent first request of a session was not replayed\n");
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a over the path with a leading '.', as computed by the hosts
+static uint32_t hash_path(const char* path) {
+    uint32_t hash = kPathHashInit;
+    for (hash = (hash ^ (uint8_t)'.') * 16777619u; *path; ++path)
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    return hash;
+}
+
+struct HashedTestObject {
+    uint32_t value = 0;
+    void set(uint32_t v) { value = v; }
+};
+
+// Requests to HASHED_ENDPOINT_ID find the endpoint by its path and are checked
+// against PROTOCOL_VERSION instead of the JSON CRC
+bool hashed_endpoint_test() {
+    static uint32_t x = 0;
+    static float y = 1.5f;
+    static HashedTestObject obj;
+    static auto tree = make_protocol_member_list(
+        make_protocol_property("x", &x),
+        make_protocol_object("o",
+            make_protocol_ro_property("y", &y),
+            make_protocol_function("set", obj, &HashedTestObject::set, "v")
+        )
+    );
+    fibre_publish(tree);
+    PacketRecorder host;
+    BidirectionalPacketBasedChannel channel(host);
+
+    auto send_hashed = [&](uint16_t seq_no, const char* path, uint16_t expected_length,
+                           const uint8_t* input, size_t input_length, uint16_t trailer) {
+        uint8_t request[16];
+        write_le<uint16_t>(seq_no, request);
+        write_le<uint16_t>(HASHED_ENDPOINT_ID | 0x8000, request + 2);
+        write_le<uint16_t>(expected_length, request + 4);
+        write_le<uint32_t>(hash_path(path), request + 6);
+        if (input_length)
+            memcpy(request + 10, input, input_length);
+        write_le<uint16_t>(trailer, request + 10 + input_length);
+        channel.process_packet(request, 12 + input_length);
+    };
+
+    uint8_t value[4];
+    write_le<uint32_t>(42, value);
+    send_hashed(0x0001, "x", 0, value, 4, PROTOCOL_VERSION);
+    send_hashed(0x0002, "o.y", 4, nullptr, 0, PROTOCOL_VERSION);
+    if (x != 42 || host.count != 2 || host.lengths[1] != 6
+        || memcmp(host.packets[1] + 2, &y, 4)) {
+        printf("hashed access to properties failed\n");
+        return false;
+    }
+
+    write_le<uint32_t>(7, value);
+    send_hashed(0x0003, "o.set.v", 0, value, 4, PROTOCOL_VERSION);
+    send_hashed(0x0004, "o.set", 0, nullptr, 0, PROTOCOL_VERSION);
+    if (obj.value != 7) {
+        printf("hashed function call failed\n");
+        return false;
+    }
+
+    // Unknown paths and requests with the JSON CRC as trailer are dropped
+    size_t count = host.count;
+    send_hashed(0x0005, "o.z", 4, nullptr, 0, PROTOCOL_VERSION);
+    send_hashed(0x0006, "o.y", 4, nullptr, 0, (uint16_t)(PROTOCOL_VERSION + 1));
+    if (host.count != count) {
+        printf("invalid hashed request got a response\n");
+        return false;
+    }
+    return true;
+}
+
+struct PackedTestObject {
+    float total = 0.0f;
+    uint32_t calls = 0;
+    std::tuple<float, uint32_t> add(float a, bool twice) {
+        total += twice ? 2.0f * a : a;
+        return std::make_tuple(total, ++calls);
+    }
+};
+
+// A packed call passes all inputs in the request and gets all outputs in the
+// response. Calls without inputs still use the input endpoints.
+bool packed_function_test() {
+    static PackedTestObject obj;
+    static auto tree = make_protocol_member_list(
+        make_protocol_function("add", obj, &PackedTestObject::add, make_protocol_outputs("total", "calls"), "a", "twice")
+    );
+    fibre_publish(tree);
+    PacketRecorder host;
+    BidirectionalPacketBasedChannel channel(host);
+
+    uint8_t request[16];
+    write_le<uint16_t>(0x0001, request);
+    write_le<uint16_t>(1 | 0x8000, request + 2);
+    write_le<uint16_t>(8, request + 4);
+    write_le<float>(1.5f, request + 6);
+    write_le<bool>(true, request + 10);
+    write_le<uint16_t>(json_crc_, request + 11);
+    channel.process_packet(request, 13);
+    float total = 0.0f;
+    uint32_t calls = 0;
+    read_le<float>(&total, host.packets[0] + 2);
+    read_le<uint32_t>(&calls, host.packets[0] + 6);
+    if (host.count != 1 || host.lengths[0] != 10 || total != 3.0f || calls != 1) {
+        printf("packed call returned %zu bytes: %f, %u\n", host.lengths[0], total, (unsigned)calls);
+        return false;
+    }
+
+    // The inputs of the last call are still in the input endpoints
+    write_le<uint16_t>(0x0002, request);
+    write_le<uint16_t>(0, request + 4);
+    write_le<uint16_t>(json_crc_, request + 6);
+    channel.process_packet(request, 8);
+    write_le<uint16_t>(0x0003, request);
+    write_le<uint16_t>(5 | 0x8000, request + 2); // calls output
+    write_le<uint16_t>(4, request + 4);
+    channel.process_packet(request, 8);
+    if (host.count != 3 || obj.total != 6.0f || host.lengths[2] != 6 || host.packets[2][2] != 2) {
+        printf("legacy call with the previous inputs failed\n");
+        return false;
+    }
+
+    // A request with only some of the inputs is rejected and does not run
+    write_le<uint16_t>(0x0004, request);
+    write_le<uint16_t>(1 | 0x8000, request + 2);
+    write_le<uint16_t>(8, request + 4);
+    write_le<float>(1.0f, request + 6);
+    write_le<uint16_t>(json_crc_, request + 10);
+    channel.process_packet(request, 12);
+    if (host.count != 4 || obj.calls != 2 || host.lengths[3] != 4
+            || host.get_u16(3, 0) != 0x0004 || host.get_u16(3, 2) != REJECT_ENDPOINT_ID) {
+        printf("short packed call was not rejected\n");
+        return false;
+    }
+
+    // In a batch, it ends the batch
+    write_le<uint16_t>(0x0005, request);
+    write_le<uint16_t>(BATCH_ENDPOINT_ID | 0x8000, request + 2);
+    write_le<uint16_t>(8, request + 4);
+    write_le<uint16_t>(1, request + 6);
+    request[8] = 4;
+    request[9] = 8;
+    write_le<float>(1.0f, request + 10);
+    write_le<uint16_t>(json_crc_, request + 14);
+    channel.process_packet(request, 16);
+    if (host.count != 5 || obj.calls != 2 || host.lengths[4] != 2) {
+        printf("short packed call in a batch was not refused\n");
+        return false;
+    }
+    return true;
+}
+
+// The segmenter counts the frames it discards, and resynchronizes on the next one
+bool segmenter_error_count_test() {
+    uint8_t frame[16];
+    MemoryStreamSink sink(frame, sizeof(frame));
+    StreamBasedPacketSink encoder(sink);
+    const uint8_t payload[4] = { 1, 2, 3, 4 };
+    encoder.process_packet(payload, sizeof(payload));
+    size_t frame_length = sizeof(frame) - sink.get_free_space();
+
+    PacketRecorder output;
+    StreamToPacketSegmenter segmenter(output);
+    uint8_t stream[64];
+    size_t length = 0;
+    memcpy(stream + length, frame, frame_length);
+    stream[length + 2] ^= 0x01; // bad header CRC
+    length += frame_length;
+    memcpy(stream + length, frame, frame_length);
+    stream[length + frame_length - 1] ^= 0x01; // bad payload CRC
+    length += frame_length;
+    memcpy(stream + length, frame, frame_length);
+    length += frame_length;
+    segmenter.process_bytes(stream, length, nullptr);
+    if (output.count != 1 || output.lengths[0] != sizeof(payload)
+            || segmenter.header_error_cnt_ != 1 || segmenter.crc_error_cnt_ != 1
+            || segmenter.oversize_cnt_ != 0) {
+        printf("segmenter passed %zu packets, counted %u header and %u CRC errors\n", output.count,
+                (unsigned)segmenter.header_error_cnt_, (unsigned)segmenter.crc_error_cnt_);
+        return false;
+    }
+
+    // A frame longer than RX_BUF_SIZE
+    uint8_t header[4] = { CANONICAL_PREFIX, 0x80 | (RX_BUF_SIZE >> 8), RX_BUF_SIZE & 0xff, 0 };
+    header[3] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, 3);
+    segmenter.process_bytes(header, sizeof(header), nullptr);
+    segmenter.process_bytes(frame, frame_length, nullptr);
+    if (segmenter.oversize_cnt_ != 1 || output.count != 2) {
+        printf("oversize frame not counted\n");
+        return false;
+    }
+    return true;
+}
+
+// Connects a ClientChannel to a device channel in the same process
+struct ClientLoopback : PacketSink, PacketSource {
+    BidirectionalPacketBasedChannel* device = nullptr;
+    uint8_t packets[8][MAX_PACKET_SIZE];
+    size_t lengths[8];
+    size_t head = 0, tail = 0;
+
+    // host -> device
+    int process_packet(const uint8_t* buffer, size_t length) {
+        return device->process_packet(buffer, length);
+    }
+    // host <- device
+    int get_packet(uint8_t* buffer, size_t max_length, size_t* length, uint32_t timeout_ms) {
+        if (head == tail)
+            return 0;
+        *length = std::min(lengths[tail % 8], max_length);
+        memcpy(buffer, packets[tail++ % 8], *length);
+        return 1;
+    }
+    struct : PacketSink {
+        ClientLoopback* loopback;
+        size_t get_mtu() { return MAX_PACKET_SIZE; }
+        int process_packet(const uint8_t* buffer, size_t length) {
+            ClientLoopback& l = *loopback;
+            memcpy(l.packets[l.head % 8], buffer, l.lengths[l.head % 8] = std::min(length, (size_t)MAX_PACKET_SIZE));
+            l.head++;
+            return 0;
+        }
+    } device_output;
+    ClientLoopback() { device_output.loopback = this; }
+};
+
+static void count_frame(void* ctx, uint16_t frame_no, const uint8_t* payload, size_t length) {
+    if (length == 8)
+        ++*reinterpret_cast<size_t*>(ctx);
+}
+
+// The C++ client talks to a device channel by ID, in batches and with a
+// subscription, and falls back to path hashes if the JSON CRC differs
+bool client_channel_test() {
+    static uint32_t x = 0;
+    static float y = 1.5f;
+    static HashedTestObject obj;
+    static bool unused = false;
+    // a different tree type than in hashed_endpoint_test(), see fibre_publish()
+    static auto tree = make_protocol_member_list(
+        make_protocol_property("x", &x),
+        make_protocol_object("o",
+            make_protocol_ro_property("y", &y),
+            make_protocol_function("set", obj, &HashedTestObject::set, "v")
+        ),
+        make_protocol_property("unused", &unused)
+    );
+    fibre_publish(tree);
+    ClientLoopback loopback;
+    BidirectionalPacketBasedChannel device(loopback.device_output);
+    loopback.device = &device;
+
+    ClientChannel channel(loopback, loopback);
+    channel.timeout_ms = 1;
+    if (!channel.connect(json_crc_) || channel.get_json_crc() != json_crc_
+        || channel.uses_path_hashes() || channel.get_max_batch_response_size() <= ClientChannel::kLegacyMaxResponseSize) {
+        printf("client did not connect\n");
+        return false;
+    }
+
+    RemoteProperty<uint32_t> remote_x(channel, {1, hash_path("x")});
+    RemoteProperty<const float> remote_y(channel, {2, hash_path("o.y")});
+    RemoteEndpoint set = {3, hash_path("o.set")};
+    RemoteEndpoint set_v = {4, hash_path("o.set.v")};
+    uint32_t x_value = 0;
+    float y_value = 0.0f;
+    if (!remote_x.set(42) || x != 42 || !remote_x.get(&x_value) || x_value != 42
+        || !remote_y.get(&y_value) || y_value != y) {
+        printf("client property access failed\n");
+        return false;
+    }
+
+    ClientBatch batch(channel);
+    batch.write(remote_x, 7);
+    batch.write(set_v, (uint32_t)3);
+    batch.call(set);
+    batch.read(remote_y, &y_value);
+    batch.read(remote_x, &x_value);
+    y_value = 0.0f;
+    if (!batch.execute() || x != 7 || obj.value != 3 || x_value != 7 || y_value != y) {
+        printf("client batch failed\n");
+        return false;
+    }
+
+    size_t n_frames = 0;
+    RemoteEndpoint subscribed[] = { remote_x.endpoint(), remote_y.endpoint() };
+    if (channel.subscribe(subscribed, 2, 10, count_frame, &n_frames) != 8) {
+        printf("client subscription was rejected\n");
+        return false;
+    }
+    device.update_subscription(0);
+    device.update_subscription(10);
+    if (channel.poll(1) != 2 || n_frames != 2) {
+        printf("client received %zu subscription frames\n", n_frames);
+        return false;
+    }
+
+    // A table of IDs from another firmware version: the IDs are wrong, the
+    // path hashes still match
+    ClientChannel hashed_channel(loopback, loopback);
+    hashed_channel.timeout_ms = 1;
+    RemoteProperty<uint32_t> stale_x(hashed_channel, {5, hash_path("x")});
+    if (!hashed_channel.connect((uint16_t)(json_crc_ + 1)) || !hashed_channel.uses_path_hashes()
+        || !stale_x.set(9) || x != 9) {
+        printf("client did not fall back to path hashes\n");
+        return false;
+    }
+    ClientBatch hashed_batch(hashed_channel);
+    hashed_batch.write(RemoteEndpoint{5, hash_path("o.set.v")}, (uint32_t)11);
+    hashed_batch.call(RemoteEndpoint{5, hash_path("o.set")});
+    hashed_batch.read(stale_x, &x_value);
+    if (!hashed_batch.execute() || obj.value != 11 || x_value != 9) {
+        printf("client batch with path hashes failed\n");
+        return false;
+    }
+    return true;
+}
+
 int main(void) {
     /***** Decoder demo (remove or move somewhere else) *****/
     printf("Running decoder... ");
@@ -130,6 +888,20 @@ int main(void) {
 
     /***** run automated test *****/
     bool test_result = varint_decoder_test();
+    test_result = crc_table_test<uint8_t, CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT) && test_result;
+    test_result = crc_table_test<uint16_t, CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT) && test_result;
+    test_result = lz_test() && test_result;
+    test_result = endpoint_id_test() && test_result;
+    test_result = buffer_endpoint_test() && test_result;
+    test_result = property_visitor_test() && test_result;
+    test_result = segmenter_error_count_test() && test_result;
+    test_result = response_window_test() && test_result;
+    test_result = array_codec_test() && test_result;
+    test_result = subscription_frame_test() && test_result;
+    test_result = subscription_on_change_test() && test_result;
+    test_result = hashed_endpoint_test() && test_result;
+    test_result = packed_function_test() && test_result;
+    test_result = client_channel_test() && test_result;
     if (test_result) {
         printf("all tests passed\n");
         return 0;
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Reports which memory the hot control loop code and data landed in,
+based on the map file generated by the GNU linker.
+
+Usage: memory_report.py path/to/ODriveFirmware.map [symbol ...]
+"""
+
+import re
+import sys
+
+MEMORY_REGIONS = [
+    ('FLASH',  0x08000000, 0x080C0000),
+    ('NVM',    0x080C0000, 0x08100000),
+    ('CCMRAM', 0x10000000, 0x10010000),
+    ('RAM',    0x20000000, 0x20020000),
+]
+
+# Symbols that are expected to be in zero wait state memory
+DEFAULT_HOT_SYMBOLS = [
+    'pwm_trig_adc_cb',
+    'Motor::FOC_current',
+    'SVM',
+    'Encoder::update',
+]
+
+def region_of(address):
+    for name, start, end in MEMORY_REGIONS:
+        if start <= address < end:
+            return name
+    return '?'
+
+def parse_map(lines):
+    """
+    Yields (output_section, input_section, address, size, object_file) for every
+    input section and (output_section, None, address, 0, symbol) for every symbol
+    in the "Linker script and memory map" part of the map file.
+    """
+    in_memory_map = False
+    output_section = None
+    pending_name = None
+    for line in lines:
+        line = line.rstrip('\n')
+        if line.startswith('Linker script and memory map'):
+            in_memory_map = True
+            continue
+        if not in_memory_map or not line:
+            continue
+
+        # Output section, e.g. ".data           0x20000000      0x9f8 load address 0x08012345"
+        m = re.match(r'^(\.\S+)(\s+0x[0-9a-f]+\s+0x[0-9a-f]+)?', line)
+        if m:
+            output_section = m.group(1)
+            pending_name = None
+            continue
+
+        # Input section, possibly with the address on the following line
+        m = re.match(r'^ (\.\S+|COMMON)\s*$', line)
+        if m:
+            pending_name = m.group(1)
+            continue
+        m = re.match(r'^ (\.\S+|COMMON)?\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S.*)$', line)
+        if m and (m.group(1) or pending_name):
+            name = m.group(1) or pending_name
+            pending_name = None
+            yield (output_section, name, int(m.group(2), 16), int(m.group(3), 16), m.group(4))
+            continue
+
+        # Symbol, e.g. "                0x20000abc                Encoder::update()"
+        m = re.match(r'^\s+(0x[0-9a-f]+)\s+(\S.*)$', line)
+        if m and not m.group(2).startswith(('PROVIDE', '.', '_', 'ALIGN', 'LOADADDR')):
+            yield (output_section, None, int(m.group(1), 16), 0, m.group(2).strip())
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+
+    with open(sys.argv[1]) as map_file:
+        entries = list(parse_map(map_file))
+    hot_symbols = sys.argv[2:] or DEFAULT_HOT_SYMBOLS
+
+    print("Zero wait state sections:")
+    for output_section, input_section, address, size, obj in entries:
+        if input_section and size and input_section.startswith(('.ramfunc', '.ccmram')):
+            print("  {:8} 0x{:08x} {:6} B  {} ({})".format(
+                region_of(address), address, size, input_section, obj.split('/')[-1]))
+
+    print("Hot symbols:")
+    for hot in hot_symbols:
+        matches = [(address, output_section, name) for output_section, input_section, address, size, name in entries
+                   if input_section is None and re.match(r'^' + re.escape(hot) + r'(\(.*\))?$', name)]
+        if not matches:
+            print("  {:8} {:10} {}".format('missing', '', hot))
+        for address, output_section, name in matches:
+            region = region_of(address)
+            warning = '' if region in ('CCMRAM', 'RAM') else '  <-- executes/lives in flash'
+            print("  {:8} 0x{:08x} {}{}".format(region, address, name, warning))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,395 @@
+# Time optimal, current limited trajectories along a path, streamed to the
+# setpoint buffer of the ODrive (see <axis>.controller.push_stream_sample).
+#
+# The path is given as points in the position space of one or more axes. It
+# is followed exactly, only the speed along it is optimized: at every point
+# of the path, the acceleration of each axis stays within its current limit
+# divided by its inertia and the velocity of each axis within its velocity
+# limit. This is the classic time optimal path parameterization: the squared
+# path speed is integrated forward at maximum acceleration and backward at
+# maximum deceleration, and the lower of the two curves is the fastest
+# feasible profile.
+#
+# The samples carry the position, velocity and the current feed-forward of
+# the trajectory, so the axes track it at the limits without waiting for
+# the position error to build up.
+#
+# Usage with a calibrated ODrive in odrivetool:
+#   import PlanTimeOptimal as pto
+#   axes = [odrv0.axis0, odrv0.axis1]
+#   limits = [pto.GetAxisLimits(axis) for axis in axes]
+#   traj = pto.PlanTimeOptimal(path, [l[0] for l in limits], [l[1] for l in limits], inertia=[l[2] for l in limits])
+#   pto.StreamTrajectory(axes, traj)
+
+import numpy as np
+import math
+import time
+
+# Symbol    Description
+# s         Arc length along the path [counts]
+# x         Squared path speed (ds/dt)^2
+# u         Path acceleration d^2s/dt^2
+# p'(s)     Unit tangent of the path, per axis
+# p''(s)    Curvature vector of the path, per axis
+# The acceleration of axis i is p'_i(s) * u + p''_i(s) * x
+
+STREAM_BUFFER_LENGTH = 63 # usable samples, see Controller::kStreamBufferLength
+
+
+def GetAxisLimits(axis, current_margin=0.8, vel_margin=0.95):
+    """
+    Reads (Vmax [counts/s], Amax [counts/s^2], inertia [A/(counts/s^2)]) of
+    an axis. The margins leave headroom for the feedback controller.
+    The inertia is trap_traj.config.A_per_css, the current feed-forward per
+    acceleration of the trapezoidal planner. If that is not set, it comes
+    from controller.config.inertia or from the disturbance observer's
+    estimate, see AXIS_STATE_AUTO_TUNING.
+    """
+    inertia = axis.trap_traj.config.A_per_css
+    if not inertia > 0:
+        inertia = axis.controller.config.inertia
+    if not inertia > 0:
+        inertia = axis.controller.inertia_estimate
+    if not inertia > 0:
+        raise Exception("the inertia of the axis is unknown, run the auto tuning first")
+    Vmax = vel_margin * axis.controller.config.vel_limit
+    Amax = current_margin * axis.motor.config.current_lim / inertia
+    return (Vmax, Amax, inertia)
+
+
+def _AccelRange(dp, ddp, x, Amax):
+    """
+    Returns the range (u_min, u_max) of path accelerations that keep every
+    axis within Amax at the squared path speed x. Arrays over the grid.
+    """
+    u_min = np.full(x.shape, -np.inf)
+    u_max = np.full(x.shape, np.inf)
+    for i in range(dp.shape[1]):
+        moving = np.abs(dp[:, i]) > 1e-9
+        with np.errstate(divide='ignore', invalid='ignore'):
+            lo = (-Amax[i] - ddp[:, i] * x) / dp[:, i]
+            hi = (Amax[i] - ddp[:, i] * x) / dp[:, i]
+        lo, hi = np.where(dp[:, i] > 0, lo, hi), np.where(dp[:, i] > 0, hi, lo)
+        u_min = np.where(moving, np.maximum(u_min, lo), u_min)
+        u_max = np.where(moving, np.minimum(u_max, hi), u_max)
+        # An axis that does not move along the path still has to follow its curvature
+        infeasible = ~moving & (np.abs(ddp[:, i] * x) > Amax[i])
+        u_min = np.where(infeasible, np.inf, u_min)
+        u_max = np.where(infeasible, -np.inf, u_max)
+    return (u_min, u_max)
+
+
+def PlanTimeOptimal(path, Vmax, Amax, inertia=None, ds=None, Ts=0.01, Jmax=None):
+    """
+    Plans the fastest motion along path, starting and ending at rest.
+
+    path      (n_points, n_axes) or (n_points,) positions [counts]. The path
+              runs straight between the points, so corners are passed
+              at almost zero speed. Sample curves densely.
+    Vmax      velocity limit per axis [counts/s]
+    Amax      acceleration limit per axis [counts/s^2]
+    inertia   per axis [A/(counts/s^2)]. If given, the samples carry the
+              current feed-forward, otherwise it is zero.
+    ds        resolution along the path [counts], by default 1/2000 of the
+              path length
+    Ts        interval between the samples [s]
+    Jmax      jerk limit per axis [counts/s^3], none by default. The
+              profile along the path is then smoothed by a moving average of
+              2 * Amax / Jmax, and sharp corners become stops. This is not
+              the fastest jerk limited motion, only a close one.
+
+    Returns (t, pos, vel, current) with t of shape (n_samples,) and the
+    others of shape (n_samples, n_axes).
+    """
+    path = np.asarray(path, dtype=float)
+    if path.ndim == 1:
+        path = path[:, np.newaxis]
+    n_axes = path.shape[1]
+    Vmax = np.broadcast_to(np.asarray(Vmax, dtype=float), (n_axes,))
+    Amax = np.broadcast_to(np.asarray(Amax, dtype=float), (n_axes,))
+    if Jmax is not None:
+        Jmax = np.broadcast_to(np.asarray(Jmax, dtype=float), (n_axes,))
+
+    # Arc length parameterization on a uniform grid
+    seg_len = np.linalg.norm(np.diff(path, axis=0), axis=1)
+    keep = np.concatenate([[True], seg_len > 0])
+    path = path[keep]
+    s_points = np.concatenate([[0.0], np.cumsum(seg_len[seg_len > 0])])
+    length = s_points[-1]
+    if length == 0:
+        return (np.array([0.0]), path[:1], np.zeros((1, n_axes)), np.zeros((1, n_axes)))
+    if ds is None:
+        ds = length / 2000
+    n = max(int(math.ceil(length / ds)), 2)
+    s = np.linspace(0, length, n + 1)
+    ds = s[1] - s[0]
+    p = np.stack([np.interp(s, s_points, path[:, i]) for i in range(n_axes)], axis=1)
+    dp = np.gradient(p, ds, axis=0)
+    ddp = np.gradient(dp, ds, axis=0)
+
+    # Maximum squared path speed from the velocity limits ...
+    with np.errstate(divide='ignore'):
+        x_lim = np.min((Vmax / np.maximum(np.abs(dp), 1e-12)) ** 2, axis=1)
+    # ... and from the curvature, where no path acceleration is feasible at all
+    lo = np.zeros(n + 1)
+    hi = x_lim.copy()
+    feasible = lambda x: np.less_equal(*_AccelRange(dp, ddp, x, Amax))
+    hi_ok = feasible(hi)
+    for _ in range(60):
+        mid = 0.5 * (lo + hi)
+        ok = feasible(mid)
+        lo = np.where(ok, mid, lo)
+        hi = np.where(ok, hi, mid)
+    x_lim = np.where(hi_ok, x_lim, lo)
+    x_lim[0] = x_lim[-1] = 0.0
+
+    # The velocity turns at once at the points of the path. Passing them
+    # slowly enough keeps the step from one sample to the next within the
+    # acceleration limit. With a jerk limit, a point where the acceleration
+    # could step by more than the jerk limit allows is a stop.
+    seg = np.diff(path, axis=0)
+    direction = seg / np.linalg.norm(seg, axis=1)[:, np.newaxis]
+    stops = [0, n]
+    for j in range(1, len(s_points) - 1):
+        turn = np.abs(direction[j] - direction[j - 1])
+        with np.errstate(divide='ignore'):
+            sd_max = np.min(Amax * Ts / 2 / turn)
+        k = int(round(s_points[j] / ds))
+        if Jmax is not None and np.any(Amax * turn > Jmax * Ts / 2):
+            sd_max = 0.0
+            stops.insert(-1, k)
+        # np.gradient blends the two directions over the neighbours
+        for q in range(max(k - 1, 0), min(k + 2, n + 1)):
+            x_lim[q] = min(x_lim[q], sd_max ** 2)
+
+    # Forward pass at maximum acceleration, backward pass at maximum deceleration
+    x = x_lim.copy()
+    for k in range(n):
+        u_max = _AccelRange(dp[k:k+1], ddp[k:k+1], x[k:k+1], Amax)[1][0]
+        x[k + 1] = min(x[k + 1], max(x[k] + 2 * ds * max(u_max, 0.0), 0.0))
+    for k in range(n, 0, -1):
+        u_min = _AccelRange(dp[k:k+1], ddp[k:k+1], x[k:k+1], Amax)[0][0]
+        x[k - 1] = min(x[k - 1], max(x[k] - 2 * ds * min(u_min, 0.0), 0.0))
+
+    # Time along the grid. Two consecutive points at rest (a stop on the path)
+    # are bridged by the average speed of a start from rest.
+    sd = np.sqrt(x)
+    dt = 2 * ds / np.maximum(sd[:-1] + sd[1:], 1e-12)
+    both_zero = (sd[:-1] + sd[1:]) == 0
+    if np.any(both_zero):
+        u_max = np.maximum(_AccelRange(dp[:-1], ddp[:-1], np.zeros(n), Amax)[1], 1e-12)
+        dt = np.where(both_zero, np.sqrt(2 * ds / u_max), dt)
+    t_grid = np.concatenate([[0.0], np.cumsum(dt)])
+    sdd = np.where(both_zero, 2 * ds / dt ** 2, np.diff(sd) / dt)
+
+    # The motion along the path on a fine time grid, at constant path
+    # acceleration between the grid points. With a jerk limit, the path
+    # position is averaged over a window Tw: the path speed and acceleration
+    # are then the differences of the unfiltered ones across the window
+    # divided by Tw, so the path jerk is at most 2 * u_max / Tw. Each part
+    # between two stops is averaged on its own, so it starts and ends at
+    # rest without acceleration.
+    h = Ts / 8
+    Tw = 0.0 if Jmax is None else np.max(2 * Amax / Jmax)
+    w = int(math.ceil(Tw / h))
+    parts = []
+    t_end = 0.0
+    for (k0, k1) in zip(stops[:-1], stops[1:]):
+        if k1 <= k0:
+            continue
+        t_p = t_grid[k0] + np.arange(int(math.ceil((t_grid[k1] - t_grid[k0]) / h)) + w + 1) * h
+        k = np.minimum(np.searchsorted(t_grid, t_p, side='right') - 1, k1 - 1)
+        tau = np.minimum(t_p - t_grid[k], dt[k])
+        sd_k = np.where(both_zero[k], 0.0, sd[k])
+        s_p = np.minimum(s[k] + sd_k * tau + sdd[k] * tau ** 2 / 2, s[k + 1])
+        sd_p = np.where(t_p < t_grid[k1], sd_k + sdd[k] * tau, 0.0)
+        sdd_p = np.where(t_p < t_grid[k1], sdd[k], 0.0)
+        if w > 0:
+            kernel = np.ones(w) / w
+            s_p = s[k0] + np.convolve(s_p - s[k0], kernel)[:len(t_p)]
+            sd_p = np.convolve(sd_p, kernel)[:len(t_p)]
+            sdd_p = np.convolve(sdd_p, kernel)[:len(t_p)]
+            s_p[-1] = s[k1]
+        parts.append((t_p - t_p[0] + t_end, s_p, sd_p, sdd_p))
+        t_end += t_p[-1] - t_p[0] + h
+    t_f = np.concatenate([part[0] for part in parts])
+    s_f = np.concatenate([part[1] for part in parts])
+    sd_f = np.concatenate([part[2] for part in parts])
+    sdd_f = np.concatenate([part[3] for part in parts])
+
+    # The limits are met on the grid of the path, but not exactly between
+    # its points and not after the averaging. Slowing down the whole move by
+    # k scales the velocities by 1/k, the accelerations by 1/k^2 and the
+    # jerks by 1/k^3, so whatever is left over is fixed that way.
+    def axis_motion(t, s_t, sd_t, sdd_t):
+        dp_t = np.stack([np.interp(s_t, s, dp[:, i]) for i in range(n_axes)], axis=1)
+        ddp_t = np.stack([np.interp(s_t, s, ddp[:, i]) for i in range(n_axes)], axis=1)
+        vel = dp_t * sd_t[:, np.newaxis]
+        acc = dp_t * sdd_t[:, np.newaxis] + ddp_t * (sd_t ** 2)[:, np.newaxis]
+        return (vel, acc)
+    (vel_f, acc_f) = axis_motion(t_f, s_f, sd_f, sdd_f)
+    k = max(1.0, np.max(np.max(np.abs(vel_f), axis=0) / Vmax),
+            math.sqrt(np.max(np.max(np.abs(acc_f), axis=0) / Amax)))
+    if Jmax is not None:
+        jerk_f = np.gradient(acc_f, h, axis=0)
+        k = max(k, (np.max(np.max(np.abs(jerk_f), axis=0) / Jmax)) ** (1 / 3))
+    t_f = t_f * k
+    sd_f = sd_f / k
+    sdd_f = sdd_f / k ** 2
+
+    # Resample at Ts. The device interpolates between the samples.
+    n_samples = int(math.ceil(t_f[-1] / Ts)) + 1
+    t = np.arange(n_samples) * Ts
+    t[-1] = max(t[-1], t_f[-1])
+    s_t = np.interp(t, t_f, s_f)
+    sd_t = np.interp(t, t_f, sd_f)
+    sdd_t = np.interp(t, t_f, sdd_f)
+    pos = np.stack([np.interp(s_t, s, p[:, i]) for i in range(n_axes)], axis=1)
+    (vel, acc) = axis_motion(t, s_t, sd_t, sdd_t)
+    acc = np.clip(acc, -Amax, Amax)
+    vel[-1] = 0
+    acc[-1] = 0
+    if inertia is None:
+        current = np.zeros_like(acc)
+    else:
+        current = acc * np.broadcast_to(np.asarray(inertia, dtype=float), (n_axes,))
+    return (t, pos, vel, current)
+
+
+def StreamTrajectory(axes, traj, poll_interval=None):
+    """
+    Plays the trajectory (t, pos, vel, current) from PlanTimeOptimal on the
+    axes, one column per axis. The axes must be in closed loop control.
+    The first STREAM_BUFFER_LENGTH samples are uploaded in one batch per
+    ODrive, so the axes of one ODrive start in the same control loop
+    iteration. The buffers are then topped up in batches while the move
+    runs. Returns the number of control loop iterations in which an axis ran
+    out of samples before the end, which means that the connection was too
+    slow.
+    """
+    (t, pos, vel, current) = traj
+    t = t - t[0]
+    n_samples = len(t)
+    by_device = {}
+    for (i, axis) in enumerate(axes):
+        by_device.setdefault(axis.__channel__, []).append((i, axis))
+    if poll_interval is None:
+        poll_interval = max((t[1] - t[0]) if n_samples > 1 else 0.01, 0.001) * STREAM_BUFFER_LENGTH / 4
+
+    def push(device_axes, start, count):
+        ok = []
+        with device_axes[0][1].batch():
+            for k in range(start, start + count):
+                for (i, axis) in device_axes:
+                    ok.append(axis.controller.push_stream_sample(
+                        float(t[k]), float(pos[k, i]), float(vel[k, i]), float(current[k, i])))
+        if not all(value.value for value in ok if value is not None):
+            raise Exception("the device rejected a stream sample")
+        if start + count == n_samples:
+            # All samples are buffered, later underruns are the end of the stream
+            return sum(axis.controller.stream_underruns for (_, axis) in device_axes)
+        return 0
+
+    sent = {}
+    underruns = 0
+    for (channel, device_axes) in by_device.items():
+        for (_, axis) in device_axes:
+            axis.controller.start_stream()
+        count = min(STREAM_BUFFER_LENGTH, n_samples)
+        underruns += push(device_axes, 0, count)
+        sent[channel] = count
+
+    while True:
+        done = True
+        for (channel, device_axes) in by_device.items():
+            with device_axes[0][1].batch():
+                counts = [axis.controller.stream_count for (_, axis) in device_axes]
+            buffered = max(count.value for count in counts)
+            if sent[channel] < n_samples:
+                count = min(STREAM_BUFFER_LENGTH - buffered, n_samples - sent[channel])
+                if count > 0:
+                    underruns += push(device_axes, sent[channel], count)
+                    sent[channel] += count
+                done = False
+            elif buffered > 1:
+                done = False
+        if done:
+            break
+        time.sleep(poll_interval)
+
+    return underruns
+
+
+def graphical_test():
+    import matplotlib.pyplot as plt
+    # A circle and a straight line, 8192 counts per turn
+    phi = np.linspace(0, 2 * math.pi, 400)
+    path = np.concatenate([
+        np.stack([20000 * np.cos(phi), 20000 * np.sin(phi)], axis=1),
+        [[-20000, 0]]])
+    Vmax = [80000, 60000]
+    Amax = [400000, 300000]
+    inertia = [2e-5, 3e-5]
+    (t, pos, vel, current) = PlanTimeOptimal(path, Vmax, Amax, inertia=inertia)
+    print("duration {:.3f}s, {} samples".format(t[-1], len(t)))
+
+    fig, (ax1, ax2, ax3) = plt.subplots(3, sharex=True)
+    ax1.plot(t, pos)
+    ax1.set_ylabel('pos [counts]')
+    ax2.plot(t, vel)
+    ax2.set_ylabel('vel [counts/s]')
+    ax3.plot(t, current)
+    ax3.set_ylabel('current [A]')
+    ax3.set_xlabel('t [s]')
+    plt.show()
+
+def numeric_test():
+    """
+    Checks the limits on finite differences of the samples and that every
+    move ends at rest on its target.
+    """
+    phi = np.linspace(0, 2 * math.pi, 2000)
+    circle = np.concatenate([
+        np.stack([20000 * np.cos(phi), 20000 * np.sin(phi)], axis=1),
+        [[-20000, 0]]])
+    cases = [
+        ('circle', circle, [80000, 60000], [400000, 300000], None),
+        ('line', [[0], [10000]], [20000], [100000], None),
+        ('diagonal', [[0, 0], [10000, -5000]], [20000, 20000], [100000, 50000], None),
+        ('line with jerk limit', [[0], [10000]], [20000], [100000], [2000000]),
+        ('circle with jerk limit', circle, [80000, 60000], [400000, 300000], [8000000, 6000000]),
+    ]
+    tolerance = 1.02
+    ok = True
+    for (name, path, Vmax, Amax, Jmax) in cases:
+        path = np.asarray(path, dtype=float)
+        (t, pos, vel, current) = PlanTimeOptimal(path, Vmax, Amax, Jmax=Jmax)
+        Ts = t[1] - t[0]
+        v = np.diff(pos, axis=0) / Ts
+        a = np.diff(v, axis=0) / Ts
+        j = np.diff(a, axis=0) / Ts
+        checks = [
+            ('velocity', np.max(np.abs(v), axis=0), Vmax),
+            ('acceleration', np.max(np.abs(a), axis=0), Amax),
+        ]
+        if Jmax is not None:
+            checks.append(('jerk', np.max(np.abs(j), axis=0), Jmax))
+        for (quantity, peak, limit) in checks:
+            for i in range(path.shape[1]):
+                if peak[i] > tolerance * limit[i]:
+                    print("{}: {} {:.0f} exceeds {:.0f} on axis {}".format(
+                        name, quantity, peak[i], limit[i], i))
+                    ok = False
+        end_error = np.max(np.abs(pos[-1] - path[-1]))
+        if end_error > 1e-3 or np.max(np.abs(vel[-1])) != 0:
+            print("{}: ends {:.3g} counts from the target".format(name, end_error))
+            ok = False
+        print("{}: duration {:.3f}s".format(name, t[-1]))
+    print("all checks passed" if ok else "some checks failed")
+    return ok
+
+if __name__ == '__main__':
+    import sys
+    if '--test' in sys.argv:
+        sys.exit(0 if numeric_test() else 1)
+    graphical_test()
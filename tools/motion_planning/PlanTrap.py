@@ -25,7 +25,6 @@
 
 import numpy as np
 import math
-import matplotlib.pyplot as plt
 import random
 
 # Symbol                     Description
@@ -90,6 +89,25 @@ def PlanTrap(Xf, Xi, Vi, Vmax, Amax, Dmax):
 
     return (Ar, Vr, Dr, Ta, Tv, Td, Tf)
 
+def EvalTrapAt(t, Xf, Xi, Vi, Ar, Vr, Dr, Ta, Tv, Td, Tf):
+    """
+    Returns (y, yd, ydd) of the profile at time t
+    """
+    if t < 0: # Initial conditions
+        return (Xi, Vi, 0)
+    elif t < Ta: # Acceleration
+        return (Xi + Vi*t + 0.5*Ar*t**2, Vi + Ar*t, Ar)
+    elif t < Ta+Tv: # Coasting
+        y_Accel = Xi + Vi*Ta + 0.5*Ar*Ta**2
+        return (y_Accel + Vr*(t-Ta), Vr, 0)
+    elif t < Tf: # Deceleration
+        td = t-Tf
+        return (Xf + 0*td + 0.5*Dr*td**2, 0 + Dr*td, Dr)
+    elif t >= Tf: # Final condition
+        return (Xf, 0, 0)
+    else:
+        raise ValueError("t = {} is outside of considered range".format(t))
+
 def EvalTrap(Xf, Xi, Vi, Ar, Vr, Dr, Ta, Tv, Td, Tf):
     # Create the time series and preallocate the position, velocity, and acceleration arrays
     t_traj = np.arange(0, Tf+0.1, 1/10000)
@@ -97,36 +115,9 @@ def EvalTrap(Xf, Xi, Vi, Ar, Vr, Dr, Ta, Tv, Td, Tf):
     yd = [None]*len(t_traj)
     ydd = [None]*len(t_traj)
 
-    # We only know acceleration (Ar and Dr), so we integrate to create
-    # the velocity and position curves
-    y_Accel = Xi + Vi*Ta + 0.5*Ar*Ta**2
-
     for i in range(len(t_traj)):
-        t = t_traj[i]
-        if t < 0: # Initial conditions
-            y[i]   = Xi
-            yd[i]  = Vi
-            ydd[i] = 0
-        elif t < Ta: # Acceleration
-            y[i]   = Xi + Vi*t + 0.5*Ar*t**2
-            yd[i]  = Vi + Ar*t
-            ydd[i] = Ar
-        elif t < Ta+Tv: # Coasting
-            y[i]   = y_Accel + Vr*(t-Ta)
-            yd[i]  = Vr
-            ydd[i] = 0
-        elif t < Tf: # Deceleration
-            td     = t-Tf
-            y[i]   = Xf + 0*td + 0.5*Dr*td**2
-            yd[i]  = 0 + Dr*td
-            ydd[i] = Dr
-        elif t >= Tf: # Final condition
-            y[i]   = Xf
-            yd[i]  = 0
-            ydd[i] = 0
-        else:
-            raise ValueError("t = {} is outside of considered range".format(t))
-        
+        (y[i], yd[i], ydd[i]) = EvalTrapAt(t_traj[i], Xf, Xi, Vi, Ar, Vr, Dr, Ta, Tv, Td, Tf)
+
     dy = np.diff(y)
     dy_max = np.max(np.abs(dy))
     dyd = np.diff(yd)
@@ -159,6 +150,7 @@ def EvalTrap(Xf, Xi, Vi, Ar, Vr, Dr, Ta, Tv, Td, Tf):
     return (y, yd, ydd, t_traj)
 
 def graphical_test():
+    import matplotlib.pyplot as plt
     numRows = 3
     numCols = 5
     fig, axes = plt.subplots(numRows, numCols)
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Generates golden vectors for the trapezoidal planner of the firmware
+# (TrapezoidalTrajectory in Firmware/MotorControl/trapTraj.cpp) from the
+# Python reference in PlanTrap.py. They are checked on the host by
+# Firmware/MotorControl/test/trap_traj_harness.cpp, which also measures the
+# cost per call of the C++ planner.
+#
+# Format, one record per line:
+#   move Xf Xi Vi Vmax Amax Dmax Ar Vr Dr Ta Tv Td Tf
+#   eval t Y Yd Ydd
+# The eval lines after a move are points of that move, in increasing t.
+#
+# Usage:
+#   ./TrapGoldenVectors.py > ../../Firmware/MotorControl/test/trap_traj_vectors.txt
+
+import argparse
+import contextlib
+import io
+import random
+import struct
+import sys
+
+from PlanTrap import PlanTrap, EvalTrapAt, pos_range, Vmax_range, Amax_range
+
+def to_float32(value):
+    """
+    Rounds to single precision, so that both sides plan the same move
+    """
+    return struct.unpack('f', struct.pack('f', value))[0]
+
+def random_move(rng):
+    # Same distribution as large_test() in PlanTrap.py, with separate
+    # deceleration limits
+    Vmax = rng.uniform(0.1*Vmax_range, Vmax_range)
+    Amax = rng.uniform(0.1*Amax_range, Amax_range)
+    Dmax = Amax if rng.random() <= 0.5 else rng.uniform(0.1*Amax_range, Amax_range)
+    Xf = rng.uniform(-pos_range, pos_range)
+    Xi = rng.uniform(-pos_range, pos_range)
+    if rng.random() <= 0.5:
+        Vi = rng.uniform(-Vmax*1.5, Vmax*1.5)
+    else:
+        Vi = 0
+    return [to_float32(v) for v in (Xf, Xi, Vi, Vmax, Amax, Dmax)]
+
+def write_vectors(out, n_moves, n_evals, seed):
+    rng = random.Random(seed)
+    out.write("# generated by TrapGoldenVectors.py --moves {} --evals {} --seed {}\n".format(n_moves, n_evals, seed))
+    for _ in range(n_moves):
+        (Xf, Xi, Vi, Vmax, Amax, Dmax) = random_move(rng)
+        with contextlib.redirect_stdout(io.StringIO()):
+            plan = PlanTrap(Xf, Xi, Vi, Vmax, Amax, Dmax)
+        (Ar, Vr, Dr, Ta, Tv, Td, Tf) = plan
+        out.write("move " + " ".join("{:.9g}".format(v) for v in
+                  (Xf, Xi, Vi, Vmax, Amax, Dmax, Ar, Vr, Dr, Ta, Tv, Td, Tf)) + "\n")
+        # Random points before, during and after the move, including the
+        # phase boundaries where the segments change
+        times = [to_float32(rng.uniform(-0.1*Tf, 1.1*Tf)) for _ in range(n_evals - 3)]
+        times += [to_float32(Ta), to_float32(Ta + Tv), to_float32(Tf)]
+        for t in sorted(times):
+            (y, yd, ydd) = EvalTrapAt(t, *((Xf, Xi, Vi) + plan))
+            out.write("eval {:.9g} {:.9g} {:.9g} {:.9g}\n".format(t, y, yd, ydd))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Generates golden vectors for the trapezoidal planner of the firmware')
+    parser.add_argument("--moves", type=int, default=100, help="number of random moves")
+    parser.add_argument("--evals", type=int, default=16, help="points evaluated per move")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the random moves")
+    args = parser.parse_args()
+    write_vectors(sys.stdout, args.moves, max(args.evals, 3), args.seed)
@@ -6,13 +6,15 @@ sys.path.insert(0, os.path.join(os.path.dirname(os.path.dirname(
                     "Firmware", "fibre", "python"))
 
 # Syntactic sugar to make usage more intuative.
-# Try/pass used to break install-time dep issues
-try:
+# fibre is only imported on the first use, which keeps the import of the
+# odrive package fast and breaks install-time dep issues
+def find_any(*args, **kwargs):
     import fibre
-    find_any = fibre.find_any
-    find_all = fibre.find_all
-except:
-    pass
+    return fibre.find_any(*args, **kwargs)
+
+def find_all(*args, **kwargs):
+    import fibre
+    return fibre.find_all(*args, **kwargs)
 
 # Standard convention is to add a __version__ attribute to the package
 from .version import get_version_str
@@ -56,9 +56,15 @@ def generate_code(odrv, template_file, output_file):
     #import ipdb; ipdb.set_trace()
 
     # Load and render template
+    # Typed client classes for odrive_client_template.hpp.in
+    classes = []
+    root_class, _ = get_client_classes(odrv._json_data, 'ODrive', classes, set(), member_prefix='')
+
     template = env.from_string(template_file.read())
     output = template.render(
         json_crc=json_crc,
+        classes=classes,
+        root_class=root_class,
         endpoints=endpoints,
         per_axis_offset=per_axis_offset,
         axis_endpoints=axis_endpoints,
@@ -67,3 +73,92 @@ def generate_code(odrv, template_file, output_file):
 
     # Output
     output_file.write(output)
+
+
+CPP_KEYWORDS = {
+    'auto', 'bool', 'break', 'case', 'catch', 'char', 'class', 'const', 'continue',
+    'default', 'delete', 'do', 'double', 'else', 'enum', 'explicit', 'extern',
+    'false', 'float', 'for', 'friend', 'goto', 'if', 'inline', 'int', 'long',
+    'namespace', 'new', 'operator', 'private', 'protected', 'public', 'register',
+    'return', 'short', 'signed', 'sizeof', 'static', 'struct', 'switch', 'template',
+    'this', 'throw', 'true', 'try', 'typedef', 'typename', 'union', 'unsigned',
+    'using', 'virtual', 'void', 'volatile', 'while'
+}
+
+def get_cpp_type(json_type):
+    if json_type in {'int8', 'uint8', 'int16', 'uint16', 'int32', 'uint32', 'int64', 'uint64'}:
+        return json_type + '_t'
+    elif json_type in {'bool', 'float'}:
+        return json_type
+    else:
+        return None
+
+def get_cpp_name(name):
+    return name + '_' if name in CPP_KEYWORDS else name
+
+def get_endpoint_ids(json_data):
+    ids = []
+    for item in json_data:
+        if 'id' in item:
+            ids.append(item['id'])
+        for key in ('members', 'inputs', 'arguments', 'outputs'):
+            ids += get_endpoint_ids(item.get(key, []))
+    return ids
+
+def get_client_classes(json_data, class_name, classes, class_names, member_prefix=None):
+    """
+    Appends the description of a client class for the object with the given
+    JSON members to classes (the classes of its members come first) and
+    returns (class name, ID of the first endpoint of the object).
+    Objects with the same members and the same relative endpoint IDs (such as
+    axis0 and axis1) share one class, which adds the ID of the first endpoint
+    as offset. The class names of members start with member_prefix, which
+    is class_name by default.
+    """
+    if member_prefix is None:
+        member_prefix = class_name
+    base_id = min(get_endpoint_ids(json_data), default=0)
+    members = []
+    for item in json_data:
+        name = get_cpp_name(item['name'])
+        if item.get('type') == 'object':
+            if len(get_endpoint_ids(item['members'])) == 0:
+                continue
+            child_class, child_id = get_client_classes(item['members'],
+                member_prefix + ''.join(part.capitalize() for part in item['name'].rstrip('0123456789').split('_')),
+                classes, class_names)
+            members.append({'kind': 'object', 'name': name, 'path': item['name'],
+                            'class_name': child_class, 'id': child_id - base_id})
+        elif item.get('type') == 'function':
+            args = []
+            for direction, key in (('input', 'arguments'), ('input', 'inputs'), ('output', 'outputs')):
+                for arg in item.get(key, []):
+                    args.append({'direction': direction, 'name': get_cpp_name(arg['name']), 'path': arg['name'],
+                                 'type': get_cpp_type(arg.get('type')), 'id': arg['id'] - base_id})
+            if any(arg['type'] is None for arg in args):
+                continue
+            params = ["{} {}".format(arg['type'], arg['name']) for arg in args if arg['direction'] == 'input'] + \
+                     ["{}* {}".format(arg['type'], arg['name']) for arg in args if arg['direction'] == 'output']
+            members.append({'kind': 'function', 'name': name, 'path': item['name'], 'id': item['id'] - base_id,
+                            'inputs': [arg for arg in args if arg['direction'] == 'input'],
+                            'outputs': [arg for arg in args if arg['direction'] == 'output'],
+                            'params': ', '.join(params)})
+        else:
+            cpp_type = get_cpp_type(item.get('type'))
+            if cpp_type is None:
+                continue
+            if 'w' not in item.get('access', 'r'):
+                cpp_type = 'const ' + cpp_type
+            members.append({'kind': 'property', 'name': name, 'path': item['name'],
+                            'type': cpp_type, 'id': item['id'] - base_id})
+
+    signature = json.dumps(members, sort_keys=True)
+    for cls in classes:
+        if cls['signature'] == signature:
+            return cls['name'], base_id
+    unique_name = class_name
+    while unique_name in class_names:
+        unique_name = class_name + str(len([n for n in class_names if n.startswith(class_name)]) + 1)
+    class_names.add(unique_name)
+    classes.append({'name': unique_name, 'members': members, 'signature': signature})
+    return unique_name, base_id
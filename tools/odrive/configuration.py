@@ -16,6 +16,27 @@ def get_dict(obj, is_config_object):
                 result[k] = sub_dict
     return result
 
+def resolve_dict(pending_dict):
+    """
+    Replaces the PendingValues that get_dict() returns inside a batch
+    by their values.
+    """
+    return {k: resolve_dict(v) if isinstance(v, dict) else v.value
+            for (k,v) in pending_dict.items()}
+
+def get_dict_batched(device):
+    """
+    Reads all config properties of the device in as few requests as
+    possible. Falls back to reading them one by one if the device doesn't
+    support batches.
+    """
+    try:
+        with device.batch():
+            pending = get_dict(device, False)
+        return resolve_dict(pending)
+    except Exception:
+        return get_dict(device, False)
+
 def set_dict(obj, path, config_dict):
     errors = []
     for (k,v) in config_dict.items():
@@ -33,6 +54,19 @@ def set_dict(obj, path, config_dict):
                 errors.append("Could not restore {}: {}".format(name, str(ex)))
     return errors
 
+def set_dict_batched(device, config_dict):
+    """
+    Writes all properties of config_dict in as few requests as possible.
+    If the batch fails, the properties are written one by one again, so
+    that each failure is reported on its own.
+    """
+    try:
+        with device.batch():
+            errors = set_dict(device, "", config_dict)
+        return errors
+    except Exception:
+        return set_dict(device, "", config_dict)
+
 def get_temp_config_filename(device):
     serial_number = fibre.utils.get_serial_number_str(device)
     safe_serial_number = ''.join(filter(str.isalnum, serial_number))
@@ -54,7 +88,7 @@ def backup_config(device, filename, logger):
         if not yes_no_prompt("The file {} already exists. Do you want to override it?".format(filename), True):
             raise OperationAbortedException()
 
-    data = get_dict(device, False)
+    data = get_dict_batched(device)
     with open(filename, 'w') as file:
         json.dump(data, file)
     logger.info("Configuration saved.")
@@ -71,7 +105,7 @@ def restore_config(device, filename, logger):
         data = json.load(file)
 
     logger.info("Restoring configuration from {}...".format(filename))
-    errors = set_dict(device, "", data)
+    errors = set_dict_batched(device, data)
 
     for error in errors:
         logger.info(error)
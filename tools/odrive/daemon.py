@@ -0,0 +1,246 @@
+"""
+Keeps ODrive connections open in a background process, so that one-off
+commands don't wait for the import of fibre and the discovery of the
+devices every time.
+
+`odrivetool daemon` serves the ODrives that it finds on a local socket.
+`odrivetool get/set/call` send one request to it and print the result. If no
+daemon is running, they start one in the background and wait for it, so
+only the first command pays for the connection.
+
+Requests and responses are one JSON object per line:
+    {"op": "get", "path": "axis0.encoder.pos_estimate", "serial_number": null}
+    {"op": "set", "path": "axis0.controller.vel_setpoint", "value": 1000}
+    {"op": "call", "path": "save_configuration", "args": []}
+    {"op": "list"}
+    {"op": "stop"}
+=>  {"result": ...} or {"error": "..."}
+Without serial_number, the first ODrive that was found is used.
+
+The client functions only use the standard library, so that a command that
+goes to the daemon doesn't import fibre at all.
+
+Example:
+    from odrive.daemon import request
+    pos = request({'op': 'get', 'path': 'axis0.encoder.pos_estimate'})
+"""
+
+import json
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+class DaemonError(Exception):
+    pass
+
+def get_default_address():
+    """
+    Returns the address of the daemon of this user: a Unix domain socket,
+    or a TCP port on localhost where those are not available
+    """
+    if hasattr(socket, 'AF_UNIX'):
+        uid = os.getuid() if hasattr(os, 'getuid') else 0
+        return 'unix:' + os.path.join(tempfile.gettempdir(), 'odrivetool-{}.sock'.format(uid))
+    return '127.0.0.1:9909'
+
+def _make_socket(address):
+    if address.startswith('unix:'):
+        return socket.socket(socket.AF_UNIX, socket.SOCK_STREAM), address[len('unix:'):]
+    host, port = address.rsplit(':', 1)
+    return socket.socket(socket.AF_INET, socket.SOCK_STREAM), (host, int(port))
+
+def request(req, address=None, timeout=10.0):
+    """
+    Sends one request to the daemon and returns the result.
+    Raises ConnectionError if no daemon is listening on address and
+    DaemonError if the daemon could not carry out the request.
+    """
+    sock, sockaddr = _make_socket(address or get_default_address())
+    sock.settimeout(timeout)
+    try:
+        try:
+            sock.connect(sockaddr)
+        except (socket.error, OSError) as ex:
+            raise ConnectionError(str(ex))
+        sock.sendall(json.dumps(req).encode('utf-8') + b'\n')
+        buf = b''
+        while not buf.endswith(b'\n'):
+            chunk = sock.recv(4096)
+            if not chunk:
+                raise DaemonError("the daemon closed the connection")
+            buf += chunk
+    finally:
+        sock.close()
+    response = json.loads(buf.decode('utf-8'))
+    if 'error' in response:
+        raise DaemonError(response['error'])
+    return response.get('result')
+
+def start_daemon(odrivetool_path, path, serial_number, address=None, timeout=10.0):
+    """
+    Starts `odrivetool daemon` as a detached background process and waits
+    until it accepts requests
+    """
+    cmd = [sys.executable, odrivetool_path, '--path', path, 'daemon', '--address', address or get_default_address()]
+    if serial_number:
+        cmd[3:3] = ['--serial-number', serial_number]
+    kwargs = {}
+    if os.name == 'nt':
+        kwargs['creationflags'] = subprocess.CREATE_NEW_PROCESS_GROUP | 0x00000008 # DETACHED_PROCESS
+    else:
+        kwargs['start_new_session'] = True
+    subprocess.Popen(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                     stderr=subprocess.DEVNULL, close_fds=True, **kwargs)
+    deadline = time.monotonic() + timeout
+    while True:
+        try:
+            return request({'op': 'list'}, address)
+        except ConnectionError:
+            if time.monotonic() > deadline:
+                raise
+            time.sleep(0.05)
+
+def parse_value(text):
+    """
+    Parses a command line value as JSON (numbers, true/false), otherwise
+    takes it as a string
+    """
+    try:
+        return json.loads(text)
+    except ValueError:
+        return text
+
+
+class Daemon():
+    """
+    Serves the ODrives that fibre discovers on path. Devices are added as
+    they are found and removed when their channel breaks, so a reconnected
+    ODrive is served again without restarting the daemon. The JSON
+    descriptors are read from the fibre cache, see get_interface_definition().
+    """
+    def __init__(self, path, serial_number, address, logger):
+        self._path = path
+        self._serial_number = serial_number
+        self._address = address or get_default_address()
+        self._logger = logger
+        self._devices = [] # (serial number string, device, lock) in the order of discovery
+        self._devices_lock = threading.Lock()
+        self._device_found = threading.Condition(self._devices_lock)
+
+    def _did_discover_device(self, device):
+        serial_number = '{:012X}'.format(device.serial_number) if hasattr(device, 'serial_number') else '?'
+        entry = (serial_number, device, threading.Lock())
+        with self._devices_lock:
+            self._devices.append(entry)
+            self._device_found.notify_all()
+        self._logger.info("connected to ODrive {}".format(serial_number))
+        def did_lose_device():
+            with self._devices_lock:
+                if entry in self._devices:
+                    self._devices.remove(entry)
+            self._logger.info("lost ODrive {}".format(serial_number))
+        device.__channel__._channel_broken.subscribe(did_lose_device)
+
+    def _get_device(self, serial_number, timeout):
+        with self._devices_lock:
+            deadline = time.monotonic() + timeout
+            while True:
+                for entry in self._devices:
+                    if serial_number is None or entry[0] == serial_number.upper():
+                        return entry
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    raise DaemonError("no ODrive" + (" " + serial_number if serial_number else "") + " connected")
+                self._device_found.wait(remaining)
+
+    @staticmethod
+    def _resolve(device, path):
+        parent = device
+        names = path.split('.') if path else []
+        for name in names[:-1]:
+            parent = getattr(parent, name)
+        return parent, names[-1] if names else None
+
+    def _handle(self, req):
+        op = req.get('op')
+        if op == 'list':
+            with self._devices_lock:
+                return [serial for (serial, _, _) in self._devices]
+        (_, device, lock) = self._get_device(req.get('serial_number'), req.get('timeout', 5.0))
+        parent, name = self._resolve(device, req.get('path', ''))
+        if name is None:
+            raise DaemonError("no path given")
+        with lock:
+            if op == 'get':
+                value = getattr(parent, name)
+                if not isinstance(value, (bool, int, float)):
+                    raise DaemonError("{} is not a property".format(req['path']))
+                return value
+            elif op == 'set':
+                setattr(parent, name, req['value'])
+                return None
+            elif op == 'call':
+                return getattr(parent, name)(*req.get('args', []))
+        raise DaemonError("unknown operation {}".format(op))
+
+    def _serve_client(self, conn, shutdown_token):
+        try:
+            buf = b''
+            while not buf.endswith(b'\n'):
+                chunk = conn.recv(4096)
+                if not chunk:
+                    return
+                buf += chunk
+            req = json.loads(buf.decode('utf-8'))
+            if req.get('op') == 'stop':
+                response = {'result': None}
+                shutdown_token.set()
+            else:
+                try:
+                    response = {'result': self._handle(req)}
+                except Exception as ex:
+                    response = {'error': "{}: {}".format(type(ex).__name__, ex)}
+            conn.sendall(json.dumps(response).encode('utf-8') + b'\n')
+        except (socket.error, OSError, ValueError) as ex:
+            self._logger.debug("client failed: {}".format(ex))
+        finally:
+            conn.close()
+
+    def run(self, shutdown_token):
+        """
+        Serves requests until shutdown_token is set, e.g. by a stop request
+        """
+        import odrive
+        odrive.find_all(self._path, self._serial_number, self._did_discover_device,
+                        shutdown_token, shutdown_token, self._logger)
+        server, sockaddr = _make_socket(self._address)
+        if self._address.startswith('unix:'):
+            # A stale socket file of a daemon that died is taken over, a live one not
+            try:
+                request({'op': 'list'}, self._address, timeout=1.0)
+                raise DaemonError("a daemon is already running on " + self._address)
+            except ConnectionError:
+                if os.path.exists(sockaddr):
+                    os.remove(sockaddr)
+        else:
+            server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(sockaddr)
+        server.listen(8)
+        server.settimeout(0.2)
+        self._logger.info("serving on " + self._address)
+        try:
+            while not shutdown_token.is_set():
+                try:
+                    conn, _ = server.accept()
+                except socket.timeout:
+                    continue
+                conn.settimeout(None)
+                threading.Thread(target=self._serve_client, args=(conn, shutdown_token), daemon=True).start()
+        finally:
+            server.close()
+            if self._address.startswith('unix:') and os.path.exists(sockaddr):
+                os.remove(sockaddr)
@@ -10,6 +10,7 @@ import time
 import threading
 import platform
 import struct
+import array
 import requests
 import re
 import io
@@ -64,6 +65,22 @@ def populate_sectors(sectors, hexfile):
             yield (sector, hexfile.tobinarray(addr, addr + size - 1))
 
 
+def diff_sector(dfudev, sector, data):
+    """
+    Reads back the sector and returns None if it already holds data.
+    Otherwise returns a (sector, data, current_data) tuple, where current_data
+    is the current content of the sector if the new data only clears bits
+    (which flash can do without an erase), or None if the sector needs to be
+    erased first.
+    """
+    current_data = dfudev.read_sector(sector)
+    if current_data == data:
+        return None
+    current = int.from_bytes(current_data.tobytes(), 'little')
+    expected = int.from_bytes(data.tobytes(), 'little')
+    needs_erase = (expected & ~current) != 0 # a bit has to go from 0 to 1
+    return (sector, data, None if needs_erase else current_data)
+
 def get_first_mismatch_index(array1, array2):
     """
     Compares two arrays and returns the index of the
@@ -147,6 +164,7 @@ class FirmwareFromGithub(Firmware):
                           int(hw_version_match.groupdict().get('voltage') or 0))
         self.github_asset_id = asset_json['id']
         self.hex = None
+        self._download_lock = threading.Lock()
         # no technical reason to fetch this - just interesting
         self.download_count = asset_json['download_count']
     
@@ -154,13 +172,14 @@ class FirmwareFromGithub(Firmware):
         """
         Returns the content of the firmware in as a binary array in Intel Hex format
         """
-        if self.hex is None:
-            print("Downloading firmware {}...".format(get_fw_version_string(self.fw_version)))
-            response = requests.get('https://api.github.com/repos/madcowswe/ODrive/releases/assets/' + str(self.github_asset_id),
-                                    headers={'Accept': 'application/octet-stream'})
-            if response.status_code != 200:
-                raise Exception("failed to download firmware")
-            self.hex = response.content
+        with self._download_lock: # shared by parallel updates
+            if self.hex is None:
+                print("Downloading firmware {}...".format(get_fw_version_string(self.fw_version)))
+                response = requests.get('https://api.github.com/repos/madcowswe/ODrive/releases/assets/' + str(self.github_asset_id),
+                                        headers={'Accept': 'application/octet-stream'})
+                if response.status_code != 200:
+                    raise Exception("failed to download firmware")
+                self.hex = response.content
         return io.StringIO(self.hex.decode('utf-8'))
 
 class FirmwareFromFile(Firmware):
@@ -244,7 +263,39 @@ def find_device_in_dfu_mode(serial_number, cancellation_token):
         time.sleep(1)
     return None
 
-def update_device(device, firmware, logger, cancellation_token):
+prompt_lock = threading.Lock()
+
+def prompt(prefix, question, default):
+    """
+    Asks a yes/no question. Parallel updates ask one at a time and prefix
+    the question with the device's serial number.
+    """
+    with prompt_lock:
+        return odrive.utils.yes_no_prompt((prefix or "") + question, default)
+
+def run_step(name, items, fn, prefix=None):
+    """
+    Calls fn(*item) for each item and shows the progress. For parallel
+    updates (prefix is not None) only the completion is printed, prefixed
+    with the device's serial number.
+    """
+    if len(items) == 0:
+        return
+    try:
+        for i, item in enumerate(items):
+            if prefix is None:
+                print("{}... (sector {}/{})  \r".format(name, i, len(items)), end='', flush=True)
+            fn(*item)
+        if prefix is None:
+            print('{}... done            \r'.format(name), end='', flush=True)
+        else:
+            # one write per line, so that the lines of parallel updates don't mix
+            print('{}{}... done ({} sectors)\n'.format(prefix, name, len(items)), end='', flush=True)
+    finally:
+        if prefix is None:
+            print('', flush=True)
+
+def update_device(device, firmware, logger, cancellation_token, skip_unchanged=True, parallel=False):
     """
     Updates the specified device with the specified firmware.
     The device passed to this function can either be in
@@ -252,6 +303,9 @@ def update_device(device, firmware, logger, cancellation_token):
     The firmware should be an instance of Firmware or None.
     If firmware is None, the newest firmware for the device is
     downloaded from GitHub releases.
+    If skip_unchanged is True, the sectors are read back first and only the
+    ones that differ from the firmware are erased and written.
+    Set parallel to True if other devices are updated at the same time.
     """
 
     if isinstance(device, usb.core.Device):
@@ -280,12 +334,14 @@ def update_device(device, firmware, logger, cancellation_token):
         hw_version_variant = device.hw_version_variant if hasattr(device, 'hw_version_variant') else 0
         hw_version = (hw_version_major, hw_version_minor, hw_version_variant)
 
+    prefix = "ODrive {}: ".format(serial_number) if parallel else None
+
     if hw_version < (3, 5, 0):
         print("  DFU mode is not supported on board version 3.4 or earlier.")
         print("  This is because entering DFU mode on such a device would")
         print("  break the brake resistor FETs under some circumstances.")
         print("Warning: DFU mode is not supported on ODrives earlier than v3.5 unless you perform a hardware mod.")
-        if not odrive.utils.yes_no_prompt("Do you still want to continue?", False):
+        if not prompt(prefix, "Do you still want to continue?", False):
             raise OperationAbortedException()
 
     fw_version_major = device.fw_version_major if hasattr(device, 'fw_version_major') else 0
@@ -323,7 +379,7 @@ def update_device(device, firmware, logger, cancellation_token):
             print("You are about to flash firmware {} which is the same version as the firmware on the device ({}).".format(
                     get_fw_version_string(firmware.fw_version),
                     get_fw_version_string(fw_version)))
-        if not odrive.utils.yes_no_prompt("Do you want to flash this firmware anyway?", False):
+        if not prompt(prefix, "Do you want to flash this firmware anyway?", False):
             raise OperationAbortedException()
 
     # load hex file
@@ -337,11 +393,12 @@ def update_device(device, firmware, logger, cancellation_token):
         logger.debug(" {:08X} to {:08X}".format(start, end - 1))
 
     # Back up configuration
+    did_backup_config = False
     if dfudev is None:
         did_backup_config = device.user_config_loaded if hasattr(device, 'user_config_loaded') else False
         if did_backup_config:
             odrive.configuration.backup_config(device, None, logger)
-    elif not odrive.utils.yes_no_prompt("The configuration cannot be backed up because the device is already in DFU mode. The configuration may be lost after updating. Do you want to continue anyway?", True):
+    elif not prompt(prefix, "The configuration cannot be backed up because the device is already in DFU mode. The configuration may be lost after updating. Do you want to continue anyway?", True):
         raise OperationAbortedException()
 
     # Put the device into DFU mode if it's not already in DFU mode
@@ -358,48 +415,52 @@ def update_device(device, firmware, logger, cancellation_token):
             sector['addr'],
             sector['addr'] + sector['len'] - 1,
             sector['name']))
+    logger.debug("Transfer size: {} bytes".format(dfudev.transfer_size))
 
     # fill sectors with data
     touched_sectors = list(populate_sectors(dfudev.sectors, hexfile))
 
+    # Reading a sector back is much faster than erasing and writing it
+    if skip_unchanged:
+        changed_sectors = []
+        def compare_sector(sector, data):
+            changed = diff_sector(dfudev, sector, data)
+            if changed is not None:
+                changed_sectors.append(changed)
+        run_step("Comparing", touched_sectors, compare_sector, prefix)
+    else:
+        changed_sectors = [(sector, data, None) for (sector, data) in touched_sectors]
+
     logger.debug("The following sectors will be flashed: ")
-    for sector,_ in touched_sectors:
-        logger.debug(" {:08X} to {:08X}".format(sector['addr'], sector['addr'] + sector['len'] - 1))
+    for sector, _, current_data in changed_sectors:
+        logger.debug(" {:08X} to {:08X}{}".format(sector['addr'], sector['addr'] + sector['len'] - 1,
+                                                   "" if current_data is None else " (without erasing)"))
+    if len(changed_sectors) == 0:
+        print("{}The firmware on the device is already up to date.".format(prefix or ""))
 
     # Erase
-    try:
-        for i, (sector, data) in enumerate(touched_sectors):
-            print("Erasing... (sector {}/{})  \r".format(i, len(touched_sectors)), end='', flush=True)
-            dfudev.erase_sector(sector)
-        print('Erasing... done            \r', end='', flush=True)
-    finally:
-        print('', flush=True)
+    run_step("Erasing", [(sector,) for (sector, _, current_data) in changed_sectors if current_data is None],
+             dfudev.erase_sector, prefix)
 
     # Flash
-    try:
-        for i, (sector, data) in enumerate(touched_sectors):
-            print("Flashing... (sector {}/{})  \r".format(i, len(touched_sectors)), end='', flush=True)
-            dfudev.write_sector(sector, data)
-        print('Flashing... done            \r', end='', flush=True)
-    finally:
-        print('', flush=True)
+    def write_sector(sector, data, current_data):
+        if current_data is None:
+            current_data = array.array(u'B', [0xff]) * sector['len'] # erased
+        dfudev.write_sector(sector, data, current_data)
+    run_step("Flashing", changed_sectors, write_sector, prefix)
 
     # Verify
-    try:
-        for i, (sector, expected_data) in enumerate(touched_sectors):
-            print("Verifying... (sector {}/{})  \r".format(i, len(touched_sectors)), end='', flush=True)
-            observed_data = dfudev.read_sector(sector)
-            mismatch_pos = get_first_mismatch_index(observed_data, expected_data)
-            if not mismatch_pos is None:
-                mismatch_pos -= mismatch_pos % 16
-                observed_snippet = ' '.join('{:02X}'.format(x) for x in observed_data[mismatch_pos:mismatch_pos+16])
-                expected_snippet = ' '.join('{:02X}'.format(x) for x in expected_data[mismatch_pos:mismatch_pos+16])
-                raise RuntimeError("Verification failed around address 0x{:08X}:\n".format(sector['addr'] + mismatch_pos) +
-                                   "  expected: " + expected_snippet + "\n"
-                                   "  observed: " + observed_snippet)
-        print('Verifying... done            \r', end='', flush=True)
-    finally:
-        print('', flush=True)
+    def verify_sector(sector, expected_data, _):
+        observed_data = dfudev.read_sector(sector)
+        mismatch_pos = get_first_mismatch_index(observed_data, expected_data)
+        if not mismatch_pos is None:
+            mismatch_pos -= mismatch_pos % 16
+            observed_snippet = ' '.join('{:02X}'.format(x) for x in observed_data[mismatch_pos:mismatch_pos+16])
+            expected_snippet = ' '.join('{:02X}'.format(x) for x in expected_data[mismatch_pos:mismatch_pos+16])
+            raise RuntimeError("Verification failed around address 0x{:08X}:\n".format(sector['addr'] + mismatch_pos) +
+                               "  expected: " + expected_snippet + "\n"
+                               "  observed: " + observed_snippet)
+    run_step("Verifying", changed_sectors, verify_sector, prefix)
 
 
     # If the flash operation failed for some reason, your device is bricked now.
@@ -410,7 +471,7 @@ def update_device(device, firmware, logger, cancellation_token):
     # Jump to application
     dfudev.jump_to_application(0x08000000)
 
-    logger.info("Waiting for the device to reappear...")
+    logger.info("{}Waiting for the device to reappear...".format(prefix or ""))
     device = odrive.find_any("usb", serial_number,
                     cancellation_token, cancellation_token, timeout=30)
 
@@ -418,15 +479,80 @@ def update_device(device, firmware, logger, cancellation_token):
         odrive.configuration.restore_config(device, None, logger)
         os.remove(odrive.configuration.get_temp_config_filename(device))
 
-    logger.success("Device firmware update successful.")
+    logger.success("{}Device firmware update successful.".format(prefix or ""))
+
+def find_all_devices(logger, cancellation_token, discovery_time=3.0):
+    """
+    Returns all ODrives that show up on USB within discovery_time seconds,
+    in normal mode and in DFU mode, one per serial number
+    """
+    devices = {}
+    lock = threading.Lock()
+    def did_discover_device(device):
+        with lock:
+            devices.setdefault(device.__channel__.usb_device.serial_number, device)
+
+    search_cancellation_token = Event(cancellation_token)
+    odrive.find_all("usb", None, did_discover_device, search_cancellation_token, cancellation_token, logger)
+    try:
+        search_cancellation_token.wait(timeout=discovery_time)
+    except fibre.utils.TimeoutError:
+        pass # discovery time is over
+    search_cancellation_token.set()
+    if cancellation_token.is_set():
+        raise OperationAbortedException()
+
+    for stm_device in usb.core.find(find_all=True, idVendor=0x0483, idProduct=0xdf11):
+        with lock:
+            devices.setdefault(stm_device.serial_number, stm_device)
+    return list(devices.values())
+
+def update_devices(devices, firmware, logger, cancellation_token, skip_unchanged=True):
+    """
+    Updates the specified devices in parallel. Raises an exception after
+    all updates finished if any of them failed.
+    """
+    failures = {}
+    def update_thread(device):
+        serial_number = device.serial_number if isinstance(device, usb.core.Device) else device.__channel__.usb_device.serial_number
+        try:
+            update_device(device, firmware, logger, cancellation_token, skip_unchanged, parallel=True)
+        except OperationAbortedException:
+            failures[serial_number] = "aborted"
+        except Exception as ex:
+            failures[serial_number] = ex
+    threads = [threading.Thread(target=update_thread, args=(device,)) for device in devices]
+    for t in threads:
+        t.daemon = True
+        t.start()
+    for t in threads:
+        t.join()
+
+    for serial_number, failure in failures.items():
+        logger.error("ODrive {}: {}".format(serial_number, failure))
+    if len(failures):
+        raise Exception("{} of {} updates failed".format(len(failures), len(devices)))
 
 def launch_dfu(args, logger, cancellation_token):
     """
     Waits for a device that matches args.path and args.serial_number
     and then upgrades the device's firmware.
+    With args.all, all connected devices are upgraded in parallel.
     """
 
     serial_number = args.serial_number
+    firmware = FirmwareFromFile(args.file) if args.file else None
+    skip_unchanged = not args.full
+
+    if args.all:
+        logger.info("Looking for ODrives...")
+        devices = find_all_devices(logger, cancellation_token)
+        if len(devices) == 0:
+            raise Exception("no ODrive found")
+        logger.info("Updating {} ODrives".format(len(devices)))
+        update_devices(devices, firmware, logger, cancellation_token, skip_unchanged)
+        return
+
     find_odrive_cancellation_token = Event(cancellation_token)
 
     logger.info("Waiting for ODrive...")
@@ -449,10 +575,8 @@ def launch_dfu(args, logger, cancellation_token):
     find_odrive_cancellation_token.set()
     
     device = devices[0] or devices[1]
-    firmware = FirmwareFromFile(args.file) if args.file else None
-
-    update_device(device, firmware, logger, cancellation_token)
 
+    update_device(device, firmware, logger, cancellation_token, skip_unchanged)
 
 
 # Note: the flashed image can be verified using: (0x12000 is the number of bytes to read)
@@ -1,6 +1,6 @@
 import usb.util
 import time
-import fractions
+import math
 import array
 from odrive.dfuse.DfuState import DfuState
 
@@ -15,8 +15,10 @@ DFU_CLRSTATUS = 0x04
 DFU_GETSTATE  = 0x05
 DFU_ABORT     = 0x06
 
+DFU_FUNCTIONAL_DESCRIPTOR = 0x21
+
 SIZE_MULTIPLIERS = {' ': 1, 'K': 1024, 'M' : 1024*1024}
-MAX_TRANSFER_SIZE = 2048
+MAX_TRANSFER_SIZE = 2048 # used if the device has no DFU functional descriptor
 
 # Order is LSB first
 def address_to_4bytes(a):
@@ -31,6 +33,7 @@ class DfuDevice:
         #self.dev.reset()
         self.cfg.set()
         self.sectors = list(self.get_device_sectors())
+        self.transfer_size = self.get_transfer_size()
 
     def alternates(self):
         return [(usb.util.get_string(self.dev, intf.iInterface), intf) for intf in self.cfg]
@@ -145,6 +148,24 @@ class DfuDevice:
                     addr += size
                     repeat -= 1
 
+    def get_transfer_size(self):
+        """
+        Returns the largest number of bytes per DNLOAD or UPLOAD request
+        (wTransferSize of the DFU functional descriptor).
+        """
+        for desc in [self.cfg] + list(self.cfg):
+            extra = bytes(getattr(desc, 'extra_descriptors', None) or [])
+            while len(extra) >= 2 and extra[0] > 0:
+                if extra[1] == DFU_FUNCTIONAL_DESCRIPTOR and extra[0] >= 7:
+                    return extra[5] + (extra[6] << 8)
+                extra = extra[extra[0]:]
+        return MAX_TRANSFER_SIZE
+
+    def get_sector_transfer_size(self, sector):
+        # DfuSe addresses each block by its number times the transfer size,
+        # so the sector must consist of whole blocks
+        return math.gcd(sector['len'], self.transfer_size)
+
     def set_alternate_safe(self, alt):
         self.set_alternate(alt)
         if self.get_state() == DfuState.DFU_ERROR:
@@ -171,14 +192,23 @@ class DfuDevice:
         if status[1] != DfuState.DFU_DOWNLOAD_IDLE:
             raise RuntimeError("An error occured. Device Status: {!r}".format(status))
 
-    def write_sector(self, sector, data):
+    def write_sector(self, sector, data, current_data=None):
+        """
+        Writes data to the specified sector, which must be erased or only
+        need bits to be cleared. If current_data (the content of the sector
+        before writing) is given, blocks that are already equal to it are
+        skipped.
+        """
         self.set_alternate_safe(sector['alt'])
         self.set_address_safe(sector['addr'])
 
-        transfer_size = fractions.gcd(sector['len'], MAX_TRANSFER_SIZE)
+        transfer_size = self.get_sector_transfer_size(sector)
         
         blocks = [data[i:i + transfer_size] for i in range(0, len(data), transfer_size)]
         for blocknum, block in enumerate(blocks):
+            offset = blocknum * transfer_size
+            if current_data is not None and block == current_data[offset:offset + len(block)]:
+                continue
             #print('write to {:08X} ({} bytes)'.format(
             #        sector['addr'] + blocknum * TRANSFER_SIZE, len(block)))
             self.write(blocknum, block)
@@ -194,7 +224,7 @@ class DfuDevice:
         self.set_alternate_safe(sector['alt'])
         self.set_address_safe(sector['addr'])
 
-        transfer_size = fractions.gcd(sector['len'], MAX_TRANSFER_SIZE)
+        transfer_size = self.get_sector_transfer_size(sector)
         #blocknum_offset = int((sector['addr'] - sector['baseaddr']) / transfer_size)
 
         
@@ -10,6 +10,17 @@ AXIS_STATE_SENSORLESS_CONTROL = 5
 AXIS_STATE_ENCODER_INDEX_SEARCH = 6
 AXIS_STATE_ENCODER_OFFSET_CALIBRATION = 7
 AXIS_STATE_CLOSED_LOOP_CONTROL = 8
+AXIS_STATE_SENSORLESS_FLUX_IDENTIFICATION = 9
+AXIS_STATE_FRICTION_IDENTIFICATION = 10
+AXIS_STATE_FREQUENCY_RESPONSE = 11
+AXIS_STATE_AUTO_TUNING = 12
+AXIS_STATE_SEQUENCE = 13
+AXIS_STATE_HOMING = 14
+
+ESTIMATOR_NONE = 0x00
+ESTIMATOR_ENCODER = 0x01
+ESTIMATOR_SENSORLESS = 0x02
+ESTIMATOR_FUSION = 0x04
 
 AXIS_ERROR_NONE = 0
 AXIS_ERROR_INVALID_STATE = 1
@@ -31,6 +42,34 @@ CTRL_MODE_VOLTAGE_CONTROL = 0
 CTRL_MODE_CURRENT_CONTROL = 1
 CTRL_MODE_VELOCITY_CONTROL = 2
 CTRL_MODE_POSITION_CONTROL = 3
+CTRL_MODE_TRAJECTORY_CONTROL = 4
+CTRL_MODE_STREAMING_CONTROL = 5
+CTRL_MODE_GEARING_CONTROL = 6
+CTRL_MODE_PATH_CONTROL = 7
+
+ANTI_WINDUP_DECAY = 0
+ANTI_WINDUP_CLAMP = 1
+ANTI_WINDUP_BACK_CALCULATION = 2
+
+IQ_FILTER_NONE = 0
+IQ_FILTER_NOTCH = 1
+IQ_FILTER_LOWPASS = 2
+
+GAIN_SCHEDULE_NONE = 0
+GAIN_SCHEDULE_VELOCITY = 1
+GAIN_SCHEDULE_LOAD_INDEX = 2
+
+INPUT_SHAPER_NONE = 0
+INPUT_SHAPER_ZV = 1
+INPUT_SHAPER_ZVD = 2
+INPUT_SHAPER_EI = 3
 
 ENCODER_MODE_INCREMENTAL = 0
 ENCODER_MODE_HALL = 1
+ENCODER_MODE_SPI_ABS_AMS = 2
+ENCODER_MODE_SINCOS = 3
+
+CONFIG_SAVE_STATE_IDLE = 0
+CONFIG_SAVE_STATE_WRITING = 1
+CONFIG_SAVE_STATE_DONE = 2
+CONFIG_SAVE_STATE_FAILED = 3
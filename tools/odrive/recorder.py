@@ -0,0 +1,253 @@
+"""
+Records properties of an ODrive to a compact binary log and reads it back.
+
+File format (all integers little endian):
+  - 8 bytes magic "ODRVLOG1"
+  - a sequence of chunks, each with a uint8 type, a uint32 payload length
+    and the payload:
+      - CHUNK_HEADER: JSON object with the "columns" (name and struct format
+        character of each recorded property), the "sample_period" [s], the
+        "serial_number", the "json_crc" of the device's interface and the
+        "source" (subscription or oscilloscope) and, from the oscilloscope,
+        the "first_row_time_us" (device time of index 0, see
+        odrv.get_time_us())
+      - CHUNK_DESCRIPTOR: zlib compressed JSON definition of the device
+      - CHUNK_DATA: zlib compressed block of rows, stored column by column:
+        uint32 number of rows n, n uint64 sample indices (time = index *
+        sample_period) and then n values of each column
+      - CHUNK_CLOCK: uint64 device time [us] and the float64 host time.time()
+        [s] at which the device read it, from a DeviceClock sync
+A log that was cut off (e.g. on a power loss) is read up to its last
+complete chunk.
+"""
+
+import json
+import struct
+import threading
+import time
+import zlib
+
+import fibre.utils
+from odrive.utils import SubscriptionSource, OscilloscopeSource, DeviceClock, fit_clock
+from fibre.utils import Event
+
+MAGIC = b'ODRVLOG1'
+CHUNK_HEADER = 1
+CHUNK_DESCRIPTOR = 2
+CHUNK_DATA = 3
+CHUNK_CLOCK = 4
+
+# struct format character -> numpy dtype
+numpy_dtypes = {
+    '?': '?', 'b': 'i1', 'B': 'u1', 'h': '<i2', 'H': '<u2',
+    'i': '<i4', 'I': '<u4', 'q': '<i8', 'Q': '<u8', 'f': '<f4',
+}
+
+class LogWriter():
+    """
+    Writes rows of samples to a log file in chunks of chunk_rows rows.
+    add() may be called from any thread.
+    """
+    def __init__(self, fp, names, formats, chunk_rows=4096):
+        self._fp = fp
+        self._names = names
+        self._formats = formats
+        self._chunk_rows = chunk_rows
+        self._indices = []
+        self._columns = [[] for _ in names]
+        self._lock = threading.Lock()
+        self.rows = 0
+        self._fp.write(MAGIC)
+
+    def write_chunk(self, chunk_type, payload):
+        with self._lock:
+            self._fp.write(struct.pack('<BI', chunk_type, len(payload)))
+            self._fp.write(payload)
+
+    def write_header(self, sample_period, **info):
+        header = dict(info)
+        header['columns'] = [{'name': name, 'format': fmt} for (name, fmt) in zip(self._names, self._formats)]
+        header['sample_period'] = sample_period
+        self.write_chunk(CHUNK_HEADER, json.dumps(header).encode('utf-8'))
+
+    def write_clock(self, device_us, host_time):
+        self.write_chunk(CHUNK_CLOCK, struct.pack('<Qd', device_us, host_time))
+
+    def write_descriptor(self, json_data):
+        self.write_chunk(CHUNK_DESCRIPTOR, zlib.compress(json.dumps(json_data).encode('utf-8')))
+
+    def add(self, index, values):
+        with self._lock:
+            self._indices.append(index)
+            for column, value in zip(self._columns, values):
+                column.append(value)
+            self.rows += 1
+            if len(self._indices) < self._chunk_rows:
+                return
+            indices, columns = self._indices, self._columns
+            self._indices, self._columns = [], [[] for _ in self._names]
+        self._write_data(indices, columns)
+
+    def flush(self):
+        with self._lock:
+            indices, columns = self._indices, self._columns
+            self._indices, self._columns = [], [[] for _ in self._names]
+        if indices:
+            self._write_data(indices, columns)
+        self._fp.flush()
+
+    def _write_data(self, indices, columns):
+        n = len(indices)
+        parts = [struct.pack('<I{}Q'.format(n), n, *indices)]
+        for fmt, column in zip(self._formats, columns):
+            parts.append(struct.pack('<{}{}'.format(n, fmt), *column))
+        self.write_chunk(CHUNK_DATA, zlib.compress(b''.join(parts), 1))
+
+def record(odrv, paths, fp, interval_ms=1, oscilloscope=False, decimation=1,
+           duration=None, cancellation_token=None, logger=None):
+    """
+    Records the properties at the given paths (e.g. 'axis0.encoder.pos_estimate')
+    into the file object fp until duration [s] elapsed or cancellation_token
+    is set or Ctrl+C is pressed. The values come from a subscription with the given interval, or
+    with oscilloscope=True from the oscilloscope's streaming mode at the
+    current loop rate divided by decimation. Returns the number of rows and
+    the number of lost samples.
+    From the oscilloscope, the device clock is synchronized every second
+    and logged, so that read_log() can put the rows on the host time of
+    other logs.
+    """
+    properties = [odrv._resolve_property(path) for path in paths]
+    if oscilloscope:
+        source = OscilloscopeSource(odrv, properties, decimation)
+        formats = ['f'] * len(paths) # the oscilloscope samples floats
+    else:
+        source = SubscriptionSource(properties, interval_ms)
+        formats = [prop._codec._struct_format.lstrip('<') for prop in properties]
+
+    writer = LogWriter(fp, paths, formats)
+    done = Event(cancellation_token)
+    clock = DeviceClock(odrv) if oscilloscope and hasattr(odrv, 'get_time_us') else None
+    def sync_clock():
+        clock.sync()
+        (device_us, host_monotonic) = clock.last_sync
+        writer.write_clock(device_us, host_monotonic + time.time() - time.monotonic())
+
+    header_lock = threading.Lock()
+    header_written = [False]
+    def on_sample(t, values):
+        # The sample period of the oscilloscope is only known once it runs
+        with header_lock:
+            if not header_written[0]:
+                info = {}
+                if clock:
+                    info['first_row_time_us'] = source.first_row_time_us
+                writer.write_header(1.0 / source.sample_rate,
+                    serial_number=fibre.utils.get_serial_number_str(odrv),
+                    json_crc=getattr(odrv, '_json_crc', None),
+                    source='oscilloscope' if oscilloscope else 'subscription', **info)
+                writer.write_descriptor(getattr(odrv, '_json_data', None))
+                header_written[0] = True
+        writer.add(int(round(t * source.sample_rate)), values)
+
+    source.start(on_sample, done)
+    try:
+        deadline = None if duration is None else time.monotonic() + duration
+        next_report = time.monotonic()
+        while not done.is_set() and (deadline is None or time.monotonic() < deadline):
+            if time.monotonic() > next_report:
+                next_report += 1.0
+                if clock:
+                    sync_clock()
+                if logger:
+                    logger.info("recorded {} rows, {} lost".format(writer.rows, source.lost_samples))
+            time.sleep(0.1)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        done.set()
+        time.sleep(0.1) # let the source deliver what's in flight
+        if clock:
+            sync_clock()
+        writer.flush()
+    return writer.rows, source.lost_samples
+
+def read_chunks(fp):
+    if fp.read(len(MAGIC)) != MAGIC:
+        raise Exception("not an ODrive log")
+    while True:
+        chunk_header = fp.read(5)
+        if len(chunk_header) < 5:
+            return
+        (chunk_type, length) = struct.unpack('<BI', chunk_header)
+        payload = fp.read(length)
+        if len(payload) < length:
+            return # cut off
+        yield chunk_type, payload
+
+def read_log(path):
+    """
+    Reads a log written by record().
+    Returns (header, descriptor, data). data is a numpy structured array
+    with a 'time' field [s] and one field per column. Without numpy, it is a
+    dict of lists with the same keys. Logs from the oscilloscope with clock
+    syncs also get a 'host_time' field, the time.time() of each row [s],
+    which lines up with the logs of other ODrives.
+    """
+    header = None
+    descriptor = None
+    clock_points = []
+    indices = []
+    columns = None
+    with open(path, 'rb') as fp:
+        for (chunk_type, payload) in read_chunks(fp):
+            if chunk_type == CHUNK_HEADER:
+                header = json.loads(payload.decode('utf-8'))
+                formats = [column['format'] for column in header['columns']]
+                columns = [[] for _ in formats]
+            elif chunk_type == CHUNK_CLOCK:
+                clock_points.append(struct.unpack('<Qd', payload))
+            elif chunk_type == CHUNK_DESCRIPTOR:
+                descriptor = json.loads(zlib.decompress(payload).decode('utf-8'))
+            elif chunk_type == CHUNK_DATA and header is not None:
+                block = zlib.decompress(payload)
+                n = struct.unpack_from('<I', block)[0]
+                offset = 4
+                indices.extend(struct.unpack_from('<{}Q'.format(n), block, offset))
+                offset += 8 * n
+                for fmt, column in zip(formats, columns):
+                    column.extend(struct.unpack_from('<{}{}'.format(n, fmt), block, offset))
+                    offset += struct.calcsize('<{}{}'.format(n, fmt))
+    if header is None:
+        raise Exception("the log has no header")
+
+    names = [column['name'] for column in header['columns']]
+    period = header['sample_period']
+    host_time = None
+    if clock_points and header.get('first_row_time_us') is not None:
+        (device_ref, host_ref, slope) = fit_clock(clock_points)
+        offset = host_ref + (header['first_row_time_us'] - device_ref) * slope
+        host_time = lambda times: offset + times * (slope * 1e6)
+    try:
+        import numpy
+    except ImportError:
+        data = {'time': [index * period for index in indices]}
+        if host_time:
+            data['host_time'] = [host_time(t) for t in data['time']]
+        data.update(zip(names, columns))
+        return header, descriptor, data
+    dtype = [('time', '<f8')] + ([('host_time', '<f8')] if host_time else [])
+    data = numpy.empty(len(indices), dtype=dtype + [(name, numpy_dtypes[fmt]) for (name, fmt) in zip(names, formats)])
+    data['time'] = numpy.array(indices, dtype='<u8') * period
+    if host_time:
+        data['host_time'] = host_time(data['time'])
+    for name, column in zip(names, columns):
+        data[name] = column
+    return header, descriptor, data
+
+def read_log_dataframe(path):
+    """
+    Reads a log written by record() into a pandas DataFrame indexed by time [s]
+    """
+    import pandas
+    (_, _, data) = read_log(path)
+    return pandas.DataFrame(data).set_index('time')
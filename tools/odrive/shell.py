@@ -5,7 +5,7 @@ import threading
 import fibre
 import odrive
 import odrive.enums
-from odrive.utils import start_liveplotter
+from odrive.utils import start_liveplotter, SubscriptionSource, OscilloscopeSource
 #from odrive.enums import * # pylint: disable=W0614
 
 def print_banner():
@@ -76,7 +76,9 @@ def launch_shell(args, logger, app_shutdown_token):
     """
 
     interactive_variables = {
-        'start_liveplotter': start_liveplotter
+        'start_liveplotter': start_liveplotter,
+        'SubscriptionSource': SubscriptionSource,
+        'OscilloscopeSource': OscilloscopeSource
     }
 
     # Expose all enums from odrive.enums
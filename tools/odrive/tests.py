@@ -228,6 +228,123 @@ class DualAxisTest(ABC):
     def run_test(self, axis0_ctx: AxisTestContext, axis1_ctx: AxisTestContext, logger):
         pass
 
+class TestJob():
+    """
+    One test on one target: an ODrive, an axis or a set of coupled axes.
+    resources is the set of ODrive and axis names that the test takes
+    ownership of. None takes ownership of the whole test rig.
+    """
+    def __init__(self, test, target_name, run, resources):
+        self.test = test
+        self.target_name = target_name
+        self.name = type(test).__name__ + " on " + target_name
+        self.run = run
+        self.resources = resources
+        self.dependencies = []
+        self.status = 'pending' # pending, running, passed, failed or skipped
+        self.start_time = None
+        self.duration = None
+        self.error = None
+
+    def conflicts_with(self, other):
+        if self.resources is None or other.resources is None:
+            return True
+        return not self.resources.isdisjoint(other.resources)
+
+class TestScheduler():
+    """
+    Runs test jobs concurrently as long as they don't share resources.
+    A job only starts once all jobs that were added before it and share a
+    resource with it have passed, so each ODrive and each axis sees the
+    tests in the same order as in a sequential run.
+    After the first failure, no more jobs are started.
+    """
+    def __init__(self, logger, max_parallel=None):
+        self._logger = logger
+        self._max_parallel = max_parallel
+        self._cond = threading.Condition()
+        self.jobs = []
+        self.start_time = None
+        self.duration = None
+
+    def add(self, job):
+        job.dependencies = [other for other in self.jobs if other.conflicts_with(job)]
+        self.jobs.append(job)
+
+    def _run_job(self, job):
+        try:
+            job.run()
+            status = 'passed'
+        except Exception as ex:
+            job.error = ex
+            status = 'failed'
+        with self._cond:
+            job.duration = time.monotonic() - job.start_time
+            job.status = status
+            self._cond.notify_all()
+
+    def run(self):
+        """
+        Runs all jobs and waits for them to finish.
+        Throws an exception if any job failed.
+        """
+        self.start_time = time.monotonic()
+        with self._cond:
+            while True:
+                failed = [job for job in self.jobs if job.status == 'failed']
+                running = [job for job in self.jobs if job.status == 'running']
+                pending = [job for job in self.jobs if job.status == 'pending']
+                if failed:
+                    for job in pending:
+                        job.status = 'skipped'
+                    pending = []
+                if not pending and not running:
+                    break
+                for job in pending:
+                    if self._max_parallel and len(running) >= self._max_parallel:
+                        break
+                    if all(dep.status == 'passed' for dep in job.dependencies):
+                        job.status = 'running'
+                        job.start_time = time.monotonic()
+                        running.append(job)
+                        thread = threading.Thread(target=self._run_job, args=(job,))
+                        thread.daemon = True
+                        thread.start()
+                self._cond.wait()
+        self.duration = time.monotonic() - self.start_time
+
+        for job in self.jobs:
+            if job.status == 'skipped':
+                self._logger.warn('- skipped {}'.format(job.name))
+        failed = [job for job in self.jobs if job.status == 'failed']
+        if len(failed) == 1:
+            raise Exception("task {} failed.".format(failed[0].name)) from failed[0].error
+        elif len(failed) > 1:
+            msg = "task {} and {} failed.".format(
+                failed[0].name,
+                "one other" if len(failed) == 2 else str(len(failed)-1) + " others")
+            raise Exception(msg) from failed[0].error
+
+    def get_report(self):
+        """
+        Returns the status and timing of all jobs as a dict that can be
+        serialized to JSON. Times are in seconds since the start of run().
+        """
+        def job_report(job):
+            return {
+                'test': type(job.test).__name__,
+                'target': job.target_name,
+                'status': job.status,
+                'start': None if job.start_time is None else job.start_time - self.start_time,
+                'duration': job.duration,
+                'error': None if job.error is None else repr(job.error),
+            }
+        return {
+            'duration': self.duration,
+            'sequential_duration': sum(job.duration or 0 for job in self.jobs),
+            'jobs': [job_report(job) for job in self.jobs],
+        }
+
 class TestDiscoverAndGotoIdle(ODriveTest):
     def run_test(self, odrv_ctx: ODriveTestContext, logger):
         odrv_ctx.rediscover()
@@ -778,3 +895,132 @@ class TestSensorlessControl(AxisTest):
         test_assert_eq(odrv0.axis0.encoder.vel_estimate, target_vel, range=2000)
 
         request_state(axis_ctx, AXIS_STATE_IDLE)
+
+
+class TestCommsBenchmark(ODriveTest):
+    """
+    Measures the communication performance over each transport that the test
+    rig YAML lists for the ODrive:
+      usb: native USB (always measured)
+      usb-serial: the USB CDC port, e.g. /dev/ttyACM0 (fibre over a byte stream)
+      uart: the UART port (requires config.enable_uart)
+      can: a python-can path spec, e.g. socketcan:can0:0
+    Per transport it reports the round trip latency of a function call, the
+    property read rate, the telemetry stream rate (see odrive.utils.subscribe)
+    and, if axis0 is ready for closed loop control, the latency from a velocity
+    setpoint to the first encoder movement.
+    The results of all ODrives are written to results_file as JSON, keyed by
+    the ODrive name and the transport.
+    """
+    transports = ['usb', 'usb-serial', 'uart', 'can']
+
+    def __init__(self, results_file, num_calls=1000, stream_duration=2.0):
+        super(TestCommsBenchmark, self).__init__()
+        self._results_file = results_file
+        self._num_calls = num_calls
+        self._stream_duration = stream_duration
+        self._lock = threading.Lock()
+        self._results = {}
+
+    def _connect(self, odrv_ctx, transport, termination_token):
+        if transport == 'usb':
+            return odrv_ctx.handle
+        path = odrv_ctx.yaml.get(transport)
+        if not path or '[' in path:
+            return None # not used on this rig
+        path = ('can:' if transport == 'can' else 'serial:') + path
+        try:
+            return odrive.find_any(path, serial_number=odrv_ctx.yaml['serial-number'],
+                                   channel_termination_token=termination_token, timeout=5)
+        except fibre.TimeoutError:
+            return None
+
+    def _measure_round_trip(self, odrv):
+        latencies = []
+        for _ in range(self._num_calls):
+            start = time.monotonic()
+            odrv.test_function(1)
+            latencies.append(time.monotonic() - start)
+        latencies_ms = np.array(latencies) * 1e3
+        return {
+            'round_trip_mean_ms': float(np.mean(latencies_ms)),
+            'round_trip_p50_ms': float(np.percentile(latencies_ms, 50)),
+            'round_trip_p99_ms': float(np.percentile(latencies_ms, 99)),
+            'round_trip_max_ms': float(np.max(latencies_ms)),
+        }
+
+    def _measure_read_rate(self, odrv):
+        start = time.monotonic()
+        for _ in range(self._num_calls):
+            odrv.vbus_voltage
+        return {'property_reads_per_s': self._num_calls / (time.monotonic() - start)}
+
+    def _measure_stream_rate(self, odrv):
+        frames = []
+        properties = [odrv.axis0.encoder._remote_attributes['pos_estimate'],
+                      odrv.axis0.encoder._remote_attributes['vel_estimate']]
+        odrive.utils.subscribe(properties, 1, lambda frame_no, values: frames.append(frame_no))
+        time.sleep(self._stream_duration)
+        odrive.utils.subscribe(properties, 0, None)
+        if len(frames) < 2:
+            return {'stream_frames_per_s': 0.0, 'stream_lost_frames': 0}
+        expected = sum((b - a) % 0x8000 for a, b in zip(frames[:-1], frames[1:])) + 1
+        return {
+            'stream_frames_per_s': len(frames) / self._stream_duration,
+            'stream_lost_frames': expected - len(frames),
+        }
+
+    def _measure_motion_latency(self, odrv, axis_ctx, logger):
+        axis = odrv.axis0
+        if not (axis.motor.is_calibrated and axis.encoder.is_ready):
+            logger.warn("axis0 is not ready for closed loop control, skipping the motion latency")
+            return {}
+        axis.controller.config.control_mode = CTRL_MODE_VELOCITY_CONTROL
+        axis.controller.set_vel_setpoint(0, 0)
+        axis.requested_state = AXIS_STATE_CLOSED_LOOP_CONTROL
+        time.sleep(0.2)
+        try:
+            test_assert_eq(axis.current_state, AXIS_STATE_CLOSED_LOOP_CONTROL)
+            latencies = []
+            for _ in range(10):
+                init_pos = axis.encoder.pos_estimate
+                start = time.monotonic()
+                axis.controller.set_vel_setpoint(axis_ctx.yaml['encoder-cpr'], 0) # 1 turn/s
+                while abs(axis.encoder.pos_estimate - init_pos) < 4:
+                    if time.monotonic() - start > 1.0:
+                        raise TestFailed("axis0 didn't move")
+                latencies.append(time.monotonic() - start)
+                axis.controller.set_vel_setpoint(0, 0)
+                time.sleep(0.3)
+        finally:
+            axis.controller.set_vel_setpoint(0, 0)
+            axis.requested_state = AXIS_STATE_IDLE
+        # The movement is only seen with the next read, which is included
+        return {'setpoint_to_motion_mean_ms': float(np.mean(latencies)) * 1e3,
+                'setpoint_to_motion_max_ms': float(np.max(latencies)) * 1e3}
+
+    def run_test(self, odrv_ctx: ODriveTestContext, logger):
+        results = {}
+        for transport in self.transports:
+            termination_token = odrive.utils.Event()
+            odrv = self._connect(odrv_ctx, transport, termination_token)
+            if odrv is None:
+                logger.debug("{}: not available".format(transport))
+                continue
+            try:
+                result = {}
+                result.update(self._measure_round_trip(odrv))
+                result.update(self._measure_read_rate(odrv))
+                result.update(self._measure_stream_rate(odrv))
+                result.update(self._measure_motion_latency(odrv, odrv_ctx.axes[0], logger))
+            finally:
+                termination_token.set()
+            logger.debug("{}: {}".format(transport, ", ".join(
+                "{} {:.3f}".format(key, value) for key, value in result.items())))
+            results[transport] = result
+
+        import json
+        with self._lock:
+            self._results[odrv_ctx.name] = results
+            with open(self._results_file, 'w') as f:
+                json.dump(self._results, f, indent=2, sort_keys=True)
@@ -3,10 +3,14 @@ from __future__ import print_function
 import sys
 import time
 import threading
+import collections
+import math
+import struct
 import platform
 import subprocess
 import os
 from fibre.utils import Event
+import fibre.remote_object
 
 try:
     if platform.system() == 'Windows':
@@ -26,10 +30,271 @@ num_samples = 1000
 class OperationAbortedException(Exception):
     pass
 
-def start_liveplotter(get_var_callback):
+class DecimatingRingBuffer():
+    """
+    Keeps the last capacity samples of a fixed number of channels with their
+    timestamps. Each stored sample is the mean of factor input samples, so
+    that plotting a long window of a high rate signal stays cheap.
+    push() and snapshot() may be called from different threads.
+    """
+    def __init__(self, capacity, n_channels, factor=1):
+        self._times = collections.deque(maxlen=capacity)
+        self._values = [collections.deque(maxlen=capacity) for _ in range(n_channels)]
+        self._factor = max(1, int(factor))
+        self._sums = [0.0] * n_channels
+        self._count = 0
+        self._lock = threading.Lock()
+
+    def push(self, t, values):
+        with self._lock:
+            for i, value in enumerate(values):
+                self._sums[i] += value
+            self._count += 1
+            if self._count < self._factor:
+                return
+            self._times.append(t)
+            for i, channel in enumerate(self._values):
+                channel.append(self._sums[i] / self._count)
+                self._sums[i] = 0.0
+            self._count = 0
+
+    def snapshot(self):
+        """
+        Returns (times, values) with one list of samples per channel, oldest first
+        """
+        with self._lock:
+            return list(self._times), [list(channel) for channel in self._values]
+
+def fit_clock(points):
+    """
+    Fits a line through (device [us], host [s]) points, see DeviceClock.
+    Returns (device_ref, host_ref, slope): host = host_ref + (device - device_ref) * slope
+    """
+    # Relative to the newest point, so that the large device times keep their resolution
+    device_ref, host_ref = points[-1]
+    xs = [device_us - device_ref for (device_us, _) in points]
+    ys = [host - host_ref for (_, host) in points]
+    x_mean = sum(xs) / len(xs)
+    y_mean = sum(ys) / len(ys)
+    # Below 100 ms of history, the drift is lost in the jitter
+    if max(xs) - min(xs) < 1e5:
+        slope = 1e-6
+    else:
+        slope = (sum((x - x_mean) * (y - y_mean) for x, y in zip(xs, ys))
+                 / sum((x - x_mean)**2 for x in xs))
+    return (device_ref, host_ref + y_mean - slope * x_mean, slope)
+
+class DeviceClock():
+    """
+    Maps the time base of an ODrive (odrv.get_time_us(), microseconds since
+    startup) to the host time.monotonic(), so that device timestamps of
+    several ODrives can be put on one time axis.
+    sync() calls get_time_us() a few times and keeps the call with the
+    shortest round trip: the device read its clock within it, so the
+    midpoint is off by at most half the round trip, without the USB jitter
+    of the slower calls. The offset and the drift between the crystals of
+    host and device are fitted to the last max_points syncs. Call sync()
+    every few seconds, or start() to do it in the background.
+    """
+    def __init__(self, odrv, exchanges=8, max_points=16):
+        self._get_time_us = odrv.get_time_us
+        self._exchanges = exchanges
+        self._points = collections.deque(maxlen=max_points) # (device [us], host [s])
+        self._fit = None # (device [us], host [s], host seconds per device microsecond)
+        self._lock = threading.Lock()
+        self.round_trip = None # [s] of the best exchange of the last sync
+        self.last_sync = None # (device [us], host [s]) of the best exchange of the last sync
+
+    def sync(self):
+        """
+        Adds one measurement of the offset and returns its round trip [s]
+        """
+        best = None
+        for _ in range(self._exchanges):
+            t0 = time.monotonic()
+            device_us = self._get_time_us()
+            t1 = time.monotonic()
+            if best is None or t1 - t0 < best[0]:
+                best = (t1 - t0, device_us, 0.5 * (t0 + t1))
+        with self._lock:
+            self._points.append((best[1], best[2]))
+            self._fit = fit_clock(self._points)
+        self.round_trip = best[0]
+        self.last_sync = (best[1], best[2])
+        return best[0]
+
+    def to_host(self, device_us):
+        """
+        Converts a device timestamp [us] to time.monotonic() [s]
+        """
+        with self._lock:
+            if self._fit is None:
+                raise Exception("the clock is not synchronized, call sync() first")
+            device_ref, host_ref, slope = self._fit
+        return host_ref + (device_us - device_ref) * slope
+
+    def to_device(self, host_time):
+        """
+        Converts time.monotonic() [s] to a device timestamp [us]
+        """
+        with self._lock:
+            if self._fit is None:
+                raise Exception("the clock is not synchronized, call sync() first")
+            device_ref, host_ref, slope = self._fit
+        return device_ref + int(round((host_time - host_ref) / slope))
+
+    @property
+    def drift(self):
+        """
+        How much faster the device clock runs than the host clock [ppm]
+        """
+        with self._lock:
+            return (1e-6 / self._fit[2] - 1.0) * 1e6 if self._fit else 0.0
+
+    def start(self, cancellation_token, interval=1.0):
+        """
+        Syncs now and then every interval seconds until cancellation_token is set
+        """
+        self.sync()
+        def run():
+            while not cancellation_token.is_set():
+                time.sleep(interval)
+                try:
+                    self.sync()
+                except Exception as ex:
+                    print("clock sync failed: " + str(ex))
+        threading.Thread(target=run, daemon=True).start()
+
+class PollingSource():
+    """
+    Sample source that calls get_var_callback() up to rate times per second.
+    The samples are timestamped on arrival. Prefer SubscriptionSource or
+    OscilloscopeSource for evenly spaced samples.
+    """
+    def __init__(self, get_var_callback, rate=data_rate, names=None):
+        self._get_var_callback = get_var_callback
+        self.sample_rate = rate
+        self.names = names
+        self.lost_samples = 0
+
+    def start(self, callback, cancellation_token):
+        def fetch_data():
+            while not cancellation_token.is_set():
+                try:
+                    values = self._get_var_callback()
+                except Exception as ex:
+                    print(str(ex))
+                    time.sleep(1)
+                    continue
+                callback(time.monotonic(), values)
+                time.sleep(1/self.sample_rate)
+        threading.Thread(target=fetch_data, daemon=True).start()
+
+class SubscriptionSource():
+    """
+    Sample source that makes the device push up to 8 properties every
+    interval_ms milliseconds (see subscribe()). The timestamps are the
+    frame counter times the interval, so they are evenly spaced. Frames
+    that the device skipped because it was busy are not counted.
+    """
+    def __init__(self, properties, interval_ms=1):
+        self._properties = properties
+        self._interval_ms = interval_ms
+        self.sample_rate = 1000.0 / interval_ms
+        self.names = [prop._name for prop in properties]
+        self.lost_samples = 0
+
+    def start(self, callback, cancellation_token):
+        state = {'last': None, 'frames': 0}
+        def on_frame(frame_no, values):
+            if state['last'] is not None:
+                step = (frame_no - state['last']) & 0x7fff
+                self.lost_samples += step - 1
+                state['frames'] += step
+            state['last'] = frame_no
+            callback(state['frames'] * self._interval_ms * 0.001, values)
+        subscribe(self._properties, self._interval_ms, on_frame)
+        cancellation_token.subscribe(lambda: subscribe(self._properties, 0, None))
+
+class OscilloscopeSource():
+    """
+    Sample source that streams up to 4 numeric properties from the
+    on-device oscilloscope at the current loop rate divided by decimation.
+    The rows are sampled by the current measurement interrupt and timestamped
+    by their index, so they are evenly spaced. With a synchronized
+    DeviceClock of odrv, the timestamps are the device times of the rows in
+    time.monotonic(), which line up with the rows of other ODrives.
+    The host reads the new rows every poll_interval seconds. Rows that were
+    overwritten before they were read are counted in lost_samples; increase
+    decimation or use fewer channels if that happens.
+    """
+    def __init__(self, odrv, channels, decimation=1, poll_interval=0.02, clock=None):
+        if not 1 <= len(channels) <= 4:
+            raise Exception("1 to 4 channels are supported")
+        self._scope = odrv.oscilloscope
+        self._channels = channels
+        self._decimation = decimation
+        self._poll_interval = poll_interval
+        self._clock = clock
+        self.sample_rate = None # known after start()
+        self.first_row_time_us = None # device time of row 0, known with the first sample
+        self.names = [channel._name for channel in channels]
+        self.lost_samples = 0
+
+    def start(self, callback, cancellation_token):
+        scope = self._scope
+        for i in range(4):
+            scope.config._remote_attributes['channel{}'.format(i)].set_value(self._channels[i] if i < len(self._channels) else None)
+        scope.config.decimation = self._decimation
+        if not scope.start_streaming():
+            raise Exception("invalid oscilloscope configuration")
+        n_channels = scope.n_channels
+        n_rows = scope.n_samples
+        dt = scope.sample_period
+        self.sample_rate = 1.0 / dt
+        cancellation_token.subscribe(lambda: scope.stop())
+
+        def get_write_count(read_count):
+            # write_count wraps at 32 bits, read_count doesn't
+            return read_count + ((scope.write_count - read_count) & 0xffffffff)
+
+        def get_time(row_count):
+            return self._clock.to_host(self.first_row_time_us + row_count * dt * 1e6) if self._clock else row_count * dt
+
+        def fetch_data():
+            read_count = 0 # rows handed to the callback so far
+            while not cancellation_token.is_set():
+                time.sleep(self._poll_interval)
+                write_count = get_write_count(read_count)
+                if write_count > 0 and self.first_row_time_us is None:
+                    self.first_row_time_us = scope.first_row_time_us
+                if write_count - read_count > n_rows:
+                    self.lost_samples += write_count - n_rows - read_count
+                    read_count = write_count - n_rows
+                n_new = write_count - read_count
+                if n_new == 0:
+                    continue
+                # The new rows are in up to two contiguous parts of the ring buffer
+                begin = read_count % n_rows
+                end = begin + n_new
+                data = list(scope.buffer.read(begin * n_channels, (min(end, n_rows) - begin) * n_channels))
+                if end > n_rows:
+                    data += list(scope.buffer.read(0, (end - n_rows) * n_channels))
+                # Rows that the device overwrote during the read are dropped
+                n_overwritten = min(n_new, max(0, get_write_count(read_count) - n_rows - read_count))
+                self.lost_samples += n_overwritten
+                for i in range(n_overwritten, n_new):
+                    callback(get_time(read_count + i), data[i * n_channels:(i + 1) * n_channels])
+                read_count = write_count
+        threading.Thread(target=fetch_data, daemon=True).start()
+
+def start_liveplotter(get_var_callback=None, source=None, window=None, max_points=num_samples):
     """
     Starts a liveplotter.
-    The variable that is plotted is retrieved from get_var_callback.
+    The samples come from source (a PollingSource, SubscriptionSource or
+    OscilloscopeSource), or from polling get_var_callback if no source is
+    given. The plot shows the last window seconds (default: num_samples
+    samples) and averages the samples down to max_points per channel.
     This function returns immediately and the liveplotter quits when
     the user closes it.
     """
@@ -37,28 +302,21 @@ def start_liveplotter(get_var_callback):
     import matplotlib.pyplot as plt
 
     cancellation_token = Event()
+    if source is None:
+        source = PollingSource(get_var_callback)
+    buffer = [None]
 
-    global vals
-    vals = []
-    def fetch_data():
-        global vals
-        while not cancellation_token.is_set():
-            try:
-                data = get_var_callback()
-            except Exception as ex:
-                print(str(ex))
-                time.sleep(1)
-                continue
-            vals.append(data)
-            if len(vals) > num_samples:
-                vals = vals[-num_samples:]
-            time.sleep(1/data_rate)
+    def on_sample(t, values):
+        if buffer[0] is None:
+            rate = source.sample_rate
+            span = window * rate if window else num_samples
+            buffer[0] = DecimatingRingBuffer(max_points, len(values), math.ceil(span / max_points))
+        buffer[0].push(t, values)
+    source.start(on_sample, cancellation_token)
 
     # TODO: use animation for better UI performance, see:
     # https://matplotlib.org/examples/animation/simple_anim.html
     def plot_data():
-        global vals
-
         plt.ion()
 
         # Make sure the script terminates when the user closes the plotter
@@ -69,18 +327,22 @@ def start_liveplotter(get_var_callback):
 
         while not cancellation_token.is_set():
             plt.clf()
-            plt.plot(vals)
+            if buffer[0] is not None:
+                times, values = buffer[0].snapshot()
+                if times:
+                    times = [t - times[-1] for t in times]
+                    for i, channel in enumerate(values):
+                        label = source.names[i] if source.names and i < len(source.names) else None
+                        plt.plot(times, channel, label=label)
+                    if source.names:
+                        plt.legend(loc='upper left')
+                    plt.xlabel('time [s]')
             fig.canvas.draw()
             fig.canvas.start_event_loop(1/plot_rate)
 
-    fetch_t = threading.Thread(target=fetch_data)
-    fetch_t.daemon = True
-    fetch_t.start()
-    
     plot_t = threading.Thread(target=plot_data)
     plot_t.daemon = True
     plot_t.start()
-    
 
     return cancellation_token;
     #plot_data()
@@ -101,16 +363,431 @@ def print_drv_regs(name, motor):
     print("Control Reg 1: " + str(ctrl_reg_1) + " (" + format(ctrl_reg_1, '#013b') + ")")
     print("Control Reg 2: " + str(ctrl_reg_2) + " (" + format(ctrl_reg_2, '#09b') + ")")
 
-def show_oscilloscope(odrv):
-    size = 18000
-    values = []
-    for i in range(size):
-        values.append(odrv.get_oscilloscope_val(i))
+def capture_oscilloscope(odrv, channels, trigger_mode=0, trigger_channel=0, trigger_level=0.0,
+                         pretrigger_samples=0, decimation=1, timeout=10.0, clock=None):
+    """
+    Records up to 4 numeric properties with the on-device oscilloscope
+    (odrv.oscilloscope) at the current loop rate divided by decimation.
+    The channels are given as remote attributes, for example
+    odrv0.axis0.motor.current_control._remote_attributes['Iq_measured'].
+    trigger_mode: 0 = immediate, 1 = rising edge, 2 = falling edge through
+    trigger_level on channel trigger_channel, 3 = axis or motor error.
+    Returns (times, values), where times are in seconds relative to the
+    trigger and values holds one list of samples per channel. With a
+    synchronized DeviceClock of odrv, times are in time.monotonic() instead.
+    """
+    scope = odrv.oscilloscope
+    if not 1 <= len(channels) <= 4:
+        raise Exception("1 to 4 channels are supported")
+    for i in range(4):
+        scope.config._remote_attributes['channel{}'.format(i)].set_value(channels[i] if i < len(channels) else None)
+    scope.config.decimation = decimation
+    scope.config.trigger_mode = trigger_mode
+    scope.config.trigger_channel = trigger_channel
+    scope.config.trigger_level = trigger_level
+    scope.config.pretrigger_samples = pretrigger_samples
+    if not scope.start():
+        raise Exception("invalid oscilloscope configuration")
+
+    deadline = time.time() + timeout
+    while scope.state != 4: # STATE_DONE
+        if time.time() > deadline:
+            scope.stop()
+            raise Exception("the oscilloscope did not trigger")
+        time.sleep(0.05)
+
+    n_channels = scope.n_channels
+    n_samples = scope.n_samples
+    start_row = scope.start_row
+    trigger_offset = (scope.trigger_row - start_row) % n_samples
+    dt = scope.sample_period
+    samples = scope.buffer.read(0, n_channels * n_samples)
+    rows = [(start_row + i) % n_samples for i in range(n_samples)] # oldest first
+    t0 = clock.to_host(scope.trigger_time_us) if clock else 0.0
+    times = [t0 + (i - trigger_offset) * dt for i in range(n_samples)]
+    values = [[samples[row * n_channels + c] for row in rows] for c in range(n_channels)]
+    return times, values
+
+def show_oscilloscope(odrv, channels=None, **kwargs):
+    """
+    Captures the given channels (default: vbus_voltage) with
+    capture_oscilloscope() and plots them.
+    """
+    if channels is None:
+        channels = [odrv._remote_attributes['vbus_voltage']]
+    times, values = capture_oscilloscope(odrv, channels, **kwargs)
 
     import matplotlib.pyplot as plt
-    plt.plot(values)
+    for channel, samples in zip(channels, values):
+        plt.plot(times, samples, label=channel._name)
+    plt.xlabel('time relative to the trigger [s]')
+    plt.legend()
     plt.show()
 
+def measure_frequency_response(axis, timeout=120.0):
+    """
+    Runs AXIS_STATE_FREQUENCY_RESPONSE with the current
+    axis.frequency_response.config and waits for it to finish.
+    Returns (frequencies, plant, loop_gain): the frequencies [Hz], the
+    complex response from the current command [A] to the velocity estimate
+    [counts/s], and the complex loop gain of the velocity loop. The loop
+    gain is only available with current injection, else it is None.
+    """
+    freq_response = axis.frequency_response
+    num_points = freq_response.config.num_points
+    inject_current = freq_response.config.injection == 0 # INJECT_CURRENT
+    axis.requested_state = 11 # AXIS_STATE_FREQUENCY_RESPONSE
+    time.sleep(0.1)
+    deadline = time.time() + timeout
+    while axis.current_state == 11:
+        if time.time() > deadline:
+            axis.requested_state = 1 # AXIS_STATE_IDLE
+            raise Exception("the frequency response measurement timed out")
+        time.sleep(0.1)
+    if axis.error != 0 or freq_response.num_points_done < num_points:
+        raise Exception("the frequency response measurement failed, axis error 0x{:x}".format(axis.error))
+
+    results = freq_response.results.read(0, 5 * num_points)
+    frequencies = [results[5 * i] for i in range(num_points)]
+    command = [complex(results[5 * i + 1], results[5 * i + 2]) for i in range(num_points)]
+    output = [complex(results[5 * i + 3], results[5 * i + 4]) for i in range(num_points)]
+    plant = [y / u for y, u in zip(output, command)]
+    loop_gain = [1 / u - 1 for u in command] if inject_current else None
+    return frequencies, plant, loop_gain
+
+def show_frequency_response(axis, **kwargs):
+    """
+    Measures the frequency response with measure_frequency_response()
+    and shows the Bode plot of the plant and of the loop gain.
+    """
+    frequencies, plant, loop_gain = measure_frequency_response(axis, **kwargs)
+
+    import matplotlib.pyplot as plt
+    fig, (ax_mag, ax_phase) = plt.subplots(2, 1, sharex=True)
+    for label, response in (('plant', plant), ('loop gain', loop_gain)):
+        if response is None:
+            continue
+        ax_mag.loglog(frequencies, [abs(h) for h in response], label=label)
+        ax_phase.semilogx(frequencies, [math.degrees(math.atan2(h.imag, h.real)) for h in response], label=label)
+    ax_mag.set_ylabel('magnitude')
+    ax_phase.set_ylabel('phase [deg]')
+    ax_phase.set_xlabel('frequency [Hz]')
+    ax_mag.legend()
+    plt.show()
+
+def dump_cycle_log(odrv):
+    """
+    Downloads the control cycle log (odrv.cycle_log), oldest record first.
+    The log freezes on the first axis or motor error. Call
+    odrv.cycle_log.rearm() to resume logging afterwards.
+    Returns a list of dicts, one per current measurement.
+    """
+    import struct
+    num_records = 128
+    record_format = '<IHHHBBfff' # must match CycleLog::Record_t
+    words_per_record = struct.calcsize(record_format) // 4
+    activities = ['usb', 'uart', 'nvm_write', 'usb_cdc']
+
+    # oldest record first
+    raw = odrv.cycle_log.records.read_bytes()
+    pos = odrv.cycle_log.pos * words_per_record * 4
+    raw = raw[pos:] + raw[:pos]
+    cpu_hz = odrv.profiler.cpu_hz
+
+    records = []
+    for i in range(num_records):
+        (timestamp, adc_cb_cycles, foc_cycles, encoder_cycles, axis, flags,
+            Iq_setpoint, Iq_measured, vbus_voltage) = struct.unpack_from(record_format, raw, i * words_per_record * 4)
+        if timestamp == 0:
+            continue # never written
+        records.append({
+            'timestamp': timestamp,
+            'time_us': timestamp * 1e6 / cpu_hz,
+            'axis': axis,
+            'adc_cb_cycles': adc_cb_cycles,
+            'foc_cycles': foc_cycles,
+            'encoder_cycles': encoder_cycles,
+            'error': bool(flags & 0x80),
+            'active': [name for bit, name in enumerate(activities) if flags & (1 << bit)],
+            'Iq_setpoint': Iq_setpoint,
+            'Iq_measured': Iq_measured,
+            'vbus_voltage': vbus_voltage,
+        })
+    return records
+
+def record_inputs(odrv, filename=None, axes=None, timeout=1.0):
+    """
+    Records the raw inputs of the control loop (odrv.input_recorder) until
+    the buffer is full, which takes a few ms. The oscilloscope buffer is
+    used for it, so the oscilloscope must not be capturing.
+    axes: list of the axis numbers to record, all by default.
+    If filename is given, the raw buffer is written to it, for a replay in
+    the simulation: run_sim replay <filename> <output.csv>, see
+    Firmware/MotorControl/test/sim/run_sim.cpp.
+    Returns a dict with the header fields, the records (one dict per axis
+    and current measurement) and the setpoint commands.
+    """
+    import struct
+    header_format = '<IIfBBH'       # must match InputRecorder::Header_t
+    record_format = '<HHHHfHBB'     # must match InputRecorder::Record_t
+    setpoint_format = '<IB3xfff'    # must match InputRecorder::SetpointEvent_t
+    fields = ['current', 'dc_cal', 'vbus', 'hall', 'encoder']
+
+    recorder = odrv.input_recorder
+    if axes is not None:
+        recorder.config.axes = sum(1 << axis for axis in axes)
+    if not recorder.start():
+        raise Exception("the oscilloscope is capturing")
+    deadline = time.time() + timeout
+    while recorder.state == 1: # STATE_RECORDING
+        if time.time() > deadline:
+            recorder.stop()
+            break
+        time.sleep(0.01)
+
+    raw = recorder.buffer.read_bytes()
+    if filename:
+        with open(filename, 'wb') as f:
+            f.write(raw)
+
+    (num_records, num_setpoints, current_meas_hz, axes_mask, current_oversampling, _) = \
+        struct.unpack_from(header_format, raw, 0)
+    offset = struct.calcsize(header_format)
+    record_size = struct.calcsize(record_format)
+    records = []
+    for i in range(num_records):
+        (adc_phB, adc_phC, adc_dc_phB, adc_dc_phC, vbus_sample, encoder_count,
+            hall_state, axis_fields) = struct.unpack_from(record_format, raw, offset + i * record_size)
+        records.append({
+            'axis': axis_fields & 0x03,
+            'fields': [name for bit, name in enumerate(fields) if axis_fields & (0x04 << bit)],
+            'adc_phB': adc_phB, 'adc_phC': adc_phC,
+            'adc_dc_phB': adc_dc_phB, 'adc_dc_phC': adc_dc_phC,
+            'vbus_sample': vbus_sample,
+            'encoder_count': encoder_count,
+            'hall_state': hall_state,
+        })
+    setpoint_size = struct.calcsize(setpoint_format)
+    setpoints = []
+    for i in range(num_setpoints):
+        (record, control_mode, pos_setpoint, vel_setpoint, current_setpoint) = \
+            struct.unpack_from(setpoint_format, raw, len(raw) - (i + 1) * setpoint_size)
+        setpoints.append({
+            'record': record, 'control_mode': control_mode, 'pos_setpoint': pos_setpoint,
+            'vel_setpoint': vel_setpoint, 'current_setpoint': current_setpoint,
+        })
+    return {
+        'current_meas_hz': current_meas_hz,
+        'axes': [i for i in range(8) if axes_mask & (1 << i)],
+        'current_oversampling': current_oversampling,
+        'records': records,
+        'setpoints': setpoints,
+    }
+
+def run_benchmark(odrv, iterations=10000):
+    """
+    Runs the control loop kernel benchmark on the ODrive (odrv.benchmark).
+    axis0 must be idle. Returns a dict with the min, mean and max execution
+    time of each kernel in microseconds, or None if the benchmark didn't run.
+    The approximations of trigonometric functions also report their
+    max_error against libm.
+    """
+    kernels = ['svm', 'fast_atan2', 'fast_atan2_octant', 'sin_cos', 'fast_sincos',
+               'encoder_update', 'sensorless_update', 'foc_current', 'trap_traj_eval']
+    if not odrv.benchmark.run(iterations):
+        return None
+    us_per_cycle = 1e6 / odrv.benchmark.clock_hz
+    results = {}
+    for name in kernels:
+        result = getattr(odrv.benchmark, name)
+        results[name] = {
+            'min_us': result.min * us_per_cycle,
+            'mean_us': result.mean * us_per_cycle,
+            'max_us': result.max * us_per_cycle,
+            'max_error': result.max_error,
+        }
+    return results
+
+def get_link_stats(odrv, interval=1.0):
+    """
+    Samples the transport counters in odrv.system_stats twice, interval
+    seconds apart. Returns a dict per link ('usb', 'uart', 'i2c') with the
+    counters of the second sample, the rates over the interval
+    ('rx_bytes_per_s', 'tx_bytes_per_s', 'rx_packets_per_s',
+    'tx_packets_per_s') and the mean and max request latency in
+    microseconds. Note that the requests of this function itself show up in
+    the link it uses. Call odrv.system_stats.reset_link_stats() to clear the
+    counters.
+    """
+    links = ['usb', 'uart', 'i2c']
+    counters = ['rx_cnt', 'rx_bytes', 'tx_cnt', 'tx_bytes', 'tx_wait_cnt', 'tx_overrun_cnt',
+                'error_cnt', 'rx_crc_error_cnt', 'rx_dropped_cnt', 'rx_queue_max_fill', 'tx_queue_max_fill']
+    def sample():
+        return {link: {name: getattr(getattr(odrv.system_stats, link), name) for name in counters}
+                for link in links}
+    first = sample()
+    start = time.monotonic()
+    time.sleep(interval)
+    second = sample()
+    elapsed = time.monotonic() - start
+    us_per_cycle = 1e6 / odrv.profiler.cpu_hz
+
+    results = {}
+    for link in links:
+        result = dict(second[link])
+        for direction in ['rx', 'tx']:
+            result[direction + '_bytes_per_s'] = ((second[link][direction + '_bytes'] - first[link][direction + '_bytes']) & 0xffffffff) / elapsed
+            result[direction + '_packets_per_s'] = ((second[link][direction + '_cnt'] - first[link][direction + '_cnt']) & 0xffffffff) / elapsed
+        latency = getattr(odrv.system_stats, link).request_latency
+        result['latency_mean_us'] = latency.mean * us_per_cycle
+        result['latency_max_us'] = latency.max * us_per_cycle
+        results[link] = result
+    return results
+
+def show_link_stats(odrv, interval=1.0):
+    """
+    Prints the throughput, errors, queue high-water marks and request
+    latency of each link, see get_link_stats().
+    """
+    for link, stats in get_link_stats(odrv, interval).items():
+        print("{}: rx {:.0f} B/s {:.0f} pkt/s, tx {:.0f} B/s {:.0f} pkt/s, latency {:.0f} us mean {:.0f} us max".format(
+            link, stats['rx_bytes_per_s'], stats['rx_packets_per_s'], stats['tx_bytes_per_s'], stats['tx_packets_per_s'],
+            stats['latency_mean_us'], stats['latency_max_us']))
+        print("    waits {tx_wait_cnt}, overruns {tx_overrun_cnt}, errors {error_cnt}, CRC errors {rx_crc_error_cnt}, "
+              "dropped {rx_dropped_cnt}, max queue rx {rx_queue_max_fill} tx {tx_queue_max_fill}".format(**stats))
+
+def subscribe(properties, interval_ms, callback, on_change=False):
+    """
+    Makes the ODrive push the values of up to 8 properties every interval_ms
+    milliseconds, without a request per value. With on_change=True, they are
+    also pushed within about 1 ms whenever one of them changes, for example
+    axis.error or axis.current_state, and interval_ms (at most 32767) is only
+    the longest time between frames. The properties must belong to
+    the same device and fit into 28 bytes (e.g. 7 floats). They are given as
+    remote attributes, for example
+    odrv0.axis0.encoder._remote_attributes['pos_estimate'].
+    callback(frame_no, values) is called with a 15 bit frame counter, which
+    shows lost frames, and the list of values.
+    Pass an empty list or interval_ms=0 to stop.
+    """
+    if not properties:
+        return
+    channel = properties[0].__channel__
+    if not interval_ms:
+        channel.subscribe([], 0, None)
+        return
+    codec = fibre.remote_object.RecordCodec(properties, [prop._name for prop in properties])
+
+    def on_frame(frame_no, payload):
+        callback(frame_no, list(codec.deserialize(payload[:codec.get_length()])))
+
+    length = channel.subscribe([prop._id for prop in properties], interval_ms, on_frame, on_change)
+    if length != codec.get_length():
+        channel.subscribe([], 0, None)
+        raise Exception("the device rejected the subscription")
+
+def subscribe_events(odrv, callback, heartbeat_ms=1000):
+    """
+    Makes the ODrive push axis.error, axis.motor.error and axis.current_state
+    of both axes as soon as one of them changes, instead of polling them.
+    callback(frame_no, axes) is called with a list with a dict of these
+    values for each axis, also every heartbeat_ms if nothing changes, which
+    shows that the connection is alive. Pass callback=None to stop.
+    This replaces any other subscription on the channel.
+    """
+    axes = [odrv.axis0, odrv.axis1]
+    properties = [prop for axis in axes for prop in (axis._remote_attributes['error'],
+                  axis.motor._remote_attributes['error'], axis._remote_attributes['current_state'])]
+    if callback is None:
+        subscribe(properties, 0, None)
+        return
+    def on_frame(frame_no, values):
+        callback(frame_no, [dict(zip(['error', 'motor_error', 'current_state'], values[3 * i:3 * i + 3]))
+                            for i in range(len(axes))])
+    subscribe(properties, heartbeat_ms, on_frame, on_change=True)
+
+# Layout of the telemetry frames after the 4 byte header, see USBTelemetryFrame
+# in interface_usb.cpp: meas_count, vbus_voltage and for each axis
+# pos_estimate, vel_estimate, Iq_setpoint, Iq_measured, error, motor_error,
+# encoder_error, current_state and a reserved byte
+USB_TELEMETRY_FORMAT = '<If' + 2 * '4f3HBx'
+USB_TELEMETRY_AXIS_FIELDS = ['pos_estimate', 'vel_estimate', 'Iq_setpoint', 'Iq_measured',
+                             'error', 'motor_error', 'encoder_error', 'current_state']
+
+def usb_telemetry(odrv, callback):
+    """
+    Makes an ODrive on native USB push the status of both axes at the start
+    of every 1 ms USB frame. This bypasses the request handling on the device
+    and arrives at most one frame after it was sampled, for host control
+    loops that need a bounded latency.
+    callback(frame_no, telemetry) is called with a 15 bit frame counter and a
+    dict with 'meas_count', 'vbus_voltage' and 'axes', a list with a dict of
+    the values of each axis. Pass callback=None to stop.
+    """
+    channel = odrv.__channel__
+    if callback is None:
+        odrv.usb_telemetry.enabled = False
+        channel.telemetry_callback = None
+        return
+    length = struct.calcsize(USB_TELEMETRY_FORMAT)
+    n_axis_fields = len(USB_TELEMETRY_AXIS_FIELDS)
+    def on_frame(frame_no, payload):
+        if len(payload) < length:
+            return
+        values = struct.unpack_from(USB_TELEMETRY_FORMAT, payload)
+        axes = [dict(zip(USB_TELEMETRY_AXIS_FIELDS, values[2 + i * n_axis_fields:2 + (i + 1) * n_axis_fields]))
+                for i in range(2)]
+        callback(frame_no, {'meas_count': values[0], 'vbus_voltage': values[1], 'axes': axes})
+    channel.telemetry_callback = on_frame
+    odrv.usb_telemetry.enabled = True
+
+AXIS_SNAPSHOT_FIELDS = ['meas_count', 'pos_estimate', 'vel_estimate', 'pos_setpoint', 'vel_setpoint',
+                        'Iq_setpoint', 'Iq_measured', 'Id_measured', 'vbus_voltage',
+                        'error', 'motor_error', 'encoder_error', 'current_state']
+
+def read_snapshot(axis):
+    """
+    Reads the state of the axis at the end of its last control loop
+    iteration, in one batch. Unlike reading encoder.pos_estimate,
+    encoder.vel_estimate and motor.current_control.Iq_measured one by one,
+    all values are from the same iteration.
+    Returns a dict with the values of AXIS_SNAPSHOT_FIELDS.
+    """
+    with axis.batch():
+        axis.take_snapshot()
+        pending = {name: getattr(axis.snapshot, name) for name in AXIS_SNAPSHOT_FIELDS}
+    return {name: value.value for name, value in pending.items()}
+
+def get_anticogging_map(axis):
+    """
+    Downloads the anti-cogging map of the axis in one bulk read.
+    Returns the list of anti-cogging currents [A], one per encoder count or
+    one per bin for a binned map (see controller.config.anticogging_bins),
+    or an empty list if no map is allocated.
+    """
+    anticogging = axis.controller.anticogging
+    binned_map = anticogging.binned_map.read()
+    if len(binned_map):
+        return [value * 0.001 for value in binned_map] # kAnticoggingBinScale
+    return list(anticogging.cogging_map.read())
+
+def get_encoder_correction_table(encoder):
+    """
+    Reads the nonlinearity correction table of an encoder (e.g. odrv0.axis0.encoder).
+    Entry n is the correction in counts at n/len(table) of a turn.
+    """
+    table_size = 128 # must match Encoder::kCorrectionTableSize
+    return [encoder.get_correction(i) for i in range(table_size)]
+
+def set_encoder_correction_table(encoder, table):
+    """
+    Writes a nonlinearity correction table, for example a smoothed version of
+    the one returned by get_encoder_correction_table. Call save_configuration()
+    on the ODrive afterwards to make it persistent.
+    """
+    for i, value in enumerate(table):
+        encoder.set_correction(i, value)
+
 def rate_test(device):
     """
     Tests how many integers per second can be transmitted
@@ -133,26 +810,19 @@ def rate_test(device):
     # plt.plot(vals)
     # plt.show(block=True)
 
-def usb_burn_in_test(get_var_callback, cancellation_token):
+def usb_burn_in_test(get_var_callback, cancellation_token, source=None):
     """
-    Starts background threads that read a values form the USB device in a spin-loop
+    Starts background threads that read a values form the USB device in a spin-loop,
+    or from source (see start_liveplotter()) as fast as it delivers them
     """
-
-    def fetch_data():
-        global vals
-        i = 0
-        while not cancellation_token.is_set():
-            try:
-                get_var_callback()
-                i += 1
-            except Exception as ex:
-                print(str(ex))
-                time.sleep(1)
-                i = 0
-                continue
-            if i % 1000 == 0:
-                print("read {} values".format(i))
-    threading.Thread(target=fetch_data, daemon=True).start()
+    if source is None:
+        source = PollingSource(get_var_callback, rate=float('inf'))
+    count = [0]
+    def on_sample(t, values):
+        count[0] += 1
+        if count[0] % 1000 == 0:
+            print("read {} values, {} lost".format(count[0], source.lost_samples))
+    source.start(on_sample, cancellation_token)
 
 def setup_udev_rules(logger):
     if platform.system() != 'Linux':
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Decodes the firmware event trace (Firmware/MotorControl/trace.hpp).
+
+Usage:
+  odrive_trace.py                 poll the trace of a connected ODrive over USB/UART
+  odrive_trace.py FILE [CPU_HZ]   decode a raw SWO capture, e.g. from
+                                  "openocd ... -c 'tpiu config internal FILE uart off CPU_HZ'"
+
+In live mode, records are read through odrv.trace.records. If the poll
+interval is too long for the event rate, the number of lost records is shown.
+In SWO mode, the records are taken from ITM stimulus port 1.
+"""
+
+import struct
+import sys
+import time
+
+try:
+    from odrive.enums import *
+except Exception:
+    pass
+
+ITM_PORT = 1
+RECORD_FORMAT = '<IBBHI' # timestamp, event, source, arg, value
+RECORD_SIZE = struct.calcsize(RECORD_FORMAT)
+NUM_RECORDS = 256
+NO_AXIS = 0xff
+DEFAULT_CPU_HZ = 168000000
+
+EVENT_NAMES = ['none', 'axis_state', 'axis_error', 'motor_error', 'encoder_error', 'profiler_max', 'user']
+PROFILER_SECTIONS = ['adc_cb', 'encoder_update', 'sensorless_update', 'controller_update', 'foc_current', 'svm', 'thread_wakeup']
+
+def enum_name(prefix, value):
+    for name, val in globals().items():
+        if name.startswith(prefix) and val == value:
+            return name[len(prefix):].lower()
+    return str(value)
+
+def format_record(record, cpu_hz):
+    timestamp, event, source, arg, value = record
+    event_name = EVENT_NAMES[event] if event < len(EVENT_NAMES) else str(event)
+    source_name = '-' if source == NO_AXIS else 'axis{}'.format(source)
+    if event_name == 'axis_state':
+        detail = '{} (error 0x{:x})'.format(enum_name('AXIS_STATE_', arg), value)
+    elif event_name.endswith('_error'):
+        detail = '0x{:x}'.format(value)
+    elif event_name == 'profiler_max':
+        section = PROFILER_SECTIONS[arg] if arg < len(PROFILER_SECTIONS) else str(arg)
+        detail = '{} {:.2f}us'.format(section, value * 1e6 / cpu_hz)
+    else:
+        detail = 'arg {} value 0x{:x}'.format(arg, value)
+    # The DWT timestamp wraps after 2^32 cycles (about 25s at 168MHz)
+    return '{:12.6f} {:6} {:14} {}'.format(timestamp / cpu_hz, source_name, event_name, detail)
+
+def parse_itm(data, port=ITM_PORT):
+    """
+    Returns the payload of all software source packets on the specified
+    stimulus port. Other packets and synchronization bytes are skipped.
+    """
+    payload = bytearray()
+    i = 0
+    while i < len(data):
+        header = data[i]
+        i += 1
+        if header & 0x3 == 0:
+            # Synchronization, overflow or protocol packet (timestamps etc.)
+            if header & 0x80 and header != 0x80:
+                while i < len(data) and data[i] & 0x80:
+                    i += 1
+                i += 1
+            continue
+        size = [0, 1, 2, 4][header & 0x3]
+        if not (header & 0x4) and (header >> 3) == port:
+            payload += data[i:i + size]
+        i += size
+    return payload
+
+def decode_swo(filename, cpu_hz):
+    with open(filename, 'rb') as f:
+        payload = parse_itm(f.read())
+    for offset in range(0, len(payload) - RECORD_SIZE + 1, RECORD_SIZE):
+        print(format_record(struct.unpack_from(RECORD_FORMAT, payload, offset), cpu_hz))
+
+def poll(odrv, interval=0.1):
+    cpu_hz = odrv.profiler.cpu_hz
+    read_count = odrv.trace.write_count
+    while True:
+        write_count = odrv.trace.write_count
+        data = odrv.trace.records.read_bytes()
+        # Records may be overwritten during the download, so only the ones
+        # that were still there after it are trusted
+        write_count_after = odrv.trace.write_count
+        oldest = write_count_after - NUM_RECORDS
+        if write_count < read_count:
+            read_count = 0 # the trace was reset
+        if read_count < oldest:
+            print('... {} records lost'.format(oldest - read_count))
+            read_count = oldest
+        for count in range(read_count, write_count):
+            offset = (count % NUM_RECORDS) * RECORD_SIZE
+            print(format_record(struct.unpack_from(RECORD_FORMAT, data, offset), cpu_hz))
+        read_count = max(read_count, write_count)
+        time.sleep(interval)
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        decode_swo(sys.argv[1], float(sys.argv[2]) if len(sys.argv) > 2 else DEFAULT_CPU_HZ)
+    else:
+        import odrive
+        print("finding an odrive...")
+        poll(odrive.find_any())
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Checks that USB traffic does not delay the current measurement interrupt.
+
+Usage: priority_stress.py [DURATION_S]
+
+Runs twice for DURATION_S seconds (default 5): once idle and once while a
+second thread keeps bulk-reading the oscilloscope buffer over USB. In both
+runs, the control cycle log (odrv.cycle_log) is downloaded repeatedly and the
+following is reported per axis:
+  - the worst jitter: how much later than one current measurement period T a
+    measurement started after the previous one
+  - the longest current measurement callback
+  - the margin: T minus the longest callback
+With the priorities in Firmware/Board/v3/Inc/priorities.h, the loaded run
+should show the same jitter as the idle run.
+"""
+
+import sys
+import threading
+import time
+
+import odrive
+from odrive.utils import dump_cycle_log
+
+def measure(odrv, duration):
+    cpu_hz = odrv.profiler.cpu_hz
+    period = cpu_hz / odrv.current_meas_hz # [CPU cycles]
+    stats = {}
+    usb_records = 0
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        records = dump_cycle_log(odrv)
+        last = {}
+        for record in records:
+            axis = record['axis']
+            s = stats.setdefault(axis, {'jitter': 0, 'adc_cb': 0, 'n': 0})
+            if axis in last:
+                # the DWT cycle counter wraps at 2^32
+                delta = (record['timestamp'] - last[axis]) % (1 << 32)
+                # a lost record shows up as a multiple of the period
+                if delta < 1.5 * period:
+                    s['jitter'] = max(s['jitter'], delta - period)
+            last[axis] = record['timestamp']
+            s['adc_cb'] = max(s['adc_cb'], record['adc_cb_cycles'])
+            s['n'] += 1
+            usb_records += 'usb' in record['active']
+    return cpu_hz, period, stats, usb_records
+
+def report(name, result):
+    cpu_hz, period, stats, usb_records = result
+    us = lambda cycles: cycles * 1e6 / cpu_hz
+    print('{}: period {:.2f}us, {} records with USB activity'.format(name, us(period), usb_records))
+    for axis in sorted(stats):
+        s = stats[axis]
+        print('  axis{}: {} records, worst jitter {:.2f}us, longest callback {:.2f}us, margin {:.2f}us'.format(
+            axis, s['n'], us(s['jitter']), us(s['adc_cb']), us(period - s['adc_cb'])))
+
+def load_usb(odrv, stop):
+    while not stop.is_set():
+        odrv.oscilloscope.buffer.read_bytes()
+
+if __name__ == '__main__':
+    duration = float(sys.argv[1]) if len(sys.argv) > 1 else 5.0
+    print("finding an odrive...")
+    odrv = odrive.find_any()
+    odrv.cycle_log.rearm()
+
+    report('idle', measure(odrv, duration))
+
+    stop = threading.Event()
+    loader = threading.Thread(target=load_usb, args=(odrv, stop), daemon=True)
+    loader.start()
+    try:
+        report('USB load', measure(odrv, duration))
+    finally:
+        stop.set()
+        loader.join()
@@ -14,7 +14,7 @@ import threading
 import traceback
 import argparse
 from odrive.tests import *
-from odrive.utils import Logger, Event
+from odrive.utils import Logger
 
 
 def for_all_parallel(objects, get_name, callback):
@@ -65,6 +65,12 @@ parser.add_argument("--ignore", metavar='DEVICE', action='store', nargs='+',
 parser.add_argument("--test-rig-yaml", type=argparse.FileType('r'),
                     help="test rig YAML file")
 # parser.set_defaults(test_rig_yaml=script_path + '/test-rig-parallel.yaml')
+parser.add_argument("--benchmark-json", metavar='FILE', action='store',
+                    help="Measure the communication latency and throughput per transport and write the results to FILE")
+parser.add_argument("--max-parallel", metavar='N', type=int, action='store',
+                    help="Run at most N tests at the same time (1 runs all tests sequentially)")
+parser.add_argument("--report-json", metavar='FILE', action='store',
+                    help="Write the status and duration of every test to FILE")
 parser.set_defaults(ignore=[])
 args = parser.parse_args()
 test_rig_yaml = yaml.load(args.test_rig_yaml)
@@ -91,6 +97,9 @@ else:
 all_tests.append(TestAsciiProtocol())
 all_tests.append(TestSensorlessControl())
 
+if args.benchmark_json:
+    all_tests.append(TestCommsBenchmark(os.path.abspath(args.benchmark_json)))
+
 #all_tests.append(TestStepDirInput())
 #all_tests.append(TestPWMInput())
 
@@ -136,96 +145,88 @@ else:
         if len(c) > 1:
             couplings.append(c)
 
-app_shutdown_token = Event()
+def get_conflicting_axes(axis_name):
+    """
+    Returns the names of the axis and all axes mechanically coupled with it
+    """
+    return set([axis_name] + [a.name for c in couplings if (axis_name in [a.name for a in c]) for a in c])
+
+def make_odrv_job(test, odrv_name):
+    odrv_ctx = odrives_by_name[odrv_name]
+    def run():
+        logger.notify('* running {} on {}...'.format(type(test).__name__, odrv_name))
+        try:
+            test.check_preconditions(odrv_ctx,
+                        logger.indent('  {}: '.format(odrv_name)))
+        except:
+            raise PreconditionsNotMet()
+        test.run_test(odrv_ctx,
+                      logger.indent('  {}: '.format(odrv_name)))
+    # The test owns the ODrive and all of its axes
+    resources = None if test._exclusive else set([odrv_name] + [a.name for a in odrv_ctx.axes])
+    return TestJob(test, odrv_name, run, resources)
+
+def make_axis_job(test, axis_name):
+    axis_ctx = axes_by_name[axis_name]
+    def run():
+        logger.notify('* running {} on {}...'.format(type(test).__name__, axis_name))
+        try:
+            test.check_preconditions(axis_ctx,
+                        logger.indent('  {}: '.format(axis_name)))
+        except:
+            raise PreconditionsNotMet()
+        test.run_test(axis_ctx,
+                      logger.indent('  {}: '.format(axis_name)))
+    # The coupled axes must stay disabled during the test
+    return TestJob(test, axis_name, run, get_conflicting_axes(axis_name))
+
+def make_dual_axis_job(test, coupling):
+    coupling_name = "...".join([a.name for a in coupling])
+    coupled_axes = sorted(set(coupling), key=lambda x: x.name)
+    def run():
+        logger.notify('* running {} on {}...'.format(type(test).__name__, coupling_name))
+        try:
+            test.check_preconditions(coupled_axes[0], coupled_axes[1],
+                        logger.indent('  {}: '.format(coupling_name)))
+        except:
+            raise PreconditionsNotMet()
+        test.run_test(coupled_axes[0], coupled_axes[1],
+                      logger.indent('  {}: '.format(coupling_name)))
+    return TestJob(test, coupling_name, run, set(sum([list(get_conflicting_axes(a.name)) for a in coupled_axes], [])))
+
+# Each test is split into one job per ODrive, axis or coupling. Jobs on
+# independent ODrives and axes run concurrently, also across tests.
+scheduler = TestScheduler(logger, max_parallel=args.max_parallel)
+for test in all_tests:
+    if isinstance(test, ODriveTest):
+        for odrv_name in odrives_by_name:
+            scheduler.add(make_odrv_job(test, odrv_name))
+    elif isinstance(test, AxisTest):
+        for axis_name in axes_by_name:
+            scheduler.add(make_axis_job(test, axis_name))
+    elif isinstance(test, DualAxisTest):
+        for coupling in couplings:
+            scheduler.add(make_dual_axis_job(test, coupling))
+    else:
+        logger.warn("ignoring unknown test type {}".format(type(test)))
+
+def write_report():
+    report = scheduler.get_report()
+    for job in report['jobs']:
+        if job['duration'] is not None:
+            logger.debug('{:8.1f}s {} on {}'.format(job['duration'], job['test'], job['target']))
+    if report['duration'] is not None:
+        logger.debug('total {:.1f}s, {:.1f}s if run sequentially'.format(report['duration'], report['sequential_duration']))
+    if args.report_json:
+        import json
+        with open(args.report_json, 'w') as f:
+            json.dump(report, f, indent=2)
 
 try:
-    for test in all_tests:
-        if isinstance(test, ODriveTest):
-            def odrv_test_thread(odrv_name):
-                odrv_ctx = odrives_by_name[odrv_name]
-                logger.notify('* running {} on {}...'.format(type(test).__name__, odrv_name))
-                try:
-                    test.check_preconditions(odrv_ctx,
-                              logger.indent('  {}: '.format(odrv_name)))
-                except:
-                    raise PreconditionsNotMet()
-                test.run_test(odrv_ctx,
-                              logger.indent('  {}: '.format(odrv_name)))
-
-            if test._exclusive:
-                for odrv in odrives_by_name:
-                    odrv_test_thread(odrv)
-            else:
-                for_all_parallel(odrives_by_name, lambda x: type(test).__name__ + " on " + x, odrv_test_thread)
-
-        elif isinstance(test, AxisTest):
-            def axis_test_thread(axis_name):
-                # Get all axes that are mechanically coupled with the axis specified by axis_name
-                conflicting_axes = sum([c for c in couplings if (axis_name in [a.name for a in c])], [])
-                # Remove duplicates
-                conflicting_axes = list(set(conflicting_axes))
-                # Acquire lock for all conflicting axes
-                conflicting_axes.sort(key=lambda x: x.name) # prevent deadlocks
-                axis_ctx = axes_by_name[axis_name]
-                for conflicting_axis in conflicting_axes:
-                    conflicting_axis.lock.acquire()
-                try:
-                    if not app_shutdown_token.is_set():
-                        # Run test on this axis
-                        logger.notify('* running {} on {}...'.format(type(test).__name__, axis_name))
-                        try:
-                            test.check_preconditions(axis_ctx,
-                                        logger.indent('  {}: '.format(axis_name)))
-                        except:
-                            raise PreconditionsNotMet()
-                        test.run_test(axis_ctx,
-                                    logger.indent('  {}: '.format(axis_name)))
-                    else:
-                        logger.warn('- skipping {} on {}'.format(type(test).__name__, axis_name))
-                except:
-                    app_shutdown_token.set()
-                    raise
-                finally:
-                    # Release all conflicting axes
-                    for conflicting_axis in conflicting_axes:
-                        conflicting_axis.lock.release()
-
-            for_all_parallel(axes_by_name, lambda x: type(test).__name__ + " on " + x, axis_test_thread)
-
-        elif isinstance(test, DualAxisTest):
-            def dual_axis_test_thread(coupling):
-                coupling_name = "...".join([a.name for a in coupling])
-                # Remove duplicates
-                coupled_axes = list(set(coupling))
-                # Acquire lock for all conflicting axes
-                coupled_axes.sort(key=lambda x: x.name) # prevent deadlocks
-                for axis_ctx in coupled_axes:
-                    axis_ctx.lock.acquire()
-                try:
-                    if not app_shutdown_token.is_set():
-                        # Run test on this axis
-                        logger.notify('* running {} on {}...'.format(type(test).__name__, coupling_name))
-                        try:
-                            test.check_preconditions(coupled_axes[0], coupled_axes[1],
-                                        logger.indent('  {}: '.format(coupling_name)))
-                        except:
-                            raise PreconditionsNotMet()
-                        test.run_test(coupled_axes[0], coupled_axes[1],
-                                    logger.indent('  {}: '.format(coupling_name)))
-                    else:
-                        logger.warn('- skipping {} on {}...'.format(type(test).__name__, coupling_name))
-                except:
-                    app_shutdown_token.set()
-                    raise
-                finally:
-                    # Release all conflicting axes
-                    for axis_ctx in coupled_axes:
-                        axis_ctx.lock.release()
-
-            for_all_parallel(couplings, lambda x: type(test).__name__ + " on " + "..".join([a.name for a in x]), dual_axis_test_thread)
-
-        else:
-            logger.warn("ignoring unknown test type {}".format(type(test)))
+    try:
+        scheduler.run()
+    finally:
+        write_report()
 
 except:
     logger.error(traceback.format_exc())